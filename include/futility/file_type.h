@@ -23,6 +23,11 @@ enum futil_file_type {
 
 	FILE_TYPE_CHROMIUMOS_DISK,		/* At least it has a GPT */
 	FILE_TYPE_PRIVKEY,			/* VbPrivateKey */
+	FILE_TYPE_VBSD,				/* VbSharedDataHeader */
+	FILE_TYPE_VB21_PUBKEY,			/* struct vb21_packed_key */
+	FILE_TYPE_VB21_KEYBLOCK,		/* struct vb21_keyblock */
+	FILE_TYPE_VB21_FW_PREAMBLE,		/* struct vb21_fw_preamble */
+	FILE_TYPE_VB21_SIGNATURE,		/* struct vb21_signature */
 
 	NUM_FILE_TYPES
 };
@@ -31,9 +36,10 @@ enum futil_file_type {
 const char * const futil_file_type_str(enum futil_file_type type);
 
 /*
- * This tries to match the buffer content to one of the known file types.
+ * This tries to match the buffer content to one of the known file types. It
+ * only goes by the shape of things, without checking any signatures.
  */
-enum futil_file_type futil_file_type_buf(uint8_t *buf, uint32_t len);
+enum futil_file_type futil_file_type_buf(uint8_t *buf, uint64_t len);
 
 /*
  * This opens a file and tries to match it to one of the known file types.
@@ -42,11 +48,40 @@ enum futil_file_type futil_file_type_buf(uint8_t *buf, uint32_t len);
 enum futil_file_err futil_file_type(const char *filename,
 				    enum futil_file_type *type);
 
+/*
+ * What the last look at a file found, which with futil_set_xattr_cache() is
+ * kept in its "user.futility.meta" extended attribute. The file's inode,
+ * size and mtime are kept with it, and it's ignored once they change.
+ */
+struct futil_file_meta_s {
+	enum futil_file_type type;
+	uint64_t fmap_offset;			/* or FUTIL_NO_FMAP */
+};
+
+struct stat;
+void futil_set_xattr_cache(int on);
+
+/*
+ * Gets what was kept for [fd], whose [sb] is as it was when we started
+ * reading it. Returns non-zero if nothing was, or it's out of date.
+ */
+int futil_meta_load(int fd, const struct stat *sb,
+		    struct futil_file_meta_s *meta);
+
+/* Keeps [meta] for [fd], if we're keeping things */
+void futil_meta_save(int fd, const struct stat *sb,
+		     const struct futil_file_meta_s *meta);
+
+/* The GPT header is in the second sector */
+#define DISK_SECTOR_SIZE 512
+
 /* Routines to identify particular file types. */
-enum futil_file_type recognize_bios_image(uint8_t *buf, uint32_t len);
-enum futil_file_type recognize_gbb(uint8_t *buf, uint32_t len);
-enum futil_file_type recognize_vblock1(uint8_t *buf, uint32_t len);
-enum futil_file_type recognize_gpt(uint8_t *buf, uint32_t len);
-enum futil_file_type recognize_privkey(uint8_t *buf, uint32_t len);
+enum futil_file_type recognize_bios_image(uint8_t *buf, uint64_t len);
+enum futil_file_type recognize_gbb(uint8_t *buf, uint64_t len);
+enum futil_file_type recognize_vblock1(uint8_t *buf, uint64_t len);
+enum futil_file_type recognize_gpt(uint8_t *buf, uint64_t len);
+enum futil_file_type recognize_privkey(uint8_t *buf, uint64_t len);
+enum futil_file_type recognize_vbsd(uint8_t *buf, uint64_t len);
+enum futil_file_type recognize_vb21(uint8_t *buf, uint64_t len);
 
 #endif	/* VBOOT_REFERENCE_FUTILITY_FILE_TYPE_H_ */
@@ -6,8 +6,12 @@
 #ifndef VBOOT_REFERENCE_FUTILITY_H_
 #define VBOOT_REFERENCE_FUTILITY_H_
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include "vboot_common.h"
+#include "gpt.h"
 #include "gbb_header.h"
 #include "host_key.h"
 
@@ -40,7 +44,7 @@ enum vboot_version  {
 };
 
 /* What's our preferred API & data format? */
-enum vboot_version vboot_version;
+extern enum vboot_version vboot_version;
 
 /* Here's a structure to define the commands that futility implements. */
 struct futil_cmd_t {
@@ -64,6 +68,37 @@ struct futil_cmd_t {
 /* This is the list of pointers to all commands. */
 extern const struct futil_cmd_t *const futil_cmds[];
 
+/* And a perfect hash of their names, for find_command() */
+#define FUTIL_CMD_SLOTS 32
+extern const uint32_t futil_cmd_hash_seed;
+extern const int8_t futil_cmd_slot[FUTIL_CMD_SLOTS];
+
+/* Look up a command by name, or return NULL */
+const struct futil_cmd_t *find_command(const char *name);
+
+/* Invoke a command, handling "CMD --help" */
+int run_command(const struct futil_cmd_t *cmd, int argc, char *argv[]);
+
+/* Keep the keys read by the sign command around for later invocations */
+void futil_sign_keep_keys(void);
+
+/*
+ * Drop the kept keys whose files have changed since they were read, or all
+ * of them if [all]. Only call it between commands.
+ */
+void futil_sign_refresh_keys(int all);
+
+/*
+ * Runs a command on the "futility serve" server listening on [path], as
+ * "serve --connect" does, and puts its exit status in [status]. Returns 0
+ * if the server answered, or else one of these.
+ */
+#define SERVE_BAD_REQUEST	1	/* no server could be sent it */
+#define SERVE_NOT_SENT		2	/* this one couldn't; it didn't run */
+#define SERVE_NO_REPLY		3	/* it may or may not have run */
+int futil_serve_request(const char *path, int argc, char *argv[],
+			int *status);
+
 /* Size of an array */
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(array) (sizeof(array)/sizeof(array[0]))
@@ -87,10 +122,18 @@ extern const struct futil_cmd_t *const futil_cmds[];
 	} while (0)
 #endif
 
-/* Debug output (off by default) */
+/*
+ * Debug output (off by default). Each thread gathers whole lines, tagged with
+ * its futil_thread_id() and futil_job_id(), and hands them to one thread
+ * that writes them to stderr, so busy threads don't wait on each other or
+ * on the terminal. Lines may come out a little after other stderr output.
+ */
 extern int debugging_enabled;
 void Debug(const char *format, ...);
 
+/* Sends VbExDebug() output, when VBOOT_DEBUG is on, the same way */
+void futil_debug_init(void);
+
 /* Returns true if this looks enough like a GBB header to proceed. */
 int futil_looks_like_gbb(GoogleBinaryBlockHeader *gbb, uint32_t len);
 
@@ -105,13 +148,37 @@ int futil_valid_gbb_header(GoogleBinaryBlockHeader *gbb, uint32_t len,
 void update_hwid_digest(GoogleBinaryBlockHeader *gbb);
 
 /* For GBB v1.2 and later, print the stored digest of the HWID (and whether
- * it's correct). Return true if it is correct. */
-int print_hwid_digest(GoogleBinaryBlockHeader *gbb,
+ * it's correct) to fp. Return true if it is correct. */
+int print_hwid_digest(FILE *fp, GoogleBinaryBlockHeader *gbb,
 		      const char *banner, const char *footer);
 
 /* Copies a file or dies with an error message */
 void futil_copy_file_or_die(const char *infile, const char *outfile);
 
+/*
+ * Has the kernel copy up to [len] bytes from [ifd] at [ioff] to [ofd] at
+ * [ooff], without passing them through our own buffers. Returns how many
+ * it copied, which is short at the end of the input and may be zero if the
+ * files (or the kernel) can't do this. The caller copies what's left.
+ */
+uint64_t futil_copy_range(int ifd, uint64_t ioff, int ofd, uint64_t ooff,
+			  uint64_t len);
+
+/*
+ * Writes all [len] bytes of [buf] to [fd] at [offset], leaving anything
+ * else there, holes included, as it was. Returns 0 on success.
+ */
+int futil_write_at(int fd, const void *buf, uint64_t len, uint64_t offset);
+
+/*
+ * For skipping the holes in sparse files: finds the first range of data in
+ * [fd] (whose size is [size]) at or after [offset], from [*data] up to the
+ * next hole at [*hole]. If the file system can't tell, it's all data. Moves
+ * the file offset. Returns nonzero if there's no more data.
+ */
+int futil_next_data(int fd, uint64_t offset, uint64_t size,
+		    uint64_t *data, uint64_t *hole);
+
 /* Possible file operation errors */
 enum futil_file_err {
 	FILE_ERR_NONE,
@@ -132,9 +199,388 @@ enum futil_file_err {
 #define MAP_RO 0
 #define MAP_RW 1
 enum futil_file_err futil_map_file(int fd, int writeable,
-				   uint8_t **buf, uint32_t *len);
+				   uint8_t **buf, uint64_t *len);
 enum futil_file_err futil_unmap_file(int fd, int writeable,
-				     uint8_t *buf, uint32_t len);
+				     uint8_t *buf, uint64_t len);
+
+/*
+ * A SPI flash, as a Linux MTD device (/dev/mtdN), is mapped by reading just
+ * the FMAP and the areas signing looks at (GBB, VBLOCK_A/B and FW_MAIN_A/B),
+ * a whole erase block at a time; the rest reads as 0xff. futil_map_file()
+ * does this for one, and futil_write_dirty() (see futil_write_flash()) only
+ * rewrites the blocks that changed. They can't be mapped MAP_RW.
+ *
+ * futil_is_flash() says whether [fd] is one. futil_unmap_flash() returns
+ * nonzero if [buf] wasn't mapped from one; with [keep], as for
+ * futil_unmap_input(), the next futil_map_flash() of it on this thread
+ * gets it back as it was rather than reading it again.
+ */
+int futil_is_flash(int fd);
+enum futil_file_err futil_map_flash(int fd, uint8_t **buf, uint64_t *len);
+int futil_unmap_flash(uint8_t *buf, int keep);
+
+/*
+ * Images compressed with xz, zstd or gzip can be read as if they weren't.
+ * futil_decompressor() returns the program that undoes whatever [buf] was
+ * compressed with, or NULL if it wasn't.
+ *
+ * futil_decompress_start() runs [prog] on all of [fd] and returns a pipe to
+ * read the result from, or -1 on error. futil_decompress_finish() closes the
+ * pipe and waits for [prog], stopping it first unless [all_read]. If all was
+ * read, it returns nonzero if [prog] failed.
+ */
+const char *futil_decompressor(const uint8_t *buf, uint64_t len);
+int futil_decompress_start(int fd, const char *prog, pid_t *pid);
+int futil_decompress_finish(int rfd, pid_t pid, const char *prog,
+			    int all_read);
+
+/*
+ * The same, for running any program ([argv] is its command line) on [fd].
+ * futil_filter_finish() only complains if it loses track of the program.
+ */
+int futil_filter_start(int fd, char *const argv[], pid_t *pid);
+int futil_filter_finish(int rfd, pid_t pid, const char *prog, int all_read);
+
+/*
+ * Like futil_map_file(fd, MAP_RO, ...), except that a compressed file gives
+ * what it decompresses to, in memory, and sets [*decompressed]. Writing that
+ * back to [fd] would be wrong, of course. futil_unmap_input() undoes it; with
+ * [keep], this thread holds on to a decompressed image until it's next asked
+ * to map the same (unchanged) file, rather than decompressing it again.
+ * A pipe is read to the end the same way (but not decompressed), and can be
+ * mapped again afterwards.
+ */
+/* Opens [filename] for reading, or stdin if it's "-" */
+int futil_open_input(const char *filename);
+
+enum futil_file_err futil_map_input(int fd, uint8_t **buf, uint64_t *len,
+				    int *decompressed);
+enum futil_file_err futil_unmap_input(int fd, uint8_t *buf, uint64_t len,
+				      int decompressed, int keep);
+
+/*
+ * Maps [object], which lives wherever [prog] can fetch it from, without
+ * reading any of it yet. Each part is fetched the first time it's touched,
+ * by running "[prog] [object] OFFSET LENGTH", which writes those bytes to
+ * stdout; "[prog] [object]" prints its size. futil_unmap_remote() returns
+ * an error if any fetch failed (those parts read as zeroes).
+ */
+enum futil_file_err futil_map_remote(const char *prog, const char *object,
+				     uint8_t **buf, uint64_t *len);
+enum futil_file_err futil_unmap_remote(uint8_t *buf, uint64_t len);
+
+/*
+ * An image too big to map whole (into a 32-bit address space, say, or a
+ * container with little memory) can be read a window at a time instead.
+ * futil_set_window() sets the most that's mapped at once, from a string
+ * like "256M" (--window or FUTILITY_WINDOW), and returns nonzero if it
+ * doesn't make sense. It's off on 64-bit hosts unless it's set.
+ *
+ * futil_window_wanted() says whether [fd] is bigger than that, so should
+ * be. futil_window_get() returns [len] bytes at [offset], which are only
+ * good until it's next called; [len] mustn't be more than the window, and
+ * futil_window_clamp() cuts it down to fit. It returns NULL if they can't
+ * be mapped, or are past the end. What the window has slid past is
+ * dropped from memory.
+ */
+struct futil_window_s {
+	int fd;
+	uint64_t len;			/* of the whole image */
+	uint8_t *map;			/* the part of it mapped now */
+	uint64_t map_offset, map_len;
+};
+
+int futil_set_window(const char *str);
+uint64_t futil_window_size(void);
+int futil_window_wanted(int fd);
+enum futil_file_err futil_window_open(struct futil_window_s *win, int fd);
+uint8_t *futil_window_get(struct futil_window_s *win, uint64_t offset,
+			  uint64_t len);
+uint64_t futil_window_clamp(uint64_t len);
+void futil_window_close(struct futil_window_s *win);
+
+/* Gets the size of [fd] too when it's a block device. Returns non-zero if
+ * it can't be stat()ed. */
+struct stat;
+int futil_fstat(int fd, struct stat *sb);
+
+/*
+ * Passes madvise() [advice] about [len] bytes at [buf], which needn't be
+ * page-aligned. It's only a hint, so errors are ignored.
+ */
+void futil_advise(const uint8_t *buf, uint64_t len, int advice);
+
+/* Returns true if both names refer to the same existing file */
+int futil_same_file(const char *a, const char *b);
+
+/*
+ * Splits a manifest line into at most [max] words, stopping at a '#'. The
+ * line is modified in place. Returns the number of words, or -1 if there
+ * are too many.
+ */
+int futil_split_line(char *line, char **argv, int max);
+
+/*
+ * Looks up a GPT partition type by its short name: kernel, rootfs, data, fs,
+ * reserved, efi or firmware. Returns 0 and fills in [guid] if it's one of
+ * them.
+ */
+int futil_gpt_type(const char *name, Guid *guid);
+
+/* Returns the short name of the partition type [guid], or NULL if none */
+const char *futil_gpt_type_name(const Guid *guid);
+
+/*
+ * Where a GPT goes: the PMBR, the primary header and its entries at the
+ * start of the disk, and the secondary entries and header at the end. These
+ * need cgptlib_internal.h.
+ */
+#define GPT_ENTRIES_SECTORS \
+	(MAX_NUMBER_OF_ENTRIES * sizeof(GptEntry) / DISK_SECTOR_SIZE)
+#define GPT_SECTORS (GPT_PMBR_SECTORS + GPT_HEADER_SECTORS + \
+		     GPT_ENTRIES_SECTORS)
+#define GPT_TAIL_SECTORS (GPT_ENTRIES_SECTORS + GPT_HEADER_SECTORS)
+
+/* Rounds [lba] up to a multiple of [align] sectors */
+uint64_t futil_align_lba(uint64_t lba, uint64_t align);
+
+/* Makes the random bytes in [guid] a random (version 4) UUID */
+void futil_make_uuid(Guid *guid);
+
+/*
+ * Finishes a GPT for a disk of [sectors] sectors, just as cgpt would make
+ * it. [gpt] holds the first GPT_SECTORS of the disk, with the partition
+ * entries already filled in; the PMBR and primary header are filled in
+ * here, with [disk_uuid]. The secondary entries and header, the last
+ * GPT_TAIL_SECTORS of the disk, go in [tail]. Returns GPT_SUCCESS, or the
+ * cgptlib error (see GptErrorText()) if the result isn't a valid GPT.
+ */
+int futil_make_gpt(uint8_t *gpt, uint8_t *tail, uint64_t sectors,
+		   const Guid *disk_uuid);
+
+/*
+ * Writes the [count] buffers in [iov], which get used up, out as a new file.
+ * An existing regular file is only replaced once the new one is complete,
+ * so it's never seen half written and is untouched on error.
+ */
+enum futil_file_err futil_write_iov(const char *outfile,
+				    struct iovec *iov, int count);
+
+/* Writes a buffer (usually a private mapping) out as a new file, as above */
+enum futil_file_err futil_write_file(const char *outfile,
+				     const uint8_t *buf, uint64_t len);
+
+/*
+ * Opens a commit group. Until futil_commit_end(), new files are left under
+ * their temporary names, and in-place changes that would be synced aren't
+ * yet. Every [size] of them are synced together, with one syncfs() for
+ * each filesystem, and the new files then renamed into place. So they're
+ * safe on disk at about the cost of not syncing at all.
+ */
+void futil_commit_begin(int size);
+
+/* Commits whatever's left. Returns the number of errors since the start. */
+int futil_commit_end(void);
+
+/*
+ * Starts a tar archive in [filename] ("-" for stdout). Until
+ * futil_archive_end(), futil_write_iov() adds each new file to it, under
+ * the name it was given, instead of writing it. Returns non-zero on error.
+ */
+int futil_archive_begin(const char *filename);
+int futil_archive_active(void);
+enum futil_file_err futil_archive_write(const char *name,
+					const struct iovec *iov, int count);
+
+/*
+ * Finishes the archive with a member called ".index" listing the others, a
+ * line each: the offset of its contents in the archive, its size and its
+ * name. With [sync], a regular file is synced too. Returns the number of
+ * errors.
+ */
+int futil_archive_end(int sync);
+
+/* Puts the SHA-256 of [filename] in [digest]. Returns non-zero on error. */
+int futil_file_sha256(const char *filename, uint8_t *digest);
+
+/*
+ * Opens the journal of a batch in [filename], which is made if it isn't
+ * there, and reads what it says was already done. Items are known by a
+ * SHA-256 [key] of whatever decides what they'd write. Returns non-zero on
+ * error.
+ */
+int futil_journal_open(const char *filename);
+
+/*
+ * Whether the item [key] was finished from an input with [in_digest]
+ * (unless it was done [in_place]), and [outfile] still holds what it wrote.
+ */
+int futil_journal_done(const uint8_t *key, const uint8_t *in_digest,
+		       const char *outfile, int in_place);
+
+/* Records that [key] is finished, with what's now in [outfile]. */
+int futil_journal_add(const uint8_t *key, const uint8_t *in_digest,
+		      const char *outfile);
+
+/* Closes the journal. Returns the number of errors since it was opened. */
+int futil_journal_close(void);
+
+/*
+ * Each thread keeps its own cache of converted RSA keys, so that checking
+ * lots of files signed by the same keys only converts them once. Threads
+ * other than the main one should free theirs before they exit.
+ */
+RSAKeyCache *futil_rsa_cache(void);
+void futil_rsa_cache_free(void);
+
+/*
+ * KeyBlockVerifyCached() with the signature checked by [key], remembering the
+ * answer for this thread so the same keyblock and key aren't checked again.
+ */
+int futil_keyblock_verify(const VbKeyBlockHeader *block, uint64_t size,
+			  const VbPublicKey *key);
+
+/*
+ * Start hashing [len] bytes of [buf], which holds the contents of
+ * [filename] at [offset], with the hash for [sig_algorithm], and leave the
+ * result in [ctx] to be finished or continued. If [cache_dir] is not NULL
+ * the hash state is looked up there first, and saved there if it wasn't.
+ * Entries are keyed by the file's device, inode, size, mtime and ctime,
+ * so modifying the file (including signing it in place) invalidates them.
+ */
+void futil_digest_region(const char *cache_dir, const char *filename,
+			 uint64_t offset, const uint8_t *buf, uint64_t len,
+			 int sig_algorithm, DigestContext *ctx);
+
+/*
+ * Also share the hash states of regions of 1 MB or more with other machines
+ * through [prog], which talks to a store keyed by their contents; see
+ * digest_cache.c for what it's asked. What the store says is trusted, so
+ * only use one that no-one else can write to.
+ */
+void futil_set_digest_remote(const char *prog);
+
+/*
+ * Whether futil_digest_region() would look for the hash of [len] bytes of
+ * [filename] in [cache_dir] or the --digest_remote store, rather than just
+ * make it.
+ */
+int futil_digest_region_stored(const char *cache_dir, const char *filename,
+			       uint64_t len);
+
+/*
+ * After futil_remember_signed_digests(), each body signature made with
+ * futil_signed_digest_add() is kept along with the [sig_algorithm] digest it
+ * was made from. futil_signed_digest_take() looks for a signature with the
+ * same bytes and size, and if it's there puts the digest (SHA512_DIGEST_SIZE
+ * bytes at most) in [digest], forgets it, and returns nonzero. This lets a
+ * verification straight after signing skip hashing the bodies again.
+ */
+void futil_remember_signed_digests(void);
+void futil_signed_digest_add(const VbSignature *sig, const uint8_t *digest,
+			     int sig_algorithm);
+int futil_signed_digest_take(const VbSignature *sig, uint8_t *digest);
+
+/*
+ * The outcome of verifying one file, with everything it printed, so that a
+ * cached result reads exactly the same as a fresh one.
+ */
+struct futil_verify_result_s {
+	int errorcnt;
+	char *out;
+	size_t out_len;
+	char *err;
+	size_t err_len;
+};
+
+/*
+ * Look up the result of verifying [filename], whose contents are the [len]
+ * bytes at [buf], in [cache_dir]. [context] is a SHA-256 digest of whatever
+ * else went into the result (the keys and options used). Entries are keyed
+ * like futil_digest_region()'s, plus a digest of the first and last 64 KB of
+ * the file, and each is signed with an HMAC key kept in [cache_dir]. Returns
+ * nonzero on a hit, in which case [result] must be freed with
+ * futil_verify_result_free().
+ */
+int futil_verify_cache_lookup(const char *cache_dir, const char *filename,
+			      const uint8_t *buf, uint64_t len,
+			      const uint8_t *context,
+			      struct futil_verify_result_s *result);
+
+/* Remember [result] for futil_verify_cache_lookup(). Errors are ignored. */
+void futil_verify_cache_store(const char *cache_dir, const char *filename,
+			      const uint8_t *buf, uint64_t len,
+			      const uint8_t *context,
+			      const struct futil_verify_result_s *result);
+
+void futil_verify_result_free(struct futil_verify_result_s *result);
+
+/* Returns "DIR/<hex of id>". Caller must free it. */
+char *futil_cache_path(const char *dir, const uint8_t *id, int id_len);
+
+/* Atomically replace a cache file. Returns nonzero on error. */
+int futil_cache_write(const char *path, const void *buf, size_t len);
+
+/*
+ * Sets how many threads futility may keep busy at once, from a string
+ * (--jobs or FUTILITY_JOBS). Returns nonzero if it isn't a sensible number.
+ */
+int futil_set_jobs(const char *str);
+
+/* Returns that, or the number of CPUs if it hasn't been set */
+int futil_jobs(void);
+
+/*
+ * Calls [func]([arg], i) for each i below [count], on up to [jobs] threads
+ * including this one (0 means futil_jobs()). The threads are shared by
+ * all of futility, so jobs that do this in turn only get what's spare and
+ * do the rest themselves. With more than one NUMA node, the threads are
+ * spread over them and each kept to its own. [thread_done]([arg]), if not
+ * NULL, is called by each thread that was started before it goes away, to
+ * free anything it kept.
+ */
+void futil_run_jobs(void (*func)(void *arg, uint32_t index),
+		    void (*thread_done)(void *arg), void *arg,
+		    uint32_t count, int jobs);
+
+/* Numbers the calling thread, from 1 in the order threads first ask */
+int futil_thread_id(void);
+
+/* The index of the job the calling thread is running, or -1 if none */
+int64_t futil_job_id(void);
+
+/*
+ * For threads started some other way: takes up to [want] of the spare ones
+ * and returns how many it got, which must each be given back with
+ * futil_jobs_release() when they're done.
+ */
+int futil_jobs_reserve(int want);
+void futil_jobs_release(int n);
+
+/*
+ * Sets how much memory the jobs in flight may take between them, from a
+ * string like "512M" (--mem_budget or FUTILITY_MEM_BUDGET). Returns nonzero
+ * if it doesn't make sense.
+ */
+int futil_set_mem_budget(const char *str);
+
+/*
+ * Reads a size like "512M" (K, M or G) into [size]. Returns nonzero if it
+ * isn't one, or is zero.
+ */
+int futil_parse_size(const char *str, uint64_t *size);
+
+/* Returns that, or half of the memory there is if it hasn't been set */
+uint64_t futil_mem_budget(void);
+
+/*
+ * A job about to take roughly [want] bytes waits here until there's room
+ * for it in the budget, rather than everyone running out together. Returns
+ * how much was taken (no more than the whole budget, so a job that's too
+ * big runs on its own), which must be given back with futil_mem_release().
+ */
+uint64_t futil_mem_reserve(uint64_t want);
+void futil_mem_release(uint64_t got);
 
 /* The CPU architecture is occasionally important */
 enum arch_t {
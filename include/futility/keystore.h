@@ -0,0 +1,57 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#ifndef VBOOT_REFERENCE_FUTILITY_KEYSTORE_H_
+#define VBOOT_REFERENCE_FUTILITY_KEYSTORE_H_
+
+#include <sys/stat.h>
+
+#include "file_type.h"
+
+/*
+ * A key store packs many .vbpubk and .keyblock files into one file, so
+ * signers can name a key as "STORE:ID" instead of keeping a file for each.
+ * ID is a hex prefix of the "Key sha1sum" shown for the key (for a keyblock,
+ * of its data key), long enough to pick out just one entry.
+ */
+
+/* Returns true if [spec] names a key in an existing key store */
+int futil_is_keystore_spec(const char *spec);
+
+/* Stats the key store [spec] names a key in. Returns nonzero on error. */
+int futil_keystore_stat(const char *spec, struct stat *sb);
+
+/*
+ * Returns a copy of the key named by [spec], which the caller must free, or
+ * NULL on error. If *[type] isn't FILE_TYPE_UNKNOWN only entries of that type
+ * are considered. On success *[type] is FILE_TYPE_PUBKEY or
+ * FILE_TYPE_KEYBLOCK.
+ */
+void *futil_keystore_read(const char *spec, enum futil_file_type *type);
+
+/* Writes the [count] key files in [files] into a new key store */
+int futil_keystore_create(const char *outfile, int count, char *files[]);
+
+/* Prints what a key store holds. Returns nonzero on error. */
+int futil_keystore_list(const char *storefile);
+
+/*
+ * An index of known keys by sha1sum, for telling which of them an image
+ * carries or was signed by. [path] is a key store, or a directory of .vbpubk
+ * and .keyblock files (a keyblock stands for its data key). Returns NULL on
+ * error. Lookups don't change it, so threads can share it.
+ */
+struct futil_known_keys;
+struct futil_known_keys *futil_known_keys_load(const char *path);
+void futil_known_keys_free(struct futil_known_keys *known);
+
+/*
+ * Returns the name of the known key that's the same as [key] (its file, or
+ * STORE:ID for a key store), or NULL if there isn't one.
+ */
+const char *futil_known_key_name(const struct futil_known_keys *known,
+				 VbPublicKey *key);
+
+#endif	/* VBOOT_REFERENCE_FUTILITY_KEYSTORE_H_ */
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#ifndef VBOOT_REFERENCE_FUTILITY_LIBFUTILITY_H_
+#define VBOOT_REFERENCE_FUTILITY_LIBFUTILITY_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include "futility.h"
+
+/*
+ * Signing and verifying for programs that already hold the images in memory,
+ * without going through files or the command line. Build libfutility.a
+ * ("make lib") and link with -lfutility -lcrypto -lpthread.
+ *
+ * Keys can be loaded from memory too: a .keyblock or .vbpubk file's contents
+ * can be used as they are, and PrivateKeyReadBuf() parses a .vbprivk.
+ */
+
+/* The keys to sign with */
+struct futil_sign_keys {
+	VbPrivateKey *signprivate;
+	/* Required for a new partition; a resigned one keeps its own if NULL */
+	VbKeyBlockHeader *keyblock;
+};
+
+/* How to sign. Everything here means what it does for "futility sign". */
+struct futil_sign_opts {
+	/* For a new partition these are required */
+	enum arch_t arch;
+	uint8_t *bootloader_data;
+	uint64_t bootloader_size;
+	/*
+	 * The kernel command line, as ReadConfigFile() returns it. Required
+	 * for a new partition; a resigned one keeps its own if NULL.
+	 */
+	uint8_t *config_data;
+	uint64_t config_size;
+	/* A resigned partition keeps its own unless these are set */
+	uint32_t version;
+	int version_specified;
+	uint32_t flags;
+	int flags_specified;
+	/* Zero for the defaults */
+	uint32_t kloadaddr;
+	uint32_t padding;
+	/* Leave the kernel blob out of the result */
+	int vblockonly;
+};
+
+/*
+ * Signs the kernel in [buf]. If it's a kernel partition (vblock and blob) it
+ * is resigned, otherwise it's taken to be a vmlinuz to pack into a new one.
+ * [buf] isn't changed. On success, [out][0] is the new vblock and [out][1]
+ * the kernel blob (empty with vblockonly), which together make up the signed
+ * partition, and zero is returned. The caller must free() both iov_bases.
+ * On error, nonzero is returned, nothing needs freeing, and the reason has
+ * been printed to stderr.
+ */
+int futil_sign_kernel(const uint8_t *buf, uint64_t len,
+		      const struct futil_sign_keys *keys,
+		      const struct futil_sign_opts *opts,
+		      struct iovec out[2]);
+
+/*
+ * Checks all the signatures in [buf], which can be anything "futility verify"
+ * understands. [key], if not NULL, is used as it is for "futility verify -k".
+ * What "futility verify" would print is written to [report], if it isn't
+ * NULL. Returns zero if everything is good. Calls to this must not overlap.
+ */
+int futil_verify(const uint8_t *buf, uint64_t len, VbPublicKey *key,
+		 FILE *report);
+
+#endif	/* VBOOT_REFERENCE_FUTILITY_LIBFUTILITY_H_ */
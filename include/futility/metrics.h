@@ -0,0 +1,73 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#ifndef VBOOT_REFERENCE_FUTILITY_METRICS_H_
+#define VBOOT_REFERENCE_FUTILITY_METRICS_H_
+#include <stdint.h>
+
+/*
+ * Counters for a long-running server, published in the Prometheus text
+ * format. Each thread counts into a block of its own, so counting never
+ * waits for another thread; the blocks are only added up when the metrics
+ * are written out.
+ */
+enum futil_metric {
+	METRIC_DIGEST_CACHE_HIT,
+	METRIC_DIGEST_CACHE_MISS,
+	METRIC_VERIFY_CACHE_HIT,
+	METRIC_VERIFY_CACHE_MISS,
+	METRIC_KEYBLOCK_MEMO_HIT,
+	METRIC_KEYBLOCK_MEMO_MISS,
+
+	NUM_METRICS
+};
+
+/* What the server was asked to do */
+enum futil_metric_op {
+	METRIC_OP_SIGN,
+	METRIC_OP_VERIFY,
+	METRIC_OP_OTHER,
+
+	NUM_METRIC_OPS
+};
+
+/* Nonzero once futil_metrics_start() has been called */
+extern int futil_metrics_enabled;
+
+/*
+ * Starts counting. The metrics are rewritten to [file] whenever
+ * futil_metrics_update() is called, and sent to anyone who connects to the
+ * Unix socket [socket_path]; either may be NULL. Returns nonzero on error.
+ */
+int futil_metrics_start(const char *file, const char *socket_path);
+
+/* Writes the file one last time, and stops listening */
+void futil_metrics_stop(void);
+
+/* Rewrites the file, if there is one */
+void futil_metrics_update(void);
+
+/* Threads other than the one that called futil_metrics_start() call this */
+void futil_metrics_thread_begin(void);
+
+void futil_metrics_add(enum futil_metric metric, uint64_t n);
+
+/* Counts a request for [op] that took [ns] and ended with [status] */
+void futil_metrics_request(enum futil_metric_op op, int status, uint64_t ns);
+
+/* These do nothing unless counting */
+static inline void futil_metrics_count(enum futil_metric metric)
+{
+	if (futil_metrics_enabled)
+		futil_metrics_add(metric, 1);
+}
+
+static inline void futil_metrics_thread(void)
+{
+	if (futil_metrics_enabled)
+		futil_metrics_thread_begin();
+}
+
+#endif	/* VBOOT_REFERENCE_FUTILITY_METRICS_H_ */
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#ifndef VBOOT_REFERENCE_FUTILITY_SERVE_H_
+#define VBOOT_REFERENCE_FUTILITY_SERVE_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The protocol is deliberately dumb. The client connects and sends a
+ * struct serve_request_s, followed by "size" bytes holding "argc"
+ * NUL-terminated arguments (argv[0] is the command name). Attached to the
+ * request header (as SCM_RIGHTS) are the client's current directory, its
+ * stdout and its stderr, followed by one descriptor for each argument of
+ * the form "/dev/fd/N", in the order they appear. The server runs the
+ * command with those in place and answers with a struct serve_reply_s.
+ *
+ * The server is "futility serve", in cmd_serve.c. The client is
+ * futil_serve_request(), in serve.c, which sign --batch --node calls too,
+ * so it's part of libfutility.
+ */
+#define SERVE_MAGIC 0x76727366			/* "fsrv" */
+
+struct serve_request_s {
+	uint32_t magic;
+	uint32_t argc;
+	uint32_t size;
+};
+
+struct serve_reply_s {
+	uint32_t magic;
+	int32_t status;
+};
+
+#define SERVE_FD_CWD	0
+#define SERVE_FD_STDOUT	1
+#define SERVE_FD_STDERR	2
+#define SERVE_FD_ARGS	3
+
+#define SERVE_MAX_FDS	16
+#define SERVE_MAX_ARGS	128
+#define SERVE_MAX_SIZE	(64 * 1024)
+
+#define FD_PREFIX "/dev/fd/"
+
+/* Is [arg] of the form "/dev/fd/N"? */
+int serve_is_fd_arg(const char *arg);
+
+/* Read or write all of [buf] on the socket [fd], or return nonzero */
+int serve_read_all(int fd, void *buf, size_t len);
+int serve_write_all(int fd, const void *buf, size_t len);
+
+#endif	/* VBOOT_REFERENCE_FUTILITY_SERVE_H_ */
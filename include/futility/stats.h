@@ -0,0 +1,89 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#ifndef VBOOT_REFERENCE_FUTILITY_STATS_H_
+#define VBOOT_REFERENCE_FUTILITY_STATS_H_
+#include <stdint.h>
+
+#include "file_type.h"
+#include "traversal.h"
+
+/*
+ * Timers for the phases of a command. Each use of one adds its elapsed time
+ * and byte count to a running total, and, when tracing, is remembered as a
+ * separate event. The cryptolib counters (bytes hashed, RSA operations) are
+ * collected alongside them.
+ */
+enum futil_stat {
+	STAT_COMMAND,
+	STAT_MAP,
+	STAT_RECOGNIZE,
+	STAT_TRAVERSE,
+	STAT_WRITE_BACK,
+	/* One for each component that invoke_callback() handles */
+	STAT_CALLBACK,
+
+	NUM_STATS = STAT_CALLBACK + NUM_CB_COMPONENTS
+};
+
+/* Nonzero once futil_stats_start() has been called */
+extern int futil_stats_enabled;
+
+/*
+ * Starts collecting, and arranges for the results to be reported at exit:
+ * as a summary on stderr, or if [trace_file] isn't NULL, as Chrome trace
+ * JSON (see chrome://tracing) written there. Returns nonzero on error.
+ */
+int futil_stats_start(const char *trace_file);
+
+/* Monotonic time in nanoseconds */
+uint64_t futil_stats_now(void);
+
+/*
+ * Adds an event that began at [start] and ended now. [detail] names it in
+ * the trace, and must be a string that outlives the process (or NULL).
+ */
+void futil_stats_add(enum futil_stat stat, const char *detail,
+		     uint64_t start, uint64_t bytes);
+
+/* These only look at the clock when collecting */
+static inline uint64_t futil_stats_begin(void)
+{
+	return futil_stats_enabled ? futil_stats_now() : 0;
+}
+
+static inline void futil_stats_end(enum futil_stat stat, const char *detail,
+				   uint64_t start, uint64_t bytes)
+{
+	if (futil_stats_enabled)
+		futil_stats_add(stat, detail, start, bytes);
+}
+
+/*
+ * Budgets, to catch a change that quietly costs more: a new allocation in a
+ * loop, say, or another pass over the file. futil_budget_load() reads limits
+ * from [filename], one "COMMAND COUNTER MAX" per line ("*" for any command,
+ * "#" for a comment). The counters are:
+ *
+ *   allocs        VbExMalloc() calls
+ *   maps          images mapped (or read in) whole
+ *   reads         read syscalls, of any kind, from /proc/self/io
+ *   writes        write syscalls, the same
+ *   read_bytes    bytes those read, and write_bytes, bytes they wrote
+ *   digest_bytes  bytes hashed by cryptolib
+ *   rsa_verify    signatures checked
+ *   rsa_sign      signatures made
+ *
+ * The counts are for the whole process, so one command at a time is what
+ * makes sense. futil_budget_begin() starts counting again, and
+ * futil_budget_check() says (on stderr) which limits for [cmd] the counts
+ * since then are over, returning nonzero if any are. Without budgets, they
+ * do nothing.
+ */
+int futil_budget_load(const char *filename);
+void futil_budget_begin(void);
+int futil_budget_check(const char *cmd);
+
+#endif	/* VBOOT_REFERENCE_FUTILITY_STATS_H_ */
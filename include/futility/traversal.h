@@ -6,12 +6,20 @@
 #ifndef VBOOT_REFERENCE_FUTILITY_TRAVERSAL_H_
 #define VBOOT_REFERENCE_FUTILITY_TRAVERSAL_H_
 #include <stdint.h>
+#include <stdio.h>
+
+#include "cbfs.h"
+#include "fmap.h"
 
 
 /* What are we trying to accomplish? */
 enum futil_op_type {
 	FUTIL_OP_SHOW,
 	FUTIL_OP_SIGN,
+	/* Only the cheap checks, to rule things out before the costly ones */
+	FUTIL_OP_TRIAGE,
+	/* Whether a disk image's kernels chain up to a BIOS image's keys */
+	FUTIL_OP_VERIFY_CHAIN,
 
 	NUM_FUTIL_OPS
 };
@@ -27,6 +35,8 @@ enum futil_cb_component {
 	CB_FMAP_VBLOCK_B,
 	CB_FMAP_FW_MAIN_A,
 	CB_FMAP_FW_MAIN_B,
+	/* each kernel partition within a disk image */
+	CB_GPT_KERNEL,
 	/* individual files (extracted from a bios, for example) */
 	CB_PUBKEY,
 	CB_KEYBLOCK,
@@ -36,33 +46,76 @@ enum futil_cb_component {
 	CB_RAW_FIRMWARE,
 	CB_RAW_KERNEL,
 	CB_PRIVKEY,
+	CB_VBSD,
+	CB_VB21_PUBKEY,
+	CB_VB21_KEYBLOCK,
+	CB_VB21_FW_PREAMBLE,
+	CB_VB21_SIGNATURE,
+	/* each file within a CBFS area, see futil_traverse_cbfs() */
+	CB_CBFS_FILE,
 
 	NUM_CB_COMPONENTS
 };
 
+/* Names for each of those, for debugging and stats */
+extern const char * const futil_cb_component_str[NUM_CB_COMPONENTS];
+
 /* Where is the component we're poking at? */
 struct cb_area_s {
-	uint32_t offset;			/* to avoid pointer math */
+	uint64_t offset;			/* to avoid pointer math */
 	uint8_t *buf;
-	uint32_t len;
+	uint64_t len;
 	uint32_t _flags;			/* for callback use */
+	CbfsIndex *cbfs;			/* see futil_cbfs_index() */
+};
+
+/* A range of bytes within the buffer */
+struct cb_range_s {
+	uint64_t offset;
+	uint64_t len;
 };
 
+/* How many separate modified ranges to track before merging them */
+#define MAX_DIRTY_RANGES 8
+
 /* What do we know at this point in time? */
 struct futil_traverse_state_s {
-	/* These two should be initialized by the caller as needed */
+	/* These should be initialized by the caller as needed */
 	const char *in_filename;
 	enum futil_op_type op;
+	/* Per-job settings for the callbacks, which know what it points to */
+	void *cb_data;
 	/* Current activity during traversal */
 	enum futil_cb_component component;
 	struct cb_area_s *my_area;
 	const char *name;
-	/* Other activites, possibly before or after the current one */
+	/*
+	 * Other activites, possibly before or after the current one. For a
+	 * BIOS image, where each area is is filled in before any callbacks
+	 * run, but only the callback for an area sets its _flags.
+	 */
 	struct cb_area_s cb_area[NUM_CB_COMPONENTS];
 	struct cb_area_s recovery_key;
 	struct cb_area_s rootkey;
 	enum futil_file_type in_type;
 	int errors;
+	/* GPT partition number (from 1) of the current CB_GPT_KERNEL */
+	uint32_t partition;
+	/*
+	 * How big that whole partition is. With vblock_only, set by
+	 * futil_traverse_disk(), its area is just the keyblock and preamble,
+	 * and the rest is left in [fd] for a callback that wants it.
+	 */
+	uint64_t part_len;
+	int vblock_only;
+	int fd;
+	/* The current CB_CBFS_FILE, and the name of the area it's in */
+	const CbfsEntry *cbfs_file;
+	const char *cbfs_area;
+
+	/* Parts of the buffer that the callbacks have modified */
+	struct cb_range_s dirty[MAX_DIRTY_RANGES];
+	int num_dirty;
 };
 
 
@@ -70,10 +123,108 @@ struct futil_traverse_state_s {
  * Traverse the buffer using the provided state, which should be initialized
  * before calling. Returns nonzero (but no details) if there were any errors.
  */
-int futil_traverse(uint8_t *buf, uint32_t len,
+int futil_traverse(uint8_t *buf, uint64_t len,
 		   struct futil_traverse_state_s *state,
 		   enum futil_file_type type_hint);
 
+/*
+ * The same for an image read through [win] instead of mapped, which only
+ * works for disk images: the GPT and each kernel partition are read in turn.
+ * The begin and end callbacks get no buffer.
+ */
+struct futil_window_s;
+int futil_traverse_window(struct futil_window_s *win,
+			  struct futil_traverse_state_s *state);
+
+/*
+ * The same for a disk image that's [len] bytes of [fd], which isn't mapped
+ * at all: the GPT and then just the vblock of each kernel partition are read
+ * with pread(). If the op allows it, the partitions' callbacks all run at
+ * once, so that any reading of the rest they do goes in parallel too.
+ */
+int futil_traverse_disk(int fd, uint64_t len,
+			struct futil_traverse_state_s *state);
+
+/*
+ * Return the FMAP index for the buffer, or NULL if it hasn't got one. This is
+ * cached, so it's cheap to call again for the same buffer. Forget it before
+ * the buffer is unmapped or reused.
+ */
+FmapIndex *futil_fmap_index(uint8_t *buf, uint64_t len);
+void futil_fmap_index_forget(uint8_t *buf);
+
+/*
+ * Says where the FMAP of [buf] probably is, so that the index made for it
+ * next needn't search. futil_fmap_offset() says where it was found, if the
+ * index for [buf] has been made, or returns FUTIL_NO_FMAP.
+ */
+#define FUTIL_NO_FMAP UINT64_MAX
+void futil_fmap_hint(uint8_t *buf, uint64_t offset);
+uint64_t futil_fmap_offset(uint8_t *buf);
+
+/*
+ * Callbacks use this to start reading in an area they'll want soon, such as
+ * a firmware body that's going to be hashed, while they get on with something
+ * else. It does nothing for an area the traversal hasn't found.
+ */
+void futil_prefetch_area(struct futil_traverse_state_s *state,
+			 enum futil_cb_component c);
+
+/*
+ * The CBFS files in area [c] of the image, or NULL if it has none. The area
+ * is only parsed the first time this is asked; after that, files are looked
+ * up by name in constant time with cbfs_index_find(). The index lasts until
+ * the traversal ends.
+ */
+const CbfsIndex *futil_cbfs_index(struct futil_traverse_state_s *state,
+				  enum futil_cb_component c);
+
+/*
+ * Invoke the CB_CBFS_FILE callback for each file in area [c], which is
+ * called [area_name]. Each sees the file's contents as its own area, in place
+ * in the image, and the file itself as cbfs_file. Returns nonzero if any
+ * callback did. The state is as it was when it returns.
+ */
+int futil_traverse_cbfs(struct futil_traverse_state_s *state,
+			enum futil_cb_component c, const char *area_name);
+
+/* Callbacks use this to note which parts of the buffer they've changed */
+void futil_mark_dirty(struct futil_traverse_state_s *state,
+		      uint64_t offset, uint64_t len);
+
+/*
+ * Write just the modified parts of buf back to fd, and maybe wait for them
+ * to reach the disk. Returns nonzero on error.
+ */
+int futil_write_dirty(int fd, const uint8_t *buf,
+		      const struct futil_traverse_state_s *state, int sync);
+
+/*
+ * What futil_write_dirty() does for a flash device: erases and programs each
+ * erase block with a dirty range in it, if it's really different from what's
+ * there. Those all have to have been read when it was mapped.
+ */
+int futil_write_flash(int fd, const uint8_t *buf,
+		      const struct futil_traverse_state_s *state);
+
+/*
+ * Prepares the show callbacks for a caller other than the show command: the
+ * default options, with output going to [out] and errors to [err]. [key],
+ * if not NULL, is used for validation like "show -k". If [strict] is set,
+ * bad signatures are errors, as with "futility verify".
+ */
+void futil_show_init(FILE *out, FILE *err, VbPublicKey *key, int strict);
+
+/*
+ * For show callbacks that futil_traverse() runs on a thread of its own: the
+ * output on that thread goes to [out] and [err] between begin and end, and
+ * is then passed by futil_show_flush() to the traversing thread's output.
+ */
+void futil_show_thread_begin(FILE *out, FILE *err);
+void futil_show_thread_end(void);
+void futil_show_flush(const char *out, size_t out_len,
+		      const char *err, size_t err_len);
+
 /* These are invoked by the traversal. They also return nonzero on error. */
 int futil_cb_show_begin(struct futil_traverse_state_s *state);
 int futil_cb_show_pubkey(struct futil_traverse_state_s *state);
@@ -83,12 +234,27 @@ int futil_cb_show_fw_main(struct futil_traverse_state_s *state);
 int futil_cb_show_fw_preamble(struct futil_traverse_state_s *state);
 int futil_cb_show_kernel_preamble(struct futil_traverse_state_s *state);
 int futil_cb_show_privkey(struct futil_traverse_state_s *state);
+int futil_cb_show_vbsd(struct futil_traverse_state_s *state);
+int futil_cb_show_cbfs_file(struct futil_traverse_state_s *state);
+int futil_cb_show_vb21_pubkey(struct futil_traverse_state_s *state);
+int futil_cb_show_vb21_keyblock(struct futil_traverse_state_s *state);
+int futil_cb_show_vb21_fw_preamble(struct futil_traverse_state_s *state);
+int futil_cb_show_vb21_signature(struct futil_traverse_state_s *state);
+
+int futil_cb_triage_keyblock(struct futil_traverse_state_s *state);
+int futil_cb_triage_fw_preamble(struct futil_traverse_state_s *state);
+int futil_cb_triage_kernel_preamble(struct futil_traverse_state_s *state);
+
+int futil_cb_chain_gbb(struct futil_traverse_state_s *state);
+int futil_cb_chain_fw_vblock(struct futil_traverse_state_s *state);
+int futil_cb_chain_kernel(struct futil_traverse_state_s *state);
 
 int futil_cb_sign_pubkey(struct futil_traverse_state_s *state);
 int futil_cb_sign_fw_main(struct futil_traverse_state_s *state);
 int futil_cb_sign_fw_vblock(struct futil_traverse_state_s *state);
 int futil_cb_sign_raw_firmware(struct futil_traverse_state_s *state);
 int futil_cb_resign_kernel_part(struct futil_traverse_state_s *state);
+int futil_cb_sign_gpt_kernel(struct futil_traverse_state_s *state);
 int futil_cb_create_kernel_part(struct futil_traverse_state_s *state);
 int futil_cb_sign_begin(struct futil_traverse_state_s *state);
 int futil_cb_sign_end(struct futil_traverse_state_s *state);
@@ -8,37 +8,161 @@
 
 uint8_t *ReadConfigFile(const char *config_file, uint64_t *config_size);
 
-uint8_t *CreateKernelBlob(uint8_t *vmlinuz_buf, uint64_t vmlinuz_size,
+/*
+ * Where the parts of one kernel blob are. UnpackKPart() and CreateKernelBlob()
+ * fill this in, and the functions that take it after that use what they
+ * found, so each blob being worked on needs its own. Zero it to start.
+ */
+struct kernel_blob_ctx_s {
+	/* The keyblock, preamble, and kernel blob are in separate places */
+	VbKeyBlockHeader *keyblock;
+	VbKernelPreambleHeader *preamble;
+	uint8_t *kernel_blob_data;
+	uint64_t kernel_blob_size;
+
+	/* These refer to individual parts within the kernel blob */
+	uint8_t *kernel_data;
+	uint64_t kernel_size;
+	uint8_t *config_data;
+	uint64_t config_size;
+	uint8_t *param_data;
+	uint64_t param_size;
+	uint8_t *bootloader_data;
+	uint64_t bootloader_size;
+	uint8_t *vmlinuz_header_data;
+	uint64_t vmlinuz_header_size;
+
+	uint64_t ondisk_bootloader_addr;
+	uint64_t ondisk_vmlinuz_header_addr;
+};
+
+uint8_t *CreateKernelBlob(struct kernel_blob_ctx_s *kb,
+			  uint8_t *vmlinuz_buf, uint64_t vmlinuz_size,
 			  enum arch_t arch, uint64_t kernel_body_load_address,
 			  uint8_t *config_data, uint64_t config_size,
 			  uint8_t *bootloader_data, uint64_t bootloader_size,
 			  uint64_t *blob_size_ptr);
 
-uint8_t *SignKernelBlob(uint8_t *kernel_blob, uint64_t kernel_size,
+uint8_t *SignKernelBlob(struct kernel_blob_ctx_s *kb,
+			uint8_t *kernel_blob, uint64_t kernel_size,
 			uint64_t padding,
 			int version, uint64_t kernel_body_load_address,
 			VbKeyBlockHeader *keyblock, VbPrivateKey *signpriv_key,
 			uint32_t flags, uint64_t *vblock_size_ptr);
 
+/*
+ * Create, sign and write out a kernel partition (or just its vblock) in one
+ * go. This gives the same result as CreateKernelBlob(), SignKernelBlob() and
+ * WriteSomeParts(), but the blob is hashed and written piece by piece from
+ * the buffers passed in, so it's never held in memory. [vmlinuz_buf] must
+ * not be a mapping of [outfile]. If [digest_cache] and [vmlinuz_file] are
+ * given, the hash of the kernel proper may come from futil_digest_region().
+ * Returns zero on success.
+ */
+int WriteKernelPart(const char *outfile,
+		    uint8_t *vmlinuz_buf, uint64_t vmlinuz_size,
+		    enum arch_t arch, uint64_t kernel_body_load_address,
+		    uint8_t *config_data, uint64_t config_size,
+		    uint8_t *bootloader_data, uint64_t bootloader_size,
+		    uint64_t padding, int version,
+		    VbKeyBlockHeader *keyblock, VbPrivateKey *signpriv_key,
+		    uint32_t flags, int vblockonly,
+		    const char *digest_cache, const char *vmlinuz_file);
+
 int WriteSomeParts(const char *outfile,
 		   void *part1_data, uint64_t part1_size,
 		   void *part2_data, uint64_t part2_size);
 
-uint8_t *UnpackKPart(uint8_t *kpart_data, uint64_t kpart_size,
+uint8_t *UnpackKPart(struct kernel_blob_ctx_s *kb,
+		     uint8_t *kpart_data, uint64_t kpart_size,
 		     uint64_t padding,
 		     VbKeyBlockHeader **keyblock_ptr,
 		     VbKernelPreambleHeader **preamble_ptr,
 		     uint64_t *blob_size_ptr);
 
-int UpdateKernelBlobConfig(uint8_t *kblob_data, uint64_t kblob_size,
+int UpdateKernelBlobConfig(struct kernel_blob_ctx_s *kb,
+			   uint8_t *kblob_data, uint64_t kblob_size,
 			   uint8_t *config_data, uint64_t config_size);
 
-int VerifyKernelBlob(uint8_t *kernel_blob,
+/*
+ * For a blob just unpacked by UnpackKPart(), replace the config (if
+ * [config_data] is given) and sign the result, as UpdateKernelBlobConfig()
+ * and SignKernelBlob() would. If [cache_dir] is given, the hash state of
+ * everything in front of the config is kept there, keyed by the body
+ * signature it produced, so the next resign of that blob only hashes the
+ * config and what follows it. An entry is only used if, combined with the
+ * rest of the blob, it reproduces the existing body signature. Note that
+ * the kernel itself is not rehashed: if it was altered without resigning,
+ * the new signature still covers the originally signed kernel, so the
+ * result won't verify. Entries can be deleted at any time.
+ */
+uint8_t *ResignKernelBlob(struct kernel_blob_ctx_s *kb,
+			  uint8_t *kblob_data, uint64_t kblob_size,
+			  uint8_t *config_data, uint64_t config_size,
+			  const char *cache_dir, uint64_t padding,
+			  int version, uint64_t kernel_body_load_address,
+			  VbKeyBlockHeader *keyblock, VbPrivateKey *signpriv_key,
+			  uint32_t flags, uint64_t *vblock_size_ptr);
+
+/*
+ * Like ResignKernelBlob() with no new config, for a blob that UnpackKPart()
+ * found in just the vblock of a kernel partition still on disk at [fd]. The
+ * [body_size] bytes of body at [body_offset] are hashed as they're read, so
+ * they never need to be in memory.
+ */
+uint8_t *ResignKernelPartFd(struct kernel_blob_ctx_s *kb, int fd,
+			    uint64_t body_offset, uint64_t body_size,
+			    uint64_t padding, int version,
+			    uint64_t kernel_body_load_address,
+			    VbKeyBlockHeader *keyblock,
+			    VbPrivateKey *signpriv_key,
+			    uint32_t flags, uint64_t *vblock_size_ptr);
+
+/*
+ * Like ResignKernelPartFd(), but the body isn't read at all. Once the
+ * keyblock that UnpackKPart() found checks out against [trusted_key] (the
+ * old kernel subkey, say, when rotating keys) and the preamble against that
+ * keyblock, the digest the body signature was made from is recovered from
+ * it and signed again. The preamble's body size has to be within the
+ * [body_avail] bytes that follow the vblock. Returns NULL if any of that
+ * fails, or if the new key hashes differently, so the caller can rehash
+ * the body instead.
+ */
+uint8_t *ResignKernelRecovered(struct kernel_blob_ctx_s *kb,
+			       uint64_t body_avail,
+			       const VbPublicKey *trusted_key,
+			       uint64_t padding, int version,
+			       uint64_t kernel_body_load_address,
+			       VbKeyBlockHeader *keyblock,
+			       VbPrivateKey *signpriv_key,
+			       uint32_t flags, uint64_t *vblock_size_ptr);
+
+int VerifyKernelBlob(struct kernel_blob_ctx_s *kb,
+		     uint8_t *kernel_blob,
 		     uint64_t kernel_size,
 		     VbPublicKey *signpub_key,
 		     const char *keyblock_outfile,
 		     uint64_t min_version);
 
+/*
+ * Like VerifyKernelBlob(), but for a kernel partition still on disk. Only the
+ * vblock ([padding] bytes) is held in memory; the body is hashed as it is
+ * read, so this works on a whole block device without reading it all in.
+ */
+int VerifyKernelPartFile(const char *filename, uint64_t padding,
+			 VbPublicKey *signpub_key,
+			 const char *keyblock_outfile,
+			 uint64_t min_version);
+
 uint64_t KernelCmdLineOffset(VbKernelPreambleHeader *preamble);
 
+/*
+ * Check everything about a preamble of [size] bytes that can be checked
+ * without its signature, which makes them cheap. Nonzero if it looks okay.
+ */
+int FirmwarePreambleLooksOkay(const VbFirmwarePreambleHeader *preamble,
+			      uint64_t size);
+int KernelPreambleLooksOkay(const VbKernelPreambleHeader *preamble,
+			    uint64_t size);
+
 #endif	/* VBOOT_REFERENCE_FUTILITY_VB1_HELPER_H_ */
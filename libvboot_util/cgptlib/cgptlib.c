@@ -17,8 +17,18 @@ int GptInit(GptData *gpt)
 	int retval;
 
 	gpt->modified = 0;
+	gpt->modified_entries_start = gpt->modified_entries_end = 0;
 	gpt->current_kernel = CGPT_KERNEL_ENTRY_NOT_FOUND;
 	gpt->current_priority = 999;
+	gpt->num_kernels = 0;
+
+	/* Already checked and repaired when it was cached */
+	if (gpt->flags & GPT_FLAG_VALIDATED) {
+		gpt->valid_headers = MASK_BOTH;
+		gpt->valid_entries = MASK_BOTH;
+		GptSortKernelEntries(gpt);
+		return GPT_SUCCESS;
+	}
 
 	retval = GptSanityCheck(gpt);
 	if (GPT_SUCCESS != retval) {
@@ -27,86 +37,54 @@ int GptInit(GptData *gpt)
 	}
 
 	GptRepair(gpt);
+	GptSortKernelEntries(gpt);
 	return GPT_SUCCESS;
 }
 
 int GptNextKernelEntry(GptData *gpt, uint64_t *start_sector, uint64_t *size)
 {
-	GptHeader *header = (GptHeader *)gpt->primary_header;
 	GptEntry *entries = (GptEntry *)gpt->primary_entries;
+	uint32_t lo = 0, hi = gpt->num_kernels, mid;
 	GptEntry *e;
-	int new_kernel = CGPT_KERNEL_ENTRY_NOT_FOUND;
-	int new_prio = 0;
-	uint32_t i;
-
-	/*
-	 * If we already found a kernel, continue the scan at the current
-	 * kernel's priority, in case there is another kernel with the same
-	 * priority.
-	 */
-	if (gpt->current_kernel != CGPT_KERNEL_ENTRY_NOT_FOUND) {
-		for (i = gpt->current_kernel + 1;
-		     i < header->number_of_entries; i++) {
-			e = entries + i;
-			if (!IsKernelEntry(e))
-				continue;
-			VBDEBUG(("GptNextKernelEntry looking at same prio "
-				 "partition %d\n", i+1));
-			VBDEBUG(("GptNextKernelEntry s%d t%d p%d\n",
-				 GetEntrySuccessful(e), GetEntryTries(e),
-				 GetEntryPriority(e)));
-			if (!(GetEntrySuccessful(e) || GetEntryTries(e)))
-				continue;
-			if (GetEntryPriority(e) == gpt->current_priority) {
-				gpt->current_kernel = i;
-				*start_sector = e->starting_lba;
-				*size = e->ending_lba - e->starting_lba + 1;
-				VBDEBUG(("GptNextKernelEntry likes it\n"));
-				return GPT_SUCCESS;
-			}
-		}
-	}
+	int index, prio;
 
 	/*
-	 * We're still here, so scan for the remaining kernel with the highest
-	 * priority less than the previous attempt.
+	 * Find the first kernel in kernel_order after the one we last
+	 * returned: another kernel with the current kernel's priority later in
+	 * the table, or else the first one with a lower priority.  Searching
+	 * from current_kernel and current_priority, rather than keeping a
+	 * cursor, lets callers save and restore them.
 	 */
-	for (i = 0, e = entries; i < header->number_of_entries; i++, e++) {
-		int current_prio = GetEntryPriority(e);
-		if (!IsKernelEntry(e))
-			continue;
-		VBDEBUG(("GptNextKernelEntry looking at new prio "
-			 "partition %d\n", i+1));
-		VBDEBUG(("GptNextKernelEntry s%d t%d p%d\n",
-			 GetEntrySuccessful(e), GetEntryTries(e),
-			 GetEntryPriority(e)));
-		if (!(GetEntrySuccessful(e) || GetEntryTries(e)))
-			continue;
-		if (current_prio >= gpt->current_priority) {
-			/* Already returned this kernel in a previous call */
-			continue;
-		}
-		if (current_prio > new_prio) {
-			new_kernel = i;
-			new_prio = current_prio;
-		}
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		index = gpt->kernel_order[mid];
+		prio = GetEntryPriority(entries + index);
+		if (prio > gpt->current_priority ||
+		    (prio == gpt->current_priority &&
+		     (gpt->current_kernel == CGPT_KERNEL_ENTRY_NOT_FOUND ||
+		      index <= gpt->current_kernel)))
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	/*
-	 * Save what we found.  Note that if we didn't find a new kernel,
-	 * new_prio will still be -1, so future calls to this function will
-	 * also fail.
-	 */
-	gpt->current_kernel = new_kernel;
-	gpt->current_priority = new_prio;
-
-	if (CGPT_KERNEL_ENTRY_NOT_FOUND == new_kernel) {
+	if (lo == gpt->num_kernels) {
+		/* Future calls to this function will also fail */
+		gpt->current_kernel = CGPT_KERNEL_ENTRY_NOT_FOUND;
+		gpt->current_priority = 0;
 		VBDEBUG(("GptNextKernelEntry no more kernels\n"));
 		return GPT_ERROR_NO_VALID_KERNEL;
 	}
 
-	VBDEBUG(("GptNextKernelEntry likes partition %d\n", new_kernel + 1));
-	e = entries + new_kernel;
+	index = gpt->kernel_order[lo];
+	e = entries + index;
+	gpt->current_kernel = index;
+	gpt->current_priority = GetEntryPriority(e);
+
+	VBDEBUG(("GptNextKernelEntry likes partition %d\n", index + 1));
+	VBDEBUG(("GptNextKernelEntry s%d t%d p%d\n",
+		 GetEntrySuccessful(e), GetEntryTries(e),
+		 GetEntryPriority(e)));
 	*start_sector = e->starting_lba;
 	*size = e->ending_lba - e->starting_lba + 1;
 	return GPT_SUCCESS;
@@ -119,6 +97,7 @@ int GptNextKernelEntry(GptData *gpt, uint64_t *start_sector, uint64_t *size)
  */
 int GptUpdateKernelWithEntry(GptData *gpt, GptEntry *e, uint32_t update_type)
 {
+	uint64_t old_attrs = e->attrs.whole;
 	int modified = 0;
 
 	if (!IsKernelEntry(e))
@@ -184,7 +163,7 @@ int GptUpdateKernelWithEntry(GptData *gpt, GptEntry *e, uint32_t update_type)
 	}
 
 	if (modified) {
-		GptModified(gpt);
+		GptModifiedAttrs(gpt, e, old_attrs);
 	}
 
 	return GPT_SUCCESS;
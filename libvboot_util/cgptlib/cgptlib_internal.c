@@ -156,6 +156,119 @@ int IsKernelEntry(const GptEntry *e)
 	return !Memcmp(&e->type, &chromeos_kernel, sizeof(Guid));
 }
 
+/* The EC is short on space, so it only gets the pairwise check */
+#if defined(CHROMEOS_EC) && !defined(GPT_CHECK_SMALL)
+#define GPT_CHECK_SMALL
+#endif
+
+#ifndef GPT_CHECK_SMALL
+/* Tables with fewer used entries than this are checked pairwise */
+#define GPT_SORT_MIN_ENTRIES 16
+
+/* Sift used[root] down the heap of the first n entries, by starting LBA */
+static void SiftDown(const GptEntry *entries, uint32_t *used,
+		     uint32_t root, uint32_t n)
+{
+	uint32_t child, tmp;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n &&
+		    entries[used[child + 1]].starting_lba >
+		    entries[used[child]].starting_lba)
+			child++;
+		if (entries[used[root]].starting_lba >=
+		    entries[used[child]].starting_lba)
+			return;
+		tmp = used[root];
+		used[root] = used[child];
+		used[child] = tmp;
+		root = child;
+	}
+}
+
+static uint32_t GuidHash(const Guid *guid)
+{
+	const uint8_t *b = (const uint8_t *)guid;
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < sizeof(Guid); i++)
+		h = (h ^ b[i]) * 16777619u;
+	return h;
+}
+
+/*
+ * Look for any problem with the used entries, without saying which: they're
+ * range-checked, heap-sorted by starting LBA so that only neighbours can
+ * overlap, and their GUIDs go through a hash table. Returns 0 if the entries
+ * are all good, 1 if something is wrong, or -1 if there's no memory or too
+ * few entries for this to be worth it.
+ */
+static int SortedCheckEntries(GptEntry *entries, GptHeader *h)
+{
+	uint32_t *used, *slots;
+	uint32_t n = 0, nslots, mask, i, j, tmp;
+	int bad = 0;
+
+	for (i = 0; i < h->number_of_entries; i++)
+		if (!IsUnusedEntry(entries + i))
+			n++;
+	if (n < GPT_SORT_MIN_ENTRIES)
+		return -1;
+
+	/* Keep the hash table no more than half full */
+	for (nslots = 4; nslots < 2 * n; nslots *= 2)
+		;
+	mask = nslots - 1;
+
+	used = VbExMalloc((n + nslots) * sizeof(*used));
+	if (!used)
+		return -1;
+	slots = used + n;
+	Memset(slots, 0xff, nslots * sizeof(*slots));
+
+	for (i = 0, n = 0; i < h->number_of_entries && !bad; i++) {
+		GptEntry *entry = entries + i;
+
+		if (IsUnusedEntry(entry))
+			continue;
+		if ((entry->starting_lba < h->first_usable_lba) ||
+		    (entry->ending_lba > h->last_usable_lba) ||
+		    (entry->ending_lba < entry->starting_lba))
+			bad = 1;
+
+		for (j = GuidHash(&entry->unique) & mask; slots[j] != ~0U;
+		     j = (j + 1) & mask)
+			if (0 == Memcmp(&entry->unique,
+					&entries[slots[j]].unique,
+					sizeof(Guid)))
+				bad = 1;
+		slots[j] = i;
+		used[n++] = i;
+	}
+
+	if (!bad) {
+		for (i = n / 2; i > 0; i--)
+			SiftDown(entries, used, i - 1, n);
+		for (i = n - 1; i > 0; i--) {
+			tmp = used[0];
+			used[0] = used[i];
+			used[i] = tmp;
+			SiftDown(entries, used, 0, i);
+		}
+
+		/* The ranges are sound, so disjoint ones stay in order */
+		for (i = 1; i < n && !bad; i++)
+			if (entries[used[i]].starting_lba <=
+			    entries[used[i - 1]].ending_lba)
+				bad = 1;
+	}
+
+	VbExFree(used);
+	return bad;
+}
+#endif
+
 int CheckEntries(GptEntry *entries, GptHeader *h)
 {
 	if (!entries)
@@ -170,6 +283,15 @@ int CheckEntries(GptEntry *entries, GptHeader *h)
 	if (crc32 != h->entries_crc32)
 		return GPT_ERROR_CRC_CORRUPTED;
 
+#ifndef GPT_CHECK_SMALL
+	/*
+	 * Large tables are usually fine, and that's quick to show. If they
+	 * aren't, the pairwise check below says just what's wrong.
+	 */
+	if (0 == SortedCheckEntries(entries, h))
+		return 0;
+#endif
+
 	/* Check all entries. */
 	for (i = 0, entry = entries; i < h->number_of_entries; i++, entry++) {
 		GptEntry *e2;
@@ -312,6 +434,33 @@ int GptSanityCheck(GptData *gpt)
 	return GPT_SUCCESS;
 }
 
+/*
+ * Note that bytes [start, end) of the entries are about to be modified, or
+ * all of them if the range is empty. The range only ever grows to cover
+ * whatever was modified before, however many of the copies that was in.
+ */
+static void GptModifiedEntries(GptData *gpt, uint32_t start, uint32_t end)
+{
+	int any = gpt->modified &
+		(GPT_MODIFIED_ENTRIES1 | GPT_MODIFIED_ENTRIES2);
+
+	if (start >= end ||
+	    (any && gpt->modified_entries_start >=
+	     gpt->modified_entries_end)) {
+		/* All of them */
+		gpt->modified_entries_start = gpt->modified_entries_end = 0;
+		return;
+	}
+	if (any) {
+		if (start > gpt->modified_entries_start)
+			start = gpt->modified_entries_start;
+		if (end < gpt->modified_entries_end)
+			end = gpt->modified_entries_end;
+	}
+	gpt->modified_entries_start = start;
+	gpt->modified_entries_end = end;
+}
+
 void GptRepair(GptData *gpt)
 {
 	GptHeader *header1 = (GptHeader *)(gpt->primary_header);
@@ -352,11 +501,13 @@ void GptRepair(GptData *gpt)
 	if (MASK_PRIMARY == gpt->valid_entries) {
 		/* Primary is good, secondary is bad */
 		Memcpy(entries2, entries1, entries_size);
+		GptModifiedEntries(gpt, 0, 0);
 		gpt->modified |= GPT_MODIFIED_ENTRIES2;
 	}
 	else if (MASK_SECONDARY == gpt->valid_entries) {
 		/* Secondary is good, primary is bad */
 		Memcpy(entries1, entries2, entries_size);
+		GptModifiedEntries(gpt, 0, 0);
 		gpt->modified |= GPT_MODIFIED_ENTRIES1;
 	}
 	gpt->valid_entries = MASK_BOTH;
@@ -418,6 +569,7 @@ void GptModified(GptData *gpt) {
 				      header->size_of_entry *
 				      header->number_of_entries);
 	header->header_crc32 = HeaderCrc(header);
+	GptModifiedEntries(gpt, 0, 0);
 	gpt->modified |= GPT_MODIFIED_HEADER1 | GPT_MODIFIED_ENTRIES1;
 
 	/*
@@ -428,6 +580,110 @@ void GptModified(GptData *gpt) {
 	gpt->valid_headers = MASK_PRIMARY;
 	gpt->valid_entries = MASK_PRIMARY;
 	GptRepair(gpt);
+
+	/* Tries and priorities may have changed */
+	GptSortKernelEntries(gpt);
+}
+
+/*
+ * The [n] bytes at [offset] in primary entry [e] have changed from [old].
+ * Patch the CRCs and copy them to the secondary entries, or fall back to
+ * GptModified() if the two copies can't be patched alike.
+ */
+static void GptModifiedEntryBytes(GptData *gpt, GptEntry *e, uint32_t offset,
+				  const void *old, uint32_t n)
+{
+	GptHeader *header1 = (GptHeader *)gpt->primary_header;
+	GptHeader *header2 = (GptHeader *)gpt->secondary_header;
+	GptEntry *entries1 = (GptEntry *)gpt->primary_entries;
+	GptEntry *entries2 = (GptEntry *)gpt->secondary_entries;
+
+	/*
+	 * Patching the CRCs needs both copies to be good, and the same, as
+	 * they are once GptInit() has repaired them.
+	 */
+	if (MASK_BOTH != gpt->valid_headers ||
+	    MASK_BOTH != gpt->valid_entries ||
+	    header1->entries_crc32 != header2->entries_crc32 ||
+	    header1->size_of_entry != sizeof(GptEntry) ||
+	    e < entries1 || e >= entries1 + header1->number_of_entries) {
+		GptModified(gpt);
+		return;
+	}
+
+	offset += (uint8_t *)e - (uint8_t *)entries1;
+	header1->entries_crc32 = Crc32Patch(header1->entries_crc32,
+					    header1->size_of_entry *
+					    header1->number_of_entries,
+					    offset, old,
+					    (uint8_t *)entries1 + offset, n);
+	header1->header_crc32 = HeaderCrc(header1);
+
+	Memcpy((uint8_t *)entries2 + offset, (uint8_t *)entries1 + offset, n);
+	header2->entries_crc32 = header1->entries_crc32;
+	header2->header_crc32 = HeaderCrc(header2);
+
+	GptModifiedEntries(gpt, offset, offset + n);
+	gpt->modified |= GPT_MODIFIED_HEADER1 | GPT_MODIFIED_ENTRIES1 |
+		GPT_MODIFIED_HEADER2 | GPT_MODIFIED_ENTRIES2;
+
+	/* Tries and priorities may have changed */
+	GptSortKernelEntries(gpt);
+}
+
+void GptModifiedAttrs(GptData *gpt, GptEntry *e, uint64_t old_attrs)
+{
+	GptModifiedEntryBytes(gpt, e, (uint8_t *)&e->attrs - (uint8_t *)e,
+			      &old_attrs, sizeof(e->attrs));
+}
+
+void GptModifiedEntry(GptData *gpt, GptEntry *e, const GptEntry *old)
+{
+	GptModifiedEntryBytes(gpt, e, 0, old, sizeof(*e));
+}
+
+/* Can GptNextKernelEntry() return this entry, if its priority is non-zero? */
+static int IsBootableKernelEntry(const GptEntry *e)
+{
+	return IsKernelEntry(e) && (GetEntrySuccessful(e) || GetEntryTries(e));
+}
+
+void GptSortKernelEntries(GptData *gpt)
+{
+	GptHeader *header = (GptHeader *)gpt->primary_header;
+	GptEntry *entries = (GptEntry *)gpt->primary_entries;
+	uint32_t num_entries = header->number_of_entries;
+	uint32_t slot[16];
+	uint32_t i, n = 0;
+	GptEntry *e;
+	int prio;
+
+	if (num_entries > GPT_MAX_KERNEL_ORDER)
+		num_entries = GPT_MAX_KERNEL_ORDER;
+
+	/*
+	 * A counting sort on priority keeps entries of equal priority in
+	 * table order, which is how GptNextKernelEntry() breaks ties.
+	 */
+	Memset(slot, 0, sizeof(slot));
+	for (i = 0, e = entries; i < num_entries; i++, e++) {
+		if (IsBootableKernelEntry(e))
+			slot[GetEntryPriority(e)]++;
+	}
+	/* Highest priority first; priority 0 is never booted */
+	for (prio = 15; prio > 0; prio--) {
+		uint32_t count = slot[prio];
+		slot[prio] = n;
+		n += count;
+	}
+	for (i = 0, e = entries; i < num_entries; i++, e++) {
+		if (!IsBootableKernelEntry(e))
+			continue;
+		prio = GetEntryPriority(e);
+		if (prio)
+			gpt->kernel_order[slot[prio]++] = i;
+	}
+	gpt->num_kernels = n;
 }
 
 
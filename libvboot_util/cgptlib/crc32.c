@@ -41,6 +41,24 @@
 /*  --------------------------------------------------------------------  */
 #include "sysincludes.h"
 
+/* Host builds can fold with carry-less multiplies, or use the CPU's CRC32
+ * instructions, when it has them. The choice is made at runtime so the same
+ * binary still works on older CPUs. */
+#if !defined(CHROMEOS_EC) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CRC32_HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif !defined(CHROMEOS_EC) && defined(__GNUC__) && defined(__aarch64__) && \
+    defined(__linux__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32_HW_ARM
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
 #include "crc32.h"
 
 static uint32_t crc32_tab[] = {
@@ -99,13 +117,233 @@ static uint32_t crc32_tab[] = {
 };
 
 
-uint32_t Crc32(const void *buffer, uint32_t len)
+/*
+ * Slice-by-8: crc32_slice[k][n] is the CRC register after feeding byte n
+ * followed by k zero bytes, so eight input bytes cost eight independent
+ * lookups instead of eight dependent ones. Row 0 is crc32_tab itself.
+ */
+static uint32_t crc32_slice[8][256];
+static int crc32_slice_ready;
+
+static void Crc32InitSlices(void)
+{
+	uint32_t i, k, v;
+
+	for (i = 0; i < 256; i++) {
+		v = crc32_tab[i];
+		crc32_slice[0][i] = v;
+		for (k = 1; k < 8; k++) {
+			v = crc32_tab[v & 0xff] ^ (v >> 8);
+			crc32_slice[k][i] = v;
+		}
+	}
+#ifdef __GNUC__
+	__atomic_store_n(&crc32_slice_ready, 1, __ATOMIC_RELEASE);
+#else
+	crc32_slice_ready = 1;
+#endif
+}
+
+static uint32_t Crc32Slice8(uint32_t value, const uint8_t *p, uint32_t len)
+{
+	uint32_t (*t)[256] = crc32_slice;
+
+#ifdef __GNUC__
+	if (!__atomic_load_n(&crc32_slice_ready, __ATOMIC_ACQUIRE))
+#else
+	if (!crc32_slice_ready)
+#endif
+		Crc32InitSlices();	/* Racing callers fill in equal values */
+
+	for (; len >= 8; len -= 8, p += 8) {
+		value ^= p[0] | (p[1] << 8) | (p[2] << 16) |
+			((uint32_t)p[3] << 24);
+		value = t[7][value & 0xff] ^ t[6][(value >> 8) & 0xff] ^
+			t[5][(value >> 16) & 0xff] ^ t[4][value >> 24] ^
+			t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+	}
+	for (; len; len--, p++)
+		value = crc32_tab[(value ^ *p) & 0xff] ^ (value >> 8);
+	return value;
+}
+
+#ifdef CRC32_HW_X86
+/*
+ * Folding with PCLMULQDQ, after Gopal et al., "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). The
+ * constants are x^n mod P for the bit-reflected polynomial, plus the
+ * Barrett constants for the final reduction.
+ */
+#define CRC32_FOLD_MIN 64
+
+__attribute__((target("pclmul,sse2")))
+static uint32_t Crc32Fold(uint32_t value, const uint8_t *p, uint32_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596ULL, 0x154442bd4ULL);
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eULL, 0x1751997d0ULL);
+	const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124ULL);
+	const __m128i poly = _mm_set_epi64x(0x1f7011641ULL, 0x1db710641ULL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+	__m128i x0, x1, x2, x3, y0, y1, y2, y3;
+
+	/* Four lanes of 128 bits, each folded 512 bits forward per round */
+	x0 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(value));
+	p += 64;
+	len -= 64;
+
+	for (; len >= 64; len -= 64, p += 64) {
+		y0 = _mm_clmulepi64_si128(x0, k1k2, 0x11);
+		y1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		y2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		y3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x0 = _mm_clmulepi64_si128(x0, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x0 = _mm_xor_si128(_mm_xor_si128(x0, y0),
+			_mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, y1),
+			_mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, y2),
+			_mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, y3),
+			_mm_loadu_si128((const __m128i *)(p + 0x30)));
+	}
+
+	/* Fold the lanes into one, then any remaining whole blocks */
+#define CRC32_FOLD128(acc, next) \
+	_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(acc, k3k4, 0x00), \
+				    _mm_clmulepi64_si128(acc, k3k4, 0x11)), \
+		      next)
+	x0 = CRC32_FOLD128(x0, x1);
+	x0 = CRC32_FOLD128(x0, x2);
+	x0 = CRC32_FOLD128(x0, x3);
+	for (; len >= 16; len -= 16, p += 16)
+		x0 = CRC32_FOLD128(x0,
+			_mm_loadu_si128((const __m128i *)p));
+#undef CRC32_FOLD128
+
+	/* 128 bits down to 64, then to 32 */
+	x0 = _mm_xor_si128(_mm_clmulepi64_si128(x0, k3k4, 0x10),
+			   _mm_srli_si128(x0, 8));
+	x0 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x0, mask32),
+						k5, 0x00),
+			   _mm_srli_si128(x0, 4));
+
+	/* Barrett reduction */
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x00);
+	x0 = _mm_xor_si128(x0, x1);
+	value = _mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
+
+	return Crc32Slice8(value, p, len);
+}
+
+static int Crc32HwProbe(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_PCLMUL) && (edx & bit_SSE2);
+}
+#endif  /* CRC32_HW_X86 */
+
+#ifdef CRC32_HW_ARM
+#define CRC32_FOLD_MIN 8
+
+static uint32_t Crc32Fold(uint32_t value, const uint8_t *p, uint32_t len)
+{
+	uint64_t v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		value = __crc32d(value, v);
+	}
+	for (; len; len--, p++)
+		value = __crc32b(value, *p);
+	return value;
+}
+
+static int Crc32HwProbe(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif  /* CRC32_HW_ARM */
+
+#if defined(CRC32_HW_X86) || defined(CRC32_HW_ARM)
+/* -1 until the first large buffer probes the CPU. Racing probes all store
+ * the same answer, so no locking is needed. */
+static int crc32_hw_usable = -1;
+#endif
+
+/*
+ * Polynomials mod P, for zero-extending a CRC. As in the table, the
+ * polynomials are bit-reversed, so x^0 is the top bit.
+ */
+static uint32_t Crc32MulModP(uint32_t a, uint32_t b)
+{
+	uint32_t p = 0;
+	uint32_t m;
+
+	for (m = 1U << 31; m; m >>= 1) {
+		if (a & m)
+			p ^= b;
+		b = (b & 1) ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+	return p;
+}
+
+/* Return x^(8 * len) mod P, by squaring */
+static uint32_t Crc32XPowMod(uint32_t len)
+{
+	uint32_t p = 1U << 31;		/* x^0 */
+	uint32_t sq = 1U << 23;		/* x^8 */
+
+	for (; len; len >>= 1) {
+		if (len & 1)
+			p = Crc32MulModP(sq, p);
+		sq = Crc32MulModP(sq, sq);
+	}
+	return p;
+}
+
+uint32_t Crc32Patch(uint32_t crc, uint32_t len, uint32_t offset,
+		    const void *old_bytes, const void *new_bytes, uint32_t n)
 {
-	uint8_t *byte = (uint8_t *)buffer;
+	const uint8_t *o = (const uint8_t *)old_bytes;
+	const uint8_t *b = (const uint8_t *)new_bytes;
+	uint32_t value = 0;
 	uint32_t i;
+
+	/*
+	 * With the initial and final inversions cancelling out, the change
+	 * in the CRC is just the CRC of the change, zero-extended over the
+	 * rest of the buffer. The zeroes in front don't affect it at all.
+	 */
+	for (i = 0; i < n; i++)
+		value = crc32_tab[(value ^ o[i] ^ b[i]) & 0xff] ^ (value >> 8);
+	if (!value)
+		return crc;
+	return crc ^ Crc32MulModP(Crc32XPowMod(len - offset - n), value);
+}
+
+uint32_t Crc32(const void *buffer, uint32_t len)
+{
+	const uint8_t *byte = (const uint8_t *)buffer;
 	uint32_t value = ~0U;
 
-	for (i = 0; i < len; ++i)
-		value = crc32_tab[(value ^ byte[i]) & 0xff] ^ (value >> 8);
-	return value ^ ~0U;
+#if defined(CRC32_HW_X86) || defined(CRC32_HW_ARM)
+	if (len >= CRC32_FOLD_MIN) {
+		if (crc32_hw_usable < 0)
+			crc32_hw_usable = Crc32HwProbe();
+		if (crc32_hw_usable)
+			return Crc32Fold(value, byte, len) ^ ~0U;
+	}
+#endif
+	return Crc32Slice8(value, byte, len) ^ ~0U;
 }
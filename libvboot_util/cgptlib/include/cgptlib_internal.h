@@ -134,6 +134,26 @@ void GptRepair(GptData *gpt);
  */
 void GptModified(GptData *gpt);
 
+/**
+ * Like GptModified(), when only the attributes of primary entry [e] have
+ * changed, from [old_attrs]. The entries CRCs are patched rather than
+ * recalculated, so this doesn't need to read the whole entries array.
+ */
+void GptModifiedAttrs(GptData *gpt, GptEntry *e, uint64_t old_attrs);
+
+/**
+ * Like GptModifiedAttrs(), when any of primary entry [e] may have changed,
+ * from [old]. Only the sectors holding [e] then need writing back.
+ */
+void GptModifiedEntry(GptData *gpt, GptEntry *e, const GptEntry *old);
+
+/**
+ * Rebuild gpt->kernel_order from the primary entries.  Called by GptInit()
+ * and GptModified(), so it only needs calling directly if the entries are
+ * changed some other way.
+ */
+void GptSortKernelEntries(GptData *gpt);
+
 /* Getters and setters for partition attribute fields. */
 
 int GetEntrySuccessful(const GptEntry *e);
@@ -9,4 +9,12 @@
 
 uint32_t Crc32(const void *buffer, uint32_t len);
 
+/*
+ * Return the new CRC32 of a [len]-byte buffer whose CRC32 was [crc], after
+ * the [n] bytes at [offset] changed from [old_bytes] to [new_bytes]. This
+ * only looks at the bytes that changed.
+ */
+uint32_t Crc32Patch(uint32_t crc, uint32_t len, uint32_t offset,
+		    const void *old_bytes, const void *new_bytes, uint32_t n);
+
 #endif  /* VBOOT_REFERENCE_GPT_CRC32_H_ */
@@ -12,4 +12,55 @@
 #include "rsa.h"
 #include "sha.h"
 
+/* Running totals of the work done, for host tools that want to report it.
+ * Nothing is counted unless crypto_stats points somewhere, so leaving it
+ * NULL costs one test per call. A thread that points crypto_thread_stats
+ * at totals of its own has them counted there too, without the atomic add
+ * that every thread sharing crypto_stats pays for.
+ */
+typedef struct CryptoStats {
+  uint64_t digest_bytes;  /* Bytes hashed by DigestUpdate() and DigestBuf*() */
+  uint64_t rsa_verify;    /* Signatures checked by RSAVerify*() */
+  uint64_t rsa_sign;      /* Digests handed to a signer */
+  uint64_t rsa_key_hits;  /* Keys RSAKeyCacheGet() had already converted */
+  uint64_t rsa_key_misses;  /* and those it had to convert */
+} CryptoStats;
+
+#ifdef CHROMEOS_EC
+#define CRYPTO_STATS_ADD(field, n) do {} while (0)
+#else
+extern CryptoStats* crypto_stats;
+extern __thread CryptoStats* crypto_thread_stats;
+/* Only this thread writes its own, but others may read them at any time */
+#define CRYPTO_STATS_ADD(field, n) do {                                \
+    if (crypto_stats)                                                  \
+      __sync_fetch_and_add(&crypto_stats->field, (uint64_t)(n));       \
+    if (crypto_thread_stats)                                           \
+      __atomic_store_n(&crypto_thread_stats->field,                    \
+                       crypto_thread_stats->field + (uint64_t)(n),     \
+                       __ATOMIC_RELAXED);                              \
+  } while (0)
+#endif
+
+/* Host tools can hand the one-shot operations to another implementation,
+ * such as a system crypto library, while the streaming DigestContext stays
+ * here: contexts are copied and saved by value, so their layout is ours.
+ * Each hook returns 0 if it did the work, or nonzero to let the code below
+ * do it instead. Firmware never sets crypto_provider.
+ */
+typedef struct CryptoProvider {
+  const char* name;
+  /* Hash [len] bytes of [buf] with hash [hash_alg] (SHA*_DIGEST_ALGORITHM)
+   * into [digest]. */
+  int (*digest_buf)(const uint8_t* buf, uint64_t len, int hash_alg,
+                    uint8_t* digest);
+  /* Raise the big-endian number in [inout], which is the size of [key], to
+   * the power 65537 modulo the key, in place. */
+  int (*modpow_f4)(const RSAPublicKey* key, uint8_t* inout);
+} CryptoProvider;
+
+#ifndef CHROMEOS_EC
+extern const CryptoProvider* crypto_provider;
+#endif
+
 #endif  /* VBOOT_REFERENCE_CRYPTOLIB_H_ */
@@ -12,25 +12,77 @@
 
 #include "sysincludes.h"
 
-extern const uint8_t paddingRSA1024_SHA1[];
-extern const uint8_t paddingRSA1024_SHA256[];
-extern const uint8_t paddingRSA1024_SHA512[];
-extern const uint8_t paddingRSA2048_SHA1[];
-extern const uint8_t paddingRSA2048_SHA256[];
-extern const uint8_t paddingRSA2048_SHA512[];
-extern const uint8_t paddingRSA4096_SHA1[];
-extern const uint8_t paddingRSA4096_SHA256[];
-extern const uint8_t paddingRSA4096_SHA512[];
-extern const uint8_t paddingRSA8192_SHA1[];
-extern const uint8_t paddingRSA8192_SHA256[];
-extern const uint8_t paddingRSA8192_SHA512[];
-
 extern const int kNumAlgorithms;
 
+/* The algorithms a build can verify, one bit for each algorithm ID: bit 0 is
+ * "RSA1024 SHA1" and bit 11 "RSA8192 SHA512", in the order of algo_strings[].
+ * Firmware for a board that only ever sees a few of them can be built with
+ * "make ALGORITHMS=0x90", say, for RSA2048 SHA256 and RSA4096 SHA256, which
+ * leaves out the hashes, padding and key sizes the others would need. The
+ * IDs stay the same, so the tables are still indexed by them, but the
+ * entries for the rest are never used. Host tools want all of them.
+ */
+#ifndef VBOOT_ALGORITHMS
+#ifdef CHROMEOS_EC
+#define VBOOT_ALGORITHMS 0x080  /* RSA4096 SHA256 */
+#else
+#define VBOOT_ALGORITHMS 0xfff
+#endif
+#endif
+
+#define VBOOT_ALGORITHM_ENABLED(a) \
+  ((a) < 12 && ((VBOOT_ALGORITHMS >> (a)) & 1))
+
+/* Nonzero if anything enabled uses that key size or hash */
+#define VBOOT_RSA1024 (VBOOT_ALGORITHMS & 0x007)
+#define VBOOT_RSA2048 (VBOOT_ALGORITHMS & 0x038)
+#define VBOOT_RSA4096 (VBOOT_ALGORITHMS & 0x1c0)
+#define VBOOT_RSA8192 (VBOOT_ALGORITHMS & 0xe00)
+#define VBOOT_SHA1 (VBOOT_ALGORITHMS & 0x249)
+#define VBOOT_SHA256 (VBOOT_ALGORITHMS & 0x492)
+#define VBOOT_SHA512 (VBOOT_ALGORITHMS & 0x924)
+
+/* Two hashes are wanted whatever the mask. A keyblock carries a SHA-512
+ * hash of itself, which developer mode checks in place of the signature and
+ * the host tools make. And keys are identified by the SHA-1 of their data
+ * (the "sha1sum" that futility shows and key stores are indexed by). The EC
+ * has no use for either. Other firmware that doesn't show key IDs can leave
+ * SHA-1 out with -DVBOOT_KEY_IDS=0. */
+#ifdef CHROMEOS_EC
+#define VBOOT_KEYBLOCKS 0
+#else
+#define VBOOT_KEYBLOCKS 1
+#endif
+#ifndef VBOOT_KEY_IDS
+#define VBOOT_KEY_IDS VBOOT_KEYBLOCKS
+#endif
+
+/* Nonzero if that hash's code is built */
+#define VBOOT_SHA1_CODE (VBOOT_SHA1 || VBOOT_KEY_IDS)
+#define VBOOT_SHA256_CODE VBOOT_SHA256
+#define VBOOT_SHA512_CODE (VBOOT_SHA512 || VBOOT_KEYBLOCKS)
+
+/* Is a key of [bytes] one of the sizes enabled? */
+#define VBOOT_RSA_SIZE_ENABLED(bytes)                 \
+  ((VBOOT_RSA1024 && (bytes) == RSA1024NUMBYTES) ||   \
+   (VBOOT_RSA2048 && (bytes) == RSA2048NUMBYTES) ||   \
+   (VBOOT_RSA4096 && (bytes) == RSA4096NUMBYTES) ||   \
+   (VBOOT_RSA8192 && (bytes) == RSA8192NUMBYTES))
+
+/* The largest of them, for buffers holding a signature or working on one */
+#if VBOOT_RSA8192
+#define VBOOT_RSA_MAX_BYTES RSA8192NUMBYTES
+#elif VBOOT_RSA4096
+#define VBOOT_RSA_MAX_BYTES RSA4096NUMBYTES
+#elif VBOOT_RSA2048
+#define VBOOT_RSA_MAX_BYTES RSA2048NUMBYTES
+#else
+#define VBOOT_RSA_MAX_BYTES RSA1024NUMBYTES
+#endif
+#define VBOOT_RSA_MAX_WORDS (VBOOT_RSA_MAX_BYTES / sizeof(uint32_t))
+
 extern const int digestinfo_size_map[];
 extern const int siglen_map[];
-extern const uint8_t* const padding_map[];
-extern const int padding_size_map[];
 extern const int hash_type_map[];
 extern const int hash_size_map[];
 extern const int hash_blocksize_map[];
@@ -39,6 +39,30 @@ int RSAVerify(const RSAPublicKey *key,
               const uint8_t sig_type,
               const uint8_t* hash);
 
+/* Recover the hash that a RSA PKCS1.5 signature [sig] of [sig_type] and
+ * length [sig_len] was made from, using [key], into [hash]. This is only the
+ * hash the signature claims; it says nothing about what was hashed. Returns 1
+ * if the padding checks out, 0 otherwise.
+ */
+int RSARecoverDigest(const RSAPublicKey *key,
+                     const uint8_t* sig,
+                     const uint32_t sig_len,
+                     const uint8_t sig_type,
+                     uint8_t* hash);
+
+/* Verify [count] signatures [sigs], all of [sig_type] and length [sig_len],
+ * against the matching expected [hashes] using [key]. Sets results[i] to 1 for
+ * each one that's good and 0 for each one that's not, and returns the number
+ * that are good.
+ */
+int RSAVerifyBatch(const RSAPublicKey *key,
+                   const uint8_t* const* sigs,
+                   const uint32_t sig_len,
+                   const uint8_t sig_type,
+                   const uint8_t* const* hashes,
+                   int count,
+                   int* results);
+
 /* Perform RSA signature verification on [buf] of length [len] against expected
  * signature [sig] using signature algorithm [algorithm]. The public key used
  * for verification can either be in the form of a pre-process key blob
@@ -91,5 +115,16 @@ void RSAPublicKeyFree(RSAPublicKey* key);
  */
 RSAPublicKey* RSAPublicKeyFromBuf(const uint8_t* buf, uint64_t len);
 
+/* Like RSAPublicKeyFromBuf(), but if n[] and rr[] in [buf] are aligned for
+ * 64-bit access, [view] is filled in to use them where they are, and is
+ * returned, without allocating or copying anything.  Otherwise this falls
+ * back to RSAPublicKeyFromBuf().  [buf] must outlive the key.
+ *
+ * Release the key with RSAPublicKeyViewFree(), which only frees a copy.
+ */
+RSAPublicKey* RSAPublicKeyView(RSAPublicKey* view, const uint8_t* buf,
+                               uint64_t len);
+void RSAPublicKeyViewFree(RSAPublicKey* key, RSAPublicKey* view);
+
 
 #endif  /* VBOOT_REFERENCE_RSA_H_ */
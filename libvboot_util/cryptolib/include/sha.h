@@ -38,7 +38,7 @@ typedef struct SHA1_CTX {
 
 typedef struct {
   uint32_t h[8];
-  uint32_t tot_len;
+  uint64_t tot_len;
   uint32_t len;
   uint8_t block[2 * SHA256_BLOCK_SIZE];
   uint8_t buf[SHA256_DIGEST_SIZE];  /* Used for storing the final digest. */
@@ -46,7 +46,7 @@ typedef struct {
 
 typedef struct {
   uint64_t h[8];
-  uint32_t tot_len;
+  uint64_t tot_len;
   uint32_t len;
   uint8_t block[2 * SHA512_BLOCK_SIZE];
   uint8_t buf[SHA512_DIGEST_SIZE];  /* Used for storing the final digest. */
@@ -58,11 +58,11 @@ void SHA1_update(SHA1_CTX* ctx, const uint8_t* data, uint64_t len);
 uint8_t* SHA1_final(SHA1_CTX* ctx);
 
 void SHA256_init(VB_SHA256_CTX* ctx);
-void SHA256_update(VB_SHA256_CTX* ctx, const uint8_t* data, uint32_t len);
+void SHA256_update(VB_SHA256_CTX* ctx, const uint8_t* data, uint64_t len);
 uint8_t* SHA256_final(VB_SHA256_CTX* ctx);
 
 void SHA512_init(VB_SHA512_CTX* ctx);
-void SHA512_update(VB_SHA512_CTX* ctx, const uint8_t* data, uint32_t len);
+void SHA512_update(VB_SHA512_CTX* ctx, const uint8_t* data, uint64_t len);
 uint8_t* SHA512_final(VB_SHA512_CTX* ctx);
 
 /* Convenience function for SHA-1.  Computes hash on [data] of length [len].
@@ -83,6 +83,17 @@ uint8_t* internal_SHA256(const uint8_t* data, uint64_t len, uint8_t* digest);
  */
 uint8_t* internal_SHA512(const uint8_t* data, uint64_t len, uint8_t* digest);
 
+/* Multi-buffer versions of the above. Computes the hash of each of the
+ * [count] messages [data][i] of length [len][i] and stores it into
+ * [digest][i], which should be pre-allocated to the digest size. Where the
+ * CPU has wide enough vector units the messages are hashed in parallel
+ * lanes, otherwise one after another.
+ */
+void SHA1_multi(const uint8_t* const* data, const uint64_t* len, int count,
+                uint8_t** digest);
+void SHA512_multi(const uint8_t* const* data, const uint64_t* len, int count,
+                  uint8_t** digest);
+
 
 /*---- Utility functions/wrappers for message digests. */
 
@@ -91,12 +102,15 @@ uint8_t* internal_SHA512(const uint8_t* data, uint64_t len, uint8_t* digest);
 #define SHA512_DIGEST_ALGORITHM 2
 
 /* A generic digest context structure which can be used to represent
- * the SHA*_CTX for multiple digest algorithms.
+ * the SHA*_CTX for multiple digest algorithms. It holds the state itself,
+ * so callers can keep it on the stack and hash without any allocation.
  */
 typedef struct DigestContext {
-  SHA1_CTX* sha1_ctx;
-  VB_SHA256_CTX* sha256_ctx;
-  VB_SHA512_CTX* sha512_ctx;
+  union {
+    SHA1_CTX sha1_ctx;
+    VB_SHA256_CTX sha256_ctx;
+    VB_SHA512_CTX sha512_ctx;
+  } u;
   int algorithm;  /* Hashing algorithm to use. */
 } DigestContext;
 
@@ -107,11 +121,16 @@ typedef struct DigestContext {
 
 /* Initialize a digest context for use with signature algorithm [algorithm]. */
 void DigestInit(DigestContext* ctx, int sig_algorithm);
-void DigestUpdate(DigestContext* ctx, const uint8_t* data, uint32_t len);
+void DigestUpdate(DigestContext* ctx, const uint8_t* data, uint64_t len);
 
 /* Caller owns the returned digest and must free it. */
 uint8_t* DigestFinal(DigestContext* ctx);
 
+/* Like DigestFinal(), but stores the digest into [digest], which must have
+ * room for the digest size of the algorithm passed to DigestInit().
+ */
+void DigestFinalInto(DigestContext* ctx, uint8_t* digest);
+
 /* Returns the appropriate digest for the data in [input_file]
  * based on the signature [algorithm].
  * Caller owns the returned digest and must free it.
@@ -124,5 +143,33 @@ uint8_t* DigestFile(char* input_file, int sig_algorithm);
  */
 uint8_t* DigestBuf(const uint8_t* buf, uint64_t len, int sig_algorithm);
 
+/* Like DigestBuf(), but stores the digest into [digest], which must have
+ * room for SHA512_DIGEST_SIZE bytes, and returns [digest].
+ */
+uint8_t* DigestBufInto(const uint8_t* buf, uint64_t len, int sig_algorithm,
+                       uint8_t* digest);
+
+/* Computes the digests of [count] buffers [bufs] of lengths [lens] based on
+ * the signature [algorithm], as if DigestBuf() had been called on each. The
+ * digest of bufs[i] is stored into [digests][i], which must have room for
+ * SHA512_DIGEST_SIZE bytes. Returns 0 on success, non-zero on error.
+ */
+int DigestBufMulti(const uint8_t* const* bufs, const uint64_t* lens,
+                   int count, int sig_algorithm, uint8_t** digests);
+
+/* How much of the buffer DigestMulti() gives each hash at a time. Small
+ * enough to stay in the L1 cache while every hash reads it.
+ */
+#define DIGEST_MULTI_CHUNK 8192
+
+/* The other way around from DigestBufMulti(): computes several kinds of
+ * digest of the same [buf] of length [len], in one pass over it.
+ * [algorithms] is a mask of (1 << SHA*_DIGEST_ALGORITHM) bits, and each of
+ * those digests is stored into [digests][SHA*_DIGEST_ALGORITHM], which must
+ * have room for it.
+ */
+void DigestMulti(const uint8_t* buf, uint64_t len, uint32_t algorithms,
+                 uint8_t** digests);
+
 
 #endif  /* VBOOT_REFERENCE_SHA_H_ */
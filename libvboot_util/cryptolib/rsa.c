@@ -12,43 +12,55 @@
 
 #include "cryptolib.h"
 #include "vboot_api.h"
+#include "vboot_probe.h"
 #include "utility.h"
 
+/* Everything below that takes a len is inlined into its callers, so that
+ * where the len is a constant (see RSA_SIZED_COPIES) the loops have known
+ * trip counts.
+ */
+#if defined(__GNUC__)
+#define RSA_INLINE inline __attribute__((always_inline))
+#else
+#define RSA_INLINE inline
+#endif
+
 /* a[] -= mod */
-static void subM(const RSAPublicKey *key, uint32_t *a) {
+static RSA_INLINE void subM(const uint32_t *n, uint32_t len, uint32_t *a) {
   int64_t A = 0;
   uint32_t i;
-  for (i = 0; i < key->len; ++i) {
-    A += (uint64_t)a[i] - key->n[i];
+  for (i = 0; i < len; ++i) {
+    A += (uint64_t)a[i] - n[i];
     a[i] = (uint32_t)A;
     A >>= 32;
   }
 }
 
 /* return a[] >= mod */
-static int geM(const RSAPublicKey *key, uint32_t *a) {
+static RSA_INLINE int geM(const uint32_t *n, uint32_t len, uint32_t *a) {
   uint32_t i;
-  for (i = key->len; i;) {
+  for (i = len; i;) {
     --i;
-    if (a[i] < key->n[i]) return 0;
-    if (a[i] > key->n[i]) return 1;
+    if (a[i] < n[i]) return 0;
+    if (a[i] > n[i]) return 1;
   }
   return 1;  /* equal */
  }
 
 /* montgomery c[] += a * b[] / R % mod */
-static void montMulAdd(const RSAPublicKey *key,
-                       uint32_t* c,
-                       const uint32_t a,
-                       const uint32_t* b) {
+static RSA_INLINE void montMulAdd(const uint32_t *n, uint32_t n0inv,
+                                  uint32_t len,
+                                  uint32_t* c,
+                                  const uint32_t a,
+                                  const uint32_t* b) {
   uint64_t A = (uint64_t)a * b[0] + c[0];
-  uint32_t d0 = (uint32_t)A * key->n0inv;
-  uint64_t B = (uint64_t)d0 * key->n[0] + (uint32_t)A;
+  uint32_t d0 = (uint32_t)A * n0inv;
+  uint64_t B = (uint64_t)d0 * n[0] + (uint32_t)A;
   uint32_t i;
 
-  for (i = 1; i < key->len; ++i) {
+  for (i = 1; i < len; ++i) {
     A = (A >> 32) + (uint64_t)a * b[i] + c[i];
-    B = (B >> 32) + (uint64_t)d0 * key->n[i] + (uint32_t)A;
+    B = (B >> 32) + (uint64_t)d0 * n[i] + (uint32_t)A;
     c[i - 1] = (uint32_t)B;
   }
 
@@ -57,95 +69,301 @@ static void montMulAdd(const RSAPublicKey *key,
   c[i - 1] = (uint32_t)A;
 
   if (A >> 32) {
-    subM(key, c);
+    subM(n, len, c);
   }
 }
 
 /* montgomery c[] = a[] * b[] / R % mod */
-static void montMul(const RSAPublicKey *key,
-                    uint32_t* c,
-                    uint32_t* a,
-                    uint32_t* b) {
+static RSA_INLINE void montMul(const uint32_t *n, uint32_t n0inv,
+                               uint32_t len,
+                               uint32_t* c,
+                               uint32_t* a,
+                               const uint32_t* b) {
   uint32_t i;
-  for (i = 0; i < key->len; ++i) {
+  for (i = 0; i < len; ++i) {
     c[i] = 0;
   }
-  for (i = 0; i < key->len; ++i) {
-    montMulAdd(key, c, a[i], b);
+  for (i = 0; i < len; ++i) {
+    montMulAdd(n, n0inv, len, c, a[i], b);
   }
 }
 
-/* In-place public exponentiation. (65537}
- * Input and output big-endian byte array in inout.
- */
-static void modpowF4(const RSAPublicKey *key,
-                    uint8_t* inout) {
-  uint32_t* a = (uint32_t*) VbExMalloc(key->len * sizeof(uint32_t));
-  uint32_t* aR = (uint32_t*) VbExMalloc(key->len * sizeof(uint32_t));
-  uint32_t* aaR = (uint32_t*) VbExMalloc(key->len * sizeof(uint32_t));
+/* In-place public exponentiation (65537), using 32-bit words. */
+static RSA_INLINE void modpowF4_32(const RSAPublicKey *key, uint32_t len,
+                                   uint8_t* inout) {
+  const uint32_t* n = key->n;
+  uint32_t n0inv = key->n0inv;
+  uint32_t a[VBOOT_RSA_MAX_WORDS];
+  uint32_t aR[VBOOT_RSA_MAX_WORDS];
+  uint32_t aaR[VBOOT_RSA_MAX_WORDS];
 
   uint32_t* aaa = aaR;  /* Re-use location. */
   int i;
 
   /* Convert from big endian byte array to little endian word array. */
-  for (i = 0; i < (int)key->len; ++i) {
+  for (i = 0; i < (int)len; ++i) {
     uint32_t tmp =
-        (inout[((key->len - 1 - i) * 4) + 0] << 24) |
-        (inout[((key->len - 1 - i) * 4) + 1] << 16) |
-        (inout[((key->len - 1 - i) * 4) + 2] << 8) |
-        (inout[((key->len - 1 - i) * 4) + 3] << 0);
+        (inout[((len - 1 - i) * 4) + 0] << 24) |
+        (inout[((len - 1 - i) * 4) + 1] << 16) |
+        (inout[((len - 1 - i) * 4) + 2] << 8) |
+        (inout[((len - 1 - i) * 4) + 3] << 0);
     a[i] = tmp;
   }
 
-  montMul(key, aR, a, key->rr);  /* aR = a * RR / R mod M   */
+  montMul(n, n0inv, len, aR, a, key->rr);  /* aR = a * RR / R mod M   */
   for (i = 0; i < 16; i+=2) {
-    montMul(key, aaR, aR, aR);  /* aaR = aR * aR / R mod M */
-    montMul(key, aR, aaR, aaR);  /* aR = aaR * aaR / R mod M */
+    montMul(n, n0inv, len, aaR, aR, aR);  /* aaR = aR * aR / R mod M */
+    montMul(n, n0inv, len, aR, aaR, aaR);  /* aR = aaR * aaR / R mod M */
   }
-  montMul(key, aaa, aR, a);  /* aaa = aR * a / R mod M */
+  montMul(n, n0inv, len, aaa, aR, a);  /* aaa = aR * a / R mod M */
 
 
   /* Make sure aaa < mod; aaa is at most 1x mod too large. */
-  if (geM(key, aaa)) {
-    subM(key, aaa);
+  if (geM(n, len, aaa)) {
+    subM(n, len, aaa);
   }
 
   /* Convert to bigendian byte array */
-  for (i = (int)key->len - 1; i >= 0; --i) {
+  for (i = (int)len - 1; i >= 0; --i) {
     uint32_t tmp = aaa[i];
     *inout++ = (uint8_t)(tmp >> 24);
     *inout++ = (uint8_t)(tmp >> 16);
     *inout++ = (uint8_t)(tmp >>  8);
     *inout++ = (uint8_t)(tmp >>  0);
   }
+}
 
-  VbExFree(a);
-  VbExFree(aR);
-  VbExFree(aaR);
+/* Where the compiler gives us a 64x64->128 multiply (mulx/mul on x86-64,
+ * mul/umulh on aarch64), working on 64-bit limbs needs a quarter as many
+ * multiplies. Pairs of the key's 32-bit words are used as 64-bit limbs in
+ * place, so this is only for little endian machines. All the key sizes are
+ * an even number of words, so R is the same either way.
+ */
+#if defined(__SIZEOF_INT128__) && defined(__BYTE_ORDER__) && \
+  __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define RSA_64BIT_LIMBS
+
+typedef unsigned __int128 uint128_t;
+/* The key's n[] and rr[] are uint32_t arrays that we read as uint64_t */
+typedef uint64_t __attribute__((may_alias)) limb64_t;
+
+/* 64-bit limb versions of the above. len is in limbs. */
+static RSA_INLINE void subM64(const limb64_t *n, uint32_t len, uint64_t *a) {
+  uint64_t borrow = 0;
+  uint32_t i;
+  for (i = 0; i < len; ++i) {
+    uint128_t A = (uint128_t)a[i] - n[i] - borrow;
+    a[i] = (uint64_t)A;
+    borrow = (uint64_t)(A >> 64) & 1;
+  }
 }
 
-/* Verify a RSA PKCS1.5 signature against an expected hash.
- * Returns 0 on failure, 1 on success.
+static RSA_INLINE int geM64(const limb64_t *n, uint32_t len,
+                            const uint64_t *a) {
+  uint32_t i;
+  for (i = len; i;) {
+    --i;
+    if (a[i] < n[i]) return 0;
+    if (a[i] > n[i]) return 1;
+  }
+  return 1;  /* equal */
+}
+
+/* montgomery c[] += a * b[] / R % mod */
+static RSA_INLINE void montMulAdd64(const limb64_t *n, uint64_t n0inv,
+                                    uint32_t len,
+                                    uint64_t* c,
+                                    const uint64_t a,
+                                    const limb64_t* b) {
+  uint128_t A = (uint128_t)a * b[0] + c[0];
+  uint64_t d0 = (uint64_t)A * n0inv;
+  uint128_t B = (uint128_t)d0 * n[0] + (uint64_t)A;
+  uint32_t i;
+
+  for (i = 1; i < len; ++i) {
+    A = (A >> 64) + (uint128_t)a * b[i] + c[i];
+    B = (B >> 64) + (uint128_t)d0 * n[i] + (uint64_t)A;
+    c[i - 1] = (uint64_t)B;
+  }
+
+  A = (A >> 64) + (B >> 64);
+
+  c[i - 1] = (uint64_t)A;
+
+  if (A >> 64) {
+    subM64(n, len, c);
+  }
+}
+
+/* montgomery c[] = a[] * b[] / R % mod */
+static RSA_INLINE void montMul64(const limb64_t *n, uint64_t n0inv,
+                                 uint32_t len,
+                                 uint64_t* c,
+                                 const limb64_t* a,
+                                 const limb64_t* b) {
+  uint32_t i;
+  for (i = 0; i < len; ++i) {
+    c[i] = 0;
+  }
+  for (i = 0; i < len; ++i) {
+    montMulAdd64(n, n0inv, len, c, a[i], b);
+  }
+}
+
+/* -1 / n[0] mod 2^64, extended from the key's mod 2^32 with a Newton step. */
+static uint64_t n0inv64(const RSAPublicKey *key) {
+  uint64_t inv = (uint32_t)-key->n0inv;
+  inv *= 2 - ((const limb64_t*)key->n)[0] * inv;
+  return -inv;
+}
+
+/* Convert from big endian byte array to little endian limb array. */
+static RSA_INLINE void fromBytes64(uint64_t* a, const uint8_t* in,
+                                   uint32_t len) {
+  uint32_t i, j;
+  for (i = 0; i < len; ++i) {
+    const uint8_t* p = in + (len - 1 - i) * 8;
+    uint64_t tmp = 0;
+    for (j = 0; j < 8; ++j)
+      tmp = (tmp << 8) | p[j];
+    a[i] = tmp;
+  }
+}
+
+/* Convert to bigendian byte array, making sure a < mod first. a is at most
+ * 1x mod too large.
  */
-int RSAVerify(const RSAPublicKey *key,
-              const uint8_t *sig,
-              const uint32_t sig_len,
-              const uint8_t sig_type,
-              const uint8_t *hash) {
-  uint8_t* buf;
-  const uint8_t* padding;
-  int padding_len;
-  int success = 1;
+static RSA_INLINE void toBytes64(const limb64_t* n, uint32_t len, uint8_t* out,
+                                 uint64_t* a) {
+  int i, j;
+  if (geM64(n, len, a)) {
+    subM64(n, len, a);
+  }
+  for (i = (int)len - 1; i >= 0; --i) {
+    uint64_t tmp = a[i];
+    for (j = 56; j >= 0; j -= 8)
+      *out++ = (uint8_t)(tmp >> j);
+  }
+}
 
-  if (!key || !sig || !hash)
-    return 0;
+/* In-place public exponentiation (65537), using 64-bit limbs. */
+static RSA_INLINE void modpowF4_64(const RSAPublicKey *key, uint32_t len,
+                                   uint8_t* inout) {
+  const limb64_t* n = (const limb64_t*)key->n;
+  const limb64_t* rr = (const limb64_t*)key->rr;
+  uint64_t n0inv = n0inv64(key);
+  uint64_t a[VBOOT_RSA_MAX_WORDS / 2];
+  uint64_t aR[VBOOT_RSA_MAX_WORDS / 2];
+  uint64_t aaR[VBOOT_RSA_MAX_WORDS / 2];
+  uint64_t* aaa = aaR;  /* Re-use location. */
+  int i;
+
+  fromBytes64(a, inout, len);
+
+  montMul64(n, n0inv, len, aR, a, rr);  /* aR = a * RR / R mod M   */
+  for (i = 0; i < 16; i+=2) {
+    montMul64(n, n0inv, len, aaR, aR, aR);  /* aaR = aR * aR / R mod M */
+    montMul64(n, n0inv, len, aR, aaR, aaR);  /* aR = aaR * aaR / R mod M */
+  }
+  montMul64(n, n0inv, len, aaa, aR, a);  /* aaa = aR * a / R mod M */
+
+  toBytes64(n, len, inout, aaa);
+}
+
+/* The key arrays come from VbExMalloc(), so they should be aligned. */
+static int canUse64(const RSAPublicKey *key) {
+  return !(key->len & 1) && !((size_t)key->n & 7) && !((size_t)key->rr & 7);
+}
+#endif  /* RSA_64BIT_LIMBS */
+
+/* In-place public exponentiation. (65537}
+ * Input and output big-endian byte array in inout.
+ */
+static void modpowF4Any(const RSAPublicKey *key,
+                        uint8_t* inout) {
+#ifdef RSA_64BIT_LIMBS
+  if (canUse64(key)) {
+    modpowF4_64(key, key->len / 2, inout);
+    return;
+  }
+#endif
+  modpowF4_32(key, key->len, inout);
+}
+
+/* The key is always one of four sizes. Unless code size matters more, each
+ * size gets its own copy of the 32-bit word code with the length fixed, so
+ * the compiler can unroll and schedule the inner loops knowing the trip
+ * counts. With 64-bit limbs the loops are half as long and fixing them made
+ * no measurable difference, for eight times the code, so that isn't copied.
+ */
+#if defined(__GNUC__) && !defined(CHROMEOS_EC) && !defined(RSA_64BIT_LIMBS)
+#define RSA_SIZED_COPIES
+
+#define RSA_SIZED_MODPOW(bits)                                          \
+  static void modpowF4_##bits(const RSAPublicKey *key, uint8_t* inout) { \
+    modpowF4_32(key, RSA##bits##NUMWORDS, inout);                       \
+  }
+#if VBOOT_RSA1024
+RSA_SIZED_MODPOW(1024)
+#endif
+#if VBOOT_RSA2048
+RSA_SIZED_MODPOW(2048)
+#endif
+#if VBOOT_RSA4096
+RSA_SIZED_MODPOW(4096)
+#endif
+#if VBOOT_RSA8192
+RSA_SIZED_MODPOW(8192)
+#endif
+#undef RSA_SIZED_MODPOW
+#endif  /* RSA_SIZED_COPIES */
 
+/* Picks the copy of modpowF4() for [key]'s size, unless the crypto provider
+ * does it. */
+static void modpowF4(const RSAPublicKey *key,
+                    uint8_t* inout) {
+#ifndef CHROMEOS_EC
+  if (crypto_provider && crypto_provider->modpow_f4 &&
+      !crypto_provider->modpow_f4(key, inout))
+    return;
+#endif
+#ifdef RSA_SIZED_COPIES
+  switch (key->len) {
+#if VBOOT_RSA1024
+    case RSA1024NUMWORDS:
+      modpowF4_1024(key, inout);
+      return;
+#endif
+#if VBOOT_RSA2048
+    case RSA2048NUMWORDS:
+      modpowF4_2048(key, inout);
+      return;
+#endif
+#if VBOOT_RSA4096
+    case RSA4096NUMWORDS:
+      modpowF4_4096(key, inout);
+      return;
+#endif
+#if VBOOT_RSA8192
+    case RSA8192NUMWORDS:
+      modpowF4_8192(key, inout);
+      return;
+#endif
+  }
+#endif
+  modpowF4Any(key, inout);
+}
+
+/* Can [key] check a [sig_len]-byte signature of type [sig_type]? */
+static int checkVerifyArgs(const RSAPublicKey *key,
+                           const uint32_t sig_len,
+                           const uint8_t sig_type) {
   if (sig_len != (key->len * sizeof(uint32_t))) {
     VBDEBUG(("Signature is of incorrect length!\n"));
     return 0;
   }
 
-  if (sig_type >= kNumAlgorithms) {
+  if (!VBOOT_ALGORITHM_ENABLED(sig_type)) {
     VBDEBUG(("Invalid signature type!\n"));
     return 0;
   }
@@ -155,32 +373,139 @@ int RSAVerify(const RSAPublicKey *key,
     return 0;
   }
 
-  buf = (uint8_t*) VbExMalloc(sig_len);
-  if (!buf)
-    return 0;
-  Memcpy(buf, sig, sig_len);
-
-  modpowF4(key, buf);
+  return 1;
+}
 
-  /* Determine padding to use depending on the signature type. */
-  padding = padding_map[sig_type];
-  padding_len = padding_size_map[sig_type];
+/* Check the decrypted signature in [buf], which must be 32-bit aligned,
+ * against [hash]. That's 0x00 0x01, 0xff up to a 0x00, the DigestInfo for
+ * the hash algorithm and then the hash itself (see padding.c). Every check
+ * runs to the end, whatever it finds, so timing doesn't depend on the data.
+ * The run of 0xff is most of it, and that's checked a word at a time. */
+static int checkPadding(const uint8_t* buf,
+                        const uint32_t sig_len,
+                        const uint8_t sig_type,
+                        const uint8_t* hash) {
+  const uint32_t hash_len = hash_size_map[sig_type];
+  const uint32_t info_len = digestinfo_size_map[sig_type];
+  /* Where the 0x00 after the run of 0xff is */
+  const uint32_t ps_end = sig_len - hash_len - info_len - 1;
+  uint32_t diff;
+  uint32_t i;
+  int success = 1;
 
-  /* Even though there are probably no timing issues here, we use
-   * SafeMemcmp() just to be on the safe side. */
+  diff = buf[0] | (buf[1] ^ 0x01) | (buf[2] ^ 0xff) | (buf[3] ^ 0xff) |
+      buf[ps_end];
+  /* The run is longer than a word for every algorithm */
+  for (i = 4; i + sizeof(uint32_t) <= ps_end; i += sizeof(uint32_t))
+    diff |= *(const uint32_t*)(buf + i) ^ 0xffffffff;
+  for (; i < ps_end; i++)
+    diff |= buf[i] ^ 0xff;
+  diff |= SafeMemcmp(buf + ps_end + 1, hash_digestinfo_map[sig_type],
+                     info_len);
 
   /* Check pkcs1.5 padding bytes. */
-  if (SafeMemcmp(buf, padding, padding_len)) {
+  if (diff) {
     VBDEBUG(("In RSAVerify(): Padding check failed!\n"));
     success = 0;
   }
 
   /* Check hash. */
-  if (SafeMemcmp(buf + padding_len, hash, sig_len - padding_len)) {
+  if (SafeMemcmp(buf + sig_len - hash_len, hash, hash_len)) {
     VBDEBUG(("In RSAVerify(): Hash check failed!\n"));
     success  = 0;
   }
-  VbExFree(buf);
 
   return success;
 }
+
+/* Verify a RSA PKCS1.5 signature against an expected hash.
+ * Returns 0 on failure, 1 on success.
+ */
+int RSAVerify(const RSAPublicKey *key,
+              const uint8_t *sig,
+              const uint32_t sig_len,
+              const uint8_t sig_type,
+              const uint8_t *hash) {
+  /* Words, so that checkPadding() can read them as such */
+  uint32_t words[VBOOT_RSA_MAX_WORDS];
+  uint8_t *buf = (uint8_t *)words;
+  int success;
+
+  if (!key || !sig || !hash)
+    return 0;
+
+  if (!checkVerifyArgs(key, sig_len, sig_type))
+    return 0;
+
+  VB_PROBE2(rsa_verify_entry, sig_type, sig_len);
+  Memcpy(buf, sig, sig_len);
+
+  CRYPTO_STATS_ADD(rsa_verify, 1);
+  modpowF4(key, buf);
+
+  success = checkPadding(buf, sig_len, sig_type, hash);
+  VB_PROBE1(rsa_verify_return, success);
+  return success;
+}
+
+int RSARecoverDigest(const RSAPublicKey *key,
+                     const uint8_t *sig,
+                     const uint32_t sig_len,
+                     const uint8_t sig_type,
+                     uint8_t *hash) {
+  uint32_t words[VBOOT_RSA_MAX_WORDS];
+  uint8_t *buf = (uint8_t *)words;
+  uint32_t hash_len;
+
+  if (!key || !sig || !hash)
+    return 0;
+
+  if (!checkVerifyArgs(key, sig_len, sig_type))
+    return 0;
+
+  Memcpy(buf, sig, sig_len);
+  CRYPTO_STATS_ADD(rsa_verify, 1);
+  modpowF4(key, buf);
+
+  /* The hash is whatever's at the end, so it can't fail to match that */
+  hash_len = hash_size_map[sig_type];
+  if (!checkPadding(buf, sig_len, sig_type, buf + sig_len - hash_len))
+    return 0;
+  Memcpy(hash, buf + sig_len - hash_len, hash_len);
+  return 1;
+}
+
+int RSAVerifyBatch(const RSAPublicKey *key,
+                   const uint8_t* const* sigs,
+                   const uint32_t sig_len,
+                   const uint8_t sig_type,
+                   const uint8_t* const* hashes,
+                   int count,
+                   int* results) {
+  uint32_t words[VBOOT_RSA_MAX_WORDS];
+  uint8_t *buf = (uint8_t *)words;
+  int good = 0;
+  int i;
+
+  if (!key || !sigs || !hashes || !results || count < 0)
+    return 0;
+
+  for (i = 0; i < count; ++i)
+    results[i] = 0;
+
+  /* These are the same for all of them, so only check once */
+  if (!checkVerifyArgs(key, sig_len, sig_type))
+    return 0;
+
+  for (i = 0; i < count; ++i) {
+    if (!sigs[i] || !hashes[i])
+      continue;
+    Memcpy(buf, sigs[i], sig_len);
+    CRYPTO_STATS_ADD(rsa_verify, 1);
+    modpowF4(key, buf);
+    results[i] = checkPadding(buf, sig_len, sig_type, hashes[i]);
+    good += results[i];
+  }
+
+  return good;
+}
@@ -14,7 +14,7 @@
 
 uint64_t RSAProcessedKeySize(uint64_t algorithm, uint64_t* out_size) {
   int key_len; /* Key length in bytes.  (int type matches siglen_map) */
-  if (algorithm < kNumAlgorithms) {
+  if (VBOOT_ALGORITHM_ENABLED(algorithm)) {
     key_len = siglen_map[algorithm];
     /* Total size needed by a RSAPublicKey buffer is =
      *  2 * key_len bytes for the  n and rr arrays
@@ -35,39 +35,48 @@ RSAPublicKey* RSAPublicKeyNew(void) {
   return key;
 }
 
+/* RSAPublicKeyFromBuf() puts n[] and rr[] in the same allocation as the
+ * key itself, right after it. */
+static uint32_t* RSAPublicKeyArrays(RSAPublicKey* key) {
+  return (uint32_t*)(key + 1);
+}
+
 void RSAPublicKeyFree(RSAPublicKey* key) {
   if (key) {
-    if (key->n)
+    if (key->n && key->n != RSAPublicKeyArrays(key))
       VbExFree(key->n);
-    if (key->rr)
+    if (key->rr && key->rr != RSAPublicKeyArrays(key) + key->len)
       VbExFree(key->rr);
     VbExFree(key);
   }
 }
 
 RSAPublicKey* RSAPublicKeyFromBuf(const uint8_t* buf, uint64_t len) {
-  RSAPublicKey* key = RSAPublicKeyNew();
+  RSAPublicKey* key;
   MemcpyState st;
+  uint32_t words;
   uint64_t key_len;
 
   StatefulInit(&st, (void*)buf, len);
 
-  StatefulMemcpy(&st, &key->len, sizeof(key->len));
+  StatefulMemcpy(&st, &words, sizeof(words));
   /* key length in bytes (avoiding possible 32-bit rollover) */
-  key_len = key->len;
+  key_len = words;
   key_len *= sizeof(uint32_t);
 
   /* Sanity Check the key length. */
-  if (RSA1024NUMBYTES != key_len &&
-      RSA2048NUMBYTES != key_len &&
-      RSA4096NUMBYTES != key_len &&
-      RSA8192NUMBYTES != key_len) {
-    RSAPublicKeyFree(key);
+  if (!VBOOT_RSA_SIZE_ENABLED(key_len)) {
     return NULL;
   }
 
-  key->n = (uint32_t*) VbExMalloc(key_len);
-  key->rr = (uint32_t*) VbExMalloc(key_len);
+  /* One allocation for the key and both arrays.  sizeof(RSAPublicKey) is a
+   * multiple of its pointers' alignment, so the arrays stay aligned for
+   * modpowF4()'s 64-bit limbs. */
+  key = (RSAPublicKey*) VbExMalloc(sizeof(RSAPublicKey) + 2 * key_len);
+  key->len = words;
+  key->algorithm = kNumAlgorithms;
+  key->n = RSAPublicKeyArrays(key);
+  key->rr = key->n + words;
 
   StatefulMemcpy(&st, &key->n0inv, sizeof(key->n0inv));
   StatefulMemcpy(&st, key->n, key_len);
@@ -80,6 +89,36 @@ RSAPublicKey* RSAPublicKeyFromBuf(const uint8_t* buf, uint64_t len) {
   return key;
 }
 
+RSAPublicKey* RSAPublicKeyView(RSAPublicKey* view, const uint8_t* buf,
+                               uint64_t len) {
+  const uint8_t* arrays = buf + 2 * sizeof(uint32_t);
+  uint32_t words;
+  uint64_t key_len;
+
+  /* modpowF4() reads pairs of words as 64-bit limbs if it can, so don't
+   * settle for less */
+  if (len < 2 * sizeof(uint32_t) || ((size_t)arrays & 7))
+    return RSAPublicKeyFromBuf(buf, len);
+
+  Memcpy(&words, buf, sizeof(words));
+  key_len = (uint64_t)words * sizeof(uint32_t);
+  if (!VBOOT_RSA_SIZE_ENABLED(key_len) ||
+      len != 2 * sizeof(uint32_t) + 2 * key_len)
+    return NULL;
+
+  view->len = words;
+  Memcpy(&view->n0inv, buf + sizeof(uint32_t), sizeof(view->n0inv));
+  view->n = (uint32_t*)arrays;
+  view->rr = view->n + words;
+  view->algorithm = kNumAlgorithms;
+  return view;
+}
+
+void RSAPublicKeyViewFree(RSAPublicKey* key, RSAPublicKey* view) {
+  if (key != view)
+    RSAPublicKeyFree(key);
+}
+
 int RSAVerifyBinary_f(const uint8_t* key_blob,
                       const RSAPublicKey* key,
                       const uint8_t* buf,
@@ -87,7 +126,7 @@ int RSAVerifyBinary_f(const uint8_t* key_blob,
                       const uint8_t* sig,
                       unsigned int algorithm) {
   RSAPublicKey* verification_key = NULL;
-  uint8_t* digest = NULL;
+  uint8_t digest[SHA512_DIGEST_SIZE];
   uint64_t key_size;
   int sig_size;
   int success;
@@ -109,11 +148,10 @@ int RSAVerifyBinary_f(const uint8_t* key_blob,
   if (!verification_key)
     return 0;
 
-  digest = DigestBuf(buf, len, algorithm);
+  DigestBufInto(buf, len, algorithm, digest);
   success = RSAVerify(verification_key, sig, (uint32_t)sig_size,
                       (uint8_t)algorithm, digest);
 
-  VbExFree(digest);
   if (!key)
     RSAPublicKeyFree(verification_key);  /* Only free if we allocated it. */
   return success;
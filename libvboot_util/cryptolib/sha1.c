@@ -8,9 +8,178 @@
 
 #include "sysincludes.h"
 
+/* Host builds on x86 can hash several messages at once in AVX2 lanes, and
+ * can use the CPU's SHA-1 instructions when it has them, as can host builds
+ * on ARMv8. The choice is made at runtime so the same binary still works on
+ * older CPUs. */
+#if !defined(CHROMEOS_EC) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA1_MULTI_AVX2
+#define SHA1_HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif !defined(CHROMEOS_EC) && defined(__GNUC__) && defined(__aarch64__) && \
+    defined(__linux__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define SHA1_HW_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#endif
+
 #include "cryptolib.h"
 #include "utility.h"
 
+/* Only if something uses it; see VBOOT_SHA1_CODE in padding.h */
+#if VBOOT_SHA1_CODE
+
+
+#ifdef SHA1_HW_X86
+/* One group of four rounds, [j] being which (0 to 19). The rounds take
+ * their function from [f] (j / 5), which has to be a constant. */
+#define SHA1_HW_ROUNDS(j, f)                                                \
+  {                                                                         \
+    if (j < 4) {                                                            \
+      w[j & 3] = _mm_shuffle_epi8(                                          \
+          _mm_loadu_si128((const __m128i*) (message + (j << 4))), mask);    \
+    } else {                                                                \
+      w[j & 3] = _mm_sha1msg2_epu32(                                        \
+          _mm_xor_si128(_mm_sha1msg1_epu32(w[j & 3], w[(j + 1) & 3]),       \
+                        w[(j + 2) & 3]),                                    \
+          w[(j + 3) & 3]);                                                  \
+    }                                                                       \
+    e = j ? _mm_sha1nexte_epu32(e, w[j & 3]) : _mm_add_epi32(e, w[0]);     \
+    tmp = abcd;                                                             \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, f);                                 \
+    e = tmp;                                                                \
+  }
+
+__attribute__((target("sha,sse4.1")))
+static void SHA1_transform_hw(uint32_t* state, const uint8_t* message,
+                              uint64_t block_nb) {
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                      0x08090a0b0c0d0e0fULL);
+  __m128i abcd, e, abcd_save, e_save, tmp;
+  __m128i w[4];
+  uint64_t i;
+
+  /* The SHA instructions want A in the top lane, and E on its own there. */
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) state), 0x1B);
+  e = _mm_set_epi32(state[4], 0, 0, 0);
+
+  for (i = 0; i < block_nb; i++, message += 64) {
+    abcd_save = abcd;
+    e_save = e;
+
+    SHA1_HW_ROUNDS(0, 0); SHA1_HW_ROUNDS(1, 0); SHA1_HW_ROUNDS(2, 0);
+    SHA1_HW_ROUNDS(3, 0); SHA1_HW_ROUNDS(4, 0); SHA1_HW_ROUNDS(5, 1);
+    SHA1_HW_ROUNDS(6, 1); SHA1_HW_ROUNDS(7, 1); SHA1_HW_ROUNDS(8, 1);
+    SHA1_HW_ROUNDS(9, 1); SHA1_HW_ROUNDS(10, 2); SHA1_HW_ROUNDS(11, 2);
+    SHA1_HW_ROUNDS(12, 2); SHA1_HW_ROUNDS(13, 2); SHA1_HW_ROUNDS(14, 2);
+    SHA1_HW_ROUNDS(15, 3); SHA1_HW_ROUNDS(16, 3); SHA1_HW_ROUNDS(17, 3);
+    SHA1_HW_ROUNDS(18, 3); SHA1_HW_ROUNDS(19, 3);
+
+    /* What's left in [e] is A from before the last rounds, to make E of. */
+    e = _mm_sha1nexte_epu32(e, e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i*) state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = _mm_extract_epi32(e, 3);
+}
+
+static int SHA1_hw_probe(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+      !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+    return 0;
+  if (__get_cpuid_max(0, 0) < 7)
+    return 0;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1 << 29)) != 0;  /* SHA extensions */
+}
+#endif /* SHA1_HW_X86 */
+
+#ifdef SHA1_HW_ARM
+static void SHA1_transform_hw(uint32_t* state, const uint8_t* message,
+                              uint64_t block_nb) {
+  static const uint32_t k[4] = {
+    0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
+  uint32x4_t abcd, abcd_save, wk;
+  uint32x4_t w[4];
+  uint32_t e, e_next, e_save;
+  uint64_t i;
+  int j;
+
+  abcd = vld1q_u32(state);
+  e = state[4];
+
+  for (i = 0; i < block_nb; i++, message += 64) {
+    abcd_save = abcd;
+    e_save = e;
+
+    for (j = 0; j < 20; j++) {
+      if (j < 4) {
+        w[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(message + (j << 4))));
+      } else {
+        w[j & 3] = vsha1su1q_u32(
+            vsha1su0q_u32(w[j & 3], w[(j + 1) & 3], w[(j + 2) & 3]),
+            w[(j + 3) & 3]);
+      }
+      wk = vaddq_u32(w[j & 3], vdupq_n_u32(k[j / 5]));
+      e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+      if (j < 5)
+        abcd = vsha1cq_u32(abcd, e, wk);
+      else if (j < 10 || j >= 15)
+        abcd = vsha1pq_u32(abcd, e, wk);
+      else
+        abcd = vsha1mq_u32(abcd, e, wk);
+      e = e_next;
+    }
+
+    abcd = vaddq_u32(abcd, abcd_save);
+    e += e_save;
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e;
+}
+
+static int SHA1_hw_probe(void) {
+  return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+#endif /* SHA1_HW_ARM */
+
+#if defined(SHA1_HW_X86) || defined(SHA1_HW_ARM)
+/* -1 until the first transform probes the CPU. Racing probes all store the
+ * same answer, so no locking is needed. */
+static int sha1_hw_usable = -1;
+
+static int SHA1_hw(void) {
+  if (sha1_hw_usable < 0)
+    sha1_hw_usable = SHA1_hw_probe();
+  return sha1_hw_usable;
+}
+
+/* Hashes as many whole blocks of [*data] as there are straight from where
+ * they are, if the CPU can, moving [*data] and [*len] past them. */
+static void SHA1_blocks_hw(SHA1_CTX* ctx, const uint8_t** data,
+                           uint64_t* len) {
+  uint64_t block_nb = *len >> 6;
+
+  if (!block_nb || !SHA1_hw())
+    return;
+  SHA1_transform_hw(ctx->state, *data, block_nb);
+  *data += block_nb << 6;
+  *len -= block_nb << 6;
+}
+#else
+#define SHA1_blocks_hw(ctx, data, len) do {} while (0)
+#endif
+
 
 /* Some machines lack byteswap.h and endian.h. These have to use the
  * slower code, even if they're little-endian.
@@ -36,6 +205,13 @@ static void SHA1_Transform(SHA1_CTX* ctx) {
   register uint32_t A, B, C, D, E;
   int t;
 
+#if defined(SHA1_HW_X86) || defined(SHA1_HW_ARM)
+  if (SHA1_hw()) {
+    SHA1_transform_hw(ctx->state, ctx->buf.b, 1);
+    return;
+  }
+#endif
+
   A = ctx->state[0];
   B = ctx->state[1];
   C = ctx->state[2];
@@ -139,6 +315,7 @@ void SHA1_update(SHA1_CTX* ctx, const uint8_t* data, uint64_t len) {
     p += sizeof(ctx->buf) - i;
     SHA1_Transform(ctx);
     i = 0;
+    SHA1_blocks_hw(ctx, &p, &len);
   }
 
   while (len--) {
@@ -181,6 +358,13 @@ static void SHA1_transform(SHA1_CTX *ctx) {
   uint8_t *p = ctx->buf;
   int t;
 
+#if defined(SHA1_HW_X86) || defined(SHA1_HW_ARM)
+  if (SHA1_hw()) {
+    SHA1_transform_hw(ctx->state, ctx->buf, 1);
+    return;
+  }
+#endif
+
   for(t = 0; t < 16; ++t) {
     uint32_t tmp =  *p++ << 24;
     tmp |= *p++ << 16;
@@ -231,11 +415,15 @@ void SHA1_update(SHA1_CTX *ctx, const uint8_t *data, uint64_t len) {
 
   ctx->count += len;
 
+  if (!i)
+    SHA1_blocks_hw(ctx, &p, &len);
+
   while (len--) {
     ctx->buf[i++] = *p++;
     if (i == sizeof(ctx->buf)) {
       SHA1_transform(ctx);
       i = 0;
+      SHA1_blocks_hw(ctx, &p, &len);
     }
   }
 }
@@ -287,3 +475,137 @@ uint8_t* internal_SHA1(const uint8_t *data, uint64_t len, uint8_t *digest) {
   }
   return digest;
 }
+
+
+#ifdef SHA1_MULTI_AVX2
+#define SHA1_LANES 8
+
+#define ROL_X8(bits, x) \
+  _mm256_or_si256(_mm256_slli_epi32(x, bits), _mm256_srli_epi32(x, 32 - (bits)))
+#define XOR3_X8(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define ADD_X8(x, y) _mm256_add_epi32(x, y)
+
+/* Runs [block_nb] blocks of each of the 8 messages in [message] through the
+ * interleaved state [state], one message per 32-bit lane. */
+__attribute__((target("avx2")))
+static void SHA1_transform_x8(__m256i* state, const uint8_t* const* message,
+                              uint64_t block_nb) {
+  __m256i W[80];
+  __m256i A, B, C, D, E, f, tmp;
+  uint32_t lane[SHA1_LANES];
+  uint64_t i;
+  int t, k;
+
+  for (i = 0; i < block_nb; i++) {
+    for (t = 0; t < 16; t++) {
+      for (k = 0; k < SHA1_LANES; k++) {
+        const uint8_t* p = &message[k][(i << 6) + (t << 2)];
+        lane[k] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+            ((uint32_t)p[2] << 8) | p[3];
+      }
+      W[t] = _mm256_loadu_si256((const __m256i*) lane);
+    }
+
+    for (; t < 80; t++) {
+      W[t] = ROL_X8(1, _mm256_xor_si256(XOR3_X8(W[t - 3], W[t - 8], W[t - 14]),
+                                        W[t - 16]));
+    }
+
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
+
+    for (t = 0; t < 80; t++) {
+      if (t < 20) {
+        f = _mm256_xor_si256(D, _mm256_and_si256(B, _mm256_xor_si256(C, D)));
+        f = ADD_X8(f, _mm256_set1_epi32(0x5A827999));
+      } else if (t < 40) {
+        f = ADD_X8(XOR3_X8(B, C, D), _mm256_set1_epi32(0x6ED9EBA1));
+      } else if (t < 60) {
+        f = _mm256_or_si256(_mm256_and_si256(B, C),
+                            _mm256_and_si256(D, _mm256_or_si256(B, C)));
+        f = ADD_X8(f, _mm256_set1_epi32(0x8F1BBCDC));
+      } else {
+        f = ADD_X8(XOR3_X8(B, C, D), _mm256_set1_epi32(0xCA62C1D6));
+      }
+      tmp = ADD_X8(ADD_X8(ROL_X8(5, A), E), ADD_X8(W[t], f));
+
+      E = D;
+      D = C;
+      C = ROL_X8(30, B);
+      B = A;
+      A = tmp;
+    }
+
+    state[0] = ADD_X8(state[0], A);
+    state[1] = ADD_X8(state[1], B);
+    state[2] = ADD_X8(state[2], C);
+    state[3] = ADD_X8(state[3], D);
+    state[4] = ADD_X8(state[4], E);
+  }
+}
+
+/* Hashes [count] (2 to SHA1_LANES) messages. The blocks all of them have in
+ * common go through the vector transform; each message's tail is then
+ * finished on its own. */
+__attribute__((target("avx2")))
+static void SHA1_multi_x8(const uint8_t* const* data, const uint64_t* len,
+                          int count, uint8_t** digest) {
+  __m256i state[5];
+  uint32_t lane[SHA1_LANES];
+  const uint8_t* message[SHA1_LANES];
+  uint64_t block_nb = len[0] >> 6;
+  const uint8_t* p;
+  SHA1_CTX ctx;
+  int i, k;
+
+  for (k = 1; k < count; k++) {
+    if ((len[k] >> 6) < block_nb)
+      block_nb = len[k] >> 6;
+  }
+
+  /* Unused lanes just shadow the first message. */
+  for (k = 0; k < SHA1_LANES; k++)
+    message[k] = data[k < count ? k : 0];
+
+  SHA1_init(&ctx);
+  for (i = 0; i < 5; i++)
+    state[i] = _mm256_set1_epi32(ctx.state[i]);
+  SHA1_transform_x8(state, message, block_nb);
+
+  for (k = 0; k < count; k++) {
+    for (i = 0; i < 5; i++) {
+      _mm256_storeu_si256((__m256i*) lane, state[i]);
+      ctx.state[i] = lane[k];
+    }
+    ctx.count = block_nb << 6;
+    SHA1_update(&ctx, data[k] + (block_nb << 6), len[k] - (block_nb << 6));
+    p = SHA1_final(&ctx);
+    for (i = 0; i < SHA1_DIGEST_SIZE; ++i) {
+      digest[k][i] = *p++;
+    }
+  }
+}
+#endif /* SHA1_MULTI_AVX2 */
+
+void SHA1_multi(const uint8_t* const* data, const uint64_t* len, int count,
+                uint8_t** digest) {
+  int i = 0;
+
+#ifdef SHA1_MULTI_AVX2
+  if (count > 1 && __builtin_cpu_supports("avx2")) {
+    for (; i + 1 < count; i += SHA1_LANES) {
+      SHA1_multi_x8(data + i, len + i,
+                    count - i < SHA1_LANES ? count - i : SHA1_LANES,
+                    digest + i);
+    }
+  }
+#endif
+
+  for (; i < count; i++)
+    internal_SHA1(data[i], len[i], digest[i]);
+}
+
+#endif  /* VBOOT_SHA1_CODE */
@@ -37,9 +37,30 @@
 
 #include "sysincludes.h"
 
+/* Host builds can use the CPU's SHA-256 instructions when it has them. The
+ * choice is made at runtime so the same binary still works on older CPUs. */
+#if !defined(CHROMEOS_EC) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA256_HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif !defined(CHROMEOS_EC) && defined(__GNUC__) && defined(__aarch64__) && \
+    defined(__linux__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define SHA256_HW_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
 #include "cryptolib.h"
 #include "utility.h"
 
+/* Only if something uses it; see VBOOT_SHA256_CODE in padding.h */
+#if VBOOT_SHA256_CODE
+
 #define SHFR(x, n)    (x >> n)
 #define ROTR(x, n)   ((x >> n) | (x << ((sizeof(x) << 3) - n)))
 #define ROTL(x, n)   ((x << n) | (x >> ((sizeof(x) << 3) - n)))
@@ -126,19 +147,138 @@ void SHA256_init(VB_SHA256_CTX *ctx) {
 }
 
 
+#ifdef SHA256_HW_X86
+__attribute__((target("sha,sse4.1")))
+static void SHA256_transform_hw(uint32_t* h, const uint8_t* message,
+                                uint64_t block_nb) {
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                      0x0405060700010203ULL);
+  __m128i state0, state1, abef, cdgh, msg, tmp;
+  __m128i w[4];
+  uint64_t i;
+  int j;
+
+  /* The SHA instructions want the state as ABEF / CDGH. */
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &h[0]), 0xB1);
+  state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &h[4]), 0x1B);
+  state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for (i = 0; i < block_nb; i++, message += 64) {
+    abef = state0;
+    cdgh = state1;
+
+    for (j = 0; j < 16; j++) {
+      if (j < 4) {
+        w[j] = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i*) (message + (j << 4))), mask);
+      } else {
+        tmp = _mm_alignr_epi8(w[(j + 3) & 3], w[(j + 2) & 3], 4);
+        w[j & 3] = _mm_sha256msg1_epu32(w[j & 3], w[(j + 1) & 3]);
+        w[j & 3] = _mm_add_epi32(w[j & 3], tmp);
+        w[j & 3] = _mm_sha256msg2_epu32(w[j & 3], w[(j + 3) & 3]);
+      }
+      msg = _mm_add_epi32(w[j & 3],
+                          _mm_loadu_si128((const __m128i*) &sha256_k[j << 2]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128((__m128i*) &h[0], state0);
+  _mm_storeu_si128((__m128i*) &h[4], state1);
+}
+
+static int SHA256_hw_probe(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+      !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+    return 0;
+  if (__get_cpuid_max(0, 0) < 7)
+    return 0;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1 << 29)) != 0;  /* SHA extensions */
+}
+#endif /* SHA256_HW_X86 */
+
+#ifdef SHA256_HW_ARM
+static void SHA256_transform_hw(uint32_t* h, const uint8_t* message,
+                                uint64_t block_nb) {
+  uint32x4_t state0, state1, abcd, efgh, msg, tmp;
+  uint32x4_t w[4];
+  uint64_t i;
+  int j;
+
+  state0 = vld1q_u32(&h[0]);
+  state1 = vld1q_u32(&h[4]);
+
+  for (i = 0; i < block_nb; i++, message += 64) {
+    abcd = state0;
+    efgh = state1;
+
+    for (j = 0; j < 16; j++) {
+      if (j < 4) {
+        w[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(message + (j << 4))));
+      } else {
+        w[j & 3] = vsha256su1q_u32(vsha256su0q_u32(w[j & 3], w[(j + 1) & 3]),
+                                   w[(j + 2) & 3], w[(j + 3) & 3]);
+      }
+      msg = vaddq_u32(w[j & 3], vld1q_u32(&sha256_k[j << 2]));
+      tmp = state0;
+      state0 = vsha256hq_u32(state0, state1, msg);
+      state1 = vsha256h2q_u32(state1, tmp, msg);
+    }
+
+    state0 = vaddq_u32(state0, abcd);
+    state1 = vaddq_u32(state1, efgh);
+  }
+
+  vst1q_u32(&h[0], state0);
+  vst1q_u32(&h[4], state1);
+}
+
+static int SHA256_hw_probe(void) {
+  return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+#endif /* SHA256_HW_ARM */
+
+#if defined(SHA256_HW_X86) || defined(SHA256_HW_ARM)
+/* -1 until the first transform probes the CPU. Racing probes all store the
+ * same answer, so no locking is needed. */
+static int sha256_hw_usable = -1;
+#endif
+
 static void SHA256_transform(VB_SHA256_CTX* ctx, const uint8_t* message,
-                             unsigned int block_nb) {
+                             uint64_t block_nb) {
   uint32_t w[64];
   uint32_t wv[8];
   uint32_t t1, t2;
   const unsigned char *sub_block;
-  int i;
+  uint64_t i;
 
 #ifndef UNROLL_LOOPS
   int j;
 #endif
 
-  for (i = 0; i < (int) block_nb; i++) {
+#if defined(SHA256_HW_X86) || defined(SHA256_HW_ARM)
+  if (sha256_hw_usable < 0)
+    sha256_hw_usable = SHA256_hw_probe();
+  if (sha256_hw_usable) {
+    SHA256_transform_hw(ctx->h, message, block_nb);
+    return;
+  }
+#endif
+
+  for (i = 0; i < block_nb; i++) {
     sub_block = message + (i << 6);
 
 #ifndef UNROLL_LOOPS
@@ -242,9 +382,9 @@ static void SHA256_transform(VB_SHA256_CTX* ctx, const uint8_t* message,
 
 
 
-void SHA256_update(VB_SHA256_CTX* ctx, const uint8_t* data, uint32_t len) {
-    unsigned int block_nb;
-    unsigned int new_len, rem_len, tmp_len;
+void SHA256_update(VB_SHA256_CTX* ctx, const uint8_t* data, uint64_t len) {
+    uint64_t block_nb;
+    uint64_t new_len, rem_len, tmp_len;
     const uint8_t *shifted_data;
 
     tmp_len = SHA256_BLOCK_SIZE - ctx->len;
@@ -277,7 +417,7 @@ void SHA256_update(VB_SHA256_CTX* ctx, const uint8_t* data, uint32_t len) {
 uint8_t* SHA256_final(VB_SHA256_CTX* ctx) {
     unsigned int block_nb;
     unsigned int pm_len;
-    unsigned int len_b;
+    uint64_t len_b;
 #ifndef UNROLL_LOOPS
     int i;
 #endif
@@ -290,7 +430,8 @@ uint8_t* SHA256_final(VB_SHA256_CTX* ctx) {
 
     Memset(ctx->block + ctx->len, 0, pm_len - ctx->len);
     ctx->block[ctx->len] = 0x80;
-    UNPACK32(len_b, ctx->block + pm_len - 4);
+    UNPACK32((uint32_t) (len_b >> 32), ctx->block + pm_len - 8);
+    UNPACK32((uint32_t) len_b, ctx->block + pm_len - 4);
 
     SHA256_transform(ctx, ctx->block, block_nb);
 
@@ -313,26 +454,12 @@ uint8_t* SHA256_final(VB_SHA256_CTX* ctx) {
 }
 
 uint8_t* internal_SHA256(const uint8_t* data, uint64_t len, uint8_t* digest) {
-  const uint8_t* input_ptr;
   const uint8_t* result;
-  uint64_t remaining_len;
   int i;
   VB_SHA256_CTX ctx;
 
   SHA256_init(&ctx);
-
-  input_ptr = data;
-  remaining_len = len;
-
-  /* Process data in at most UINT32_MAX byte chunks at a time. */
-  while (remaining_len) {
-    uint32_t block_size;
-    block_size = (uint32_t) ((remaining_len >= UINT32_MAX) ?
-                             UINT32_MAX : remaining_len);
-    SHA256_update(&ctx, input_ptr, block_size);
-    remaining_len -= block_size;
-    input_ptr += block_size;
-  }
+  SHA256_update(&ctx, data, len);
 
   result = SHA256_final(&ctx);
   for (i = 0; i < SHA256_DIGEST_SIZE; ++i) {
@@ -340,3 +467,5 @@ uint8_t* internal_SHA256(const uint8_t* data, uint64_t len, uint8_t* digest) {
   }
   return digest;
 }
+
+#endif  /* VBOOT_SHA256_CODE */
@@ -37,9 +37,38 @@
 
 #include "sysincludes.h"
 
+/* Host builds on x86 can hash several messages at once in AVX2 lanes, and
+ * can use the CPU's SHA-512 instructions when it and the compiler have them,
+ * as can host builds on ARMv8.2. Without them, x86 still works out the
+ * message schedule of two blocks at once with AVX2. The choice is made at
+ * runtime so the same binary still works on older CPUs. */
+#if !defined(CHROMEOS_EC) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA512_MULTI_AVX2
+#define SHA512_SCHED_AVX2
+#include <cpuid.h>
+#include <immintrin.h>
+#if defined(__has_include)
+#if __has_include(<sha512intrin.h>)
+#define SHA512_HW_X86
+#endif
+#endif
+#elif !defined(CHROMEOS_EC) && defined(__GNUC__) && defined(__aarch64__) && \
+    defined(__linux__) && defined(__ARM_FEATURE_SHA512)
+#define SHA512_HW_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA512
+#define HWCAP_SHA512 (1 << 21)
+#endif
+#endif
+
 #include "cryptolib.h"
 #include "utility.h"
 
+/* Only if something uses it; see VBOOT_SHA512_CODE in padding.h */
+#if VBOOT_SHA512_CODE
+
 #define SHFR(x, n)    (x >> n)
 #define ROTR(x, n)   ((x >> n) | (x << ((sizeof(x) << 3) - n)))
 #define ROTL(x, n)   ((x << n) | (x >> ((sizeof(x) << 3) - n)))
@@ -169,15 +198,254 @@ void SHA512_init(VB_SHA512_CTX *ctx) {
 }
 
 
+#ifdef SHA512_HW_X86
+__attribute__((target("sha512,avx2")))
+static void SHA512_transform_hw(uint64_t* h, const uint8_t* message,
+                                uint64_t block_nb) {
+  const __m256i mask = _mm256_set_epi64x(
+      0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL,
+      0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL);
+  __m256i state0, state1, abef, cdgh, msg, tmp;
+  __m256i w[4];
+  uint64_t i;
+  int j;
+
+  /* The SHA instructions want the state as ABEF / CDGH. */
+  state0 = _mm256_set_epi64x(h[0], h[1], h[4], h[5]);
+  state1 = _mm256_set_epi64x(h[2], h[3], h[6], h[7]);
+
+  for (i = 0; i < block_nb; i++, message += 128) {
+    abef = state0;
+    cdgh = state1;
+
+    for (j = 0; j < 20; j++) {
+      if (j < 4) {
+        w[j] = _mm256_shuffle_epi8(
+            _mm256_loadu_si256((const __m256i*) (message + (j << 5))), mask);
+      } else {
+        /* W[t-7] straddles the two groups before last */
+        tmp = _mm256_permute4x64_epi64(
+            _mm256_blend_epi32(w[(j + 2) & 3], w[(j + 3) & 3], 0x03), 0x39);
+        w[j & 3] = _mm256_sha512msg1_epi64(
+            w[j & 3], _mm256_castsi256_si128(w[(j + 1) & 3]));
+        w[j & 3] = _mm256_add_epi64(w[j & 3], tmp);
+        w[j & 3] = _mm256_sha512msg2_epi64(w[j & 3], w[(j + 3) & 3]);
+      }
+      msg = _mm256_add_epi64(w[j & 3],
+                             _mm256_loadu_si256(
+                                 (const __m256i*) &sha512_k[j << 2]));
+      state1 = _mm256_sha512rnds2_epi64(state1, state0,
+                                        _mm256_castsi256_si128(msg));
+      state0 = _mm256_sha512rnds2_epi64(state0, state1,
+                                        _mm256_extracti128_si256(msg, 1));
+    }
+
+    state0 = _mm256_add_epi64(state0, abef);
+    state1 = _mm256_add_epi64(state1, cdgh);
+  }
+
+  h[0] = _mm256_extract_epi64(state0, 3);
+  h[1] = _mm256_extract_epi64(state0, 2);
+  h[4] = _mm256_extract_epi64(state0, 1);
+  h[5] = _mm256_extract_epi64(state0, 0);
+  h[2] = _mm256_extract_epi64(state1, 3);
+  h[3] = _mm256_extract_epi64(state1, 2);
+  h[6] = _mm256_extract_epi64(state1, 1);
+  h[7] = _mm256_extract_epi64(state1, 0);
+}
+
+static int SHA512_hw_probe(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__builtin_cpu_supports("avx2") || __get_cpuid_max(0, 0) < 7)
+    return 0;
+  __cpuid_count(7, 1, eax, ebx, ecx, edx);
+  return (eax & 1) != 0;  /* SHA512 extensions */
+}
+#endif /* SHA512_HW_X86 */
+
+#ifdef SHA512_HW_ARM
+static void SHA512_transform_hw(uint64_t* h, const uint8_t* message,
+                                uint64_t block_nb) {
+  uint64x2_t ab, cd, ef, gh, ab_save, cd_save, ef_save, gh_save;
+  uint64x2_t wk, fg, de, tmp;
+  uint64x2_t w[8];
+  uint64_t i;
+  int j;
+
+  ab = vld1q_u64(&h[0]);
+  cd = vld1q_u64(&h[2]);
+  ef = vld1q_u64(&h[4]);
+  gh = vld1q_u64(&h[6]);
+
+  for (i = 0; i < block_nb; i++, message += 128) {
+    ab_save = ab;
+    cd_save = cd;
+    ef_save = ef;
+    gh_save = gh;
+
+    for (j = 0; j < 8; j++)
+      w[j] = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(message + (j << 4))));
+
+    /* Two rounds at a time, the words moving round one place each time */
+    for (j = 0; j < 40; j++) {
+      wk = vaddq_u64(w[j & 7], vld1q_u64(&sha512_k[j << 1]));
+      wk = vextq_u64(wk, wk, 1);
+      fg = vextq_u64(ef, gh, 1);
+      de = vextq_u64(cd, ef, 1);
+      gh = vaddq_u64(gh, wk);
+      if (j < 32) {
+        w[j & 7] = vsha512su1q_u64(vsha512su0q_u64(w[j & 7], w[(j + 1) & 7]),
+                                   w[(j + 7) & 7],
+                                   vextq_u64(w[(j + 4) & 7],
+                                             w[(j + 5) & 7], 1));
+      }
+      gh = vsha512hq_u64(gh, fg, de);
+      tmp = vaddq_u64(cd, gh);
+      gh = vsha512h2q_u64(gh, cd, ab);
+      cd = ab;
+      ab = gh;
+      gh = ef;
+      ef = tmp;
+    }
+
+    ab = vaddq_u64(ab, ab_save);
+    cd = vaddq_u64(cd, cd_save);
+    ef = vaddq_u64(ef, ef_save);
+    gh = vaddq_u64(gh, gh_save);
+  }
+
+  vst1q_u64(&h[0], ab);
+  vst1q_u64(&h[2], cd);
+  vst1q_u64(&h[4], ef);
+  vst1q_u64(&h[6], gh);
+}
+
+static int SHA512_hw_probe(void) {
+  return (getauxval(AT_HWCAP) & HWCAP_SHA512) != 0;
+}
+#endif /* SHA512_HW_ARM */
+
+#ifdef SHA512_SCHED_AVX2
+#define ROTR_SCHED(x, n) \
+  _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
+
+/* Runs two blocks at [message] through [h]. The message schedules of both
+ * are worked out together, two words of each at a time, with block one in
+ * the low half of each vector and block two in the high half; only the
+ * rounds are left to do one word at a time. */
+__attribute__((target("avx2")))
+static void SHA512_transform_sched2(uint64_t* h, const uint8_t* message) {
+  const __m256i mask = _mm256_set_epi64x(
+      0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL,
+      0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL);
+  __m256i w[40];
+  __m256i w2, w15, w7, s0, s1;
+  uint64_t wk[2][80];
+  uint64_t wv[8];
+  uint64_t t1, t2;
+  int b, j;
+
+  for (j = 0; j < 8; j++) {
+    w[j] = _mm256_shuffle_epi8(
+        _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i*) (message + (j << 4)))),
+            _mm_loadu_si128((const __m128i*) (message + 128 + (j << 4))), 1),
+        mask);
+  }
+
+  for (j = 8; j < 40; j++) {
+    w2 = w[j - 1];
+    w7 = _mm256_alignr_epi8(w[j - 3], w[j - 4], 8);
+    w15 = _mm256_alignr_epi8(w[j - 7], w[j - 8], 8);
+    s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR_SCHED(w2, 19),
+                                           ROTR_SCHED(w2, 61)),
+                          _mm256_srli_epi64(w2, 6));
+    s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR_SCHED(w15, 1),
+                                           ROTR_SCHED(w15, 8)),
+                          _mm256_srli_epi64(w15, 7));
+    w[j] = _mm256_add_epi64(_mm256_add_epi64(s1, w7),
+                            _mm256_add_epi64(s0, w[j - 8]));
+  }
+
+  for (j = 0; j < 40; j++) {
+    s0 = _mm256_add_epi64(w[j], _mm256_set_epi64x(
+        sha512_k[(j << 1) + 1], sha512_k[j << 1],
+        sha512_k[(j << 1) + 1], sha512_k[j << 1]));
+    _mm_storeu_si128((__m128i*) &wk[0][j << 1],
+                     _mm256_castsi256_si128(s0));
+    _mm_storeu_si128((__m128i*) &wk[1][j << 1],
+                     _mm256_extracti128_si256(s0, 1));
+  }
+
+  for (b = 0; b < 2; b++) {
+    for (j = 0; j < 8; j++)
+      wv[j] = h[j];
+
+    for (j = 0; j < 80; j++) {
+      t1 = wv[7] + SHA512_F2(wv[4]) + CH(wv[4], wv[5], wv[6]) + wk[b][j];
+      t2 = SHA512_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
+      wv[7] = wv[6];
+      wv[6] = wv[5];
+      wv[5] = wv[4];
+      wv[4] = wv[3] + t1;
+      wv[3] = wv[2];
+      wv[2] = wv[1];
+      wv[1] = wv[0];
+      wv[0] = t1 + t2;
+    }
+
+    for (j = 0; j < 8; j++)
+      h[j] += wv[j];
+  }
+}
+#endif /* SHA512_SCHED_AVX2 */
+
+/* Which transform to use, -1 until the first transform probes the CPU.
+ * Racing probes all store the same answer, so no locking is needed. */
+#define SHA512_IMPL_C 0
+#define SHA512_IMPL_HW 1
+#define SHA512_IMPL_SCHED 2
+static int sha512_impl = -1;
+
+static int SHA512_probe(void) {
+#if defined(SHA512_HW_X86) || defined(SHA512_HW_ARM)
+  if (SHA512_hw_probe())
+    return SHA512_IMPL_HW;
+#endif
+#ifdef SHA512_SCHED_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    return SHA512_IMPL_SCHED;
+#endif
+  return SHA512_IMPL_C;
+}
+
 static void SHA512_transform(VB_SHA512_CTX* ctx, const uint8_t* message,
-                             unsigned int block_nb) {
+                             uint64_t block_nb) {
   uint64_t w[80];
   uint64_t wv[8];
   uint64_t t1, t2;
   const uint8_t *sub_block;
-  int i, j;
+  uint64_t i;
+  int j;
+
+  if (sha512_impl < 0)
+    sha512_impl = SHA512_probe();
+#if defined(SHA512_HW_X86) || defined(SHA512_HW_ARM)
+  if (sha512_impl == SHA512_IMPL_HW) {
+    SHA512_transform_hw(ctx->h, message, block_nb);
+    return;
+  }
+#endif
+#ifdef SHA512_SCHED_AVX2
+  if (sha512_impl == SHA512_IMPL_SCHED) {
+    for (; block_nb >= 2; block_nb -= 2, message += 2 << 7)
+      SHA512_transform_sched2(ctx->h, message);
+  }
+#endif
 
-  for (i = 0; i < (int) block_nb; i++) {
+  for (i = 0; i < block_nb; i++) {
     sub_block = message + (i << 7);
 
 #ifdef UNROLL_LOOPS_SHA512
@@ -264,9 +532,9 @@ static void SHA512_transform(VB_SHA512_CTX* ctx, const uint8_t* message,
 
 
 void SHA512_update(VB_SHA512_CTX* ctx, const uint8_t* data,
-                   uint32_t len) {
-    unsigned int block_nb;
-    unsigned int new_len, rem_len, tmp_len;
+                   uint64_t len) {
+    uint64_t block_nb;
+    uint64_t new_len, rem_len, tmp_len;
     const uint8_t* shifted_data;
 
     tmp_len = SHA512_BLOCK_SIZE - ctx->len;
@@ -300,7 +568,7 @@ uint8_t* SHA512_final(VB_SHA512_CTX* ctx)
 {
     unsigned int block_nb;
     unsigned int pm_len;
-    unsigned int len_b;
+    uint64_t len_b;
 
 #ifndef UNROLL_LOOPS_SHA512
     int i;
@@ -314,7 +582,8 @@ uint8_t* SHA512_final(VB_SHA512_CTX* ctx)
 
     Memset(ctx->block + ctx->len, 0, pm_len - ctx->len);
     ctx->block[ctx->len] = 0x80;
-    UNPACK32(len_b, ctx->block + pm_len - 4);
+    UNPACK32((uint32_t) (len_b >> 32), ctx->block + pm_len - 8);
+    UNPACK32((uint32_t) len_b, ctx->block + pm_len - 4);
 
     SHA512_transform(ctx, ctx->block, block_nb);
 
@@ -336,30 +605,146 @@ uint8_t* SHA512_final(VB_SHA512_CTX* ctx)
 }
 
 
-uint8_t* internal_SHA512(const uint8_t* data, uint64_t len, uint8_t* digest) {
-  const uint8_t* input_ptr;
+/* Feeds [len] bytes to [ctx] and writes the final digest to [digest]. */
+static void SHA512_finish(VB_SHA512_CTX* ctx, const uint8_t* data,
+                          uint64_t len, uint8_t* digest) {
   const uint8_t* result;
-  uint64_t remaining_len;
   int i;
+
+  SHA512_update(ctx, data, len);
+  result = SHA512_final(ctx);
+  for (i = 0; i < SHA512_DIGEST_SIZE; ++i) {
+    digest[i] = *result++;
+  }
+}
+
+uint8_t* internal_SHA512(const uint8_t* data, uint64_t len, uint8_t* digest) {
   VB_SHA512_CTX ctx;
   SHA512_init(&ctx);
+  SHA512_finish(&ctx, data, len, digest);
+  return digest;
+}
+
+
+#ifdef SHA512_MULTI_AVX2
+#define SHA512_LANES 4
+
+#define ROTR_X4(x, n) \
+  _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
+#define SHFR_X4(x, n) _mm256_srli_epi64(x, n)
+#define XOR3_X4(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define ADD_X4(x, y) _mm256_add_epi64(x, y)
+
+#define SHA512_F1_X4(x) XOR3_X4(ROTR_X4(x, 28), ROTR_X4(x, 34), ROTR_X4(x, 39))
+#define SHA512_F2_X4(x) XOR3_X4(ROTR_X4(x, 14), ROTR_X4(x, 18), ROTR_X4(x, 41))
+#define SHA512_F3_X4(x) XOR3_X4(ROTR_X4(x,  1), ROTR_X4(x,  8), SHFR_X4(x,  7))
+#define SHA512_F4_X4(x) XOR3_X4(ROTR_X4(x, 19), ROTR_X4(x, 61), SHFR_X4(x,  6))
+
+/* Runs [block_nb] blocks of each of the 4 messages in [message] through the
+ * interleaved state [h], one message per 64-bit lane. */
+__attribute__((target("avx2")))
+static void SHA512_transform_x4(__m256i* h, const uint8_t* const* message,
+                                uint64_t block_nb) {
+  __m256i w[80];
+  __m256i a, b, c, d, e, f, g, hh, t1, t2;
+  uint64_t lane[SHA512_LANES];
+  uint64_t i;
+  int j, k;
+
+  for (i = 0; i < block_nb; i++) {
+    for (j = 0; j < 16; j++) {
+      for (k = 0; k < SHA512_LANES; k++)
+        PACK64(&message[k][(i << 7) + (j << 3)], &lane[k]);
+      w[j] = _mm256_loadu_si256((const __m256i*) lane);
+    }
 
-  input_ptr = data;
-  remaining_len = len;
-
-  /* Process data in at most UINT32_MAX byte chunks at a time. */
-  while (remaining_len) {
-    uint32_t block_size;
-    block_size = (uint32_t) ((remaining_len >= UINT32_MAX) ?
-                             UINT32_MAX : remaining_len);
-       SHA512_update(&ctx, input_ptr, block_size);
-    remaining_len -= block_size;
-    input_ptr += block_size;
+    for (j = 16; j < 80; j++) {
+      w[j] = ADD_X4(ADD_X4(SHA512_F4_X4(w[j - 2]), w[j - 7]),
+                    ADD_X4(SHA512_F3_X4(w[j - 15]), w[j - 16]));
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+
+    for (j = 0; j < 80; j++) {
+      t1 = ADD_X4(ADD_X4(hh, SHA512_F2_X4(e)),
+                  _mm256_xor_si256(_mm256_and_si256(e, f),
+                                   _mm256_andnot_si256(e, g)));
+      t1 = ADD_X4(t1, ADD_X4(_mm256_set1_epi64x(sha512_k[j]), w[j]));
+      t2 = ADD_X4(SHA512_F1_X4(a),
+                  _mm256_or_si256(_mm256_and_si256(a, b),
+                                  _mm256_and_si256(c, _mm256_or_si256(a, b))));
+      hh = g;
+      g = f;
+      f = e;
+      e = ADD_X4(d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = ADD_X4(t1, t2);
+    }
+
+    h[0] = ADD_X4(h[0], a); h[1] = ADD_X4(h[1], b);
+    h[2] = ADD_X4(h[2], c); h[3] = ADD_X4(h[3], d);
+    h[4] = ADD_X4(h[4], e); h[5] = ADD_X4(h[5], f);
+    h[6] = ADD_X4(h[6], g); h[7] = ADD_X4(h[7], hh);
   }
+}
 
-  result = SHA512_final(&ctx);
-  for (i = 0; i < SHA512_DIGEST_SIZE; ++i) {
-    digest[i] = *result++;
+/* Hashes [count] (2 to SHA512_LANES) messages. The blocks all of them have
+ * in common go through the vector transform; each message's tail is then
+ * finished on its own. */
+__attribute__((target("avx2")))
+static void SHA512_multi_x4(const uint8_t* const* data, const uint64_t* len,
+                            int count, uint8_t** digest) {
+  __m256i h[8];
+  uint64_t lane[SHA512_LANES];
+  const uint8_t* message[SHA512_LANES];
+  uint64_t block_nb = len[0] >> 7;
+  VB_SHA512_CTX ctx;
+  int j, k;
+
+  for (k = 1; k < count; k++) {
+    if ((len[k] >> 7) < block_nb)
+      block_nb = len[k] >> 7;
+  }
+  /* Unused lanes just shadow the first message. */
+  for (k = 0; k < SHA512_LANES; k++)
+    message[k] = data[k < count ? k : 0];
+
+  for (j = 0; j < 8; j++)
+    h[j] = _mm256_set1_epi64x(sha512_h0[j]);
+  SHA512_transform_x4(h, message, block_nb);
+
+  for (k = 0; k < count; k++) {
+    for (j = 0; j < 8; j++) {
+      _mm256_storeu_si256((__m256i*) lane, h[j]);
+      ctx.h[j] = lane[k];
+    }
+    ctx.len = 0;
+    ctx.tot_len = block_nb << 7;
+    SHA512_finish(&ctx, data[k] + (block_nb << 7), len[k] - (block_nb << 7),
+                  digest[k]);
   }
-  return digest;
 }
+#endif /* SHA512_MULTI_AVX2 */
+
+void SHA512_multi(const uint8_t* const* data, const uint64_t* len, int count,
+                  uint8_t** digest) {
+  int i = 0;
+
+#ifdef SHA512_MULTI_AVX2
+  if (count > 1 && __builtin_cpu_supports("avx2")) {
+    for (; i + 1 < count; i += SHA512_LANES) {
+      SHA512_multi_x4(data + i, len + i,
+                      count - i < SHA512_LANES ? count - i : SHA512_LANES,
+                      digest + i);
+    }
+  }
+#endif
+
+  for (; i < count; i++)
+    internal_SHA512(data[i], len[i], digest[i]);
+}
+
+#endif  /* VBOOT_SHA512_CODE */
@@ -10,109 +10,238 @@
 #include "cryptolib.h"
 #include "utility.h"
 #include "vboot_api.h"
+#include "vboot_probe.h"
+
+#ifndef CHROMEOS_EC
+CryptoStats* crypto_stats;
+__thread CryptoStats* crypto_thread_stats;
+const CryptoProvider* crypto_provider;
+#endif
 
 void DigestInit(DigestContext* ctx, int sig_algorithm) {
   ctx->algorithm = hash_type_map[sig_algorithm];
   switch(ctx->algorithm) {
-#ifndef CHROMEOS_EC
+#if VBOOT_SHA1_CODE
     case SHA1_DIGEST_ALGORITHM:
-      ctx->sha1_ctx = (SHA1_CTX*) VbExMalloc(sizeof(SHA1_CTX));
-      SHA1_init(ctx->sha1_ctx);
+      SHA1_init(&ctx->u.sha1_ctx);
       break;
 #endif
+#if VBOOT_SHA256_CODE
     case SHA256_DIGEST_ALGORITHM:
-      ctx->sha256_ctx = (VB_SHA256_CTX*) VbExMalloc(sizeof(VB_SHA256_CTX));
-      SHA256_init(ctx->sha256_ctx);
+      SHA256_init(&ctx->u.sha256_ctx);
       break;
-#ifndef CHROMEOS_EC
+#endif
+#if VBOOT_SHA512_CODE
     case SHA512_DIGEST_ALGORITHM:
-      ctx->sha512_ctx = (VB_SHA512_CTX*) VbExMalloc(sizeof(VB_SHA512_CTX));
-      SHA512_init(ctx->sha512_ctx);
+      SHA512_init(&ctx->u.sha512_ctx);
       break;
 #endif
   };
 }
 
-void DigestUpdate(DigestContext* ctx, const uint8_t* data, uint32_t len) {
+void DigestUpdate(DigestContext* ctx, const uint8_t* data, uint64_t len) {
+  CRYPTO_STATS_ADD(digest_bytes, len);
+  VB_PROBE2(digest_update, ctx->algorithm, len);
   switch(ctx->algorithm) {
-#ifndef CHROMEOS_EC
+#if VBOOT_SHA1_CODE
     case SHA1_DIGEST_ALGORITHM:
-      SHA1_update(ctx->sha1_ctx, data, len);
+      SHA1_update(&ctx->u.sha1_ctx, data, len);
       break;
 #endif
+#if VBOOT_SHA256_CODE
     case SHA256_DIGEST_ALGORITHM:
-      SHA256_update(ctx->sha256_ctx, data, len);
+      SHA256_update(&ctx->u.sha256_ctx, data, len);
       break;
-#ifndef CHROMEOS_EC
+#endif
+#if VBOOT_SHA512_CODE
+    case SHA512_DIGEST_ALGORITHM:
+      SHA512_update(&ctx->u.sha512_ctx, data, len);
+      break;
+#endif
+  };
+}
+
+void DigestFinalInto(DigestContext* ctx, uint8_t* digest) {
+  VB_PROBE1(digest_final_entry, ctx->algorithm);
+  switch(ctx->algorithm) {
+#if VBOOT_SHA1_CODE
+    case SHA1_DIGEST_ALGORITHM:
+      Memcpy(digest, SHA1_final(&ctx->u.sha1_ctx), SHA1_DIGEST_SIZE);
+      break;
+#endif
+#if VBOOT_SHA256_CODE
+    case SHA256_DIGEST_ALGORITHM:
+      Memcpy(digest, SHA256_final(&ctx->u.sha256_ctx), SHA256_DIGEST_SIZE);
+      break;
+#endif
+#if VBOOT_SHA512_CODE
     case SHA512_DIGEST_ALGORITHM:
-      SHA512_update(ctx->sha512_ctx, data, len);
+      Memcpy(digest, SHA512_final(&ctx->u.sha512_ctx), SHA512_DIGEST_SIZE);
       break;
 #endif
   };
+  VB_PROBE1(digest_final_return, ctx->algorithm);
 }
 
 uint8_t* DigestFinal(DigestContext* ctx) {
   uint8_t* digest = NULL;
   switch(ctx->algorithm) {
-#ifndef CHROMEOS_EC
+#if VBOOT_SHA1_CODE
     case SHA1_DIGEST_ALGORITHM:
       digest = (uint8_t*) VbExMalloc(SHA1_DIGEST_SIZE);
-      Memcpy(digest, SHA1_final(ctx->sha1_ctx), SHA1_DIGEST_SIZE);
-      VbExFree(ctx->sha1_ctx);
       break;
 #endif
+#if VBOOT_SHA256_CODE
     case SHA256_DIGEST_ALGORITHM:
       digest = (uint8_t*) VbExMalloc(SHA256_DIGEST_SIZE);
-      Memcpy(digest, SHA256_final(ctx->sha256_ctx), SHA256_DIGEST_SIZE);
-      VbExFree(ctx->sha256_ctx);
       break;
-#ifndef CHROMEOS_EC
+#endif
+#if VBOOT_SHA512_CODE
     case SHA512_DIGEST_ALGORITHM:
       digest = (uint8_t*) VbExMalloc(SHA512_DIGEST_SIZE);
-      Memcpy(digest, SHA512_final(ctx->sha512_ctx), SHA512_DIGEST_SIZE);
-      VbExFree(ctx->sha512_ctx);
       break;
 #endif
   };
+  if (digest)
+    DigestFinalInto(ctx, digest);
   return digest;
 }
 
-uint8_t* DigestBuf(const uint8_t* buf, uint64_t len, int sig_algorithm) {
-  /* Allocate enough space for the largest digest */
-  uint8_t* digest = (uint8_t*) VbExMalloc(SHA512_DIGEST_SIZE);
+/* Entries for the hashes a build leaves out are NULL, so that nothing
+ * refers to them. Callers wanting just a hash pass its
+ * SHA*_DIGEST_ALGORITHM, which picks the RSA1024 entry for it, so the
+ * entries go by the hash rather than by VBOOT_ALGORITHM_ENABLED(). */
+#define HASH_FN(code, fn) ((code) ? (fn) : 0)
+
+uint8_t* DigestBufInto(const uint8_t* buf, uint64_t len, int sig_algorithm,
+                       uint8_t* digest) {
   /* Define an array mapping [sig_algorithm] to function pointers to the
    * SHA{1|256|512} functions.
    */
   typedef uint8_t* (*Hash_ptr) (const uint8_t*, uint64_t, uint8_t*);
-  Hash_ptr hash[] = {
-#ifdef CHROMEOS_EC
-    0,  /* RSA 1024 */
-    0,
-    0,
-    0,  /* RSA 2048 */
-    0,
-    0,
-    0,  /* RSA 4096 */
-    internal_SHA256,
-    0,
-    0,  /* RSA 8192 */
-    0,
-    0,
-#else
-    internal_SHA1,  /* RSA 1024 */
-    internal_SHA256,
-    internal_SHA512,
-    internal_SHA1,  /* RSA 2048 */
-    internal_SHA256,
-    internal_SHA512,
-    internal_SHA1,  /* RSA 4096 */
-    internal_SHA256,
-    internal_SHA512,
-    internal_SHA1,  /* RSA 8192 */
-    internal_SHA256,
-    internal_SHA512,
-#endif
+  static const Hash_ptr hash[] = {
+    HASH_FN(VBOOT_SHA1_CODE, internal_SHA1),  /* RSA 1024 */
+    HASH_FN(VBOOT_SHA256_CODE, internal_SHA256),
+    HASH_FN(VBOOT_SHA512_CODE, internal_SHA512),
+    HASH_FN(VBOOT_SHA1_CODE, internal_SHA1),  /* RSA 2048 */
+    HASH_FN(VBOOT_SHA256_CODE, internal_SHA256),
+    HASH_FN(VBOOT_SHA512_CODE, internal_SHA512),
+    HASH_FN(VBOOT_SHA1_CODE, internal_SHA1),  /* RSA 4096 */
+    HASH_FN(VBOOT_SHA256_CODE, internal_SHA256),
+    HASH_FN(VBOOT_SHA512_CODE, internal_SHA512),
+    HASH_FN(VBOOT_SHA1_CODE, internal_SHA1),  /* RSA 8192 */
+    HASH_FN(VBOOT_SHA256_CODE, internal_SHA256),
+    HASH_FN(VBOOT_SHA512_CODE, internal_SHA512),
   };
   /* Call the appropriate hash function. */
-  return hash[sig_algorithm](buf, len, digest);
+  CRYPTO_STATS_ADD(digest_bytes, len);
+  VB_PROBE2(digest_buf_entry, sig_algorithm, len);
+#ifndef CHROMEOS_EC
+  if (crypto_provider && crypto_provider->digest_buf &&
+      !crypto_provider->digest_buf(buf, len, hash_type_map[sig_algorithm],
+                                   digest)) {
+    VB_PROBE1(digest_buf_return, sig_algorithm);
+    return digest;
+  }
+#endif
+  hash[sig_algorithm](buf, len, digest);
+  VB_PROBE1(digest_buf_return, sig_algorithm);
+  return digest;
+}
+
+uint8_t* DigestBuf(const uint8_t* buf, uint64_t len, int sig_algorithm) {
+  /* Allocate enough space for the largest digest */
+  uint8_t* digest = (uint8_t*) VbExMalloc(SHA512_DIGEST_SIZE);
+  return DigestBufInto(buf, len, sig_algorithm, digest);
+}
+
+int DigestBufMulti(const uint8_t* const* bufs, const uint64_t* lens,
+                   int count, int sig_algorithm, uint8_t** digests) {
+  int i;
+
+  for (i = 0; i < count; i++)
+    CRYPTO_STATS_ADD(digest_bytes, lens[i]);
+
+  switch(hash_type_map[sig_algorithm]) {
+#if VBOOT_SHA1_CODE
+    case SHA1_DIGEST_ALGORITHM:
+      SHA1_multi(bufs, lens, count, digests);
+      return 0;
+#endif
+#if VBOOT_SHA256_CODE
+    case SHA256_DIGEST_ALGORITHM:
+      /* Single-stream hardware SHA-256 beats lane interleaving. */
+      for (i = 0; i < count; i++)
+        internal_SHA256(bufs[i], lens[i], digests[i]);
+      return 0;
+#endif
+#if VBOOT_SHA512_CODE
+    case SHA512_DIGEST_ALGORITHM:
+      SHA512_multi(bufs, lens, count, digests);
+      return 0;
+#endif
+  };
+  return 1;
+}
+
+void DigestMulti(const uint8_t* buf, uint64_t len, uint32_t algorithms,
+                 uint8_t** digests) {
+#if VBOOT_SHA1_CODE
+  SHA1_CTX sha1_ctx;
+#endif
+#if VBOOT_SHA256_CODE
+  VB_SHA256_CTX sha256_ctx;
+#endif
+#if VBOOT_SHA512_CODE
+  VB_SHA512_CTX sha512_ctx;
+#endif
+  uint64_t n;
+
+  CRYPTO_STATS_ADD(digest_bytes, len);
+
+#if VBOOT_SHA1_CODE
+  if (algorithms & (1 << SHA1_DIGEST_ALGORITHM))
+    SHA1_init(&sha1_ctx);
+#endif
+#if VBOOT_SHA512_CODE
+  if (algorithms & (1 << SHA512_DIGEST_ALGORITHM))
+    SHA512_init(&sha512_ctx);
+#endif
+#if VBOOT_SHA256_CODE
+  if (algorithms & (1 << SHA256_DIGEST_ALGORITHM))
+    SHA256_init(&sha256_ctx);
+#endif
+
+  /* Each piece is read from memory once, then hashed from the cache */
+  for (; len; buf += n, len -= n) {
+    n = len < DIGEST_MULTI_CHUNK ? len : DIGEST_MULTI_CHUNK;
+#if VBOOT_SHA1_CODE
+    if (algorithms & (1 << SHA1_DIGEST_ALGORITHM))
+      SHA1_update(&sha1_ctx, buf, n);
+#endif
+#if VBOOT_SHA512_CODE
+    if (algorithms & (1 << SHA512_DIGEST_ALGORITHM))
+      SHA512_update(&sha512_ctx, buf, n);
+#endif
+#if VBOOT_SHA256_CODE
+    if (algorithms & (1 << SHA256_DIGEST_ALGORITHM))
+      SHA256_update(&sha256_ctx, buf, n);
+#endif
+  }
+
+#if VBOOT_SHA1_CODE
+  if (algorithms & (1 << SHA1_DIGEST_ALGORITHM))
+    Memcpy(digests[SHA1_DIGEST_ALGORITHM], SHA1_final(&sha1_ctx),
+           SHA1_DIGEST_SIZE);
+#endif
+#if VBOOT_SHA512_CODE
+  if (algorithms & (1 << SHA512_DIGEST_ALGORITHM))
+    Memcpy(digests[SHA512_DIGEST_ALGORITHM], SHA512_final(&sha512_ctx),
+           SHA512_DIGEST_SIZE);
+#endif
+#if VBOOT_SHA256_CODE
+  if (algorithms & (1 << SHA256_DIGEST_ALGORITHM))
+    Memcpy(digests[SHA256_DIGEST_ALGORITHM], SHA256_final(&sha256_ctx),
+           SHA256_DIGEST_SIZE);
+#endif
 }
@@ -13,6 +13,94 @@
 #include "vboot_api.h"
 
 
+/*
+ * Read one GPT header, and its entries if they're right next to it, in a
+ * single read of [spec_sectors] starting at [spec_lba]. The header is at
+ * [header_lba]. Returns a buffer holding it all for FinishGptEntries(), or
+ * NULL if error.
+ */
+static uint8_t *ReadGptHeaderAndMaybeEntries(VbExDiskHandle_t disk_handle,
+					     GptData *gptdata,
+					     uint64_t spec_lba,
+					     uint64_t spec_sectors,
+					     uint64_t header_lba,
+					     uint8_t *header)
+{
+	uint8_t *buf;
+
+	buf = (uint8_t *)VbExMalloc(spec_sectors * gptdata->sector_bytes);
+	if (!buf)
+		return NULL;
+	if (0 != VbExDiskRead(disk_handle, spec_lba, spec_sectors, buf)) {
+		VbExFree(buf);
+		return NULL;
+	}
+	Memcpy(header, buf + (header_lba - spec_lba) * gptdata->sector_bytes,
+	       gptdata->sector_bytes);
+	return buf;
+}
+
+/*
+ * Fill [entries] for a valid [h], from [buf] (read from [spec_lba] on) if the
+ * entries were in it, or else from the drive. Returns 0 if successful.
+ */
+static int FinishGptEntries(VbExDiskHandle_t disk_handle, GptData *gptdata,
+			    const GptHeader *h, const uint8_t *buf,
+			    uint64_t spec_lba, uint64_t spec_sectors,
+			    uint8_t *entries)
+{
+	uint64_t entries_bytes = h->number_of_entries * h->size_of_entry;
+	uint64_t entries_sectors = entries_bytes / gptdata->sector_bytes;
+
+	if (h->entries_lba >= spec_lba &&
+	    h->entries_lba + entries_sectors <= spec_lba + spec_sectors) {
+		Memcpy(entries,
+		       buf + (h->entries_lba - spec_lba) * gptdata->sector_bytes,
+		       entries_sectors * gptdata->sector_bytes);
+		return 0;
+	}
+
+	VBDEBUG(("GPT entries aren't next to their header\n"));
+	return VbExDiskRead(disk_handle, h->entries_lba, entries_sectors,
+			    entries) ? 1 : 0;
+}
+
+/* Does [cache] hold the GPT for this disk and geometry? */
+static int GptCacheMatches(const GptCache *cache,
+			   VbExDiskHandle_t disk_handle,
+			   const GptData *gptdata)
+{
+	return cache && cache->data &&
+		cache->disk_handle == disk_handle &&
+		cache->sector_bytes == gptdata->sector_bytes &&
+		cache->streaming_drive_sectors ==
+		gptdata->streaming_drive_sectors &&
+		cache->gpt_drive_sectors == gptdata->gpt_drive_sectors &&
+		cache->flags == (gptdata->flags & ~GPT_FLAG_VALIDATED);
+}
+
+void GptCacheFree(GptCache *cache)
+{
+	if (cache->data)
+		VbExFree(cache->data);
+	Memset(cache, 0, sizeof(*cache));
+}
+
+/* Allocate the four GPT buffers, with room for [entries_bytes] of entries */
+static int AllocGptBuffers(GptData *gptdata, uint64_t entries_bytes)
+{
+	gptdata->primary_header = (uint8_t *)VbExMalloc(gptdata->sector_bytes);
+	gptdata->secondary_header =
+		(uint8_t *)VbExMalloc(gptdata->sector_bytes);
+	gptdata->primary_entries = (uint8_t *)VbExMalloc(entries_bytes);
+	gptdata->secondary_entries = (uint8_t *)VbExMalloc(entries_bytes);
+
+	return (gptdata->primary_header == NULL ||
+		gptdata->secondary_header == NULL ||
+		gptdata->primary_entries == NULL ||
+		gptdata->secondary_entries == NULL);
+}
+
 /**
  * Allocate and read GPT data from the drive.
  *
@@ -22,77 +110,221 @@
  * Returns 0 if successful, 1 if error.
  */
 int AllocAndReadGptData(VbExDiskHandle_t disk_handle, GptData *gptdata)
+{
+	return AllocAndReadGptDataCached(disk_handle, gptdata, NULL);
+}
+
+int AllocAndReadGptDataCached(VbExDiskHandle_t disk_handle, GptData *gptdata,
+			      GptCache *cache)
 {
 	uint64_t max_entries_bytes = MAX_NUMBER_OF_ENTRIES * sizeof(GptEntry);
+	uint64_t spec_sectors, spec2_lba, entries_bytes = 0;
+	uint8_t *header1 = NULL, *header2 = NULL;
+	uint8_t *buf1 = NULL, *buf2 = NULL;
 	int primary_valid = 0, secondary_valid = 0;
+	GptHeader *h;
+	int ret = 1;
 
 	/* No data to be written yet */
 	gptdata->modified = 0;
+	gptdata->modified_entries_start = gptdata->modified_entries_end = 0;
+	gptdata->flags &= ~GPT_FLAG_VALIDATED;
+	gptdata->valid_headers = MASK_NONE;
+	gptdata->valid_entries = MASK_NONE;
+	gptdata->primary_header = NULL;
+	gptdata->secondary_header = NULL;
+	gptdata->primary_entries = NULL;
+	gptdata->secondary_entries = NULL;
 
-	/* Allocate all buffers */
-	gptdata->primary_header = (uint8_t *)VbExMalloc(gptdata->sector_bytes);
-	gptdata->secondary_header =
-		(uint8_t *)VbExMalloc(gptdata->sector_bytes);
-	gptdata->primary_entries = (uint8_t *)VbExMalloc(max_entries_bytes);
-	gptdata->secondary_entries = (uint8_t *)VbExMalloc(max_entries_bytes);
+	/* Reuse what we validated last time, if it's for this disk */
+	if (GptCacheMatches(cache, disk_handle, gptdata)) {
+		uint64_t n = cache->sector_bytes;
 
-	if (gptdata->primary_header == NULL ||
-	    gptdata->secondary_header == NULL ||
-	    gptdata->primary_entries == NULL ||
-	    gptdata->secondary_entries == NULL)
-		return 1;
+		if (AllocGptBuffers(gptdata, cache->entries_bytes))
+			return 1;
+		Memcpy(gptdata->primary_header, cache->data, n);
+		Memcpy(gptdata->secondary_header, cache->data + n, n);
+		Memcpy(gptdata->primary_entries, cache->data + 2 * n,
+		       cache->entries_bytes);
+		Memcpy(gptdata->secondary_entries,
+		       cache->data + 2 * n + cache->entries_bytes,
+		       cache->entries_bytes);
+		gptdata->flags |= GPT_FLAG_VALIDATED;
+		VBDEBUG(("Using cached GPT data\n"));
+		return 0;
+	}
+	if (cache)
+		GptCacheFree(cache);
+
+	/*
+	 * Normally each header sits next to its entries: the primary header
+	 * follows the protective MBR and is followed by its entries, and the
+	 * secondary entries are followed by the secondary header at the end of
+	 * the drive. So read each header together with as many sectors as the
+	 * largest table could need, on that side of it.
+	 */
+	spec_sectors = GPT_HEADER_SECTORS +
+		(max_entries_bytes + gptdata->sector_bytes - 1) /
+		gptdata->sector_bytes;
+	if (gptdata->gpt_drive_sectors < GPT_PMBR_SECTORS + 2 * spec_sectors)
+		spec_sectors = GPT_HEADER_SECTORS;
+	spec2_lba = gptdata->gpt_drive_sectors - spec_sectors;
+
+	header1 = (uint8_t *)VbExMalloc(gptdata->sector_bytes);
+	header2 = (uint8_t *)VbExMalloc(gptdata->sector_bytes);
+	if (!header1 || !header2)
+		goto out;
 
 	/* Read primary header from the drive, skipping the protective MBR */
-	if (0 != VbExDiskRead(disk_handle, 1, 1, gptdata->primary_header))
-		return 1;
+	buf1 = ReadGptHeaderAndMaybeEntries(disk_handle, gptdata, 1,
+					    spec_sectors, 1, header1);
+	if (!buf1)
+		goto out;
 
 	/* Only read primary GPT if the primary header is valid */
-	GptHeader* primary_header = (GptHeader*)gptdata->primary_header;
-	if (0 == CheckHeader(primary_header, 0,
+	h = (GptHeader *)header1;
+	if (0 == CheckHeader(h, 0,
 			gptdata->streaming_drive_sectors,
 			gptdata->gpt_drive_sectors,
 			gptdata->flags)) {
 		primary_valid = 1;
-		uint64_t entries_bytes = primary_header->number_of_entries
-				* primary_header->size_of_entry;
-		uint64_t entries_sectors = entries_bytes
-					/ gptdata->sector_bytes;
-		if (0 != VbExDiskRead(disk_handle,
-				      primary_header->entries_lba,
-				      entries_sectors,
-				      gptdata->primary_entries))
-			return 1;
+		entries_bytes = h->number_of_entries * h->size_of_entry;
 	} else {
 		VBDEBUG(("Primary GPT header invalid!\n"));
 	}
 
 	/* Read secondary header from the end of the drive */
-	if (0 != VbExDiskRead(disk_handle, gptdata->gpt_drive_sectors - 1, 1,
-			      gptdata->secondary_header))
-		return 1;
+	buf2 = ReadGptHeaderAndMaybeEntries(disk_handle, gptdata, spec2_lba,
+					    spec_sectors,
+					    gptdata->gpt_drive_sectors - 1,
+					    header2);
+	if (!buf2)
+		goto out;
 
 	/* Only read secondary GPT if the secondary header is valid */
-	GptHeader* secondary_header = (GptHeader*)gptdata->secondary_header;
-	if (0 == CheckHeader(secondary_header, 1,
+	h = (GptHeader *)header2;
+	if (0 == CheckHeader(h, 1,
 			gptdata->streaming_drive_sectors,
 			gptdata->gpt_drive_sectors,
 			gptdata->flags)) {
 		secondary_valid = 1;
-		uint64_t entries_bytes = secondary_header->number_of_entries
-				* secondary_header->size_of_entry;
-		uint64_t entries_sectors = entries_bytes
-				/ gptdata->sector_bytes;
-		if (0 != VbExDiskRead(disk_handle,
-				      secondary_header->entries_lba,
-				      entries_sectors,
-				      gptdata->secondary_entries))
-			return 1;
+		if (entries_bytes < h->number_of_entries * h->size_of_entry)
+			entries_bytes = h->number_of_entries * h->size_of_entry;
 	} else {
 		VBDEBUG(("Secondary GPT header invalid!\n"));
 	}
 
+	/*
+	 * Size both tables for the larger of the valid headers, since
+	 * GptRepair() may copy either one over the other.
+	 */
+	if (!entries_bytes)
+		entries_bytes = gptdata->sector_bytes;
+	if (AllocGptBuffers(gptdata, entries_bytes))
+		goto out;
+	Memcpy(gptdata->primary_header, header1, gptdata->sector_bytes);
+	Memcpy(gptdata->secondary_header, header2, gptdata->sector_bytes);
+
+	if (primary_valid &&
+	    0 != FinishGptEntries(disk_handle, gptdata,
+				  (GptHeader *)header1, buf1, 1, spec_sectors,
+				  gptdata->primary_entries))
+		goto out;
+	if (secondary_valid &&
+	    0 != FinishGptEntries(disk_handle, gptdata,
+				  (GptHeader *)header2, buf2, spec2_lba,
+				  spec_sectors, gptdata->secondary_entries))
+		goto out;
+
 	/* Return 0 if least one GPT header was valid */
-	return (primary_valid || secondary_valid) ? 0 : 1;
+	ret = (primary_valid || secondary_valid) ? 0 : 1;
+
+out:
+	if (buf1)
+		VbExFree(buf1);
+	if (buf2)
+		VbExFree(buf2);
+	if (header1)
+		VbExFree(header1);
+	if (header2)
+		VbExFree(header2);
+	return ret;
+}
+
+/*
+ * Remember [gptdata], which GptInit() has validated and repaired and which
+ * now matches the drive, for the next AllocAndReadGptDataCached().
+ */
+static void GptCacheStore(GptCache *cache, VbExDiskHandle_t disk_handle,
+			  const GptData *gptdata)
+{
+	const GptHeader *h = (const GptHeader *)gptdata->primary_header;
+	uint64_t n = gptdata->sector_bytes;
+	uint64_t entries_bytes;
+
+	GptCacheFree(cache);
+	if (gptdata->valid_headers != MASK_BOTH ||
+	    gptdata->valid_entries != MASK_BOTH)
+		return;
+
+	entries_bytes = h->number_of_entries * h->size_of_entry;
+	cache->data = (uint8_t *)VbExMalloc(2 * n + 2 * entries_bytes);
+	if (!cache->data)
+		return;
+	Memcpy(cache->data, gptdata->primary_header, n);
+	Memcpy(cache->data + n, gptdata->secondary_header, n);
+	Memcpy(cache->data + 2 * n, gptdata->primary_entries, entries_bytes);
+	Memcpy(cache->data + 2 * n + entries_bytes,
+	       gptdata->secondary_entries, entries_bytes);
+	cache->disk_handle = disk_handle;
+	cache->sector_bytes = gptdata->sector_bytes;
+	cache->streaming_drive_sectors = gptdata->streaming_drive_sectors;
+	cache->gpt_drive_sectors = gptdata->gpt_drive_sectors;
+	cache->flags = gptdata->flags & ~GPT_FLAG_VALIDATED;
+	cache->entries_bytes = entries_bytes;
+}
+
+/*
+ * Write one copy of the GPT: [count] sectors of [entries] from sector [first]
+ * on, which are at [entries_lba] on the drive, and the [header] at
+ * [header_lba] if that's not NULL. A header right next to the entries goes
+ * in the same write. Returns 0 if successful.
+ */
+static int WriteGptCopy(VbExDiskHandle_t disk_handle, GptData *gptdata,
+			const uint8_t *header, uint64_t header_lba,
+			const uint8_t *entries, uint64_t entries_lba,
+			uint64_t first, uint64_t count)
+{
+	uint64_t n = gptdata->sector_bytes;
+	uint64_t lba = entries_lba + first;
+	uint8_t *buf;
+	int ret;
+
+	if (count)
+		entries += first * n;
+	if (header && count &&
+	    (header_lba + 1 == lba || lba + count == header_lba)) {
+		buf = (uint8_t *)VbExMalloc((count + 1) * n);
+		if (buf) {
+			if (header_lba < lba) {
+				Memcpy(buf, header, n);
+				Memcpy(buf + n, entries, count * n);
+				lba = header_lba;
+			} else {
+				Memcpy(buf, entries, count * n);
+				Memcpy(buf + count * n, header, n);
+			}
+			ret = VbExDiskWrite(disk_handle, lba, count + 1, buf);
+			VbExFree(buf);
+			return ret ? 1 : 0;
+		}
+	}
+
+	if (header && 0 != VbExDiskWrite(disk_handle, header_lba, 1, header))
+		return 1;
+	if (count && 0 != VbExDiskWrite(disk_handle, lba, count, entries))
+		return 1;
+	return 0;
 }
 
 /**
@@ -101,12 +333,21 @@ int AllocAndReadGptData(VbExDiskHandle_t disk_handle, GptData *gptdata)
  * Returns 0 if successful, 1 if error.
  */
 int WriteAndFreeGptData(VbExDiskHandle_t disk_handle, GptData *gptdata)
+{
+	return WriteAndFreeGptDataCached(disk_handle, gptdata, NULL);
+}
+
+int WriteAndFreeGptDataCached(VbExDiskHandle_t disk_handle, GptData *gptdata,
+			      GptCache *cache)
 {
 	int legacy = 0;
 	GptHeader *header = (GptHeader *)gptdata->primary_header;
-	uint64_t entries_bytes = header->number_of_entries
-				* header->size_of_entry;
+	uint64_t entries_bytes = header ? header->number_of_entries
+				* header->size_of_entry : 0;
 	uint64_t entries_sectors = entries_bytes / gptdata->sector_bytes;
+	uint64_t first = 0, count = entries_sectors;
+	const uint8_t *h1 = NULL, *h2 = NULL;
+	uint64_t e1 = 0, e2 = 0;
 	int ret = 1;
 
 	/*
@@ -114,6 +355,17 @@ int WriteAndFreeGptData(VbExDiskHandle_t disk_handle, GptData *gptdata)
 	 * its entries.
 	 */
 	uint64_t entries_lba = GPT_PMBR_SECTORS + GPT_HEADER_SECTORS;
+
+	/* Only the sectors holding the entries that changed need writing */
+	if (gptdata->modified_entries_start < gptdata->modified_entries_end &&
+	    gptdata->modified_entries_end <= entries_bytes) {
+		first = gptdata->modified_entries_start /
+			gptdata->sector_bytes;
+		count = (gptdata->modified_entries_end +
+			 gptdata->sector_bytes - 1) / gptdata->sector_bytes -
+			first;
+	}
+
 	if (gptdata->primary_header) {
 		GptHeader *h = (GptHeader *)(gptdata->primary_header);
 		entries_lba = h->entries_lba;
@@ -133,9 +385,7 @@ int WriteAndFreeGptData(VbExDiskHandle_t disk_handle, GptData *gptdata)
 					 "legacy mode is enabled.\n"));
 			} else {
 				VBDEBUG(("Updating GPT header 1\n"));
-				if (0 != VbExDiskWrite(disk_handle, 1, 1,
-						       gptdata->primary_header))
-					goto fail;
+				h1 = gptdata->primary_header;
 			}
 		}
 	}
@@ -147,41 +397,51 @@ int WriteAndFreeGptData(VbExDiskHandle_t disk_handle, GptData *gptdata)
 					 "legacy mode is enabled.\n"));
 			} else {
 				VBDEBUG(("Updating GPT entries 1\n"));
-				if (0 != VbExDiskWrite(disk_handle, entries_lba,
-						entries_sectors,
-						gptdata->primary_entries))
-					goto fail;
+				e1 = count;
 			}
 		}
 	}
 
+	if (0 != WriteGptCopy(disk_handle, gptdata, h1, 1,
+			      gptdata->primary_entries, entries_lba,
+			      first, e1))
+		goto fail;
+
 	entries_lba = (gptdata->gpt_drive_sectors - entries_sectors -
 		GPT_HEADER_SECTORS);
 	if (gptdata->secondary_header) {
 		GptHeader *h = (GptHeader *)(gptdata->secondary_header);
 		entries_lba = h->entries_lba;
 		if (gptdata->modified & GPT_MODIFIED_HEADER2) {
-			VBDEBUG(("Updating GPT entries 2\n"));
-			if (0 != VbExDiskWrite(disk_handle,
-					       gptdata->gpt_drive_sectors - 1, 1,
-					       gptdata->secondary_header))
-				goto fail;
+			VBDEBUG(("Updating GPT header 2\n"));
+			h2 = gptdata->secondary_header;
 		}
 	}
 
 	if (gptdata->secondary_entries) {
 		if (gptdata->modified & GPT_MODIFIED_ENTRIES2) {
-			VBDEBUG(("Updating GPT header 2\n"));
-			if (0 != VbExDiskWrite(disk_handle,
-				entries_lba, entries_sectors,
-				gptdata->secondary_entries))
-				goto fail;
+			VBDEBUG(("Updating GPT entries 2\n"));
+			e2 = count;
 		}
 	}
 
+	if (0 != WriteGptCopy(disk_handle, gptdata, h2,
+			      gptdata->gpt_drive_sectors - 1,
+			      gptdata->secondary_entries, entries_lba,
+			      first, e2))
+		goto fail;
+
 	ret = 0;
 
+	/* What we have now is what's on the drive */
+	if (cache)
+		GptCacheStore(cache, disk_handle, gptdata);
+
 fail:
+	/* Don't trust the cache if the drive may be half written */
+	if (ret && cache)
+		GptCacheFree(cache);
+
 	/* Avoid leaking memory on disk write failure */
 	if (gptdata->primary_header)
 		VbExFree(gptdata->primary_header);
@@ -62,7 +62,9 @@ VbError_t VbGbbReadBmpHeader(VbCommonParams *cparams,
 /**
  * Read a image from the GBB
  *
- * The caller must call VbExFree() on *image_datap when finished with it.
+ * The caller must call VbGbbFreeImage() on *image_datap when finished with
+ * it, and before the next call, which may reuse the memory if it came from
+ * cparams->image_cache, unless images are held with VbGbbHoldImages().
  *
  * @param cparams	Vboot common parameters
  * @param localization	Localization/language number
@@ -80,4 +82,23 @@ VbError_t VbGbbReadImage(VbCommonParams *cparams,
 			 struct ImageInfo *image_info, char **image_datap,
 			 uint32_t *image_data_sizep);
 
+/**
+ * Keep (hold!=0) the images returned by VbGbbReadImage() from being moved or
+ * reused by later calls, until called again with hold=0, so that several can
+ * be in use at once.  Images which don't fit in the cache then are read into
+ * memory of their own.
+ *
+ * @param cparams	Vboot common parameters
+ * @param hold		Non-zero to hold images, zero to let them go
+ */
+void VbGbbHoldImages(VbCommonParams *cparams, int hold);
+
+/**
+ * Release an image returned by VbGbbReadImage()
+ *
+ * @param cparams	Vboot common parameters
+ * @param image_data	Image data pointer returned in *image_datap
+ */
+void VbGbbFreeImage(VbCommonParams *cparams, char *image_data);
+
 #endif
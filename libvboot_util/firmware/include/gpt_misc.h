@@ -64,6 +64,14 @@ enum {
 
 /* If this bit is 1, the GPT is stored in another from the streaming data */
 #define GPT_FLAG_EXTERNAL	0x1
+/*
+ * If this bit is 1, the headers and entries came from a GptCache, and were
+ * checked and repaired before they went in, so GptInit() trusts them.
+ */
+#define GPT_FLAG_VALIDATED	0x2
+
+/* Must be at least MAX_NUMBER_OF_ENTRIES */
+#define GPT_MAX_KERNEL_ORDER	128
 
 /*
  * A note about stored_on_device and gpt_drive_sectors:
@@ -100,6 +108,12 @@ typedef struct {
 	/* Outputs */
 	/* Which inputs have been modified?  GPT_MODIFIED_* */
 	uint8_t modified;
+	/*
+	 * Which bytes of the modified entries have changed, from start up to
+	 * end, so that only their sectors need writing. An empty range means
+	 * all of them. Reset along with modified.
+	 */
+	uint32_t modified_entries_start, modified_entries_end;
 	/*
 	 * The current chromeos kernel index in partition table.  -1 means not
 	 * found on drive. Note that GPT partition numbers are traditionally
@@ -110,6 +124,13 @@ typedef struct {
 	/* Internal variables */
 	uint32_t valid_headers, valid_entries;
 	int current_priority;
+	/*
+	 * Bootable kernel entries, highest priority first and in table order
+	 * within a priority; that is, the order GptNextKernelEntry() returns
+	 * them in.  Rebuilt by GptInit() and whenever the entries change.
+	 */
+	uint8_t kernel_order[GPT_MAX_KERNEL_ORDER];
+	uint32_t num_kernels;
 } GptData;
 
 /**
@@ -160,6 +181,42 @@ int AllocAndReadGptData(VbExDiskHandle_t disk_handle, GptData *gptdata);
  */
 int WriteAndFreeGptData(VbExDiskHandle_t disk_handle, GptData *gptdata);
 
+/*
+ * The GPT of one drive as it was last written back, after GptInit() had
+ * validated it. Zero it before first use and free it with GptCacheFree().
+ * It isn't safe to share one between threads.
+ */
+typedef struct GptCache {
+	VbExDiskHandle_t disk_handle;
+	uint32_t sector_bytes;
+	uint64_t streaming_drive_sectors;
+	uint64_t gpt_drive_sectors;
+	uint32_t flags;
+	uint64_t entries_bytes;
+	/* Primary and secondary header, then primary and secondary entries */
+	uint8_t *data;
+} GptCache;
+
+/**
+ * Like AllocAndReadGptData(), but if [cache] holds this drive's GPT (same
+ * handle, geometry and flags), copy it from there instead of reading and
+ * checking it again. [cache] may be NULL.
+ */
+int AllocAndReadGptDataCached(VbExDiskHandle_t disk_handle, GptData *gptdata,
+			      GptCache *cache);
+
+/**
+ * Like WriteAndFreeGptData(), and if the data was valid and written back,
+ * keep a copy in [cache]. [cache] may be NULL.
+ */
+int WriteAndFreeGptDataCached(VbExDiskHandle_t disk_handle, GptData *gptdata,
+			      GptCache *cache);
+
+/**
+ * Empty a GptCache.
+ */
+void GptCacheFree(GptCache *cache);
+
 /**
  * Return 1 if the entry is unused, 0 if it is used.
  */
@@ -21,6 +21,17 @@
 #define BOOT_FLAG_RECOVERY     (0x02ULL)
 /* GPT is external */
 #define BOOT_FLAG_EXTERNAL_GPT (0x04ULL)
+/*
+ * Check the key block and preamble of every candidate before choosing one,
+ * using VbExRunParallel(). The choice is the same either way.
+ */
+#define BOOT_FLAG_PARALLEL_HEADERS (0x08ULL)
+/*
+ * For VbTryLoadKernel(): read and check the GPTs of all the disks at once,
+ * using VbExRunParallel(), before trying them in order. The choice is the
+ * same either way.
+ */
+#define BOOT_FLAG_PARALLEL_DISKS (0x10ULL)
 
 typedef struct LoadKernelParams {
 	/* Inputs to LoadKernel() */
@@ -57,6 +68,11 @@ typedef struct LoadKernelParams {
 	 * VbNvSetup() and VbNvTeardown() on the context.
 	 */
 	VbNvContext *nv_context;
+	/*
+	 * Optional: keeps the validated GPT between calls on the same disk,
+	 * so it isn't read and checked again each time.  See GptCache.
+	 */
+	struct GptCache *gpt_cache;
 
 	/*
 	 * Outputs from LoadKernel(); valid only if LoadKernel() returns
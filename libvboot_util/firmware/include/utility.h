@@ -104,6 +104,35 @@ uint32_t Uint64ToString(char *buf, uint32_t bufsize, uint64_t value,
  */
 uint32_t StrnAppend(char *dest, const char *src, uint32_t destlen);
 
+/*
+ * Builds a string in a fixed buffer, keeping track of where it ends so that
+ * each append picks up there instead of searching for the end again.
+ */
+typedef struct StrBuilder {
+  char *buf;
+  uint32_t size;  /* Including the terminating null */
+  uint32_t used;  /* Not including the terminating null */
+} StrBuilder;
+
+/**
+ * Start an empty string in <buf>, which has space for <size> characters
+ * including the terminating null.
+ */
+void StrBuilderInit(StrBuilder *sb, char *buf, uint32_t size);
+
+/**
+ * Append as much of <src> as fits.  The string is always null-terminated if
+ * the buffer size is > 0.
+ */
+void StrBuilderAppend(StrBuilder *sb, const char *src);
+
+/**
+ * Append <value> as Uint64ToString() would format it.  Appends nothing if
+ * the whole number doesn't fit.
+ */
+void StrBuilderAppendUint64(StrBuilder *sb, uint64_t value, uint32_t radix,
+                            uint32_t zero_pad_width);
+
 /* Ensure that only our stub implementations are used, not standard C */
 #ifndef _STUB_IMPLEMENTATION_
 #define malloc _do_not_use_standard_malloc
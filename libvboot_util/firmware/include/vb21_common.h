@@ -0,0 +1,120 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Common functions for the vboot 2.1 formats, between firmware and host.
+ */
+
+#ifndef VBOOT_REFERENCE_VB21_COMMON_H_
+#define VBOOT_REFERENCE_VB21_COMMON_H_
+
+#include "cryptolib.h"
+#include "vb21_struct.h"
+#include "vboot_common.h"
+
+/**
+ * Return the v1 algorithm number (as used by cryptolib) for a vb21 signature
+ * and hash algorithm, or -1 if there isn't one. For VB2_SIG_NONE, it's one
+ * whose hash is [hash_alg], so it can be given to DigestInit().
+ */
+int Vb21Algorithm(uint16_t sig_alg, uint16_t hash_alg);
+
+/**
+ * The other way around: split v1 [algorithm] into vb21 algorithms. Returns 0
+ * on success.
+ */
+int Vb21SplitAlgorithm(uint64_t algorithm, uint16_t *sig_alg,
+		       uint16_t *hash_alg);
+
+/**
+ * Return the description of a vb21 object, or "" if it hasn't got one.
+ * Assumes the object has already been checked with Vb21VerifyCommon().
+ */
+const char *Vb21Desc(const void *obj);
+
+/**
+ * Check that the vb21 object at [obj], which has [size] bytes to itself, has
+ * the [magic] number, fits, and has a terminated description. Returns 0 if
+ * so.
+ */
+int Vb21VerifyCommon(const void *obj, uint64_t size, uint32_t magic);
+
+/**
+ * Return the packed key or signature at [offset] in [parent], which is
+ * [parent_size] bytes, if it's a valid one that fits inside. If [end] isn't
+ * NULL, it's set to the offset just past it. Otherwise returns NULL.
+ */
+const struct vb21_packed_key *Vb21PackedKeyInside(const void *parent,
+						  uint32_t parent_size,
+						  uint32_t offset,
+						  uint32_t *end);
+const struct vb21_signature *Vb21SignatureInside(const void *parent,
+						 uint32_t parent_size,
+						 uint32_t offset,
+						 uint32_t *end);
+
+/**
+ * Convert a packed key, which has been found with Vb21PackedKeyInside(), to
+ * RsaPublicKey format. The returned key must be freed using
+ * RSAPublicKeyFree().
+ *
+ * Returns NULL if error.
+ */
+RSAPublicKey *Vb21PackedKeyToRSA(const struct vb21_packed_key *key);
+
+/**
+ * Verify a digest from DigestFinal() of the signature's hash algorithm. A
+ * VB2_SIG_NONE signature is just compared with it, and [key] may be NULL;
+ * otherwise the signature is checked with [key]. Returns 0 on success.
+ */
+int Vb21VerifyDigest(const uint8_t *digest, const struct vb21_signature *sig,
+		     const RSAPublicKey *key);
+
+/**
+ * Verify [data] matches signature [sig], as Vb21VerifyDigest() does. [size]
+ * is the size of the data buffer; the amount of data to be validated is
+ * contained in sig->data_size.
+ */
+int Vb21VerifyData(const uint8_t *data, uint64_t size,
+		   const struct vb21_signature *sig, const RSAPublicKey *key);
+
+/**
+ * Check the sanity of a keyblock of [size] bytes, and that one of its
+ * signatures is by [key], which is found in it by key ID if it can be, or
+ * else by algorithm. If [key] is NULL, only the structure is checked.
+ *
+ * Returns VBOOT_SUCCESS if successful.
+ */
+int Vb21VerifyKeyblock(const struct vb21_keyblock *block, uint64_t size,
+		       const struct vb21_packed_key *key);
+
+/**
+ * Return the data key in a keyblock checked by Vb21VerifyKeyblock().
+ */
+const struct vb21_packed_key *Vb21KeyblockDataKey(
+	const struct vb21_keyblock *block);
+
+/**
+ * Check the sanity of a firmware preamble of [size] bytes, and its signature
+ * with [key]. If [key] is NULL, only the structure is checked.
+ *
+ * Returns VBOOT_SUCCESS if successful.
+ */
+int Vb21VerifyFwPreamble(const struct vb21_fw_preamble *preamble,
+			 uint64_t size, const RSAPublicKey *key);
+
+/**
+ * Return hash [index] in a preamble checked by Vb21VerifyFwPreamble(), and
+ * set [*offset] to where the piece of the body it covers starts. The piece
+ * can then be checked with Vb21VerifyData(piece, len, hash, NULL).
+ */
+const struct vb21_signature *Vb21FwPreambleHash(
+	const struct vb21_fw_preamble *preamble, uint32_t index,
+	uint64_t *offset);
+
+/**
+ * The total size of the body that a checked preamble covers.
+ */
+uint64_t Vb21FwPreambleBodySize(const struct vb21_fw_preamble *preamble);
+
+#endif  /* VBOOT_REFERENCE_VB21_COMMON_H_ */
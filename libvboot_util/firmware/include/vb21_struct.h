@@ -0,0 +1,149 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Data structure definitions for the vboot 2.1 formats, for on-disk /
+ * in-eeprom data.
+ */
+
+#ifndef VBOOT_REFERENCE_VB21_STRUCT_H_
+#define VBOOT_REFERENCE_VB21_STRUCT_H_
+#include <stdint.h>
+
+/*
+ * Every vb21 object starts with this. The object is total_size bytes long,
+ * made of its fixed_size-byte header, then a desc_size-byte NUL-terminated
+ * description (desc_size may be 0), then whatever the header points to.
+ * All offsets are from the start of the object, and all sizes are multiples
+ * of 4 so the members stay aligned.
+ */
+struct vb21_struct_common {
+	uint32_t magic;
+	uint16_t struct_version_major;
+	uint16_t struct_version_minor;
+	uint32_t total_size;
+	uint32_t fixed_size;
+	uint32_t desc_size;
+} __attribute__((packed));
+
+#define EXPECTED_VB21_STRUCT_COMMON_SIZE 20
+
+/* Magic numbers, which spell out "Vb2" and a letter in memory */
+enum vb21_struct_magic {
+	VB21_MAGIC_KEYBLOCK	= 0x42326256,	/* "Vb2B" */
+	VB21_MAGIC_FW_PREAMBLE	= 0x46326256,	/* "Vb2F" */
+	VB21_MAGIC_PACKED_KEY	= 0x50326256,	/* "Vb2P" */
+	VB21_MAGIC_SIGNATURE	= 0x53326256,	/* "Vb2S" */
+};
+
+/* What all the magic numbers have in common */
+#define VB21_MAGIC_PREFIX	0x00326256
+#define VB21_MAGIC_PREFIX_MASK	0x00ffffff
+
+/*
+ * Algorithms are given separately, rather than as one v1 algorithm number.
+ * A signature with VB2_SIG_NONE holds just the digest of the data.
+ */
+enum vb2_signature_algorithm {
+	VB2_SIG_NONE = 0,
+	VB2_SIG_RSA1024,
+	VB2_SIG_RSA2048,
+	VB2_SIG_RSA4096,
+	VB2_SIG_RSA8192,
+	VB2_SIG_ALG_COUNT
+};
+
+enum vb2_hash_algorithm {
+	VB2_HASH_NONE = 0,
+	VB2_HASH_SHA1,
+	VB2_HASH_SHA256,
+	VB2_HASH_SHA512,
+	VB2_HASH_ALG_COUNT
+};
+
+/* Identifies a key. By default, it's the SHA-1 of the key data. */
+#define VB2_ID_NUM_BYTES 20
+struct vb2_id {
+	uint8_t raw[VB2_ID_NUM_BYTES];
+} __attribute__((packed));
+
+/*
+ * Packed public key. The key data, which is in the same RSAPublicKey format
+ * as a VbPublicKey's, follows the description.
+ */
+#define VB21_PACKED_KEY_VERSION_MAJOR 3
+#define VB21_PACKED_KEY_VERSION_MINOR 0
+
+struct vb21_packed_key {
+	struct vb21_struct_common c;
+	uint32_t key_offset;
+	uint32_t key_size;
+	uint16_t sig_alg;
+	uint16_t hash_alg;
+	uint32_t key_version;
+	struct vb2_id id;
+} __attribute__((packed));
+
+#define EXPECTED_VB21_PACKED_KEY_SIZE 56
+
+/*
+ * Signature of data_size bytes of data, made by the key identified by id.
+ * The signature data follows the description.
+ */
+#define VB21_SIGNATURE_VERSION_MAJOR 3
+#define VB21_SIGNATURE_VERSION_MINOR 0
+
+struct vb21_signature {
+	struct vb21_struct_common c;
+	uint32_t sig_offset;
+	uint32_t sig_size;
+	uint32_t data_size;
+	uint16_t sig_alg;
+	uint16_t hash_alg;
+	struct vb2_id id;
+} __attribute__((packed));
+
+#define EXPECTED_VB21_SIGNATURE_SIZE 56
+
+/*
+ * Keyblock, containing the public key used to sign some other chunk of data.
+ * It's followed by the data key, then sig_count signatures one after another,
+ * each of everything before sig_offset. Any of them may be used to verify it.
+ * The flags are the same as a VbKeyBlockHeader's.
+ */
+#define VB21_KEYBLOCK_VERSION_MAJOR 3
+#define VB21_KEYBLOCK_VERSION_MINOR 0
+
+struct vb21_keyblock {
+	struct vb21_struct_common c;
+	uint32_t flags;
+	uint32_t key_offset;
+	uint32_t sig_count;
+	uint32_t sig_offset;
+} __attribute__((packed));
+
+#define EXPECTED_VB21_KEYBLOCK_SIZE 36
+
+/*
+ * Firmware preamble, which follows the keyblock in a vblock. It's followed
+ * by hash_count digest-only (VB2_SIG_NONE) signatures one after another,
+ * then the signature of everything before sig_offset by the keyblock's data
+ * key. The hashes cover consecutive pieces of the firmware body, each as
+ * long as its data_size, so the body can be read and checked a piece at a
+ * time instead of all at once.
+ */
+#define VB21_FW_PREAMBLE_VERSION_MAJOR 3
+#define VB21_FW_PREAMBLE_VERSION_MINOR 0
+
+struct vb21_fw_preamble {
+	struct vb21_struct_common c;
+	uint32_t flags;
+	uint32_t fw_version;
+	uint32_t hash_count;
+	uint32_t hash_offset;
+	uint32_t sig_offset;
+} __attribute__((packed));
+
+#define EXPECTED_VB21_FW_PREAMBLE_SIZE 40
+
+#endif  /* VBOOT_REFERENCE_VB21_STRUCT_H_ */
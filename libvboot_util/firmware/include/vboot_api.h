@@ -113,6 +113,8 @@ enum VbErrorPredefined_t {
 	VBERROR_UNSUPPORTED_REGION            = 0x10025,
 	/* No image present (returned from VbGbbReadImage() for missing image) */
 	VBERROR_NO_IMAGE_PRESENT              = 0x10026,
+	/* VbExDisplayImages() isn't supported; draw images one at a time */
+	VBERROR_NO_DISPLAY_LIST               = 0x10027,
 
 	/* VbExEcGetExpectedRWHash() may return the following codes */
 	/* Compute expected RW hash from the EC image; BIOS doesn't have it */
@@ -177,11 +179,42 @@ typedef struct VbCommonParams {
 	 */
 	void *caller_context;
 
+	/*
+	 * Optional cache for reads of the GBB through VbExRegionRead(), so
+	 * that the parts of it read more than once (the header, keys, bitmap
+	 * header and screen layouts) only come from flash once.  Set
+	 * gbb_cache to a buffer of gbb_cache_size bytes, zeroed, that stays
+	 * valid across calls; VB_GBB_CACHE_SIZE(n) is enough for n blocks of
+	 * VB_GBB_CACHE_BLOCK_SIZE bytes.  Leave it NULL to read directly.
+	 */
+	void *gbb_cache;
+	uint32_t gbb_cache_size;
+
+	/*
+	 * Optional cache for the decompressed images that VbDisplayScreen()
+	 * draws, so that redrawing a screen doesn't read and decompress them
+	 * again.  Set image_cache to a buffer of image_cache_size bytes,
+	 * zeroed, that stays valid across calls; the least recently used
+	 * entries are dropped to make room.  Images that don't fit are read
+	 * as if there were no cache.  Leave it NULL to read every time.  (The
+	 * bitmap header and the current localization's screen layouts are
+	 * kept regardless.)
+	 */
+	void *image_cache;
+	uint32_t image_cache_size;
+
 	/* For internal use of Vboot - do not examine or modify! */
 	struct GoogleBinaryBlockHeader *gbb;
 	struct BmpBlockHeader *bmp;
+	struct ScreenLayout *layouts;
+	uint32_t layouts_localization;
 } VbCommonParams;
 
+/* Sizes for VbCommonParams.gbb_cache */
+#define VB_GBB_CACHE_BLOCK_SIZE 4096
+#define VB_GBB_CACHE_SIZE(blocks) (16 + (blocks) * \
+				   (4 + VB_GBB_CACHE_BLOCK_SIZE))
+
 /* Flags for VbInitParams.flags */
 /* Developer switch was on at boot time. */
 #define VB_INIT_FLAG_DEV_SWITCH_ON       0x00000001
@@ -441,6 +474,25 @@ uint64_t VbExGetTimer(void);
  */
 void VbExSleepMs(uint32_t msec);
 
+/* Events for VbExWaitForEvent() */
+#define VB_EVENT_KEY		(1 << 0)  /* VbExKeyboardRead() has a key */
+#define VB_EVENT_SHUTDOWN	(1 << 1)  /* VbExIsShutdownRequested() is set */
+#define VB_EVENT_DISK		(1 << 2)  /* removable media came or went */
+/* Returned by firmware that can't wait for events */
+#define VB_EVENT_UNSUPPORTED	0x80000000
+
+/**
+ * Wait for up to [msec] milliseconds, or until one of the events in
+ * [event_mask] happens, so the developer and recovery screens can sleep
+ * instead of polling the keyboard.  Returns the events that happened, which
+ * may include ones not asked for, or 0 if the time ran out.  Waking up early
+ * for no reason is allowed, as the caller checks for itself what happened.
+ *
+ * Firmware that can't do this must return VB_EVENT_UNSUPPORTED at once; the
+ * caller then polls with VbExSleepMs() as it always has.
+ */
+uint32_t VbExWaitForEvent(uint32_t msec, uint32_t event_mask);
+
 /**
  * Play a beep tone of the specified frequency in Hz and duration in msec.
  * This is effectively a VbSleep() variant that makes noise.
@@ -528,6 +580,24 @@ VbError_t VbExNvStorageWrite(const uint8_t *buf);
 VbError_t VbExHashFirmwareBody(VbCommonParams *cparams,
                                uint32_t firmware_index);
 
+/**
+ * Hint that the firmware body for [firmware_index] (VB_SELECT_FIRMWARE_A or
+ * VB_SELECT_FIRMWARE_B) is about to be hashed.  This is called as soon as
+ * its vblock has been found, before the key block and preamble signatures
+ * are checked, so a platform that can read flash in the background (by DMA,
+ * for example) can start reading the body into memory while the RSA
+ * verification keeps the CPU busy.  VbExHashFirmwareBody() then hashes what
+ * has been read.
+ *
+ * [size_hint] is the body size the preamble claims, which hasn't been
+ * verified yet, or 0 if it isn't known.  Nothing is hashed here, and the body
+ * may turn out not to be needed at all.  Return values are ignored; a
+ * platform that can't do this just returns VBERROR_SUCCESS.
+ */
+VbError_t VbExFirmwareBodyPrefetch(VbCommonParams *cparams,
+                                   uint32_t firmware_index,
+                                   uint32_t size_hint);
+
 /*****************************************************************************/
 /* Disk access (previously in boot_device.h) */
 
@@ -685,7 +755,8 @@ VbError_t VbExStreamOpen(VbExDiskHandle_t handle, uint64_t lba_start,
  * requested is an error.
  *
  * This is used for access to the contents of the actual partitions on the
- * device. It is not used to access the GPT.
+ * device. It is not used to access the GPT. Reads need not be whole sectors;
+ * the stream picks up where the last one left off, byte for byte.
  */
 VbError_t VbExStreamRead(VbExStream_t stream, uint32_t bytes, void *buffer);
 
@@ -696,6 +767,20 @@ VbError_t VbExStreamRead(VbExStream_t stream, uint32_t bytes, void *buffer);
  */
 void VbExStreamClose(VbExStream_t stream);
 
+/**
+ * Call func(arg, index) once for each index from 0 to count - 1, and return
+ * when all the calls have finished.
+ *
+ * The calls may run concurrently, so each must only touch its own state.  An
+ * implementation without threads can simply make them one after another.
+ *
+ * @param func		Function to call
+ * @param arg		Passed to every call
+ * @param count		Number of calls
+ */
+void VbExRunParallel(void (*func)(void *arg, uint32_t index), void *arg,
+		     uint32_t count);
+
 
 /*****************************************************************************/
 /* Display */
@@ -764,6 +849,24 @@ VbError_t VbExDisplayScreen(uint32_t screen_type);
 VbError_t VbExDisplayImage(uint32_t x, uint32_t y,
                            void *buffer, uint32_t buffersize);
 
+/* One image in a list given to VbExDisplayImages() */
+typedef struct VbDisplayImage {
+	uint32_t x;
+	uint32_t y;
+	void *buffer;
+	uint32_t buffersize;
+} VbDisplayImage;
+
+/**
+ * Write [count] images to the display, in order, as calling VbExDisplayImage()
+ * on each would, but as a single update.  This lets a whole screen, with its
+ * text, be drawn in one display transaction.
+ *
+ * Platforms which can't do that should return VBERROR_NO_DISPLAY_LIST without
+ * drawing anything, and the images will be drawn one at a time instead.
+ */
+VbError_t VbExDisplayImages(const VbDisplayImage *images, uint32_t count);
+
 /**
  * Display a string containing debug information on the screen, rendered in a
  * platform-dependent font.  Should be able to handle newlines '\n' in the
@@ -874,7 +977,16 @@ VbError_t VbExEcJumpToRW(int devidx);
 VbError_t VbExEcDisableJump(int devidx);
 
 /**
- * Read the SHA-256 hash of the rewriteable EC image.
+ * Ask the EC to start hashing its rewriteable image in the background, so
+ * that the AP can do other work until VbExEcHashRW() collects the result.
+ * Returns VBERROR_SUCCESS if hashing was started; anything else means
+ * VbExEcHashRW() will hash synchronously instead.
+ */
+VbError_t VbExEcHashRWStart(int devidx);
+
+/**
+ * Read the SHA-256 hash of the rewriteable EC image.  If
+ * VbExEcHashRWStart() started the hash, this waits for it to finish.
  */
 VbError_t VbExEcHashRW(int devidx, const uint8_t **hash, int *hash_size);
 
@@ -897,9 +1009,29 @@ VbError_t VbExEcGetExpectedRWHash(int devidx, enum VbSelectFirmware_t select,
  */
 VbError_t VbExEcUpdateRW(int devidx, const uint8_t *image, int image_size);
 
+/**
+ * Read the SHA-256 hash of each [*sector_size]-byte flash sector of the
+ * rewriteable EC image, [*count] of them one after another in [*hashes], so
+ * that an update only has to write the sectors that differ. Returns
+ * VBERROR_SUCCESS, or anything else if the EC can't, in which case the
+ * whole image is written with VbExEcUpdateRW().
+ */
+VbError_t VbExEcHashRWSectors(int devidx, int *sector_size,
+			      const uint8_t **hashes, int *count);
+
+/**
+ * Erase and rewrite [size] bytes of the rewriteable EC image at [offset]
+ * with [data]. [offset] is a multiple of the sector size from
+ * VbExEcHashRWSectors(), and so is [size], unless it runs to the end of the
+ * image.
+ */
+VbError_t VbExEcUpdateRWSectors(int devidx, int offset, const uint8_t *data,
+				int size);
+
 /**
  * Lock the EC code to prevent updates until the EC is rebooted.
- * Subsequent calls to VbExEcUpdateRW() this boot will fail.
+ * Subsequent calls to VbExEcUpdateRW() or VbExEcUpdateRWSectors() this boot
+ * will fail.
  */
 VbError_t VbExEcProtectRW(int devidx);
 
@@ -964,6 +1096,7 @@ enum {
 	COMPRESS_NONE = 0,
 	COMPRESS_EFIv1,           /* The x86 BIOS only supports this */
 	COMPRESS_LZMA1,           /* The ARM BIOS supports LZMA1 */
+	COMPRESS_LZ4,             /* LZ4 frames; bigger, but much quicker */
 	MAX_COMPRESS,
 };
 
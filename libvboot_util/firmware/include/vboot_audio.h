@@ -22,6 +22,12 @@ VbAudioContext *VbAudioOpen(VbCommonParams *cparams);
  */
 int VbAudioLooping(VbAudioContext *audio);
 
+/**
+ * Wait until the next note is due or one of [events] happens, if the firmware
+ * can. This is the only delay the caller's loop should have.
+ */
+void VbAudioWaitForEvent(VbAudioContext *audio, uint32_t events);
+
 /**
  * Caller should call this prior to booting.
  */
@@ -97,6 +97,42 @@ int PublicKeyCopy(VbPublicKey *dest, const VbPublicKey *src);
  */
 RSAPublicKey *PublicKeyToRSA(const VbPublicKey *key);
 
+/**
+ * Like PublicKeyToRSA(), but uses the key data in place, through [view], if
+ * it can (see RSAPublicKeyView()). [key] must outlive the returned key, which
+ * must be released using RSAPublicKeyViewFree(rsa, view).
+ *
+ * Returns NULL if error.
+ */
+RSAPublicKey *PublicKeyToRSAView(const VbPublicKey *key, RSAPublicKey *view);
+
+/*
+ * The last few keys converted by RSAKeyCacheGet(), so checking lots of things
+ * signed by the same key only has to convert it once. Zero it before first
+ * use. It's up to the caller to keep it to one thread at a time.
+ */
+#define RSA_KEY_CACHE_SIZE 4
+typedef struct RSAKeyCache {
+	RSAPublicKey *rsa[RSA_KEY_CACHE_SIZE];
+	uint32_t next;
+} RSAKeyCache;
+
+/**
+ * Like PublicKeyToRSA(), but returns the converted key from [cache] if the
+ * same key data has been seen before. The returned key belongs to the cache,
+ * and stays valid until RSA_KEY_CACHE_SIZE other keys have been added or the
+ * cache is freed.
+ *
+ * Returns NULL if error.
+ */
+const RSAPublicKey *RSAKeyCacheGet(RSAKeyCache *cache,
+				   const VbPublicKey *key);
+
+/**
+ * Free all the keys in [cache], leaving it empty.
+ */
+void RSAKeyCacheFree(RSAKeyCache *cache);
+
 /**
  * Verify [data] matches signature [sig] using [key].  [size] is the size of
  * the data buffer; the amount of data to be validated is contained in
@@ -121,6 +157,13 @@ int VerifyDigest(const uint8_t *digest, const VbSignature *sig,
 int KeyBlockVerify(const VbKeyBlockHeader *block, uint64_t size,
 		   const VbPublicKey *key, int hash_only);
 
+/**
+ * Same as KeyBlockVerify(), but converts [key] using [cache] if it's not NULL.
+ */
+int KeyBlockVerifyCached(const VbKeyBlockHeader *block, uint64_t size,
+			 const VbPublicKey *key, int hash_only,
+			 RSAKeyCache *cache);
+
 
 /**
  * Check the sanity of a firmware preamble of size [size] bytes, using public
@@ -199,4 +242,12 @@ uint64_t VbSharedDataReserve(VbSharedDataHeader *header, uint64_t size);
 int VbSharedDataSetKernelKey(VbSharedDataHeader *header,
                              const VbPublicKey *src);
 
+/**
+ * Record that [stage] (VBSD_TS_*) finished at [time], for firmware slot or
+ * LoadKernel() call [index] and kernel partition [part].  Does nothing if
+ * the shared data is older than version 3, which has no room for it.
+ */
+void VbSharedDataAddTimestamp(VbSharedDataHeader *header, uint8_t stage,
+			      uint8_t index, uint8_t part, uint64_t time);
+
 #endif  /* VBOOT_REFERENCE_VBOOT_COMMON_H_ */
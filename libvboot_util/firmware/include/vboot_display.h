@@ -22,7 +22,17 @@ VbError_t VbCheckDisplayKey(VbCommonParams *cparams, uint32_t key,
 
 /* Internal functions, for unit testing */
 
-typedef FontArrayHeader VbFont_t;
+/* Glyphs for characters below this are found by direct lookup */
+#define VB_FONT_INDEX_SIZE 256
+
+/*
+ * In-memory form of a font, indexed by character. It points into the
+ * FontArrayHeader it was made from, which must outlive it.
+ */
+typedef struct VbFont {
+	FontArrayHeader *hdr;
+	FontArrayEntryHeader *glyph[VB_FONT_INDEX_SIZE];
+} VbFont_t;
 
 VbFont_t *VbInternalizeFontData(FontArrayHeader *fonthdr);
 
@@ -31,6 +41,37 @@ void VbDoneWithFontForNow(VbFont_t *ptr);
 ImageInfo *VbFindFontGlyph(VbFont_t *font, uint32_t ascii,
 			   void **bufferptr, uint32_t *buffersize);
 
+/* How many images are queued up before they have to be drawn */
+#define VB_DISPLAY_LIST_SIZE 64
+
+/*
+ * Images waiting to be drawn together by VbExDisplayImages(). Their buffers
+ * must stay around until the list is flushed.
+ */
+typedef struct VbDisplayList {
+	uint32_t count;
+	VbDisplayImage images[VB_DISPLAY_LIST_SIZE];
+} VbDisplayList;
+
+/**
+ * Queue an image to be drawn at (x, y). If the list is full, the images
+ * already in it are drawn first.
+ */
+VbError_t VbDisplayListAdd(VbDisplayList *list, uint32_t x, uint32_t y,
+			   void *buffer, uint32_t buffersize);
+
+/**
+ * Draw the queued images, all at once if the platform can, and empty the list.
+ */
+VbError_t VbDisplayListFlush(VbDisplayList *list);
+
+/**
+ * Queue the glyphs for the specified text at a particular position.
+ */
+void VbQueueTextAtPos(VbDisplayList *list, const char *text,
+		      int right_to_left, uint32_t x, uint32_t y,
+		      VbFont_t *font);
+
 /**
  * Try to display the specified text at a particular position.
  */
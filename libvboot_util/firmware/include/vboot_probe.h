@@ -0,0 +1,72 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Static probe points, for profiling the host tools in production with eBPF
+ * (bpftrace, bcc), perf or SystemTap.
+ */
+
+#ifndef VBOOT_REFERENCE_VBOOT_PROBE_H_
+#define VBOOT_REFERENCE_VBOOT_PROBE_H_
+
+/* Each VB_PROBEn(name, ...) is a USDT probe called [name] in the "vboot"
+ * provider, with n integer arguments. They're only there when built with
+ * "make PROBES=1", which defines VBOOT_PROBES and needs <sys/sdt.h> (from
+ * systemtap-sdt-dev); otherwise they compile to nothing. Even then each one
+ * is a single nop until something attaches to it.
+ *
+ * Timed operations have a NAME_entry probe and a NAME_return probe, fired
+ * on the same thread, so the latency of each is the time between the two:
+ *
+ *   bpftrace -e 'usdt:./futility:vboot:rsa_verify_entry { @s[tid] = nsecs }
+ *     usdt:./futility:vboot:rsa_verify_return /@s[tid]/ {
+ *       @ns[arg0] = hist(nsecs - @s[tid]); delete(@s[tid]) }'
+ *
+ * The probes and their arguments:
+ *
+ *   recognize_entry(len), recognize_return(type)
+ *     Working out what kind of file a buffer holds (enum futil_file_type)
+ *   callback_entry(op, component, len), callback_return(op, component, rv)
+ *     Each futil_traverse() callback (enum futil_op_type, futil_cb_component)
+ *   digest_buf_entry(sig_algorithm, len), digest_buf_return(sig_algorithm)
+ *     DigestBuf() and DigestBufInto()
+ *   digest_update(hash_algorithm, len)
+ *     DigestUpdate(), which is too small a step to time
+ *   digest_final_entry(hash_algorithm), digest_final_return(hash_algorithm)
+ *     DigestFinalInto(), and DigestFinal()
+ *   rsa_verify_entry(sig_algorithm, sig_len), rsa_verify_return(rv)
+ *     RSAVerify(), with rv 1 if the signature was good
+ *   sign_entry(sig_algorithm, digest_info_len), sign_return(rv)
+ *     Each signature made, however it's made
+ *   external_signer_entry(sig_algorithm), external_signer_return(rv)
+ *     A signature made by running a --pem_external program
+ *   load_firmware_entry(), load_firmware_return(rv)
+ *   load_firmware_phase(index, phase)
+ *     LoadFirmware(), and each step of checking firmware [index]: 1 keyblock,
+ *     2 preamble, 3 body, in that order
+ *   load_kernel_entry(), load_kernel_return(rv)
+ *   load_kernel_phase(partition, phase)
+ *     LoadKernel(), and each step of checking kernel [partition]: 1
+ *     keyblock, 2 preamble, 3 body, in that order
+ */
+#if defined(VBOOT_PROBES) && !defined(CHROMEOS_EC)
+#include <sys/sdt.h>
+#define VB_PROBE0(name) STAP_PROBE(vboot, name)
+#define VB_PROBE1(name, a) STAP_PROBE1(vboot, name, a)
+#define VB_PROBE2(name, a, b) STAP_PROBE2(vboot, name, a, b)
+#define VB_PROBE3(name, a, b, c) STAP_PROBE3(vboot, name, a, b, c)
+#else
+#define VB_PROBE0(name) do {} while (0)
+#define VB_PROBE1(name, a) do {} while (0)
+#define VB_PROBE2(name, a, b) do {} while (0)
+#define VB_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+/* The steps of load_firmware_phase and load_kernel_phase */
+enum VbProbePhase {
+  VB_PROBE_PHASE_KEYBLOCK = 1,
+  VB_PROBE_PHASE_PREAMBLE,
+  VB_PROBE_PHASE_BODY,
+};
+
+#endif  /* VBOOT_REFERENCE_VBOOT_PROBE_H_ */
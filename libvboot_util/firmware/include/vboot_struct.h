@@ -441,6 +441,47 @@ typedef struct VbSharedDataKernelCall {
 /* Number of kernel calls to track.  Must be power of 2. */
 #define VBSD_MAX_KERNEL_CALLS 4
 
+/* Stages for VbSharedDataTimestamp.stage */
+#define VBSD_TS_GBB_HEADER          1   /* GBB header read */
+#define VBSD_TS_GBB_KEY             2   /* A key read from the GBB */
+#define VBSD_TS_LF_START            3   /* LoadFirmware() entered */
+#define VBSD_TS_LF_KEY_BLOCK        4   /* Slot [index] key block verified */
+#define VBSD_TS_LF_PREAMBLE         5   /* Slot [index] preamble verified */
+#define VBSD_TS_LF_BODY             6   /* Slot [index] body hashed, verified */
+#define VBSD_TS_LK_START            7   /* LoadKernel() call [index] entered */
+#define VBSD_TS_LK_GPT              8   /* GPT read and parsed */
+#define VBSD_TS_LK_VBLOCK_READ      9   /* Kernel [part] vblock read */
+#define VBSD_TS_LK_VBLOCK_CHECKED   10  /* Kernel [part] headers checked */
+#define VBSD_TS_LK_BODY_READ        11  /* Kernel [part] body read */
+#define VBSD_TS_LK_BODY_CHECKED     12  /* Kernel [part] body verified */
+#define VBSD_TS_EC_SYNC_START       13  /* EC [index] software sync started */
+#define VBSD_TS_EC_SYNC             14  /* EC [index] software sync finished */
+
+/* When one stage of the boot finished */
+typedef struct VbSharedDataTimestamp {
+	/* VbExGetTimer() at the time */
+	uint64_t time;
+	/* What finished; see VBSD_TS_* */
+	uint8_t stage;
+	/*
+	 * Firmware slot (0=A, 1=B) for VBSD_TS_LF_*, which call to
+	 * LoadKernel() (lk_call_count at the time, less 1) for VBSD_TS_LK_*,
+	 * or the EC's devidx for VBSD_TS_EC_*
+	 */
+	uint8_t index;
+	/*
+	 * Which kernel partition of that call (kernel_parts_found at the
+	 * time, less 1), so its VbSharedDataKernelPart is
+	 * lk_calls[index].parts[part] if neither has wrapped around
+	 */
+	uint8_t part;
+	/* Reserved for padding */
+	uint8_t reserved0;
+} __attribute__((packed)) VbSharedDataTimestamp;
+
+/* Number of timestamps to keep.  Must be power of 2. */
+#define VBSD_MAX_TIMESTAMPS 32
+
 /*
  * Data shared between LoadFirmware(), LoadKernel(), and OS.
  *
@@ -543,10 +584,23 @@ typedef struct VbSharedDataHeader {
 	uint32_t kernel_version_lowest;
 
 	/*
-	 * After read-only firmware which uses version 2 is released, any
+	 * Fields added in version 3.  Before accessing, make sure that
+	 * struct_version >= 3
+	 */
+	/*
+	 * Number of timestamps recorded by VbSharedDataAddTimestamp().  This
+	 * wraps around, keeping the last VBSD_MAX_TIMESTAMPS of them.
+	 */
+	uint32_t timestamp_count;
+	/* Reserved for padding */
+	uint32_t reserved3;
+	VbSharedDataTimestamp timestamps[VBSD_MAX_TIMESTAMPS];
+
+	/*
+	 * After read-only firmware which uses version 3 is released, any
 	 * additional fields must be added below, and the struct version must
 	 * be increased.  Before reading/writing those fields, make sure that
-	 * the struct being accessed is at least version 3.
+	 * the struct being accessed is at least version 4.
 	 *
 	 * It's always ok for an older firmware to access a newer struct, since
 	 * all the fields it knows about are present.  Newer firmware needs to
@@ -562,7 +616,8 @@ typedef struct VbSharedDataHeader {
  */
 #define VB_SHARED_DATA_HEADER_SIZE_V1 1072
 #define VB_SHARED_DATA_HEADER_SIZE_V2 1096
+#define VB_SHARED_DATA_HEADER_SIZE_V3 1488
 
-#define VB_SHARED_DATA_VERSION 2      /* Version for struct_version */
+#define VB_SHARED_DATA_VERSION 3      /* Version for struct_version */
 
 #endif  /* VBOOT_REFERENCE_VBOOT_STRUCT_H_ */
@@ -15,6 +15,7 @@
 #include "load_kernel_fw.h"
 #include "utility.h"
 #include "vboot_api.h"
+#include "vboot_common.h"
 #include "vboot_struct.h"
 
 static VbError_t VbGbbReadKey(VbCommonParams *cparams, uint32_t offset,
@@ -40,6 +41,9 @@ static VbError_t VbGbbReadKey(VbCommonParams *cparams, uint32_t offset,
 		return ret;
 	}
 
+	VbSharedDataAddTimestamp(
+		(VbSharedDataHeader *)cparams->shared_data_blob,
+		VBSD_TS_GBB_KEY, 0, 0, VbExGetTimer());
 	*keyp = key;
 	return VBERROR_SUCCESS;
 }
@@ -17,6 +17,93 @@
 #include "vboot_api.h"
 #include "vboot_struct.h"
 
+#ifdef REGION_READ
+/*
+ * The GBB read cache lives in the caller's VbCommonParams.gbb_cache buffer:
+ * this header, then a tag for each block (its block number plus one, or zero
+ * if empty), then the blocks themselves. Block n goes in slot n % count.
+ */
+#define GBB_CACHE_MAGIC 0x43424756  /* "VGBC" */
+
+struct gbb_cache {
+	uint32_t magic;
+	uint32_t count;
+	uint32_t reserved[2];
+};
+
+static struct gbb_cache *GbbCacheGet(VbCommonParams *cparams)
+{
+	struct gbb_cache *c = cparams->gbb_cache;
+	uint32_t count;
+
+	if (!c || cparams->gbb_cache_size < VB_GBB_CACHE_SIZE(1))
+		return NULL;
+
+	count = (cparams->gbb_cache_size - sizeof(*c)) /
+		(sizeof(uint32_t) + VB_GBB_CACHE_BLOCK_SIZE);
+	if (c->magic != GBB_CACHE_MAGIC || c->count != count) {
+		Memset(c, 0, VB_GBB_CACHE_SIZE(count));
+		c->magic = GBB_CACHE_MAGIC;
+		c->count = count;
+	}
+	return c;
+}
+
+/*
+ * Reads through the cache. Runs of blocks that are missing from it are
+ * fetched with one VbExRegionRead() each. Returns non-zero if any of them
+ * can't be read, which happens near the end of the region, in which case
+ * the caller reads what it wanted directly.
+ */
+static VbError_t GbbCacheRead(VbCommonParams *cparams, struct gbb_cache *c,
+			      uint32_t offset, uint32_t size, uint8_t *buf)
+{
+	uint32_t *tag = (uint32_t *)(c + 1);
+	uint8_t *data = (uint8_t *)(tag + c->count);
+	uint32_t first = offset / VB_GBB_CACHE_BLOCK_SIZE;
+	uint32_t last = (offset + size - 1) / VB_GBB_CACHE_BLOCK_SIZE;
+	uint32_t block, end, slot, start, len;
+	VbError_t ret;
+
+	/* The blocks mustn't push each other out */
+	if (last - first >= c->count)
+		return VBERROR_UNKNOWN;
+
+	/* Fill in whatever's missing */
+	for (block = first; block <= last; block = end) {
+		slot = block % c->count;
+		end = block + 1;
+		if (tag[slot] == block + 1)
+			continue;
+		while (end <= last && (end % c->count) &&
+		       tag[end % c->count] != end + 1)
+			end++;
+		ret = VbExRegionRead(cparams, VB_REGION_GBB,
+				     block * VB_GBB_CACHE_BLOCK_SIZE,
+				     (end - block) * VB_GBB_CACHE_BLOCK_SIZE,
+				     data + slot * VB_GBB_CACHE_BLOCK_SIZE);
+		for (; block < end; block++, slot++)
+			tag[slot] = ret ? 0 : block + 1;
+		if (ret)
+			return ret;
+	}
+
+	/* Now it's all there */
+	for (block = first; block <= last; block++) {
+		slot = block % c->count;
+		start = block == first ? offset % VB_GBB_CACHE_BLOCK_SIZE : 0;
+		len = VB_GBB_CACHE_BLOCK_SIZE - start;
+		if (len > size)
+			len = size;
+		Memcpy(buf, data + slot * VB_GBB_CACHE_BLOCK_SIZE + start,
+		       len);
+		buf += len;
+		size -= len;
+	}
+	return VBERROR_SUCCESS;
+}
+#endif
+
 VbError_t VbRegionReadData(VbCommonParams *cparams,
 			   enum vb_firmware_region region, uint32_t offset,
 			   uint32_t size, void *buf)
@@ -29,8 +116,16 @@ VbError_t VbRegionReadData(VbCommonParams *cparams,
 	} else
 #ifdef REGION_READ
 	{
+		struct gbb_cache *c = NULL;
 		VbError_t ret;
 
+		/* Reads bigger than the whole cache would only thrash it */
+		if (region == VB_REGION_GBB && size &&
+		    size <= cparams->gbb_cache_size / 2)
+			c = GbbCacheGet(cparams);
+		if (c && !GbbCacheRead(cparams, c, offset, size, buf))
+			return VBERROR_SUCCESS;
+
 		ret = VbExRegionRead(cparams, region, offset, size, buf);
 		if (ret)
 			return ret;
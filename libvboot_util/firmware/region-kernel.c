@@ -93,14 +93,232 @@ VbError_t VbRegionReadHWID(VbCommonParams *cparams, char *hwid,
 	return VBERROR_SUCCESS;
 }
 
+/*
+ * The image cache lives entirely in cparams->image_cache: a header, then
+ * entries packed one after another, each holding a copy of something read
+ * from the GBB at [offset]: an ImageInfo followed by the decompressed image.  Dropping an entry slides the ones
+ * after it down, so the free space is always at the end.  While images are
+ * held, nothing is dropped, so images already handed out stay where they are.
+ */
+#define IMAGE_CACHE_MAGIC 0x43494256	/* "VBIC" */
+#define IMAGE_CACHE_ALIGN(x) (((x) + 7) & ~7)
+
+struct image_cache {
+	uint32_t magic;
+	uint32_t used;		/* Bytes of entries after this header */
+	uint32_t clock;		/* Bumped on each use, for LRU */
+	uint32_t held;		/* Non-zero while entries mustn't move */
+};
+
+struct image_cache_entry {
+	uint32_t offset;	/* Where in the GBB this came from */
+	uint32_t size;		/* Bytes of data following this header */
+	uint32_t stamp;		/* Value of clock when last used */
+	uint32_t reserved;
+};
+
+#define IMAGE_INFO_SIZE IMAGE_CACHE_ALIGN(sizeof(ImageInfo))
+
+static struct image_cache *ImageCacheGet(VbCommonParams *cparams)
+{
+	struct image_cache *c = cparams->image_cache;
+
+	if (!c || cparams->image_cache_size < sizeof(*c) + sizeof(
+		    struct image_cache_entry))
+		return NULL;
+
+	if (c->magic != IMAGE_CACHE_MAGIC) {
+		c->magic = IMAGE_CACHE_MAGIC;
+		c->used = 0;
+		c->clock = 0;
+		c->held = 0;
+	}
+	return c;
+}
+
+static struct image_cache_entry *ImageCacheNext(struct image_cache_entry *e)
+{
+	return (struct image_cache_entry *)((uint8_t *)(e + 1) +
+					    IMAGE_CACHE_ALIGN(e->size));
+}
+
+static struct image_cache_entry *ImageCacheFind(struct image_cache *c,
+						uint32_t offset)
+{
+	struct image_cache_entry *e = (struct image_cache_entry *)(c + 1);
+	uint8_t *end = (uint8_t *)(c + 1) + c->used;
+
+	for (; (uint8_t *)e < end; e = ImageCacheNext(e)) {
+		if (e->offset == offset) {
+			e->stamp = ++c->clock;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void ImageCacheDrop(struct image_cache *c, struct image_cache_entry *e)
+{
+	uint8_t *next = (uint8_t *)ImageCacheNext(e);
+	uint8_t *end = (uint8_t *)(c + 1) + c->used;
+	uint8_t *to = (uint8_t *)e;
+
+	c->used -= next - to;
+	/* Memcpy() needn't handle overlap, but copying forwards down does */
+	while (next < end)
+		*to++ = *next++;
+}
+
+/*
+ * Makes room for [size] bytes of data from [offset], dropping the least
+ * recently used entries as needed, unless images are held. Returns NULL if it
+ * can't fit.
+ */
+static struct image_cache_entry *ImageCacheAdd(VbCommonParams *cparams,
+					       struct image_cache *c,
+					       uint32_t offset, uint32_t size)
+{
+	uint32_t room = cparams->image_cache_size - sizeof(*c);
+	struct image_cache_entry *e;
+	uint32_t need;
+
+	if (size > room)
+		return NULL;
+	need = sizeof(*e) + IMAGE_CACHE_ALIGN(size);
+	if (need > room)
+		return NULL;
+
+	if (c->held && room - c->used < need)
+		return NULL;
+
+	while (room - c->used < need) {
+		struct image_cache_entry *oldest = NULL;
+		uint8_t *end = (uint8_t *)(c + 1) + c->used;
+
+		for (e = (struct image_cache_entry *)(c + 1);
+		     (uint8_t *)e < end; e = ImageCacheNext(e))
+			if (!oldest || e->stamp < oldest->stamp)
+				oldest = e;
+		ImageCacheDrop(c, oldest);
+	}
+
+	e = (struct image_cache_entry *)((uint8_t *)(c + 1) + c->used);
+	e->offset = offset;
+	e->size = size;
+	e->stamp = ++c->clock;
+	e->reserved = 0;
+	c->used += need;
+	return e;
+}
+
+/* Gives back the space at the end of the newest entry that wasn't needed */
+static void ImageCacheShrink(struct image_cache *c,
+			     struct image_cache_entry *e, uint32_t size)
+{
+	c->used -= IMAGE_CACHE_ALIGN(e->size) - IMAGE_CACHE_ALIGN(size);
+	e->size = size;
+}
+
+/*
+ * Makes sure cparams->layouts holds the screen layouts for [localization],
+ * reading the whole set of them at once when it doesn't already.
+ */
+static VbError_t VbGbbReadLayouts(VbCommonParams *cparams,
+				  const BmpBlockHeader *hdr,
+				  uint32_t localization)
+{
+	GoogleBinaryBlockHeader *gbb = cparams->gbb;
+	uint32_t size = hdr->number_of_screenlayouts * sizeof(ScreenLayout);
+	VbError_t ret;
+
+	if (cparams->layouts && cparams->layouts_localization == localization)
+		return VBERROR_SUCCESS;
+
+	/* The header doesn't change, so neither does the size */
+	if (!cparams->layouts)
+		cparams->layouts = VbExMalloc(size);
+	ret = VbRegionReadGbb(cparams, gbb->bmpfv_offset +
+			      sizeof(BmpBlockHeader) + localization * size,
+			      size, cparams->layouts);
+	if (ret) {
+		VbExFree(cparams->layouts);
+		cparams->layouts = NULL;
+		return ret;
+	}
+
+	cparams->layouts_localization = localization;
+	return VBERROR_SUCCESS;
+}
+
+/*
+ * Reads the image at [image_offset] and decompresses it, into [buf] of
+ * [buf_size] bytes if that's big enough, or else into memory from
+ * VbExMalloc().
+ */
+static VbError_t VbGbbReadImageData(VbCommonParams *cparams,
+				    uint32_t image_offset,
+				    const ImageInfo *image_info,
+				    void *buf, uint32_t buf_size,
+				    void **datap, uint32_t *data_sizep)
+{
+	uint32_t data_offset = image_offset + sizeof(*image_info);
+	uint32_t data_size = image_info->compressed_size;
+	void *data = NULL;
+	VbError_t ret;
+
+	if (data_size) {
+		void *orig_data;
+
+		if (image_info->compression == COMPRESS_NONE &&
+		    data_size <= buf_size)
+			data = buf;
+		else
+			data = VbExMalloc(image_info->compressed_size);
+		ret = VbRegionReadGbb(cparams, data_offset,
+				      image_info->compressed_size, data);
+		if (ret) {
+			if (data != buf)
+				VbExFree(data);
+			return ret;
+		}
+		if (image_info->compression != COMPRESS_NONE) {
+			uint32_t inoutsize = image_info->original_size;
+
+			if (inoutsize <= buf_size)
+				orig_data = buf;
+			else
+				orig_data = VbExMalloc(
+						image_info->original_size);
+			ret = VbExDecompress(data,
+					     image_info->compressed_size,
+					     image_info->compression,
+					     orig_data, &inoutsize);
+			data_size = inoutsize;
+			VbExFree(data);
+			data = orig_data;
+			if (ret) {
+				if (data != buf)
+					VbExFree(data);
+				return ret;
+			}
+		}
+	}
+
+	*datap = data;
+	*data_sizep = data_size;
+	return VBERROR_SUCCESS;
+}
+
 VbError_t VbGbbReadImage(VbCommonParams *cparams,
 			       uint32_t localization, uint32_t screen_index,
 			       uint32_t image_num, ScreenLayout *layout,
 			       ImageInfo *image_info, char **image_datap,
 			       uint32_t *image_data_sizep)
 {
-	uint32_t layout_offset, image_offset, data_offset, data_size;
+	uint32_t image_offset, data_size;
 	GoogleBinaryBlockHeader *gbb;
+	struct image_cache_entry *e = NULL;
+	struct image_cache *c;
 	BmpBlockHeader hdr;
 	void *data = NULL;
 	VbError_t ret;
@@ -112,54 +330,67 @@ VbError_t VbGbbReadImage(VbCommonParams *cparams,
 	if (ret)
 		return ret;
 
-	gbb = cparams->gbb;
-	layout_offset = gbb->bmpfv_offset + sizeof(BmpBlockHeader) +
-		localization * hdr.number_of_screenlayouts *
-			sizeof(ScreenLayout) +
-		screen_index * sizeof(ScreenLayout);
-	ret = VbRegionReadGbb(cparams, layout_offset, sizeof(*layout), layout);
+	if (localization >= hdr.number_of_localizations ||
+	    screen_index >= hdr.number_of_screenlayouts)
+		return VBERROR_INVALID_SCREEN_INDEX;
+
+	ret = VbGbbReadLayouts(cparams, &hdr, localization);
 	if (ret)
 		return ret;
+	*layout = cparams->layouts[screen_index];
 
 	if (!layout->images[image_num].image_info_offset)
 		return VBERROR_NO_IMAGE_PRESENT;
 
+	gbb = cparams->gbb;
 	image_offset = gbb->bmpfv_offset +
 			layout->images[image_num].image_info_offset;
+
+	/* The same image is often in several screens, so look it up by itself */
+	c = ImageCacheGet(cparams);
+	if (c) {
+		e = ImageCacheFind(c, image_offset);
+		if (e && e->size >= IMAGE_INFO_SIZE) {
+			Memcpy(image_info, e + 1, sizeof(*image_info));
+			data_size = e->size - IMAGE_INFO_SIZE;
+			*image_datap = data_size ?
+				(char *)(e + 1) + IMAGE_INFO_SIZE : NULL;
+			*image_data_sizep = data_size;
+			return VBERROR_SUCCESS;
+		}
+	}
+
 	ret = VbRegionReadGbb(cparams, image_offset, sizeof(*image_info),
 			      image_info);
 	if (ret)
 		return ret;
 
-	data_offset = image_offset + sizeof(*image_info);
-	data_size = image_info->compressed_size;
-	if (data_size) {
-		void *orig_data;
+	/* Reserve room for it up front, so it decompresses straight in */
+	if (c) {
+		data_size = image_info->compression == COMPRESS_NONE ?
+			image_info->compressed_size :
+			image_info->original_size;
+		if (data_size <= cparams->image_cache_size)
+			e = ImageCacheAdd(cparams, c, image_offset,
+					  IMAGE_INFO_SIZE + data_size);
+		else
+			e = NULL;
+	}
 
-		data = VbExMalloc(image_info->compressed_size);
-		ret = VbRegionReadGbb(cparams, data_offset,
-				      image_info->compressed_size, data);
-		if (ret) {
-			VbExFree(data);
-			return ret;
-		}
-		if (image_info->compression != COMPRESS_NONE) {
-			uint32_t inoutsize = image_info->original_size;
+	if (!e)
+		return VbGbbReadImageData(cparams, image_offset, image_info,
+					  NULL, 0, (void **)image_datap,
+					  image_data_sizep);
 
-			orig_data = VbExMalloc(image_info->original_size);
-			ret = VbExDecompress(data,
-					     image_info->compressed_size,
-					     image_info->compression,
-					     orig_data, &inoutsize);
-			data_size = inoutsize;
-			VbExFree(data);
-			data = orig_data;
-			if (ret) {
-				VbExFree(data);
-				return ret;
-			}
-		}
+	ret = VbGbbReadImageData(cparams, image_offset, image_info,
+				 (uint8_t *)(e + 1) + IMAGE_INFO_SIZE,
+				 e->size - IMAGE_INFO_SIZE, &data, &data_size);
+	if (ret) {
+		ImageCacheDrop(c, e);
+		return ret;
 	}
+	Memcpy(e + 1, image_info, sizeof(*image_info));
+	ImageCacheShrink(c, e, IMAGE_INFO_SIZE + data_size);
 
 	*image_datap = data;
 	*image_data_sizep = data_size;
@@ -167,6 +398,26 @@ VbError_t VbGbbReadImage(VbCommonParams *cparams,
 	return VBERROR_SUCCESS;
 }
 
+void VbGbbHoldImages(VbCommonParams *cparams, int hold)
+{
+	struct image_cache *c = cparams ? ImageCacheGet(cparams) : NULL;
+
+	if (c)
+		c->held = hold;
+}
+
+void VbGbbFreeImage(VbCommonParams *cparams, char *image_data)
+{
+	uint8_t *cache = cparams ? cparams->image_cache : NULL;
+
+	if (!image_data)
+		return;
+	if (cache && (uint8_t *)image_data >= cache &&
+	    (uint8_t *)image_data < cache + cparams->image_cache_size)
+		return;
+	VbExFree(image_data);
+}
+
 #define OUTBUF_LEN 128
 
 void VbRegionCheckVersion(VbCommonParams *cparams)
@@ -186,15 +437,13 @@ void VbRegionCheckVersion(VbCommonParams *cparams)
 	 */
 	if (gbb->major_version == GBB_MAJOR_VER && gbb->minor_version >= 1 &&
 	    (gbb->flags != 0)) {
-		uint32_t used = 0;
 		char outbuf[OUTBUF_LEN];
+		StrBuilder sb;
 
-		*outbuf = '\0';
-		used += StrnAppend(outbuf + used, "gbb.flags is nonzero: 0x",
-				OUTBUF_LEN - used);
-		used += Uint64ToString(outbuf + used, OUTBUF_LEN - used,
-				       gbb->flags, 16, 8);
-		used += StrnAppend(outbuf + used, "\n", OUTBUF_LEN - used);
+		StrBuilderInit(&sb, outbuf, sizeof(outbuf));
+		StrBuilderAppend(&sb, "gbb.flags is nonzero: 0x");
+		StrBuilderAppendUint64(&sb, gbb->flags, 16, 8);
+		StrBuilderAppend(&sb, "\n");
 		(void)VbExDisplayDebugInfo(outbuf);
 	}
 }
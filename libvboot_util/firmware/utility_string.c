@@ -72,3 +72,32 @@ uint32_t StrnAppend(char *dest, const char *src, uint32_t destlen)
 	dest[used] = 0;
 	return used;
 }
+
+void StrBuilderInit(StrBuilder *sb, char *buf, uint32_t size)
+{
+	sb->buf = buf;
+	sb->size = buf ? size : 0;
+	sb->used = 0;
+	if (sb->size)
+		*buf = '\0';
+}
+
+void StrBuilderAppend(StrBuilder *sb, const char *src)
+{
+	if (!sb->size || !src)
+		return;
+
+	while (*src && sb->used < sb->size - 1)
+		sb->buf[sb->used++] = *src++;
+	sb->buf[sb->used] = '\0';
+}
+
+void StrBuilderAppendUint64(StrBuilder *sb, uint64_t value, uint32_t radix,
+			    uint32_t zero_pad_width)
+{
+	if (!sb->size)
+		return;
+
+	sb->used += Uint64ToString(sb->buf + sb->used, sb->size - sb->used,
+				   value, radix, zero_pad_width);
+}
@@ -0,0 +1,402 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Common functions for the vboot 2.1 formats, between firmware and host.
+ */
+
+#include "sysincludes.h"
+
+#include "vb21_common.h"
+#include "vboot_api.h"
+#include "utility.h"
+
+/* The v1 algorithms go RSA1024 with SHA1, SHA256, SHA512, then RSA2048... */
+#define HASH_ALGS_PER_SIG 3
+
+int Vb21Algorithm(uint16_t sig_alg, uint16_t hash_alg)
+{
+	if (hash_alg == VB2_HASH_NONE || hash_alg >= VB2_HASH_ALG_COUNT ||
+	    sig_alg >= VB2_SIG_ALG_COUNT)
+		return -1;
+
+	/* Any RSA size will do for hashing */
+	if (sig_alg == VB2_SIG_NONE)
+		sig_alg = VB2_SIG_RSA1024;
+
+	return (sig_alg - 1) * HASH_ALGS_PER_SIG + (hash_alg - 1);
+}
+
+int Vb21SplitAlgorithm(uint64_t algorithm, uint16_t *sig_alg,
+		       uint16_t *hash_alg)
+{
+	if (algorithm >= kNumAlgorithms)
+		return 1;
+
+	*sig_alg = algorithm / HASH_ALGS_PER_SIG + VB2_SIG_RSA1024;
+	*hash_alg = algorithm % HASH_ALGS_PER_SIG + VB2_HASH_SHA1;
+	return 0;
+}
+
+const char *Vb21Desc(const void *obj)
+{
+	const struct vb21_struct_common *c = obj;
+
+	if (!c->desc_size)
+		return "";
+	return (const char *)obj + c->fixed_size;
+}
+
+int Vb21VerifyCommon(const void *obj, uint64_t size, uint32_t magic)
+{
+	const struct vb21_struct_common *c = obj;
+	const uint8_t *desc;
+
+	if (size < sizeof(*c)) {
+		VBDEBUG(("Not enough space for vb21 header.\n"));
+		return 1;
+	}
+	if (c->magic != magic) {
+		VBDEBUG(("Wrong vb21 magic 0x%08x.\n", c->magic));
+		return 1;
+	}
+	if (c->total_size > size || c->fixed_size < sizeof(*c) ||
+	    c->fixed_size > c->total_size ||
+	    c->desc_size > c->total_size - c->fixed_size) {
+		VBDEBUG(("vb21 object doesn't fit.\n"));
+		return 1;
+	}
+
+	/* The description must be terminated inside its own space */
+	desc = (const uint8_t *)obj + c->fixed_size;
+	if (c->desc_size && desc[c->desc_size - 1]) {
+		VBDEBUG(("vb21 description isn't terminated.\n"));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Is [offset, offset + size) inside the object, after its description? */
+static int MemberInside(const struct vb21_struct_common *c,
+			uint32_t offset, uint32_t size)
+{
+	return offset >= c->fixed_size + c->desc_size &&
+		offset <= c->total_size &&
+		size <= c->total_size - offset;
+}
+
+const struct vb21_packed_key *Vb21PackedKeyInside(const void *parent,
+						  uint32_t parent_size,
+						  uint32_t offset,
+						  uint32_t *end)
+{
+	const struct vb21_packed_key *key;
+	uint64_t key_size;
+	int algorithm;
+
+	if (offset > parent_size)
+		return NULL;
+	key = (const struct vb21_packed_key *)
+		((const uint8_t *)parent + offset);
+
+	if (Vb21VerifyCommon(key, parent_size - offset,
+			     VB21_MAGIC_PACKED_KEY))
+		return NULL;
+	if (key->c.struct_version_major != VB21_PACKED_KEY_VERSION_MAJOR ||
+	    key->c.fixed_size < sizeof(*key)) {
+		VBDEBUG(("Incompatible vb21 packed key.\n"));
+		return NULL;
+	}
+	if (!MemberInside(&key->c, key->key_offset, key->key_size)) {
+		VBDEBUG(("vb21 key data isn't inside the packed key.\n"));
+		return NULL;
+	}
+
+	algorithm = Vb21Algorithm(key->sig_alg, key->hash_alg);
+	if (key->sig_alg == VB2_SIG_NONE || algorithm < 0 ||
+	    !RSAProcessedKeySize(algorithm, &key_size) ||
+	    key_size != key->key_size) {
+		VBDEBUG(("Wrong vb21 key size for algorithm.\n"));
+		return NULL;
+	}
+
+	if (end)
+		*end = offset + key->c.total_size;
+	return key;
+}
+
+const struct vb21_signature *Vb21SignatureInside(const void *parent,
+						 uint32_t parent_size,
+						 uint32_t offset,
+						 uint32_t *end)
+{
+	const struct vb21_signature *sig;
+	int algorithm;
+
+	if (offset > parent_size)
+		return NULL;
+	sig = (const struct vb21_signature *)
+		((const uint8_t *)parent + offset);
+
+	if (Vb21VerifyCommon(sig, parent_size - offset, VB21_MAGIC_SIGNATURE))
+		return NULL;
+	if (sig->c.struct_version_major != VB21_SIGNATURE_VERSION_MAJOR ||
+	    sig->c.fixed_size < sizeof(*sig)) {
+		VBDEBUG(("Incompatible vb21 signature.\n"));
+		return NULL;
+	}
+	if (!MemberInside(&sig->c, sig->sig_offset, sig->sig_size)) {
+		VBDEBUG(("vb21 signature data isn't inside the signature.\n"));
+		return NULL;
+	}
+
+	algorithm = Vb21Algorithm(sig->sig_alg, sig->hash_alg);
+	if (algorithm < 0 ||
+	    sig->sig_size != (sig->sig_alg == VB2_SIG_NONE ?
+			      hash_size_map[algorithm] :
+			      siglen_map[algorithm])) {
+		VBDEBUG(("Wrong vb21 signature size for algorithm.\n"));
+		return NULL;
+	}
+
+	if (end)
+		*end = offset + sig->c.total_size;
+	return sig;
+}
+
+RSAPublicKey *Vb21PackedKeyToRSA(const struct vb21_packed_key *key)
+{
+	RSAPublicKey *rsa;
+
+	rsa = RSAPublicKeyFromBuf((const uint8_t *)key + key->key_offset,
+				  key->key_size);
+	if (!rsa)
+		return NULL;
+
+	rsa->algorithm = Vb21Algorithm(key->sig_alg, key->hash_alg);
+	return rsa;
+}
+
+int Vb21VerifyDigest(const uint8_t *digest, const struct vb21_signature *sig,
+		     const RSAPublicKey *key)
+{
+	const uint8_t *sig_data = (const uint8_t *)sig + sig->sig_offset;
+
+	if (sig->sig_alg == VB2_SIG_NONE)
+		return SafeMemcmp(digest, sig_data, sig->sig_size) ? 1 : 0;
+
+	if (!key ||
+	    key->algorithm != Vb21Algorithm(sig->sig_alg, sig->hash_alg)) {
+		VBDEBUG(("vb21 signature isn't for this key's algorithm.\n"));
+		return 1;
+	}
+
+	if (!RSAVerifyBinaryWithDigest_f(NULL, key, digest, sig_data,
+					 key->algorithm))
+		return 1;
+
+	return 0;
+}
+
+int Vb21VerifyData(const uint8_t *data, uint64_t size,
+		   const struct vb21_signature *sig, const RSAPublicKey *key)
+{
+	DigestContext ctx;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+
+	if (sig->data_size > size) {
+		VBDEBUG(("Data buffer smaller than length of signed data.\n"));
+		return 1;
+	}
+
+	DigestInit(&ctx, Vb21Algorithm(sig->sig_alg, sig->hash_alg));
+	DigestUpdate(&ctx, data, sig->data_size);
+	DigestFinalInto(&ctx, digest);
+
+	return Vb21VerifyDigest(digest, sig, key);
+}
+
+/* Does signature [sig] look like it was made by [key]? */
+static int SignatureByKey(const struct vb21_signature *sig,
+			  const struct vb21_packed_key *key, int check_id)
+{
+	if (sig->sig_alg != key->sig_alg || sig->hash_alg != key->hash_alg)
+		return 0;
+	return !check_id || !SafeMemcmp(&sig->id, &key->id, sizeof(key->id));
+}
+
+int Vb21VerifyKeyblock(const struct vb21_keyblock *block, uint64_t size,
+		       const struct vb21_packed_key *key)
+{
+	const struct vb21_signature *sig, *by_key = NULL, *by_alg = NULL;
+	RSAPublicKey *rsa;
+	uint32_t offset, i;
+	int rv;
+
+	if (Vb21VerifyCommon(block, size, VB21_MAGIC_KEYBLOCK))
+		return VBOOT_KEY_BLOCK_INVALID;
+	if (block->c.struct_version_major != VB21_KEYBLOCK_VERSION_MAJOR ||
+	    block->c.fixed_size < sizeof(*block)) {
+		VBDEBUG(("Incompatible vb21 keyblock.\n"));
+		return VBOOT_KEY_BLOCK_INVALID;
+	}
+
+	/* The data key comes before the signatures, which sign all of it */
+	if (block->key_offset < block->c.fixed_size + block->c.desc_size ||
+	    !Vb21PackedKeyInside(block, block->c.total_size,
+				 block->key_offset, &offset) ||
+	    block->sig_offset < offset || !block->sig_count) {
+		VBDEBUG(("vb21 keyblock data key is invalid.\n"));
+		return VBOOT_KEY_BLOCK_INVALID;
+	}
+
+	offset = block->sig_offset;
+	for (i = 0; i < block->sig_count; i++) {
+		sig = Vb21SignatureInside(block, block->c.total_size, offset,
+					  &offset);
+		if (!sig || sig->data_size != block->sig_offset) {
+			VBDEBUG(("vb21 keyblock signature %d is invalid.\n",
+				 (int)i));
+			return VBOOT_KEY_BLOCK_INVALID;
+		}
+
+		/* Checksums are cheap enough to check whatever the key */
+		if (sig->sig_alg == VB2_SIG_NONE) {
+			if (Vb21VerifyData((const uint8_t *)block,
+					   block->sig_offset, sig, NULL)) {
+				VBDEBUG(("vb21 keyblock hash failed.\n"));
+				return VBOOT_KEY_BLOCK_HASH;
+			}
+			continue;
+		}
+
+		if (!key)
+			continue;
+		if (!by_key && SignatureByKey(sig, key, 1))
+			by_key = sig;
+		if (!by_alg && SignatureByKey(sig, key, 0))
+			by_alg = sig;
+	}
+
+	if (!key)
+		return VBOOT_SUCCESS;
+
+	/* The ID may not be known, if it was signed without the public key */
+	sig = by_key ? by_key : by_alg;
+	if (!sig) {
+		VBDEBUG(("vb21 keyblock has no signature for the key.\n"));
+		return VBOOT_KEY_BLOCK_SIGNATURE;
+	}
+
+	rsa = Vb21PackedKeyToRSA(key);
+	if (!rsa) {
+		VBDEBUG(("Invalid public key passed to vb21 keyblock.\n"));
+		return VBOOT_PUBLIC_KEY_INVALID;
+	}
+	rv = Vb21VerifyData((const uint8_t *)block, block->sig_offset,
+			    sig, rsa);
+	RSAPublicKeyFree(rsa);
+	if (rv) {
+		VBDEBUG(("Invalid vb21 keyblock signature.\n"));
+		return VBOOT_KEY_BLOCK_SIGNATURE;
+	}
+
+	return VBOOT_SUCCESS;
+}
+
+const struct vb21_packed_key *Vb21KeyblockDataKey(
+	const struct vb21_keyblock *block)
+{
+	return (const struct vb21_packed_key *)
+		((const uint8_t *)block + block->key_offset);
+}
+
+int Vb21VerifyFwPreamble(const struct vb21_fw_preamble *preamble,
+			 uint64_t size, const RSAPublicKey *key)
+{
+	const struct vb21_signature *sig;
+	uint32_t offset, i;
+
+	if (Vb21VerifyCommon(preamble, size, VB21_MAGIC_FW_PREAMBLE))
+		return VBOOT_PREAMBLE_INVALID;
+	if (preamble->c.struct_version_major !=
+	    VB21_FW_PREAMBLE_VERSION_MAJOR ||
+	    preamble->c.fixed_size < sizeof(*preamble)) {
+		VBDEBUG(("Incompatible vb21 firmware preamble.\n"));
+		return VBOOT_PREAMBLE_INVALID;
+	}
+
+	/* The hashes are signed along with the rest */
+	offset = preamble->hash_offset;
+	if (offset < preamble->c.fixed_size + preamble->c.desc_size ||
+	    preamble->sig_offset > preamble->c.total_size) {
+		VBDEBUG(("vb21 preamble hashes overlap the header.\n"));
+		return VBOOT_PREAMBLE_INVALID;
+	}
+	for (i = 0; i < preamble->hash_count; i++) {
+		sig = Vb21SignatureInside(preamble, preamble->sig_offset,
+					  offset, &offset);
+		if (!sig || sig->sig_alg != VB2_SIG_NONE) {
+			VBDEBUG(("vb21 preamble hash %d is invalid.\n",
+				 (int)i));
+			return VBOOT_PREAMBLE_INVALID;
+		}
+	}
+
+	if (preamble->sig_offset < offset ||
+	    !(sig = Vb21SignatureInside(preamble, preamble->c.total_size,
+					preamble->sig_offset, NULL)) ||
+	    sig->data_size != preamble->sig_offset) {
+		VBDEBUG(("vb21 preamble signature is invalid.\n"));
+		return VBOOT_PREAMBLE_INVALID;
+	}
+
+	if (!key)
+		return VBOOT_SUCCESS;
+
+	if (sig->sig_alg == VB2_SIG_NONE ||
+	    Vb21VerifyData((const uint8_t *)preamble, preamble->sig_offset,
+			   sig, key)) {
+		VBDEBUG(("vb21 preamble signature validation failed.\n"));
+		return VBOOT_PREAMBLE_SIGNATURE;
+	}
+
+	return VBOOT_SUCCESS;
+}
+
+const struct vb21_signature *Vb21FwPreambleHash(
+	const struct vb21_fw_preamble *preamble, uint32_t index,
+	uint64_t *offset)
+{
+	const struct vb21_signature *sig;
+	const uint8_t *p = (const uint8_t *)preamble + preamble->hash_offset;
+	uint64_t body = 0;
+
+	if (index >= preamble->hash_count)
+		return NULL;
+
+	for (;;) {
+		sig = (const struct vb21_signature *)p;
+		if (!index--)
+			break;
+		body += sig->data_size;
+		p += sig->c.total_size;
+	}
+
+	if (offset)
+		*offset = body;
+	return sig;
+}
+
+uint64_t Vb21FwPreambleBodySize(const struct vb21_fw_preamble *preamble)
+{
+	const struct vb21_signature *sig;
+	uint64_t offset;
+
+	if (!preamble->hash_count)
+		return 0;
+
+	sig = Vb21FwPreambleHash(preamble, preamble->hash_count - 1, &offset);
+	return offset + sig->data_size;
+}
@@ -30,6 +30,7 @@ VbError_t VbSelectFirmware(VbCommonParams *cparams,
 
 	cparams->gbb = NULL;
 	cparams->bmp = NULL;
+	cparams->layouts = NULL;
 
 	/* Start timer */
 	shared->timer_vb_select_firmware_enter = VbExGetTimer();
@@ -52,6 +53,9 @@ VbError_t VbSelectFirmware(VbCommonParams *cparams,
 			VBDEBUG(("Can't read GBB. Continuing anyway...\n"));
 			VbExFree(cparams->gbb);
 			cparams->gbb = NULL;
+		} else {
+			VbSharedDataAddTimestamp(shared, VBSD_TS_GBB_HEADER,
+						 0, 0, VbExGetTimer());
 		}
 
 		/* Go directly to recovery mode */
@@ -61,6 +65,8 @@ VbError_t VbSelectFirmware(VbCommonParams *cparams,
 		retval = VbGbbReadHeader_static(cparams, cparams->gbb);
 		if (VBERROR_SUCCESS != retval)
 			goto VbSelectFirmware_exit;
+		VbSharedDataAddTimestamp(shared, VBSD_TS_GBB_HEADER, 0, 0,
+					 VbExGetTimer());
 
 		/* Chain to LoadFirmware() */
 		retval = LoadFirmware(cparams, fparams, &vnc);
@@ -36,7 +36,6 @@ VbError_t VbInit(VbCommonParams *cparams, VbInitParams *iparams)
 	uint32_t disable_dev_request = 0;
 	uint32_t clear_tpm_owner_request = 0;
 	int is_dev = 0;
-	uint32_t backup_requested = 0;
 	uint32_t backup_for_safety = 0;
 	int lost_nvram;
 
@@ -321,7 +320,7 @@ VbError_t VbInit(VbCommonParams *cparams, VbInitParams *iparams)
 		VbNvSet(&vnc, VBNV_DEV_BOOT_LEGACY, 0);
 		VbNvSet(&vnc, VBNV_DEV_BOOT_SIGNED_ONLY, 0);
 		/*
-		 * Back up any changes now, so these values can't be forgotten
+		 * Back up any changes this boot, so these values can't be forgotten
 		 * by draining the battery. We really only care about these
 		 * three fields, but it's uncommon for any others to change so
 		 * this is an easier test than checking each one.
@@ -350,13 +349,12 @@ VbError_t VbInit(VbCommonParams *cparams, VbInitParams *iparams)
 
 VbInit_exit:
 	/*
-	 * If we successfully backup the NV storage, it will clear the
-	 * VBNV_BACKUP_NVRAM_REQUEST field, so we want to do it before
-	 * calling VbNvTeardown(). It's okay if we can't backup, though.
+	 * The backup itself is written by VbSelectAndLoadKernel(), along with
+	 * any other TPM writes this boot needs, so just ask for it here. The
+	 * request lives in the nvram, so it isn't lost if we never get there.
 	 */
-	VbNvGet(&vnc, VBNV_BACKUP_NVRAM_REQUEST, &backup_requested);
-	if (backup_requested || backup_for_safety)
-		SaveNvToBackup(&vnc);
+	if (backup_for_safety)
+		VbNvSet(&vnc, VBNV_BACKUP_NVRAM_REQUEST, 1);
 
 	/* Tear down NV storage */
 	VbNvTeardown(&vnc);
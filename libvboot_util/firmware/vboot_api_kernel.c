@@ -7,8 +7,10 @@
 
 #include "sysincludes.h"
 
+#include "cgptlib_internal.h"
 #include "gbb_access.h"
 #include "gbb_header.h"
+#include "gpt_misc.h"
 #include "load_kernel_fw.h"
 #include "region.h"
 #include "rollback_index.h"
@@ -68,13 +70,206 @@ static int VbWantShutdown(uint32_t gbb_flags)
  *
  * May return other VBERROR_ codes for other failures.
  */
+/* One disk's GPT, read and checked alongside the others' */
+typedef struct VbDiskProbe {
+	const VbDiskInfo *info;
+	GptCache cache;		/* Empty unless the GPT was good as it is */
+} VbDiskProbe;
+
+static void VbProbeDiskJob(void *arg, uint32_t index)
+{
+	VbDiskProbe *d = (VbDiskProbe *)arg + index;
+	GptData gpt;
+
+	Memset(&gpt, 0, sizeof(gpt));
+	gpt.sector_bytes = (uint32_t)d->info->bytes_per_lba;
+	gpt.gpt_drive_sectors = d->info->lba_count;
+	gpt.streaming_drive_sectors = d->info->streaming_lba_count
+					?: d->info->lba_count;
+	gpt.flags = d->info->flags & VB_DISK_FLAG_EXTERNAL_GPT
+			? GPT_FLAG_EXTERNAL : 0;
+
+	/*
+	 * Only keep a GPT that needed no repair, so that there's nothing to
+	 * write now and LoadKernel() still writes any repair itself, if it
+	 * gets as far as this disk. With nothing modified, this just frees.
+	 */
+	if (0 == AllocAndReadGptData(d->info->handle, &gpt) &&
+	    GPT_SUCCESS == GptInit(&gpt) && !gpt.modified) {
+		WriteAndFreeGptDataCached(d->info->handle, &gpt, &d->cache);
+	} else {
+		gpt.modified = 0;
+		WriteAndFreeGptData(d->info->handle, &gpt);
+	}
+}
+
+/*
+ * Read and check the GPTs of all the [count] usable disks in [disk_info] at
+ * once, so slow disks wait together rather than one after another. Returns
+ * an array of probes, in disk order, which the caller frees with
+ * VbFreeDiskProbes(), or NULL if there's no memory.
+ */
+static VbDiskProbe *VbProbeDisks(const VbDiskInfo *disk_info,
+				 const uint32_t *usable, uint32_t count)
+{
+	VbDiskProbe *probes;
+	uint32_t i;
+
+	probes = VbExMalloc(count * sizeof(*probes));
+	if (!probes)
+		return NULL;
+	Memset(probes, 0, count * sizeof(*probes));
+	for (i = 0; i < count; i++)
+		probes[i].info = disk_info + usable[i];
+
+	VBDEBUG(("VbTryLoadKernel() probing %d disks\n", (int)count));
+	VbExRunParallel(VbProbeDiskJob, probes, count);
+	return probes;
+}
+
+static void VbFreeDiskProbes(VbDiskProbe *probes, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+		GptCacheFree(&probes[i].cache);
+	VbExFree(probes);
+}
+
+/*
+ * Removable disks that LoadKernel() found no good kernel on. Recovery mode
+ * polls for media every second, and would otherwise read the GPT of an
+ * unchanged bad disk and check its kernels all over again each time. A disk
+ * is known by its handle, its size, and the CRCs its primary GPT header has
+ * of itself and of the partition entries, so one that's swapped for another
+ * or repartitioned is tried again. (One whose kernel partition is rewritten
+ * in place, while it stays plugged in, isn't.)
+ */
+#define BAD_DISK_COUNT 4
+
+typedef struct VbDiskIdentity {
+	VbExDiskHandle_t handle;
+	uint64_t lba_count;
+	uint64_t boot_flags;
+	uint32_t header_crc32;
+	uint32_t entries_crc32;
+} VbDiskIdentity;
+
+static struct {
+	VbDiskIdentity id;
+	uint32_t retval;
+} bad_disks[BAD_DISK_COUNT];
+static uint32_t bad_disk_next;
+
+/*
+ * Fill in what [info] is known by, reading its primary GPT header. Returns
+ * nonzero if it can't be known that way, because it has no good one.
+ */
+static int VbGetDiskIdentity(const VbDiskInfo *info, uint64_t boot_flags,
+			     VbDiskIdentity *id)
+{
+	GptHeader *h;
+	int rv = 1;
+
+	if (info->flags & VB_DISK_FLAG_EXTERNAL_GPT)
+		return 1;
+	h = VbExMalloc(info->bytes_per_lba);
+	if (!h)
+		return 1;
+	if (VBERROR_SUCCESS == VbExDiskRead(info->handle, GPT_PMBR_SECTORS, 1,
+					    h) &&
+	    0 == CheckHeader(h, 0, info->streaming_lba_count ?: info->lba_count,
+			     info->lba_count, 0)) {
+		Memset(id, 0, sizeof(*id));
+		id->handle = info->handle;
+		id->lba_count = info->lba_count;
+		id->boot_flags = boot_flags & ~BOOT_FLAG_EXTERNAL_GPT;
+		id->header_crc32 = h->header_crc32;
+		id->entries_crc32 = h->entries_crc32;
+		rv = 0;
+	}
+	VbExFree(h);
+	return rv;
+}
+
+/* What LoadKernel() said about the disk [id], or 0 if it's not known bad */
+static uint32_t VbFindBadDisk(const VbDiskIdentity *id)
+{
+	int i;
+
+	for (i = 0; i < BAD_DISK_COUNT; i++)
+		if (bad_disks[i].retval &&
+		    0 == Memcmp(&bad_disks[i].id, id, sizeof(*id)))
+			return bad_disks[i].retval;
+	return 0;
+}
+
+static void VbAddBadDisk(const VbDiskIdentity *id, uint32_t retval)
+{
+	bad_disks[bad_disk_next].id = *id;
+	bad_disks[bad_disk_next].retval = retval;
+	bad_disk_next = (bad_disk_next + 1) % BAD_DISK_COUNT;
+}
+
+/* Forget the disks that aren't among the [count] in [info] any more */
+static void VbPruneBadDisks(const VbDiskInfo *info, uint32_t count)
+{
+	uint32_t j;
+	int i;
+
+	for (i = 0; i < BAD_DISK_COUNT; i++) {
+		if (!bad_disks[i].retval)
+			continue;
+		for (j = 0; j < count; j++)
+			if (info[j].handle == bad_disks[i].id.handle)
+				break;
+		if (j == count)
+			bad_disks[i].retval = 0;
+	}
+}
+
+/*
+ * Nonzero if the last LoadKernel() call couldn't read all it needed, so its
+ * result says nothing about what's on the disk.
+ */
+static int VbLoadKernelReadFailed(const LoadKernelParams *p)
+{
+	VbSharedDataHeader *shared =
+		(VbSharedDataHeader *)p->shared_data_blob;
+	VbSharedDataKernelCall *shcall;
+	uint32_t i, n, check;
+
+	if (!shared || !shared->lk_call_count)
+		return 1;
+	shcall = shared->lk_calls + ((shared->lk_call_count - 1)
+				     & (VBSD_MAX_KERNEL_CALLS - 1));
+	if (VBSD_LKC_CHECK_GPT_READ_ERROR == shcall->check_result)
+		return 1;
+	n = shcall->kernel_parts_found;
+	if (n > VBSD_MAX_KERNEL_PARTS)
+		return 1;	/* Some of them weren't recorded */
+	for (i = 0; i < n; i++) {
+		check = shcall->parts[i].check_result;
+		if (VBSD_LKP_CHECK_READ_START == check ||
+		    VBSD_LKP_CHECK_READ_DATA == check)
+			return 1;
+	}
+	return 0;
+}
+
 uint32_t VbTryLoadKernel(VbCommonParams *cparams, LoadKernelParams *p,
                          uint32_t get_info_flags)
 {
 	VbError_t retval = VBERROR_UNKNOWN;
 	VbDiskInfo* disk_info = NULL;
 	uint32_t disk_count = 0;
-	uint32_t i;
+	GptCache *gpt_cache = p->gpt_cache;
+	VbDiskProbe *probes = NULL;
+	VbDiskIdentity id;
+	uint32_t *usable = NULL;
+	uint32_t usable_count = 0;
+	uint32_t bad;
+	uint32_t i, j;
 
 	VBDEBUG(("VbTryLoadKernel() start, get_info_flags=0x%x\n",
 		 (unsigned)get_info_flags));
@@ -92,37 +287,89 @@ uint32_t VbTryLoadKernel(VbCommonParams *cparams, LoadKernelParams *p,
 		return VBERROR_NO_DISK_FOUND;
 	}
 
-	/* Loop over disks */
+	/*
+	 * Sanity-check what we can. FWIW, VbTryLoadKernel() is always called
+	 * with only a single bit set in get_info_flags.
+	 *
+	 * Ensure 512-byte sectors and non-trivially sized disk (for cgptlib)
+	 * and that we got a partition with only the flags we asked for.
+	 */
+	usable = VbExMalloc(disk_count * sizeof(*usable));
+	if (!usable) {
+		VbExDiskFreeInfo(disk_info, NULL);
+		VbSetRecoveryRequest(VBNV_RECOVERY_RW_NO_KERNEL);
+		return VBERROR_UNKNOWN;
+	}
 	for (i = 0; i < disk_count; i++) {
-		VBDEBUG(("VbTryLoadKernel() trying disk %d\n", (int)i));
-		/*
-		 * Sanity-check what we can. FWIW, VbTryLoadKernel() is always
-		 * called with only a single bit set in get_info_flags.
-		 *
-		 * Ensure 512-byte sectors and non-trivially sized disk (for
-		 * cgptlib) and that we got a partition with only the flags we
-		 * asked for.
-		 */
 		if (512 != disk_info[i].bytes_per_lba ||
 		    16 > disk_info[i].lba_count ||
 		    get_info_flags != (disk_info[i].flags & ~VB_DISK_FLAG_EXTERNAL_GPT)) {
-			VBDEBUG(("  skipping: bytes_per_lba=%" PRIu64
+			VBDEBUG(("  skipping disk %d: bytes_per_lba=%" PRIu64
 				 " lba_count=%" PRIu64 " flags=0x%x\n",
-				 disk_info[i].bytes_per_lba,
+				 (int)i, disk_info[i].bytes_per_lba,
 				 disk_info[i].lba_count,
 				 disk_info[i].flags));
 			continue;
 		}
-		p->disk_handle = disk_info[i].handle;
-		p->bytes_per_lba = disk_info[i].bytes_per_lba;
-		p->gpt_lba_count = disk_info[i].lba_count;
-		p->streaming_lba_count = disk_info[i].streaming_lba_count
-						?: p->gpt_lba_count;
-		p->boot_flags |= disk_info[i].flags & VB_DISK_FLAG_EXTERNAL_GPT
+		usable[usable_count++] = i;
+	}
+
+	/* Don't try removable disks again that haven't changed since */
+	if (get_info_flags == VB_DISK_FLAG_REMOVABLE) {
+		VbPruneBadDisks(disk_info, disk_count);
+		for (i = j = 0; i < usable_count; i++) {
+			if (!VbGetDiskIdentity(disk_info + usable[i],
+					       p->boot_flags, &id) &&
+			    (bad = VbFindBadDisk(&id))) {
+				VBDEBUG(("  skipping disk %d: no good kernel "
+					 "last time, and unchanged\n",
+					 (int)usable[i]));
+				retval = bad;
+				continue;
+			}
+			usable[j++] = usable[i];
+		}
+		usable_count = j;
+	}
+
+	/*
+	 * If asked, read all the GPTs up front. The disks are still tried in
+	 * order below, so the choice is the same; the ones further down the
+	 * list have just already been read.
+	 */
+	if ((p->boot_flags & BOOT_FLAG_PARALLEL_DISKS) && usable_count > 1)
+		probes = VbProbeDisks(disk_info, usable, usable_count);
+
+	/* Loop over disks */
+	for (i = 0; i < usable_count; i++) {
+		VBDEBUG(("VbTryLoadKernel() trying disk %d\n",
+			 (int)usable[i]));
+		if (probes)
+			p->gpt_cache = &probes[i].cache;
+		p->disk_handle = disk_info[usable[i]].handle;
+		p->bytes_per_lba = disk_info[usable[i]].bytes_per_lba;
+		p->gpt_lba_count = disk_info[usable[i]].lba_count;
+		p->streaming_lba_count =
+			disk_info[usable[i]].streaming_lba_count
+			?: p->gpt_lba_count;
+		p->boot_flags |= disk_info[usable[i]].flags &
+				VB_DISK_FLAG_EXTERNAL_GPT
 				? BOOT_FLAG_EXTERNAL_GPT : 0;
 		retval = LoadKernel(p, cparams);
 		VBDEBUG(("VbTryLoadKernel() LoadKernel() = %d\n", retval));
 
+		/*
+		 * Remember a removable disk that hasn't got a good kernel,
+		 * unless that's only because it couldn't be read this time.
+		 */
+		if (get_info_flags == VB_DISK_FLAG_REMOVABLE &&
+		    (VBERROR_INVALID_KERNEL_FOUND == retval ||
+		     VBERROR_NO_KERNEL_FOUND == retval) &&
+		    !VbLoadKernelReadFailed(p) &&
+		    !VbGetDiskIdentity(disk_info + usable[i], p->boot_flags,
+				       &id))
+			VbAddBadDisk(&id, retval);
+
 		/*
 		 * Stop now if we found a kernel.
 		 *
@@ -134,6 +381,12 @@ uint32_t VbTryLoadKernel(VbCommonParams *cparams, LoadKernelParams *p,
 			break;
 	}
 
+	if (probes) {
+		p->gpt_cache = gpt_cache;
+		VbFreeDiskProbes(probes, usable_count);
+	}
+	VbExFree(usable);
+
 	/* If we didn't find any good kernels, don't return a disk handle. */
 	if (VBERROR_SUCCESS != retval) {
 		VbSetRecoveryRequest(VBNV_RECOVERY_RW_NO_KERNEL);
@@ -149,7 +402,26 @@ uint32_t VbTryLoadKernel(VbCommonParams *cparams, LoadKernelParams *p,
 	return retval;
 }
 
+/**
+ * Wait up to [msec] for one of [events], or if the firmware can't do that,
+ * sleep for [poll_msec] so the caller can poll for them instead.  Returns
+ * how long to count that as: all of [msec] if it ran out, otherwise the poll
+ * interval, so a burst of events can't keep the caller from timing out.
+ */
+static uint32_t VbWaitForEvents(uint32_t msec, uint32_t poll_msec,
+				uint32_t events)
+{
+	uint32_t got = VbExWaitForEvent(msec, events);
+
+	if (got == VB_EVENT_UNSUPPORTED) {
+		VbExSleepMs(poll_msec);
+		return poll_msec;
+	}
+	return got ? poll_msec : msec;
+}
+
 #define CONFIRM_KEY_DELAY 20  /* Check confirm screen keys every 20ms */
+#define CONFIRM_EVENT_WAIT 1000  /* Or wait this long for them to happen */
 
 int VbUserConfirms(VbCommonParams *cparams, uint32_t confirm_flags)
 {
@@ -210,7 +482,11 @@ int VbUserConfirms(VbCommonParams *cparams, uint32_t confirm_flags)
 			}
 			VbCheckDisplayKey(cparams, key, &vnc);
 		}
-		VbExSleepMs(CONFIRM_KEY_DELAY);
+		/* A physical recovery button can only be polled */
+		VbWaitForEvents(shared->flags & VBSD_BOOT_REC_SWITCH_VIRTUAL ?
+				CONFIRM_EVENT_WAIT : CONFIRM_KEY_DELAY,
+				CONFIRM_KEY_DELAY,
+				VB_EVENT_KEY | VB_EVENT_SHUTDOWN);
 	}
 
 	/* Not reached, but compiler will complain without it */
@@ -420,6 +696,7 @@ VbError_t VbBootDeveloper(VbCommonParams *cparams, LoadKernelParams *p)
 			VbCheckDisplayKey(cparams, key, &vnc);
 			break;
 		}
+		VbAudioWaitForEvent(audio, VB_EVENT_KEY | VB_EVENT_SHUTDOWN);
 	} while(VbAudioLooping(audio));
 
  fallout:
@@ -446,6 +723,7 @@ VbError_t VbBootDeveloper(VbCommonParams *cparams, LoadKernelParams *p)
 #define REC_DISK_DELAY       1000     /* Check disks every 1s */
 #define REC_KEY_DELAY        20       /* Check keys every 20ms */
 #define REC_MEDIA_INIT_DELAY 500      /* Check removable media every 500ms */
+#define REC_EVENTS (VB_EVENT_KEY | VB_EVENT_SHUTDOWN | VB_EVENT_DISK)
 
 VbError_t VbBootRecovery(VbCommonParams *cparams, LoadKernelParams *p)
 {
@@ -453,6 +731,7 @@ VbError_t VbBootRecovery(VbCommonParams *cparams, LoadKernelParams *p)
 		(VbSharedDataHeader *)cparams->shared_data_blob;
 	uint32_t retval;
 	uint32_t key;
+	uint32_t waited;
 	int i;
 
 	VBDEBUG(("VbBootRecovery() start\n"));
@@ -505,12 +784,14 @@ VbError_t VbBootRecovery(VbCommonParams *cparams, LoadKernelParams *p)
 			 * Scan keyboard more frequently than media, since x86
 			 * platforms don't like to scan USB too rapidly.
 			 */
-			for (i = 0; i < REC_DISK_DELAY; i += REC_KEY_DELAY) {
+			for (i = 0; i < REC_DISK_DELAY; i += waited) {
 				VbCheckDisplayKey(cparams, VbExKeyboardRead(),
 						  &vnc);
 				if (VbWantShutdown(cparams->gbb->flags))
 					return VBERROR_SHUTDOWN_REQUESTED;
-				VbExSleepMs(REC_KEY_DELAY);
+				waited = VbWaitForEvents(REC_DISK_DELAY - i,
+							 REC_KEY_DELAY,
+							 REC_EVENTS);
 			}
 		}
 	}
@@ -540,7 +821,8 @@ VbError_t VbBootRecovery(VbCommonParams *cparams, LoadKernelParams *p)
 		 * Scan keyboard more frequently than media, since x86
 		 * platforms don't like to scan USB too rapidly.
 		 */
-		for (i = 0; i < REC_DISK_DELAY; i += REC_KEY_DELAY) {
+		for (i = 0; i < REC_DISK_DELAY; i += waited) {
+			waited = REC_KEY_DELAY;
 			key = VbExKeyboardRead();
 			/*
 			 * We might want to enter dev-mode from the Insert
@@ -607,7 +889,8 @@ VbError_t VbBootRecovery(VbCommonParams *cparams, LoadKernelParams *p)
 			}
 			if (VbWantShutdown(cparams->gbb->flags))
 				return VBERROR_SHUTDOWN_REQUESTED;
-			VbExSleepMs(REC_KEY_DELAY);
+			waited = VbWaitForEvents(REC_DISK_DELAY - i,
+						 REC_KEY_DELAY, REC_EVENTS);
 		}
 	}
 
@@ -630,6 +913,102 @@ static VbError_t EcProtectRW(int devidx)
 	return rv;
 }
 
+/**
+ * Get the expected EC-RW image for the firmware we booted, and hash it.
+ */
+static VbError_t EcGetExpectedImage(int devidx, VbSharedDataHeader *shared,
+				    const uint8_t **expected,
+				    int *expected_size, uint8_t *expected_hash)
+{
+	int rv;
+	int i;
+
+	rv = VbExEcGetExpectedRW(devidx, shared->firmware_index ?
+				 VB_SELECT_FIRMWARE_B : VB_SELECT_FIRMWARE_A,
+				 expected, expected_size);
+	if (rv) {
+		VBDEBUG(("VbEcSoftwareSync() - "
+			 "VbExEcGetExpectedRW() returned %d\n", rv));
+		VbSetRecoveryRequest(VBNV_RECOVERY_EC_EXPECTED_IMAGE);
+		return VBERROR_EC_REBOOT_TO_RO_REQUIRED;
+	}
+	VBDEBUG(("VbEcSoftwareSync() - expected len = %d\n",
+		 *expected_size));
+
+	internal_SHA256(*expected, *expected_size, expected_hash);
+	VBDEBUG(("Computed hash of expected image:"));
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		VBDEBUG(("%02x", expected_hash[i]));
+	VBDEBUG(("\n"));
+	return VBERROR_SUCCESS;
+}
+
+/**
+ * Update EC-RW to [expected]. If the EC can say what's in each of its flash
+ * sectors, only the runs of sectors that differ are written, so a small
+ * update takes a fraction of the time and wear of rewriting it all.
+ */
+static VbError_t EcUpdateRW(int devidx, const uint8_t *expected,
+			    int expected_size)
+{
+	uint8_t hash[SHA256_DIGEST_SIZE];
+	const uint8_t *ec_hashes;
+	int sector_size, count;
+	int sectors, changed = 0;
+	int i, run = -1;
+	int rv;
+
+	if (VbExEcHashRWSectors(devidx, &sector_size, &ec_hashes, &count) !=
+	    VBERROR_SUCCESS || sector_size <= 0) {
+		VBDEBUG(("VbEcSoftwareSync() - updating all of EC-RW\n"));
+		return VbExEcUpdateRW(devidx, expected, expected_size);
+	}
+
+	sectors = (expected_size + sector_size - 1) / sector_size;
+	if (count < sectors) {
+		VBDEBUG(("VbEcSoftwareSync() - "
+			 "EC-RW has %d sectors, not %d\n", count, sectors));
+		return VbExEcUpdateRW(devidx, expected, expected_size);
+	}
+
+	/*
+	 * A short last sector can't be compared with the EC's hash of a whole
+	 * one, so it's always written. Each run of sectors that differ is
+	 * written once the sector after it is found to match.
+	 */
+	for (i = 0; i <= sectors; i++) {
+		int same = 0;
+
+		if (i < sectors && (i + 1) * sector_size <= expected_size) {
+			internal_SHA256(expected + i * sector_size,
+					sector_size, hash);
+			same = !SafeMemcmp(hash,
+					   ec_hashes + i * SHA256_DIGEST_SIZE,
+					   SHA256_DIGEST_SIZE);
+		}
+		if (i < sectors && !same) {
+			if (run < 0)
+				run = i;
+			changed++;
+			continue;
+		}
+		if (run < 0)
+			continue;
+
+		rv = VbExEcUpdateRWSectors(
+			devidx, run * sector_size, expected + run * sector_size,
+			(i < sectors ? i * sector_size : expected_size) -
+			run * sector_size);
+		if (rv != VBERROR_SUCCESS)
+			return rv;
+		run = -1;
+	}
+
+	VBDEBUG(("VbEcSoftwareSync() - wrote %d of %d EC-RW sectors\n",
+		 changed, sectors));
+	return VBERROR_SUCCESS;
+}
+
 VbError_t VbEcSoftwareSync(int devidx, VbCommonParams *cparams)
 {
 	VbSharedDataHeader *shared =
@@ -711,26 +1090,14 @@ VbError_t VbEcSoftwareSync(int devidx, VbCommonParams *cparams)
 		return VBERROR_SUCCESS;
 	}
 
-	/* Get hash of EC-RW */
-	rv = VbExEcHashRW(devidx, &ec_hash, &ec_hash_size);
-	if (rv) {
-		VBDEBUG(("VbEcSoftwareSync() - "
-			 "VbExEcHashRW() returned %d\n", rv));
-		VbSetRecoveryRequest(VBNV_RECOVERY_EC_HASH_FAILED);
-		return VBERROR_EC_REBOOT_TO_RO_REQUIRED;
-	}
-	if (ec_hash_size != SHA256_DIGEST_SIZE) {
-		VBDEBUG(("VbEcSoftwareSync() - "
-			 "VbExEcHashRW() says size %d, not %d\n",
-			 ec_hash_size, SHA256_DIGEST_SIZE));
-		VbSetRecoveryRequest(VBNV_RECOVERY_EC_HASH_SIZE);
-		return VBERROR_EC_REBOOT_TO_RO_REQUIRED;
-	}
-
-	VBDEBUG(("EC hash:"));
-	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
-		VBDEBUG(("%02x", ec_hash[i]));
-	VBDEBUG(("\n"));
+	/*
+	 * Have the EC start hashing its RW image.  That can take hundreds of
+	 * ms on boards where the EC hashes its own flash, so fetch and hash
+	 * the expected image on the AP while it runs.  If the EC can't hash
+	 * in the background, VbExEcHashRW() below does it all as before.
+	 */
+	if (VbExEcHashRWStart(devidx) != VBERROR_SUCCESS)
+		VBDEBUG(("VbEcSoftwareSync() - EC hashes synchronously\n"));
 
 	/*
 	 * Get expected EC-RW hash. Note that we've already checked for
@@ -744,9 +1111,14 @@ VbError_t VbEcSoftwareSync(int devidx, VbCommonParams *cparams)
 	if (rv == VBERROR_EC_GET_EXPECTED_HASH_FROM_IMAGE) {
 		/*
 		 * BIOS has verified EC image but doesn't have a precomputed
-		 * hash for it, so we must compute the hash ourselves.
+		 * hash for it, so we must compute the hash ourselves.  Do it
+		 * now, while the EC is busy.
 		 */
 		rw_hash = NULL;
+		rv = EcGetExpectedImage(devidx, shared, &expected,
+					&expected_size, expected_hash);
+		if (rv)
+			return rv;
 	} else if (rv) {
 		VBDEBUG(("VbEcSoftwareSync() - "
 			 "VbExEcGetExpectedRWHash() returned %d\n", rv));
@@ -763,37 +1135,42 @@ VbError_t VbEcSoftwareSync(int devidx, VbCommonParams *cparams)
 		for (i = 0; i < SHA256_DIGEST_SIZE; i++)
 			VBDEBUG(("%02x", rw_hash[i]));
 		VBDEBUG(("\n"));
+	}
 
-		need_update = SafeMemcmp(ec_hash, rw_hash, SHA256_DIGEST_SIZE);
+	/* Get hash of EC-RW, waiting for the EC if it's still hashing */
+	rv = VbExEcHashRW(devidx, &ec_hash, &ec_hash_size);
+	if (rv) {
+		VBDEBUG(("VbEcSoftwareSync() - "
+			 "VbExEcHashRW() returned %d\n", rv));
+		VbSetRecoveryRequest(VBNV_RECOVERY_EC_HASH_FAILED);
+		return VBERROR_EC_REBOOT_TO_RO_REQUIRED;
 	}
+	if (ec_hash_size != SHA256_DIGEST_SIZE) {
+		VBDEBUG(("VbEcSoftwareSync() - "
+			 "VbExEcHashRW() says size %d, not %d\n",
+			 ec_hash_size, SHA256_DIGEST_SIZE));
+		VbSetRecoveryRequest(VBNV_RECOVERY_EC_HASH_SIZE);
+		return VBERROR_EC_REBOOT_TO_RO_REQUIRED;
+	}
+
+	VBDEBUG(("EC hash:"));
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		VBDEBUG(("%02x", ec_hash[i]));
+	VBDEBUG(("\n"));
 
 	/*
-	 * Get expected EC-RW image if we're sure we need to update (because the
-	 * expected hash didn't match the EC) or we still don't know (because
-	 * there was no expected hash and we need the image to compute one
-	 * ourselves).
+	 * If the expected hash didn't match the EC, we need the expected image
+	 * to update it with.  We only have it already if there was no
+	 * expected hash.
 	 */
-	if (need_update || !rw_hash) {
-		/* Get expected EC-RW image */
-		rv = VbExEcGetExpectedRW(devidx, shared->firmware_index ?
-					 VB_SELECT_FIRMWARE_B :
-					 VB_SELECT_FIRMWARE_A,
-					 &expected, &expected_size);
-		if (rv) {
-			VBDEBUG(("VbEcSoftwareSync() - "
-				 "VbExEcGetExpectedRW() returned %d\n", rv));
-			VbSetRecoveryRequest(VBNV_RECOVERY_EC_EXPECTED_IMAGE);
-			return VBERROR_EC_REBOOT_TO_RO_REQUIRED;
+	if (rw_hash) {
+		need_update = SafeMemcmp(ec_hash, rw_hash, SHA256_DIGEST_SIZE);
+		if (need_update) {
+			rv = EcGetExpectedImage(devidx, shared, &expected,
+						&expected_size, expected_hash);
+			if (rv)
+				return rv;
 		}
-		VBDEBUG(("VbEcSoftwareSync() - expected len = %d\n",
-			 expected_size));
-
-		/* Hash expected image */
-		internal_SHA256(expected, expected_size, expected_hash);
-		VBDEBUG(("Computed hash of expected image:"));
-		for (i = 0; i < SHA256_DIGEST_SIZE; i++)
-			VBDEBUG(("%02x", expected_hash[i]));
-		VBDEBUG(("\n"));
 	}
 
 	if (!rw_hash) {
@@ -867,11 +1244,11 @@ VbError_t VbEcSoftwareSync(int devidx, VbCommonParams *cparams)
 			VbDisplayScreen(cparams, VB_SCREEN_WAIT, 0, &vnc);
 		}
 
-		rv = VbExEcUpdateRW(devidx, expected, expected_size);
+		rv = EcUpdateRW(devidx, expected, expected_size);
 
 		if (rv != VBERROR_SUCCESS) {
 			VBDEBUG(("VbEcSoftwareSync() - "
-				 "VbExEcUpdateRW() returned %d\n", rv));
+				 "updating EC-RW returned %d\n", rv));
 
 			/*
 			 * The EC may know it needs a reboot.  It may need to
@@ -962,6 +1339,44 @@ void VbApiKernelFree(VbCommonParams *cparams)
 		VbExFree(cparams->bmp);
 		cparams->bmp = NULL;
 	}
+	if (cparams->layouts) {
+		VbExFree(cparams->layouts);
+		cparams->layouts = NULL;
+	}
+}
+
+/**
+ * Write out the TPM updates collected during the boot, in one sequence right
+ * before the kernel space is locked: the kernel version, if [advance_tpm] and
+ * it went up, then the nvram backup, if VbInit() or the boot screens asked
+ * for one. Writes that wouldn't change anything are skipped.
+ */
+static VbError_t VbFlushTpmWrites(VbSharedDataHeader *shared, int advance_tpm)
+{
+	uint32_t backup_requested = 0;
+	uint32_t tpm_status;
+
+	if (advance_tpm &&
+	    shared->kernel_version_tpm > shared->kernel_version_tpm_start) {
+		VBDEBUG(("Advancing TPM kernel version to 0x%x\n",
+			 shared->kernel_version_tpm));
+		tpm_status = RollbackKernelWrite(shared->kernel_version_tpm);
+		if (0 != tpm_status) {
+			VBDEBUG(("Error writing kernel versions to TPM.\n"));
+			VbSetRecoveryRequest(VBNV_RECOVERY_RW_TPM_W_ERROR);
+			return VBERROR_TPM_WRITE_KERNEL;
+		}
+	}
+
+	/*
+	 * It's okay if we can't back up; the request stays set, so it's tried
+	 * again next boot.
+	 */
+	VbNvGet(&vnc, VBNV_BACKUP_NVRAM_REQUEST, &backup_requested);
+	if (backup_requested)
+		SaveNvToBackup(&vnc);
+
+	return VBERROR_SUCCESS;
 }
 
 VbError_t VbSelectAndLoadKernel(VbCommonParams *cparams,
@@ -972,6 +1387,7 @@ VbError_t VbSelectAndLoadKernel(VbCommonParams *cparams,
 	VbError_t retval = VBERROR_SUCCESS;
 	LoadKernelParams p;
 	uint32_t tpm_status = 0;
+	int advance_tpm = 0;
 
 	/* Start timer */
 	shared->timer_vb_select_and_load_kernel_enter = VbExGetTimer();
@@ -988,17 +1404,24 @@ VbError_t VbSelectAndLoadKernel(VbCommonParams *cparams,
 	Memset(kparams->partition_guid, 0, sizeof(kparams->partition_guid));
 
 	cparams->bmp = NULL;
+	cparams->layouts = NULL;
 	cparams->gbb = VbExMalloc(sizeof(*cparams->gbb));
 	retval = VbGbbReadHeader_static(cparams, cparams->gbb);
 	if (VBERROR_SUCCESS != retval)
 		goto VbSelectAndLoadKernel_exit;
+	VbSharedDataAddTimestamp(shared, VBSD_TS_GBB_HEADER, 0, 0,
+				 VbExGetTimer());
 
 	/* Do EC software sync if necessary */
 	if ((shared->flags & VBSD_EC_SOFTWARE_SYNC) &&
 	    !(cparams->gbb->flags & GBB_FLAG_DISABLE_EC_SOFTWARE_SYNC)) {
 		int oprom_mismatch = 0;
 
+		VbSharedDataAddTimestamp(shared, VBSD_TS_EC_SYNC_START, 0, 0,
+					 VbExGetTimer());
 		retval = VbEcSoftwareSync(0, cparams);
+		VbSharedDataAddTimestamp(shared, VBSD_TS_EC_SYNC, 0, 0,
+					 VbExGetTimer());
 		/* Save reboot requested until after possible PD sync */
 		if (retval == VBERROR_VGA_OPROM_MISMATCH)
 			oprom_mismatch = 1;
@@ -1008,7 +1431,11 @@ VbError_t VbSelectAndLoadKernel(VbCommonParams *cparams,
 #ifdef PD_SYNC
 		if (!(cparams->gbb->flags &
 		      GBB_FLAG_DISABLE_PD_SOFTWARE_SYNC)) {
+			VbSharedDataAddTimestamp(shared, VBSD_TS_EC_SYNC_START,
+						 1, 0, VbExGetTimer());
 			retval = VbEcSoftwareSync(1, cparams);
+			VbSharedDataAddTimestamp(shared, VBSD_TS_EC_SYNC, 1, 0,
+						 VbExGetTimer());
 			if (retval == VBERROR_VGA_OPROM_MISMATCH)
 				oprom_mismatch = 1;
 			else if (retval != VBERROR_SUCCESS)
@@ -1125,23 +1552,12 @@ VbError_t VbSelectAndLoadKernel(VbCommonParams *cparams,
 				goto VbSelectAndLoadKernel_exit;
 			}
 		} else {
-			/* Not trying a new firmware B. */
-
-			/* See if we need to update the TPM. */
-			VBDEBUG(("Checking if TPM kernel version needs "
-				 "advancing\n"));
-			if (shared->kernel_version_tpm >
-			    shared->kernel_version_tpm_start) {
-				tpm_status = RollbackKernelWrite(
-						shared->kernel_version_tpm);
-				if (0 != tpm_status) {
-					VBDEBUG(("Error writing kernel "
-						 "versions to TPM.\n"));
-					VbSetRecoveryRequest(VBNV_RECOVERY_RW_TPM_W_ERROR);
-					retval = VBERROR_TPM_WRITE_KERNEL;
-					goto VbSelectAndLoadKernel_exit;
-				}
-			}
+			/*
+			 * Not trying a new firmware B, so the TPM may be
+			 * advanced; that's done with the other TPM writes,
+			 * just before the kernel space is locked.
+			 */
+			advance_tpm = 1;
 		}
 	}
 
@@ -1157,6 +1573,10 @@ VbError_t VbSelectAndLoadKernel(VbCommonParams *cparams,
 	Memcpy(kparams->partition_guid, p.partition_guid,
 	       sizeof(kparams->partition_guid));
 
+	retval = VbFlushTpmWrites(shared, advance_tpm);
+	if (VBERROR_SUCCESS != retval)
+		goto VbSelectAndLoadKernel_exit;
+
 	/* Lock the kernel versions.  Ignore errors in recovery mode. */
 	tpm_status = RollbackKernelLock(shared->recovery_reason);
 	if (0 != tpm_status) {
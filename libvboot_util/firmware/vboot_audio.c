@@ -289,6 +289,24 @@ int VbAudioLooping(VbAudioContext *audio)
 	return looping;
 }
 
+/**
+ * Where the firmware can wait for events, wait until the next note is due or
+ * one of [events] happens. Otherwise return at once, and the caller polls.
+ */
+void VbAudioWaitForEvent(VbAudioContext *audio, uint32_t events)
+{
+	uint64_t now = VbExGetTimer();
+	uint64_t msec;
+
+	if (!ticks_per_msec || now >= audio->play_until)
+		return;
+
+	msec = (audio->play_until - now + ticks_per_msec - 1) / ticks_per_msec;
+	if (msec > UINT_MAX)
+		msec = UINT_MAX;
+	VbExWaitForEvent((uint32_t)msec, events);
+}
+
 /**
  * Caller should call this prior to booting.
  */
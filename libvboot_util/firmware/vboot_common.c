@@ -120,20 +120,29 @@ int PublicKeyCopy(VbPublicKey *dest, const VbPublicKey *src)
 	return 0;
 }
 
-RSAPublicKey *PublicKeyToRSA(const VbPublicKey *key)
+/* Is [key]'s size right for its algorithm? */
+static int PublicKeySizeOkay(const VbPublicKey *key)
 {
-	RSAPublicKey *rsa;
 	uint64_t key_size;
 
 	if (kNumAlgorithms <= key->algorithm) {
 		VBDEBUG(("Invalid algorithm.\n"));
-		return NULL;
+		return 0;
 	}
 	if (!RSAProcessedKeySize(key->algorithm, &key_size) ||
 	    key_size != key->key_size) {
 		VBDEBUG(("Wrong key size for algorithm\n"));
-		return NULL;
+		return 0;
 	}
+	return 1;
+}
+
+RSAPublicKey *PublicKeyToRSA(const VbPublicKey *key)
+{
+	RSAPublicKey *rsa;
+
+	if (!PublicKeySizeOkay(key))
+		return NULL;
 
 	rsa = RSAPublicKeyFromBuf(GetPublicKeyDataC(key), key->key_size);
 	if (!rsa)
@@ -143,6 +152,77 @@ RSAPublicKey *PublicKeyToRSA(const VbPublicKey *key)
 	return rsa;
 }
 
+RSAPublicKey *PublicKeyToRSAView(const VbPublicKey *key, RSAPublicKey *view)
+{
+	RSAPublicKey *rsa;
+
+	if (!PublicKeySizeOkay(key))
+		return NULL;
+
+	rsa = RSAPublicKeyView(view, GetPublicKeyDataC(key), key->key_size);
+	if (!rsa)
+		return NULL;
+
+	rsa->algorithm = (unsigned int)key->algorithm;
+	return rsa;
+}
+
+/* Does [rsa] hold the same key as [key]? */
+static int RSAKeyMatches(const RSAPublicKey *rsa, const VbPublicKey *key)
+{
+	const uint8_t *buf = GetPublicKeyDataC(key);
+	uint64_t words = rsa->len * sizeof(uint32_t);
+	uint32_t n0inv;
+
+	if (rsa->algorithm != key->algorithm ||
+	    key->key_size != 2 * sizeof(uint32_t) + 2 * words)
+		return 0;
+
+	/* A different modulus almost certainly has a different n0inv */
+	Memcpy(&n0inv, buf + sizeof(uint32_t), sizeof(n0inv));
+	if (n0inv != rsa->n0inv)
+		return 0;
+
+	buf += 2 * sizeof(uint32_t);
+	return !Memcmp(rsa->n, buf, words) &&
+		!Memcmp(rsa->rr, buf + words, words);
+}
+
+const RSAPublicKey *RSAKeyCacheGet(RSAKeyCache *cache,
+				   const VbPublicKey *key)
+{
+	RSAPublicKey *rsa;
+	int i;
+
+	for (i = 0; i < RSA_KEY_CACHE_SIZE; i++)
+		if (cache->rsa[i] && RSAKeyMatches(cache->rsa[i], key)) {
+			CRYPTO_STATS_ADD(rsa_key_hits, 1);
+			return cache->rsa[i];
+		}
+
+	CRYPTO_STATS_ADD(rsa_key_misses, 1);
+	rsa = PublicKeyToRSA(key);
+	if (!rsa)
+		return NULL;
+
+	/* Replace the oldest one */
+	i = cache->next++ % RSA_KEY_CACHE_SIZE;
+	if (cache->rsa[i])
+		RSAPublicKeyFree(cache->rsa[i]);
+	cache->rsa[i] = rsa;
+	return rsa;
+}
+
+void RSAKeyCacheFree(RSAKeyCache *cache)
+{
+	int i;
+
+	for (i = 0; i < RSA_KEY_CACHE_SIZE; i++)
+		if (cache->rsa[i])
+			RSAPublicKeyFree(cache->rsa[i]);
+	Memset(cache, 0, sizeof(*cache));
+}
+
 int VerifyData(const uint8_t *data, uint64_t size, const VbSignature *sig,
                const RSAPublicKey *key)
 {
@@ -186,6 +266,13 @@ int VerifyDigest(const uint8_t *digest, const VbSignature *sig,
 
 int KeyBlockVerify(const VbKeyBlockHeader *block, uint64_t size,
                    const VbPublicKey *key, int hash_only)
+{
+	return KeyBlockVerifyCached(block, size, key, hash_only, NULL);
+}
+
+int KeyBlockVerifyCached(const VbKeyBlockHeader *block, uint64_t size,
+			 const VbPublicKey *key, int hash_only,
+			 RSAKeyCache *cache)
 {
 	const VbSignature *sig;
 
@@ -219,7 +306,7 @@ int KeyBlockVerify(const VbKeyBlockHeader *block, uint64_t size,
 	 */
 	if (hash_only) {
 		/* Check hash */
-		uint8_t *header_checksum = NULL;
+		uint8_t header_checksum[SHA512_DIGEST_SIZE];
 		int rv;
 
 		sig = &block->key_block_checksum;
@@ -240,19 +327,19 @@ int KeyBlockVerify(const VbKeyBlockHeader *block, uint64_t size,
 		}
 
 		VBDEBUG(("Checking key block hash only...\n"));
-		header_checksum = DigestBuf((const uint8_t *)block,
-					    sig->data_size,
-					    SHA512_DIGEST_ALGORITHM);
+		DigestBufInto((const uint8_t *)block, sig->data_size,
+			      SHA512_DIGEST_ALGORITHM, header_checksum);
 		rv = SafeMemcmp(header_checksum, GetSignatureDataC(sig),
 				SHA512_DIGEST_SIZE);
-		VbExFree(header_checksum);
 		if (rv) {
 			VBDEBUG(("Invalid key block hash.\n"));
 			return VBOOT_KEY_BLOCK_HASH;
 		}
 	} else {
 		/* Check signature */
-		RSAPublicKey *rsa;
+		const RSAPublicKey *rsa;
+		RSAPublicKey *tmp = NULL;
+		RSAPublicKey view;
 		int rv;
 
 		sig = &block->key_block_signature;
@@ -262,7 +349,10 @@ int KeyBlockVerify(const VbKeyBlockHeader *block, uint64_t size,
 			return VBOOT_KEY_BLOCK_INVALID;
 		}
 
-		rsa = PublicKeyToRSA(key);
+		if (cache)
+			rsa = RSAKeyCacheGet(cache, key);
+		else
+			rsa = tmp = PublicKeyToRSAView(key, &view);
 		if (!rsa) {
 			VBDEBUG(("Invalid public key\n"));
 			return VBOOT_PUBLIC_KEY_INVALID;
@@ -271,13 +361,15 @@ int KeyBlockVerify(const VbKeyBlockHeader *block, uint64_t size,
 		/* Make sure advertised signature data sizes are sane. */
 		if (block->key_block_size < sig->data_size) {
 			VBDEBUG(("Signature calculated past end of block\n"));
-			RSAPublicKeyFree(rsa);
+			if (tmp)
+				RSAPublicKeyViewFree(tmp, &view);
 			return VBOOT_KEY_BLOCK_INVALID;
 		}
 
 		VBDEBUG(("Checking key block signature...\n"));
 		rv = VerifyData((const uint8_t *)block, size, sig, rsa);
-		RSAPublicKeyFree(rsa);
+		if (tmp)
+			RSAPublicKeyViewFree(tmp, &view);
 		if (rv) {
 			VBDEBUG(("Invalid key block signature.\n"));
 			return VBOOT_KEY_BLOCK_SIGNATURE;
@@ -542,3 +634,21 @@ int VbSharedDataSetKernelKey(VbSharedDataHeader *header, const VbPublicKey *src)
 
 	return PublicKeyCopy(kdest, src);
 }
+
+void VbSharedDataAddTimestamp(VbSharedDataHeader *header, uint8_t stage,
+			      uint8_t index, uint8_t part, uint64_t time)
+{
+	VbSharedDataTimestamp *ts;
+
+	if (!header || header->struct_version < 3)
+		return;
+
+	ts = header->timestamps + (header->timestamp_count
+				   & (VBSD_MAX_TIMESTAMPS - 1));
+	ts->time = time;
+	ts->stage = stage;
+	ts->index = index;
+	ts->part = part;
+	ts->reserved0 = 0;
+	header->timestamp_count++;
+}
@@ -19,6 +19,8 @@
 
 static uint32_t disp_current_screen = VB_SCREEN_BLANK;
 static uint32_t disp_width = 0, disp_height = 0;
+/* Set once VbExDisplayImages() turns out not to be supported */
+static int disp_no_list = 0;
 
 VbError_t VbGetLocalizationCount(VbCommonParams *cparams, uint32_t *count)
 {
@@ -36,66 +38,142 @@ VbError_t VbGetLocalizationCount(VbCommonParams *cparams, uint32_t *count)
 	return VBERROR_SUCCESS;
 }
 
+static FontArrayEntryHeader *VbNextFontEntry(FontArrayEntryHeader *entry)
+{
+	return (FontArrayEntryHeader *)((uint8_t *)entry +
+					sizeof(FontArrayEntryHeader) +
+					entry->info.compressed_size);
+}
+
 /*
- * TODO: We could cache the font info to speed things up, by making the
- * in-memory font structure distinct from the in-flash version.  We'll do that
- * Real Soon Now. Until then, we just repeat the same linear search every time.
+ * Walks the glyphs once, so that looking one up for each character is just
+ * an index into font->glyph[].
  */
-
 VbFont_t *VbInternalizeFontData(FontArrayHeader *fonthdr)
 {
-	/* Just return the raw data pointer for now. */
-	return (VbFont_t *)fonthdr;
+	FontArrayEntryHeader *entry;
+	VbFont_t *font;
+	uint32_t i;
+
+	if (!fonthdr)
+		return NULL;
+
+	font = VbExMalloc(sizeof(*font));
+	Memset(font, 0, sizeof(*font));
+	font->hdr = fonthdr;
+
+	entry = (FontArrayEntryHeader *)(fonthdr + 1);
+	for (i = 0; i < fonthdr->num_entries; i++) {
+		/* The first match wins, as it did when we searched for it */
+		if (entry->ascii < VB_FONT_INDEX_SIZE &&
+		    !font->glyph[entry->ascii])
+			font->glyph[entry->ascii] = entry;
+		entry = VbNextFontEntry(entry);
+	}
+
+	return font;
 }
 
 void VbDoneWithFontForNow(VbFont_t *ptr)
 {
-	/* Nothing. */
+	if (ptr)
+		VbExFree(ptr);
 }
 
 ImageInfo *VbFindFontGlyph(VbFont_t *font, uint32_t ascii,
 			   void **bufferptr, uint32_t *buffersize)
 {
-	uint8_t *ptr, *firstptr;
-	uint32_t max;
+	FontArrayEntryHeader *entry = NULL;
 	uint32_t i;
-	FontArrayEntryHeader *entry;
-
-	ptr = (uint8_t *)font;
-	max = ((FontArrayHeader *)ptr)->num_entries;
-	ptr += sizeof(FontArrayHeader);
-	firstptr = ptr;
 
 	/*
-	 * Simple linear search.
-	 *
 	 * Note: We're assuming glpyhs are uncompressed. That's true because
 	 * the bmpblk_font tool doesn't compress anything. The bmpblk_utility
 	 * does, but it compresses the entire font blob at once, and we've
 	 * already uncompressed that before we got here.
 	 */
-	for(i=0; i<max; i++) {
-		entry = (FontArrayEntryHeader *)ptr;
-		if (entry->ascii == ascii) {
-			*bufferptr = ptr + sizeof(FontArrayEntryHeader);
-			*buffersize = entry->info.original_size;
-			return &(entry->info);
+	if (ascii < VB_FONT_INDEX_SIZE) {
+		entry = font->glyph[ascii];
+	} else {
+		/* Anything past the index is rare enough to search for */
+		FontArrayEntryHeader *e =
+			(FontArrayEntryHeader *)(font->hdr + 1);
+
+		for (i = 0; i < font->hdr->num_entries; i++) {
+			if (e->ascii == ascii) {
+				entry = e;
+				break;
+			}
+			e = VbNextFontEntry(e);
 		}
-		ptr += sizeof(FontArrayEntryHeader)+entry->info.compressed_size;
 	}
 
 	/*
 	 * We must return something valid. We'll just use the first glyph in
 	 * the font structure (so it should be something distinct).
 	 */
-	entry = (FontArrayEntryHeader *)firstptr;
-	*bufferptr = firstptr + sizeof(FontArrayEntryHeader);
+	if (!entry)
+		entry = (FontArrayEntryHeader *)(font->hdr + 1);
+
+	*bufferptr = (uint8_t *)entry + sizeof(FontArrayEntryHeader);
 	*buffersize = entry->info.original_size;
 	return &(entry->info);
 }
 
-void VbRenderTextAtPos(const char *text, int right_to_left,
-		       uint32_t x, uint32_t y, VbFont_t *font)
+VbError_t VbDisplayListFlush(VbDisplayList *list)
+{
+	VbError_t retval = VBERROR_SUCCESS;
+	VbError_t ret;
+	uint32_t i;
+
+	if (!list->count)
+		return VBERROR_SUCCESS;
+
+	if (!disp_no_list) {
+		retval = VbExDisplayImages(list->images, list->count);
+		if (VBERROR_NO_DISPLAY_LIST == retval) {
+			VBDEBUG(("VbExDisplayImages() not supported\n"));
+			disp_no_list = 1;
+		} else {
+			list->count = 0;
+			return retval;
+		}
+	}
+
+	/* One at a time, then; keep going past failures, as one call would */
+	retval = VBERROR_SUCCESS;
+	for (i = 0; i < list->count; i++) {
+		ret = VbExDisplayImage(list->images[i].x, list->images[i].y,
+				       list->images[i].buffer,
+				       list->images[i].buffersize);
+		if (ret && VBERROR_SUCCESS == retval)
+			retval = ret;
+	}
+
+	list->count = 0;
+	return retval;
+}
+
+VbError_t VbDisplayListAdd(VbDisplayList *list, uint32_t x, uint32_t y,
+			   void *buffer, uint32_t buffersize)
+{
+	VbDisplayImage *image;
+	VbError_t retval = VBERROR_SUCCESS;
+
+	if (list->count == VB_DISPLAY_LIST_SIZE)
+		retval = VbDisplayListFlush(list);
+
+	image = &list->images[list->count++];
+	image->x = x;
+	image->y = y;
+	image->buffer = buffer;
+	image->buffersize = buffersize;
+	return retval;
+}
+
+void VbQueueTextAtPos(VbDisplayList *list, const char *text,
+		      int right_to_left, uint32_t x, uint32_t y,
+		      VbFont_t *font)
 {
 	int i;
 	ImageInfo *image_info = 0;
@@ -104,7 +182,7 @@ void VbRenderTextAtPos(const char *text, int right_to_left,
 	uint32_t cur_x = x, cur_y = y;
 
 	if (!text || !font) {
-		VBDEBUG(("  VbRenderTextAtPos: invalid args\n"));
+		VBDEBUG(("  VbQueueTextAtPos: invalid args\n"));
 		return;
 	}
 
@@ -126,10 +204,10 @@ void VbRenderTextAtPos(const char *text, int right_to_left,
 		if (right_to_left)
 			cur_x -= image_info->width;
 
-		if (VBERROR_SUCCESS != VbExDisplayImage(cur_x, cur_y, buffer,
-							buffersize)) {
-			VBDEBUG(("  VbRenderTextAtPos: "
-				 "can't display ascii 0x%x\n", text[i]));
+		if (VBERROR_SUCCESS != VbDisplayListAdd(list, cur_x, cur_y,
+							buffer, buffersize)) {
+			VBDEBUG(("  VbQueueTextAtPos: "
+				 "can't display text before 0x%x\n", text[i]));
 		}
 
 		if (!right_to_left)
@@ -137,10 +215,25 @@ void VbRenderTextAtPos(const char *text, int right_to_left,
 	}
 }
 
+void VbRenderTextAtPos(const char *text, int right_to_left,
+		       uint32_t x, uint32_t y, VbFont_t *font)
+{
+	VbDisplayList *list = VbExMalloc(sizeof(*list));
+
+	list->count = 0;
+	VbQueueTextAtPos(list, text, right_to_left, x, y, font);
+	if (VBERROR_SUCCESS != VbDisplayListFlush(list))
+		VBDEBUG(("  VbRenderTextAtPos: can't display text\n"));
+	VbExFree(list);
+}
+
 VbError_t VbDisplayScreenFromGBB(VbCommonParams *cparams, uint32_t screen,
                                  VbNvContext *vncptr)
 {
+	/* Images stay loaded until the whole screen has been drawn */
+	char *fullimages[MAX_IMAGE_IN_LAYOUT];
 	char *fullimage = NULL;
+	VbDisplayList *list = NULL;
 	BmpBlockHeader hdr;
 	uint32_t screen_index;
 	uint32_t localization = 0;
@@ -152,6 +245,8 @@ VbError_t VbDisplayScreenFromGBB(VbCommonParams *cparams, uint32_t screen,
 	int rtol = 0;
 	VbError_t ret;
 
+	Memset(fullimages, 0, sizeof(fullimages));
+
 	ret = VbGbbReadBmpHeader(cparams, &hdr);
 	if (ret)
 		return ret;
@@ -214,7 +309,10 @@ VbError_t VbDisplayScreenFromGBB(VbCommonParams *cparams, uint32_t screen,
 		VbNvSet(vncptr, VBNV_BACKUP_NVRAM_REQUEST, 1);
 	}
 
-	/* Display all bitmaps for the image */
+	/* Queue all bitmaps for the image, to be drawn together */
+	list = VbExMalloc(sizeof(*list));
+	list->count = 0;
+	VbGbbHoldImages(cparams, 1);
 	for (i = 0; i < MAX_IMAGE_IN_LAYOUT; i++) {
 		ScreenLayout layout;
 		ImageInfo image_info;
@@ -229,6 +327,7 @@ VbError_t VbDisplayScreenFromGBB(VbCommonParams *cparams, uint32_t screen,
 			retval = ret;
 			goto VbDisplayScreenFromGBB_exit;
 		}
+		fullimages[i] = fullimage;
 
 		switch(image_info.format) {
 		case FORMAT_BMP:
@@ -248,7 +347,7 @@ VbError_t VbDisplayScreenFromGBB(VbCommonParams *cparams, uint32_t screen,
 				}
 			}
 
-			retval = VbExDisplayImage(layout.images[i].x,
+			retval = VbDisplayListAdd(list, layout.images[i].x,
 						  layout.images[i].y,
 						  fullimage, inoutsize);
 			break;
@@ -272,9 +371,9 @@ VbError_t VbDisplayScreenFromGBB(VbCommonParams *cparams, uint32_t screen,
 				rtol = 0;
 			}
 
-			VbRenderTextAtPos(text_to_show, rtol,
-					  layout.images[i].x,
-					  layout.images[i].y, font);
+			VbQueueTextAtPos(list, text_to_show, rtol,
+					 layout.images[i].x,
+					 layout.images[i].y, font);
 
 			VbDoneWithFontForNow(font);
 			break;
@@ -286,18 +385,25 @@ VbError_t VbDisplayScreenFromGBB(VbCommonParams *cparams, uint32_t screen,
 			retval = VBERROR_INVALID_GBB;
 		}
 
-		VbExFree(fullimage);
-
 		if (VBERROR_SUCCESS != retval)
 			goto VbDisplayScreenFromGBB_exit;
 	}
 
 	/* Successful if all bitmaps displayed */
-	retval = VBERROR_SUCCESS;
+	retval = VbDisplayListFlush(list);
+	if (VBERROR_SUCCESS != retval)
+		goto VbDisplayScreenFromGBB_exit;
 
 	VbRegionCheckVersion(cparams);
 
  VbDisplayScreenFromGBB_exit:
+	if (list)
+		VbExFree(list);
+	for (i = 0; i < MAX_IMAGE_IN_LAYOUT; i++) {
+		if (fullimages[i])
+			VbGbbFreeImage(cparams, fullimages[i]);
+	}
+	VbGbbHoldImages(cparams, 0);
 	VBDEBUG(("leaving VbDisplayScreenFromGBB() with %d\n",retval));
 	return retval;
 }
@@ -333,6 +439,7 @@ VbError_t VbDisplayScreen(VbCommonParams *cparams, uint32_t screen,
 	return VbExDisplayScreen(screen);
 }
 
+#if VBOOT_SHA1_CODE
 static void Uint8ToString(char *buf, uint8_t val)
 {
 	const char *trans = "0123456789abcdef";
@@ -344,15 +451,24 @@ static void FillInSha1Sum(char *outbuf, VbPublicKey *key)
 {
 	uint8_t *buf = ((uint8_t *)key) + key->key_offset;
 	uint64_t buflen = key->key_size;
-	uint8_t *digest = DigestBuf(buf, buflen, SHA1_DIGEST_ALGORITHM);
+	uint8_t digest[SHA1_DIGEST_SIZE];
 	int i;
+
+	/* Not DigestBuf(), which would allocate the digest */
+	internal_SHA1(buf, buflen, digest);
 	for (i = 0; i < SHA1_DIGEST_SIZE; i++) {
 		Uint8ToString(outbuf, digest[i]);
 		outbuf += 2;
 	}
 	*outbuf = '\0';
-	VbExFree(digest);
 }
+#else
+static void FillInSha1Sum(char *outbuf, VbPublicKey *key)
+{
+	/* VBOOT_ALGORITHMS and VBOOT_KEY_IDS left SHA-1 out of this build */
+	Memcpy(outbuf, "n/a", 4);
+}
+#endif
 
 const char *RecoveryReasonString(uint8_t code)
 {
@@ -505,10 +621,10 @@ VbError_t VbDisplayDebugInfo(VbCommonParams *cparams, VbNvContext *vncptr)
 	VbSharedDataHeader *shared =
 		(VbSharedDataHeader *)cparams->shared_data_blob;
 	GoogleBinaryBlockHeader *gbb = cparams->gbb;
-	char buf[DEBUG_INFO_SIZE] = "";
+	char buf[DEBUG_INFO_SIZE];
 	char sha1sum[SHA1_DIGEST_SIZE * 2 + 1];
 	char hwid[256];
-	uint32_t used = 0;
+	StrBuilder sb;
 	VbPublicKey *key;
 	VbError_t ret;
 	uint32_t i;
@@ -516,70 +632,60 @@ VbError_t VbDisplayDebugInfo(VbCommonParams *cparams, VbNvContext *vncptr)
 	/* Redisplay current screen to overwrite any previous debug output */
 	VbDisplayScreen(cparams, disp_current_screen, 1, vncptr);
 
+	StrBuilderInit(&sb, buf, sizeof(buf));
+
 	/* Add hardware ID */
 	VbRegionReadHWID(cparams, hwid, sizeof(hwid));
-	used += StrnAppend(buf + used, "HWID: ", DEBUG_INFO_SIZE - used);
-	used += StrnAppend(buf + used, hwid, DEBUG_INFO_SIZE - used);
+	StrBuilderAppend(&sb, "HWID: ");
+	StrBuilderAppend(&sb, hwid);
 
 	/* Add recovery reason and subcode */
 	VbNvGet(vncptr, VBNV_RECOVERY_SUBCODE, &i);
-	used += StrnAppend(buf + used,
-			"\nrecovery_reason: 0x", DEBUG_INFO_SIZE - used);
-	used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used,
-			       shared->recovery_reason, 16, 2);
-	used += StrnAppend(buf + used, " / 0x", DEBUG_INFO_SIZE - used);
-	used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used, i, 16, 2);
-	used += StrnAppend(buf + used, "  ", DEBUG_INFO_SIZE - used);
-	used += StrnAppend(buf + used,
-			RecoveryReasonString(shared->recovery_reason),
-			DEBUG_INFO_SIZE - used);
+	StrBuilderAppend(&sb, "\nrecovery_reason: 0x");
+	StrBuilderAppendUint64(&sb, shared->recovery_reason, 16, 2);
+	StrBuilderAppend(&sb, " / 0x");
+	StrBuilderAppendUint64(&sb, i, 16, 2);
+	StrBuilderAppend(&sb, "  ");
+	StrBuilderAppend(&sb, RecoveryReasonString(shared->recovery_reason));
 
 	/* Add VbSharedData flags */
-	used += StrnAppend(buf + used, "\nVbSD.flags: 0x", DEBUG_INFO_SIZE - used);
-	used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used,
-			       shared->flags, 16, 8);
+	StrBuilderAppend(&sb, "\nVbSD.flags: 0x");
+	StrBuilderAppendUint64(&sb, shared->flags, 16, 8);
 
 	/* Add raw contents of VbNvStorage */
-	used += StrnAppend(buf + used, "\nVbNv.raw:", DEBUG_INFO_SIZE - used);
+	StrBuilderAppend(&sb, "\nVbNv.raw:");
 	for (i = 0; i < VBNV_BLOCK_SIZE; i++) {
-		used += StrnAppend(buf + used, " ", DEBUG_INFO_SIZE - used);
-		used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used,
-				       vncptr->raw[i], 16, 2);
+		StrBuilderAppend(&sb, " ");
+		StrBuilderAppendUint64(&sb, vncptr->raw[i], 16, 2);
 	}
 
 	/* Add dev_boot_usb flag */
 	VbNvGet(vncptr, VBNV_DEV_BOOT_USB, &i);
-	used += StrnAppend(buf + used, "\ndev_boot_usb: ", DEBUG_INFO_SIZE - used);
-	used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used, i, 10, 0);
+	StrBuilderAppend(&sb, "\ndev_boot_usb: ");
+	StrBuilderAppendUint64(&sb, i, 10, 0);
 
 	/* Add dev_boot_legacy flag */
 	VbNvGet(vncptr, VBNV_DEV_BOOT_LEGACY, &i);
-	used += StrnAppend(buf + used,
-			"\ndev_boot_legacy: ", DEBUG_INFO_SIZE - used);
-	used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used, i, 10, 0);
+	StrBuilderAppend(&sb, "\ndev_boot_legacy: ");
+	StrBuilderAppendUint64(&sb, i, 10, 0);
 
 	/* Add dev_boot_signed_only flag */
 	VbNvGet(vncptr, VBNV_DEV_BOOT_SIGNED_ONLY, &i);
-	used += StrnAppend(buf + used, "\ndev_boot_signed_only: ",
-			DEBUG_INFO_SIZE - used);
-	used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used, i, 10, 0);
+	StrBuilderAppend(&sb, "\ndev_boot_signed_only: ");
+	StrBuilderAppendUint64(&sb, i, 10, 0);
 
 	/* Add TPM versions */
-	used += StrnAppend(buf + used, "\nTPM: fwver=0x", DEBUG_INFO_SIZE - used);
-	used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used,
-			       shared->fw_version_tpm, 16, 8);
-	used += StrnAppend(buf + used, " kernver=0x", DEBUG_INFO_SIZE - used);
-	used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used,
-			       shared->kernel_version_tpm, 16, 8);
+	StrBuilderAppend(&sb, "\nTPM: fwver=0x");
+	StrBuilderAppendUint64(&sb, shared->fw_version_tpm, 16, 8);
+	StrBuilderAppend(&sb, " kernver=0x");
+	StrBuilderAppendUint64(&sb, shared->kernel_version_tpm, 16, 8);
 
 	/* Add GBB flags */
-	used += StrnAppend(buf + used, "\ngbb.flags: 0x", DEBUG_INFO_SIZE - used);
+	StrBuilderAppend(&sb, "\ngbb.flags: 0x");
 	if (gbb->major_version == GBB_MAJOR_VER && gbb->minor_version >= 1) {
-		used += Uint64ToString(buf + used, DEBUG_INFO_SIZE - used,
-				       gbb->flags, 16, 8);
+		StrBuilderAppendUint64(&sb, gbb->flags, 16, 8);
 	} else {
-		used += StrnAppend(buf + used,
-				"0 (default)", DEBUG_INFO_SIZE - used);
+		StrBuilderAppend(&sb, "0 (default)");
 	}
 
 	/* Add sha1sum for Root & Recovery keys */
@@ -587,37 +693,31 @@ VbError_t VbDisplayDebugInfo(VbCommonParams *cparams, VbNvContext *vncptr)
 	if (!ret) {
 		FillInSha1Sum(sha1sum, key);
 		VbExFree(key);
-		used += StrnAppend(buf + used, "\ngbb.rootkey: ",
-				   DEBUG_INFO_SIZE - used);
-		used += StrnAppend(buf + used, sha1sum,
-				   DEBUG_INFO_SIZE - used);
+		StrBuilderAppend(&sb, "\ngbb.rootkey: ");
+		StrBuilderAppend(&sb, sha1sum);
 	}
 
 	ret = VbGbbReadRecoveryKey(cparams, &key);
 	if (!ret) {
 		FillInSha1Sum(sha1sum, key);
 		VbExFree(key);
-		used += StrnAppend(buf + used, "\ngbb.recovery_key: ",
-				   DEBUG_INFO_SIZE - used);
-		used += StrnAppend(buf + used, sha1sum,
-				   DEBUG_INFO_SIZE - used);
+		StrBuilderAppend(&sb, "\ngbb.recovery_key: ");
+		StrBuilderAppend(&sb, sha1sum);
 	}
 
 	/* If we're in dev-mode, show the kernel subkey that we expect, too. */
 	if (0 == shared->recovery_reason) {
 		FillInSha1Sum(sha1sum, &shared->kernel_subkey);
-		used += StrnAppend(buf + used,
-				"\nkernel_subkey: ", DEBUG_INFO_SIZE - used);
-		used += StrnAppend(buf + used, sha1sum, DEBUG_INFO_SIZE - used);
+		StrBuilderAppend(&sb, "\nkernel_subkey: ");
+		StrBuilderAppend(&sb, sha1sum);
 	}
 
 	/* Make sure we finish with a newline */
-	used += StrnAppend(buf + used, "\n", DEBUG_INFO_SIZE - used);
+	StrBuilderAppend(&sb, "\n");
 
 	/* TODO: add more interesting data:
 	 * - Information on current disks */
 
-	buf[DEBUG_INFO_SIZE - 1] = '\0';
 	return VbExDisplayDebugInfo(buf);
 }
 
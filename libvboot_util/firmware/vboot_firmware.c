@@ -16,6 +16,7 @@
 #include "vboot_api.h"
 #include "vboot_common.h"
 #include "vboot_nvstorage.h"
+#include "vboot_probe.h"
 
 /*
  * Static variables for UpdateFirmwareBodyHash().  It's less than optimal to
@@ -38,6 +39,27 @@ void VbUpdateFirmwareBodyHash(VbCommonParams *cparams, uint8_t *data,
 	lfi->body_size_accum += size;
 }
 
+/*
+ * How big the firmware body is, going by the preamble in the [vblock_size]
+ * bytes at [key_block], which hasn't been checked yet, or 0 if it doesn't
+ * fit. Good enough to start reading it.
+ */
+static uint32_t BodySizeHint(const VbKeyBlockHeader *key_block,
+			     uint32_t vblock_size)
+{
+	const VbFirmwarePreambleHeader *preamble;
+
+	if (key_block->key_block_size > vblock_size ||
+	    vblock_size - key_block->key_block_size < sizeof(*preamble))
+		return 0;
+
+	preamble = (const VbFirmwarePreambleHeader *)
+		((const uint8_t *)key_block + key_block->key_block_size);
+	if (preamble->body_signature.data_size > 0xFFFFFFFF)
+		return 0;
+	return (uint32_t)preamble->body_signature.data_size;
+}
+
 int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
                  VbNvContext *vnc)
 {
@@ -46,6 +68,7 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 	GoogleBinaryBlockHeader *gbb = cparams->gbb;
 	VbPublicKey *root_key = NULL;
 	VbLoadFirmwareInternal *lfi;
+	RSAKeyCache key_cache;
 
 	uint32_t try_b_count;
 	uint32_t lowest_version = 0xFFFFFFFF;
@@ -60,7 +83,13 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 	/* Clear output params in case we fail */
 	shared->firmware_index = 0xFF;
 
+	/* Both key blocks are checked with the same root key */
+	Memset(&key_cache, 0, sizeof(key_cache));
+
 	VBDEBUG(("LoadFirmware started...\n"));
+	VB_PROBE0(load_firmware_entry);
+	VbSharedDataAddTimestamp(shared, VBSD_TS_LF_START, 0, 0,
+				 VbExGetTimer());
 
 	/* Must have a root key from the GBB */
 	retval = VbGbbReadRootKey(cparams, &root_key);
@@ -93,6 +122,7 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 		uint32_t vblock_size;
 		VbFirmwarePreambleHeader *preamble;
 		RSAPublicKey *data_key;
+		RSAPublicKey data_key_view;
 		uint64_t key_version;
 		uint32_t combined_version;
 		uint8_t *body_digest;
@@ -132,13 +162,27 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 			continue;
 		}
 
+		/*
+		 * Let the platform start reading the body while we check the
+		 * signatures, if it's one we'd go on to hash.
+		 */
+		if (-1 == good_index)
+			VbExFirmwareBodyPrefetch(cparams,
+						 (index ? VB_SELECT_FIRMWARE_B :
+						  VB_SELECT_FIRMWARE_A),
+						 BodySizeHint(key_block,
+							      vblock_size));
+
 		/* Verify the key block */
-		if ((0 != KeyBlockVerify(key_block, vblock_size,
-					 root_key, 0))) {
+		VB_PROBE2(load_firmware_phase, index, VB_PROBE_PHASE_KEYBLOCK);
+		if ((0 != KeyBlockVerifyCached(key_block, vblock_size,
+					       root_key, 0, &key_cache))) {
 			VBDEBUG(("Key block verification failed.\n"));
 			*check_result = VBSD_LF_CHECK_VERIFY_KEYBLOCK;
 			continue;
 		}
+		VbSharedDataAddTimestamp(shared, VBSD_TS_LF_KEY_BLOCK, index, 0,
+					 VbExGetTimer());
 
 		/* Check for rollback of key version. */
 		key_version = key_block->data_key.key_version;
@@ -161,7 +205,8 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 		}
 
 		/* Get key for preamble/data verification from the key block. */
-		data_key = PublicKeyToRSA(&key_block->data_key);
+		data_key = PublicKeyToRSAView(&key_block->data_key,
+					      &data_key_view);
 		if (!data_key) {
 			VBDEBUG(("Unable to parse data key.\n"));
 			*check_result = VBSD_LF_CHECK_DATA_KEY_PARSE;
@@ -171,15 +216,18 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 		/* Verify the preamble, which follows the key block. */
 		preamble = (VbFirmwarePreambleHeader *)
 			((uint8_t *)key_block + key_block->key_block_size);
+		VB_PROBE2(load_firmware_phase, index, VB_PROBE_PHASE_PREAMBLE);
 		if ((0 != VerifyFirmwarePreamble(
 					preamble,
 					vblock_size - key_block->key_block_size,
 					data_key))) {
 			VBDEBUG(("Preamble verfication failed.\n"));
 			*check_result = VBSD_LF_CHECK_VERIFY_PREAMBLE;
-			RSAPublicKeyFree(data_key);
+			RSAPublicKeyViewFree(data_key, &data_key_view);
 			continue;
 		}
+		VbSharedDataAddTimestamp(shared, VBSD_TS_LF_PREAMBLE, index, 0,
+					 VbExGetTimer());
 
 		/* Check for rollback of firmware version. */
 		combined_version = (uint32_t)((key_version << 16) |
@@ -188,7 +236,7 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 		    !(gbb->flags & GBB_FLAG_DISABLE_FW_ROLLBACK_CHECK)) {
 			VBDEBUG(("Firmware version rollback detected.\n"));
 			*check_result = VBSD_LF_CHECK_FW_ROLLBACK;
-			RSAPublicKeyFree(data_key);
+			RSAPublicKeyViewFree(data_key, &data_key_view);
 			continue;
 		}
 
@@ -205,7 +253,7 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 		 * rollback.
 		 */
 		if (-1 != good_index) {
-			RSAPublicKeyFree(data_key);
+			RSAPublicKeyViewFree(data_key, &data_key_view);
 			continue;
 		}
 
@@ -218,7 +266,7 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 			if (!(shared->flags & VBSD_BOOT_RO_NORMAL_SUPPORT)) {
 				VBDEBUG(("No RO normal support.\n"));
 				*check_result = VBSD_LF_CHECK_NO_RO_NORMAL;
-				RSAPublicKeyFree(data_key);
+				RSAPublicKeyViewFree(data_key, &data_key_view);
 				continue;
 			}
 
@@ -229,6 +277,8 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 			VbError_t rv;
 
 			/* Read the firmware data */
+			VB_PROBE2(load_firmware_phase, index,
+				  VB_PROBE_PHASE_BODY);
 			DigestInit(&lfi->body_digest_context,
 				   data_key->algorithm);
 			lfi->body_size_accum = 0;
@@ -240,7 +290,7 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 				VBDEBUG(("VbExHashFirmwareBody() failed for "
 					 "index %d\n", index));
 				*check_result = VBSD_LF_CHECK_GET_FW_BODY;
-				RSAPublicKeyFree(data_key);
+				RSAPublicKeyViewFree(data_key, &data_key_view);
 				continue;
 			}
 			if (lfi->body_size_accum !=
@@ -249,7 +299,7 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 					 (int)lfi->body_size_accum,
 					 (int)preamble->body_signature.data_size));
 				*check_result = VBSD_LF_CHECK_HASH_WRONG_SIZE;
-				RSAPublicKeyFree(data_key);
+				RSAPublicKeyViewFree(data_key, &data_key_view);
 				continue;
 			}
 
@@ -260,15 +310,17 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 					      data_key)) {
 				VBDEBUG(("FW body verification failed.\n"));
 				*check_result = VBSD_LF_CHECK_VERIFY_BODY;
-				RSAPublicKeyFree(data_key);
+				RSAPublicKeyViewFree(data_key, &data_key_view);
 				VbExFree(body_digest);
 				continue;
 			}
 			VbExFree(body_digest);
+			VbSharedDataAddTimestamp(shared, VBSD_TS_LF_BODY,
+						 index, 0, VbExGetTimer());
 		}
 
 		/* Done with the data key, so can free it now */
-		RSAPublicKeyFree(data_key);
+		RSAPublicKeyViewFree(data_key, &data_key_view);
 
 		/* If we're still here, the firmware is valid. */
 		VBDEBUG(("Firmware %d is valid.\n", index));
@@ -346,6 +398,7 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 	}
 
  LoadFirmwareExit:
+	RSAKeyCacheFree(&key_cache);
 	VbExFree(root_key);
 
 	/* Store recovery request, if any */
@@ -361,5 +414,6 @@ int LoadFirmware(VbCommonParams *cparams, VbSelectFirmwareParams *fparams,
 		shared->recovery_reason = recovery;
 	}
 
+	VB_PROBE1(load_firmware_return, retval);
 	return retval;
 }
@@ -19,8 +19,21 @@
 #include "vboot_api.h"
 #include "vboot_common.h"
 #include "vboot_kernel.h"
+#include "vboot_probe.h"
 
-#define KBUF_SIZE 65536  /* Bytes to read at start of kernel partition */
+#define KBUF_SIZE 65536  /* Most bytes read at start of kernel partition */
+/*
+ * Bytes first read at the start of a kernel partition. That's usually the
+ * whole key block, and the headers say how much more to read.
+ */
+#define KBUF_FIRST_READ 4096
+/*
+ * The kernel body is read in chunks that start small, so hashing can start
+ * early, and double up to the max, so big devices aren't asked for lots of
+ * little reads.
+ */
+#define KBODY_READ_MIN (256 * 1024)
+#define KBODY_READ_MAX (2 * 1024 * 1024)
 #define LOWEST_TPM_VERSION 0xffffffff
 
 typedef enum BootMode {
@@ -29,11 +42,397 @@ typedef enum BootMode {
 	kBootDev = 2        /* Developer boot - self-signed kernel ok */
 } BootMode;
 
+/* What LoadKernel() needs to know to check a kernel partition's headers */
+typedef struct KernelHeaderParams {
+	VbExDiskHandle_t disk_handle;
+	VbPublicKey *kernel_subkey;
+	RSAKeyCache *key_cache;
+	uint32_t kernel_version_tpm;
+	BootMode boot_mode;
+	int rec_switch;
+	int dev_switch;
+	uint32_t require_official_os;
+} KernelHeaderParams;
+
+/* One candidate kernel partition and what its headers said */
+typedef struct KernelHeaderCheck {
+	/* Inputs */
+	uint64_t part_start;
+	uint64_t part_size;
+	int gpt_index;		/* gpt.current_kernel when it was found */
+
+	/* Outputs; kbuf, stream and data_key belong to the caller */
+	VbSharedDataKernelPart shpart;
+	uint8_t *kbuf;
+	uint32_t kbuf_used;	/* Bytes read into kbuf */
+	VbExStream_t stream;
+	RSAPublicKey *data_key;
+	int key_block_valid;
+	uint32_t combined_version;
+	int good;		/* Header checks passed */
+	/* VbExGetTimer() when the vblock was read and when it was checked */
+	uint64_t timer_read;
+	uint64_t timer_checked;
+} KernelHeaderCheck;
+
+/*
+ * Make sure at least [want] bytes, up to KBUF_SIZE, have been read into
+ * c->kbuf. The stream takes care of sector alignment, so only what's wanted
+ * is read. Returns non-zero if a read failed.
+ */
+static int ReadKernelHeaderBytes(KernelHeaderCheck *c, uint64_t want)
+{
+	uint32_t more;
+
+	if (want > KBUF_SIZE)
+		want = KBUF_SIZE;
+	if (want <= c->kbuf_used)
+		return 0;
+
+	more = (uint32_t)want - c->kbuf_used;
+	if (0 != VbExStreamRead(c->stream, more, c->kbuf + c->kbuf_used))
+		return 1;
+	c->kbuf_used += more;
+	return 0;
+}
+
+/*
+ * Read the start of a candidate kernel partition into c->kbuf and check its
+ * key block and preamble, exactly as LoadKernel() always has. Only as much is
+ * read as the headers need, up to KBUF_SIZE; the checks see the same bytes
+ * they would have in a full KBUF_SIZE read. The stream is left open after
+ * the c->kbuf_used bytes read. This only touches [c] and reads [p], so
+ * candidates can be checked concurrently if [p] has no key cache.
+ */
+static void CheckKernelHeaders(const KernelHeaderParams *p,
+			       KernelHeaderCheck *c)
+{
+	VbSharedDataKernelPart *shpart = &c->shpart;
+	VbKeyBlockHeader *key_block;
+	VbKernelPreambleHeader *preamble;
+	uint64_t key_version;
+	uint32_t combined_version;
+	int key_block_valid = 1;
+
+	VBDEBUG(("Found kernel entry at %" PRIu64 " size %" PRIu64 "\n",
+		 c->part_start, c->part_size));
+
+	Memset(shpart, 0, sizeof(VbSharedDataKernelPart));
+	shpart->sector_start = c->part_start;
+	shpart->sector_count = c->part_size;
+	/*
+	 * TODO: GPT partitions start at 1, but cgptlib starts them at
+	 * 0.  Adjust here, until cgptlib is fixed.
+	 */
+	shpart->gpt_index = (uint8_t)(c->gpt_index + 1);
+	c->good = 0;
+
+	/* Set up the stream */
+	if (VbExStreamOpen(p->disk_handle,
+			   c->part_start, c->part_size, &c->stream)) {
+		VBDEBUG(("Partition error getting stream.\n"));
+		shpart->check_result = VBSD_LKP_CHECK_TOO_SMALL;
+		return;
+	}
+
+	/* Read the key block, going by the size in its header */
+	c->kbuf_used = 0;
+	key_block = (VbKeyBlockHeader*)c->kbuf;
+	if (0 != ReadKernelHeaderBytes(c, KBUF_FIRST_READ) ||
+	    (c->kbuf_used >= sizeof(VbKeyBlockHeader) &&
+	     0 != ReadKernelHeaderBytes(c, key_block->key_block_size))) {
+		VBDEBUG(("Unable to read start of partition.\n"));
+		shpart->check_result = VBSD_LKP_CHECK_READ_START;
+		return;
+	}
+	c->timer_read = VbExGetTimer();
+
+	/* Verify the key block. */
+	VB_PROBE2(load_kernel_phase, shpart->gpt_index,
+		  VB_PROBE_PHASE_KEYBLOCK);
+	if (0 != KeyBlockVerifyCached(key_block, c->kbuf_used,
+				      p->kernel_subkey, 0, p->key_cache)) {
+		VBDEBUG(("Verifying key block signature failed.\n"));
+		shpart->check_result = VBSD_LKP_CHECK_KEY_BLOCK_SIG;
+		key_block_valid = 0;
+
+		/* If not in developer mode, this kernel is bad. */
+		if (kBootDev != p->boot_mode)
+			return;
+
+		/*
+		 * In developer mode, we can explictly disallow
+		 * self-signed kernels
+		 */
+		if (p->require_official_os) {
+			VBDEBUG(("Self-signed kernels not enabled.\n"));
+			shpart->check_result = VBSD_LKP_CHECK_SELF_SIGNED;
+			return;
+		}
+
+		/*
+		 * Allow the kernel if the SHA-512 hash of the key
+		 * block is valid.
+		 */
+		if (0 != KeyBlockVerify(key_block, c->kbuf_used,
+					p->kernel_subkey, 1)) {
+			VBDEBUG(("Verifying key block hash failed.\n"));
+			shpart->check_result = VBSD_LKP_CHECK_KEY_BLOCK_HASH;
+			return;
+		}
+	}
+
+	/* Check the key block flags against the current boot mode. */
+	if (!(key_block->key_block_flags &
+	      (p->dev_switch ? KEY_BLOCK_FLAG_DEVELOPER_1 :
+	       KEY_BLOCK_FLAG_DEVELOPER_0))) {
+		VBDEBUG(("Key block developer flag mismatch.\n"));
+		shpart->check_result = VBSD_LKP_CHECK_DEV_MISMATCH;
+		key_block_valid = 0;
+	}
+	if (!(key_block->key_block_flags &
+	      (p->rec_switch ? KEY_BLOCK_FLAG_RECOVERY_1 :
+	       KEY_BLOCK_FLAG_RECOVERY_0))) {
+		VBDEBUG(("Key block recovery flag mismatch.\n"));
+		shpart->check_result = VBSD_LKP_CHECK_REC_MISMATCH;
+		key_block_valid = 0;
+	}
+
+	/* Check for rollback of key version except in recovery mode. */
+	key_version = key_block->data_key.key_version;
+	if (kBootRecovery != p->boot_mode) {
+		if (key_version < (p->kernel_version_tpm >> 16)) {
+			VBDEBUG(("Key version too old.\n"));
+			shpart->check_result = VBSD_LKP_CHECK_KEY_ROLLBACK;
+			key_block_valid = 0;
+		}
+		if (key_version > 0xFFFF) {
+			/*
+			 * Key version is stored in 16 bits in the TPM,
+			 * so key versions greater than 0xFFFF can't be
+			 * stored properly.
+			 */
+			VBDEBUG(("Key version > 0xFFFF.\n"));
+			shpart->check_result = VBSD_LKP_CHECK_KEY_ROLLBACK;
+			key_block_valid = 0;
+		}
+	}
+	c->key_block_valid = key_block_valid;
+
+	/* If not in developer mode, key block required to be valid. */
+	if (kBootDev != p->boot_mode && !key_block_valid) {
+		VBDEBUG(("Key block is invalid.\n"));
+		return;
+	}
+
+	/* Get key for preamble/data verification from the key block. */
+	c->data_key = PublicKeyToRSA(&key_block->data_key);
+	if (!c->data_key) {
+		VBDEBUG(("Data key bad.\n"));
+		shpart->check_result = VBSD_LKP_CHECK_DATA_KEY_PARSE;
+		return;
+	}
+
+	/*
+	 * Read the preamble, which follows the key block. The key block is
+	 * good, so it fits in kbuf. The header says how big the rest is.
+	 */
+	preamble = (VbKernelPreambleHeader *)
+		(c->kbuf + key_block->key_block_size);
+	if (0 != ReadKernelHeaderBytes(c, key_block->key_block_size +
+				       sizeof(VbKernelPreambleHeader)) ||
+	    (c->kbuf_used >= key_block->key_block_size +
+	     sizeof(VbKernelPreambleHeader) &&
+	     0 != ReadKernelHeaderBytes(c, key_block->key_block_size +
+					preamble->preamble_size))) {
+		VBDEBUG(("Unable to read kernel preamble.\n"));
+		shpart->check_result = VBSD_LKP_CHECK_READ_START;
+		return;
+	}
+
+	/* Verify the preamble */
+	VB_PROBE2(load_kernel_phase, shpart->gpt_index,
+		  VB_PROBE_PHASE_PREAMBLE);
+	if ((0 != VerifyKernelPreamble(
+				preamble,
+				c->kbuf_used - key_block->key_block_size,
+				c->data_key))) {
+		VBDEBUG(("Preamble verification failed.\n"));
+		shpart->check_result = VBSD_LKP_CHECK_VERIFY_PREAMBLE;
+		return;
+	}
+
+	/*
+	 * If the key block is valid and we're not in recovery mode,
+	 * check for rollback of the kernel version.
+	 */
+	combined_version = (uint32_t)(
+			(key_version << 16) |
+			(preamble->kernel_version & 0xFFFF));
+	shpart->combined_version = combined_version;
+	c->combined_version = combined_version;
+	if (key_block_valid && kBootRecovery != p->boot_mode) {
+		if (combined_version < p->kernel_version_tpm) {
+			VBDEBUG(("Kernel version too low.\n"));
+			shpart->check_result = VBSD_LKP_CHECK_KERNEL_ROLLBACK;
+			/*
+			 * If not in developer mode, kernel version
+			 * must be valid.
+			 */
+			if (kBootDev != p->boot_mode)
+				return;
+		}
+	}
+
+	VBDEBUG(("Kernel preamble is good.\n"));
+	shpart->check_result = VBSD_LKP_CHECK_PREAMBLE_VALID;
+	c->good = 1;
+}
+
+static void CheckKernelHeadersJob(void *arg, uint32_t index)
+{
+	KernelHeaderParams *p = ((KernelHeaderParams **)arg)[0];
+	KernelHeaderCheck *checks = ((KernelHeaderCheck **)arg)[1];
+
+	CheckKernelHeaders(p, checks + index);
+	checks[index].timer_checked = VbExGetTimer();
+}
+
+/* Reading one chunk of the kernel body while hashing the one before it */
+typedef struct KernelBodyRead {
+	VbExStream_t stream;
+	DigestContext digest;
+	uint8_t *read_ptr;
+	uint32_t read_size;
+	VbError_t read_rv;
+	const uint8_t *hash_ptr;
+	uint32_t hash_size;
+} KernelBodyRead;
+
+static void KernelBodyJob(void *arg, uint32_t index)
+{
+	KernelBodyRead *r = (KernelBodyRead *)arg;
+
+	/* The read only touches the stream, and the hash only the digest */
+	if (index == 0) {
+		if (r->read_size)
+			r->read_rv = VbExStreamRead(r->stream, r->read_size,
+						    r->read_ptr);
+	} else if (r->hash_size) {
+		DigestUpdate(&r->digest, r->hash_ptr, r->hash_size);
+	}
+}
+
+/*
+ * Read [toread] more bytes of the kernel body from [stream] to follow the
+ * [have] bytes already at [body], hashing each chunk with [algorithm] while
+ * the next one is read.  Returns the digest of all of it, which the caller
+ * must free with VbExFree(), or NULL if a read failed.
+ */
+static uint8_t *ReadAndHashKernelBody(VbExStream_t stream, int algorithm,
+				      uint8_t *body, uint32_t have,
+				      uint32_t toread)
+{
+	KernelBodyRead r;
+	uint32_t chunk = KBODY_READ_MIN;
+
+	Memset(&r, 0, sizeof(r));
+	r.stream = stream;
+	DigestInit(&r.digest, algorithm);
+	r.hash_ptr = body;
+	r.hash_size = have;
+	r.read_ptr = body + have;
+
+	while (toread || r.hash_size) {
+		r.read_size = toread < chunk ? toread : chunk;
+		VbExRunParallel(KernelBodyJob, &r, 2);
+		if (r.read_rv) {
+			/* There's nothing to free in the digest context */
+			return NULL;
+		}
+
+		r.hash_ptr = r.read_ptr;
+		r.hash_size = r.read_size;
+		r.read_ptr += r.read_size;
+		toread -= r.read_size;
+		if (chunk < KBODY_READ_MAX)
+			chunk *= 2;
+	}
+
+	return DigestFinal(&r.digest);
+}
+
+/*
+ * Find every candidate LoadKernel() would visit, in the same order, and check
+ * all their headers at once. Leaves [gpt] as it found it. Returns the number
+ * of candidates in *checks_ptr, which the caller frees with
+ * FreeKernelHeaderChecks().
+ */
+static uint32_t PrecheckKernelHeaders(GptData *gpt,
+				      const KernelHeaderParams *p,
+				      KernelHeaderCheck **checks_ptr)
+{
+	GptHeader *header = (GptHeader *)gpt->primary_header;
+	int saved_kernel = gpt->current_kernel;
+	int saved_priority = gpt->current_priority;
+	KernelHeaderParams params = *p;
+	KernelHeaderCheck *checks;
+	uint64_t part_start, part_size;
+	uint32_t count = 0;
+	void *job[2];
+
+	*checks_ptr = NULL;
+	checks = VbExMalloc(header->number_of_entries * sizeof(*checks));
+	if (!checks)
+		return 0;
+	Memset(checks, 0, header->number_of_entries * sizeof(*checks));
+
+	while (count < header->number_of_entries &&
+	       GPT_SUCCESS == GptNextKernelEntry(gpt, &part_start,
+						 &part_size)) {
+		KernelHeaderCheck *c = checks + count;
+
+		c->part_start = part_start;
+		c->part_size = part_size;
+		c->gpt_index = gpt->current_kernel;
+		c->kbuf = VbExMalloc(KBUF_SIZE);
+		if (!c->kbuf)
+			break;
+		count++;
+	}
+	gpt->current_kernel = saved_kernel;
+	gpt->current_priority = saved_priority;
+
+	/* The key cache isn't safe to share between concurrent checks */
+	params.key_cache = NULL;
+	job[0] = &params;
+	job[1] = checks;
+	VbExRunParallel(CheckKernelHeadersJob, job, count);
+
+	*checks_ptr = checks;
+	return count;
+}
+
+static void FreeKernelHeaderChecks(KernelHeaderCheck *checks, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		if (checks[i].stream)
+			VbExStreamClose(checks[i].stream);
+		if (checks[i].data_key)
+			RSAPublicKeyFree(checks[i].data_key);
+		VbExFree(checks[i].kbuf);
+	}
+	VbExFree(checks);
+}
+
 VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 {
 	VbSharedDataHeader *shared =
 		(VbSharedDataHeader *)params->shared_data_blob;
 	VbSharedDataKernelCall *shcall = NULL;
+	uint8_t call = 0;
 	VbNvContext* vnc = params->nv_context;
 	VbPublicKey* kernel_subkey = NULL;
 	int free_kernel_subkey = 0;
@@ -50,11 +449,21 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 	BootMode boot_mode;
 	uint32_t require_official_os = 0;
 	uint32_t body_toread;
-	uint8_t *body_readptr;
+	uint32_t body_copied;
+	uint8_t *body_digest;
+	RSAKeyCache key_cache;
+	KernelHeaderParams header_params;
+	KernelHeaderCheck *checks = NULL;
+	uint32_t num_checks = 0;
 
 	VbError_t retval = VBERROR_UNKNOWN;
 	int recovery = VBNV_RECOVERY_LK_UNSPECIFIED;
 
+	VB_PROBE0(load_kernel_entry);
+
+	/* Every partition is checked with the same kernel subkey */
+	Memset(&key_cache, 0, sizeof(key_cache));
+
 	/* Sanity Checks */
 	if (!params->bytes_per_lba ||
 	    !params->streaming_lba_count) {
@@ -93,6 +502,9 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 	shcall->sector_size = (uint32_t)params->bytes_per_lba;
 	shcall->sector_count = params->streaming_lba_count;
 	shared->lk_call_count++;
+	call = (uint8_t)(shared->lk_call_count - 1);
+	VbSharedDataAddTimestamp(shared, VBSD_TS_LK_START, call, 0,
+				 VbExGetTimer());
 
 	/* Initialization */
 	blba = params->bytes_per_lba;
@@ -120,7 +532,8 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 	gpt.gpt_drive_sectors = params->gpt_lba_count;
 	gpt.flags = params->boot_flags & BOOT_FLAG_EXTERNAL_GPT
 			? GPT_FLAG_EXTERNAL : 0;
-	if (0 != AllocAndReadGptData(params->disk_handle, &gpt)) {
+	if (0 != AllocAndReadGptDataCached(params->disk_handle, &gpt,
+					   params->gpt_cache)) {
 		VBDEBUG(("Unable to read GPT data\n"));
 		shcall->check_result = VBSD_LKC_CHECK_GPT_READ_ERROR;
 		goto bad_gpt;
@@ -132,12 +545,27 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 		shcall->check_result = VBSD_LKC_CHECK_GPT_PARSE_ERROR;
 		goto bad_gpt;
 	}
+	VbSharedDataAddTimestamp(shared, VBSD_TS_LK_GPT, call, 0,
+				 VbExGetTimer());
 
 	/* Allocate kernel header buffers */
 	kbuf = (uint8_t*)VbExMalloc(KBUF_SIZE);
 	if (!kbuf)
 		goto bad_gpt;
 
+	/* Check all the candidates' headers up front, if asked */
+	header_params.disk_handle = params->disk_handle;
+	header_params.kernel_subkey = kernel_subkey;
+	header_params.key_cache = &key_cache;
+	header_params.kernel_version_tpm = shared->kernel_version_tpm;
+	header_params.boot_mode = boot_mode;
+	header_params.rec_switch = rec_switch;
+	header_params.dev_switch = dev_switch;
+	header_params.require_official_os = require_official_os;
+	if (params->boot_flags & BOOT_FLAG_PARALLEL_HEADERS)
+		num_checks = PrecheckKernelHeaders(&gpt, &header_params,
+						   &checks);
+
         /* Loop over candidate kernel partitions */
         while (GPT_SUCCESS ==
 	       GptNextKernelEntry(&gpt, &part_start, &part_size)) {
@@ -146,13 +574,40 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 		VbKernelPreambleHeader *preamble;
 		RSAPublicKey *data_key = NULL;
 		VbExStream_t stream = NULL;
-		uint64_t key_version;
+		KernelHeaderCheck *check = NULL;
+		KernelHeaderCheck one;
 		uint32_t combined_version;
 		uint64_t body_offset;
-		int key_block_valid = 1;
+		int key_block_valid;
+		uint8_t part;
+		uint32_t i;
+
+		/* Use the up-front check of this partition, if there is one */
+		for (i = 0; i < num_checks; i++) {
+			if (checks[i].gpt_index == gpt.current_kernel &&
+			    checks[i].part_start == part_start) {
+				check = checks + i;
+				break;
+			}
+		}
+		if (!check) {
+			check = &one;
+			Memset(check, 0, sizeof(*check));
+			check->part_start = part_start;
+			check->part_size = part_size;
+			check->gpt_index = gpt.current_kernel;
+			check->kbuf = kbuf;
+			CheckKernelHeaders(&header_params, check);
+			check->timer_checked = VbExGetTimer();
+		}
 
-		VBDEBUG(("Found kernel entry at %" PRIu64 " size %" PRIu64 "\n",
-			 part_start, part_size));
+		/* The rest of this partition's handling owns these now */
+		stream = check->stream;
+		check->stream = NULL;
+		data_key = check->data_key;
+		check->data_key = NULL;
+		key_block_valid = check->key_block_valid;
+		combined_version = check->combined_version;
 
 		/*
 		 * Set up tracking for this partition.  This wraps around if
@@ -161,157 +616,24 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 		 */
 		shpart = shcall->parts + (shcall->kernel_parts_found
 					  & (VBSD_MAX_KERNEL_PARTS - 1));
-		Memset(shpart, 0, sizeof(VbSharedDataKernelPart));
-		shpart->sector_start = part_start;
-		shpart->sector_count = part_size;
-		/*
-		 * TODO: GPT partitions start at 1, but cgptlib starts them at
-		 * 0.  Adjust here, until cgptlib is fixed.
-		 */
-		shpart->gpt_index = (uint8_t)(gpt.current_kernel + 1);
-		shcall->kernel_parts_found++;
+		Memcpy(shpart, &check->shpart, sizeof(VbSharedDataKernelPart));
+		part = shcall->kernel_parts_found++;
+
+		/* Up-front checks were timed as they ran, so these are too */
+		if (check->timer_read)
+			VbSharedDataAddTimestamp(shared, VBSD_TS_LK_VBLOCK_READ,
+						 call, part, check->timer_read);
+		VbSharedDataAddTimestamp(shared, VBSD_TS_LK_VBLOCK_CHECKED,
+					 call, part, check->timer_checked);
 
 		/* Found at least one kernel partition. */
 		found_partitions++;
 
-		/* Set up the stream */
-		if (VbExStreamOpen(params->disk_handle,
-				   part_start, part_size, &stream)) {
-			VBDEBUG(("Partition error getting stream.\n"));
-			shpart->check_result = VBSD_LKP_CHECK_TOO_SMALL;
-			goto bad_kernel;
-		}
-
-		if (0 != VbExStreamRead(stream, KBUF_SIZE, kbuf)) {
-			VBDEBUG(("Unable to read start of partition.\n"));
-			shpart->check_result = VBSD_LKP_CHECK_READ_START;
-			goto bad_kernel;
-		}
-
-		/* Verify the key block. */
-		key_block = (VbKeyBlockHeader*)kbuf;
-		if (0 != KeyBlockVerify(key_block, KBUF_SIZE,
-					kernel_subkey, 0)) {
-			VBDEBUG(("Verifying key block signature failed.\n"));
-			shpart->check_result = VBSD_LKP_CHECK_KEY_BLOCK_SIG;
-			key_block_valid = 0;
-
-			/* If not in developer mode, this kernel is bad. */
-			if (kBootDev != boot_mode)
-				goto bad_kernel;
-
-			/*
-			 * In developer mode, we can explictly disallow
-			 * self-signed kernels
-			 */
-			if (require_official_os) {
-				VBDEBUG(("Self-signed kernels not enabled.\n"));
-				shpart->check_result =
-					VBSD_LKP_CHECK_SELF_SIGNED;
-				goto bad_kernel;
-			}
-
-			/*
-			 * Allow the kernel if the SHA-512 hash of the key
-			 * block is valid.
-			 */
-			if (0 != KeyBlockVerify(key_block, KBUF_SIZE,
-						kernel_subkey, 1)) {
-				VBDEBUG(("Verifying key block hash failed.\n"));
-				shpart->check_result =
-					VBSD_LKP_CHECK_KEY_BLOCK_HASH;
-				goto bad_kernel;
-			}
-		}
-
-		/* Check the key block flags against the current boot mode. */
-		if (!(key_block->key_block_flags &
-		      (dev_switch ? KEY_BLOCK_FLAG_DEVELOPER_1 :
-		       KEY_BLOCK_FLAG_DEVELOPER_0))) {
-			VBDEBUG(("Key block developer flag mismatch.\n"));
-			shpart->check_result = VBSD_LKP_CHECK_DEV_MISMATCH;
-			key_block_valid = 0;
-		}
-		if (!(key_block->key_block_flags &
-		      (rec_switch ? KEY_BLOCK_FLAG_RECOVERY_1 :
-		       KEY_BLOCK_FLAG_RECOVERY_0))) {
-			VBDEBUG(("Key block recovery flag mismatch.\n"));
-			shpart->check_result = VBSD_LKP_CHECK_REC_MISMATCH;
-			key_block_valid = 0;
-		}
-
-		/* Check for rollback of key version except in recovery mode. */
-		key_version = key_block->data_key.key_version;
-		if (kBootRecovery != boot_mode) {
-			if (key_version < (shared->kernel_version_tpm >> 16)) {
-				VBDEBUG(("Key version too old.\n"));
-				shpart->check_result =
-					VBSD_LKP_CHECK_KEY_ROLLBACK;
-				key_block_valid = 0;
-			}
-			if (key_version > 0xFFFF) {
-				/*
-				 * Key version is stored in 16 bits in the TPM,
-				 * so key versions greater than 0xFFFF can't be
-				 * stored properly.
-				 */
-				VBDEBUG(("Key version > 0xFFFF.\n"));
-				shpart->check_result =
-					VBSD_LKP_CHECK_KEY_ROLLBACK;
-				key_block_valid = 0;
-			}
-		}
-
-		/* If not in developer mode, key block required to be valid. */
-		if (kBootDev != boot_mode && !key_block_valid) {
-			VBDEBUG(("Key block is invalid.\n"));
+		if (!check->good)
 			goto bad_kernel;
-		}
-
-		/* Get key for preamble/data verification from the key block. */
-		data_key = PublicKeyToRSA(&key_block->data_key);
-		if (!data_key) {
-			VBDEBUG(("Data key bad.\n"));
-			shpart->check_result = VBSD_LKP_CHECK_DATA_KEY_PARSE;
-			goto bad_kernel;
-		}
-
-		/* Verify the preamble, which follows the key block */
+		key_block = (VbKeyBlockHeader *)check->kbuf;
 		preamble = (VbKernelPreambleHeader *)
-			(kbuf + key_block->key_block_size);
-		if ((0 != VerifyKernelPreamble(
-					preamble,
-					KBUF_SIZE - key_block->key_block_size,
-					data_key))) {
-			VBDEBUG(("Preamble verification failed.\n"));
-			shpart->check_result = VBSD_LKP_CHECK_VERIFY_PREAMBLE;
-			goto bad_kernel;
-		}
-
-		/*
-		 * If the key block is valid and we're not in recovery mode,
-		 * check for rollback of the kernel version.
-		 */
-		combined_version = (uint32_t)(
-				(key_version << 16) |
-				(preamble->kernel_version & 0xFFFF));
-		shpart->combined_version = combined_version;
-		if (key_block_valid && kBootRecovery != boot_mode) {
-			if (combined_version < shared->kernel_version_tpm) {
-				VBDEBUG(("Kernel version too low.\n"));
-				shpart->check_result =
-					VBSD_LKP_CHECK_KERNEL_ROLLBACK;
-				/*
-				 * If not in developer mode, kernel version
-				 * must be valid.
-				 */
-				if (kBootDev != boot_mode)
-					goto bad_kernel;
-			}
-		}
-
-		VBDEBUG(("Kernel preamble is good.\n"));
-		shpart->check_result = VBSD_LKP_CHECK_PREAMBLE_VALID;
+			(check->kbuf + key_block->key_block_size);
 
 		/* Check for lowest version from a valid header. */
 		if (key_block_valid && lowest_version > combined_version)
@@ -343,7 +665,7 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 		 * We could deal with a larger offset by reading and discarding
 		 * the data in between the vblock and the kernel data.
 		 */
-		if (body_offset > KBUF_SIZE) {
+		if (body_offset > check->kbuf_used) {
 			shpart->check_result = VBSD_LKP_CHECK_BODY_OFFSET;
 			VBDEBUG(("Kernel body offset is %d > 64KB.\n",
 				 (int)body_offset));
@@ -371,44 +693,59 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 		 * to verify it.
 		 */
 		body_toread = preamble->body_signature.data_size;
-		body_readptr = params->kernel_buffer;
+		body_copied = 0;
 
 		/*
 		 * If we've already read part of the kernel, copy that to the
 		 * beginning of the kernel buffer.
 		 */
-		if (body_offset < KBUF_SIZE) {
-			uint32_t body_copied = KBUF_SIZE - body_offset;
+		if (body_offset < check->kbuf_used) {
+			body_copied = check->kbuf_used - body_offset;
 
 			/* If the kernel is tiny, don't over-copy */
 			if (body_copied > body_toread)
 				body_copied = body_toread;
 
-			Memcpy(body_readptr, kbuf + body_offset, body_copied);
+			Memcpy(params->kernel_buffer,
+			       check->kbuf + body_offset, body_copied);
 			body_toread -= body_copied;
-			body_readptr += body_copied;
 		}
 
-		/* Read the kernel data */
-		if (body_toread &&
-		    0 != VbExStreamRead(stream, body_toread, body_readptr)) {
+		/*
+		 * Read the kernel data, hashing it as it arrives.  This is the
+		 * same digest VerifyData() would take of the whole buffer
+		 * afterwards, because the body signature's data_size fits in
+		 * kernel_buffer_size.
+		 */
+		VB_PROBE2(load_kernel_phase, shpart->gpt_index,
+			  VB_PROBE_PHASE_BODY);
+		body_digest = ReadAndHashKernelBody(
+			stream, data_key->algorithm,
+			(uint8_t *)params->kernel_buffer,
+			body_copied, body_toread);
+		if (!body_digest) {
 			VBDEBUG(("Unable to read kernel data.\n"));
 			shpart->check_result = VBSD_LKP_CHECK_READ_DATA;
 			goto bad_kernel;
 		}
+		VbSharedDataAddTimestamp(shared, VBSD_TS_LK_BODY_READ, call, part,
+					 VbExGetTimer());
 
 		/* Close the stream; we're done with it */
 		VbExStreamClose(stream);
 		stream = NULL;
 
 		/* Verify kernel data */
-		if (0 != VerifyData((const uint8_t *)params->kernel_buffer,
-				    params->kernel_buffer_size,
-				    &preamble->body_signature, data_key)) {
+		if (0 != VerifyDigest(body_digest, &preamble->body_signature,
+				      data_key)) {
 			VBDEBUG(("Kernel data verification failed.\n"));
 			shpart->check_result = VBSD_LKP_CHECK_VERIFY_DATA;
+			VbExFree(body_digest);
 			goto bad_kernel;
 		}
+		VbExFree(body_digest);
+		VbSharedDataAddTimestamp(shared, VBSD_TS_LK_BODY_CHECKED, call,
+					 part, VbExGetTimer());
 
 		/* Done with the kernel signing key, so can free it now */
 		RSAPublicKeyFree(data_key);
@@ -484,12 +821,18 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 
  bad_gpt:
 
+	/* Free any up-front checks the loop didn't get to */
+	if (checks)
+		FreeKernelHeaderChecks(checks, num_checks);
+
+	RSAKeyCacheFree(&key_cache);
+
 	/* Free kernel buffer */
 	if (kbuf)
 		VbExFree(kbuf);
 
 	/* Write and free GPT data */
-	WriteAndFreeGptData(params->disk_handle, &gpt);
+	WriteAndFreeGptDataCached(params->disk_handle, &gpt, params->gpt_cache);
 
 	/* Handle finding a good partition */
 	if (good_partition >= 0) {
@@ -541,5 +884,6 @@ VbError_t LoadKernel(LoadKernelParams *params, VbCommonParams *cparams)
 	if (free_kernel_subkey)
 		VbExFree(kernel_subkey);
 
+	VB_PROBE1(load_kernel_return, retval);
 	return retval;
 }
@@ -5,6 +5,7 @@
  * Exports the kernel commandline from a given partition/image.
  */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -25,9 +26,22 @@
 #ifdef USE_MTD
 #include <linux/major.h>
 #include <mtd/mtd-user.h>
-#include <mtdutils.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 #endif
 
+/* Like VbExError(), but return to the caller, who may have other
+ * partitions to look at. */
+static void KernelConfigError(const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	fprintf(stderr, "ERROR: ");
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
 typedef ssize_t (*ReadFullyFn)(void *ctx, void *buf, size_t count);
 
 static ssize_t ReadFullyWithRead(void *ctx, void *buf, size_t count)
@@ -47,13 +61,8 @@ static ssize_t ReadFullyWithRead(void *ctx, void *buf, size_t count)
 	return nr_read;
 }
 
-#ifdef USE_MTD
-static ssize_t ReadFullyWithMtdRead(void *ctx, void *buf, size_t count)
-{
-	MtdReadContext *mtd_ctx = (MtdReadContext*)ctx;
-	return mtd_read_data(mtd_ctx, buf, count);
-}
-#endif
+/* Skip |count| bytes of the stream. Return 0 on success. */
+typedef int (*SkipFn)(void *ctx, size_t count);
 
 /* Skip the stream by calling |read_fn| many times. Return 0 on success. */
 static int SkipWithRead(void *ctx, ReadFullyFn read_fn, size_t count)
@@ -73,7 +82,146 @@ static int SkipWithRead(void *ctx, ReadFullyFn read_fn, size_t count)
 	return 0;
 }
 
+static int SkipWithReadFully(void *ctx, size_t count)
+{
+	return SkipWithRead(ctx, ReadFullyWithRead, count);
+}
+
+#ifdef USE_MTD
+/* A raw MTD partition, read in whole pages. Like the MTD read functions of
+ * the Android recovery, bad erase blocks are left out, so offsets only count
+ * the good ones. Skipping just moves the offset along, and each read is one
+ * call for all the pages it needs in an erase block, so finding the config
+ * costs a few page reads instead of reading everything in front of it. */
+typedef struct MtdReader {
+	int fd;
+	uint32_t erase_size;
+	uint32_t page_size;
+	uint64_t dev_size;
+	uint64_t pos;		/* Logical offset of the next read */
+	uint64_t map_logical;	/* The last good block found, by number ... */
+	uint64_t map_physical;	/* ... and by where it is on the device */
+	uint64_t buf_pos;	/* Logical offset of what's in buf */
+	uint32_t buf_len;
+	uint8_t *buf;		/* One erase block */
+} MtdReader;
+
+static MtdReader *MtdReaderOpen(int fd)
+{
+	struct mtd_info_user info;
+	MtdReader *r;
+
+	if (ioctl(fd, MEMGETINFO, &info) || !info.erasesize)
+		return NULL;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->fd = fd;
+	r->erase_size = info.erasesize;
+	/* NOR flash has no pages to speak of */
+	r->page_size = info.writesize > 1 &&
+		info.erasesize % info.writesize == 0 ? info.writesize : 512;
+	r->dev_size = info.size;
+	r->buf = malloc(r->erase_size);
+	if (!r->buf) {
+		free(r);
+		return NULL;
+	}
+	r->map_physical = (uint64_t)-1;
+	return r;
+}
+
+static void MtdReaderClose(MtdReader *r)
+{
+	free(r->buf);
+	free(r);
+}
+
+/* Find where good block |logical| starts on the device. Bad blocks are only
+ * asked about between the last block we found and this one, since reads
+ * nearly always move forward. Return 0 on success. */
+static int MtdFindBlock(MtdReader *r, uint64_t logical, uint64_t *physical)
+{
+	uint64_t lb = 0, pb = 0;
+	loff_t ofs;
+
+	if (r->map_physical != (uint64_t)-1 && logical >= r->map_logical) {
+		lb = r->map_logical;
+		pb = r->map_physical;
+	}
+	for (;; pb += r->erase_size) {
+		if (pb >= r->dev_size)
+			return -1;
+		/* Anything that won't say is taken to be good */
+		ofs = pb;
+		if (ioctl(r->fd, MEMGETBADBLOCK, &ofs) > 0)
+			continue;
+		if (lb == logical)
+			break;
+		lb++;
+	}
+	r->map_logical = logical;
+	r->map_physical = pb;
+	*physical = pb;
+	return 0;
+}
+
+/* Read the pages under [pos, pos + count) that are in pos's erase block */
+static int MtdFill(MtdReader *r, size_t count)
+{
+	uint64_t physical;
+	uint32_t in_block = r->pos % r->erase_size;
+	uint32_t start = in_block - in_block % r->page_size;
+	uint64_t end = in_block + (uint64_t)count;
+	ssize_t n;
+
+	if (end > r->erase_size)
+		end = r->erase_size;
+	end = (end + r->page_size - 1) / r->page_size * r->page_size;
+	if (MtdFindBlock(r, r->pos / r->erase_size, &physical))
+		return -1;
+
+	r->buf_len = 0;
+	n = pread(r->fd, r->buf, end - start, physical + start);
+	if (n <= 0)
+		return -1;
+	r->buf_pos = r->pos - (in_block - start);
+	r->buf_len = n;
+	return 0;
+}
+
+static ssize_t ReadFullyWithMtdRead(void *ctx, void *buf, size_t count)
+{
+	MtdReader *r = ctx;
+	ssize_t nr_read = 0;
+	uint64_t avail;
+
+	while (nr_read < count) {
+		if (r->pos < r->buf_pos || r->pos >= r->buf_pos + r->buf_len) {
+			if (MtdFill(r, count - nr_read))
+				break;
+		}
+		avail = r->buf_pos + r->buf_len - r->pos;
+		if (avail > count - nr_read)
+			avail = count - nr_read;
+		memcpy(buf + nr_read, r->buf + (r->pos - r->buf_pos), avail);
+		r->pos += avail;
+		nr_read += avail;
+	}
+	return nr_read;
+}
+
+static int SkipWithMtdSeek(void *ctx, size_t count)
+{
+	MtdReader *r = ctx;
+
+	r->pos += count;
+	return 0;
+}
+#endif
+
 static char *FindKernelConfigFromStream(void *ctx, ReadFullyFn read_fn,
+					SkipFn skip_fn,
 					uint64_t kernel_body_load_address)
 {
 	VbKeyBlockHeader key_block;
@@ -83,24 +231,26 @@ static char *FindKernelConfigFromStream(void *ctx, ReadFullyFn read_fn,
 
 	/* Skip the key block */
 	if (read_fn(ctx, &key_block, sizeof(key_block)) != sizeof(key_block)) {
-		VbExError("not enough data to fill key block header\n");
+		KernelConfigError("not enough data to fill key block header\n");
 		return NULL;
 	}
 	ssize_t to_skip = key_block.key_block_size - sizeof(key_block);
-	if (to_skip < 0 || SkipWithRead(ctx, read_fn, to_skip)) {
-		VbExError("key_block_size advances past the end of the blob\n");
+	if (to_skip < 0 || skip_fn(ctx, to_skip)) {
+		KernelConfigError("key_block_size advances past the end"
+				  " of the blob\n");
 		return NULL;
 	}
 	now += key_block.key_block_size;
 
 	/* Open up the preamble */
 	if (read_fn(ctx, &preamble, sizeof(preamble)) != sizeof(preamble)) {
-		VbExError("not enough data to fill preamble\n");
+		KernelConfigError("not enough data to fill preamble\n");
 		return NULL;
 	}
 	to_skip = preamble.preamble_size - sizeof(preamble);
-	if (to_skip < 0 || SkipWithRead(ctx, read_fn, to_skip)) {
-		VbExError("preamble_size advances past the end of the blob\n");
+	if (to_skip < 0 || skip_fn(ctx, to_skip)) {
+		KernelConfigError("preamble_size advances past the end"
+				  " of the blob\n");
 		return NULL;
 	}
 	now += preamble.preamble_size;
@@ -117,26 +267,107 @@ static char *FindKernelConfigFromStream(void *ctx, ReadFullyFn read_fn,
 	    (kernel_body_load_address + CROS_PARAMS_SIZE +
 	     CROS_CONFIG_SIZE) + now;
 	to_skip = offset - now;
-	if (to_skip < 0 || SkipWithRead(ctx, read_fn, to_skip)) {
-		VbExError("params are outside of the memory blob: %x\n",
-			  offset);
+	if (to_skip < 0 || skip_fn(ctx, to_skip)) {
+		KernelConfigError("params are outside of the memory blob: %x\n",
+				  offset);
 		return NULL;
 	}
 	char *ret = malloc(CROS_CONFIG_SIZE);
 	if (!ret) {
-		VbExError("No memory\n");
+		KernelConfigError("No memory\n");
 		return NULL;
 	}
 	if (read_fn(ctx, ret, CROS_CONFIG_SIZE) != CROS_CONFIG_SIZE) {
-		VbExError("Cannot read kernel config\n");
+		KernelConfigError("Cannot read kernel config\n");
 		free(ret);
 		ret = NULL;
 	}
 	return ret;
 }
 
+/* Read exactly |count| bytes at |offset|. Return 0 on success. */
+static int PreadFully(int fd, void *buf, size_t count, off_t offset)
+{
+	ssize_t nr_read = 0;
+	while (nr_read < count) {
+		ssize_t chunk = pread(fd, buf + nr_read, count - nr_read,
+				      offset + nr_read);
+		if (chunk <= 0)
+			return -1;
+		nr_read += chunk;
+	}
+	return 0;
+}
+
+/* Like FindKernelConfigFromStream(), but for a file of |size| bytes that we
+ * can seek in, so that only the two headers and the config itself are read. */
+static char *FindKernelConfigFromFile(int fd, uint64_t size,
+				      uint64_t kernel_body_load_address)
+{
+	VbKeyBlockHeader key_block;
+	VbKernelPreambleHeader preamble;
+	uint32_t now = 0;
+	uint32_t offset = 0;
+
+	if (PreadFully(fd, &key_block, sizeof(key_block), 0)) {
+		KernelConfigError("not enough data to fill key block header\n");
+		return NULL;
+	}
+	if (key_block.key_block_size < sizeof(key_block) ||
+	    key_block.key_block_size > size) {
+		KernelConfigError("key_block_size advances past the end"
+				  " of the blob\n");
+		return NULL;
+	}
+	now += key_block.key_block_size;
+
+	if (PreadFully(fd, &preamble, sizeof(preamble), now)) {
+		KernelConfigError("not enough data to fill preamble\n");
+		return NULL;
+	}
+	if (preamble.preamble_size < sizeof(preamble) ||
+	    preamble.preamble_size > size - now) {
+		KernelConfigError("preamble_size advances past the end"
+				  " of the blob\n");
+		return NULL;
+	}
+	now += preamble.preamble_size;
+
+	if (kernel_body_load_address == USE_PREAMBLE_LOAD_ADDR)
+		kernel_body_load_address = preamble.body_load_address;
+
+	/* Same place as FindKernelConfigFromStream() looks */
+	offset = preamble.bootloader_address -
+	    (kernel_body_load_address + CROS_PARAMS_SIZE +
+	     CROS_CONFIG_SIZE) + now;
+	if (offset < now || offset > size) {
+		KernelConfigError("params are outside of the memory blob: %x\n",
+				  offset);
+		return NULL;
+	}
+	char *ret = malloc(CROS_CONFIG_SIZE);
+	if (!ret) {
+		KernelConfigError("No memory\n");
+		return NULL;
+	}
+	if (PreadFully(fd, ret, CROS_CONFIG_SIZE, offset)) {
+		KernelConfigError("Cannot read kernel config\n");
+		free(ret);
+		ret = NULL;
+	}
+	return ret;
+}
+
+char *FindKernelConfigFromFd(int fd, uint64_t kernel_body_load_address)
+{
+	return FindKernelConfigFromStream(&fd, ReadFullyWithRead,
+					  SkipWithReadFully,
+					  kernel_body_load_address);
+}
+
 char *FindKernelConfig(const char *infile, uint64_t kernel_body_load_address)
 {
+	struct stat st;
 	char *newstr = NULL;
 
 #if defined(__linux__) || defined(__ANDROID__)
@@ -145,37 +376,54 @@ char *FindKernelConfig(const char *infile, uint64_t kernel_body_load_address)
 	int fd = open(infile, O_RDONLY | O_CLOEXEC);
 #endif
 	if (fd < 0) {
-		VbExError("Cannot open %s\n", infile);
+		KernelConfigError("Cannot open %s\n", infile);
 		return NULL;
 	}
 
+	/* Pipes and character devices have to be read through in order. A
+	 * block device's st_size is zero, so ask it how big it is. */
+	if (!fstat(fd, &st) && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+		off_t size = lseek(fd, 0, SEEK_END);
+		if (size >= 0) {
+			newstr = FindKernelConfigFromFile(
+				fd, size, kernel_body_load_address);
+			close(fd);
+			return newstr;
+		}
+		lseek(fd, 0, SEEK_SET);
+	}
+
 	void *ctx = &fd;
 	ReadFullyFn read_fn = ReadFullyWithRead;
+	SkipFn skip_fn = SkipWithReadFully;
 
 #ifdef USE_MTD
 	struct stat stat_buf;
 	if (fstat(fd, &stat_buf)) {
-		VbExError("Cannot stat %s\n", infile);
+		KernelConfigError("Cannot stat %s\n", infile);
 		return NULL;
 	}
 
 	int is_mtd = (major(stat_buf.st_rdev) == MTD_CHAR_MAJOR);
 	if (is_mtd) {
-		ctx = mtd_read_descriptor(fd, infile);
+		ctx = MtdReaderOpen(fd);
 		if (!ctx) {
-			VbExError("Cannot read from MTD device %s\n", infile);
+			KernelConfigError("Cannot read from MTD device %s\n",
+					  infile);
+			close(fd);
 			return NULL;
 		}
 		read_fn = ReadFullyWithMtdRead;
+		skip_fn = SkipWithMtdSeek;
 	}
 #endif
 
-	newstr = FindKernelConfigFromStream(ctx, read_fn,
+	newstr = FindKernelConfigFromStream(ctx, read_fn, skip_fn,
 					    kernel_body_load_address);
 
 #ifdef USE_MTD
 	if (is_mtd) {
-		mtd_read_close(ctx);
+		MtdReaderClose(ctx);
 	}
 #endif
 	close(fd);
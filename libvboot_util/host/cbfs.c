@@ -0,0 +1,206 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cbfs.h"
+
+static const struct {
+	uint32_t type;
+	const char *name;
+} cbfs_types[] = {
+	{0x01, "bootblock"},
+	{0x02, "cbfs header"},
+	{0x10, "stage"},
+	{0x20, "payload"},
+	{0x21, "fit"},
+	{0x30, "optionrom"},
+	{0x40, "bootsplash"},
+	{0x50, "raw"},
+	{0x51, "vsa"},
+	{0x52, "mbi"},
+	{0x53, "microcode"},
+	{0x60, "fsp"},
+	{0x61, "mrc"},
+	{0x62, "mma"},
+	{0x63, "efi"},
+	{0x70, "struct"},
+	{0xaa, "cmos_default"},
+	{0xab, "spd"},
+	{0xac, "mrc_cache"},
+	{0x1aa, "cmos_layout"},
+};
+
+const char *cbfs_type_name(uint32_t type)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(cbfs_types) / sizeof(cbfs_types[0]); i++)
+		if (cbfs_types[i].type == type)
+			return cbfs_types[i].name;
+	return NULL;
+}
+
+/* The headers are packed, so [p] may not be aligned */
+static uint32_t be32(const void *p)
+{
+	const uint8_t *b = p;
+
+	return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+		((uint32_t)b[2] << 8) | b[3];
+}
+
+/* FNV-1a, as for the FMAP index */
+static uint32_t cbfs_name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *name; name++)
+		h = (h ^ (uint8_t)*name) * 16777619u;
+	return h;
+}
+
+/*
+ * Checks the file header at [pos] and fills in [e] from it. Returns the
+ * offset of the next header to look at, or 0 if this one isn't valid.
+ */
+static uint64_t read_file_header(const uint8_t *ptr, size_t size,
+				 uint64_t pos, CbfsEntry *e)
+{
+	const CbfsFileHeader *h = (const CbfsFileHeader *)(ptr + pos);
+	uint64_t offset, len, name_max, end;
+
+	if (size - pos < sizeof(*h) ||
+	    memcmp(h->magic, CBFS_FILE_MAGIC, CBFS_FILE_MAGIC_SIZE))
+		return 0;
+
+	offset = be32(&h->offset);
+	len = be32(&h->len);
+	if (offset <= sizeof(*h) || offset > size - pos ||
+	    len > size - pos - offset)
+		return 0;
+
+	/* The name ends before the attributes, if there are any */
+	name_max = offset - sizeof(*h);
+	if (be32(&h->attributes_offset) > sizeof(*h) &&
+	    be32(&h->attributes_offset) < offset)
+		name_max = be32(&h->attributes_offset) - sizeof(*h);
+	if (!memchr(h + 1, 0, name_max))
+		return 0;
+
+	e->name = (const char *)(h + 1);
+	e->type = be32(&h->type);
+	e->offset = pos;
+	e->data_offset = pos + offset;
+	e->len = len;
+
+	end = pos + offset + len;
+	return (end + CBFS_ALIGNMENT - 1) & ~(uint64_t)(CBFS_ALIGNMENT - 1);
+}
+
+CbfsIndex *cbfs_index_create(uint8_t *ptr, size_t size)
+{
+	CbfsIndex *idx;
+	CbfsEntry e, *entries = NULL, *more;
+	int n = 0, max = 0, i;
+	uint32_t slots, h;
+	uint64_t pos = 0, next;
+
+	/*
+	 * Files are aligned, and normally follow one another. Anything
+	 * between them, such as a bootblock, is skipped a step at a time.
+	 */
+	while (pos < size) {
+		next = read_file_header(ptr, size, pos, &e);
+		if (!next) {
+			pos += CBFS_ALIGNMENT;
+			continue;
+		}
+		pos = next;
+
+		if (e.type == CBFS_TYPE_DELETED || e.type == CBFS_TYPE_DELETED2)
+			continue;
+
+		if (n == max) {
+			max = max ? 2 * max : 32;
+			more = realloc(entries, max * sizeof(*entries));
+			if (!more) {
+				free(entries);
+				return NULL;
+			}
+			entries = more;
+		}
+		entries[n++] = e;
+	}
+
+	if (!n) {
+		free(entries);
+		return NULL;
+	}
+
+	/* Keep the table no more than half full */
+	for (slots = 4; slots < 2 * n; slots *= 2)
+		;
+
+	idx = malloc(sizeof(*idx) + slots * sizeof(idx->hash[0]));
+	if (!idx) {
+		free(entries);
+		return NULL;
+	}
+
+	idx->base = ptr;
+	idx->size = size;
+	idx->entries = entries;
+	idx->nentries = n;
+	idx->hash_mask = slots - 1;
+	idx->hash = (int32_t *)(idx + 1);
+
+	for (h = 0; h < slots; h++)
+		idx->hash[h] = -1;
+
+	for (i = 0; i < n; i++) {
+		/* Linear probing keeps the first of any duplicates first */
+		h = cbfs_name_hash(entries[i].name) & idx->hash_mask;
+		while (idx->hash[h] >= 0)
+			h = (h + 1) & idx->hash_mask;
+		idx->hash[h] = i;
+	}
+
+	return idx;
+}
+
+void cbfs_index_free(CbfsIndex *idx)
+{
+	if (!idx)
+		return;
+	free(idx->entries);
+	free(idx);
+}
+
+const CbfsEntry *cbfs_index_find(const CbfsIndex *idx, const char *name)
+{
+	uint32_t h;
+	int32_t i;
+
+	if (!idx)
+		return NULL;
+
+	h = cbfs_name_hash(name) & idx->hash_mask;
+	for (; (i = idx->hash[h]) >= 0; h = (h + 1) & idx->hash_mask)
+		if (!strcmp(idx->entries[i].name, name))
+			return idx->entries + i;
+
+	return NULL;
+}
+
+const CbfsEntry *cbfs_index_entry(const CbfsIndex *idx, int n)
+{
+	if (!idx || n < 0 || n >= idx->nentries)
+		return NULL;
+	return idx->entries + n;
+}
@@ -5,9 +5,13 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
 
@@ -28,7 +32,8 @@ typedef enum VdatStringField {
   VDAT_STRING_TIMERS = 0,           /* Timer values */
   VDAT_STRING_LOAD_FIRMWARE_DEBUG,  /* LoadFirmware() debug information */
   VDAT_STRING_LOAD_KERNEL_DEBUG,    /* LoadKernel() debug information */
-  VDAT_STRING_MAINFW_ACT            /* Active main firmware */
+  VDAT_STRING_MAINFW_ACT,           /* Active main firmware */
+  VDAT_STRING_TIMESTAMPS            /* Boot stage timestamps */
 } VdatStringField;
 
 
@@ -82,23 +87,39 @@ int FwidStartsWith(const char *start) {
 
 static int vnc_read;
 
+static void SnapshotInvalidate(void);
+
+/* NV storage context shared by the writes in a batch, between
+ * VbSetSystemPropertiesBegin() and VbSetSystemPropertiesCommit().  It stays
+ * set up (VbNvSetup() but not VbNvTeardown()) for the whole batch. */
+static VbNvContext batch_vnc;
+static int batch_open;
+
 int VbGetNvStorage(VbNvParam param) {
   uint32_t value;
   int retval;
   static VbNvContext cached_vnc;
 
+  /* Inside a batch, see the writes made so far */
+  if (batch_open) {
+    if (0 != VbNvGet(&batch_vnc, param, &value))
+      return -1;
+    return (int)value;
+  }
+
   /* TODO: locking around NV access */
+  /* Reads don't change it, so one VbNvSetup() (and its CRC check) covers
+   * every read until the next write.  There's nothing to tear down, since
+   * this copy is never written back. */
   if (!vnc_read) {
     if (0 != VbReadNvStorage(&cached_vnc))
       return -1;
+    if (0 != VbNvSetup(&cached_vnc))
+      return -1;
     vnc_read = 1;
   }
 
-  if (0 != VbNvSetup(&cached_vnc))
-    return -1;
   retval = VbNvGet(&cached_vnc, param, &value);
-  if (0 != VbNvTeardown(&cached_vnc))
-    return -1;
   if (0 != retval)
     return -1;
 
@@ -115,6 +136,10 @@ int VbSetNvStorage(VbNvParam param, int value) {
   int retval = -1;
   int i;
 
+  /* Inside a batch, the write happens in VbSetSystemPropertiesCommit() */
+  if (batch_open)
+    return VbNvSet(&batch_vnc, param, (uint32_t)value) ? -1 : 0;
+
   if (0 != VbReadNvStorage(&vnc))
     return -1;
 
@@ -140,6 +165,56 @@ VbSetNvCleanup:
   return retval;
 }
 
+int VbSetSystemPropertiesBegin(void) {
+  if (batch_open)
+    return -1;
+
+  if (0 != VbReadNvStorage(&batch_vnc))
+    return -1;
+  if (0 != VbNvSetup(&batch_vnc))
+    return -1;
+
+  batch_open = 1;
+  return 0;
+}
+
+
+int VbSetSystemPropertiesCommit(void) {
+  int retval = 0;
+
+  if (!batch_open)
+    return -1;
+  batch_open = 0;
+
+  /* One CRC update for the whole batch */
+  if (0 != VbNvTeardown(&batch_vnc))
+    return -1;
+
+  if (batch_vnc.raw_changed) {
+    vnc_read = 0;
+    retval = VbWriteNvStorage(&batch_vnc) ? -1 : 0;
+    /* The sets only marked it out of date before the write */
+    SnapshotInvalidate();
+  }
+
+  return retval;
+}
+
+
+void VbSetSystemPropertiesAbort(void) {
+  batch_open = 0;
+}
+
+
+void VbGetSystemPropertiesBegin(void) {
+  ReadFileCacheBegin();
+}
+
+
+void VbGetSystemPropertiesEnd(void) {
+  ReadFileCacheEnd();
+}
+
 /*
  * Set a param value, and try to flag it for persistent backup.
  * It's okay if backup isn't supported. It's best-effort only.
@@ -156,17 +231,12 @@ static int VbSetNvStorage_WithBackup(VbNvParam param, int value)
 /* Find what build/debug status is specified on the kernel command
  * line, if any. */
 static VbBuildOption VbScanBuildOption(void) {
-  FILE* f = NULL;
   char buf[4096] = "";
   char *t, *saveptr;
   const char *delimiters = " \r\n";
 
-  f = fopen(KERNEL_CMDLINE_PATH, "r");
-  if (NULL != f) {
-    if (NULL == fgets(buf, sizeof(buf), f))
-      buf[0] = 0;
-    fclose(f);
-  }
+  if (!ReadFileString(buf, sizeof(buf), KERNEL_CMDLINE_PATH))
+    buf[0] = 0;
   for (t = strtok_r(buf, delimiters, &saveptr); t;
        t = strtok_r(NULL, delimiters, &saveptr)) {
     if (0 == strcmp(t, "cros_debug"))
@@ -319,9 +389,65 @@ LoadKernelDebugExit:
 }
 
 
+char* GetVdatTimestamps(char* dest, int size,
+                        const VbSharedDataHeader* sh) {
+  int used = 0;
+  uint32_t first = 0;
+  uint32_t i;
+  uint64_t prev = 0;
+
+  if (sh->struct_version < 3)
+    return NULL;
+
+  /* Make sure we have space for truncation warning */
+  if (size < strlen(TRUNCATED) + 1)
+    return NULL;
+  size -= strlen(TRUNCATED) + 1;
+  dest[0] = '\0';
+
+  /* Each is when a stage finished, so the delta is how long it took */
+  if (sh->timestamp_count > VBSD_MAX_TIMESTAMPS)
+    first = sh->timestamp_count - VBSD_MAX_TIMESTAMPS;
+  for (i = first; i < sh->timestamp_count; i++) {
+    const VbSharedDataTimestamp* ts =
+        sh->timestamps + (i & (VBSD_MAX_TIMESTAMPS - 1));
+
+    used += snprintf(
+        dest + used, size - used,
+        "%s index=%d part=%d time=%" PRIu64 " delta=%" PRIu64 "\n",
+        VbSharedDataStageName(ts->stage),
+        ts->index,
+        ts->part,
+        ts->time,
+        prev && ts->time > prev ? ts->time - prev : 0);
+    if (used > size)
+      break;
+    prev = ts->time;
+  }
+
+  /* Warn if data was truncated; we left space for this above. */
+  if (used > size)
+    strcat(dest, TRUNCATED);
+
+  return dest;
+}
+
+
+/* Return the VbSharedData for this boot, or NULL if error.  It doesn't
+ * change until reboot, so it's read the first time it's needed and kept for
+ * the rest of the process.  Callers must not free it. */
+static const VbSharedDataHeader* GetVdat(void) {
+  static VbSharedDataHeader* vdat;
+
+  if (!vdat)
+    vdat = VbSharedDataRead();
+  return vdat;
+}
+
+
 char* GetVdatString(char* dest, int size, VdatStringField field)
 {
-  VbSharedDataHeader* sh = VbSharedDataRead();
+  const VbSharedDataHeader* sh = GetVdat();
   char* value = dest;
 
   if (!sh)
@@ -349,6 +475,10 @@ char* GetVdatString(char* dest, int size, VdatStringField field)
       value = GetVdatLoadKernelDebug(dest, size, sh);
       break;
 
+    case VDAT_STRING_TIMESTAMPS:
+      value = GetVdatTimestamps(dest, size, sh);
+      break;
+
     case VDAT_STRING_MAINFW_ACT:
       switch(sh->firmware_index) {
         case 0:
@@ -370,13 +500,12 @@ char* GetVdatString(char* dest, int size, VdatStringField field)
       break;
   }
 
-  free(sh);
   return value;
 }
 
 
 int GetVdatInt(VdatIntField field) {
-  VbSharedDataHeader* sh = VbSharedDataRead();
+  const VbSharedDataHeader* sh = GetVdat();
   int value = -1;
 
   if (!sh)
@@ -434,7 +563,6 @@ int GetVdatInt(VdatIntField field) {
     }
   }
 
-  free(sh);
   return value;
 }
 
@@ -443,143 +571,455 @@ int VbSharedDataVersion(void) {
   return GetVdatInt(VDAT_INT_HEADER_VERSION);
 }
 
+/* Getters for the common properties.  Each takes the descriptor's arg. */
+
+static int GetNvInt(int param) {
+  return VbGetNvStorage((VbNvParam)param);
+}
+
+/* A field within kern_nv */
+static int GetKernNvMasked(int mask) {
+  int value = VbGetNvStorage(VBNV_KERNEL_FIELD);
+  if (value != -1)
+    value &= mask;
+  return value;
+}
+
+/* A single-bit flag within kern_nv, as 0 or 1 */
+static int GetKernNvFlag(int mask) {
+  int value = GetKernNvMasked(mask);
+  if (value != -1)
+    value = !!value;
+  return value;
+}
+
+static int GetVdatIntProp(int field) {
+  return GetVdatInt((VdatIntField)field);
+}
+
+static int GetCrosDebugProp(int unused) {
+  return VbGetCrosDebug();
+}
+
+static int GetDebugBuildProp(int unused) {
+  return VbGetDebugBuild();
+}
+
+static const char* GetKernkeyVfy(int unused, char* dest, size_t size) {
+  switch(GetVdatInt(VDAT_INT_KERNEL_KEY_VERIFIED)) {
+    case 0:
+      return "hash";
+    case 1:
+      return "sig";
+    default:
+      return NULL;
+  }
+}
+
+static const char* GetVdatStringProp(int field, char* dest, size_t size) {
+  return GetVdatString(dest, size, (VdatStringField)field);
+}
+
+static const char* GetUnknownString(int unused, char* dest, size_t size) {
+  return "unknown";
+}
+
+/* A firmware slot in NV storage, as "A" or "B" */
+static const char* GetNvSlot(int param, char* dest, size_t size) {
+  return VbGetNvStorage((VbNvParam)param) ? "B" : "A";
+}
+
+/* A firmware result in NV storage, as one of fw_results[] */
+static const char* GetNvResult(int param, char* dest, size_t size) {
+  int v = VbGetNvStorage((VbNvParam)param);
+  if (v < ARRAY_SIZE(fw_results))
+    return fw_results[v];
+  else
+    return "unknown";
+}
+
+/* Description of a common (not architecture-specific) property.  Exactly
+ * one of the getters is set, depending on the property's type. */
+typedef struct VbPropertyDesc {
+  const char* name;
+  int (*get_int)(int arg);
+  const char* (*get_string)(int arg, char* dest, size_t size);
+  /* Passed to the getter: a VbNvParam, VdatIntField, VdatStringField or
+   * kern_nv mask, depending on the getter */
+  int arg;
+} VbPropertyDesc;
+
+/* Sorted by name, for FindProperty().  Names are lowercase, so this is also
+ * the order strcasecmp() sees them in. */
+static const VbPropertyDesc properties[] = {
+  {"backup_nvram_request", GetNvInt, NULL, VBNV_BACKUP_NVRAM_REQUEST},
+  {"block_devmode", GetKernNvFlag, NULL, KERN_NV_BLOCK_DEVMODE_FLAG},
+  {"clear_tpm_owner_done", GetNvInt, NULL, VBNV_CLEAR_TPM_OWNER_DONE},
+  {"clear_tpm_owner_request", GetNvInt, NULL, VBNV_CLEAR_TPM_OWNER_REQUEST},
+  {"cros_debug", GetCrosDebugProp, NULL, 0},
+  {"dbg_reset", GetNvInt, NULL, VBNV_DEBUG_RESET_MODE},
+  {"ddr_type", NULL, GetUnknownString, 0},
+  {"debug_build", GetDebugBuildProp, NULL, 0},
+  {"dev_boot_legacy", GetNvInt, NULL, VBNV_DEV_BOOT_LEGACY},
+  {"dev_boot_signed_only", GetNvInt, NULL, VBNV_DEV_BOOT_SIGNED_ONLY},
+  {"dev_boot_usb", GetNvInt, NULL, VBNV_DEV_BOOT_USB},
+  {"devsw_boot", GetVdatIntProp, NULL, VDAT_INT_DEVSW_BOOT},
+  {"devsw_virtual", GetVdatIntProp, NULL, VDAT_INT_DEVSW_VIRTUAL},
+  {"disable_dev_request", GetNvInt, NULL, VBNV_DISABLE_DEV_REQUEST},
+  {"fw_prev_result", NULL, GetNvResult, VBNV_FW_PREV_RESULT},
+  {"fw_prev_tried", NULL, GetNvSlot, VBNV_FW_PREV_TRIED},
+  {"fw_result", NULL, GetNvResult, VBNV_FW_RESULT},
+  {"fw_tried", NULL, GetNvSlot, VBNV_FW_TRIED},
+  {"fw_try_count", GetNvInt, NULL, VBNV_FW_TRY_COUNT},
+  {"fw_try_next", NULL, GetNvSlot, VBNV_FW_TRY_NEXT},
+  {"fw_vboot2", GetVdatIntProp, NULL, VDAT_INT_FW_BOOT2},
+  {"fwb_tries", GetNvInt, NULL, VBNV_TRY_B_COUNT},
+  {"fwupdate_tries", GetKernNvMasked, NULL, KERN_NV_FWUPDATE_TRIES_MASK},
+  {"kern_nv", GetNvInt, NULL, VBNV_KERNEL_FIELD},
+  {"kernkey_vfy", NULL, GetKernkeyVfy, 0},
+  {"loc_idx", GetNvInt, NULL, VBNV_LOCALIZATION_INDEX},
+  {"mainfw_act", NULL, GetVdatStringProp, VDAT_STRING_MAINFW_ACT},
+  {"nvram_cleared", GetNvInt, NULL, VBNV_KERNEL_SETTINGS_RESET},
+  {"oprom_needed", GetNvInt, NULL, VBNV_OPROM_NEEDED},
+  {"recovery_reason", GetVdatIntProp, NULL, VDAT_INT_RECOVERY_REASON},
+  {"recovery_request", GetNvInt, NULL, VBNV_RECOVERY_REQUEST},
+  {"recovery_subcode", GetNvInt, NULL, VBNV_RECOVERY_SUBCODE},
+  {"recoverysw_boot", GetVdatIntProp, NULL, VDAT_INT_RECSW_BOOT},
+  {"sw_wpsw_boot", GetVdatIntProp, NULL, VDAT_INT_SW_WPSW_BOOT},
+  {"tpm_fwver", GetVdatIntProp, NULL, VDAT_INT_FW_VERSION_TPM},
+  {"tpm_kernver", GetVdatIntProp, NULL, VDAT_INT_KERNEL_VERSION_TPM},
+  {"tried_fwb", GetVdatIntProp, NULL, VDAT_INT_TRIED_FIRMWARE_B},
+  {"vdat_flags", GetVdatIntProp, NULL, VDAT_INT_FLAGS},
+  {"vdat_lfdebug", NULL, GetVdatStringProp, VDAT_STRING_LOAD_FIRMWARE_DEBUG},
+  {"vdat_lkdebug", NULL, GetVdatStringProp, VDAT_STRING_LOAD_KERNEL_DEBUG},
+  {"vdat_timers", NULL, GetVdatStringProp, VDAT_STRING_TIMERS},
+  {"vdat_timestamps", NULL, GetVdatStringProp, VDAT_STRING_TIMESTAMPS},
+  {"wpsw_boot", GetVdatIntProp, NULL, VDAT_INT_HW_WPSW_BOOT},
+};
+
+static int ComparePropertyName(const void* key, const void* entry) {
+  return strcasecmp((const char*)key, ((const VbPropertyDesc*)entry)->name);
+}
+
+/* Return the descriptor for the named common property, or NULL if there
+ * isn't one. */
+static const VbPropertyDesc* FindProperty(const char* name) {
+  return bsearch(name, properties, ARRAY_SIZE(properties),
+                 sizeof(properties[0]), ComparePropertyName);
+}
+
+const char* VbGetSystemPropertyName(int index, int* is_string) {
+  if (index < 0 || index >= ARRAY_SIZE(properties))
+    return NULL;
+  if (is_string)
+    *is_string = (properties[index].get_string != NULL);
+  return properties[index].name;
+}
+
+/* The snapshot file: a header, one entry per common property in the same
+ * order as properties[], then the string values.  It's rewritten in place,
+ * so readers never have to reopen it.  [seq] is a seqlock: a writer makes it
+ * odd, changes the rest, then makes it even again, and a reader that sees
+ * it change (or odd) while it reads tries again. */
+#define SNAPSHOT_MAGIC 0x70616e73  /* "snap" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NAME_SIZE 32
+#define SNAPSHOT_STRINGS (8 * VB_MAX_STRING_PROPERTY)
+#define SNAPSHOT_TRIES 1000
+
+#define SNAPSHOT_HAVE   0x01  /* The entry was filled in */
+#define SNAPSHOT_STRING 0x02  /* It's a string; <value> is 0 if NULL */
+
+typedef struct VbSnapshotEntry {
+  char name[SNAPSHOT_NAME_SIZE];
+  uint32_t flags;
+  int32_t value;
+  uint32_t offset;  /* Into <strings> */
+  uint32_t length;  /* Not counting the NUL */
+} VbSnapshotEntry;
+
+typedef struct VbSnapshot {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  uint32_t valid;   /* Cleared when a property is set */
+  uint32_t count;
+  uint32_t strings_used;
+  VbSnapshotEntry entry[ARRAY_SIZE(properties)];
+  char strings[SNAPSHOT_STRINGS];
+} VbSnapshot;
+
+static const VbSnapshot* snapshot;
+static const char* snapshot_path = VB_SNAPSHOT_PATH;
+
+/* Set while refreshing, so that what's read is the real thing */
+static int snapshot_bypass;
+
+/* Look up <name> in the snapshot.  If <dest> is NULL, copies an integer
+ * into <value>.  Otherwise copies a string into <dest> and sets <value> to 1,
+ * or to 0 if the string was NULL.  Returns 0 if it was found, -1 if it has
+ * to be read the usual way. */
+static int SnapshotGet(const char* name, int* value, char* dest,
+                       size_t size) {
+  const VbSnapshot* s = snapshot;
+  VbSnapshotEntry e;
+  uint32_t seq, lo, hi, mid;
+  size_t len;
+  int tries, cmp, found;
+
+  if (!s || snapshot_bypass || strlen(name) >= SNAPSHOT_NAME_SIZE)
+    return -1;
+
+  for (tries = 0; tries < SNAPSHOT_TRIES; tries++) {
+    seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+    if (s->magic != SNAPSHOT_MAGIC || s->version != SNAPSHOT_VERSION ||
+        !s->valid || s->count != ARRAY_SIZE(properties))
+      return -1;
+
+    /* The entries are in the table's order, which is sorted */
+    found = 0;
+    lo = 0;
+    hi = ARRAY_SIZE(properties);
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      cmp = strncasecmp(name, s->entry[mid].name, SNAPSHOT_NAME_SIZE);
+      if (!cmp) {
+        e = s->entry[mid];
+        found = 1;
+        break;
+      }
+      if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+    /* What was copied only counts if nothing changed meanwhile */
+    if (found && (e.flags & SNAPSHOT_STRING) && dest && e.value &&
+        e.offset <= SNAPSHOT_STRINGS &&
+        e.length < SNAPSHOT_STRINGS - e.offset) {
+      len = e.length < size - 1 ? e.length : size - 1;
+      memcpy(dest, s->strings + e.offset, len);
+      dest[len] = '\0';
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+      continue;
+
+    if (!found || !(e.flags & SNAPSHOT_HAVE))
+      return -1;
+    if (!(e.flags & SNAPSHOT_STRING) != !dest)
+      return -1;
+    *value = e.value;
+    return 0;
+  }
+  return -1;
+}
+
+/* Lock the snapshot file <path>, creating it if <create>, and map it for
+ * writing.  Returns the mapping, with its descriptor in <fd>, or NULL if
+ * error. */
+static VbSnapshot* SnapshotLock(const char* path, int create, int* fd) {
+  struct stat sb;
+  void* map;
+
+  *fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+  if (*fd < 0)
+    return NULL;
+  if (0 != flock(*fd, LOCK_EX) || 0 != fstat(*fd, &sb) ||
+      (sb.st_size != sizeof(VbSnapshot) &&
+       (!create || 0 != ftruncate(*fd, sizeof(VbSnapshot))))) {
+    close(*fd);
+    return NULL;
+  }
+  map = mmap(NULL, sizeof(VbSnapshot), PROT_READ | PROT_WRITE, MAP_SHARED,
+             *fd, 0);
+  if (map == MAP_FAILED) {
+    close(*fd);
+    return NULL;
+  }
+  return (VbSnapshot*)map;
+}
+
+static void SnapshotUnlock(VbSnapshot* s, int fd) {
+  munmap(s, sizeof(*s));
+  close(fd);  /* Which drops the lock */
+}
+
+static void SnapshotWriteBegin(VbSnapshot* s) {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void SnapshotWriteEnd(VbSnapshot* s) {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Something was set, so the snapshot can't be trusted until it's taken
+ * again.  Nobody but the refresher may be able to write it, which is fine:
+ * nobody else can set properties either. */
+static void SnapshotInvalidate(void) {
+  VbSnapshot* s;
+  int fd;
+
+  s = SnapshotLock(snapshot_path, 0, &fd);
+  if (!s)
+    return;
+  if (s->valid) {
+    SnapshotWriteBegin(s);
+    s->valid = 0;
+    SnapshotWriteEnd(s);
+  }
+  SnapshotUnlock(s, fd);
+}
+
+int VbSystemSnapshotRefresh(const char* path) {
+  char buf[VB_MAX_STRING_PROPERTY];
+  VbSnapshot* fresh;
+  VbSnapshot* s;
+  VbSnapshotEntry* e;
+  const char* str;
+  size_t len;
+  int fd, i;
+
+  if (!path)
+    path = VB_SNAPSHOT_PATH;
+
+  /* Readers don't take the lock, but whoever sets a property does, after
+   * setting it, so holding it while reading means that a value set
+   * meanwhile can't be overwritten by the old one. */
+  fresh = (VbSnapshot*)calloc(1, sizeof(*fresh));
+  if (!fresh)
+    return -1;
+  s = SnapshotLock(path, 1, &fd);
+  if (!s) {
+    free(fresh);
+    return -1;
+  }
+  snapshot_bypass = 1;
+  /* Whoever refreshes it runs for a long time, and NV storage may have been
+   * written by someone else since it was last read */
+  vnc_read = 0;
+  VbGetSystemPropertiesBegin();
+  for (i = 0; i < ARRAY_SIZE(properties); i++) {
+    e = &fresh->entry[i];
+    StrCopy(e->name, properties[i].name, sizeof(e->name));
+    if (!properties[i].get_string) {
+      e->value = VbGetSystemPropertyInt(properties[i].name);
+      e->flags = SNAPSHOT_HAVE;
+      continue;
+    }
+    e->flags = SNAPSHOT_STRING;
+    str = VbGetSystemPropertyString(properties[i].name, buf, sizeof(buf));
+    if (!str) {
+      e->flags |= SNAPSHOT_HAVE;
+      continue;
+    }
+    /* Anything that doesn't fit is read the usual way */
+    len = strlen(str);
+    if (len >= SNAPSHOT_STRINGS - fresh->strings_used)
+      continue;
+    memcpy(fresh->strings + fresh->strings_used, str, len + 1);
+    e->value = 1;
+    e->offset = fresh->strings_used;
+    e->length = len;
+    e->flags |= SNAPSHOT_HAVE;
+    fresh->strings_used += len + 1;
+  }
+  VbGetSystemPropertiesEnd();
+  snapshot_bypass = 0;
+  fresh->magic = SNAPSHOT_MAGIC;
+  fresh->version = SNAPSHOT_VERSION;
+  fresh->count = ARRAY_SIZE(properties);
+  fresh->valid = 1;
+
+  /* Readers only need to be able to read it */
+  fchmod(fd, 0644);
+  SnapshotWriteBegin(s);
+  fresh->seq = s->seq;
+  memcpy(s, fresh, sizeof(*s));
+  SnapshotWriteEnd(s);
+  SnapshotUnlock(s, fd);
+  free(fresh);
+  return 0;
+}
+
+int VbSystemSnapshotOpen(const char* path) {
+  struct stat sb;
+  void* map;
+  int fd;
+
+  VbSystemSnapshotClose();
+  if (!path)
+    path = VB_SNAPSHOT_PATH;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (0 != fstat(fd, &sb) || sb.st_size != sizeof(VbSnapshot)) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, sizeof(VbSnapshot), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  snapshot = (const VbSnapshot*)map;
+  snapshot_path = path;
+  return 0;
+}
+
+void VbSystemSnapshotClose(void) {
+  if (snapshot)
+    munmap((void*)snapshot, sizeof(*snapshot));
+  snapshot = NULL;
+  snapshot_path = VB_SNAPSHOT_PATH;
+}
+
 int VbGetSystemPropertyInt(const char* name) {
+  const VbPropertyDesc* prop;
   int value = -1;
 
+  if (0 == SnapshotGet(name, &value, NULL, 0))
+    return value;
+
   /* Check architecture-dependent properties first */
   value = VbGetArchPropertyInt(name);
   if (-1 != value)
     return value;
 
-  /* NV storage values */
-  else if (!strcasecmp(name,"kern_nv")) {
-    value = VbGetNvStorage(VBNV_KERNEL_FIELD);
-  } else if (!strcasecmp(name,"nvram_cleared")) {
-    value = VbGetNvStorage(VBNV_KERNEL_SETTINGS_RESET);
-  } else if (!strcasecmp(name,"recovery_request")) {
-    value = VbGetNvStorage(VBNV_RECOVERY_REQUEST);
-  } else if (!strcasecmp(name,"dbg_reset")) {
-    value = VbGetNvStorage(VBNV_DEBUG_RESET_MODE);
-  } else if (!strcasecmp(name,"disable_dev_request")) {
-    value = VbGetNvStorage(VBNV_DISABLE_DEV_REQUEST);
-  } else if (!strcasecmp(name,"clear_tpm_owner_request")) {
-    value = VbGetNvStorage(VBNV_CLEAR_TPM_OWNER_REQUEST);
-  } else if (!strcasecmp(name,"clear_tpm_owner_done")) {
-    value = VbGetNvStorage(VBNV_CLEAR_TPM_OWNER_DONE);
-  } else if (!strcasecmp(name,"fwb_tries")) {
-    value = VbGetNvStorage(VBNV_TRY_B_COUNT);
-  } else if (!strcasecmp(name,"fw_vboot2")) {
-    value = GetVdatInt(VDAT_INT_FW_BOOT2);
-  } else if (!strcasecmp(name,"fw_try_count")) {
-    value = VbGetNvStorage(VBNV_FW_TRY_COUNT);
-  } else if (!strcasecmp(name,"fwupdate_tries")) {
-    value = VbGetNvStorage(VBNV_KERNEL_FIELD);
-    if (value != -1)
-      value &= KERN_NV_FWUPDATE_TRIES_MASK;
-  } else if (!strcasecmp(name,"block_devmode")) {
-    value = VbGetNvStorage(VBNV_KERNEL_FIELD);
-    if (value != -1) {
-      value &= KERN_NV_BLOCK_DEVMODE_FLAG;
-      value = !!value;
-    }
-  } else if (!strcasecmp(name,"loc_idx")) {
-    value = VbGetNvStorage(VBNV_LOCALIZATION_INDEX);
-  } else if (!strcasecmp(name,"backup_nvram_request")) {
-    value = VbGetNvStorage(VBNV_BACKUP_NVRAM_REQUEST);
-  } else if (!strcasecmp(name,"dev_boot_usb")) {
-    value = VbGetNvStorage(VBNV_DEV_BOOT_USB);
-  } else if (!strcasecmp(name,"dev_boot_legacy")) {
-    value = VbGetNvStorage(VBNV_DEV_BOOT_LEGACY);
-  } else if (!strcasecmp(name,"dev_boot_signed_only")) {
-    value = VbGetNvStorage(VBNV_DEV_BOOT_SIGNED_ONLY);
-  } else if (!strcasecmp(name,"oprom_needed")) {
-    value = VbGetNvStorage(VBNV_OPROM_NEEDED);
-  } else if (!strcasecmp(name,"recovery_subcode")) {
-    value = VbGetNvStorage(VBNV_RECOVERY_SUBCODE);
-  }
-  /* Other parameters */
-  else if (!strcasecmp(name,"cros_debug")) {
-    value = VbGetCrosDebug();
-  } else if (!strcasecmp(name,"debug_build")) {
-    value = VbGetDebugBuild();
-  } else if (!strcasecmp(name,"devsw_boot")) {
-    value = GetVdatInt(VDAT_INT_DEVSW_BOOT);
-  } else if (!strcasecmp(name,"devsw_virtual")) {
-    value = GetVdatInt(VDAT_INT_DEVSW_VIRTUAL);
-  } else if (!strcasecmp(name, "recoverysw_boot")) {
-    value = GetVdatInt(VDAT_INT_RECSW_BOOT);
-  } else if (!strcasecmp(name, "wpsw_boot")) {
-    value = GetVdatInt(VDAT_INT_HW_WPSW_BOOT);
-  } else if (!strcasecmp(name, "sw_wpsw_boot")) {
-    value = GetVdatInt(VDAT_INT_SW_WPSW_BOOT);
-  } else if (!strcasecmp(name,"vdat_flags")) {
-    value = GetVdatInt(VDAT_INT_FLAGS);
-  } else if (!strcasecmp(name,"tpm_fwver")) {
-    value = GetVdatInt(VDAT_INT_FW_VERSION_TPM);
-  } else if (!strcasecmp(name,"tpm_kernver")) {
-    value = GetVdatInt(VDAT_INT_KERNEL_VERSION_TPM);
-  } else if (!strcasecmp(name,"tried_fwb")) {
-    value = GetVdatInt(VDAT_INT_TRIED_FIRMWARE_B);
-  } else if (!strcasecmp(name,"recovery_reason")) {
-    value = GetVdatInt(VDAT_INT_RECOVERY_REASON);
-  }
+  prop = FindProperty(name);
+  if (!prop || !prop->get_int)
+    return -1;
 
-  return value;
+  return prop->get_int(prop->arg);
 }
 
 
 const char* VbGetSystemPropertyString(const char* name, char* dest,
                                       size_t size) {
-  static const char unknown_string[] = "unknown";
+  const VbPropertyDesc* prop;
+  int have;
+
+  if (size && 0 == SnapshotGet(name, &have, dest, size))
+    return have ? dest : NULL;
 
   /* Check architecture-dependent properties first */
   if (VbGetArchPropertyString(name, dest, size))
     return dest;
 
-  if (!strcasecmp(name,"kernkey_vfy")) {
-    switch(GetVdatInt(VDAT_INT_KERNEL_KEY_VERIFIED)) {
-      case 0:
-        return "hash";
-      case 1:
-        return "sig";
-      default:
-        return NULL;
-    }
-  } else if (!strcasecmp(name, "mainfw_act")) {
-    return GetVdatString(dest, size, VDAT_STRING_MAINFW_ACT);
-  } else if (!strcasecmp(name, "vdat_timers")) {
-    return GetVdatString(dest, size, VDAT_STRING_TIMERS);
-  } else if (!strcasecmp(name, "vdat_lfdebug")) {
-    return GetVdatString(dest, size, VDAT_STRING_LOAD_FIRMWARE_DEBUG);
-  } else if (!strcasecmp(name, "vdat_lkdebug")) {
-    return GetVdatString(dest, size, VDAT_STRING_LOAD_KERNEL_DEBUG);
-  } else if (!strcasecmp(name, "ddr_type")) {
-    return unknown_string;
-  } else if (!strcasecmp(name, "fw_try_next")) {
-    return VbGetNvStorage(VBNV_FW_TRY_NEXT) ? "B" : "A";
-  } else if (!strcasecmp(name, "fw_tried")) {
-    return VbGetNvStorage(VBNV_FW_TRIED) ? "B" : "A";
-  } else if (!strcasecmp(name, "fw_result")) {
-    int v = VbGetNvStorage(VBNV_FW_RESULT);
-    if (v < ARRAY_SIZE(fw_results))
-      return fw_results[v];
-    else
-      return "unknown";
-  } else if (!strcasecmp(name, "fw_prev_tried")) {
-    return VbGetNvStorage(VBNV_FW_PREV_TRIED) ? "B" : "A";
-  } else if (!strcasecmp(name, "fw_prev_result")) {
-    int v = VbGetNvStorage(VBNV_FW_PREV_RESULT);
-    if (v < ARRAY_SIZE(fw_results))
-      return fw_results[v];
-    else
-      return "unknown";
-  }
+  prop = FindProperty(name);
+  if (!prop || !prop->get_string)
+    return NULL;
 
-  return NULL;
+  return prop->get_string(prop->arg, dest, size);
 }
 
 
-int VbSetSystemPropertyInt(const char* name, int value) {
+static int SetPropertyInt(const char* name, int value) {
   /* Check architecture-dependent properties first */
 
   if (0 == VbSetArchPropertyInt(name, value))
@@ -640,7 +1080,7 @@ int VbSetSystemPropertyInt(const char* name, int value) {
 }
 
 
-int VbSetSystemPropertyString(const char* name, const char* value) {
+static int SetPropertyString(const char* name, const char* value) {
   /* Chain to architecture-dependent properties */
   if (0 == VbSetArchPropertyString(name, value))
     return 0;
@@ -665,3 +1105,19 @@ int VbSetSystemPropertyString(const char* name, const char* value) {
 
   return -1;
 }
+
+
+int VbSetSystemPropertyInt(const char* name, int value) {
+  int retval = SetPropertyInt(name, value);
+
+  SnapshotInvalidate();
+  return retval;
+}
+
+
+int VbSetSystemPropertyString(const char* name, const char* value) {
+  int retval = SetPropertyString(name, value);
+
+  SnapshotInvalidate();
+  return retval;
+}
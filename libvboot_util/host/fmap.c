@@ -5,9 +5,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "fmap.h"
+#include "image_scan.h"
 
 static int is_fmap(uint8_t *ptr)
 {
@@ -24,17 +26,86 @@ static int is_fmap(uint8_t *ptr)
 	return 0;
 }
 
+/* Ordered the way fmap_find() looks at them: larger alignments first */
+static int fmap_candidate_cmp(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+	size_t ax = x & -x, ay = y & -y;
+
+	if (ax != ay)
+		return ax > ay ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+FmapHeader *image_scan_fmap(uint8_t *ptr, size_t size,
+			    const ImageScan *scan, size_t max_align)
+{
+	FmapHeader *found = NULL;
+	size_t *cand;
+	int i, n = 0;
+
+	if (!scan->num_fmap || size < sizeof(FmapHeader))
+		return NULL;
+
+	cand = malloc(scan->num_fmap * sizeof(*cand));
+	if (!cand)
+		return NULL;
+	for (i = 0; i < scan->num_fmap; i++) {
+		size_t offset = scan->fmap[i];
+
+		if (offset > size - sizeof(FmapHeader))
+			continue;
+		/* Offset 0 is aligned to everything */
+		if (max_align && (!offset || (offset & -offset) >= max_align))
+			continue;
+		cand[n++] = offset;
+	}
+
+	/* Offset 0 sorts last, but is the first place fmap_find() looks */
+	qsort(cand, n, sizeof(*cand), fmap_candidate_cmp);
+	if (n && !cand[n - 1] && is_fmap(ptr))
+		found = (FmapHeader *)ptr;
+	for (i = 0; i < n && !found; i++)
+		if (cand[i] && is_fmap(ptr + cand[i]))
+			found = (FmapHeader *)(ptr + cand[i]);
+
+	free(cand);
+	return found;
+}
+
+/*
+ * Most images put the FMAP on a large boundary, so it's much quicker to try
+ * those first than to look at the whole image.
+ */
+#define FMAP_PROBE_ALIGN 0x10000
+
 /* Find and point to the FMAP header within the buffer */
 FmapHeader *fmap_find(uint8_t *ptr, size_t size)
 {
 	ssize_t offset, align;
 	ssize_t lim = size - sizeof(FmapHeader);
+	FmapHeader *fmap;
+	ImageScan *scan;
 
 	if (lim >= 0 && is_fmap(ptr))
 		return (FmapHeader *)ptr;
 
 	/* Search large alignments before small ones to find "right" FMAP. */
 	for (align = FMAP_SEARCH_STRIDE; align <= lim; align *= 2);
+	for (; align >= FMAP_PROBE_ALIGN; align /= 2)
+		for (offset = align; offset <= lim; offset += align * 2)
+			if (is_fmap(ptr + offset))
+				return (FmapHeader *)(ptr + offset);
+
+	/* The rest are found more quickly in one pass */
+	scan = image_scan(ptr, size);
+	if (scan) {
+		fmap = image_scan_fmap(ptr, size, scan, FMAP_PROBE_ALIGN);
+		image_scan_free(scan);
+		return fmap;
+	}
+
+	/* Out of memory, so do it the slow way */
 	for (; align >= FMAP_SEARCH_STRIDE; align /= 2)
 		for (offset = align; offset <= lim; offset += align * 2)
 			if (is_fmap(ptr + offset))
@@ -65,3 +136,118 @@ uint8_t *fmap_find_by_name(uint8_t *ptr, size_t size, FmapHeader *fmap,
 
 	return NULL;
 }
+
+/* FNV-1a, over at most FMAP_NAMELEN bytes */
+static uint32_t fmap_name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < FMAP_NAMELEN && name[i]; i++)
+		h = (h ^ (uint8_t)name[i]) * 16777619u;
+	return h;
+}
+
+/* Insertion sort is fine, since the areas are nearly always in order */
+static void sort_by_offset(const FmapAreaHeader *ah, uint16_t *ary, int n)
+{
+	int i, j;
+	uint16_t t;
+
+	for (i = 1; i < n; i++) {
+		t = ary[i];
+		for (j = i; j > 0 &&
+			     ah[ary[j - 1]].area_offset > ah[t].area_offset; j--)
+			ary[j] = ary[j - 1];
+		ary[j] = t;
+	}
+}
+
+FmapIndex *fmap_index_create(uint8_t *ptr, size_t size)
+{
+	return fmap_index_create_at(ptr, size, size);
+}
+
+FmapIndex *fmap_index_create_at(uint8_t *ptr, size_t size, size_t offset)
+{
+	FmapHeader *fmap;
+	FmapIndex *idx;
+	uint32_t slots, h;
+	int i, n;
+
+	if (size >= sizeof(FmapHeader) && offset <= size - sizeof(FmapHeader) &&
+	    is_fmap(ptr + offset))
+		fmap = (FmapHeader *)(ptr + offset);
+	else
+		fmap = fmap_find(ptr, size);
+	if (!fmap)
+		return NULL;
+
+	n = fmap->fmap_nareas;
+	/* Don't trust area headers past the end of the buffer */
+	if ((uint8_t *)fmap + sizeof(FmapHeader) + n * sizeof(FmapAreaHeader)
+	    > ptr + size)
+		n = (ptr + size - (uint8_t *)fmap - sizeof(FmapHeader)) /
+			sizeof(FmapAreaHeader);
+
+	/* Keep the table no more than half full */
+	for (slots = 4; slots < 2 * n; slots *= 2)
+		;
+
+	idx = malloc(sizeof(*idx) + slots * sizeof(idx->hash[0]) +
+		     n * sizeof(idx->by_offset[0]));
+	if (!idx)
+		return NULL;
+
+	idx->base = ptr;
+	idx->size = size;
+	idx->fmap = fmap;
+	idx->areas = (FmapAreaHeader *)((uint8_t *)fmap + sizeof(FmapHeader));
+	idx->nareas = n;
+	idx->hash_mask = slots - 1;
+	idx->hash = (int32_t *)(idx + 1);
+	idx->by_offset = (uint16_t *)(idx->hash + slots);
+
+	for (h = 0; h < slots; h++)
+		idx->hash[h] = -1;
+
+	for (i = 0; i < n; i++) {
+		/* Linear probing keeps the first of any duplicates first */
+		h = fmap_name_hash(idx->areas[i].area_name) & idx->hash_mask;
+		while (idx->hash[h] >= 0)
+			h = (h + 1) & idx->hash_mask;
+		idx->hash[h] = i;
+		idx->by_offset[i] = i;
+	}
+	sort_by_offset(idx->areas, idx->by_offset, n);
+
+	return idx;
+}
+
+void fmap_index_free(FmapIndex *idx)
+{
+	free(idx);
+}
+
+FmapAreaHeader *fmap_index_find(const FmapIndex *idx, const char *name)
+{
+	uint32_t h;
+	int32_t i;
+
+	if (!idx)
+		return NULL;
+
+	h = fmap_name_hash(name) & idx->hash_mask;
+	for (; (i = idx->hash[h]) >= 0; h = (h + 1) & idx->hash_mask)
+		if (!strncmp(idx->areas[i].area_name, name, FMAP_NAMELEN))
+			return idx->areas + i;
+
+	return NULL;
+}
+
+FmapAreaHeader *fmap_index_by_offset(const FmapIndex *idx, int n)
+{
+	if (!idx || n < 0 || n >= idx->nareas)
+		return NULL;
+	return idx->areas + idx->by_offset[n];
+}
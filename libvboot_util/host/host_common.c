@@ -14,14 +14,23 @@
 #include "utility.h"
 #include "vboot_common.h"
 
-VbFirmwarePreambleHeader *CreateFirmwarePreamble(
+uint64_t FirmwarePreambleSize(const VbPublicKey *kernel_subkey,
+			      const VbSignature *body_signature,
+			      const VbPrivateKey *signing_key)
+{
+	return (sizeof(VbFirmwarePreambleHeader) + kernel_subkey->key_size +
+		body_signature->sig_size + siglen_map[signing_key->algorithm]);
+}
+
+int CreateFirmwarePreambleInto(
 	uint64_t firmware_version,
 	const VbPublicKey *kernel_subkey,
 	const VbSignature *body_signature,
 	const VbPrivateKey *signing_key,
-	uint32_t flags)
+	uint32_t flags,
+	VbFirmwarePreambleHeader *h,
+	uint64_t dest_size)
 {
-	VbFirmwarePreambleHeader *h;
 	uint64_t signed_size = (sizeof(VbFirmwarePreambleHeader) +
 				kernel_subkey->key_size +
 				body_signature->sig_size);
@@ -29,12 +38,9 @@ VbFirmwarePreambleHeader *CreateFirmwarePreamble(
 	uint8_t *kernel_subkey_dest;
 	uint8_t *body_sig_dest;
 	uint8_t *block_sig_dest;
-	VbSignature *sigtmp;
 
-	/* Allocate key block */
-	h = (VbFirmwarePreambleHeader *)malloc(block_size);
-	if (!h)
-		return NULL;
+	if (block_size > dest_size)
+		return 1;
 
 	Memset(h, 0, block_size);
 	kernel_subkey_dest = (uint8_t *)(h + 1);
@@ -62,15 +68,65 @@ VbFirmwarePreambleHeader *CreateFirmwarePreamble(
 		      siglen_map[signing_key->algorithm], signed_size);
 
 	/* Calculate signature */
-	sigtmp = CalculateSignature((uint8_t *)h, signed_size, signing_key);
-	SignatureCopy(&h->preamble_signature, sigtmp);
-	free(sigtmp);
+	return CalculateSignatureInto((uint8_t *)h, signed_size, signing_key,
+				      &h->preamble_signature);
+}
+
+VbFirmwarePreambleHeader *CreateFirmwarePreambleScratch(
+	uint64_t firmware_version,
+	const VbPublicKey *kernel_subkey,
+	const VbSignature *body_signature,
+	const VbPrivateKey *signing_key,
+	uint32_t flags,
+	VbScratch *scratch)
+{
+	VbFirmwarePreambleHeader *h;
+	uint64_t block_size = FirmwarePreambleSize(kernel_subkey,
+						   body_signature,
+						   signing_key);
+
+	/* Allocate key block */
+	h = (VbFirmwarePreambleHeader *)ScratchAlloc(scratch, block_size);
+	if (!h)
+		return NULL;
+
+	if (CreateFirmwarePreambleInto(firmware_version, kernel_subkey,
+				       body_signature, signing_key, flags,
+				       h, block_size)) {
+		if (!scratch)
+			free(h);
+		return NULL;
+	}
 
 	/* Return the header */
 	return h;
 }
 
-VbKernelPreambleHeader *CreateKernelPreamble(
+VbFirmwarePreambleHeader *CreateFirmwarePreamble(
+	uint64_t firmware_version,
+	const VbPublicKey *kernel_subkey,
+	const VbSignature *body_signature,
+	const VbPrivateKey *signing_key,
+	uint32_t flags)
+{
+	return CreateFirmwarePreambleScratch(firmware_version, kernel_subkey,
+					     body_signature, signing_key,
+					     flags, NULL);
+}
+
+uint64_t KernelPreambleSize(const VbSignature *body_signature,
+			    uint64_t desired_size,
+			    const VbPrivateKey *signing_key)
+{
+	uint64_t block_size = (sizeof(VbKernelPreambleHeader) +
+			       body_signature->sig_size +
+			       siglen_map[signing_key->algorithm]);
+
+	/* If the block size is smaller than the desired size, pad it */
+	return block_size < desired_size ? desired_size : block_size;
+}
+
+int CreateKernelPreambleInto(
 	uint64_t kernel_version,
 	uint64_t body_load_address,
 	uint64_t bootloader_address,
@@ -80,24 +136,19 @@ VbKernelPreambleHeader *CreateKernelPreamble(
 	uint64_t vmlinuz_header_size,
 	uint32_t flags,
 	uint64_t desired_size,
-	const VbPrivateKey *signing_key)
+	const VbPrivateKey *signing_key,
+	VbKernelPreambleHeader *h,
+	uint64_t dest_size)
 {
-	VbKernelPreambleHeader *h;
 	uint64_t signed_size = (sizeof(VbKernelPreambleHeader) +
 				body_signature->sig_size);
-	uint64_t block_size = signed_size + siglen_map[signing_key->algorithm];
+	uint64_t block_size = KernelPreambleSize(body_signature, desired_size,
+						 signing_key);
 	uint8_t *body_sig_dest;
 	uint8_t *block_sig_dest;
-	VbSignature *sigtmp;
 
-	/* If the block size is smaller than the desired size, pad it */
-	if (block_size < desired_size)
-		block_size = desired_size;
-
-	/* Allocate key block */
-	h = (VbKernelPreambleHeader *)malloc(block_size);
-	if (!h)
-		return NULL;
+	if (block_size > dest_size)
+		return 1;
 
 	Memset(h, 0, block_size);
 	body_sig_dest = (uint8_t *)(h + 1);
@@ -124,10 +175,86 @@ VbKernelPreambleHeader *CreateKernelPreamble(
 		      siglen_map[signing_key->algorithm], signed_size);
 
 	/* Calculate signature */
-	sigtmp = CalculateSignature((uint8_t *)h, signed_size, signing_key);
-	SignatureCopy(&h->preamble_signature, sigtmp);
-	free(sigtmp);
+	return CalculateSignatureInto((uint8_t *)h, signed_size, signing_key,
+				      &h->preamble_signature);
+}
+
+VbKernelPreambleHeader *CreateKernelPreambleScratch(
+	uint64_t kernel_version,
+	uint64_t body_load_address,
+	uint64_t bootloader_address,
+	uint64_t bootloader_size,
+	const VbSignature *body_signature,
+	uint64_t vmlinuz_header_address,
+	uint64_t vmlinuz_header_size,
+	uint32_t flags,
+	uint64_t desired_size,
+	const VbPrivateKey *signing_key,
+	VbScratch *scratch)
+{
+	VbKernelPreambleHeader *h;
+	uint64_t block_size = KernelPreambleSize(body_signature, desired_size,
+						 signing_key);
+
+	/* Allocate key block */
+	h = (VbKernelPreambleHeader *)ScratchAlloc(scratch, block_size);
+	if (!h)
+		return NULL;
+
+	if (CreateKernelPreambleInto(kernel_version, body_load_address,
+				     bootloader_address, bootloader_size,
+				     body_signature, vmlinuz_header_address,
+				     vmlinuz_header_size, flags, desired_size,
+				     signing_key, h, block_size)) {
+		if (!scratch)
+			free(h);
+		return NULL;
+	}
 
 	/* Return the header */
 	return h;
 }
+
+VbKernelPreambleHeader *CreateKernelPreamble(
+	uint64_t kernel_version,
+	uint64_t body_load_address,
+	uint64_t bootloader_address,
+	uint64_t bootloader_size,
+	const VbSignature *body_signature,
+	uint64_t vmlinuz_header_address,
+	uint64_t vmlinuz_header_size,
+	uint32_t flags,
+	uint64_t desired_size,
+	const VbPrivateKey *signing_key)
+{
+	return CreateKernelPreambleScratch(kernel_version, body_load_address,
+					   bootloader_address, bootloader_size,
+					   body_signature,
+					   vmlinuz_header_address,
+					   vmlinuz_header_size, flags,
+					   desired_size, signing_key, NULL);
+}
+
+const char *VbSharedDataStageName(uint32_t stage)
+{
+	static const char * const names[] = {
+		[VBSD_TS_GBB_HEADER] = "GBB_HEADER",
+		[VBSD_TS_GBB_KEY] = "GBB_KEY",
+		[VBSD_TS_LF_START] = "LF_START",
+		[VBSD_TS_LF_KEY_BLOCK] = "LF_KEY_BLOCK",
+		[VBSD_TS_LF_PREAMBLE] = "LF_PREAMBLE",
+		[VBSD_TS_LF_BODY] = "LF_BODY",
+		[VBSD_TS_LK_START] = "LK_START",
+		[VBSD_TS_LK_GPT] = "LK_GPT",
+		[VBSD_TS_LK_VBLOCK_READ] = "LK_VBLOCK_READ",
+		[VBSD_TS_LK_VBLOCK_CHECKED] = "LK_VBLOCK_CHECKED",
+		[VBSD_TS_LK_BODY_READ] = "LK_BODY_READ",
+		[VBSD_TS_LK_BODY_CHECKED] = "LK_BODY_CHECKED",
+		[VBSD_TS_EC_SYNC_START] = "EC_SYNC_START",
+		[VBSD_TS_EC_SYNC] = "EC_SYNC",
+	};
+
+	if (stage < ARRAY_SIZE(names) && names[stage])
+		return names[stage];
+	return "unknown";
+}
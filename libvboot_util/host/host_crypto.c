@@ -0,0 +1,273 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Crypto providers backed by libcrypto, and by the kernel's crypto API, for
+ * host tools.
+ */
+
+#ifndef FUTIL_VERIFY_ONLY
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/if_alg.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "cryptolib.h"
+#include "host_common.h"
+#include "host_crypto.h"
+
+
+/* futility-verify is built without libcrypto */
+#ifndef FUTIL_VERIFY_ONLY
+static int LibcryptoDigestBuf(const uint8_t* buf, uint64_t len, int hash_alg,
+                              uint8_t* digest) {
+  const EVP_MD* md;
+
+  switch (hash_alg) {
+    case SHA1_DIGEST_ALGORITHM:
+      md = EVP_sha1();
+      break;
+    case SHA256_DIGEST_ALGORITHM:
+      md = EVP_sha256();
+      break;
+    case SHA512_DIGEST_ALGORITHM:
+      md = EVP_sha512();
+      break;
+    default:
+      return 1;
+  }
+  return !EVP_Digest(buf, len, digest, NULL, md, NULL);
+}
+
+/* Append a DER length of [len] at [out], returning how many bytes it took */
+static int DerLength(uint8_t* out, uint32_t len) {
+  if (len < 0x80) {
+    out[0] = len;
+    return 1;
+  }
+  out[0] = 0x82;
+  out[1] = len >> 8;
+  out[2] = len;
+  return 3;
+}
+
+/* Append the DER INTEGER with big-endian magnitude [num] of [len] bytes at
+ * [out], returning how many bytes it took */
+static int DerInteger(uint8_t* out, const uint8_t* num, uint32_t len) {
+  int pad, n = 1;
+
+  while (len > 1 && !*num) {
+    num++;
+    len--;
+  }
+  pad = *num & 0x80 ? 1 : 0;
+  out[0] = 0x02;
+  n += DerLength(out + n, len + pad);
+  if (pad)
+    out[n++] = 0;
+  Memcpy(out + n, num, len);
+  return n + len;
+}
+
+/* Turning a key into an RSA costs about as much as using it, and the same
+ * key usually checks a run of signatures, so each thread keeps the last one.
+ */
+static __thread struct {
+  uint8_t modulus[RSA8192NUMBYTES];
+  uint32_t len;
+  RSA* rsa;
+} last_key;
+
+static RSA* LibcryptoKey(const RSAPublicKey* key) {
+  static const uint8_t f4[] = {0x01, 0x00, 0x01};
+  uint8_t modulus[RSA8192NUMBYTES];
+  uint8_t der[RSA8192NUMBYTES + 32];
+  uint8_t body[RSA8192NUMBYTES + 16];
+  const uint8_t* p = der;
+  uint32_t len = key->len * sizeof(uint32_t);
+  uint32_t i, n = 0;
+  int m;
+
+  if (len > sizeof(modulus))
+    return NULL;
+
+  /* n[] is little-endian words */
+  for (i = 0; i < len; i++)
+    modulus[len - 1 - i] = key->n[i / 4] >> (8 * (i % 4));
+
+  if (last_key.rsa && last_key.len == len &&
+      !memcmp(last_key.modulus, modulus, len))
+    return last_key.rsa;
+
+  /* RSAPublicKey ::= SEQUENCE { modulus INTEGER, publicExponent INTEGER } */
+  n = DerInteger(body, modulus, len);
+  n += DerInteger(body + n, f4, sizeof(f4));
+  der[0] = 0x30;
+  m = 1 + DerLength(der + 1, n);
+  Memcpy(der + m, body, n);
+
+  if (last_key.rsa)
+    RSA_free(last_key.rsa);
+  last_key.rsa = d2i_RSAPublicKey(NULL, &p, m + n);
+  if (last_key.rsa) {
+    Memcpy(last_key.modulus, modulus, len);
+    last_key.len = len;
+  }
+  return last_key.rsa;
+}
+
+static int LibcryptoModpowF4(const RSAPublicKey* key, uint8_t* inout) {
+  uint8_t out[RSA8192NUMBYTES];
+  uint32_t len = key->len * sizeof(uint32_t);
+  RSA* rsa = LibcryptoKey(key);
+
+  /* Anything it turns down, such as a number bigger than the modulus, is
+   * left to cryptolib to get wrong in the usual way */
+  if (!rsa ||
+      RSA_public_decrypt(len, inout, out, rsa, RSA_NO_PADDING) != (int)len)
+    return 1;
+  Memcpy(inout, out, len);
+  return 0;
+}
+
+const CryptoProvider libcrypto_provider = {
+  "libcrypto",
+  LibcryptoDigestBuf,
+  LibcryptoModpowF4,
+};
+#endif  /* FUTIL_VERIFY_ONLY */
+
+#ifdef __linux__
+/* Below this, a trip through the kernel costs more than hashing here */
+#define AFALG_MIN_LEN (64 * 1024)
+
+/* The most handed to the kernel by one send() */
+#define AFALG_CHUNK (1 << 20)
+
+/* Opened sockets kept for the next hash, for each hash */
+#define AFALG_POOL 64
+
+static const char* const afalg_names[] = {"sha1", "sha256", "sha512"};
+
+/* One socket bound to each hash, from which a socket per hash in flight is
+ * accepted.  Those are kept for reuse, since batch jobs hash a lot. */
+static struct {
+  pthread_mutex_t lock;
+  int tried[3];
+  int tfm[3];                   /* -1 if the kernel hasn't got it */
+  int idle[3][AFALG_POOL];
+  int num_idle[3];
+} afalg = { PTHREAD_MUTEX_INITIALIZER };
+
+static int AfalgGet(int hash_alg) {
+  struct sockaddr_alg sa;
+  int fd = -1;
+
+  pthread_mutex_lock(&afalg.lock);
+  if (!afalg.tried[hash_alg]) {
+    afalg.tried[hash_alg] = 1;
+    memset(&sa, 0, sizeof(sa));
+    sa.salg_family = AF_ALG;
+    strcpy((char*)sa.salg_type, "hash");
+    strcpy((char*)sa.salg_name, afalg_names[hash_alg]);
+    afalg.tfm[hash_alg] = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (afalg.tfm[hash_alg] >= 0 &&
+        bind(afalg.tfm[hash_alg], (struct sockaddr*)&sa, sizeof(sa))) {
+      close(afalg.tfm[hash_alg]);
+      afalg.tfm[hash_alg] = -1;
+    }
+    if (afalg.tfm[hash_alg] < 0)
+      VBDEBUG(("%s(): no %s in the kernel\n", __FUNCTION__,
+               afalg_names[hash_alg]));
+  }
+  if (afalg.num_idle[hash_alg])
+    fd = afalg.idle[hash_alg][--afalg.num_idle[hash_alg]];
+  else if (afalg.tfm[hash_alg] >= 0)
+    fd = accept4(afalg.tfm[hash_alg], NULL, 0, SOCK_CLOEXEC);
+  pthread_mutex_unlock(&afalg.lock);
+  return fd;
+}
+
+/* Keep [fd] for next time, unless something went wrong with it */
+static void AfalgPut(int hash_alg, int fd, int ok) {
+  pthread_mutex_lock(&afalg.lock);
+  if (ok && afalg.num_idle[hash_alg] < AFALG_POOL) {
+    afalg.idle[hash_alg][afalg.num_idle[hash_alg]++] = fd;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&afalg.lock);
+  if (fd >= 0)
+    close(fd);
+}
+
+/* Whatever fails here, the device being busy or gone included, is left to
+ * cryptolib to do instead */
+static int AfalgDigestBuf(const uint8_t* buf, uint64_t len, int hash_alg,
+                          uint8_t* digest) {
+  static const int digest_size[] = {
+    SHA1_DIGEST_SIZE, SHA256_DIGEST_SIZE, SHA512_DIGEST_SIZE};
+  uint64_t n;
+  ssize_t r;
+  int fd;
+
+  if (len < AFALG_MIN_LEN || hash_alg < 0 || hash_alg > 2)
+    return 1;
+  fd = AfalgGet(hash_alg);
+  if (fd < 0)
+    return 1;
+
+  while (len) {
+    n = len < AFALG_CHUNK ? len : AFALG_CHUNK;
+    r = send(fd, buf, n, n < len ? MSG_MORE : 0);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    buf += r;
+    len -= r;
+  }
+  do {
+    r = len ? -1 : read(fd, digest, digest_size[hash_alg]);
+  } while (r < 0 && !len && errno == EINTR);
+
+  AfalgPut(hash_alg, fd, r == digest_size[hash_alg]);
+  return r != digest_size[hash_alg];
+}
+#else
+static int AfalgDigestBuf(const uint8_t* buf, uint64_t len, int hash_alg,
+                          uint8_t* digest) {
+  return 1;
+}
+#endif  /* __linux__ */
+
+const CryptoProvider afalg_provider = {
+  "afalg",
+  AfalgDigestBuf,
+  NULL,
+};
+
+int CryptoProviderSelect(const char* name) {
+  if (!strcmp(name, "cryptolib"))
+    crypto_provider = NULL;
+#ifndef FUTIL_VERIFY_ONLY
+  else if (!strcmp(name, libcrypto_provider.name))
+    crypto_provider = &libcrypto_provider;
+#endif
+  else if (!strcmp(name, afalg_provider.name))
+    crypto_provider = &afalg_provider;
+  else
+    return 1;
+  return 0;
+}
+
+const char* CryptoProviderName(void) {
+  return crypto_provider ? crypto_provider->name : "cryptolib";
+}
@@ -9,6 +9,7 @@
 
 #include <openssl/pem.h>
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -53,6 +54,8 @@ VbPrivateKey* PrivateKeyReadPem(const char* filename, uint64_t algorithm) {
   }
   key->rsa_private_key = rsa_key;
   key->algorithm = algorithm;
+  key->signer = NULL;
+  key->signer_data = NULL;
 
   /* Return the key */
   return key;
@@ -62,87 +65,135 @@ VbPrivateKey* PrivateKeyReadPem(const char* filename, uint64_t algorithm) {
 void PrivateKeyFree(VbPrivateKey* key) {
   if (!key)
     return;
+  if (key->signer && key->signer->free)
+    key->signer->free(key);
   if (key->rsa_private_key)
     RSA_free(key->rsa_private_key);
   free(key);
 }
 
 
-/* Write a private key to a file in .vbprivk format. */
+/* Write a private key to a file in .vbprivk format. Like the readers below,
+ * this complains and returns nonzero instead of exiting, so one bad output
+ * doesn't end a batch. */
 int PrivateKeyWrite(const char* filename, const VbPrivateKey* key) {
   uint8_t *outbuf = 0;
-  int buflen;
+  int buflen, ok;
   FILE *f;
 
   buflen = i2d_RSAPrivateKey(key->rsa_private_key, &outbuf);
   if (buflen <= 0) {
-    VbExError("Unable to write private key buffer\n");
+    fprintf(stderr, "ERROR: Unable to write private key buffer\n");
     return 1;
   }
 
   f = fopen(filename, "wb");
   if (!f) {
-    VbExError("Unable to open file %s\n", filename);
+    fprintf(stderr, "ERROR: Unable to open file %s\n", filename);
     free(outbuf);
     return 1;
   }
 
-  if (1 != fwrite(&key->algorithm, sizeof(key->algorithm), 1, f)) {
-    VbExError("Unable to write to file %s\n", filename);
-    fclose(f);
-    free(outbuf);
-    unlink(filename);  /* Delete any partial file */
-  }
-
-  if (1 != fwrite(outbuf, buflen, 1, f)) {
-    VbExError("Unable to write to file %s\n", filename);
-    fclose(f);
+  ok = 1 == fwrite(&key->algorithm, sizeof(key->algorithm), 1, f) &&
+      1 == fwrite(outbuf, buflen, 1, f);
+  if (0 != fclose(f))
+    ok = 0;
+  if (!ok) {
+    fprintf(stderr, "ERROR: Unable to write to file %s\n", filename);
     unlink(filename);  /* Delete any partial file */
     free(outbuf);
+    return 1;
   }
 
-  fclose(f);
   free(outbuf);
   return 0;
 }
 
-VbPrivateKey* PrivateKeyRead(const char* filename) {
+/* These complain and return NULL rather than exit, as VbExError() would,
+ * because a bad key file is just one failed request to a server or a
+ * batch. */
+VbPrivateKey* PrivateKeyReadBuf(const uint8_t* buf, uint64_t len) {
   VbPrivateKey *key;
-  uint64_t filelen = 0;
-  uint8_t *buffer;
   const unsigned char *start;
 
-  buffer = ReadFile(filename, &filelen);
-  if (!buffer) {
-    VbExError("unable to read from file %s\n", filename);
+  if (len < sizeof(key->algorithm)) {
+    fprintf(stderr, "ERROR: Private key is too small\n");
     return 0;
   }
 
   key = (VbPrivateKey*)malloc(sizeof(VbPrivateKey));
   if (!key) {
-    VbExError("Unable to allocate VbPrivateKey\n");
-    free(buffer);
+    fprintf(stderr, "ERROR: Unable to allocate VbPrivateKey\n");
     return 0;
   }
 
-  key->algorithm = *(typeof(key->algorithm) *)buffer;
-  start = buffer + sizeof(key->algorithm);
+  key->algorithm = *(typeof(key->algorithm) *)buf;
+  key->signer = NULL;
+  key->signer_data = NULL;
+  start = buf + sizeof(key->algorithm);
 
   key->rsa_private_key = d2i_RSAPrivateKey(0, &start,
-                                           filelen - sizeof(key->algorithm));
+                                           len - sizeof(key->algorithm));
 
   if (!key->rsa_private_key) {
-    VbExError("Unable to parse RSA private key\n");
-    free(buffer);
+    fprintf(stderr, "ERROR: Unable to parse RSA private key\n");
     free(key);
     return 0;
   }
 
+  return key;
+}
+
+
+VbPrivateKey* PrivateKeyRead(const char* filename) {
+  VbPrivateKey *key;
+  uint64_t filelen = 0;
+  uint8_t *buffer;
+
+  buffer = ReadFile(filename, &filelen);
+  if (!buffer) {
+    fprintf(stderr, "ERROR: unable to read from file %s\n", filename);
+    return 0;
+  }
+
+  key = PrivateKeyReadBuf(buffer, filelen);
   free(buffer);
   return key;
 }
 
 
+/* Sign a throwaway block with [arg], a VbPrivateKey. */
+static void* PrivateKeyWarm(void* arg) {
+  const VbPrivateKey* key = (const VbPrivateKey*)arg;
+  const uint8_t in[1] = {0};
+  uint8_t* out;
+
+  out = (uint8_t*)malloc(RSA_size(key->rsa_private_key));
+  if (out) {
+    RSA_private_encrypt(sizeof(in), in, out, key->rsa_private_key,
+                        RSA_PKCS1_PADDING);
+    free(out);
+  }
+  return NULL;
+}
+
+
+void PrivateKeyPrepare(VbPrivateKey* key) {
+  pthread_t thread;
+
+  if (!key || !key->rsa_private_key)
+    return;
+
+  /* OpenSSL sets up the Montgomery contexts for n, p and q, and the
+   * blinding for the calling thread, on the first private key operation.
+   * The blinding that every other thread shares is set up on the first
+   * one from another thread. */
+  PrivateKeyWarm(key);
+  if (!pthread_create(&thread, NULL, PrivateKeyWarm, key))
+    pthread_join(thread, NULL);
+}
+
+
 /* Allocate a new public key with space for a [key_size] byte key. */
 VbPublicKey* PublicKeyAlloc(uint64_t key_size, uint64_t algorithm,
                             uint64_t version) {
@@ -12,24 +12,26 @@
 #include "vboot_common.h"
 
 
-VbKeyBlockHeader* KeyBlockCreate(const VbPublicKey* data_key,
-                                 const VbPrivateKey* signing_key,
-                                 uint64_t flags) {
+uint64_t KeyBlockSize(const VbPublicKey* data_key,
+                      const VbPrivateKey* signing_key) {
+  return (sizeof(VbKeyBlockHeader) + data_key->key_size + SHA512_DIGEST_SIZE +
+          (signing_key ? siglen_map[signing_key->algorithm] : 0));
+}
+
+int KeyBlockCreateInto(const VbPublicKey* data_key,
+                       const VbPrivateKey* signing_key,
+                       uint64_t flags,
+                       VbKeyBlockHeader* h,
+                       uint64_t dest_size) {
 
-  VbKeyBlockHeader* h;
   uint64_t signed_size = sizeof(VbKeyBlockHeader) + data_key->key_size;
-  uint64_t block_size = (signed_size + SHA512_DIGEST_SIZE +
-                         (signing_key ?
-                          siglen_map[signing_key->algorithm] : 0));
+  uint64_t block_size = KeyBlockSize(data_key, signing_key);
   uint8_t* data_key_dest;
   uint8_t* block_sig_dest;
   uint8_t* block_chk_dest;
-  VbSignature *sigtmp;
 
-  /* Allocate key block */
-  h = (VbKeyBlockHeader*)malloc(block_size);
-  if (!h)
-    return NULL;
+  if (block_size > dest_size)
+    return 1;
   data_key_dest = (uint8_t*)(h + 1);
   block_chk_dest = data_key_dest + data_key->key_size;
   block_sig_dest = block_chk_dest + SHA512_DIGEST_SIZE;
@@ -54,21 +56,47 @@ VbKeyBlockHeader* KeyBlockCreate(const VbPublicKey* data_key,
     Memset(&h->key_block_signature, 0, sizeof(VbSignature));
 
   /* Calculate checksum */
-  sigtmp = CalculateChecksum((uint8_t*)h, signed_size);
-  SignatureCopy(&h->key_block_checksum, sigtmp);
-  free(sigtmp);
+  DigestBufInto((uint8_t*)h, signed_size, SHA512_DIGEST_ALGORITHM,
+                block_chk_dest);
 
   /* Calculate signature */
-  if (signing_key) {
-    sigtmp = CalculateSignature((uint8_t*)h, signed_size, signing_key);
-    SignatureCopy(&h->key_block_signature, sigtmp);
-    free(sigtmp);
+  if (signing_key &&
+      CalculateSignatureInto((uint8_t*)h, signed_size, signing_key,
+                             &h->key_block_signature))
+    return 1;
+
+  return 0;
+}
+
+VbKeyBlockHeader* KeyBlockCreateScratch(const VbPublicKey* data_key,
+                                        const VbPrivateKey* signing_key,
+                                        uint64_t flags,
+                                        VbScratch* scratch) {
+
+  VbKeyBlockHeader* h;
+  uint64_t block_size = KeyBlockSize(data_key, signing_key);
+
+  /* Allocate key block */
+  h = (VbKeyBlockHeader*)ScratchAlloc(scratch, block_size);
+  if (!h)
+    return NULL;
+
+  if (KeyBlockCreateInto(data_key, signing_key, flags, h, block_size)) {
+    if (!scratch)
+      free(h);
+    return NULL;
   }
 
   /* Return the header */
   return h;
 }
 
+VbKeyBlockHeader* KeyBlockCreate(const VbPublicKey* data_key,
+                                 const VbPrivateKey* signing_key,
+                                 uint64_t flags) {
+  return KeyBlockCreateScratch(data_key, signing_key, flags, NULL);
+}
+
 /* TODO(gauravsh): This could easily be integrated into KeyBlockCreate()
  * since the code is almost a mirror - I have kept it as such to avoid changing
  * the existing interface. */
@@ -122,6 +150,10 @@ VbKeyBlockHeader* KeyBlockCreate_external(const VbPublicKey* data_key,
   sigtmp = CalculateSignature_external((uint8_t*)h, signed_size,
                                        signing_key_pem_file, algorithm,
                                        external_signer);
+  if (!sigtmp) {
+    free(h);
+    return NULL;
+  }
   SignatureCopy(&h->key_block_signature, sigtmp);
   free(sigtmp);
 
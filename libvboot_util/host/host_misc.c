@@ -7,6 +7,9 @@
 
 /* TODO: change all 'return 0', 'return 1' into meaningful return codes */
 
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -59,17 +62,296 @@ uint8_t* ReadFile(const char* filename, uint64_t* sizeptr) {
 }
 
 
-char* ReadFileString(char* dest, int size, const char* filename) {
-  char* got;
+/* Size of each read done by DigestFileRegion(). Two are in use at once. */
+#define DIGEST_REGION_CHUNK (1 << 20)
+
+typedef struct DigestRegionBuf {
+  uint8_t* data;
+  ssize_t len;  /* Bytes read, or negative on error */
+  int full;
+} DigestRegionBuf;
+
+typedef struct DigestRegionReader {
+  int fd;
+  uint64_t offset;
+  uint64_t len;
+  DigestRegionBuf buf[2];
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} DigestRegionReader;
+
+ssize_t PreadFull(int fd, void* buf, size_t len, uint64_t offset) {
+  uint8_t* p = buf;
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len) {
+    n = pread(fd, p + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+/* Reader thread: fill each buffer in turn as soon as it has been hashed. */
+static void* DigestRegionReadAhead(void* arg) {
+  DigestRegionReader* r = arg;
+  uint64_t pos;
+  size_t want;
+  ssize_t got;
+  int i = 0;
+
+  for (pos = 0; pos < r->len; pos += want, i ^= 1) {
+    DigestRegionBuf* b = &r->buf[i];
+
+    want = r->len - pos;
+    if (want > DIGEST_REGION_CHUNK)
+      want = DIGEST_REGION_CHUNK;
+    pthread_mutex_lock(&r->lock);
+    while (b->full && !r->stop)
+      pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+    if (r->stop)
+      break;
+
+    got = PreadFull(r->fd, b->data, want, r->offset + pos);
+
+    pthread_mutex_lock(&r->lock);
+    b->len = got;
+    b->full = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    if (got != want)
+      break;
+  }
+  return NULL;
+}
+
+int DigestFileRegion(DigestContext* ctx, int fd, uint64_t offset,
+                     uint64_t len, DigestRegionObserver observe, void* arg) {
+  DigestRegionReader r;
+  pthread_t thread;
+  int threaded;
+  uint64_t pos;
+  size_t want;
+  ssize_t got;
+  int i = 0;
+  int rv = 0;
+
+  memset(&r, 0, sizeof(r));
+  r.fd = fd;
+  r.offset = offset;
+  r.len = len;
+  r.buf[0].data = malloc(DIGEST_REGION_CHUNK);
+  r.buf[1].data = malloc(DIGEST_REGION_CHUNK);
+  if (!r.buf[0].data || !r.buf[1].data) {
+    free(r.buf[0].data);
+    free(r.buf[1].data);
+    return 1;
+  }
+  pthread_mutex_init(&r.lock, NULL);
+  pthread_cond_init(&r.cond, NULL);
+
+  /* Without a reader thread, just read and hash in turn */
+  threaded = len > DIGEST_REGION_CHUNK &&
+      !pthread_create(&thread, NULL, DigestRegionReadAhead, &r);
+
+  for (pos = 0; pos < len; pos += want, i ^= threaded) {
+    DigestRegionBuf* b = &r.buf[i];
+
+    want = len - pos;
+    if (want > DIGEST_REGION_CHUNK)
+      want = DIGEST_REGION_CHUNK;
+    if (threaded) {
+      pthread_mutex_lock(&r.lock);
+      while (!b->full)
+        pthread_cond_wait(&r.cond, &r.lock);
+      got = b->len;
+      pthread_mutex_unlock(&r.lock);
+    } else {
+      got = PreadFull(fd, b->data, want, offset + pos);
+    }
+    if (got != want) {
+      VBDEBUG(("DigestFileRegion() can't read at offset %" PRIu64 "\n",
+               offset + pos));
+      rv = 1;
+      break;
+    }
+
+    DigestUpdate(ctx, b->data, want);
+    if (observe)
+      observe(arg, pos, b->data, want);
+
+    if (threaded) {
+      pthread_mutex_lock(&r.lock);
+      b->full = 0;
+      pthread_cond_broadcast(&r.cond);
+      pthread_mutex_unlock(&r.lock);
+    }
+  }
+
+  if (threaded) {
+    pthread_mutex_lock(&r.lock);
+    r.stop = 1;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.lock);
+    pthread_join(thread, NULL);
+  }
+  pthread_cond_destroy(&r.cond);
+  pthread_mutex_destroy(&r.lock);
+  free(r.buf[0].data);
+  free(r.buf[1].data);
+  return rv;
+}
+
+
+struct VbScratchOverflow {
+  VbScratchOverflow* next;
+  uint64_t pad;  /* Keep the data after this 16-byte aligned */
+};
+
+#define SCRATCH_ALIGN 16
+
+void ScratchInit(VbScratch* scratch, void* buf, uint64_t size) {
+  uint64_t skip = (SCRATCH_ALIGN - ((uintptr_t)buf & (SCRATCH_ALIGN - 1))) &
+      (SCRATCH_ALIGN - 1);
+
+  scratch->buf = (uint8_t*)buf + (skip < size ? skip : size);
+  scratch->size = skip < size ? size - skip : 0;
+  scratch->used = 0;
+  scratch->overflow = NULL;
+}
+
+void* ScratchAlloc(VbScratch* scratch, uint64_t size) {
+  uint64_t rounded = (size + SCRATCH_ALIGN - 1) &
+      ~(uint64_t)(SCRATCH_ALIGN - 1);
+  VbScratchOverflow* o;
+  void* p;
+
+  if (!scratch)
+    return malloc(size);
+
+  if (rounded >= size && rounded <= scratch->size - scratch->used) {
+    p = scratch->buf + scratch->used;
+    scratch->used += rounded;
+    return p;
+  }
+
+  o = (VbScratchOverflow*)malloc(sizeof(*o) + size);
+  if (!o)
+    return NULL;
+  o->next = scratch->overflow;
+  scratch->overflow = o;
+  return o + 1;
+}
+
+void ScratchReset(VbScratch* scratch) {
+  VbScratchOverflow* o;
+
+  if (!scratch)
+    return;
+
+  while ((o = scratch->overflow)) {
+    scratch->overflow = o->next;
+    free(o);
+  }
+  scratch->used = 0;
+}
+
+
+/* The first lines of the files ReadFileString() has read, while caching */
+typedef struct FileCacheEntry {
+  struct FileCacheEntry* next;
+  char* filename;
+  char* line;     /* NULL if the file couldn't be read */
+} FileCacheEntry;
+
+static FileCacheEntry* file_cache;
+static int file_cache_on;  /* How many ReadFileCacheBegin()s are open */
+
+void ReadFileCacheBegin(void) {
+  file_cache_on++;
+}
+
+
+void ReadFileCacheEnd(void) {
+  FileCacheEntry* e;
+
+  if (file_cache_on > 1) {
+    file_cache_on--;
+    return;
+  }
+  while ((e = file_cache)) {
+    file_cache = e->next;
+    free(e->filename);
+    free(e->line);
+    free(e);
+  }
+  file_cache_on = 0;
+}
+
+
+/* The first line of [filename], all of it, which the caller must free(), or
+ * NULL if error. */
+static char* ReadFirstLine(const char* filename) {
+  char* line = NULL;
+  size_t n = 0;
   FILE* f;
 
   f = fopen(filename, "rt");
   if (!f)
     return NULL;
-
-  got = fgets(dest, size, f);
+  if (getline(&line, &n, f) < 0) {
+    free(line);
+    line = NULL;
+  }
   fclose(f);
-  return got;
+  return line;
+}
+
+
+char* ReadFileString(char* dest, int size, const char* filename) {
+  FileCacheEntry* e;
+  char* got;
+  FILE* f;
+
+  if (!file_cache_on) {
+    f = fopen(filename, "rt");
+    if (!f)
+      return NULL;
+
+    got = fgets(dest, size, f);
+    fclose(f);
+    return got;
+  }
+
+  for (e = file_cache; e; e = e->next)
+    if (!strcmp(e->filename, filename))
+      break;
+  if (!e) {
+    e = (FileCacheEntry*)calloc(1, sizeof(*e));
+    if (!e)
+      return NULL;
+    e->filename = strdup(filename);
+    if (!e->filename) {
+      free(e);
+      return NULL;
+    }
+    e->line = ReadFirstLine(filename);
+    e->next = file_cache;
+    file_cache = e;
+  }
+
+  /* Just what fgets() would have made of it */
+  if (!e->line || size < 1)
+    return NULL;
+  return StrCopy(dest, e->line, size);
 }
 
 
@@ -9,8 +9,11 @@
 
 #include <openssl/rsa.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -19,6 +22,7 @@
 #include "file_keys.h"
 #include "host_common.h"
 #include "vboot_common.h"
+#include "vboot_probe.h"
 
 
 VbSignature* SignatureAlloc(uint64_t sig_size, uint64_t data_size) {
@@ -53,167 +57,266 @@ int SignatureCopy(VbSignature* dest, const VbSignature* src) {
 
 VbSignature* CalculateChecksum(const uint8_t* data, uint64_t size) {
 
-  uint8_t* header_checksum;
   VbSignature* sig;
 
-  header_checksum = DigestBuf(data, size, SHA512_DIGEST_ALGORITHM);
-  if (!header_checksum)
-    return NULL;
-
   sig = SignatureAlloc(SHA512_DIGEST_SIZE, 0);
-  if (!sig) {
-    VbExFree(header_checksum);
+  if (!sig)
     return NULL;
-  }
   sig->sig_offset = sizeof(VbSignature);
   sig->sig_size = SHA512_DIGEST_SIZE;
   sig->data_size = size;
 
   /* Signature data immediately follows the header */
-  Memcpy(GetSignatureData(sig), header_checksum, SHA512_DIGEST_SIZE);
-  VbExFree(header_checksum);
+  DigestBufInto(data, size, SHA512_DIGEST_ALGORITHM, GetSignatureData(sig));
   return sig;
 }
 
 VbSignature* CalculateHash(const uint8_t* data, uint64_t size,
                            const VbPrivateKey* key) {
-  uint8_t* digest = NULL;
+  uint8_t digest[SHA512_DIGEST_SIZE];
   int digest_size = hash_size_map[key->algorithm];
   VbSignature* sig = NULL;
 
   /* Calculate the digest */
-  digest = DigestBuf(data, size, key->algorithm);
-  if (!digest)
-    return NULL;
+  DigestBufInto(data, size, key->algorithm, digest);
 
   /* Allocate output signature */
   sig = SignatureAlloc(digest_size, size);
-  if (!sig) {
-    free(digest);
+  if (!sig)
     return NULL;
-  }
 
   /* The digest itself is the signature data */
   Memcpy(GetSignatureData(sig), digest, digest_size);
-  free(digest);
 
   /* Return the signature */
   return sig;
 }
 
-VbSignature* CalculateSignature(const uint8_t* data, uint64_t size,
-                                const VbPrivateKey* key) {
+static int OpenSSLSignerSubmit(const VbPrivateKey* key, const uint8_t* in,
+                               uint32_t in_len, uint8_t* out,
+                               uint32_t out_len, void** pending) {
+  int rv;
+
+  if (!key->rsa_private_key ||
+      (uint32_t)RSA_size(key->rsa_private_key) > out_len)
+    return 1;
+
+  /* Sign the signature_digest into our output buffer */
+  rv = RSA_private_encrypt(in_len,                 /* Input length */
+                           in,                     /* Input data */
+                           out,                    /* Output sig */
+                           key->rsa_private_key,   /* Key to use */
+                           RSA_PKCS1_PADDING);     /* Padding to use */
+  if (-1 == rv) {
+    VBDEBUG(("SignatureBuf(): RSA_private_encrypt() failed.\n"));
+    return 1;
+  }
+  return 0;
+}
+
+const VbSignerOps kVbSignerOpenSSL = {
+  "openssl",
+  OpenSSLSignerSubmit,
+  NULL,
+  NULL,
+};
+
+static const VbSignerOps* GetSigner(const VbPrivateKey* key) {
+  return key->signer ? key->signer : &kVbSignerOpenSSL;
+}
+
+/* Start signing [digest] with [key] into the [out_len] bytes at [out]. */
+static int SubmitDigest(const uint8_t* digest, const VbPrivateKey* key,
+                        uint8_t* out, uint32_t out_len, void** pending) {
 
-  uint8_t* digest;
   int digest_size = hash_size_map[key->algorithm];
 
   const uint8_t* digestinfo = hash_digestinfo_map[key->algorithm];
   int digestinfo_size = digestinfo_size_map[key->algorithm];
 
-  uint8_t* signature_digest;
+  /* Big enough for the longest digest info plus a SHA-512 digest */
+  uint8_t signature_digest[64 + SHA512_DIGEST_SIZE];
   int signature_digest_len = digest_size + digestinfo_size;
 
-  VbSignature* sig;
-  int rv;
+  *pending = NULL;
 
-  /* Calculate the digest */
-  /* TODO: rename param 3 of DigestBuf to hash_type */
-  digest = DigestBuf(data, size, hash_type_map[key->algorithm]);
-  if (!digest)
-    return NULL;
+  if (signature_digest_len > (int)sizeof(signature_digest))
+    return 1;
 
   /* Prepend the digest info to the digest */
-  signature_digest = malloc(signature_digest_len);
-  if (!signature_digest) {
-    VbExFree(digest);
-    return NULL;
-  }
   Memcpy(signature_digest, digestinfo, digestinfo_size);
   Memcpy(signature_digest + digestinfo_size, digest, digest_size);
-  VbExFree(digest);
+
+  /* Hand the signature_digest to the backend */
+  CRYPTO_STATS_ADD(rsa_sign, 1);
+  VB_PROBE2(sign_entry, key->algorithm, signature_digest_len);
+  if (0 != GetSigner(key)->submit(key, signature_digest, signature_digest_len,
+                                  out, out_len, pending)) {
+    VBDEBUG(("%s(): %s signer failed.\n", __FUNCTION__,
+             GetSigner(key)->name));
+    VB_PROBE1(sign_return, 1);
+    return 1;
+  }
+  return 0;
+}
+
+/* Wait for a request started by SubmitDigest() to finish. */
+static int CompleteDigest(const VbPrivateKey* key, void* pending) {
+  const VbSignerOps* signer = GetSigner(key);
+
+  if (signer->complete && 0 != signer->complete(key, pending)) {
+    VBDEBUG(("%s(): %s signer failed.\n", __FUNCTION__, signer->name));
+    VB_PROBE1(sign_return, 1);
+    return 1;
+  }
+  VB_PROBE1(sign_return, 0);
+  return 0;
+}
+
+int SignatureSubmit(const uint8_t* digest, uint64_t size,
+                    const VbPrivateKey* key, VbSignRequest* req) {
+  req->key = key;
+  req->pending = NULL;
 
   /* Allocate output signature */
-  sig = SignatureAlloc(siglen_map[key->algorithm], size);
-  if (!sig) {
-    free(signature_digest);
-    return NULL;
+  req->sig = SignatureAlloc(siglen_map[key->algorithm], size);
+  if (!req->sig)
+    return 1;
+
+  if (0 != SubmitDigest(digest, key, GetSignatureData(req->sig),
+                        siglen_map[key->algorithm], &req->pending)) {
+    free(req->sig);
+    req->sig = NULL;
+    return 1;
   }
+  return 0;
+}
 
-  /* Sign the signature_digest into our output buffer */
-  rv = RSA_private_encrypt(signature_digest_len,   /* Input length */
-                           signature_digest,       /* Input data */
-                           GetSignatureData(sig),  /* Output sig */
-                           key->rsa_private_key,   /* Key to use */
-                           RSA_PKCS1_PADDING);     /* Padding to use */
-  free(signature_digest);
+VbSignature* SignatureComplete(VbSignRequest* req) {
+  VbSignature* sig = req->sig;
 
-  if (-1 == rv) {
-    VBDEBUG(("SignatureBuf(): RSA_private_encrypt() failed.\n"));
+  req->sig = NULL;
+  if (0 != CompleteDigest(req->key, req->pending)) {
     free(sig);
     return NULL;
   }
+  return sig;
+}
 
-  /* Return the signature */
+int CalculateSignatureForDigestInto(const uint8_t* digest, uint64_t size,
+                                    const VbPrivateKey* key,
+                                    VbSignature* dest) {
+  uint32_t sig_size = siglen_map[key->algorithm];
+  void* pending;
+
+  if (dest->sig_size < sig_size)
+    return 1;
+
+  if (0 != SubmitDigest(digest, key, GetSignatureData(dest), sig_size,
+                        &pending) ||
+      0 != CompleteDigest(key, pending))
+    return 1;
+
+  dest->sig_size = sig_size;
+  dest->data_size = size;
+  return 0;
+}
+
+int CalculateSignatureInto(const uint8_t* data, uint64_t size,
+                           const VbPrivateKey* key, VbSignature* dest) {
+  uint8_t digest[SHA512_DIGEST_SIZE];
+
+  /* Calculate the digest */
+  DigestBufInto(data, size, hash_type_map[key->algorithm], digest);
+
+  return CalculateSignatureForDigestInto(digest, size, key, dest);
+}
+
+VbSignature* CalculateSignatureForDigestScratch(const uint8_t* digest,
+                                                uint64_t size,
+                                                const VbPrivateKey* key,
+                                                VbScratch* scratch) {
+  uint32_t sig_size = siglen_map[key->algorithm];
+  VbSignature* sig;
+
+  /* Signature data immediately follows the header */
+  sig = (VbSignature*)ScratchAlloc(scratch, sizeof(VbSignature) + sig_size);
+  if (!sig)
+    return NULL;
+  SignatureInit(sig, (uint8_t*)(sig + 1), sig_size, size);
+
+  if (0 != CalculateSignatureForDigestInto(digest, size, key, sig)) {
+    if (!scratch)
+      free(sig);
+    return NULL;
+  }
   return sig;
 }
 
-/* Invoke [external_signer] command with [pem_file] as
- * an argument, contents of [inbuf] passed redirected to stdin,
- * and the stdout of the command is put back into [outbuf].
+VbSignature* CalculateSignatureForDigest(const uint8_t* digest, uint64_t size,
+                                         const VbPrivateKey* key) {
+  return CalculateSignatureForDigestScratch(digest, size, key, NULL);
+}
+
+VbSignature* CalculateSignatureScratch(const uint8_t* data, uint64_t size,
+                                       const VbPrivateKey* key,
+                                       VbScratch* scratch) {
+
+  uint8_t digest[SHA512_DIGEST_SIZE];
+
+  /* Calculate the digest */
+  /* TODO: rename param 3 of DigestBuf to hash_type */
+  DigestBufInto(data, size, hash_type_map[key->algorithm], digest);
+
+  return CalculateSignatureForDigestScratch(digest, size, key, scratch);
+}
+
+VbSignature* CalculateSignature(const uint8_t* data, uint64_t size,
+                                const VbPrivateKey* key) {
+  return CalculateSignatureScratch(data, size, key, NULL);
+}
+
+/* Start [external_signer] as a co-process with [pem_file] as its first
+ * argument, followed by [mode] if that is not NULL.  On success, stores the
+ * child's pid in [*pid], the descriptor that feeds its stdin in [*to_fd] and
+ * the one its stdout can be read from in [*from_fd].
  * Returns -1 on error, 0 on success.
  */
-int InvokeExternalSigner(uint64_t size,
-                         const uint8_t* inbuf,
-                         uint8_t* outbuf,
-                         uint64_t outbufsize,
-                         const char* pem_file,
-                         const char* external_signer) {
+static int SpawnExternalSigner(const char* pem_file,
+                               const char* external_signer,
+                               const char* mode,
+                               pid_t* pid,
+                               int* to_fd,
+                               int* from_fd) {
 
-  int rv = 0, n;
   int p_to_c[2], c_to_p[2];  /* pipe descriptors */
-  pid_t pid;
 
-  VBDEBUG(("Will invoke \"%s %s\" to perform signing.\n"
+  VBDEBUG(("Will invoke \"%s %s%s%s\" to perform signing.\n"
            "Input to the signer will be provided on standard in.\n"
            "Output of the signer will be read from standard out.\n",
-           external_signer, pem_file));
+           external_signer, pem_file, mode ? " " : "", mode ? mode : ""));
 
   /* Need two pipes since we want to invoke the external_signer as
    * a co-process writing to its stdin and reading from its stdout. */
-  if (pipe(p_to_c) < 0 || pipe(c_to_p) < 0) {
+  if (pipe(p_to_c) < 0) {
+    VBDEBUG(("pipe() error\n"));
+    return -1;
+  }
+  if (pipe(c_to_p) < 0) {
     VBDEBUG(("pipe() error\n"));
+    close(p_to_c[0]);
+    close(p_to_c[1]);
     return -1;
   }
-  if ((pid = fork()) < 0) {
+  if ((*pid = fork()) < 0) {
     VBDEBUG(("fork() error"));
+    close(p_to_c[0]);
+    close(p_to_c[1]);
+    close(c_to_p[0]);
+    close(c_to_p[1]);
     return -1;
   }
-  else if (pid > 0) {  /* Parent. */
-    close(p_to_c[STDIN_FILENO]);
-    close(c_to_p[STDOUT_FILENO]);
-
-    /* We provide input to the child process (external signer). */
-    if (write(p_to_c[STDOUT_FILENO], inbuf, size) != size) {
-      VBDEBUG(("write() error while providing input to external signer\n"));
-      rv = -1;
-    } else {
-      close(p_to_c[STDOUT_FILENO]);  /* Send EOF to child (signer process). */
-      do {
-        n = read(c_to_p[STDIN_FILENO], outbuf, outbufsize);
-        outbuf += n;
-        outbufsize -= n;
-      } while (n > 0 && outbufsize);
-
-      if (n < 0) {
-        VBDEBUG(("read() error while reading output from external signer\n"));
-        rv = -1;
-      }
-    }
-    if (waitpid(pid, NULL, 0) < 0) {
-      VBDEBUG(("waitpid() error\n"));
-      rv = -1;
-    }
-  } else {  /* Child. */
+  else if (*pid == 0) {  /* Child. */
     close (p_to_c[STDOUT_FILENO]);
     close (c_to_p[STDIN_FILENO]);
     /* Map the stdin to the first pipe (this pipe gets input
@@ -221,84 +324,433 @@ int InvokeExternalSigner(uint64_t size,
     if (STDIN_FILENO != p_to_c[STDIN_FILENO]) {
       if (dup2(p_to_c[STDIN_FILENO], STDIN_FILENO) != STDIN_FILENO) {
         VBDEBUG(("stdin dup2() failed (external signer)\n"));
-        close(p_to_c[0]);
-        return -1;
+        _exit(1);
       }
+      close(p_to_c[STDIN_FILENO]);
     }
     /* Map the stdout to the second pipe (this pipe sends back
      * signer output to the parent) */
     if (STDOUT_FILENO != c_to_p[STDOUT_FILENO]) {
       if (dup2(c_to_p[STDOUT_FILENO], STDOUT_FILENO) != STDOUT_FILENO) {
         VBDEBUG(("stdout dup2() failed (external signer)\n"));
-        close(c_to_p[STDOUT_FILENO]);
-        return -1;
+        _exit(1);
       }
+      close(c_to_p[STDOUT_FILENO]);
     }
     /* External signer is invoked here. */
-    if (execl(external_signer, external_signer, pem_file, (char *) 0) < 0) {
-      VBDEBUG(("execl() of external signer failed\n"));
+    execl(external_signer, external_signer, pem_file, mode, (char *) 0);
+    VBDEBUG(("execl() of external signer failed\n"));
+    _exit(1);
+  }
+
+  /* Parent. */
+  close(p_to_c[STDIN_FILENO]);
+  close(c_to_p[STDOUT_FILENO]);
+  *to_fd = p_to_c[STDOUT_FILENO];
+  *from_fd = c_to_p[STDIN_FILENO];
+  /* Keep later signers from holding this one's stdin open */
+  fcntl(*to_fd, F_SETFD, FD_CLOEXEC);
+  fcntl(*from_fd, F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+/* Start [external_signer] with [pem_file] as an argument and feed it the
+ * contents of [inbuf] on its stdin.  On success, stores the child's pid in
+ * [*pid] and the descriptor its stdout can be read from in [*fd].
+ * Returns -1 on error, 0 on success.
+ */
+static int StartExternalSigner(uint64_t size,
+                               const uint8_t* inbuf,
+                               const char* pem_file,
+                               const char* external_signer,
+                               pid_t* pid,
+                               int* fd) {
+  int to_fd;
+
+  if (0 != SpawnExternalSigner(pem_file, external_signer, NULL,
+                               pid, &to_fd, fd))
+    return -1;
+
+  /* We provide input to the child process (external signer). */
+  if (write(to_fd, inbuf, size) != size) {
+    VBDEBUG(("write() error while providing input to external signer\n"));
+    close(to_fd);
+    close(*fd);
+    waitpid(*pid, NULL, 0);
+    return -1;
+  }
+  close(to_fd);  /* Send EOF to child (signer process). */
+  return 0;
+}
+
+/* Collect up to [outbufsize] bytes of output from an external signer
+ * started by StartExternalSigner() into [outbuf], and reap it.
+ * Returns -1 on error, 0 on success.
+ */
+static int FinishExternalSigner(pid_t pid, int fd,
+                                uint8_t* outbuf, uint64_t outbufsize) {
+  int rv = 0;
+  ssize_t n;
+
+  do {
+    n = read(fd, outbuf, outbufsize);
+    if (n > 0) {
+      outbuf += n;
+      outbufsize -= n;
     }
+  } while (n > 0 && outbufsize);
+
+  if (n < 0) {
+    VBDEBUG(("read() error while reading output from external signer\n"));
+    rv = -1;
+  }
+  close(fd);
+
+  if (waitpid(pid, NULL, 0) < 0) {
+    VBDEBUG(("waitpid() error\n"));
+    rv = -1;
   }
   return rv;
 }
 
-/* TODO(gauravsh): This could easily be integrated into CalculateSignature()
- * since the code is almost a mirror - I have kept it as such to avoid changing
- * the existing interface. */
-VbSignature* CalculateSignature_external(const uint8_t* data, uint64_t size,
-                                         const char* key_file,
-                                         uint64_t key_algorithm,
-                                         const char* external_signer) {
-  uint8_t* digest;
-  uint64_t digest_size = hash_size_map[key_algorithm];
+/* Invoke [external_signer] command with [pem_file] as
+ * an argument, contents of [inbuf] passed redirected to stdin,
+ * and the stdout of the command is put back into [outbuf].
+ * Returns -1 on error, 0 on success.
+ */
+int InvokeExternalSigner(uint64_t size,
+                         const uint8_t* inbuf,
+                         uint8_t* outbuf,
+                         uint64_t outbufsize,
+                         const char* pem_file,
+                         const char* external_signer) {
+  pid_t pid;
+  int fd;
 
-  const uint8_t* digestinfo = hash_digestinfo_map[key_algorithm];
-  uint64_t digestinfo_size = digestinfo_size_map[key_algorithm];
+  if (0 != StartExternalSigner(size, inbuf, pem_file, external_signer,
+                               &pid, &fd))
+    return -1;
+  return FinishExternalSigner(pid, fd, outbuf, outbufsize);
+}
 
-  uint8_t* signature_digest;
-  uint64_t signature_digest_len = digest_size + digestinfo_size;
+/* Per-key data for the external signer backend */
+typedef struct ExternalSignerKey {
+  const char* pem_file;
+  const char* external_signer;
+} ExternalSignerKey;
 
-  VbSignature* sig;
+/* A signer process that has been fed its input but not yet reaped */
+typedef struct ExternalSignerJob {
+  pid_t pid;
+  int fd;
+  uint8_t* out;
+  uint32_t out_len;
+} ExternalSignerJob;
+
+static int ExternalSignerSubmit(const VbPrivateKey* key, const uint8_t* in,
+                                uint32_t in_len, uint8_t* out,
+                                uint32_t out_len, void** pending) {
+  const ExternalSignerKey* ext = (const ExternalSignerKey*)key->signer_data;
+  ExternalSignerJob* job;
+
+  job = (ExternalSignerJob*)malloc(sizeof(ExternalSignerJob));
+  if (!job)
+    return 1;
+  VB_PROBE1(external_signer_entry, key->algorithm);
+  if (0 != StartExternalSigner(in_len, in, ext->pem_file,
+                               ext->external_signer, &job->pid, &job->fd)) {
+    VB_PROBE1(external_signer_return, -1);
+    free(job);
+    return 1;
+  }
+  job->out = out;
+  job->out_len = out_len;
+  *pending = job;
+  return 0;
+}
+
+static int ExternalSignerComplete(const VbPrivateKey* key, void* pending) {
+  ExternalSignerJob* job = (ExternalSignerJob*)pending;
   int rv;
 
-  /* Calculate the digest */
-  /* TODO: rename param 3 of DigestBuf to hash_type */
-  digest = DigestBuf(data, size, hash_type_map[key_algorithm]);
-  if (!digest)
-    return NULL;
+  rv = FinishExternalSigner(job->pid, job->fd, job->out, job->out_len);
+  VB_PROBE1(external_signer_return, rv);
+  free(job);
+  return rv ? 1 : 0;
+}
 
-  /* Prepend the digest info to the digest */
-  signature_digest = malloc(signature_digest_len);
-  if (!signature_digest) {
-    free(digest);
+static void ExternalSignerFree(VbPrivateKey* key) {
+  ExternalSignerKey* ext = (ExternalSignerKey*)key->signer_data;
+
+  if (!ext)
+    return;
+  free((char*)ext->pem_file);
+  free((char*)ext->external_signer);
+  free(ext);
+  key->signer_data = NULL;
+}
+
+static const VbSignerOps kVbSignerExternal = {
+  "external",
+  ExternalSignerSubmit,
+  ExternalSignerComplete,
+  ExternalSignerFree,
+};
+
+VbPrivateKey* PrivateKeyExternal(const char* pem_file, uint64_t algorithm,
+                                 const char* external_signer) {
+  VbPrivateKey* key;
+  ExternalSignerKey* ext;
+
+  if (algorithm >= kNumAlgorithms) {
+    VBDEBUG(("%s() called with invalid algorithm!\n", __FUNCTION__));
     return NULL;
   }
-  Memcpy(signature_digest, digestinfo, digestinfo_size);
-  Memcpy(signature_digest + digestinfo_size, digest, digest_size);
-  free(digest);
 
-  /* Allocate output signature */
-  sig = SignatureAlloc(siglen_map[key_algorithm], size);
-  if (!sig) {
-    free(signature_digest);
+  key = (VbPrivateKey*)malloc(sizeof(VbPrivateKey));
+  ext = (ExternalSignerKey*)malloc(sizeof(ExternalSignerKey));
+  if (!key || !ext) {
+    free(key);
+    free(ext);
     return NULL;
   }
+  ext->pem_file = strdup(pem_file);
+  ext->external_signer = strdup(external_signer);
+
+  key->rsa_private_key = NULL;
+  key->algorithm = algorithm;
+  key->signer = &kVbSignerExternal;
+  key->signer_data = ext;
+  if (!ext->pem_file || !ext->external_signer) {
+    PrivateKeyFree(key);
+    return NULL;
+  }
+  return key;
+}
 
-  /* Sign the signature_digest into our output buffer */
-  rv = InvokeExternalSigner(signature_digest_len, /* Input length */
-                            signature_digest,     /* Input data */
-                            GetSignatureData(sig), /* Output sig */
-                            siglen_map[key_algorithm], /* Max Output sig size */
-                            key_file,             /* Key file to use */
-                            external_signer);     /* External cmd to invoke */
-  free(signature_digest);
+/* Write all [len] bytes of [buf] to [fd].  Returns 0 on success. */
+static int WriteAll(int fd, const uint8_t* buf, uint64_t len) {
+  ssize_t n;
+
+  while (len) {
+    n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
 
-  if (-1 == rv) {
-    VBDEBUG(("SignatureBuf(): RSA_private_encrypt() failed.\n"));
-    free(sig);
+/* Read exactly [len] bytes from [fd] into [buf].  Returns 0 on success. */
+static int ReadAll(int fd, uint8_t* buf, uint64_t len) {
+  ssize_t n;
+
+  while (len) {
+    n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* A request sent to a persistent signer whose reply hasn't been read yet */
+typedef struct PersistentSignerJob {
+  struct PersistentSignerJob* next;
+  uint8_t* out;
+  uint32_t out_len;
+  int done;
+  int status;
+} PersistentSignerJob;
+
+/* Per-key data for the persistent external signer backend.  Replies come
+ * back in the order the requests were sent, so outstanding jobs are kept
+ * in a FIFO and completing one reads every reply queued ahead of it. */
+typedef struct PersistentSigner {
+  pid_t pid;
+  int to_fd;
+  int from_fd;
+  int broken;
+  PersistentSignerJob* head;
+  PersistentSignerJob** tail;
+} PersistentSigner;
+
+static void PutBE32(uint8_t* buf, uint32_t val) {
+  buf[0] = (uint8_t)(val >> 24);
+  buf[1] = (uint8_t)(val >> 16);
+  buf[2] = (uint8_t)(val >> 8);
+  buf[3] = (uint8_t)val;
+}
+
+static uint32_t GetBE32(const uint8_t* buf) {
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+      ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+/* Read the next reply into the oldest outstanding job. */
+static void PersistentSignerReadReply(PersistentSigner* ps) {
+  PersistentSignerJob* job = ps->head;
+  uint8_t frame[4];
+  uint8_t junk[256];
+  uint32_t len;
+
+  ps->head = job->next;
+  if (!ps->head)
+    ps->tail = &ps->head;
+  job->done = 1;
+  job->status = 1;
+
+  if (ps->broken)
+    return;
+  if (0 != ReadAll(ps->from_fd, frame, sizeof(frame))) {
+    VBDEBUG(("read() error while reading output from external signer\n"));
+    ps->broken = 1;
+    return;
+  }
+  len = GetBE32(frame);
+  if (len == job->out_len) {
+    if (0 != ReadAll(ps->from_fd, job->out, len)) {
+      VBDEBUG(("short signature from external signer\n"));
+      ps->broken = 1;
+      return;
+    }
+    job->status = 0;
+    return;
+  }
+
+  /* Wrong size (zero means the signer failed); skip it to stay in step */
+  VBDEBUG(("external signer replied with %u bytes, expected %u\n",
+           len, job->out_len));
+  while (len) {
+    uint32_t chunk = len < sizeof(junk) ? len : sizeof(junk);
+    if (0 != ReadAll(ps->from_fd, junk, chunk)) {
+      ps->broken = 1;
+      return;
+    }
+    len -= chunk;
+  }
+}
+
+static int PersistentSignerSubmit(const VbPrivateKey* key, const uint8_t* in,
+                                  uint32_t in_len, uint8_t* out,
+                                  uint32_t out_len, void** pending) {
+  PersistentSigner* ps = (PersistentSigner*)key->signer_data;
+  PersistentSignerJob* job;
+  uint8_t frame[4];
+
+  if (ps->broken)
+    return 1;
+
+  job = (PersistentSignerJob*)malloc(sizeof(PersistentSignerJob));
+  if (!job)
+    return 1;
+
+  PutBE32(frame, in_len);
+  if (0 != WriteAll(ps->to_fd, frame, sizeof(frame)) ||
+      0 != WriteAll(ps->to_fd, in, in_len)) {
+    VBDEBUG(("write() error while providing input to external signer\n"));
+    ps->broken = 1;
+    free(job);
+    return 1;
+  }
+
+  job->next = NULL;
+  job->out = out;
+  job->out_len = out_len;
+  job->done = 0;
+  job->status = 1;
+  *ps->tail = job;
+  ps->tail = &job->next;
+  *pending = job;
+  return 0;
+}
+
+static int PersistentSignerComplete(const VbPrivateKey* key, void* pending) {
+  PersistentSigner* ps = (PersistentSigner*)key->signer_data;
+  PersistentSignerJob* job = (PersistentSignerJob*)pending;
+  int rv;
+
+  while (!job->done)
+    PersistentSignerReadReply(ps);
+  rv = job->status;
+  free(job);
+  return rv;
+}
+
+static void PersistentSignerFree(VbPrivateKey* key) {
+  PersistentSigner* ps = (PersistentSigner*)key->signer_data;
+
+  if (!ps)
+    return;
+  close(ps->to_fd);  /* EOF tells the signer to exit */
+  close(ps->from_fd);
+  if (waitpid(ps->pid, NULL, 0) < 0)
+    VBDEBUG(("waitpid() error\n"));
+  free(ps);
+  key->signer_data = NULL;
+}
+
+static const VbSignerOps kVbSignerPersistent = {
+  "persistent",
+  PersistentSignerSubmit,
+  PersistentSignerComplete,
+  PersistentSignerFree,
+};
+
+VbPrivateKey* PrivateKeyExternalPersistent(const char* pem_file,
+                                           uint64_t algorithm,
+                                           const char* external_signer) {
+  VbPrivateKey* key;
+  PersistentSigner* ps;
+
+  if (algorithm >= kNumAlgorithms) {
+    VBDEBUG(("%s() called with invalid algorithm!\n", __FUNCTION__));
     return NULL;
   }
 
-  /* Return the signature */
-  return sig;
+  key = (VbPrivateKey*)malloc(sizeof(VbPrivateKey));
+  ps = (PersistentSigner*)malloc(sizeof(PersistentSigner));
+  if (!key || !ps) {
+    free(key);
+    free(ps);
+    return NULL;
+  }
+  if (0 != SpawnExternalSigner(pem_file, external_signer, "--persistent",
+                               &ps->pid, &ps->to_fd, &ps->from_fd)) {
+    free(key);
+    free(ps);
+    return NULL;
+  }
+  ps->broken = 0;
+  ps->head = NULL;
+  ps->tail = &ps->head;
+
+  key->rsa_private_key = NULL;
+  key->algorithm = algorithm;
+  key->signer = &kVbSignerPersistent;
+  key->signer_data = ps;
+  return key;
+}
+
+VbSignature* CalculateSignature_external(const uint8_t* data, uint64_t size,
+                                         const char* key_file,
+                                         uint64_t key_algorithm,
+                                         const char* external_signer) {
+  ExternalSignerKey ext;
+  VbPrivateKey key;
+
+  ext.pem_file = key_file;
+  ext.external_signer = external_signer;
+  key.rsa_private_key = NULL;
+  key.algorithm = key_algorithm;
+  key.signer = &kVbSignerExternal;
+  key.signer_data = &ext;
+
+  return CalculateSignature(data, size, &key);
 }
@@ -0,0 +1,499 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * A signing backend that paces another one: each named key gets a token
+ * bucket and a window of outstanding requests, waiting requests are served
+ * in priority order, and a request for a signature that's already being
+ * produced waits for that one instead of asking again.  Signatures that
+ * have been produced can be remembered, so signing the same digest with the
+ * same key again costs nothing.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cryptolib.h"
+#include "host_common.h"
+
+
+typedef struct SchedShared SchedShared;
+
+/* A finished signature, kept for reuse */
+typedef struct SchedMemo {
+  uint32_t hash;
+  uint32_t in_len;
+  uint32_t out_len;
+  uint8_t* data;                /* [in_len] bytes in, then [out_len] out */
+} SchedMemo;
+
+/* The limits and state shared by every key with the same name */
+typedef struct SchedBucket {
+  struct SchedBucket* next;
+  char* name;
+  int refs;
+  VbSignSchedule sched;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  double tokens;
+  double last;                  /* when [tokens] was last brought up to date */
+  uint32_t inflight;
+  uint32_t waiting[VB_SIGN_PRIORITY_COUNT];
+  SchedShared* shared;          /* requests that others can share */
+  SchedMemo* memo;              /* [sched.memo] of them, oldest replaced */
+  uint32_t memo_next;
+  uint64_t memo_hits;
+  uint64_t requests;
+  uint64_t started;             /* requests that went to the real backend */
+  uint64_t shared_hits;
+} SchedBucket;
+
+/* One request to the real backend, and everyone waiting for its result */
+struct SchedShared {
+  SchedShared* next;
+  pthread_t thread;             /* whose request it is */
+  int refs;
+  int done;
+  int status;
+  uint32_t in_len;
+  uint32_t out_len;
+  uint8_t* result;              /* a copy, once it's done */
+  uint8_t in[1];                /* really [in_len] */
+};
+
+typedef struct SchedRequest {
+  const VbPrivateKey* key;
+  uint32_t hash;
+  SchedShared* shared;
+  int leader;                   /* we asked the real backend */
+  void* pending;                /* the real backend's */
+  uint8_t* out;
+  uint32_t out_len;
+} SchedRequest;
+
+typedef struct SchedKey {
+  const VbPrivateKey* inner;
+  SchedBucket* bucket;
+  int priority;
+} SchedKey;
+
+static SchedBucket* buckets;
+static pthread_mutex_t buckets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Requests this thread has submitted but not completed */
+static __thread int outstanding;
+
+/* FNV-1a */
+static uint32_t HashInput(const uint8_t* in, uint32_t len) {
+  uint32_t h = 2166136261u;
+
+  while (len--)
+    h = (h ^ *in++) * 16777619u;
+  return h;
+}
+
+/* Called with the lock held. */
+static const SchedMemo* FindMemo(SchedBucket* b, uint32_t hash,
+                                 const uint8_t* in, uint32_t in_len,
+                                 uint32_t out_len) {
+  const SchedMemo* m;
+  uint32_t i;
+
+  for (i = 0; i < b->sched.memo; i++) {
+    m = &b->memo[i];
+    if (m->data && m->hash == hash && m->in_len == in_len &&
+        m->out_len == out_len && !memcmp(m->data, in, in_len))
+      return m;
+  }
+  return NULL;
+}
+
+/* Called with the lock held. */
+static void AddMemo(SchedBucket* b, uint32_t hash, const uint8_t* in,
+                    uint32_t in_len, const uint8_t* out, uint32_t out_len) {
+  SchedMemo* m;
+  uint8_t* data;
+
+  if (!b->memo || FindMemo(b, hash, in, in_len, out_len))
+    return;
+  data = (uint8_t*)malloc(in_len + out_len);
+  if (!data)
+    return;
+  Memcpy(data, in, in_len);
+  Memcpy(data + in_len, out, out_len);
+
+  m = &b->memo[b->memo_next];
+  b->memo_next = (b->memo_next + 1) % b->sched.memo;
+  free(m->data);
+  m->hash = hash;
+  m->in_len = in_len;
+  m->out_len = out_len;
+  m->data = data;
+}
+
+static double Now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static SchedBucket* GetBucket(const char* name, const VbSignSchedule* sched) {
+  pthread_condattr_t attr;
+  SchedBucket* b;
+
+  pthread_mutex_lock(&buckets_lock);
+  for (b = buckets; b; b = b->next)
+    if (!strcmp(b->name, name))
+      break;
+
+  /* The latest limits apply, but what's remembered stays as it was */
+  if (b) {
+    pthread_mutex_lock(&b->lock);
+    b->sched.rate = sched->rate;
+    b->sched.burst = sched->burst < 1 ? 1 : sched->burst;
+    b->sched.window = sched->window;
+    if (b->tokens > b->sched.burst)
+      b->tokens = b->sched.burst;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+  } else {
+    b = (SchedBucket*)calloc(1, sizeof(*b));
+    if (b)
+      b->name = strdup(name);
+    if (b && !b->name) {
+      free(b);
+      b = NULL;
+    }
+    if (b) {
+      b->sched = *sched;
+      if (b->sched.burst < 1)
+        b->sched.burst = 1;
+      b->tokens = b->sched.burst;
+      b->last = Now();
+      pthread_mutex_init(&b->lock, NULL);
+      /* Refills are timed against the monotonic clock */
+      pthread_condattr_init(&attr);
+      pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+      pthread_cond_init(&b->cond, &attr);
+      pthread_condattr_destroy(&attr);
+      b->next = buckets;
+      buckets = b;
+    }
+  }
+  if (b && b->sched.memo && !b->memo) {
+    b->memo = (SchedMemo*)calloc(b->sched.memo, sizeof(*b->memo));
+    if (!b->memo)
+      b->sched.memo = 0;
+  }
+  if (b)
+    b->refs++;
+  pthread_mutex_unlock(&buckets_lock);
+  return b;
+}
+
+/* Buckets outlive their keys, so what they remember can be used by the
+ * next key with the same name.  PrivateKeyScheduledCleanup() frees them. */
+static void PutBucket(SchedBucket* bucket) {
+  pthread_mutex_lock(&buckets_lock);
+  bucket->refs--;
+  pthread_mutex_unlock(&buckets_lock);
+}
+
+void PrivateKeyScheduledCleanup(void) {
+  SchedBucket** p = &buckets;
+  SchedBucket* b;
+  uint32_t i;
+
+  pthread_mutex_lock(&buckets_lock);
+  while ((b = *p)) {
+    if (b->refs) {
+      p = &b->next;
+      continue;
+    }
+    *p = b->next;
+    VBDEBUG(("%s: %" PRIu64 " signatures reused\n", b->name, b->memo_hits));
+    for (i = 0; i < b->sched.memo; i++)
+      free(b->memo[i].data);
+    free(b->memo);
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+    free(b->name);
+    free(b);
+  }
+  pthread_mutex_unlock(&buckets_lock);
+}
+
+void PrivateKeyScheduledStats(void (*report)(void* arg, const char* name,
+                                             const VbSignScheduleStats* stats),
+                              void* arg) {
+  VbSignScheduleStats stats;
+  SchedBucket* b;
+  int i;
+
+  pthread_mutex_lock(&buckets_lock);
+  for (b = buckets; b; b = b->next) {
+    pthread_mutex_lock(&b->lock);
+    stats.requests = b->requests;
+    stats.started = b->started;
+    stats.shared = b->shared_hits;
+    stats.remembered = b->memo_hits;
+    stats.inflight = b->inflight;
+    stats.waiting = 0;
+    for (i = 0; i < VB_SIGN_PRIORITY_COUNT; i++)
+      stats.waiting += b->waiting[i];
+    pthread_mutex_unlock(&b->lock);
+    report(arg, b->name, &stats);
+  }
+  pthread_mutex_unlock(&buckets_lock);
+}
+
+/* Waits for a token and a place in the window.  Called with the lock held. */
+static void Acquire(SchedBucket* b, int priority) {
+  const VbSignSchedule* s = &b->sched;
+  struct timespec ts;
+  double now, wait;
+  int i, ahead;
+
+  b->waiting[priority]++;
+  for (;;) {
+    now = Now();
+    if (s->rate > 0) {
+      b->tokens += (now - b->last) * s->rate;
+      if (b->tokens > s->burst)
+        b->tokens = s->burst;
+    }
+    b->last = now;
+
+    for (ahead = 0, i = 0; i < priority; i++)
+      ahead += b->waiting[i];
+
+    /* One thread can't fill the window and then wait for itself */
+    if (ahead || (s->window && b->inflight >= s->window && !outstanding)) {
+      pthread_cond_wait(&b->cond, &b->lock);
+      continue;
+    }
+    if (s->rate > 0 && b->tokens < 1) {
+      wait = now + (1 - b->tokens) / s->rate;
+      ts.tv_sec = (time_t)wait;
+      ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+      pthread_cond_timedwait(&b->cond, &b->lock, &ts);
+      continue;
+    }
+    break;
+  }
+  b->waiting[priority]--;
+  if (s->rate > 0)
+    b->tokens -= 1;
+  b->inflight++;
+
+  /* Whoever's next may be able to go too */
+  pthread_cond_broadcast(&b->cond);
+}
+
+static void Release(SchedBucket* b) {
+  pthread_mutex_lock(&b->lock);
+  b->inflight--;
+  pthread_cond_broadcast(&b->cond);
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* Drops a reference to [sh], which must no longer be on the bucket's list.
+ * Called with the lock held. */
+static void PutShared(SchedShared* sh) {
+  if (--sh->refs)
+    return;
+  free(sh->result);
+  free(sh);
+}
+
+static int SchedSubmit(const VbPrivateKey* key, const uint8_t* in,
+                       uint32_t in_len, uint8_t* out, uint32_t out_len,
+                       void** pending) {
+  SchedKey* sk = (SchedKey*)key->signer_data;
+  SchedBucket* b = sk->bucket;
+  const VbSignerOps* ops = sk->inner->signer ? sk->inner->signer :
+      &kVbSignerOpenSSL;
+  uint32_t hash = HashInput(in, in_len);
+  const SchedMemo* m;
+  SchedRequest* req;
+  SchedShared* sh;
+
+  req = (SchedRequest*)calloc(1, sizeof(*req));
+  if (!req)
+    return 1;
+  req->key = key;
+  req->hash = hash;
+  req->out = out;
+  req->out_len = out_len;
+
+  pthread_mutex_lock(&b->lock);
+  b->requests++;
+
+  /* Signed it before?  Then there's nothing to wait for. */
+  m = FindMemo(b, hash, in, in_len, out_len);
+  if (m) {
+    Memcpy(out, m->data + in_len, out_len);
+    b->memo_hits++;
+    pthread_mutex_unlock(&b->lock);
+    *pending = req;
+    return 0;
+  }
+
+  /* Signatures are deterministic, so the same input means the same output.
+   * We don't wait on another request while we have one of our own
+   * outstanding, so no two threads can end up waiting on each other. */
+  if (!outstanding) {
+    for (sh = b->shared; sh; sh = sh->next)
+      if (!pthread_equal(sh->thread, pthread_self()) &&
+          sh->in_len == in_len && sh->out_len == out_len &&
+          !memcmp(sh->in, in, in_len))
+        break;
+    if (sh) {
+      sh->refs++;
+      b->shared_hits++;
+      req->shared = sh;
+      pthread_mutex_unlock(&b->lock);
+      *pending = req;
+      return 0;
+    }
+  }
+
+  Acquire(b, sk->priority);
+  b->started++;
+  pthread_mutex_unlock(&b->lock);
+
+  req->leader = 1;
+  if (0 != ops->submit(sk->inner, in, in_len, out, out_len, &req->pending)) {
+    Release(b);
+    free(req);
+    return 1;
+  }
+
+  /* Let others share it, now that it's on its way */
+  sh = (SchedShared*)calloc(1, sizeof(*sh) + in_len);
+  if (sh) {
+    sh->thread = pthread_self();
+    sh->refs = 1;
+    sh->in_len = in_len;
+    sh->out_len = out_len;
+    memcpy(sh->in, in, in_len);
+    pthread_mutex_lock(&b->lock);
+    sh->next = b->shared;
+    b->shared = sh;
+    pthread_mutex_unlock(&b->lock);
+    req->shared = sh;
+  }
+
+  outstanding++;
+  *pending = req;
+  return 0;
+}
+
+static int SchedComplete(const VbPrivateKey* key, void* pending) {
+  SchedKey* sk = (SchedKey*)key->signer_data;
+  SchedBucket* b = sk->bucket;
+  const VbSignerOps* ops = sk->inner->signer ? sk->inner->signer :
+      &kVbSignerOpenSSL;
+  SchedRequest* req = (SchedRequest*)pending;
+  SchedShared* sh = req->shared;
+  SchedShared** p;
+  int status = 0;
+
+  if (!req->leader && !sh) {
+    /* It was remembered */
+    free(req);
+    return 0;
+  }
+
+  if (!req->leader) {
+    pthread_mutex_lock(&b->lock);
+    while (!sh->done)
+      pthread_cond_wait(&b->cond, &b->lock);
+    status = sh->status;
+    if (!status)
+      Memcpy(req->out, sh->result, req->out_len);
+    PutShared(sh);
+    pthread_mutex_unlock(&b->lock);
+    free(req);
+    return status;
+  }
+
+  if (ops->complete)
+    status = ops->complete(sk->inner, req->pending);
+  outstanding--;
+
+  pthread_mutex_lock(&b->lock);
+  b->inflight--;
+  if (sh) {
+    for (p = &b->shared; *p != sh; p = &(*p)->next)
+      ;
+    *p = sh->next;
+    /* Nobody else needs a copy if nobody else is waiting */
+    sh->status = status;
+    if (!status && sh->refs > 1) {
+      sh->result = (uint8_t*)malloc(req->out_len);
+      if (sh->result)
+        Memcpy(sh->result, req->out, req->out_len);
+      else
+        sh->status = 1;
+    }
+    if (!status)
+      AddMemo(b, req->hash, sh->in, sh->in_len, req->out, req->out_len);
+    sh->done = 1;
+    PutShared(sh);
+  }
+  pthread_cond_broadcast(&b->cond);
+  pthread_mutex_unlock(&b->lock);
+
+  free(req);
+  return status;
+}
+
+static void SchedFree(VbPrivateKey* key) {
+  SchedKey* sk = (SchedKey*)key->signer_data;
+
+  PutBucket(sk->bucket);
+  free(sk);
+}
+
+static const VbSignerOps kVbSignerSched = {
+  "sched",
+  SchedSubmit,
+  SchedComplete,
+  SchedFree,
+};
+
+VbPrivateKey* PrivateKeyScheduled(const VbPrivateKey* key, const char* name,
+                                  const VbSignSchedule* sched, int priority) {
+  VbPrivateKey* wrapper;
+  SchedKey* sk;
+
+  if (priority < 0 || priority >= VB_SIGN_PRIORITY_COUNT)
+    return NULL;
+
+  wrapper = (VbPrivateKey*)calloc(1, sizeof(*wrapper));
+  sk = (SchedKey*)calloc(1, sizeof(*sk));
+  if (!wrapper || !sk) {
+    free(wrapper);
+    free(sk);
+    return NULL;
+  }
+
+  sk->inner = key;
+  sk->priority = priority;
+  sk->bucket = GetBucket(name, sched);
+  if (!sk->bucket) {
+    free(wrapper);
+    free(sk);
+    return NULL;
+  }
+
+  wrapper->algorithm = key->algorithm;
+  wrapper->signer = &kVbSignerSched;
+  wrapper->signer_data = sk;
+  return wrapper;
+}
@@ -0,0 +1,334 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * A signing backend that splits signing in two, for a signer that's far
+ * away: first the DigestInfo-prefixed digests are collected and written to
+ * a request file, to be signed wherever the private keys are, then the
+ * same signing is done again with the signed file, taking each signature
+ * from it instead of asking a signer.
+ *
+ * Some signatures cover others (a preamble holds its body's signature), so
+ * their digests can't be known until those have come back.  While
+ * collecting, a request made by a thread straight after one it was given a
+ * placeholder for is taken to depend on it, and left for the next round
+ * rather than asked for in vain.  That's only a guess, but guessing wrong
+ * costs no more than a wasted signature or another round.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cryptolib.h"
+#include "host_common.h"
+
+
+#define SPLIT_HASH_SIZE 1024
+
+/* The longest line we'll read: a name, and the request and signature */
+#define SPLIT_LINE_MAX 4096
+
+typedef struct SplitEntry {
+  struct SplitEntry* hash_next;
+  struct SplitEntry* next;      /* in the order they were asked for */
+  char* name;
+  uint64_t algorithm;
+  uint32_t in_len;
+  uint32_t out_len;             /* zero until it's been signed */
+  int used;                     /* asked for this time */
+  uint8_t* data;                /* [in_len] bytes in, then [out_len] out */
+} SplitEntry;
+
+struct VbSplitSigning {
+  pthread_mutex_t lock;
+  int collect;                  /* collect what's missing, don't fail */
+  SplitEntry* hash[SPLIT_HASH_SIZE];
+  SplitEntry* first;
+  SplitEntry** last;
+};
+
+/* This thread's last request got a placeholder */
+static __thread int after_placeholder;
+
+typedef struct SplitKey {
+  VbSplitSigning* ss;
+  char name[1];                 /* really as long as it is */
+} SplitKey;
+
+static uint32_t SplitHash(const char* name, uint64_t algorithm,
+                          const uint8_t* in, uint32_t in_len) {
+  uint32_t h = 2166136261U ^ (uint32_t)algorithm;
+
+  while (*name)
+    h = (h ^ (uint8_t)*name++) * 16777619U;
+  while (in_len--)
+    h = (h ^ *in++) * 16777619U;
+  return h % SPLIT_HASH_SIZE;
+}
+
+static SplitEntry* SplitFind(VbSplitSigning* ss, const char* name,
+                             uint64_t algorithm, const uint8_t* in,
+                             uint32_t in_len) {
+  SplitEntry* e = ss->hash[SplitHash(name, algorithm, in, in_len)];
+
+  for (; e; e = e->hash_next)
+    if (e->algorithm == algorithm && e->in_len == in_len &&
+        !memcmp(e->data, in, in_len) && !strcmp(e->name, name))
+      return e;
+  return NULL;
+}
+
+static SplitEntry* SplitAdd(VbSplitSigning* ss, const char* name,
+                            uint64_t algorithm, const uint8_t* in,
+                            uint32_t in_len, const uint8_t* out,
+                            uint32_t out_len) {
+  SplitEntry* e = (SplitEntry*)calloc(1, sizeof(*e));
+  uint32_t h = SplitHash(name, algorithm, in, in_len);
+
+  if (!e)
+    return NULL;
+  e->name = strdup(name);
+  e->data = (uint8_t*)malloc(in_len + out_len);
+  if (!e->name || !e->data) {
+    free(e->name);
+    free(e->data);
+    free(e);
+    return NULL;
+  }
+  e->algorithm = algorithm;
+  e->in_len = in_len;
+  e->out_len = out_len;
+  memcpy(e->data, in, in_len);
+  if (out_len)
+    memcpy(e->data + in_len, out, out_len);
+
+  e->hash_next = ss->hash[h];
+  ss->hash[h] = e;
+  *ss->last = e;
+  ss->last = &e->next;
+  return e;
+}
+
+static int SplitSubmit(const VbPrivateKey* key, const uint8_t* in,
+                       uint32_t in_len, uint8_t* out, uint32_t out_len,
+                       void** pending) {
+  SplitKey* sk = (SplitKey*)key->signer_data;
+  VbSplitSigning* ss = sk->ss;
+  SplitEntry* e;
+  int rv = 0;
+
+  *pending = NULL;
+
+  pthread_mutex_lock(&ss->lock);
+  e = SplitFind(ss, sk->name, key->algorithm, in, in_len);
+  if (e && e->out_len == out_len) {
+    memcpy(out, e->data + in_len, out_len);
+    e->used = 1;
+    after_placeholder = 0;
+  } else if (!ss->collect) {
+    VBDEBUG(("%s(): no signature by %s\n", __FUNCTION__, sk->name));
+    rv = 1;
+  } else {
+    /* Whatever gets built with this is only thrown away */
+    memset(out, 0, out_len);
+    if (after_placeholder) {
+      after_placeholder = 0;
+    } else {
+      if (!e)
+        e = SplitAdd(ss, sk->name, key->algorithm, in, in_len, NULL, 0);
+      if (e)
+        e->used = 1;
+      else
+        rv = 1;
+      after_placeholder = 1;
+    }
+  }
+  pthread_mutex_unlock(&ss->lock);
+
+  return rv;
+}
+
+static void SplitKeyFree(VbPrivateKey* key) {
+  free(key->signer_data);
+}
+
+static const VbSignerOps kVbSignerSplit = {
+  "split",
+  SplitSubmit,
+  NULL,
+  SplitKeyFree,
+};
+
+VbSplitSigning* SplitSigningNew(int collect) {
+  VbSplitSigning* ss = (VbSplitSigning*)calloc(1, sizeof(*ss));
+
+  if (!ss)
+    return NULL;
+  pthread_mutex_init(&ss->lock, NULL);
+  ss->collect = collect;
+  ss->last = &ss->first;
+  return ss;
+}
+
+void SplitSigningFree(VbSplitSigning* ss) {
+  SplitEntry *e, *next;
+
+  if (!ss)
+    return;
+  for (e = ss->first; e; e = next) {
+    next = e->next;
+    free(e->name);
+    free(e->data);
+    free(e);
+  }
+  pthread_mutex_destroy(&ss->lock);
+  free(ss);
+}
+
+VbPrivateKey* PrivateKeySplit(VbSplitSigning* ss, const char* name,
+                              uint64_t algorithm) {
+  VbPrivateKey* key;
+  SplitKey* sk;
+  const char* p;
+
+  /* The name is a word in the request file */
+  for (p = name; *p; p++)
+    if (isspace((unsigned char)*p) || *p == '#')
+      return NULL;
+  if (!*name || algorithm >= kNumAlgorithms)
+    return NULL;
+
+  key = (VbPrivateKey*)calloc(1, sizeof(*key));
+  sk = (SplitKey*)calloc(1, sizeof(*sk) + strlen(name));
+  if (!key || !sk) {
+    free(key);
+    free(sk);
+    return NULL;
+  }
+
+  sk->ss = ss;
+  strcpy(sk->name, name);
+  key->algorithm = algorithm;
+  key->signer = &kVbSignerSplit;
+  key->signer_data = sk;
+  return key;
+}
+
+static void PutHex(FILE* fp, const uint8_t* data, uint32_t len) {
+  while (len--)
+    fprintf(fp, "%02x", *data++);
+}
+
+/* Decode the hex word [s] into [buf], which holds [max] bytes.  Returns the
+ * number of bytes, or -1 if it isn't hex or won't fit. */
+static int GetHex(const char* s, uint8_t* buf, int max) {
+  int n = 0;
+  unsigned int b;
+
+  for (; s[0] && s[1]; s += 2) {
+    if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]) ||
+        n == max || 1 != sscanf(s, "%2x", &b))
+      return -1;
+    buf[n++] = b;
+  }
+  return *s ? -1 : n;
+}
+
+int SplitSigningWriteRequests(VbSplitSigning* ss, const char* filename,
+                              uint32_t* missing) {
+  SplitEntry* e;
+  FILE* fp;
+  int rv = 0;
+
+  fp = fopen(filename, "w");
+  if (!fp) {
+    VBDEBUG(("%s(): can't open %s\n", __FUNCTION__, filename));
+    return 1;
+  }
+
+  pthread_mutex_lock(&ss->lock);
+  *missing = 0;
+  for (e = ss->first; e; e = e->next)
+    if (e->used && !e->out_len)
+      (*missing)++;
+  fprintf(fp, "# %u signature%s to make: add the signature of DIGESTINFO"
+          " by the key NAME\n# to the end of each line that has none,"
+          " in hex\n# NAME ALGORITHM DIGESTINFO [SIGNATURE]\n",
+          *missing, *missing == 1 ? "" : "s");
+  for (e = ss->first; e; e = e->next) {
+    if (!e->used)
+      continue;
+    fprintf(fp, "%s %u ", e->name, (unsigned)e->algorithm);
+    PutHex(fp, e->data, e->in_len);
+    if (e->out_len) {
+      fputc(' ', fp);
+      PutHex(fp, e->data + e->in_len, e->out_len);
+    }
+    fputc('\n', fp);
+  }
+  pthread_mutex_unlock(&ss->lock);
+
+  if (ferror(fp))
+    rv = 1;
+  if (fclose(fp))
+    rv = 1;
+  return rv;
+}
+
+int SplitSigningReadSignatures(VbSplitSigning* ss, const char* filename) {
+  char line[SPLIT_LINE_MAX];
+  uint8_t in[SPLIT_LINE_MAX / 2], out[SPLIT_LINE_MAX / 2];
+  char *name, *algo, *in_hex, *out_hex, *e;
+  unsigned long algorithm;
+  int in_len, out_len;
+  int lineno = 0;
+  FILE* fp;
+  int rv = 0;
+
+  fp = fopen(filename, "r");
+  if (!fp) {
+    VBDEBUG(("%s(): can't open %s\n", __FUNCTION__, filename));
+    return 1;
+  }
+
+  pthread_mutex_lock(&ss->lock);
+  while (!rv && fgets(line, sizeof(line), fp)) {
+    lineno++;
+    name = strtok(line, " \t\r\n");
+    if (!name || *name == '#')
+      continue;
+    algo = strtok(NULL, " \t\r\n");
+    in_hex = strtok(NULL, " \t\r\n");
+    out_hex = strtok(NULL, " \t\r\n");
+    if (!algo || !in_hex || strtok(NULL, " \t\r\n")) {
+      VBDEBUG(("%s:%d: not NAME ALGORITHM DIGESTINFO [SIGNATURE]\n",
+               filename, lineno));
+      rv = 1;
+      break;
+    }
+    /* Still waiting to be signed */
+    if (!out_hex)
+      continue;
+    algorithm = strtoul(algo, &e, 0);
+    in_len = GetHex(in_hex, in, sizeof(in));
+    out_len = GetHex(out_hex, out, sizeof(out));
+    if (*e || algorithm >= kNumAlgorithms || in_len <= 0 ||
+        out_len != siglen_map[algorithm]) {
+      VBDEBUG(("%s:%d: bad request or signature\n", filename, lineno));
+      rv = 1;
+      break;
+    }
+    if (!SplitFind(ss, name, algorithm, in, in_len) &&
+        !SplitAdd(ss, name, algorithm, in, in_len, out, out_len))
+      rv = 1;
+  }
+  pthread_mutex_unlock(&ss->lock);
+
+  if (ferror(fp))
+    rv = 1;
+  fclose(fp);
+  return rv;
+}
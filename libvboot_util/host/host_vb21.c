@@ -0,0 +1,317 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Host functions for the vboot 2.1 formats.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_common.h"
+#include "cryptolib.h"
+#include "host_signature.h"
+#include "host_vb21.h"
+#include "util_misc.h"
+#include "vb21_common.h"
+
+/* Everything in a vb21 object is a multiple of 4 bytes long */
+static uint32_t Align4(uint64_t size)
+{
+	return (size + 3) & ~3ULL;
+}
+
+static uint32_t DescSize(const char *desc)
+{
+	return desc && *desc ? Align4(strlen(desc) + 1) : 0;
+}
+
+/* Fill in the common header of [obj], and its description */
+static void CommonInit(void *obj, uint32_t magic, uint16_t major,
+		       uint16_t minor, uint32_t fixed_size, const char *desc,
+		       uint32_t total_size)
+{
+	struct vb21_struct_common *c = obj;
+
+	c->magic = magic;
+	c->struct_version_major = major;
+	c->struct_version_minor = minor;
+	c->total_size = total_size;
+	c->fixed_size = fixed_size;
+	c->desc_size = DescSize(desc);
+	if (c->desc_size)
+		strcpy((char *)obj + fixed_size, desc);
+}
+
+/* The size of a signature by a key with v1 [algorithm], or of a hash with it
+ * if [hash_only] */
+static uint32_t SignatureSize(uint64_t algorithm, int hash_only,
+			      const char *desc)
+{
+	return sizeof(struct vb21_signature) + DescSize(desc) +
+		(hash_only ? hash_size_map[algorithm] : siglen_map[algorithm]);
+}
+
+/* Build a hash-only signature of [data_size] bytes in [sig], which has room
+ * for it, and return where its digest goes */
+static uint8_t *HashInit(struct vb21_signature *sig, uint64_t algorithm,
+			 uint32_t data_size, const char *desc)
+{
+	uint16_t sig_alg, hash_alg;
+
+	memset(sig, 0, sizeof(*sig));
+	CommonInit(sig, VB21_MAGIC_SIGNATURE, VB21_SIGNATURE_VERSION_MAJOR,
+		   VB21_SIGNATURE_VERSION_MINOR, sizeof(*sig), desc,
+		   SignatureSize(algorithm, 1, desc));
+	sig->sig_offset = sizeof(*sig) + sig->c.desc_size;
+	sig->sig_size = hash_size_map[algorithm];
+	sig->data_size = data_size;
+	Vb21SplitAlgorithm(algorithm, &sig_alg, &hash_alg);
+	sig->sig_alg = VB2_SIG_NONE;
+	sig->hash_alg = hash_alg;
+	return (uint8_t *)sig + sig->sig_offset;
+}
+
+void Vb21KeyId(const uint8_t *key_data, uint64_t key_size, struct vb2_id *id)
+{
+	uint8_t digest[SHA512_DIGEST_SIZE];
+
+	DigestBufInto(key_data, key_size, SHA1_DIGEST_ALGORITHM, digest);
+	memcpy(id->raw, digest, sizeof(id->raw));
+}
+
+int Vb21PrivateKeyId(const VbPrivateKey *key, struct vb2_id *id)
+{
+	uint8_t *keyb_data;
+	uint32_t keyb_size;
+
+	memset(id, 0, sizeof(*id));
+	if (!key->rsa_private_key ||
+	    vb_keyb_from_rsa(key->rsa_private_key, &keyb_data, &keyb_size))
+		return 1;
+
+	Vb21KeyId(keyb_data, keyb_size, id);
+	free(keyb_data);
+	return 0;
+}
+
+struct vb21_packed_key *Vb21PackedKeyCreate(const VbPublicKey *key,
+					    const char *desc)
+{
+	struct vb21_packed_key *pkey;
+	uint32_t fixed_size = sizeof(*pkey);
+	uint32_t key_offset = fixed_size + DescSize(desc);
+	uint32_t total_size = key_offset + Align4(key->key_size);
+	uint16_t sig_alg, hash_alg;
+
+	if (Vb21SplitAlgorithm(key->algorithm, &sig_alg, &hash_alg))
+		return NULL;
+
+	pkey = calloc(1, total_size);
+	if (!pkey)
+		return NULL;
+
+	CommonInit(pkey, VB21_MAGIC_PACKED_KEY, VB21_PACKED_KEY_VERSION_MAJOR,
+		   VB21_PACKED_KEY_VERSION_MINOR, fixed_size, desc,
+		   total_size);
+	pkey->key_offset = key_offset;
+	pkey->key_size = key->key_size;
+	pkey->key_version = key->key_version;
+	pkey->sig_alg = sig_alg;
+	pkey->hash_alg = hash_alg;
+
+	memcpy((uint8_t *)pkey + key_offset, GetPublicKeyDataC(key),
+	       key->key_size);
+	Vb21KeyId(GetPublicKeyDataC(key), key->key_size, &pkey->id);
+	return pkey;
+}
+
+VbPublicKey *Vb21PackedKeyToV1(const struct vb21_packed_key *key)
+{
+	VbPublicKey *v1;
+	int algorithm = Vb21Algorithm(key->sig_alg, key->hash_alg);
+
+	if (algorithm < 0)
+		return NULL;
+
+	v1 = PublicKeyAlloc(key->key_size, algorithm, key->key_version);
+	if (!v1)
+		return NULL;
+
+	memcpy(GetPublicKeyData(v1), (const uint8_t *)key + key->key_offset,
+	       key->key_size);
+	return v1;
+}
+
+struct vb21_signature *Vb21SignatureCreate(const uint8_t *digest,
+					   uint32_t data_size,
+					   const VbPrivateKey *key,
+					   const struct vb2_id *id,
+					   const char *desc)
+{
+	struct vb21_signature *sig;
+	VbSignature *v1;
+	uint32_t total_size = SignatureSize(key->algorithm, 0, desc);
+	uint16_t sig_alg, hash_alg;
+
+	/* Signing goes through whatever backend the key has */
+	v1 = CalculateSignatureForDigest(digest, data_size, key);
+	if (!v1)
+		return NULL;
+
+	sig = calloc(1, total_size);
+	if (!sig) {
+		free(v1);
+		return NULL;
+	}
+
+	CommonInit(sig, VB21_MAGIC_SIGNATURE, VB21_SIGNATURE_VERSION_MAJOR,
+		   VB21_SIGNATURE_VERSION_MINOR, sizeof(*sig), desc,
+		   total_size);
+	sig->sig_offset = sizeof(*sig) + sig->c.desc_size;
+	sig->sig_size = v1->sig_size;
+	sig->data_size = data_size;
+	Vb21SplitAlgorithm(key->algorithm, &sig_alg, &hash_alg);
+	sig->sig_alg = sig_alg;
+	sig->hash_alg = hash_alg;
+	if (id)
+		sig->id = *id;
+	memcpy((uint8_t *)sig + sig->sig_offset, GetSignatureDataC(v1),
+	       v1->sig_size);
+
+	free(v1);
+	return sig;
+}
+
+struct vb21_keyblock *Vb21KeyblockCreate(
+    const struct vb21_packed_key *data_key,
+    const VbPrivateKey *signing_key,
+    const struct vb2_id *signing_id,
+    uint32_t flags, const char *desc)
+{
+	struct vb21_keyblock *kb;
+	struct vb21_signature *sig;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	uint32_t fixed_size = sizeof(*kb);
+	uint32_t key_offset = fixed_size + DescSize(desc);
+	uint32_t sig_offset = key_offset + data_key->c.total_size;
+	uint32_t chk_size = SignatureSize(SHA512_DIGEST_ALGORITHM, 1, NULL);
+	uint32_t total_size = sig_offset + chk_size;
+
+	if (signing_key)
+		total_size += SignatureSize(signing_key->algorithm, 0, NULL);
+
+	kb = calloc(1, total_size);
+	if (!kb)
+		return NULL;
+
+	/* The sizes are all known up front, since they're signed too */
+	CommonInit(kb, VB21_MAGIC_KEYBLOCK, VB21_KEYBLOCK_VERSION_MAJOR,
+		   VB21_KEYBLOCK_VERSION_MINOR, fixed_size, desc, total_size);
+	kb->flags = flags;
+	kb->key_offset = key_offset;
+	kb->sig_count = signing_key ? 2 : 1;
+	kb->sig_offset = sig_offset;
+	memcpy((uint8_t *)kb + key_offset, data_key, data_key->c.total_size);
+
+	/* A checksum, as a v1 keyblock has, then the real signature */
+	DigestBufInto((uint8_t *)kb, sig_offset, SHA512_DIGEST_ALGORITHM,
+		      HashInit((struct vb21_signature *)((uint8_t *)kb +
+							 sig_offset),
+			       SHA512_DIGEST_ALGORITHM, sig_offset, NULL));
+	if (!signing_key)
+		return kb;
+
+	DigestBufInto((uint8_t *)kb, sig_offset, signing_key->algorithm,
+		      digest);
+	sig = Vb21SignatureCreate(digest, sig_offset, signing_key,
+				  signing_id, NULL);
+	if (!sig) {
+		free(kb);
+		return NULL;
+	}
+	memcpy((uint8_t *)kb + sig_offset + chk_size, sig, sig->c.total_size);
+	free(sig);
+
+	return kb;
+}
+
+struct vb21_fw_preamble *Vb21FwPreambleCreate(const uint8_t *body,
+					      uint64_t body_size,
+					      uint32_t chunk_size,
+					      const VbPrivateKey *signing_key,
+					      const struct vb2_id *signing_id,
+					      uint32_t fw_version,
+					      uint32_t flags,
+					      const char *desc)
+{
+	struct vb21_fw_preamble *pre;
+	struct vb21_signature *sig;
+	const uint8_t **bufs = NULL;
+	uint64_t *lens = NULL;
+	uint8_t **digests = NULL;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	uint64_t algorithm = signing_key->algorithm;
+	uint32_t fixed_size = sizeof(*pre);
+	uint32_t hash_offset = fixed_size + DescSize(desc);
+	uint32_t hash_size = SignatureSize(algorithm, 1, NULL);
+	uint64_t count, sig_offset, total_size, i;
+
+	if (!chunk_size)
+		return NULL;
+	count = (body_size + chunk_size - 1) / chunk_size;
+	sig_offset = hash_offset + count * hash_size;
+	total_size = sig_offset + SignatureSize(algorithm, 0, NULL);
+	if (total_size > UINT32_MAX)
+		return NULL;
+
+	pre = calloc(1, total_size);
+	bufs = calloc(count + 1, sizeof(*bufs));
+	lens = calloc(count + 1, sizeof(*lens));
+	digests = calloc(count + 1, sizeof(*digests));
+	if (!pre || !bufs || !lens || !digests)
+		goto fail;
+
+	CommonInit(pre, VB21_MAGIC_FW_PREAMBLE, VB21_FW_PREAMBLE_VERSION_MAJOR,
+		   VB21_FW_PREAMBLE_VERSION_MINOR, fixed_size, desc,
+		   total_size);
+	pre->flags = flags;
+	pre->fw_version = fw_version;
+	pre->hash_count = count;
+	pre->hash_offset = hash_offset;
+	pre->sig_offset = sig_offset;
+
+	/* The pieces are hashed side by side, straight into their places */
+	for (i = 0; i < count; i++) {
+		bufs[i] = body + i * chunk_size;
+		lens[i] = body_size - i * chunk_size;
+		if (lens[i] > chunk_size)
+			lens[i] = chunk_size;
+		digests[i] = HashInit((struct vb21_signature *)
+				      ((uint8_t *)pre + hash_offset +
+				       i * hash_size),
+				      algorithm, lens[i], NULL);
+	}
+	if (count && DigestBufMulti(bufs, lens, count, algorithm, digests))
+		goto fail;
+
+	DigestBufInto((uint8_t *)pre, sig_offset, algorithm, digest);
+	sig = Vb21SignatureCreate(digest, sig_offset, signing_key, signing_id,
+				  NULL);
+	if (!sig)
+		goto fail;
+	memcpy((uint8_t *)pre + sig_offset, sig, sig->c.total_size);
+	free(sig);
+
+	free(bufs);
+	free(lens);
+	free(digests);
+	return pre;
+
+fail:
+	free(pre);
+	free(bufs);
+	free(lens);
+	free(digests);
+	return NULL;
+}
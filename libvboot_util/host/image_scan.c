@@ -0,0 +1,198 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fmap.h"
+#include "gbb_header.h"
+#include "image_scan.h"
+
+/* Both signatures start on a FMAP_SEARCH_STRIDE boundary */
+#define SCAN_STRIDE FMAP_SEARCH_STRIDE
+#define SCAN_BLOCK 64
+
+static int scan_add(size_t **list, int *count, size_t offset)
+{
+	size_t *p;
+
+	/* Grow at powers of two, starting from 4 */
+	if (*count >= 4 && !(*count & (*count - 1))) {
+		p = realloc(*list, 2 * *count * sizeof(**list));
+		if (!p)
+			return 1;
+		*list = p;
+	} else if (!*list) {
+		*list = malloc(4 * sizeof(**list));
+		if (!*list)
+			return 1;
+	}
+	(*list)[(*count)++] = offset;
+	return 0;
+}
+
+static uint32_t load32(const uint8_t *ptr)
+{
+	uint32_t w;
+
+	memcpy(&w, ptr, sizeof(w));
+	return w;
+}
+
+/* Look at each stride in [start, end) for the start of a signature */
+static int scan_words(ImageScan *scan, const uint8_t *ptr, size_t size,
+		      size_t start, size_t end)
+{
+	const uint32_t fmap_word = load32((const uint8_t *)FMAP_SIGNATURE);
+	const uint32_t gbb_word = load32((const uint8_t *)GBB_SIGNATURE);
+	size_t i;
+	uint32_t w;
+
+	for (i = start; i + SCAN_STRIDE <= end; i += SCAN_STRIDE) {
+		w = load32(ptr + i);
+		if (w == fmap_word) {
+			if (i + FMAP_SIGNATURE_SIZE <= size &&
+			    !memcmp(ptr + i, FMAP_SIGNATURE,
+				    FMAP_SIGNATURE_SIZE) &&
+			    scan_add(&scan->fmap, &scan->num_fmap, i))
+				return 1;
+		} else if (w == gbb_word) {
+			if (i + GBB_SIGNATURE_SIZE <= size &&
+			    !memcmp(ptr + i, GBB_SIGNATURE,
+				    GBB_SIGNATURE_SIZE) &&
+			    scan_add(&scan->gbb, &scan->num_gbb, i))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+ImageScan *image_scan(const uint8_t *ptr, size_t size)
+{
+	ImageScan *scan;
+	size_t i = 0;
+
+	scan = calloc(1, sizeof(*scan));
+	if (!scan)
+		return NULL;
+
+#if defined(__SSE2__)
+	{
+		const __m128i fmap_word =
+			_mm_set1_epi32(load32((const uint8_t *)FMAP_SIGNATURE));
+		const __m128i gbb_word =
+			_mm_set1_epi32(load32((const uint8_t *)GBB_SIGNATURE));
+
+		/*
+		 * Compare a block's words against both signatures at once,
+		 * and only look closer at blocks that have a hit.
+		 */
+		for (; i + SCAN_BLOCK <= size; i += SCAN_BLOCK) {
+			__m128i a, b, c, d, hit;
+
+			a = _mm_loadu_si128((const __m128i *)(ptr + i));
+			b = _mm_loadu_si128((const __m128i *)(ptr + i + 16));
+			c = _mm_loadu_si128((const __m128i *)(ptr + i + 32));
+			d = _mm_loadu_si128((const __m128i *)(ptr + i + 48));
+			hit = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi32(a, fmap_word),
+					     _mm_cmpeq_epi32(a, gbb_word)),
+				_mm_or_si128(_mm_cmpeq_epi32(b, fmap_word),
+					     _mm_cmpeq_epi32(b, gbb_word)));
+			hit = _mm_or_si128(hit,
+				_mm_or_si128(_mm_cmpeq_epi32(c, fmap_word),
+					     _mm_cmpeq_epi32(c, gbb_word)));
+			hit = _mm_or_si128(hit,
+				_mm_or_si128(_mm_cmpeq_epi32(d, fmap_word),
+					     _mm_cmpeq_epi32(d, gbb_word)));
+			if (_mm_movemask_epi8(hit) &&
+			    scan_words(scan, ptr, size, i, i + SCAN_BLOCK))
+				goto fail;
+		}
+	}
+#endif
+
+	if (scan_words(scan, ptr, size, i, size))
+		goto fail;
+	return scan;
+
+fail:
+	image_scan_free(scan);
+	return NULL;
+}
+
+enum image_fill image_fill(const uint8_t *ptr, size_t size)
+{
+	uint8_t all = 0xff, any = 0;
+	uint64_t w, all_w = ~0ULL, any_w = 0;
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	{
+		const __m128i ones = _mm_set1_epi8(-1);
+		const __m128i zero = _mm_setzero_si128();
+		__m128i all_v = ones, any_v = zero;
+		__m128i a, b, c, d;
+
+		/*
+		 * AND and OR the block together, 64 bytes at a time, and stop
+		 * as soon as it's neither all ones nor all zeros.
+		 */
+		for (; i + SCAN_BLOCK <= size; i += SCAN_BLOCK) {
+			a = _mm_loadu_si128((const __m128i *)(ptr + i));
+			b = _mm_loadu_si128((const __m128i *)(ptr + i + 16));
+			c = _mm_loadu_si128((const __m128i *)(ptr + i + 32));
+			d = _mm_loadu_si128((const __m128i *)(ptr + i + 48));
+			all_v = _mm_and_si128(all_v, _mm_and_si128(
+				_mm_and_si128(a, b), _mm_and_si128(c, d)));
+			any_v = _mm_or_si128(any_v, _mm_or_si128(
+				_mm_or_si128(a, b), _mm_or_si128(c, d)));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(all_v, ones))
+			    != 0xffff &&
+			    _mm_movemask_epi8(_mm_cmpeq_epi8(any_v, zero))
+			    != 0xffff)
+				return IMAGE_FILL_DATA;
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(all_v, ones)) != 0xffff)
+			all = 0;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any_v, zero)) != 0xffff)
+			any = 0xff;
+	}
+#endif
+
+	for (; i + sizeof(w) <= size; i += sizeof(w)) {
+		memcpy(&w, ptr + i, sizeof(w));
+		all_w &= w;
+		any_w |= w;
+	}
+	if (all_w != ~0ULL)
+		all = 0;
+	if (any_w)
+		any = 0xff;
+	for (; i < size; i++) {
+		all &= ptr[i];
+		any |= ptr[i];
+	}
+
+	if (all == 0xff)
+		return IMAGE_FILL_ERASED;
+	if (!any)
+		return IMAGE_FILL_ZERO;
+	return IMAGE_FILL_DATA;
+}
+
+void image_scan_free(ImageScan *scan)
+{
+	if (!scan)
+		return;
+	free(scan->fmap);
+	free(scan->gbb);
+	free(scan);
+}
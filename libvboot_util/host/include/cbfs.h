@@ -0,0 +1,68 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#ifndef __CBFS_H__
+#define __CBFS_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/* CBFS file headers, as coreboot lays them out. The fields are big-endian. */
+
+#define CBFS_FILE_MAGIC "LARCHIVE"
+#define CBFS_FILE_MAGIC_SIZE 8
+#define CBFS_ALIGNMENT 64
+
+typedef struct _CbfsFileHeader {
+  char     magic[CBFS_FILE_MAGIC_SIZE];
+  uint32_t len;				/* of the contents */
+  uint32_t type;
+  uint32_t attributes_offset;		/* from this header, or 0 */
+  uint32_t offset;			/* of the contents, from this header */
+  /* followed by the NUL-terminated file name */
+} __attribute__((packed)) CbfsFileHeader;
+
+/* Space that's free, rather than a file */
+#define CBFS_TYPE_DELETED  0x00000000
+#define CBFS_TYPE_DELETED2 0xffffffff
+
+/* A file found in a CBFS, with its fields in host order */
+typedef struct _CbfsEntry {
+	const char *name;		/* in the image */
+	uint32_t type;
+	uint64_t offset;		/* of the header, within the CBFS */
+	uint64_t data_offset;		/* of the contents, within the CBFS */
+	uint64_t len;
+} CbfsEntry;
+
+/*
+ * A parsed CBFS, such as an FMAP area. The headers are read once, after which
+ * files are found by name through a hash table, or walked in order.
+ */
+typedef struct _CbfsIndex {
+	uint8_t *base;			/* the CBFS */
+	size_t size;
+	CbfsEntry *entries;		/* in order of offset */
+	int nentries;
+	uint32_t hash_mask;		/* hash table has hash_mask + 1 slots */
+	int32_t *hash;			/* entry index, or -1 if empty */
+} CbfsIndex;
+
+/* Parse the CBFS in the buffer. Returns NULL if it has no files in it. */
+CbfsIndex *cbfs_index_create(uint8_t *ptr, size_t size);
+
+/* Free an index returned by cbfs_index_create() */
+void cbfs_index_free(CbfsIndex *idx);
+
+/* Return the (first) file with the given name, or NULL */
+const CbfsEntry *cbfs_index_find(const CbfsIndex *idx, const char *name);
+
+/* Return the n'th file in order of offset, or NULL */
+const CbfsEntry *cbfs_index_entry(const CbfsIndex *idx, int n);
+
+/* Return the name of a CBFS file type, or NULL if it isn't one we know */
+const char *cbfs_type_name(uint32_t type);
+
+#endif  /* __CBFS_H__ */
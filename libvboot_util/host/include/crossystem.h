@@ -32,6 +32,13 @@ int VbGetSystemPropertyInt(const char* name);
 const char* VbGetSystemPropertyString(const char* name, char* dest,
                                       size_t size);
 
+/* Return the name of the common (not architecture-specific) property at
+ * <index>, starting from 0, so that callers can list them all.  If <is_string>
+ * is not NULL, it's set to 1 for a string property or 0 for an integer one.
+ *
+ * Returns NULL once <index> is past the last property. */
+const char* VbGetSystemPropertyName(int index, int* is_string);
+
 /* Sets a system property integer.
  *
  * Returns 0 if success, -1 if error. */
@@ -45,6 +52,62 @@ int VbSetSystemPropertyInt(const char* name, int value);
  * Returns 0 if success, -1 if error. */
 int VbSetSystemPropertyString(const char* name, const char* value);
 
+/* Start a batch of property writes.  Until VbSetSystemPropertiesCommit()
+ * or VbSetSystemPropertiesAbort(), NV storage properties set with
+ * VbSetSystemPropertyInt() and VbSetSystemPropertyString() are applied to
+ * one copy of NV storage, read here, and reads see those writes.  Batches
+ * don't nest.
+ *
+ * Returns 0 if success, -1 if error. */
+int VbSetSystemPropertiesBegin(void);
+
+/* Finish a batch of property writes, storing NV storage once if any of
+ * them changed it.
+ *
+ * Returns 0 if success, -1 if error. */
+int VbSetSystemPropertiesCommit(void);
+
+/* Finish a batch of property writes, discarding its NV storage changes. */
+void VbSetSystemPropertiesAbort(void);
+
+/* Start a batch of property reads, such as listing them all.  Until
+ * VbGetSystemPropertiesEnd(), each sysfs, ACPI or /proc file behind the
+ * properties is read at most once, and properties that share a file are
+ * answered from that one read.  Values that change meanwhile (the current
+ * state of a switch, say) aren't seen until the batch ends, so keep batches
+ * short.  Batches may nest. */
+void VbGetSystemPropertiesBegin(void);
+
+/* Finish a batch of property reads, forgetting what was read. */
+void VbGetSystemPropertiesEnd(void);
+
+/* Where the property snapshot is kept by default.  It's on tmpfs, so it
+ * doesn't outlive the boot it describes. */
+#define VB_SNAPSHOT_PATH "/run/crossystem.snapshot"
+
+/* Read every common property and publish them in the snapshot file <path>
+ * (or VB_SNAPSHOT_PATH if NULL), creating it if need be.  Readers that have
+ * called VbSystemSnapshotOpen() see the new values at once.  Only whoever
+ * can read all the properties should do this, and only one process should
+ * do it regularly; a reader that hits a property missing from the snapshot
+ * just reads it the usual way.
+ *
+ * Returns 0 if success, -1 if error. */
+int VbSystemSnapshotRefresh(const char* path);
+
+/* Answer VbGetSystemPropertyInt() and VbGetSystemPropertyString() from the
+ * snapshot file <path> (or VB_SNAPSHOT_PATH if NULL) when it has the
+ * property, instead of reading NV storage, VbSharedData and the rest.  Reads
+ * take no locks; a read that overlaps a refresh is retried.  Setting any
+ * property marks the snapshot out of date until the next refresh, and
+ * until then properties are read the usual way.
+ *
+ * Returns 0 if success, -1 if there's no usable snapshot. */
+int VbSystemSnapshotOpen(const char* path);
+
+/* Stop using the snapshot. */
+void VbSystemSnapshotClose(void);
+
 #ifdef __cplusplus
 }
 #endif
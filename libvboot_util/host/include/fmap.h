@@ -46,4 +46,38 @@ uint8_t *fmap_find_by_name(uint8_t *ptr, size_t size,
 			   /* optional, return pointer to entry if not NULL */
 			   FmapAreaHeader **ah);
 
+/*
+ * A parsed FMAP, for callers that look up several areas in the same image.
+ * The FMAP is located once, names are found through a hash table, and the
+ * areas can also be walked in order of their offsets.
+ */
+typedef struct _FmapIndex {
+	uint8_t *base;			/* the image */
+	size_t size;
+	FmapHeader *fmap;		/* the FMAP within the image */
+	FmapAreaHeader *areas;		/* fmap->fmap_nareas of them */
+	int nareas;
+	uint32_t hash_mask;		/* hash table has hash_mask + 1 slots */
+	int32_t *hash;			/* area index, or -1 if empty */
+	uint16_t *by_offset;		/* area indices, sorted by offset */
+} FmapIndex;
+
+/* Parse the FMAP within the buffer. Returns NULL if there isn't one. */
+FmapIndex *fmap_index_create(uint8_t *ptr, size_t size);
+
+/*
+ * The same, but try [offset] first, where the FMAP was found last time.
+ * If there isn't one there, it's searched for as usual.
+ */
+FmapIndex *fmap_index_create_at(uint8_t *ptr, size_t size, size_t offset);
+
+/* Free an index returned by fmap_index_create() */
+void fmap_index_free(FmapIndex *idx);
+
+/* Return the (first) area with the given name, or NULL */
+FmapAreaHeader *fmap_index_find(const FmapIndex *idx, const char *name);
+
+/* Return the n'th area in order of offset, or NULL */
+FmapAreaHeader *fmap_index_by_offset(const FmapIndex *idx, int n);
+
 #endif  /* __FMAP_H__ */
@@ -56,4 +56,78 @@ VbKernelPreambleHeader *CreateKernelPreamble(
 	uint64_t desired_size,
 	const VbPrivateKey *signing_key);
 
+/**
+ * Like CreateFirmwarePreamble() and CreateKernelPreamble(), but the
+ * preamble is allocated from [scratch] (see ScratchAlloc()), so it must not
+ * be freed if [scratch] is not NULL.
+ */
+VbFirmwarePreambleHeader *CreateFirmwarePreambleScratch(
+	uint64_t firmware_version,
+	const VbPublicKey *kernel_subkey,
+	const VbSignature *body_signature,
+	const VbPrivateKey *signing_key,
+	uint32_t flags,
+	VbScratch *scratch);
+
+VbKernelPreambleHeader *CreateKernelPreambleScratch(
+	uint64_t kernel_version,
+	uint64_t body_load_address,
+	uint64_t bootloader_address,
+	uint64_t bootloader_size,
+	const VbSignature *body_signature,
+	uint64_t vmlinuz_header_address,
+	uint64_t vmlinuz_header_size,
+	uint32_t flags,
+	uint64_t desired_size,
+	const VbPrivateKey *signing_key,
+	VbScratch *scratch);
+
+/**
+ * The sizes of the preambles the functions above would create.
+ */
+uint64_t FirmwarePreambleSize(const VbPublicKey *kernel_subkey,
+			      const VbSignature *body_signature,
+			      const VbPrivateKey *signing_key);
+
+uint64_t KernelPreambleSize(const VbSignature *body_signature,
+			    uint64_t desired_size,
+			    const VbPrivateKey *signing_key);
+
+/**
+ * Like CreateFirmwarePreamble() and CreateKernelPreamble(), but the
+ * preamble is built in [dest], which has room for [dest_size] bytes (see
+ * FirmwarePreambleSize() and KernelPreambleSize()). Nothing is allocated.
+ * Bytes of [dest] past the preamble are left alone.
+ *
+ * Returns 0 if success, non-zero if error.
+ */
+int CreateFirmwarePreambleInto(
+	uint64_t firmware_version,
+	const VbPublicKey *kernel_subkey,
+	const VbSignature *body_signature,
+	const VbPrivateKey *signing_key,
+	uint32_t flags,
+	VbFirmwarePreambleHeader *dest,
+	uint64_t dest_size);
+
+int CreateKernelPreambleInto(
+	uint64_t kernel_version,
+	uint64_t body_load_address,
+	uint64_t bootloader_address,
+	uint64_t bootloader_size,
+	const VbSignature *body_signature,
+	uint64_t vmlinuz_header_address,
+	uint64_t vmlinuz_header_size,
+	uint32_t flags,
+	uint64_t desired_size,
+	const VbPrivateKey *signing_key,
+	VbKernelPreambleHeader *dest,
+	uint64_t dest_size);
+
+/**
+ * Name of a VbSharedDataTimestamp stage (VBSD_TS_*), such as "LK_GPT", or
+ * "unknown" if it isn't one.
+ */
+const char *VbSharedDataStageName(uint32_t stage);
+
 #endif  /* VBOOT_REFERENCE_HOST_COMMON_H_ */
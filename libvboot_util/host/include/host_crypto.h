@@ -0,0 +1,37 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Choosing what does the host's hashing and signature checking.
+ */
+
+#ifndef VBOOT_REFERENCE_HOST_CRYPTO_H_
+#define VBOOT_REFERENCE_HOST_CRYPTO_H_
+
+#include "cryptolib.h"
+
+/* Hashes with EVP_Digest() and exponentiates with RSA_public_decrypt(), so
+ * libcrypto's assembly does the work. Padding is still checked by cryptolib,
+ * so a signature is accepted exactly when cryptolib would accept it.  Not
+ * in futility-verify, which is built without libcrypto. */
+extern const CryptoProvider libcrypto_provider;
+
+/* Hashes big buffers through the kernel's AF_ALG sockets, so that a crypto
+ * accelerator the kernel has a driver for does the work, and the CPU is
+ * free for something else.  Small buffers, hashes the kernel can't do, and
+ * anything the device fails (say because it's busy) are hashed by cryptolib
+ * as usual, as is everything when there's no AF_ALG.  RSA stays on the CPU;
+ * signing goes through libcrypto, which can be given an accelerator by
+ * configuring an engine or provider for it in openssl.cnf. */
+extern const CryptoProvider afalg_provider;
+
+/* Make [name] ("cryptolib", "libcrypto" or "afalg") the crypto provider for
+ * the whole process.  Not thread safe; do it before starting anything.
+ *
+ * Returns 0 if success, non-zero if there's no such provider. */
+int CryptoProviderSelect(const char* name);
+
+/* The name of the current crypto provider. */
+const char* CryptoProviderName(void);
+
+#endif  /* VBOOT_REFERENCE_HOST_CRYPTO_H_ */
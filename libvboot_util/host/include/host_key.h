@@ -14,12 +14,38 @@
 
 typedef struct rsa_st RSA;
 
+struct VbPrivateKey;
+
+/* Signing backend.  [submit] starts producing the PKCS #1 v1.5 signature of
+ * the [in_len]-byte DigestInfo-prefixed digest [in] into [out], which holds
+ * [out_len] bytes and must stay valid until [complete] is called; [in] is
+ * only needed during the [submit] call.  [submit] may return before the
+ * signature is ready, in which case it sets [*pending] to whatever state
+ * [complete] needs to wait for it.  Backends that sign synchronously leave
+ * [*pending] NULL and [complete] may then be NULL too.  [free] releases the
+ * backend's per-key data, if any.  Both [submit] and [complete] return 0 on
+ * success; [complete] is always called exactly once for a successful
+ * [submit], even if the caller gives up on the result. */
+typedef struct VbSignerOps {
+  const char* name;
+  int (*submit)(const struct VbPrivateKey* key, const uint8_t* in,
+                uint32_t in_len, uint8_t* out, uint32_t out_len,
+                void** pending);
+  int (*complete)(const struct VbPrivateKey* key, void* pending);
+  void (*free)(struct VbPrivateKey* key);
+} VbSignerOps;
+
 /* Private key data */
 typedef struct VbPrivateKey {
   RSA* rsa_private_key;  /* Private key data */
   uint64_t algorithm;    /* Algorithm to use when signing */
+  const VbSignerOps* signer;  /* Signing backend; NULL means OpenSSL */
+  void* signer_data;     /* Backend-specific data */
 } VbPrivateKey;
 
+/* The default backend, which signs in-process with [rsa_private_key]. */
+extern const VbSignerOps kVbSignerOpenSSL;
+
 
 /* Read a private key from a .pem file.  Caller owns the returned pointer,
  * and must free it with PrivateKeyFree(). */
@@ -38,6 +64,16 @@ int PrivateKeyWrite(const char* filename, const VbPrivateKey* key);
  * Returns NULL if error. */
 VbPrivateKey* PrivateKeyRead(const char* filename);
 
+/* Like PrivateKeyRead(), but for the contents of a .vbprivk file that's
+ * already in memory. */
+VbPrivateKey* PrivateKeyReadBuf(const uint8_t* buf, uint64_t len);
+
+/* Get [key] ready to sign, so that its first signature takes no longer
+ * than the rest, on this thread or any other. That's worth doing for a key
+ * that will sign many times, from many threads; otherwise it only moves
+ * the cost. Does nothing for a key that OpenSSL doesn't hold. */
+void PrivateKeyPrepare(VbPrivateKey* key);
+
 
 
 /* Allocate a new public key with space for a [key_size] byte key. */
@@ -9,6 +9,7 @@
 #define VBOOT_REFERENCE_HOST_KEYBLOCK_H_
 
 #include "host_key.h"
+#include "host_misc.h"
 #include "vboot_struct.h"
 
 
@@ -31,6 +32,26 @@ VbKeyBlockHeader* KeyBlockCreate(const VbPublicKey* data_key,
                                  const VbPrivateKey* signing_key,
                                  uint64_t flags);
 
+/* Like KeyBlockCreate(), but the key block is allocated from [scratch]
+ * (see ScratchAlloc()), so it must not be freed if [scratch] is not NULL. */
+VbKeyBlockHeader* KeyBlockCreateScratch(const VbPublicKey* data_key,
+                                        const VbPrivateKey* signing_key,
+                                        uint64_t flags,
+                                        VbScratch* scratch);
+
+/* The size of the key block KeyBlockCreate() would create. */
+uint64_t KeyBlockSize(const VbPublicKey* data_key,
+                      const VbPrivateKey* signing_key);
+
+/* Like KeyBlockCreate(), but the key block is built in [dest], which has
+ * room for [dest_size] bytes (see KeyBlockSize()). Nothing is allocated.
+ * Returns 0 if success, non-zero if error. */
+int KeyBlockCreateInto(const VbPublicKey* data_key,
+                       const VbPrivateKey* signing_key,
+                       uint64_t flags,
+                       VbKeyBlockHeader* dest,
+                       uint64_t dest_size);
+
 
 /* Read a key block from a .keyblock file.  Caller owns the returned
  * pointer, and must free it with Free().
@@ -8,6 +8,9 @@
 #ifndef VBOOT_REFERENCE_HOST_MISC_H_
 #define VBOOT_REFERENCE_HOST_MISC_H_
 
+#include <sys/types.h>
+
+#include "cryptolib.h"
 #include "utility.h"
 #include "vboot_struct.h"
 
@@ -22,12 +25,65 @@ char* StrCopy(char* dest, const char* src, int dest_size);
  * error. */
 uint8_t* ReadFile(const char* filename, uint64_t* size);
 
+/* Like pread(), but retries short reads. Returns the number of bytes read,
+ * which is less than [len] only at EOF, or -1 on error. */
+ssize_t PreadFull(int fd, void* buf, size_t len, uint64_t offset);
+
+/* Called by DigestFileRegion() with each chunk of [len] bytes it hashes,
+ * found [pos] bytes into the region. */
+typedef void (*DigestRegionObserver)(void* arg, uint64_t pos,
+                                     const uint8_t* buf, uint64_t len);
+
+/* Feed [len] bytes of [fd] starting at [offset] into [ctx], which the caller
+ * has already set up with DigestInit(). The file is read in chunks on a
+ * second thread, so the next chunk is on its way while the current one is
+ * being hashed. If [observe] is given, it sees each chunk after it's hashed.
+ *
+ * Returns 0 if success, 1 if error (including running out of file). */
+int DigestFileRegion(DigestContext* ctx, int fd, uint64_t offset,
+                     uint64_t len, DigestRegionObserver observe, void* arg);
+
+/* Bump allocator for the temporaries and results of one signing
+ * operation, so a batch of them costs no heap traffic.  Everything taken
+ * from it is released together by ScratchReset(); none of it may be passed
+ * to free().  Not thread safe; give each thread its own. */
+typedef struct VbScratchOverflow VbScratchOverflow;
+typedef struct VbScratch {
+  uint8_t* buf;
+  uint64_t size;
+  uint64_t used;
+  VbScratchOverflow* overflow;  /* Heap blocks for requests that didn't fit */
+} VbScratch;
+
+/* Set up [scratch] to hand out [size] bytes of [buf], which the caller
+ * owns and which must outlive it. */
+void ScratchInit(VbScratch* scratch, void* buf, uint64_t size);
+
+/* Return [size] bytes suitably aligned for any type.  They come from
+ * [scratch]'s buffer if they fit, else from the heap until the next
+ * ScratchReset().  If [scratch] is NULL this is just malloc(), and the
+ * caller must free() the result.
+ *
+ * Returns NULL if out of memory. */
+void* ScratchAlloc(VbScratch* scratch, uint64_t size);
+
+/* Release everything allocated from [scratch], which may be NULL. */
+void ScratchReset(VbScratch* scratch);
+
 /* Read a string from a file.  Passed the destination, dest size, and
  * filename to read.
  *
  * Returns the destination, or NULL if error. */
 char* ReadFileString(char* dest, int size, const char* filename);
 
+/* Between these, ReadFileString() (and so ReadFileInt() and ReadFileBit())
+ * reads each file once and answers from what it read after that, however
+ * often it's asked.  For reading many sysfs or ACPI values that won't
+ * change meanwhile.  They nest; what was read is forgotten when the
+ * outermost ReadFileCacheEnd() is called.  Not thread safe. */
+void ReadFileCacheBegin(void);
+void ReadFileCacheEnd(void);
+
 /* Read an unsigned integer from a file and save into passed pointer.
  *
  * Returns 0 if success, -1 if error. */
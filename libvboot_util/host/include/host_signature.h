@@ -10,6 +10,7 @@
 
 #include "cryptolib.h"
 #include "host_key.h"
+#include "host_misc.h"
 #include "utility.h"
 #include "vboot_struct.h"
 
@@ -50,6 +51,61 @@ VbSignature* CalculateHash(const uint8_t* data, uint64_t size,
 VbSignature* CalculateSignature(const uint8_t* data, uint64_t size,
                                 const VbPrivateKey* key);
 
+/* Calculates a signature for data of length [size] whose digest has already
+ * been computed (e.g. with DigestBufMulti()) using the algorithm from the
+ * specified key.
+ * Caller owns the returned pointer, and must free it with Free().
+ *
+ * Returns NULL on error. */
+VbSignature* CalculateSignatureForDigest(const uint8_t* digest, uint64_t size,
+                                         const VbPrivateKey* key);
+
+/* Like CalculateSignature() and CalculateSignatureForDigest(), but the
+ * result is allocated from [scratch] (see ScratchAlloc()), so it must not be
+ * freed if [scratch] is not NULL. */
+VbSignature* CalculateSignatureScratch(const uint8_t* data, uint64_t size,
+                                       const VbPrivateKey* key,
+                                       VbScratch* scratch);
+VbSignature* CalculateSignatureForDigestScratch(const uint8_t* digest,
+                                                uint64_t size,
+                                                const VbPrivateKey* key,
+                                                VbScratch* scratch);
+
+/* Like CalculateSignature() and CalculateSignatureForDigest(), but the
+ * signature is written into [dest], which must have been set up with
+ * SignatureInit() with room for it.  Nothing is allocated.
+ *
+ * Returns 0 if success, non-zero if error. */
+int CalculateSignatureInto(const uint8_t* data, uint64_t size,
+                           const VbPrivateKey* key, VbSignature* dest);
+int CalculateSignatureForDigestInto(const uint8_t* digest, uint64_t size,
+                                    const VbPrivateKey* key,
+                                    VbSignature* dest);
+
+/* A signature that has been submitted to a key's signing backend but not
+ * yet collected.  Treat the contents as opaque. */
+typedef struct VbSignRequest {
+  const VbPrivateKey* key;
+  VbSignature* sig;
+  void* pending;
+} VbSignRequest;
+
+/* Starts signing data of length [size] whose digest has already been
+ * computed, as CalculateSignatureForDigest() does, but without waiting for
+ * the backend to finish.  Any number of requests may be outstanding; each
+ * must be passed to SignatureComplete() exactly once.
+ *
+ * Returns 0 if success, non-zero if error (in which case there is nothing
+ * to complete). */
+int SignatureSubmit(const uint8_t* digest, uint64_t size,
+                    const VbPrivateKey* key, VbSignRequest* req);
+
+/* Waits for a request started by SignatureSubmit() to finish.
+ * Caller owns the returned pointer, and must free it with Free().
+ *
+ * Returns NULL on error. */
+VbSignature* SignatureComplete(VbSignRequest* req);
+
 /* Calculates a signature for the data using the specified key and
  * an external program.
  * Caller owns the returned pointer, and must free it with Free().
@@ -60,4 +116,126 @@ VbSignature* CalculateSignature_external(const uint8_t* data, uint64_t size,
                                          uint64_t key_algorithm,
                                          const char* external_signer);
 
+/* Create a private key whose signatures are produced by running
+ * [external_signer] with [pem_file] as its only argument, feeding it the
+ * data to sign on stdin and reading the signature from its stdout.  The
+ * signer is started on submit and reaped on completion, so several
+ * signatures can be in flight at once.  Caller owns the returned pointer,
+ * and must free it with PrivateKeyFree().
+ *
+ * Returns NULL if error. */
+VbPrivateKey* PrivateKeyExternal(const char* pem_file, uint64_t algorithm,
+                                 const char* external_signer);
+
+/* Like PrivateKeyExternal(), but [external_signer] is started only once,
+ * as "[external_signer] [pem_file] --persistent", and stays running until
+ * the key is freed.  Each request is written to its stdin as a 4-byte
+ * big-endian length followed by that many bytes of data to sign; each
+ * reply is read from its stdout the same way, in request order.  A reply
+ * of the wrong length (such as zero) fails that request only.  The key
+ * must not be used by more than one thread at a time.  Caller owns the
+ * returned pointer, and must free it with PrivateKeyFree().
+ *
+ * Returns NULL if error. */
+VbPrivateKey* PrivateKeyExternalPersistent(const char* pem_file,
+                                           uint64_t algorithm,
+                                           const char* external_signer);
+
+/* How hard a scheduled key (see PrivateKeyScheduled()) may be driven. */
+typedef struct VbSignSchedule {
+  double rate;      /* Signatures started per second, or 0 for no limit */
+  uint32_t burst;   /* How many may start at once after a lull (at least 1) */
+  uint32_t window;  /* Most outstanding at once, or 0 for no limit */
+  uint32_t memo;    /* Finished signatures to remember for reuse */
+} VbSignSchedule;
+
+/* Waiting requests are started in this order. */
+enum {
+  VB_SIGN_PRIORITY_RELEASE,
+  VB_SIGN_PRIORITY_NIGHTLY,
+  VB_SIGN_PRIORITY_DEV,
+  VB_SIGN_PRIORITY_COUNT
+};
+
+/* Create a key that signs with [key], but no faster than [sched] allows.
+ * Its requests wait behind those of keys with a higher [priority]
+ * (VB_SIGN_PRIORITY_*) for the same limits.  Every scheduled key with the same [name] shares one set of limits (those
+ * of the latest one created), so give each HSM key or partition its own
+ * name.  A request that finds the same input already being signed for
+ * another thread waits for that signature instead of asking for another
+ * one, and one for the same input as any of the last [memo] signatures is
+ * answered at once.  PKCS #1 v1.5 signatures are deterministic, so this is
+ * only wrong if different keys are given the same name.  A thread's requests beyond the window wait for a place in it only
+ * if that thread has none of its own outstanding, so it can't wait for
+ * itself.  [key] must outlive the returned key, and must be safe to use from
+ * as many threads as use the returned key.  Caller owns the returned
+ * pointer, and must free it with PrivateKeyFree().
+ *
+ * Returns NULL if error. */
+VbPrivateKey* PrivateKeyScheduled(const VbPrivateKey* key, const char* name,
+                                  const VbSignSchedule* sched, int priority);
+
+/* The limits and remembered signatures for each name are kept after the
+ * last key using them is freed, for the next one.  This frees them. */
+void PrivateKeyScheduledCleanup(void);
+
+/* What's been asked of the keys with one name, and what they're doing now. */
+typedef struct VbSignScheduleStats {
+  uint64_t requests;    /* Signatures asked for */
+  uint64_t started;     /* Requests that went to the real backend */
+  uint64_t shared;      /* Requests that waited for another's signature */
+  uint64_t remembered;  /* Requests answered from the remembered ones */
+  uint32_t inflight;    /* Started but not yet complete */
+  uint32_t waiting;     /* Waiting for a token or a place in the window */
+} VbSignScheduleStats;
+
+/* Call [report] with the stats for each name that's still kept.  It's
+ * called with a lock held, so mustn't use any scheduled key. */
+void PrivateKeyScheduledStats(void (*report)(void* arg, const char* name,
+                                             const VbSignScheduleStats* stats),
+                              void* arg);
+
+/* Signing split in two, for when the private keys are far away.  Keys from
+ * PrivateKeySplit() take their signatures from those that
+ * SplitSigningReadSignatures() has read.  If the VbSplitSigning is
+ * collecting, they make signatures of zeros for the rest, and
+ * SplitSigningWriteRequests() writes them to a request file, one line for
+ * each: "NAME ALGORITHM DIGESTINFO", with the DigestInfo-prefixed digest in
+ * hex.  Whoever holds the key NAME adds its PKCS #1 v1.5 signature of
+ * DIGESTINFO to the end of the line, in hex, and the file can then be read
+ * back.  A signature that covers one that's still missing (a preamble
+ * covers its body's) can't be asked for yet, so it may take another round.
+ * Keys may be used from any number of threads. */
+typedef struct VbSplitSigning VbSplitSigning;
+
+/* Create an empty set of signatures, which collects what's missing if
+ * [collect] is non-zero, or fails to sign it otherwise.
+ *
+ * Returns NULL if error. */
+VbSplitSigning* SplitSigningNew(int collect);
+
+/* Free [ss], which must outlive every key using it. */
+void SplitSigningFree(VbSplitSigning* ss);
+
+/* Create a key that signs for [ss] as the key [name], which must be a single
+ * word, with [algorithm].  Caller owns the returned pointer, and must free it
+ * with PrivateKeyFree().
+ *
+ * Returns NULL if error. */
+VbPrivateKey* PrivateKeySplit(VbSplitSigning* ss, const char* name,
+                              uint64_t algorithm);
+
+/* Write every signature asked for so far to [filename], with those that
+ * are known, and set [*missing] to the number that aren't.
+ *
+ * Returns 0 if success, non-zero if error. */
+int SplitSigningWriteRequests(VbSplitSigning* ss, const char* filename,
+                              uint32_t* missing);
+
+/* Read the signatures in a request file.  Lines not yet signed are
+ * skipped.
+ *
+ * Returns 0 if success, non-zero if error. */
+int SplitSigningReadSignatures(VbSplitSigning* ss, const char* filename);
+
 #endif  /* VBOOT_REFERENCE_HOST_SIGNATURE_H_ */
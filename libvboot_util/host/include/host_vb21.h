@@ -0,0 +1,80 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Host-side functions for the vboot 2.1 formats.
+ */
+
+#ifndef VBOOT_REFERENCE_HOST_VB21_H_
+#define VBOOT_REFERENCE_HOST_VB21_H_
+
+#include "host_key.h"
+#include "vb21_common.h"
+#include "vboot_struct.h"
+
+
+/* The default size of the pieces of firmware body that a vb21 preamble
+ * hashes separately. */
+#define VB21_FW_HASH_CHUNK (64 * 1024)
+
+/* Set [id] to the ID of a key with [key_data], which is the SHA-1 of it. */
+void Vb21KeyId(const uint8_t *key_data, uint64_t key_size, struct vb2_id *id);
+
+/* Set [id] to the ID of the public half of [key].  Returns non-zero, with
+ * [id] zeroed, if it can't be worked out, such as for an external signer. */
+int Vb21PrivateKeyId(const VbPrivateKey *key, struct vb2_id *id);
+
+/* Create a vb21 packed key from the v1 public key [key], whose key data is
+ * in the same format, with description [desc] (which may be NULL).  Caller
+ * owns the returned pointer, and must free it with free().
+ *
+ * Returns NULL if error. */
+struct vb21_packed_key *Vb21PackedKeyCreate(const VbPublicKey *key,
+                                            const char *desc);
+
+/* Create a v1 public key from the vb21 packed key [key], which has been
+ * checked with Vb21PackedKeyInside().  Caller owns the returned pointer, and
+ * must free it with free().
+ *
+ * Returns NULL if error. */
+VbPublicKey *Vb21PackedKeyToV1(const struct vb21_packed_key *key);
+
+/* Create a signature by [key], whose ID is [id], of [data_size] bytes of
+ * data with [digest], as CalculateSignatureForDigest() does.  Caller owns
+ * the returned pointer, and must free it with free().
+ *
+ * Returns NULL if error. */
+struct vb21_signature *Vb21SignatureCreate(const uint8_t *digest,
+                                           uint32_t data_size,
+                                           const VbPrivateKey *key,
+                                           const struct vb2_id *id,
+                                           const char *desc);
+
+/* Create a keyblock containing [data_key] and [flags], with a SHA-512
+ * checksum and a signature by [signing_key], whose ID is [signing_id], unless
+ * [signing_key] is NULL.  Caller owns the returned pointer, and must free it with free().
+ *
+ * Returns NULL if error. */
+struct vb21_keyblock *Vb21KeyblockCreate(
+    const struct vb21_packed_key *data_key,
+    const VbPrivateKey *signing_key,
+    const struct vb2_id *signing_id,
+    uint32_t flags, const char *desc);
+
+/* Create a firmware preamble for the [body_size]-byte [body], with a hash of
+ * each [chunk_size]-byte piece of it (the last may be shorter), signed by
+ * [signing_key], whose ID is [signing_id].  The pieces are hashed with the
+ * key's hash algorithm, several at once.  Caller owns the returned pointer,
+ * and must free it with free().
+ *
+ * Returns NULL if error. */
+struct vb21_fw_preamble *Vb21FwPreambleCreate(const uint8_t *body,
+                                              uint64_t body_size,
+                                              uint32_t chunk_size,
+                                              const VbPrivateKey *signing_key,
+                                              const struct vb2_id *signing_id,
+                                              uint32_t fw_version,
+                                              uint32_t flags,
+                                              const char *desc);
+
+#endif  /* VBOOT_REFERENCE_HOST_VB21_H_ */
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef VBOOT_REFERENCE_IMAGE_SCAN_H_
+#define VBOOT_REFERENCE_IMAGE_SCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fmap.h"
+
+/*
+ * Where the FMAP and GBB signatures are in an image, found in one pass over
+ * it. Both are only looked for at multiples of FMAP_SEARCH_STRIDE (which is
+ * the GBB's stride too), and the offsets are in increasing order. Nothing
+ * past the signatures is checked, so the headers may not be any good.
+ */
+typedef struct _ImageScan {
+	size_t *fmap;
+	int num_fmap;
+	size_t *gbb;
+	int num_gbb;
+} ImageScan;
+
+/* Scan the buffer. Returns NULL if out of memory. */
+ImageScan *image_scan(const uint8_t *ptr, size_t size);
+
+/* Free a scan returned by image_scan() */
+void image_scan_free(ImageScan *scan);
+
+/*
+ * Return the FMAP that fmap_find() would, from a scan of the same buffer.
+ * Only candidates with an alignment below [max_align] are considered, for
+ * callers that have already tried the larger ones.
+ */
+FmapHeader *image_scan_fmap(uint8_t *ptr, size_t size,
+			    const ImageScan *scan, size_t max_align);
+
+/*
+ * The smallest erase block of most SPI flash, which is what's reported and
+ * skipped as pad. Blocks are aligned to the start of the image.
+ */
+#define IMAGE_ERASE_BLOCK 4096
+
+/* What a stretch of an image is filled with */
+enum image_fill {
+	IMAGE_FILL_DATA,		/* anything else */
+	IMAGE_FILL_ERASED,		/* all 0xff, as erased flash reads */
+	IMAGE_FILL_ZERO,		/* all 0x00 */
+};
+
+/* What [ptr, ptr + size) is filled with. An empty one counts as erased. */
+enum image_fill image_fill(const uint8_t *ptr, size_t size);
+
+#endif  /* VBOOT_REFERENCE_IMAGE_SCAN_H_ */
@@ -8,12 +8,26 @@
 #ifndef VBOOT_REFERENCE_UTIL_MISC_H_
 #define VBOOT_REFERENCE_UTIL_MISC_H_
 
+#include <stdio.h>
+
 #include "vboot_struct.h"
 struct rsa_st;
 
 /* Prints the sha1sum of the given VbPublicKey to stdout. */
 void PrintPubKeySha1Sum(VbPublicKey* key);
 
+/* Same, but to the given stream. */
+void FPrintPubKeySha1Sum(FILE* fp, VbPublicKey* key);
+
+/* Size of the buffer needed for PubKeySha1String(), including the NUL */
+#define PUBKEY_SHA1_STRLEN 41
+
+/* Formats the sha1sum of the given VbPublicKey as a hex string. */
+void PubKeySha1String(VbPublicKey* key, char* str);
+
+/* The same sum, as SHA1_DIGEST_SIZE bytes. Recent keys' sums are cached. */
+void PubKeySha1(VbPublicKey* key, uint8_t* digest);
+
 /*
  * Our packed RSBPublicKey buffer (historically in files ending with ".keyb",
  * but also the part of VbPublicKey and struct vb2_packed_key that is
@@ -57,6 +57,9 @@ int GuidIsZero(const Guid *guid);
 char *FindKernelConfig(const char *filename,
                        uint64_t kernel_body_load_address);
 
+/* Same, but reads it from a pipe, only as far as the config */
+char *FindKernelConfigFromFd(int fd, uint64_t kernel_body_load_address);
+
 /****************************************************************************/
 /* Kernel partition */
 
@@ -19,14 +19,122 @@
 #include "vboot_common.h"
 
 void PrintPubKeySha1Sum(VbPublicKey *key)
+{
+	FPrintPubKeySha1Sum(stdout, key);
+}
+
+void FPrintPubKeySha1Sum(FILE *fp, VbPublicKey *key)
+{
+	char str[PUBKEY_SHA1_STRLEN];
+
+	PubKeySha1String(key, str);
+	fputs(str, fp);
+}
+
+/*
+ * The same few keys (root, recovery, kernel subkey) are shown for image after
+ * image, so each thread remembers the sums of the last few. They're matched
+ * by content, as the same key turns up at a new address in every image, and
+ * comparing is much cheaper than hashing.
+ */
+#define SHA1_CACHE_SIZE 4
+#define SHA1_CACHE_KEY_MAX (2 * RSA8192NUMBYTES + 2 * sizeof(uint32_t))
+
+static __thread struct {
+	uint64_t key_size;
+	uint8_t digest[SHA1_DIGEST_SIZE];
+	uint8_t data[SHA1_CACHE_KEY_MAX];
+} sha1_cache[SHA1_CACHE_SIZE];
+static __thread int sha1_cache_next;
+
+void PubKeySha1(VbPublicKey *key, uint8_t *digest)
 {
 	uint8_t *buf = ((uint8_t *)key) + key->key_offset;
 	uint64_t buflen = key->key_size;
-	uint8_t *digest = DigestBuf(buf, buflen, SHA1_DIGEST_ALGORITHM);
 	int i;
-	for (i = 0; i < SHA1_DIGEST_SIZE; i++)
-		printf("%02x", digest[i]);
-	free(digest);
+
+	for (i = 0; i < SHA1_CACHE_SIZE; i++)
+		if (sha1_cache[i].key_size == buflen && buflen &&
+		    !memcmp(sha1_cache[i].data, buf, buflen)) {
+			memcpy(digest, sha1_cache[i].digest, SHA1_DIGEST_SIZE);
+			return;
+		}
+
+	internal_SHA1(buf, buflen, digest);
+	if (!buflen || buflen > SHA1_CACHE_KEY_MAX)
+		return;
+
+	i = sha1_cache_next;
+	sha1_cache_next = (i + 1) % SHA1_CACHE_SIZE;
+	sha1_cache[i].key_size = buflen;
+	memcpy(sha1_cache[i].data, buf, buflen);
+	memcpy(sha1_cache[i].digest, digest, SHA1_DIGEST_SIZE);
+}
+
+void PubKeySha1String(VbPublicKey *key, char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	uint8_t digest[SHA1_DIGEST_SIZE];
+	int i;
+
+	PubKeySha1(key, digest);
+	for (i = 0; i < SHA1_DIGEST_SIZE; i++) {
+		str[2 * i] = hex[digest[i] >> 4];
+		str[2 * i + 1] = hex[digest[i] & 0xf];
+	}
+	str[2 * i] = '\0';
+}
+
+/* Reads a DER tag and length, leaving *[p] at the contents */
+static int der_header(const unsigned char **p, const unsigned char *end,
+		      int tag, uint32_t *len)
+{
+	const unsigned char *q = *p;
+	uint32_t n;
+	int i, bytes;
+
+	if (end - q < 2 || *q++ != tag)
+		return 1;
+	n = *q++;
+	if (n & 0x80) {
+		bytes = n & 0x7f;
+		if (bytes > 4 || end - q < bytes)
+			return 1;
+		for (n = 0, i = 0; i < bytes; i++)
+			n = (n << 8) | *q++;
+	}
+	if (n > end - q)
+		return 1;
+	*p = q;
+	*len = n;
+	return 0;
+}
+
+/*
+ * Returns a copy of the key's modulus. It's taken from the DER encoding,
+ * because struct rsa_st isn't the same in every OpenSSL release.
+ */
+static BIGNUM *rsa_modulus(struct rsa_st *rsa)
+{
+	const unsigned char *p, *end;
+	unsigned char *der = NULL;
+	BIGNUM *n = NULL;
+	uint32_t len;
+	int der_len;
+
+	der_len = i2d_RSAPublicKey(rsa, &der);
+	if (der_len <= 0)
+		return NULL;
+	p = der;
+	end = der + der_len;
+
+	/* RSAPublicKey ::= SEQUENCE { modulus INTEGER, publicExponent ... } */
+	if (!der_header(&p, end, 0x30, &len) &&
+	    !der_header(&p, end, 0x02, &len))
+		n = BN_bin2bn(p, len, NULL);
+
+	OPENSSL_free(der);
+	return n;
 }
 
 int vb_keyb_from_rsa(struct rsa_st *rsa_private_key,
@@ -42,11 +150,15 @@ int vb_keyb_from_rsa(struct rsa_st *rsa_private_key,
 	BN_CTX *bn_ctx = BN_CTX_new();
 	uint32_t n0invout;
 	uint32_t bufsize;
-	uint32_t *outbuf;
+	uint32_t *outbuf = NULL;
 	int retval = 1;
 
+	N = rsa_modulus(rsa_private_key);
+	if (!N)
+		goto done;
+
 	/* Size of RSA key in 32-bit words */
-	nwords = BN_num_bits(rsa_private_key->n) / 32;
+	nwords = BN_num_bits(N) / 32;
 
 	bufsize = (2 + nwords + nwords) * sizeof(uint32_t);
 	outbuf = malloc(bufsize);
@@ -60,7 +172,6 @@ int vb_keyb_from_rsa(struct rsa_st *rsa_private_key,
 
 	/* Initialize BIGNUMs */
 #define NEW_BIGNUM(x) do { x = BN_new(); if (!x) goto done; } while (0)
-	NEW_BIGNUM(N);
 	NEW_BIGNUM(Big1);
 	NEW_BIGNUM(Big2);
 	NEW_BIGNUM(Big32);
@@ -75,7 +186,6 @@ int vb_keyb_from_rsa(struct rsa_st *rsa_private_key,
 	NEW_BIGNUM(B);
 #undef NEW_BIGNUM
 
-	BN_copy(N, rsa_private_key->n);
 	BN_set_word(Big1, 1L);
 	BN_set_word(Big2, 2L);
 	BN_set_word(Big32, 32L);
@@ -128,6 +238,7 @@ int vb_keyb_from_rsa(struct rsa_st *rsa_private_key,
 done:
 	free(outbuf);
 	/* Free BIGNUMs. */
+	BN_free(N);
 	BN_free(Big1);
 	BN_free(Big2);
 	BN_free(Big32);
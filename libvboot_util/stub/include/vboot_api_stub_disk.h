@@ -0,0 +1,52 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * File-backed disks for running the disk and stream APIs on a host.
+ */
+
+#ifndef VBOOT_REFERENCE_VBOOT_API_STUB_DISK_H_
+#define VBOOT_REFERENCE_VBOOT_API_STUB_DISK_H_
+
+#include <stdint.h>
+
+#include "vboot_api.h"
+
+/* Opens a disk image (or block device) so VbExDiskRead(), VbExDiskWrite()
+ * and the stream calls work on it. Fills in [info] with a handle and a
+ * geometry of [bytes_per_lba]-byte sectors, flagged VB_DISK_FLAG_FIXED.
+ * Until it's closed, VbExDiskGetInfo() lists it as a fixed disk, so
+ * VbSelectAndLoadKernel() finds it. Handles not made here keep the old
+ * do-nothing stub behavior.
+ *
+ * Returns VBERROR_SUCCESS, or VBERROR_UNKNOWN if the file can't be opened. */
+VbError_t VbExDiskOpenFile(const char* filename, uint64_t bytes_per_lba,
+                           VbDiskInfo* info);
+
+/* Closes a disk opened by VbExDiskOpenFile(). */
+void VbExDiskCloseFile(VbExDiskHandle_t handle);
+
+/* Returns the sector size of a disk opened by VbExDiskOpenFile(), or 0 for
+ * any other handle. */
+uint64_t VbExDiskFileBytesPerLba(VbExDiskHandle_t handle);
+
+/* Calls [hook] with the byte offset and size of every read of a file-backed
+ * disk before it's done, so that a host harness can work out how long the
+ * reads would have taken on real storage. A NULL [hook] stops that. */
+void VbExDiskSetReadHook(VbExDiskHandle_t handle,
+                         void (*hook)(void* arg, uint64_t offset,
+                                      uint64_t bytes),
+                         void* arg);
+
+/* Reads [bytes] bytes at byte [offset] of a file-backed disk, with no
+ * sector alignment required. Returns VBERROR_SUCCESS, or VBERROR_UNKNOWN if
+ * the read fails or goes past the end of the disk. */
+VbError_t VbExDiskReadBytes(VbExDiskHandle_t handle, uint64_t offset,
+                            uint32_t bytes, void* buffer);
+
+/* Asks the OS to start reading [bytes] bytes at byte [offset] of a
+ * file-backed disk in the background, so a later read finds them cached. */
+void VbExDiskPrefetch(VbExDiskHandle_t handle, uint64_t offset,
+                      uint64_t bytes);
+
+#endif  /* VBOOT_REFERENCE_VBOOT_API_STUB_DISK_H_ */
@@ -0,0 +1,18 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Host hooks for the stub firmware API.
+ */
+
+#ifndef VBOOT_REFERENCE_VBOOT_API_STUB_INIT_H_
+#define VBOOT_REFERENCE_VBOOT_API_STUB_INIT_H_
+
+#include <stdarg.h>
+
+/* Sends what VbExDebug() prints to [hook] instead of stderr, with any '%L'
+ * in the format already made '%l'. The hook may be called from several
+ * threads at once. A NULL [hook] goes back to stderr. */
+void VbExSetDebugHook(void (*hook)(const char *format, va_list ap));
+
+#endif  /* VBOOT_REFERENCE_VBOOT_API_STUB_INIT_H_ */
@@ -0,0 +1,22 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * What the host stubs of VbExMalloc() and VbExFree() know about the
+ * allocations, in either vboot_api_stub_malloc.c or the debug version.
+ */
+
+#ifndef VBOOT_REFERENCE_VBOOT_API_STUB_MALLOC_H_
+#define VBOOT_REFERENCE_VBOOT_API_STUB_MALLOC_H_
+
+#include <stdint.h>
+
+/* Returns 0 if everything VbExMalloc() handed out has been freed. If not,
+ * says so on stderr (the debug version says where each came from) and
+ * returns -1. */
+int vboot_api_stub_check_memory(void);
+
+/* Returns how many times VbExMalloc() has been called, by every thread. */
+uint64_t vboot_api_stub_alloc_count(void);
+
+#endif  /* VBOOT_REFERENCE_VBOOT_API_STUB_MALLOC_H_ */
@@ -0,0 +1,53 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * A file-backed firmware image for running VbSelectFirmware() on a host.
+ */
+
+#ifndef VBOOT_REFERENCE_VBOOT_API_STUB_SF_H_
+#define VBOOT_REFERENCE_VBOOT_API_STUB_SF_H_
+
+#include <stdint.h>
+
+#include "vboot_api.h"
+
+/* Bytes handed to VbUpdateFirmwareBodyHash() at a time */
+#define VB_FIRMWARE_FILE_CHUNK (1 << 20)
+
+/* Maps the bios.bin [filename] and finds its VBLOCK_A/B and FW_MAIN_A/B
+ * areas through its FMAP. [cparams]->caller_context is pointed at the
+ * image, so that VbExHashFirmwareBody() hashes the real bodies, and
+ * [fparams] gets the two verification blocks. The OS is asked to start
+ * reading both bodies right away, so the second one is in memory by the
+ * time the first has been hashed. Each image is independent of the others,
+ * so any number can be checked at once on different threads. Contexts not
+ * set up here keep the old do-nothing stub behavior.
+ *
+ * Returns VBERROR_SUCCESS, or VBERROR_UNKNOWN if the file can't be opened
+ * or doesn't have those areas. */
+VbError_t VbExFirmwareOpenFile(const char *filename, VbCommonParams *cparams,
+			       VbSelectFirmwareParams *fparams);
+
+/* Unmaps an image opened by VbExFirmwareOpenFile(), and clears
+ * [cparams]->caller_context. */
+void VbExFirmwareCloseFile(VbCommonParams *cparams);
+
+/* Calls [hook] with the offset and size of everything read from an image
+ * opened by VbExFirmwareOpenFile() before it's read: the chunks of the body
+ * being hashed and the GBB reads, so that a host harness can work out how
+ * long they'd have taken from flash. A NULL [hook] stops that. */
+void VbExFirmwareSetReadHook(VbCommonParams *cparams,
+			     void (*hook)(void *arg, uint64_t offset,
+					  uint64_t bytes),
+			     void *arg);
+
+/* What VbExRegionRead() does: reads [size] bytes at [offset] of the GBB of
+ * an image opened by VbExFirmwareOpenFile(). Returns
+ * VBERROR_REGION_READ_INVALID if that's past the end of the GBB area, or
+ * isn't the GBB. Contexts not set up here read nothing, as before. */
+VbError_t VbExFirmwareRegionRead(VbCommonParams *cparams,
+				 enum vb_firmware_region region,
+				 uint32_t offset, uint32_t size, void *buf);
+
+#endif  /* VBOOT_REFERENCE_VBOOT_API_STUB_SF_H_ */
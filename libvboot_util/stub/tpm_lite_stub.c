@@ -75,11 +75,19 @@ __attribute__((unused)) static void PrintBytes(const uint8_t* a, int n) {
 }
 
 
-/* Executes a command on the TPM.
+/* Gets the size field of a TPM command.
+ */
+static inline uint32_t TpmCommandSize(const uint8_t* buffer) {
+  uint32_t size;
+  FromTpmUint32(buffer + sizeof(uint16_t), &size);
+  return size;
+}
+
+
+/* Executes a command on the TPM.  The response is read straight into |out|.
  */
 static VbError_t TpmExecute(const uint8_t *in, const uint32_t in_len,
                 uint8_t *out, uint32_t *pout_len) {
-  uint8_t response[TPM_MAX_COMMAND_SIZE];
   if (in_len <= 0) {
     return DoError(TPM_E_INPUT_TOO_SMALL,
                    "invalid command length %d for command 0x%x\n",
@@ -94,20 +102,20 @@ static VbError_t TpmExecute(const uint8_t *in, const uint32_t in_len,
       return DoError(TPM_E_WRITE_FAILURE,
                      "write failure to TPM device: %s\n", strerror(errno));
     }
-    n = read(tpm_fd, response, sizeof(response));
+    /* The driver hands back at most the size asked for and drops the rest,
+     * so a response that didn't fit shows up as a header size larger than
+     * what was read. */
+    n = read(tpm_fd, out, *pout_len);
     if (n == 0) {
       return DoError(TPM_E_READ_EMPTY, "null read from TPM device\n");
     } else if (n < 0) {
       return DoError(TPM_E_READ_FAILURE, "read failure from TPM device: %s\n",
                      strerror(errno));
+    } else if (n >= kTpmResponseHeaderLength && TpmCommandSize(out) > n) {
+      return DoError(TPM_E_RESPONSE_TOO_LARGE,
+                     "TPM response too long for output buffer\n");
     } else {
-      if (n > *pout_len) {
-        return DoError(TPM_E_RESPONSE_TOO_LARGE,
-                       "TPM response too long for output buffer\n");
-      } else {
-        *pout_len = n;
-        Memcpy(out, response, n);
-      }
+      *pout_len = n;
     }
   }
   return VBERROR_SUCCESS;
@@ -124,16 +132,6 @@ static inline int TpmTag(const uint8_t* buffer) {
 }
 
 
-/* Gets the size field of a TPM command.
- */
-__attribute__((unused))
-static inline int TpmResponseSize(const uint8_t* buffer) {
-  uint32_t size;
-  FromTpmUint32(buffer + sizeof(uint16_t), &size);
-  return (int) size;
-}
-
-
 VbError_t VbExTpmInit(void) {
   char *no_exit = getenv("TPM_NO_EXIT");
   if (no_exit)
@@ -210,12 +208,17 @@ VbError_t VbExTpmSendReceive(const uint8_t* request, uint32_t request_length,
 #endif
   VbError_t result;
 
+#ifdef VBOOT_DEBUG
+  /* Only timed for the debug output below */
   struct timeval before, after;
   gettimeofday(&before, NULL);
+#endif
   result = TpmExecute(request, request_length, response, response_length);
   if (result != VBERROR_SUCCESS)
     return result;
+#ifdef VBOOT_DEBUG
   gettimeofday(&after, NULL);
+#endif
 
 #ifdef VBOOT_DEBUG
   {
@@ -244,7 +247,7 @@ VbError_t VbExTpmSendReceive(const uint8_t* request, uint32_t request_length,
      response_tag == TPM_TAG_RSP_AUTH1_COMMAND) ||
     (tag == TPM_TAG_RQU_AUTH2_COMMAND &&
      response_tag == TPM_TAG_RSP_AUTH2_COMMAND));
-  assert(*response_length == TpmResponseSize(response));
+  assert(*response_length == TpmCommandSize(response));
 #endif
 
   return VBERROR_SUCCESS;
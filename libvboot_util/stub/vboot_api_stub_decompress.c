@@ -0,0 +1,170 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Stub implementation of decompression, for the codecs that are simple
+ * enough to do here.
+ */
+
+#include <stdint.h>
+
+#define _STUB_IMPLEMENTATION_
+
+#include "utility.h"
+#include "vboot_api.h"
+
+/* LZ4 frame format; see lz4_Frame_format.md in the LZ4 sources */
+#define LZ4F_MAGIC 0x184D2204
+#define LZ4F_FLG_VERSION_MASK 0xc0
+#define LZ4F_FLG_VERSION 0x40
+#define LZ4F_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4F_FLG_CONTENT_SIZE 0x08
+#define LZ4F_FLG_DICT_ID 0x01
+#define LZ4F_BLOCK_UNCOMPRESSED 0x80000000
+#define LZ4_MIN_MATCH 4
+
+static uint32_t ReadLe32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Reads an LZ4 length that goes on past the 4 bits of the token in bytes of
+ * 255, adding it to [*len]. Returns non-zero if it runs off the end.
+ */
+static int Lz4Length(const uint8_t **in, const uint8_t *end, uint32_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*in >= end)
+			return 1;
+		b = *(*in)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/*
+ * Decodes the LZ4 block at [in] onto [*out], which is [outbuf] plus what's
+ * been decoded so far; matches may reach back into earlier blocks.
+ */
+static VbError_t Lz4Block(const uint8_t *in, uint32_t in_size,
+			  uint8_t *outbuf, uint8_t **out, uint8_t *out_end)
+{
+	const uint8_t *end = in + in_size;
+	uint8_t *op = *out;
+	uint32_t len, offset;
+	uint8_t token;
+
+	while (in < end) {
+		token = *in++;
+
+		len = token >> 4;
+		if (len == 15 && Lz4Length(&in, end, &len))
+			return VBERROR_INVALID_PARAMETER;
+		if (len > end - in || len > out_end - op)
+			return VBERROR_INVALID_PARAMETER;
+		Memcpy(op, in, len);
+		op += len;
+		in += len;
+
+		/* The last sequence has only literals */
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			return VBERROR_INVALID_PARAMETER;
+		offset = in[0] | (in[1] << 8);
+		in += 2;
+		if (!offset || offset > op - outbuf)
+			return VBERROR_INVALID_PARAMETER;
+
+		len = token & 15;
+		if (len == 15 && Lz4Length(&in, end, &len))
+			return VBERROR_INVALID_PARAMETER;
+		len += LZ4_MIN_MATCH;
+		if (len > out_end - op)
+			return VBERROR_INVALID_PARAMETER;
+
+		/* Matches may overlap what they make, so go a byte at a time */
+		for (; len; len--, op++)
+			*op = op[-(int32_t)offset];
+	}
+
+	*out = op;
+	return VBERROR_SUCCESS;
+}
+
+static VbError_t Lz4FrameDecompress(const uint8_t *in, uint32_t in_size,
+				    uint8_t *outbuf, uint32_t *out_size)
+{
+	const uint8_t *end = in + in_size;
+	uint8_t *op = outbuf;
+	uint32_t block_size;
+	uint8_t flg;
+	VbError_t ret;
+
+	/* Magic, FLG, BD and the header checksum, which we don't check */
+	if (in_size < 7 || ReadLe32(in) != LZ4F_MAGIC)
+		return VBERROR_INVALID_PARAMETER;
+	flg = in[4];
+	if ((flg & LZ4F_FLG_VERSION_MASK) != LZ4F_FLG_VERSION)
+		return VBERROR_INVALID_PARAMETER;
+	in += 6;
+	if (flg & LZ4F_FLG_CONTENT_SIZE)
+		in += 8;
+	if (flg & LZ4F_FLG_DICT_ID)
+		in += 4;
+	in++;
+
+	for (;;) {
+		if (end - in < 4)
+			return VBERROR_INVALID_PARAMETER;
+		block_size = ReadLe32(in);
+		in += 4;
+		if (!block_size)
+			break;
+
+		if (block_size & LZ4F_BLOCK_UNCOMPRESSED) {
+			block_size &= ~LZ4F_BLOCK_UNCOMPRESSED;
+			if (block_size > end - in ||
+			    block_size > outbuf + *out_size - op)
+				return VBERROR_INVALID_PARAMETER;
+			Memcpy(op, in, block_size);
+			op += block_size;
+		} else {
+			if (block_size > end - in)
+				return VBERROR_INVALID_PARAMETER;
+			ret = Lz4Block(in, block_size, outbuf, &op,
+				       outbuf + *out_size);
+			if (ret)
+				return ret;
+		}
+		in += block_size;
+		if (flg & LZ4F_FLG_BLOCK_CHECKSUM)
+			in += 4;
+	}
+
+	/* Any content checksum after the end mark isn't checked either */
+	*out_size = op - outbuf;
+	return VBERROR_SUCCESS;
+}
+
+VbError_t VbExDecompress(void *inbuf, uint32_t in_size,
+                         uint32_t compression_type,
+                         void *outbuf, uint32_t *out_size)
+{
+	switch (compression_type) {
+	case COMPRESS_NONE:
+		if (in_size > *out_size)
+			return VBERROR_INVALID_PARAMETER;
+		Memcpy(outbuf, inbuf, in_size);
+		*out_size = in_size;
+		return VBERROR_SUCCESS;
+	case COMPRESS_LZ4:
+		return Lz4FrameDecompress(inbuf, in_size, outbuf, out_size);
+	default:
+		return VBERROR_SUCCESS;
+	}
+}
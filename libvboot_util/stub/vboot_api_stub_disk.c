@@ -9,36 +9,237 @@
 
 #define _STUB_IMPLEMENTATION_
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "vboot_api.h"
+#include "vboot_api_stub_disk.h"
+
+/* A disk image opened by VbExDiskOpenFile(). Any other handle is ignored. */
+#define FILE_DISK_MAGIC 0x6b736466  /* "fdsk" */
+
+typedef struct FileDisk {
+  uint32_t magic;
+  int fd;
+  uint64_t bytes_per_lba;
+  uint64_t size;
+  const char* name;
+  struct FileDisk* next;        /* in the list VbExDiskGetInfo() returns */
+  void (*read_hook)(void* arg, uint64_t offset, uint64_t bytes);
+  void* read_hook_arg;
+} FileDisk;
+
+/* The disks that are open, most recent first */
+static FileDisk* file_disks;
+static pthread_mutex_t file_disks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int IsFileDisk(VbExDiskHandle_t handle) {
+  return handle && ((FileDisk*)handle)->magic == FILE_DISK_MAGIC;
+}
+
+
+VbError_t VbExDiskOpenFile(const char* filename, uint64_t bytes_per_lba,
+                           VbDiskInfo* info) {
+  FileDisk* d;
+  struct stat sb;
+  off_t size;
+  int fd;
+
+  if (!bytes_per_lba)
+    return VBERROR_UNKNOWN;
+
+  fd = open(filename, O_RDWR);
+  if (fd < 0)
+    fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return VBERROR_UNKNOWN;
+
+  /* lseek() works for block devices, where st_size doesn't */
+  size = lseek(fd, 0, SEEK_END);
+  if (fstat(fd, &sb) || size < 0 || !(d = malloc(sizeof(*d)))) {
+    close(fd);
+    return VBERROR_UNKNOWN;
+  }
+  memset(d, 0, sizeof(*d));
+  d->magic = FILE_DISK_MAGIC;
+  d->fd = fd;
+  d->bytes_per_lba = bytes_per_lba;
+  d->size = size;
+  d->name = filename;
+
+  pthread_mutex_lock(&file_disks_lock);
+  d->next = file_disks;
+  file_disks = d;
+  pthread_mutex_unlock(&file_disks_lock);
+
+  memset(info, 0, sizeof(*info));
+  info->handle = d;
+  info->bytes_per_lba = bytes_per_lba;
+  info->lba_count = d->size / bytes_per_lba;
+  info->flags = VB_DISK_FLAG_FIXED;
+  info->name = filename;
+  return VBERROR_SUCCESS;
+}
+
+
+void VbExDiskCloseFile(VbExDiskHandle_t handle) {
+  FileDisk* d = handle;
+  FileDisk** p;
+
+  if (!IsFileDisk(handle))
+    return;
+  pthread_mutex_lock(&file_disks_lock);
+  for (p = &file_disks; *p; p = &(*p)->next) {
+    if (*p == d) {
+      *p = d->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&file_disks_lock);
+  close(d->fd);
+  d->magic = 0;
+  free(d);
+}
+
+
+uint64_t VbExDiskFileBytesPerLba(VbExDiskHandle_t handle) {
+  return IsFileDisk(handle) ? ((FileDisk*)handle)->bytes_per_lba : 0;
+}
+
+
+void VbExDiskSetReadHook(VbExDiskHandle_t handle,
+                         void (*hook)(void* arg, uint64_t offset,
+                                      uint64_t bytes),
+                         void* arg) {
+  FileDisk* d = handle;
+
+  if (!IsFileDisk(handle))
+    return;
+  d->read_hook = hook;
+  d->read_hook_arg = arg;
+}
+
+
+VbError_t VbExDiskReadBytes(VbExDiskHandle_t handle, uint64_t offset,
+                            uint32_t bytes, void* buffer) {
+  FileDisk* d = handle;
+  uint32_t done = 0;
+  ssize_t n;
+
+  if (!IsFileDisk(handle) || offset > d->size || bytes > d->size - offset)
+    return VBERROR_UNKNOWN;
+  if (d->read_hook)
+    d->read_hook(d->read_hook_arg, offset, bytes);
+
+  while (done < bytes) {
+    n = pread(d->fd, (uint8_t*)buffer + done, bytes - done, offset + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return VBERROR_UNKNOWN;
+    done += n;
+  }
+  return VBERROR_SUCCESS;
+}
+
+
+void VbExDiskPrefetch(VbExDiskHandle_t handle, uint64_t offset,
+                      uint64_t bytes) {
+#ifdef POSIX_FADV_WILLNEED
+  FileDisk* d = handle;
+
+  if (IsFileDisk(handle) && offset < d->size)
+    posix_fadvise(d->fd, offset, bytes, POSIX_FADV_WILLNEED);
+#endif
+}
 
 
 VbError_t VbExDiskGetInfo(VbDiskInfo** infos_ptr, uint32_t* count,
                           uint32_t disk_flags) {
+  VbDiskInfo* info;
+  FileDisk* d;
+  uint32_t n = 0;
+
   *infos_ptr = NULL;
   *count = 0;
+
+  /* The file-backed disks are all fixed ones */
+  if (!(disk_flags & VB_DISK_FLAG_FIXED))
+    return VBERROR_SUCCESS;
+
+  pthread_mutex_lock(&file_disks_lock);
+  for (d = file_disks; d; d = d->next)
+    n++;
+  info = n ? calloc(n, sizeof(*info)) : NULL;
+  if (info) {
+    /* In the order they were opened */
+    for (d = file_disks; d; d = d->next) {
+      n--;
+      info[n].handle = d;
+      info[n].bytes_per_lba = d->bytes_per_lba;
+      info[n].lba_count = d->size / d->bytes_per_lba;
+      info[n].flags = VB_DISK_FLAG_FIXED;
+      info[n].name = d->name;
+      (*count)++;
+    }
+    *infos_ptr = info;
+  }
+  pthread_mutex_unlock(&file_disks_lock);
   return VBERROR_SUCCESS;
 }
 
 
 VbError_t VbExDiskFreeInfo(VbDiskInfo* infos_ptr,
                            VbExDiskHandle_t preserve_handle) {
+  free(infos_ptr);
   return VBERROR_SUCCESS;
 }
 
 
 VbError_t VbExDiskRead(VbExDiskHandle_t handle, uint64_t lba_start,
                        uint64_t lba_count, void* buffer) {
-  return VBERROR_SUCCESS;
+  FileDisk* d = handle;
+
+  if (!IsFileDisk(handle))
+    return VBERROR_SUCCESS;
+  if (lba_count * d->bytes_per_lba > UINT32_MAX)
+    return VBERROR_UNKNOWN;
+  return VbExDiskReadBytes(handle, lba_start * d->bytes_per_lba,
+                           lba_count * d->bytes_per_lba, buffer);
 }
 
 
 VbError_t VbExDiskWrite(VbExDiskHandle_t handle, uint64_t lba_start,
                         uint64_t lba_count, const void* buffer) {
+  FileDisk* d = handle;
+  uint64_t offset, bytes, done = 0;
+  ssize_t n;
+
+  if (!IsFileDisk(handle))
+    return VBERROR_SUCCESS;
+
+  offset = lba_start * d->bytes_per_lba;
+  bytes = lba_count * d->bytes_per_lba;
+  if (offset > d->size || bytes > d->size - offset)
+    return VBERROR_UNKNOWN;
+
+  while (done < bytes) {
+    n = pwrite(d->fd, (const uint8_t*)buffer + done, bytes - done,
+               offset + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return VBERROR_UNKNOWN;
+    done += n;
+  }
   return VBERROR_SUCCESS;
 }
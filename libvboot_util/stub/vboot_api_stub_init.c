@@ -16,41 +16,55 @@
 #include <sys/time.h>
 
 #include "vboot_api.h"
+#include "vboot_api_stub_init.h"
 
 /* U-Boot's printf uses '%L' for uint64_t. gcc uses '%l'. */
 #define MAX_FMT 255
-static char fmtbuf[MAX_FMT+1];
 
-static const char *fixfmt(const char *format)
+/* Copies [format] to [buf], which has room for MAX_FMT characters */
+static const char *fixfmt(const char *format, char *buf)
 {
 	int i;
 	for(i=0; i<MAX_FMT && format[i]; i++) {
-		fmtbuf[i] = format[i];
+		buf[i] = format[i];
 		if(format[i] == '%' && format[i+1] == 'L') {
-			fmtbuf[i+1] = 'l';
+			buf[i+1] = 'l';
 			i++;
 		}
 	}
-	fmtbuf[i] = '\0';
-	return fmtbuf;
+	buf[i] = '\0';
+	return buf;
+}
+
+static void (*debug_hook)(const char *format, va_list ap);
+
+void VbExSetDebugHook(void (*hook)(const char *format, va_list ap))
+{
+	debug_hook = hook;
 }
 
 void VbExError(const char *format, ...)
 {
+	char fmtbuf[MAX_FMT + 1];
 	va_list ap;
 	va_start(ap, format);
 	fprintf(stderr, "ERROR: ");
-	vfprintf(stderr, fixfmt(format), ap);
+	vfprintf(stderr, fixfmt(format, fmtbuf), ap);
 	va_end(ap);
 	exit(1);
 }
 
 void VbExDebug(const char *format, ...)
 {
+	char fmtbuf[MAX_FMT + 1];
 	va_list ap;
 	va_start(ap, format);
-	fprintf(stderr, "DEBUG: ");
-	vfprintf(stderr, fixfmt(format), ap);
+	if (debug_hook) {
+		debug_hook(fixfmt(format, fmtbuf), ap);
+	} else {
+		fprintf(stderr, "DEBUG: ");
+		vfprintf(stderr, fixfmt(format, fmtbuf), ap);
+	}
 	va_end(ap);
 }
 
@@ -0,0 +1,65 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Stub VbExMalloc() and VbExFree() for release builds of host tools.
+ *
+ * These only count what is live, so both are O(1) and take no locks.  To
+ * find out where leaked or invalid pointers came from, link
+ * vboot_api_stub_malloc_debug.o ahead of libvboot_util.a instead (for
+ * futility, "make MALLOC_DEBUG=1"); it defines the same four functions,
+ * so this file is then not pulled out of the library.
+ */
+
+#include <stdint.h>
+
+#define _STUB_IMPLEMENTATION_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vboot_api.h"
+#include "vboot_api_stub_malloc.h"
+
+static uint64_t live_allocs;
+static uint64_t total_allocs;
+
+void *VbExMalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p) {
+		/* Fatal Error. We must abort. */
+		abort();
+	}
+
+	__sync_fetch_and_add(&live_allocs, 1);
+	__sync_fetch_and_add(&total_allocs, 1);
+	return p;
+}
+
+void VbExFree(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	__sync_fetch_and_sub(&live_allocs, 1);
+	free(ptr);
+}
+
+int vboot_api_stub_check_memory(void)
+{
+	uint64_t live = __sync_fetch_and_add(&live_allocs, 0);
+
+	if (!live)
+		return 0;
+
+	fprintf(stderr, "\nWarning, %llu allocations not freed\n",
+		(unsigned long long)live);
+	return -1;
+}
+
+uint64_t vboot_api_stub_alloc_count(void)
+{
+	return __sync_fetch_and_add(&total_allocs, 0);
+}
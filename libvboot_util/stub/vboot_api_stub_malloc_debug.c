@@ -0,0 +1,471 @@
+/* Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Stub VbExMalloc() and VbExFree() that track every allocation, so
+ * vboot_api_stub_check_memory() can say where leaks came from and
+ * VbExFree() can catch pointers it never handed out.
+ *
+ * They can also profile the allocations, adding up how many there were,
+ * how many bytes and the most bytes live at once for each call stack, to
+ * find the ones worth getting rid of. Set either or both of these in the
+ * environment, and the profile is written at exit:
+ *
+ *   VBOOT_ALLOC_PROFILE=FILE  A report, biggest call stacks first ("-"
+ *                             for stderr)
+ *   VBOOT_ALLOC_PPROF=FILE    A heap profile, for "pprof BINARY FILE"
+ *
+ * This is not part of libvboot_util.a.  Link it ahead of the library to
+ * replace vboot_api_stub_malloc.o.
+ */
+
+#ifdef __linux__
+#include <features.h> /* for __GLIBC__ */
+#endif
+
+#ifdef __GLIBC__
+#include <execinfo.h>
+#endif
+#include <stdint.h>
+
+#define _STUB_IMPLEMENTATION_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vboot_api.h"
+#include "vboot_api_stub_malloc.h"
+
+#define MAX_STACK_LEVELS 10
+
+/* Buckets in the table to start with; it doubles as it fills up */
+#define ALLOC_MIN_BUCKETS 1024
+
+/* Buckets in the profile's table of call stacks; it doesn't grow */
+#define SITE_BUCKETS 4096
+
+/* How much of each call stack the report shows */
+#define REPORT_LEVELS 4
+
+/* Everything allocated from one call stack, when profiling */
+struct alloc_site {
+	struct alloc_site *next;
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t live_count;
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+	void *stack[MAX_STACK_LEVELS];
+	int levels;
+};
+
+/* Keep track of nodes that are currently allocated */
+struct alloc_node {
+	struct alloc_node *next;
+	void *ptr;
+	size_t size;
+	struct alloc_site *site;	/* NULL unless profiling */
+#ifdef __GLIBC__
+	void *bt_buffer[MAX_STACK_LEVELS];
+	int bt_levels;
+#endif
+};
+
+/* Chained hash table keyed on ptr, so lookups don't scale with live nodes */
+static struct alloc_node **alloc_table;
+static size_t alloc_buckets;
+static size_t alloc_count;
+static uint64_t alloc_total;		/* ever */
+/* Host tools may allocate from several threads */
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The profile, if one was asked for; NULL site_table if not */
+static const char *profile_file, *pprof_file;
+static struct alloc_site **site_table;
+static size_t site_count;
+static uint64_t live_bytes, peak_bytes;
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+
+static size_t hash_ptr(const void *ptr, size_t buckets)
+{
+	uint64_t h = (uintptr_t)ptr;
+
+	/* Allocations are aligned, so mix the high bits down */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (size_t)h & (buckets - 1);
+}
+
+/* Grow the table once it averages two nodes per bucket.  Lock held. */
+static void maybe_grow_table(void)
+{
+	struct alloc_node **table, *node, *next;
+	size_t buckets, i, b;
+
+	if (alloc_table && alloc_count < 2 * alloc_buckets)
+		return;
+
+	buckets = alloc_table ? 2 * alloc_buckets : ALLOC_MIN_BUCKETS;
+	table = calloc(buckets, sizeof(*table));
+	if (!table) {
+		if (alloc_table)
+			return;		/* Just gets slower */
+		abort();
+	}
+
+	for (i = 0; i < alloc_buckets; i++) {
+		for (node = alloc_table[i]; node; node = next) {
+			next = node->next;
+			b = hash_ptr(node->ptr, buckets);
+			node->next = table[b];
+			table[b] = node;
+		}
+	}
+	free(alloc_table);
+	alloc_table = table;
+	alloc_buckets = buckets;
+}
+
+/* Finds or adds the site for [stack]. Lock held. */
+static struct alloc_site *find_site(void **stack, int levels)
+{
+	struct alloc_site *site;
+	uint64_t h = levels;
+	size_t b;
+	int i;
+
+	for (i = 0; i < levels; i++)
+		h = (h ^ (uintptr_t)stack[i]) * 0x100000001b3ULL;
+	b = (h ^ h >> 32) & (SITE_BUCKETS - 1);
+
+	for (site = site_table[b]; site; site = site->next)
+		if (site->levels == levels &&
+		    !memcmp(site->stack, stack, levels * sizeof(*stack)))
+			return site;
+
+	site = calloc(1, sizeof(*site));
+	if (!site)
+		return NULL;
+	if (levels)
+		memcpy(site->stack, stack, levels * sizeof(*stack));
+	site->levels = levels;
+	site->next = site_table[b];
+	site_table[b] = site;
+	site_count++;
+	return site;
+}
+
+/* Counts [node] against the stack it was allocated from. Lock held. */
+static void profile_alloc(struct alloc_node *node)
+{
+	struct alloc_site *site;
+
+#ifdef __GLIBC__
+	/* VbExMalloc() itself is the same every time */
+	site = node->bt_levels > 1 ?
+		find_site(node->bt_buffer + 1, node->bt_levels - 1) :
+		find_site(NULL, 0);
+#else
+	site = find_site(NULL, 0);
+#endif
+	if (!site)
+		return;
+
+	node->site = site;
+	site->count++;
+	site->bytes += node->size;
+	site->live_count++;
+	site->live_bytes += node->size;
+	if (site->peak_bytes < site->live_bytes)
+		site->peak_bytes = site->live_bytes;
+	live_bytes += node->size;
+	if (peak_bytes < live_bytes)
+		peak_bytes = live_bytes;
+}
+
+/* Lock held */
+static void profile_free(struct alloc_node *node)
+{
+	if (!node->site)
+		return;
+	node->site->live_count--;
+	node->site->live_bytes -= node->size;
+	live_bytes -= node->size;
+}
+
+/* Most bytes first */
+static int compare_sites(const void *a, const void *b)
+{
+	const struct alloc_site *x = *(const struct alloc_site * const *)a;
+	const struct alloc_site *y = *(const struct alloc_site * const *)b;
+
+	if (x->bytes != y->bytes)
+		return x->bytes < y->bytes ? 1 : -1;
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return 0;
+}
+
+static void write_report(FILE *fp, struct alloc_site **sites, size_t count)
+{
+	uint64_t total_count = 0, total_bytes = 0;
+	char **names = NULL;
+	size_t i;
+	int j, levels;
+
+	for (i = 0; i < count; i++) {
+		total_count += sites[i]->count;
+		total_bytes += sites[i]->bytes;
+	}
+	fprintf(fp, "VbExMalloc() profile: %" PRIu64 " allocations of %"
+		PRIu64 " bytes, at most %" PRIu64 " bytes live at once\n\n",
+		total_count, total_bytes, peak_bytes);
+	fprintf(fp, "%10s %14s %12s  %s\n",
+		"count", "bytes", "peak live", "allocated from");
+
+	for (i = 0; i < count; i++) {
+		fprintf(fp, "%10" PRIu64 " %14" PRIu64 " %12" PRIu64,
+			sites[i]->count, sites[i]->bytes,
+			sites[i]->peak_bytes);
+		levels = sites[i]->levels < REPORT_LEVELS ?
+			sites[i]->levels : REPORT_LEVELS;
+#ifdef __GLIBC__
+		names = backtrace_symbols(sites[i]->stack, levels);
+#endif
+		if (!levels)
+			fprintf(fp, "  ?\n");
+		for (j = 0; j < levels; j++)
+			fprintf(fp, "%*s%s\n", j ? 40 : 2, "",
+				names ? names[j] : "?");
+		free(names);
+	}
+}
+
+/*
+ * The heap profile format of gperftools, which pprof reads: what's live and
+ * what was allocated in all for each stack, then the mappings, so that it
+ * can find the symbols for the addresses.
+ */
+static void write_pprof(FILE *fp, struct alloc_site **sites, size_t count)
+{
+	uint64_t live_count = 0, total_count = 0, total_bytes = 0;
+	char buf[4096];
+	FILE *maps;
+	size_t i, n;
+	int j;
+
+	for (i = 0; i < count; i++) {
+		live_count += sites[i]->live_count;
+		total_count += sites[i]->count;
+		total_bytes += sites[i]->bytes;
+	}
+	fprintf(fp, "heap profile: %" PRIu64 ": %" PRIu64 " [%" PRIu64 ": %"
+		PRIu64 "] @ heapprofile\n",
+		live_count, live_bytes, total_count, total_bytes);
+
+	for (i = 0; i < count; i++) {
+		fprintf(fp, "%" PRIu64 ": %" PRIu64 " [%" PRIu64 ": %" PRIu64
+			"] @", sites[i]->live_count, sites[i]->live_bytes,
+			sites[i]->count, sites[i]->bytes);
+		for (j = 0; j < sites[i]->levels; j++)
+			fprintf(fp, " %p", sites[i]->stack[j]);
+		fprintf(fp, "\n");
+	}
+
+	fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+	maps = fopen("/proc/self/maps", "r");
+	if (!maps)
+		return;
+	while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+		fwrite(buf, 1, n, fp);
+	fclose(maps);
+}
+
+static void write_profile(const char *filename,
+			  void (*write)(FILE *fp, struct alloc_site **sites,
+					size_t count),
+			  struct alloc_site **sites, size_t count)
+{
+	FILE *fp;
+
+	fp = strcmp(filename, "-") ? fopen(filename, "w") : stderr;
+	if (!fp) {
+		fprintf(stderr, "Can't write the allocation profile to %s\n",
+			filename);
+		return;
+	}
+	write(fp, sites, count);
+	if (fp == stderr)
+		fflush(fp);
+	else if (fclose(fp))
+		fprintf(stderr, "Can't write the allocation profile to %s\n",
+			filename);
+}
+
+static void profile_dump(void)
+{
+	struct alloc_site **sites, *site;
+	size_t i, n = 0;
+
+	pthread_mutex_lock(&alloc_lock);
+	sites = malloc((site_count + 1) * sizeof(*sites));
+	if (sites) {
+		for (i = 0; i < SITE_BUCKETS; i++)
+			for (site = site_table[i]; site; site = site->next)
+				sites[n++] = site;
+		qsort(sites, n, sizeof(*sites), compare_sites);
+		if (profile_file)
+			write_profile(profile_file, write_report, sites, n);
+		if (pprof_file)
+			write_profile(pprof_file, write_pprof, sites, n);
+		free(sites);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+static void profile_init(void)
+{
+	profile_file = getenv("VBOOT_ALLOC_PROFILE");
+	pprof_file = getenv("VBOOT_ALLOC_PPROF");
+	if (profile_file && !*profile_file)
+		profile_file = NULL;
+	if (pprof_file && !*pprof_file)
+		pprof_file = NULL;
+	if (!profile_file && !pprof_file)
+		return;
+
+	site_table = calloc(SITE_BUCKETS, sizeof(*site_table));
+	if (!site_table || atexit(profile_dump)) {
+		fprintf(stderr, "Can't profile allocations\n");
+		free(site_table);
+		site_table = NULL;
+	}
+}
+
+#ifdef __GLIBC__
+static void print_stacktrace(void)
+{
+	void *buffer[MAX_STACK_LEVELS];
+	int levels = backtrace(buffer, MAX_STACK_LEVELS);
+
+	// print to stderr (fd = 2), and remove this function from the trace
+	backtrace_symbols_fd(buffer + 1, levels - 1, 2);
+}
+#endif
+
+void *VbExMalloc(size_t size)
+{
+	struct alloc_node *node;
+	size_t b;
+	void *p = malloc(size);
+
+	if (!p) {
+		/* Fatal Error. We must abort. */
+		abort();
+	}
+
+	node = malloc(sizeof(*node));
+	if (!node)
+		abort();
+	node->ptr = p;
+	node->size = size;
+	node->site = NULL;
+#ifdef __GLIBC__
+	node->bt_levels = backtrace(node->bt_buffer, MAX_STACK_LEVELS);
+#endif
+	pthread_once(&profile_once, profile_init);
+	pthread_mutex_lock(&alloc_lock);
+	if (site_table)
+		profile_alloc(node);
+	maybe_grow_table();
+	b = hash_ptr(p, alloc_buckets);
+	node->next = alloc_table[b];
+	alloc_table[b] = node;
+	alloc_count++;
+	alloc_total++;
+	pthread_mutex_unlock(&alloc_lock);
+
+	return p;
+}
+
+void VbExFree(void *ptr)
+{
+	struct alloc_node **nodep, *node = NULL;
+
+	pthread_mutex_lock(&alloc_lock);
+	if (alloc_table) {
+		nodep = &alloc_table[hash_ptr(ptr, alloc_buckets)];
+		for (; *nodep; nodep = &(*nodep)->next) {
+			if ((*nodep)->ptr == ptr) {
+				node = *nodep;
+				*nodep = node->next;
+				alloc_count--;
+				profile_free(node);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	if (node) {
+		free(node);
+	} else {
+		fprintf(stderr, "\n>>>>>> Invalid VbExFree() %p\n", ptr);
+		fflush(stderr);
+#ifdef __GLIBC__
+		print_stacktrace();
+#endif
+		/*
+		 * Fall through and do the free() so we get normal error
+		 * handling.
+		 */
+	}
+
+	free(ptr);
+}
+
+int vboot_api_stub_check_memory(void)
+{
+	struct alloc_node *node, *next;
+	size_t i;
+
+	if (!alloc_count)
+		return 0;
+
+	/*
+	 * Make sure we free all our memory so that valgrind doesn't complain
+	 * about leaked memory.
+	 */
+	fprintf(stderr, "\nWarning, some allocations not freed:");
+	for (i = 0; i < alloc_buckets; i++) {
+		for (node = alloc_table[i]; node; node = next) {
+			next = node->next;
+			fprintf(stderr, "\nptr=%p, size=%zd\n",
+				node->ptr, node->size);
+			fflush(stderr);
+#ifdef __GLIBC__
+			backtrace_symbols_fd(node->bt_buffer + 1,
+					     node->bt_levels - 1, 2);
+#endif
+			free(node);
+		}
+		alloc_table[i] = NULL;
+	}
+	alloc_count = 0;
+
+	return -1;
+}
+
+uint64_t vboot_api_stub_alloc_count(void)
+{
+	uint64_t total;
+
+	pthread_mutex_lock(&alloc_lock);
+	total = alloc_total;
+	pthread_mutex_unlock(&alloc_lock);
+	return total;
+}
@@ -12,10 +12,11 @@
 #include <stdlib.h>
 
 #include "vboot_api.h"
+#include "vboot_api_stub_sf.h"
 
 VbError_t VbExRegionRead(VbCommonParams *cparams,
 			 enum vb_firmware_region region, uint32_t offset,
 			 uint32_t size, void *buf)
 {
-	return VBERROR_SUCCESS;
+	return VbExFirmwareRegionRead(cparams, region, offset, size, buf);
 }
@@ -5,139 +5,233 @@
  * Stub implementations of firmware-provided API functions.
  */
 
-#ifdef __linux__
-#include <features.h> /* for __GLIBC__ */
-#endif
-
-#ifdef __GLIBC__
-#include <execinfo.h>
-#endif
 #include <stdint.h>
 
 #define _STUB_IMPLEMENTATION_
 
-#include <stdarg.h>
-#include <stdio.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "fmap.h"
 #include "vboot_api.h"
-
-#define MAX_STACK_LEVELS 10
-
-
-/* Keep track of nodes that are currently allocated */
-struct alloc_node {
-	struct alloc_node *next;
-	void *ptr;
-	size_t size;
-#ifdef __GLIBC__
-	void *bt_buffer[MAX_STACK_LEVELS];
-	int bt_levels;
-#endif
-};
-
-static struct alloc_node *alloc_head;
-
-#ifdef __GLIBC__
-static void print_stacktrace(void)
+#include "vboot_api_stub_sf.h"
+#include "vboot_struct.h"
+
+/* VbExMalloc() and VbExFree() are in vboot_api_stub_malloc*.c */
+
+/* An image opened by VbExFirmwareOpenFile(). Any other context is ignored. */
+#define FIRMWARE_FILE_MAGIC 0x77666466  /* "fdfw" */
+
+typedef struct FirmwareFile {
+	uint32_t magic;
+	uint8_t *buf;
+	uint64_t size;
+	uint8_t *body[2];
+	uint32_t body_size[2];
+	uint8_t *gbb;			/* or NULL, if there's no GBB area */
+	uint32_t gbb_size;
+	void (*read_hook)(void *arg, uint64_t offset, uint64_t bytes);
+	void *read_hook_arg;
+} FirmwareFile;
+
+static FirmwareFile *GetFirmwareFile(VbCommonParams *cparams)
 {
-	void *buffer[MAX_STACK_LEVELS];
-	int levels = backtrace(buffer, MAX_STACK_LEVELS);
+	FirmwareFile *f = cparams ? cparams->caller_context : NULL;
 
-	// print to stderr (fd = 2), and remove this function from the trace
-	backtrace_symbols_fd(buffer + 1, levels - 1, 2);
+	return f && f->magic == FIRMWARE_FILE_MAGIC ? f : NULL;
 }
-#endif
 
-void *VbExMalloc(size_t size)
+/* Finds one slot's areas. The body is only as long as its preamble says,
+ * which is no more than FW_MAIN_A/B, since that's what a real firmware
+ * would read; LoadFirmware() still checks everything. */
+static int FindSlot(FirmwareFile *f, FmapHeader *fmap, int slot,
+		    void **vblock, uint32_t *vblock_size)
 {
-	struct alloc_node *node;
-	void *p = malloc(size);
+	static const char * const vblock_name[2] = { "VBLOCK_A", "VBLOCK_B" };
+	static const char * const body_name[2] = { "FW_MAIN_A", "FW_MAIN_B" };
+	VbKeyBlockHeader *key_block;
+	VbFirmwarePreambleHeader *preamble;
+	FmapAreaHeader *ah;
+	uint8_t *p;
+
+	p = fmap_find_by_name(f->buf, f->size, fmap, vblock_name[slot], &ah);
+	if (!p || ah->area_offset + (uint64_t)ah->area_size > f->size)
+		return 1;
+	*vblock = p;
+	*vblock_size = ah->area_size;
+
+	key_block = (VbKeyBlockHeader *)p;
+	if (ah->area_size < sizeof(*key_block) + sizeof(*preamble) ||
+	    key_block->key_block_size > ah->area_size - sizeof(*preamble))
+		return 1;
+	preamble = (VbFirmwarePreambleHeader *)(p + key_block->key_block_size);
+
+	p = fmap_find_by_name(f->buf, f->size, fmap, body_name[slot], &ah);
+	if (!p || ah->area_offset + (uint64_t)ah->area_size > f->size)
+		return 1;
+	f->body[slot] = p;
+	f->body_size[slot] = ah->area_size;
+	if (preamble->body_signature.data_size < f->body_size[slot])
+		f->body_size[slot] = preamble->body_signature.data_size;
+	return 0;
+}
 
-	if (!p) {
-		/* Fatal Error. We must abort. */
-		abort();
+VbError_t VbExFirmwareOpenFile(const char *filename, VbCommonParams *cparams,
+			       VbSelectFirmwareParams *fparams)
+{
+	FirmwareFile *f;
+	FmapHeader *fmap;
+	FmapAreaHeader *ah;
+	struct stat sb;
+	void *buf;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return VBERROR_UNKNOWN;
+	if (fstat(fd, &sb) || sb.st_size <= 0) {
+		close(fd);
+		return VBERROR_UNKNOWN;
+	}
+	buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return VBERROR_UNKNOWN;
+
+	f = malloc(sizeof(*f));
+	if (!f) {
+		munmap(buf, sb.st_size);
+		return VBERROR_UNKNOWN;
+	}
+	memset(f, 0, sizeof(*f));
+	f->magic = FIRMWARE_FILE_MAGIC;
+	f->buf = buf;
+	f->size = sb.st_size;
+
+	fmap = fmap_find(f->buf, f->size);
+	if (fmap) {
+		f->gbb = fmap_find_by_name(f->buf, f->size, fmap, "GBB", &ah);
+		if (f->gbb && ah->area_offset + (uint64_t)ah->area_size <=
+		    f->size)
+			f->gbb_size = ah->area_size;
+		else
+			f->gbb = NULL;
+	}
+	if (!fmap ||
+	    FindSlot(f, fmap, 0, &fparams->verification_block_A,
+		     &fparams->verification_size_A) ||
+	    FindSlot(f, fmap, 1, &fparams->verification_block_B,
+		     &fparams->verification_size_B)) {
+		munmap(f->buf, f->size);
+		free(f);
+		return VBERROR_UNKNOWN;
 	}
 
-	node = malloc(sizeof(*node));
-	if (!node)
-		abort();
-	node->next = alloc_head;
-	node->ptr = p;
-	node->size = size;
-#ifdef __GLIBC__
-	node->bt_levels = backtrace(node->bt_buffer, MAX_STACK_LEVELS);
-#endif
-	alloc_head = node;
-
-	return p;
+	cparams->caller_context = f;
+	return VBERROR_SUCCESS;
 }
 
-static struct alloc_node **find_node(void *ptr)
+void VbExFirmwareCloseFile(VbCommonParams *cparams)
 {
-	struct alloc_node **nodep;
+	FirmwareFile *f = GetFirmwareFile(cparams);
 
-	for (nodep = &alloc_head; *nodep; nodep = &(*nodep)->next)
-		if ((*nodep)->ptr == ptr)
-			return nodep;
-
-	return NULL;
+	if (!f)
+		return;
+	munmap(f->buf, f->size);
+	free(f);
+	cparams->caller_context = NULL;
 }
 
-void VbExFree(void *ptr)
+void VbExFirmwareSetReadHook(VbCommonParams *cparams,
+			     void (*hook)(void *arg, uint64_t offset,
+					  uint64_t bytes),
+			     void *arg)
 {
-	struct alloc_node **nodep, *next;
-
-	nodep = find_node(ptr);
-	if (nodep) {
-		next = (*nodep)->next;
-		free(*nodep);
-		*nodep = next;
-	} else {
-		fprintf(stderr, "\n>>>>>> Invalid VbExFree() %p\n", ptr);
-		fflush(stderr);
-#ifdef __GLIBC__
-		print_stacktrace();
-#endif
-		/*
-		 * Fall through and do the free() so we get normal error
-		 * handling.
-		 */
-	}
+	FirmwareFile *f = GetFirmwareFile(cparams);
 
-	free(ptr);
+	if (!f)
+		return;
+	f->read_hook = hook;
+	f->read_hook_arg = arg;
 }
 
-VbError_t VbExHashFirmwareBody(VbCommonParams *cparams,
-                               uint32_t firmware_index)
+VbError_t VbExFirmwareRegionRead(VbCommonParams *cparams,
+				 enum vb_firmware_region region,
+				 uint32_t offset, uint32_t size, void *buf)
 {
+	FirmwareFile *f = GetFirmwareFile(cparams);
+
+	if (!f)
+		return VBERROR_SUCCESS;
+	if (region != VB_REGION_GBB || !f->gbb)
+		return VBERROR_REGION_READ_INVALID;
+	if (offset > f->gbb_size || size > f->gbb_size - offset)
+		return VBERROR_REGION_READ_INVALID;
+	if (f->read_hook)
+		f->read_hook(f->read_hook_arg, f->gbb - f->buf + offset, size);
+	memcpy(buf, f->gbb + offset, size);
 	return VBERROR_SUCCESS;
 }
 
-int vboot_api_stub_check_memory(void)
+VbError_t VbExFirmwareBodyPrefetch(VbCommonParams *cparams,
+                                   uint32_t firmware_index,
+                                   uint32_t size_hint)
 {
-	struct alloc_node *node, *next;
-
-	if (!alloc_head)
-		return 0;
-
-	/*
-	 * Make sure we free all our memory so that valgrind doesn't complain
-	 * about leaked memory.
-	 */
-	fprintf(stderr, "\nWarning, some allocations not freed:");
-	for (node = alloc_head; node; node = next) {
-		next = node->next;
-		fprintf(stderr, "\nptr=%p, size=%zd\n", node->ptr, node->size);
-		fflush(stderr);
-#ifdef __GLIBC__
-		backtrace_symbols_fd(node->bt_buffer + 1, node->bt_levels - 1,
-				     2);
-#endif
-		free(node);
-	}
+	FirmwareFile *f = GetFirmwareFile(cparams);
+	uintptr_t start;
+	uint32_t size;
+	int slot;
+
+	if (!f)
+		return VBERROR_SUCCESS;
+
+	if (firmware_index == VB_SELECT_FIRMWARE_A)
+		slot = 0;
+	else if (firmware_index == VB_SELECT_FIRMWARE_B)
+		slot = 1;
+	else
+		return VBERROR_UNKNOWN;
+
+	/* Have the kernel read it in while LoadFirmware() checks signatures */
+	size = f->body_size[slot];
+	if (size_hint && size_hint < size)
+		size = size_hint;
+	start = (uintptr_t)f->body[slot] & ~(uintptr_t)4095;
+	madvise((void *)start, (uintptr_t)f->body[slot] + size - start,
+		MADV_WILLNEED);
+	return VBERROR_SUCCESS;
+}
 
-	return -1;
+VbError_t VbExHashFirmwareBody(VbCommonParams *cparams,
+                               uint32_t firmware_index)
+{
+	FirmwareFile *f = GetFirmwareFile(cparams);
+	uint32_t offset, chunk;
+	int slot;
+
+	if (!f)
+		return VBERROR_SUCCESS;
+
+	if (firmware_index == VB_SELECT_FIRMWARE_A)
+		slot = 0;
+	else if (firmware_index == VB_SELECT_FIRMWARE_B)
+		slot = 1;
+	else
+		return VBERROR_UNKNOWN;
+
+	for (offset = 0; offset < f->body_size[slot]; offset += chunk) {
+		chunk = f->body_size[slot] - offset;
+		if (chunk > VB_FIRMWARE_FILE_CHUNK)
+			chunk = VB_FIRMWARE_FILE_CHUNK;
+		if (f->read_hook)
+			f->read_hook(f->read_hook_arg,
+				     f->body[slot] - f->buf + offset, chunk);
+		VbUpdateFirmwareBodyHash(cparams, f->body[slot] + offset,
+					 chunk);
+	}
+	return VBERROR_SUCCESS;
 }
@@ -9,21 +9,41 @@
 
 #define _STUB_IMPLEMENTATION_
 
+#include <string.h>
+
 #include "vboot_api.h"
+#include "vboot_api_stub_disk.h"
 
-/* The stub implementation assumes 512-byte disk sectors */
+/* Sector size for disks that don't say what theirs is */
 #define LBA_BYTES 512
 
-/* Internal struct to simulate a stream for sector-based disks */
+/*
+ * How far ahead to ask a file-backed disk to read. This matches the first
+ * read LoadKernel() does on each partition, so the keyblock and preamble are
+ * on their way as soon as the stream is opened.
+ */
+#define STREAM_READAHEAD 65536
+
+/*
+ * A stream over VbExDiskRead(), which only reads whole sectors. Reads of
+ * any byte range work: the whole sectors in the middle of one go straight
+ * into the caller's buffer, and a partial sector at either end goes through
+ * a one-sector bounce buffer. That keeps the last sector read, so the next
+ * read, which usually starts in it, doesn't read it again.
+ */
 struct disk_stream {
 	/* Disk handle */
 	VbExDiskHandle_t handle;
+	uint64_t bytes_per_lba;
 
-	/* Next sector to read */
-	uint64_t sector;
+	/* Disk byte offset of the next byte to read, and bytes left */
+	uint64_t offset;
+	uint64_t bytes_left;
 
-	/* Number of sectors left in partition */
-	uint64_t sectors_left;
+	/* One sector, and which one it holds if bounce_valid */
+	uint8_t *bounce;
+	uint64_t bounce_lba;
+	int bounce_valid;
 };
 
 VbError_t VbExStreamOpen(VbExDiskHandle_t handle, uint64_t lba_start,
@@ -38,39 +58,92 @@ VbError_t VbExStreamOpen(VbExDiskHandle_t handle, uint64_t lba_start,
 
 	s = VbExMalloc(sizeof(*s));
 	s->handle = handle;
-	s->sector = lba_start;
-	s->sectors_left = lba_count;
+	s->bytes_per_lba = VbExDiskFileBytesPerLba(handle);
+	if (!s->bytes_per_lba)
+		s->bytes_per_lba = LBA_BYTES;
+	s->offset = lba_start * s->bytes_per_lba;
+	s->bytes_left = lba_count * s->bytes_per_lba;
+	s->bounce = VbExMalloc(s->bytes_per_lba);
+	s->bounce_valid = 0;
+
+	VbExDiskPrefetch(handle, s->offset, STREAM_READAHEAD);
 
 	*stream = (void *)s;
 
 	return VBERROR_SUCCESS;
 }
 
+/* Read [bytes] bytes, all within one sector, through the bounce buffer */
+static VbError_t StreamReadBounce(struct disk_stream *s, uint32_t bytes,
+				  uint8_t *buffer)
+{
+	uint64_t lba = s->offset / s->bytes_per_lba;
+	VbError_t rv;
+
+	if (!s->bounce_valid || s->bounce_lba != lba) {
+		s->bounce_valid = 0;
+		rv = VbExDiskRead(s->handle, lba, 1, s->bounce);
+		if (rv != VBERROR_SUCCESS)
+			return rv;
+		s->bounce_lba = lba;
+		s->bounce_valid = 1;
+	}
+
+	memcpy(buffer, s->bounce + s->offset % s->bytes_per_lba, bytes);
+	s->offset += bytes;
+	return VBERROR_SUCCESS;
+}
+
 VbError_t VbExStreamRead(VbExStream_t stream, uint32_t bytes, void *buffer)
 {
 	struct disk_stream *s = (struct disk_stream *)stream;
+	uint8_t *buf = (uint8_t *)buffer;
 	uint64_t sectors;
+	uint32_t n;
 	VbError_t rv;
 
 	if (!s)
 		return VBERROR_UNKNOWN;
 
-	/* For now, require reads to be a multiple of the LBA size */
-	if (bytes % LBA_BYTES)
-		return VBERROR_UNKNOWN;
-
 	/* Fail on overflow */
-	sectors = bytes / LBA_BYTES;
-	if (sectors > s->sectors_left)
+	if (bytes > s->bytes_left)
 		return VBERROR_UNKNOWN;
+	s->bytes_left -= bytes;
+
+	/* The rest of a sector that's been partly read */
+	if (bytes && s->offset % s->bytes_per_lba) {
+		n = s->bytes_per_lba - s->offset % s->bytes_per_lba;
+		if (n > bytes)
+			n = bytes;
+		rv = StreamReadBounce(s, n, buf);
+		if (rv != VBERROR_SUCCESS)
+			return rv;
+		buf += n;
+		bytes -= n;
+	}
 
-	rv = VbExDiskRead(s->handle, s->sector, sectors, buffer);
-	if (rv != VBERROR_SUCCESS)
-		return rv;
+	/* Whole sectors, straight into the caller's buffer */
+	sectors = bytes / s->bytes_per_lba;
+	if (sectors) {
+		rv = VbExDiskRead(s->handle, s->offset / s->bytes_per_lba,
+				  sectors, buf);
+		if (rv != VBERROR_SUCCESS)
+			return rv;
+		n = sectors * s->bytes_per_lba;
+		s->offset += n;
+		buf += n;
+		bytes -= n;
+	}
 
-	s->sector += sectors;
-	s->sectors_left -= sectors;
+	/* The start of a sector the next read will finish */
+	if (bytes) {
+		rv = StreamReadBounce(s, bytes, buf);
+		if (rv != VBERROR_SUCCESS)
+			return rv;
+	}
 
+	/* Keep one window ahead on file-backed disks */
+	VbExDiskPrefetch(s->handle, s->offset, STREAM_READAHEAD);
 	return VBERROR_SUCCESS;
 }
 
@@ -82,6 +155,7 @@ void VbExStreamClose(VbExStream_t stream)
 	if (!s)
 		return;
 
+	VbExFree(s->bounce);
 	VbExFree(s);
 	return;
 }
@@ -0,0 +1,253 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Writing new files into one tar archive instead of onto the filesystem, so
+ * that a batch making thousands of little ones does one big sequential write
+ * rather than thousands of creates and closes.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "futility.h"
+
+/* Tar works in blocks of this */
+#define TAR_BLOCK 512
+
+/* How much is buffered before it's written out */
+#define ARCHIVE_BUF_SIZE (1 << 20)
+
+/* What every archive ends with, listing what's in it */
+#define ARCHIVE_INDEX_NAME ".index"
+
+/* A POSIX ustar header */
+struct tar_header_s {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	FILE *fp;
+	const char *filename;
+	uint64_t offset;		/* how much has gone in so far */
+	time_t mtime;
+	FILE *index;
+	char *index_buf;
+	size_t index_len;
+	int errors;
+} archive = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Puts [val] in [len] bytes as octal, or base-256 if it's too big */
+static void tar_number(char *field, int len, uint64_t val)
+{
+	int i;
+
+	if (val < (1ULL << (3 * (len - 1)))) {
+		snprintf(field, len, "%0*" PRIo64, len - 1, val);
+		return;
+	}
+	for (i = len - 1; i > 0; i--, val >>= 8)
+		field[i] = val & 0xff;
+	field[0] = (char)0x80;
+}
+
+/*
+ * Fills in [h] for a file called [name] of [size] bytes. Returns non-zero if
+ * the name won't fit, even split between the prefix and name fields.
+ */
+static int tar_header(struct tar_header_s *h, const char *name,
+		      uint64_t size)
+{
+	const char *slash = NULL;
+	size_t len;
+	unsigned int sum = 0;
+	int i;
+
+	len = strlen(name);
+
+	memset(h, 0, sizeof(*h));
+	if (len > sizeof(h->name)) {
+		for (i = 0; i < len && i <= sizeof(h->prefix); i++)
+			if (name[i] == '/')
+				slash = name + i;
+		if (!slash || len - (slash + 1 - name) > sizeof(h->name))
+			return 1;
+		memcpy(h->prefix, name, slash - name);
+		name = slash + 1;
+		len = strlen(name);
+	}
+	if (!len)
+		return 1;
+	memcpy(h->name, name, len);
+
+	tar_number(h->mode, sizeof(h->mode), 0644);
+	tar_number(h->uid, sizeof(h->uid), 0);
+	tar_number(h->gid, sizeof(h->gid), 0);
+	tar_number(h->size, sizeof(h->size), size);
+	tar_number(h->mtime, sizeof(h->mtime), archive.mtime);
+	h->typeflag = '0';
+	memcpy(h->magic, "ustar", 6);
+	memcpy(h->version, "00", 2);
+
+	/* The checksum is taken with its own field as spaces */
+	memset(h->chksum, ' ', sizeof(h->chksum));
+	for (i = 0; i < sizeof(*h); i++)
+		sum += ((uint8_t *)h)[i];
+	snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+	return 0;
+}
+
+/* Adds one member. The lock is held. */
+static int archive_member(const char *name, const struct iovec *iov,
+			  int count)
+{
+	static const uint8_t zeros[TAR_BLOCK];
+	struct tar_header_s h;
+	uint64_t len = 0, pad;
+	int i;
+
+	/* Like tar, store it relative to wherever it's extracted */
+	while (*name == '/')
+		name++;
+
+	for (i = 0; i < count; i++)
+		len += iov[i].iov_len;
+	if (tar_header(&h, name, len)) {
+		fprintf(stderr, "%s: the name is too long for %s\n",
+			name, archive.filename);
+		return 1;
+	}
+
+	fwrite(&h, sizeof(h), 1, archive.fp);
+	for (i = 0; i < count; i++)
+		fwrite(iov[i].iov_base, 1, iov[i].iov_len, archive.fp);
+	pad = (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK;
+	fwrite(zeros, 1, pad, archive.fp);
+	if (ferror(archive.fp)) {
+		fprintf(stderr, "Can't write %s: %s\n",
+			archive.filename, strerror(errno));
+		return 1;
+	}
+
+	if (archive.index)
+		fprintf(archive.index, "%" PRIu64 " %" PRIu64 " %s\n",
+			archive.offset + sizeof(h), len, name);
+	archive.offset += sizeof(h) + len + pad;
+	return 0;
+}
+
+int futil_archive_begin(const char *filename)
+{
+	int fd;
+
+	if (!strcmp(filename, "-"))
+		fd = dup(STDOUT_FILENO);
+	else
+		fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || !(archive.fp = fdopen(fd, "w"))) {
+		fprintf(stderr, "Can't open %s for writing: %s\n",
+			filename, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	setvbuf(archive.fp, NULL, _IOFBF, ARCHIVE_BUF_SIZE);
+
+	archive.filename = filename;
+	archive.offset = 0;
+	archive.mtime = time(NULL);
+	archive.errors = 0;
+	archive.index = open_memstream(&archive.index_buf,
+				       &archive.index_len);
+	return 0;
+}
+
+int futil_archive_active(void)
+{
+	return archive.fp != NULL;
+}
+
+enum futil_file_err futil_archive_write(const char *name,
+					const struct iovec *iov, int count)
+{
+	int rv;
+
+	pthread_mutex_lock(&archive.lock);
+	rv = archive_member(name, iov, count);
+	pthread_mutex_unlock(&archive.lock);
+	return rv ? FILE_ERR_SIZE : FILE_ERR_NONE;
+}
+
+int futil_archive_end(int sync)
+{
+	static const uint8_t zeros[2 * TAR_BLOCK];
+	struct iovec iov;
+	struct stat sb;
+	int errors;
+
+	if (!archive.fp)
+		return 0;
+
+	if (!archive.index || fclose(archive.index)) {
+		fprintf(stderr, "No memory for the index of %s\n",
+			archive.filename);
+		archive.errors++;
+	} else {
+		archive.index = NULL;
+		iov.iov_base = archive.index_buf;
+		iov.iov_len = archive.index_len;
+		if (archive_member(ARCHIVE_INDEX_NAME, &iov, 1))
+			archive.errors++;
+	}
+	archive.index = NULL;
+	free(archive.index_buf);
+	archive.index_buf = NULL;
+
+	/* Two empty blocks mark the end */
+	fwrite(zeros, 1, sizeof(zeros), archive.fp);
+	if (fflush(archive.fp) ||
+	    (sync && !fstat(fileno(archive.fp), &sb) &&
+	     S_ISREG(sb.st_mode) && fdatasync(fileno(archive.fp)))) {
+		fprintf(stderr, "Can't write %s: %s\n",
+			archive.filename, strerror(errno));
+		archive.errors++;
+	}
+	if (fclose(archive.fp)) {
+		fprintf(stderr, "Error when closing %s: %s\n",
+			archive.filename, strerror(errno));
+		archive.errors++;
+	}
+	archive.fp = NULL;
+
+	errors = archive.errors;
+	archive.errors = 0;
+	return errors;
+}
@@ -0,0 +1,884 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Builds a whole disk image, such as a recovery or installer image, from a
+ * layout manifest: the GPT is made in memory, the kernel partitions are
+ * packed and signed in parallel, and then everything is written out front
+ * to back in one pass, instead of one tool after another each going over
+ * the whole image again.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cgptlib_internal.h"
+#include "file_type.h"
+#include "futility.h"
+#include "gpt.h"
+#include "gpt_misc.h"
+#include "host_common.h"
+#include "image_scan.h"
+#include "kernel_blob.h"
+#include "util_misc.h"
+#include "vb1_helper.h"
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] MANIFEST OUTFILE\n"
+	"\n"
+	"Writes the disk image that MANIFEST lays out to OUTFILE, which may\n"
+	"be a file or a block device. Each line of MANIFEST is one partition,\n"
+	"in the order they go on the disk and in the GPT:\n"
+	"\n"
+	"  LABEL TYPE SIZE [KEY=VALUE ...]\n"
+	"\n"
+	"TYPE is kernel, rootfs, data, fs, reserved, efi or firmware. SIZE\n"
+	"may end in K, M or G, or be \"-\" for what --disk-size leaves over.\n"
+	"The KEYs are\n"
+	"\n"
+	"  file=FILE           What goes at the start of a partition that\n"
+	"                        isn't a kernel\n"
+	"  vmlinuz=FILE        The kernel partition's kernel,\n"
+	"  config=FILE           its command line\n"
+	"  bootloader=FILE       and its bootloader stub (all required)\n"
+	"  priority=NUM        Kernel priority, tries and successful flag\n"
+	"  tries=NUM             (default 0 for all of them)\n"
+	"  successful=NUM\n"
+	"\n"
+	"A '#' starts a comment. Partitions start on a 1M boundary. Blocks\n"
+	"of zeroes in the files are left as holes in a sparse OUTFILE.\n"
+	"\n"
+	"Options:\n"
+	"  --keyblock FILE     Kernel keyblock, in .keyblock format\n"
+	"  --signprivate FILE  Kernel data key, in .vbprivk format\n"
+	"  --version NUM       Kernel version (default 1)\n"
+	"  --arch ARCH         CPU architecture (default x86)\n"
+	"  --kloadaddr NUM     Kernel body load address\n"
+	"  --pad NUM           Kernel vblock padding size (default 0x%x)\n"
+	"  --flags NUM         Flags for the kernel preambles\n"
+	"  --disk-size SIZE    Size of the disk (default just big enough)\n"
+	"\n";
+
+#define DEFAULT_PADDING 65536
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog, DEFAULT_PADDING);
+}
+
+/* Partitions start on a multiple of this many sectors, as most tools do */
+#define PART_ALIGN (0x100000 / DISK_SECTOR_SIZE)
+/* How much of a file is read at once */
+#define STREAM_CHUNK 0x100000
+
+/* One line of the manifest */
+struct part_s {
+	char *buf;			/* the manifest line, split up */
+	int lineno;
+	const char *label;
+	Guid type;
+	int kernel;			/* type is "kernel" */
+	uint64_t size;			/* in bytes, or 0 for the rest */
+	const char *file;
+	const char *vmlinuz;
+	const char *config;
+	const char *bootloader;
+	int priority, tries, successful;
+	uint64_t start, sectors;	/* where it went */
+	uint8_t *kpart;			/* a kernel, packed and signed */
+	uint64_t kpart_size;
+	int errorcnt;
+};
+
+struct assemble_s {
+	const char *manifest;
+	struct part_s *part;
+	int count;
+	uint64_t disk_size;		/* in bytes, or 0 */
+	uint64_t sectors;
+	/* For the kernels */
+	VbKeyBlockHeader *keyblock;
+	VbPrivateKey *signpriv_key;
+	int version;
+	enum arch_t arch;
+	uint64_t load_address;
+	uint64_t padding;
+	uint32_t flags;
+	/* For writing */
+	const char *outfile;
+	int sparse;
+	uint64_t data_bytes, hole_bytes;
+};
+
+static int parse_arch(const char *str, enum arch_t *arch)
+{
+	/* The first 3 characters also catch x86_64, arm64 and mips64 */
+	if (!strncasecmp(str, "x86", 3) || !strcasecmp(str, "i386") ||
+	    !strcasecmp(str, "x64") || !strcasecmp(str, "amd64"))
+		*arch = ARCH_X86;
+	else if (!strncasecmp(str, "arm", 3) || !strcasecmp(str, "aarch64"))
+		*arch = ARCH_ARM;
+	else if (!strncasecmp(str, "mips", 3))
+		*arch = ARCH_MIPS;
+	else
+		return 1;
+	return 0;
+}
+
+static int parse_attr(const char *str, int max, int *val)
+{
+	char *e;
+	long v = strtol(str, &e, 0);
+
+	if (!*str || *e || v < 0 || v > max)
+		return 1;
+	*val = v;
+	return 0;
+}
+
+/* Fills in [p] from the words of its line. Returns the number of errors. */
+static int parse_part(struct assemble_s *a, struct part_s *p,
+		      char **argv, int argc)
+{
+	const char *key, *val;
+	char *eq;
+	int errorcnt = 0;
+	int bad = 0;
+	int i;
+
+	if (argc < 3) {
+		fprintf(stderr, "%s:%d: need LABEL TYPE SIZE\n",
+			a->manifest, p->lineno);
+		return 1;
+	}
+	p->label = argv[0];
+	if (strlen(p->label) > ARRAY_SIZE(((GptEntry *)0)->name)) {
+		fprintf(stderr, "%s:%d: label \"%s\" is too long\n",
+			a->manifest, p->lineno, p->label);
+		errorcnt++;
+	}
+	p->kernel = !strcmp(argv[1], "kernel");
+	if (futil_gpt_type(argv[1], &p->type)) {
+		fprintf(stderr, "%s:%d: unknown type \"%s\"\n",
+			a->manifest, p->lineno, argv[1]);
+		errorcnt++;
+	}
+	if (strcmp(argv[2], "-") && futil_parse_size(argv[2], &p->size)) {
+		fprintf(stderr, "%s:%d: invalid size \"%s\"\n",
+			a->manifest, p->lineno, argv[2]);
+		errorcnt++;
+	}
+
+	for (i = 3; i < argc; i++) {
+		eq = strchr(argv[i], '=');
+		if (!eq || eq == argv[i] || !eq[1]) {
+			fprintf(stderr, "%s:%d: \"%s\" isn't KEY=VALUE\n",
+				a->manifest, p->lineno, argv[i]);
+			errorcnt++;
+			continue;
+		}
+		*eq = '\0';
+		bad = 0;
+		key = argv[i];
+		val = eq + 1;
+		if (!strcmp(key, "file")) {
+			p->file = val;
+		} else if (!strcmp(key, "vmlinuz")) {
+			p->vmlinuz = val;
+		} else if (!strcmp(key, "config")) {
+			p->config = val;
+		} else if (!strcmp(key, "bootloader")) {
+			p->bootloader = val;
+		} else if (!strcmp(key, "priority")) {
+			bad = parse_attr(val, 15, &p->priority);
+		} else if (!strcmp(key, "tries")) {
+			bad = parse_attr(val, 15, &p->tries);
+		} else if (!strcmp(key, "successful")) {
+			bad = parse_attr(val, 1, &p->successful);
+		} else {
+			fprintf(stderr, "%s:%d: unknown key \"%s\"\n",
+				a->manifest, p->lineno, key);
+			errorcnt++;
+		}
+		if (bad) {
+			fprintf(stderr, "%s:%d: invalid %s \"%s\"\n",
+				a->manifest, p->lineno, key, val);
+			errorcnt++;
+		}
+	}
+
+	if (p->kernel) {
+		if (!p->vmlinuz || !p->config || !p->bootloader) {
+			fprintf(stderr, "%s:%d: a kernel needs vmlinuz=,"
+				" config= and bootloader=\n",
+				a->manifest, p->lineno);
+			errorcnt++;
+		}
+		if (p->file) {
+			fprintf(stderr, "%s:%d: a kernel is packed from"
+				" vmlinuz=, not file=\n",
+				a->manifest, p->lineno);
+			errorcnt++;
+		}
+	} else if (p->vmlinuz || p->config || p->bootloader) {
+		fprintf(stderr, "%s:%d: only a kernel has vmlinuz=, config="
+			" or bootloader=\n", a->manifest, p->lineno);
+		errorcnt++;
+	}
+	return errorcnt;
+}
+
+#define MAX_MANIFEST_ARGS 16
+
+/* Reads the manifest. Returns the number of errors. */
+static int read_manifest(struct assemble_s *a)
+{
+	struct part_s *p;
+	char *argv[MAX_MANIFEST_ARGS];
+	char *line = NULL;
+	size_t linesize = 0;
+	int lineno = 0;
+	int errorcnt = 0;
+	int argc;
+	FILE *fp;
+
+	fp = fopen(a->manifest, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			a->manifest, strerror(errno));
+		return 1;
+	}
+
+	while (getline(&line, &linesize, fp) != -1) {
+		char *copy;
+
+		lineno++;
+		copy = strdup(line);
+		argc = copy ? futil_split_line(copy, argv,
+					       MAX_MANIFEST_ARGS) : -1;
+		if (argc == 0) {
+			free(copy);
+			continue;
+		}
+
+		p = realloc(a->part, (a->count + 1) * sizeof(*p));
+		if (!p || !copy) {
+			fprintf(stderr, "Out of memory\n");
+			free(copy);
+			errorcnt++;
+			break;
+		}
+		a->part = p;
+		p = &a->part[a->count++];
+		memset(p, 0, sizeof(*p));
+		p->buf = copy;
+		p->lineno = lineno;
+
+		if (argc < 0) {
+			fprintf(stderr, "%s:%d: too many words\n",
+				a->manifest, lineno);
+			errorcnt++;
+			continue;
+		}
+		errorcnt += parse_part(a, p, argv, argc);
+	}
+	free(line);
+	fclose(fp);
+
+	if (!errorcnt && !a->count) {
+		fprintf(stderr, "%s has no partitions\n", a->manifest);
+		errorcnt++;
+	}
+	if (a->count > MAX_NUMBER_OF_ENTRIES) {
+		fprintf(stderr, "%s has more than %d partitions\n",
+			a->manifest, MAX_NUMBER_OF_ENTRIES);
+		errorcnt++;
+	}
+	return errorcnt;
+}
+
+/* Places the partitions, front to back. Returns the number of errors. */
+static int lay_out(struct assemble_s *a)
+{
+	struct part_s *p, *rest = NULL;
+	uint64_t lba, end = 0;
+	int pass, i;
+
+	for (i = 0; i < a->count; i++) {
+		p = &a->part[i];
+		if (p->size)
+			continue;
+		if (rest) {
+			fprintf(stderr, "%s:%d: only one partition can have"
+				" size \"-\"\n", a->manifest, p->lineno);
+			return 1;
+		}
+		if (!a->disk_size) {
+			fprintf(stderr, "%s:%d: size \"-\" needs"
+				" --disk-size\n", a->manifest, p->lineno);
+			return 1;
+		}
+		rest = p;
+	}
+
+	/* Once to see what's left for the rest, and again with it */
+	for (pass = 0; pass < 2; pass++) {
+		lba = futil_align_lba(GPT_SECTORS, PART_ALIGN);
+		for (i = 0; i < a->count; i++) {
+			p = &a->part[i];
+			if (p != rest)
+				p->sectors = (p->size + DISK_SECTOR_SIZE - 1) /
+					DISK_SECTOR_SIZE;
+			p->start = lba;
+			end = lba + p->sectors;
+			lba = futil_align_lba(end, PART_ALIGN);
+		}
+		if (!a->disk_size) {
+			a->sectors = end + GPT_TAIL_SECTORS;
+			break;
+		}
+		a->sectors = a->disk_size / DISK_SECTOR_SIZE;
+		if (end + GPT_TAIL_SECTORS > a->sectors) {
+			fprintf(stderr, "--disk-size is too small for %s\n",
+				a->manifest);
+			return 1;
+		}
+		if (!rest || pass)
+			break;
+		/* Keeping whatever follows it aligned */
+		rest->sectors = (a->sectors - GPT_TAIL_SECTORS - end) /
+			PART_ALIGN * PART_ALIGN;
+		if (!rest->sectors) {
+			fprintf(stderr, "%s:%d: there's no room left\n",
+				a->manifest, rest->lineno);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Checks that each file fits, before anything's written */
+static int check_files(struct assemble_s *a)
+{
+	struct part_s *p;
+	struct stat sb;
+	int errorcnt = 0;
+	int i;
+
+	for (i = 0; i < a->count; i++) {
+		p = &a->part[i];
+		if (!p->file)
+			continue;
+		if (stat(p->file, &sb)) {
+			fprintf(stderr, "Can't open %s: %s\n", p->file,
+				strerror(errno));
+			errorcnt++;
+		} else if (S_ISREG(sb.st_mode) &&
+			   (uint64_t)sb.st_size >
+			   p->sectors * DISK_SECTOR_SIZE) {
+			fprintf(stderr, "%s:%d: %s is bigger than the"
+				" partition\n", a->manifest, p->lineno,
+				p->file);
+			errorcnt++;
+		}
+	}
+	return errorcnt;
+}
+
+static void pack_kernel(void *arg, uint32_t index)
+{
+	struct assemble_s *a = arg;
+	struct part_s *p = &a->part[index];
+	struct kernel_blob_ctx_s kb;
+	uint8_t *vmlinuz = NULL, *config = NULL, *bootloader = NULL;
+	uint8_t *blob = NULL, *vblock = NULL;
+	uint64_t vmlinuz_size, config_size, bootloader_size;
+	uint64_t blob_size, vblock_size;
+
+	if (!p->kernel)
+		return;
+
+	vmlinuz = ReadFile(p->vmlinuz, &vmlinuz_size);
+	config = ReadConfigFile(p->config, &config_size);
+	bootloader = ReadFile(p->bootloader, &bootloader_size);
+	if (!vmlinuz || !vmlinuz_size || !config || !bootloader) {
+		fprintf(stderr, "%s:%d: can't read the kernel, config or"
+			" bootloader\n", a->manifest, p->lineno);
+		p->errorcnt++;
+		goto done;
+	}
+
+	memset(&kb, 0, sizeof(kb));
+	blob = CreateKernelBlob(&kb, vmlinuz, vmlinuz_size, a->arch,
+				a->load_address, config, config_size,
+				bootloader, bootloader_size, &blob_size);
+	if (blob)
+		vblock = SignKernelBlob(&kb, blob, blob_size, a->padding,
+					a->version, a->load_address,
+					a->keyblock, a->signpriv_key,
+					a->flags, &vblock_size);
+	if (!vblock) {
+		fprintf(stderr, "%s:%d: can't pack and sign the kernel\n",
+			a->manifest, p->lineno);
+		p->errorcnt++;
+		goto done;
+	}
+
+	p->kpart_size = vblock_size + blob_size;
+	if (p->kpart_size > p->sectors * DISK_SECTOR_SIZE) {
+		fprintf(stderr, "%s:%d: the kernel takes %" PRIu64
+			" bytes, more than the partition has\n",
+			a->manifest, p->lineno, p->kpart_size);
+		p->errorcnt++;
+		goto done;
+	}
+	p->kpart = malloc(p->kpart_size);
+	if (!p->kpart) {
+		fprintf(stderr, "Out of memory\n");
+		p->errorcnt++;
+		goto done;
+	}
+	memcpy(p->kpart, vblock, vblock_size);
+	memcpy(p->kpart + vblock_size, blob, blob_size);
+
+done:
+	free(vblock);
+	free(blob);
+	free(bootloader);
+	free(config);
+	free(vmlinuz);
+}
+
+/*
+ * Fills in the PMBR and the primary GPT in [gpt], and the secondary entries
+ * and header in [tail], just as cgpt would. Returns the number of errors.
+ */
+static int make_gpt(struct assemble_s *a, uint8_t *gpt, uint8_t *tail)
+{
+	GptEntry *entries = (GptEntry *)(gpt + (GPT_PMBR_SECTORS +
+						GPT_HEADER_SECTORS) *
+					 DISK_SECTOR_SIZE);
+	Guid random[MAX_NUMBER_OF_ENTRIES + 1];
+	struct part_s *p;
+	GptEntry *e;
+	int fd, i, j, rv;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, random, sizeof(random)) != sizeof(random)) {
+		fprintf(stderr, "Can't make random GUIDs: %s\n",
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	close(fd);
+
+	for (i = 0; i < a->count; i++) {
+		p = &a->part[i];
+		e = &entries[i];
+		e->type = p->type;
+		e->unique = random[i + 1];
+		futil_make_uuid(&e->unique);
+		e->starting_lba = p->start;
+		e->ending_lba = p->start + p->sectors - 1;
+		for (j = 0; p->label[j]; j++)
+			e->name[j] = p->label[j];
+		SetEntryPriority(e, p->priority);
+		SetEntryTries(e, p->tries);
+		SetEntrySuccessful(e, p->successful);
+	}
+
+	futil_make_uuid(&random[0]);
+	rv = futil_make_gpt(gpt, tail, a->sectors, &random[0]);
+	if (rv != GPT_SUCCESS) {
+		fprintf(stderr, "The GPT for %s isn't right: %s\n",
+			a->manifest, GptErrorText(rv));
+		return 1;
+	}
+	return 0;
+}
+
+static ssize_t read_full(int fd, uint8_t *buf, size_t size)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < size) {
+		n = read(fd, buf + done, size - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (!n)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * Copies [p]'s file to where it goes in [fd], a block at a time, and when
+ * the output is sparse, leaves holes where the blocks are all zeroes.
+ * Returns nonzero if it can't.
+ */
+static int stream_file(struct assemble_s *a, int fd, struct part_s *p,
+		       uint8_t *buf)
+{
+	uint64_t offset = p->start * DISK_SECTOR_SIZE;
+	uint64_t end = offset + p->sectors * DISK_SECTOR_SIZE;
+	size_t i, j, len;
+	ssize_t n;
+	int zero, in;
+
+	in = open(p->file, O_RDONLY);
+	if (in < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", p->file,
+			strerror(errno));
+		return 1;
+	}
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while ((n = read_full(in, buf, STREAM_CHUNK)) > 0) {
+		if (offset + n > end) {
+			fprintf(stderr, "%s:%d: %s is bigger than the"
+				" partition\n", a->manifest, p->lineno,
+				p->file);
+			close(in);
+			return 1;
+		}
+		/* Each run of blocks that are all zeroes, or aren't */
+		for (i = 0; i < (size_t)n; i = j) {
+			len = n - i < IMAGE_ERASE_BLOCK ? n - i :
+				IMAGE_ERASE_BLOCK;
+			zero = a->sparse &&
+				image_fill(buf + i, len) == IMAGE_FILL_ZERO;
+			for (j = i + len; j < (size_t)n; j += len) {
+				len = n - j < IMAGE_ERASE_BLOCK ? n - j :
+					IMAGE_ERASE_BLOCK;
+				if (zero != (a->sparse &&
+					     image_fill(buf + j, len) ==
+					     IMAGE_FILL_ZERO))
+					break;
+			}
+			if (zero) {
+				a->hole_bytes += j - i;
+				continue;
+			}
+			if (futil_write_at(fd, buf + i, j - i, offset + i)) {
+				fprintf(stderr, "Can't write %s: %s\n",
+					a->outfile, strerror(errno));
+				close(in);
+				return 1;
+			}
+			a->data_bytes += j - i;
+		}
+		offset += n;
+	}
+	if (n < 0) {
+		fprintf(stderr, "Can't read %s: %s\n", p->file,
+			strerror(errno));
+		close(in);
+		return 1;
+	}
+	close(in);
+	return 0;
+}
+
+/* Writes everything, front to back. Returns the number of errors. */
+static int write_disk(struct assemble_s *a, const uint8_t *gpt,
+		      const uint8_t *tail)
+{
+	uint64_t disk_bytes = a->sectors * DISK_SECTOR_SIZE;
+	uint8_t *buf = NULL;
+	struct stat sb;
+	struct part_s *p;
+	int errorcnt = 0;
+	int fd, i;
+
+	fd = open(a->outfile, O_WRONLY | O_CREAT, 0666);
+	if (fd < 0 || fstat(fd, &sb)) {
+		fprintf(stderr, "Can't open %s: %s\n", a->outfile,
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+
+	/*
+	 * A file starts out empty and all holes, so only what isn't zero
+	 * needs writing. A device keeps whatever it had where nothing is
+	 * written, so every block of every file is written to one.
+	 */
+	a->sparse = S_ISREG(sb.st_mode);
+	if (a->sparse && (ftruncate(fd, 0) || ftruncate(fd, disk_bytes))) {
+		fprintf(stderr, "Can't write %s: %s\n", a->outfile,
+			strerror(errno));
+		close(fd);
+		return 1;
+	}
+	if (S_ISBLK(sb.st_mode) &&
+	    (uint64_t)lseek(fd, 0, SEEK_END) < disk_bytes) {
+		fprintf(stderr, "%s is smaller than the %" PRIu64
+			"-byte disk\n", a->outfile, disk_bytes);
+		close(fd);
+		return 1;
+	}
+
+	if (futil_write_at(fd, gpt, GPT_SECTORS * DISK_SECTOR_SIZE, 0)) {
+		fprintf(stderr, "Can't write %s: %s\n", a->outfile,
+			strerror(errno));
+		close(fd);
+		return 1;
+	}
+	a->data_bytes += GPT_SECTORS * DISK_SECTOR_SIZE;
+
+	for (i = 0; i < a->count && !errorcnt; i++) {
+		p = &a->part[i];
+		if (p->kpart) {
+			if (futil_write_at(fd, p->kpart, p->kpart_size,
+					   p->start * DISK_SECTOR_SIZE)) {
+				fprintf(stderr, "Can't write %s: %s\n",
+					a->outfile, strerror(errno));
+				errorcnt++;
+			}
+			a->data_bytes += p->kpart_size;
+		} else if (p->file) {
+			if (!buf)
+				buf = malloc(STREAM_CHUNK);
+			if (!buf) {
+				fprintf(stderr, "Out of memory\n");
+				errorcnt++;
+			} else {
+				errorcnt += stream_file(a, fd, p, buf);
+			}
+		}
+	}
+	free(buf);
+
+	if (!errorcnt &&
+	    futil_write_at(fd, tail, GPT_TAIL_SECTORS * DISK_SECTOR_SIZE,
+			   disk_bytes - GPT_TAIL_SECTORS * DISK_SECTOR_SIZE)) {
+		fprintf(stderr, "Can't write %s: %s\n", a->outfile,
+			strerror(errno));
+		errorcnt++;
+	}
+	a->data_bytes += GPT_TAIL_SECTORS * DISK_SECTOR_SIZE;
+
+	if (close(fd) && !errorcnt) {
+		fprintf(stderr, "Can't write %s: %s\n", a->outfile,
+			strerror(errno));
+		errorcnt++;
+	}
+	return errorcnt;
+}
+
+enum no_short_opts {
+	OPT_KEYBLOCK = 1000,
+	OPT_SIGNPRIVATE,
+	OPT_VERSION,
+	OPT_ARCH,
+	OPT_KLOADADDR,
+	OPT_PADDING,
+	OPT_FLAGS,
+	OPT_DISK_SIZE,
+	OPT_HELP,
+};
+
+static const struct option long_opts[] = {
+	/* name          hasarg *flag  val */
+	{"keyblock",     1, NULL, OPT_KEYBLOCK},
+	{"signprivate",  1, NULL, OPT_SIGNPRIVATE},
+	{"version",      1, NULL, OPT_VERSION},
+	{"arch",         1, NULL, OPT_ARCH},
+	{"kloadaddr",    1, NULL, OPT_KLOADADDR},
+	{"pad",          1, NULL, OPT_PADDING},
+	{"flags",        1, NULL, OPT_FLAGS},
+	{"disk-size",    1, NULL, OPT_DISK_SIZE},
+	{"help",         0, NULL, OPT_HELP},
+	{NULL,           0, NULL, 0},
+};
+
+static int do_assemble(int argc, char *argv[])
+{
+	struct assemble_s a;
+	const char *keyblock_file = NULL, *signpriv_file = NULL;
+	uint8_t *gpt = NULL, *tail = NULL;
+	int kernels = 0;
+	int errorcnt = 0;
+	char *e;
+	int i;
+
+	memset(&a, 0, sizeof(a));
+	a.version = 1;
+	a.arch = ARCH_X86;
+	a.load_address = CROS_32BIT_ENTRY_ADDR;
+	a.padding = DEFAULT_PADDING;
+
+	opterr = 0;		/* quiet, you */
+	while ((i = getopt_long(argc, argv, ":", long_opts, NULL)) != -1) {
+		switch (i) {
+		case OPT_KEYBLOCK:
+			keyblock_file = optarg;
+			break;
+		case OPT_SIGNPRIVATE:
+			signpriv_file = optarg;
+			break;
+		case OPT_VERSION:
+			a.version = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr, "Invalid --version \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_ARCH:
+			if (parse_arch(optarg, &a.arch)) {
+				fprintf(stderr, "Unknown architecture string:"
+					" %s\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_KLOADADDR:
+			a.load_address = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr, "Invalid --kloadaddr \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_PADDING:
+			a.padding = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr, "Invalid --pad \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_FLAGS:
+			a.flags = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr, "Invalid --flags \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_DISK_SIZE:
+			if (futil_parse_size(optarg, &a.disk_size)) {
+				fprintf(stderr, "Invalid --disk-size \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_HELP:
+			print_help(argv[0]);
+			return 0;
+		case '?':
+			fprintf(stderr, "Unrecognized option: %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument to %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		default:
+			DIE;
+		}
+	}
+	if (errorcnt || argc - optind != 2) {
+		print_help(argv[0]);
+		return 1;
+	}
+	a.manifest = argv[optind];
+	a.outfile = argv[optind + 1];
+
+	errorcnt += read_manifest(&a);
+	if (!errorcnt)
+		errorcnt += lay_out(&a);
+	if (!errorcnt)
+		errorcnt += check_files(&a);
+	if (errorcnt)
+		goto done;
+
+	for (i = 0; i < a.count; i++)
+		kernels += a.part[i].kernel;
+	if (kernels) {
+		if (!keyblock_file || !signpriv_file) {
+			fprintf(stderr, "Kernels need --keyblock and"
+				" --signprivate\n");
+			errorcnt++;
+			goto done;
+		}
+		a.keyblock = (VbKeyBlockHeader *)ReadFile(keyblock_file, 0);
+		if (!a.keyblock) {
+			fprintf(stderr, "Error reading key block.\n");
+			errorcnt++;
+			goto done;
+		}
+		a.signpriv_key = PrivateKeyRead(signpriv_file);
+		if (!a.signpriv_key) {
+			fprintf(stderr, "Error reading signing key.\n");
+			errorcnt++;
+			goto done;
+		}
+	}
+
+	gpt = calloc(GPT_SECTORS, DISK_SECTOR_SIZE);
+	tail = calloc(GPT_TAIL_SECTORS, DISK_SECTOR_SIZE);
+	if (!gpt || !tail) {
+		fprintf(stderr, "Out of memory\n");
+		errorcnt++;
+		goto done;
+	}
+	errorcnt += make_gpt(&a, gpt, tail);
+	if (errorcnt)
+		goto done;
+
+	/* Every kernel at once, before anything is written */
+	if (kernels)
+		futil_run_jobs(pack_kernel, NULL, &a, a.count, 0);
+	for (i = 0; i < a.count; i++)
+		errorcnt += a.part[i].errorcnt;
+	if (errorcnt)
+		goto done;
+
+	errorcnt += write_disk(&a, gpt, tail);
+	if (errorcnt)
+		goto done;
+
+	for (i = 0; i < a.count; i++)
+		printf("%3d  %-12" PRIu64 " %-12" PRIu64 " %s\n", i + 1,
+		       a.part[i].start, a.part[i].sectors, a.part[i].label);
+	printf("Wrote %s: %" PRIu64 " sectors, %" PRIu64 " bytes of data,"
+	       " %" PRIu64 " bytes of zeroes left as holes\n", a.outfile,
+	       a.sectors, a.data_bytes, a.hole_bytes);
+
+done:
+	for (i = 0; i < a.count; i++) {
+		free(a.part[i].kpart);
+		free(a.part[i].buf);
+	}
+	free(a.part);
+	free(gpt);
+	free(tail);
+	free(a.keyblock);
+	if (a.signpriv_key)
+		PrivateKeyFree(a.signpriv_key);
+	return !!errorcnt;
+}
+
+DECLARE_FUTIL_COMMAND(assemble, do_assemble,
+		      VBOOT_VERSION_1_0,
+		      "Build a whole signed disk image from a layout manifest",
+		      print_help);
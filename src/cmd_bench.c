@@ -0,0 +1,670 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "cgptlib_internal.h"
+#include "crc32.h"
+#include "cryptolib.h"
+#include "file_type.h"
+#include "fmap.h"
+#include "futility.h"
+#include "gbb_header.h"
+#include "host_common.h"
+#include "host_crypto.h"
+#include "traversal.h"
+#include "util_misc.h"
+#include "vb1_helper.h"
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] [NAME ...]\n"
+	"\n"
+	"Times the hot paths of the library and the file traversal, and\n"
+	"prints one JSON object per line for each, like so:\n"
+	"\n"
+	"  {\"name\":\"sha256\",\"value\":412.7,\"unit\":\"MB/s\"}\n"
+	"\n"
+	"Only the benchmarks whose names start with one of the NAME args are\n"
+	"run, if any are given. Higher values are always better. The hashes and\n"
+	"signature checks are timed with the current crypto provider (see\n"
+	"\"" MYNAME " --crypto\"), and then again with libcrypto as NAME_libcrypto.\n"
+	"The hashes are timed with afalg too, as NAME_afalg.\n"
+	"\n"
+	"Options:\n"
+	"  --keydir DIR     Read the RSA keys from DIR/rsaBITS.pem, creating\n"
+	"                     any that are missing (which is slow)\n"
+	"  --time MS        Run each benchmark for about MS milliseconds\n"
+	"                     (default %d)\n"
+	"  --list           Just list the benchmarks\n"
+	"\n";
+
+#define DEFAULT_TIME_MS 500
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog, DEFAULT_TIME_MS);
+}
+
+static const char *keydir;
+static int time_ms = DEFAULT_TIME_MS;
+static FILE *devnull;
+
+/* Random input for the hashes, and what the keys sign */
+#define DATA_SIZE (1 << 20)
+#define SIGNED_SIZE 1024
+static uint8_t *data;
+
+/* RSA keys, one per size, all using SHA-256 */
+struct bench_key_s {
+	int bits;
+	int algorithm;
+	VbPrivateKey *priv;
+	VbPublicKey *pub;
+	RSAPublicKey *rsa;
+	VbSignature *sig;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+};
+
+static struct bench_key_s keys[] = {
+	{1024, 1},
+	{2048, 4},
+	{4096, 7},
+	{8192, 10},
+};
+
+/* The synthetic images, signed with the 2048-bit key */
+struct bench_image_s {
+	const char *name;
+	enum futil_file_type type;
+	uint8_t *buf;
+	uint64_t len;
+};
+
+static struct bench_image_s images[] = {
+	{"bios", FILE_TYPE_BIOS_IMAGE},
+	{"kernel", FILE_TYPE_KERN_PREAMBLE},
+	{"gpt", FILE_TYPE_CHROMIUMOS_DISK},
+};
+
+static struct bench_key_s *image_key = &keys[1];
+
+static int need_data(void)
+{
+	int i;
+
+	if (data)
+		return 0;
+	data = malloc(DATA_SIZE);
+	if (!data)
+		return 1;
+	/* Fixed, so each run hashes the same thing */
+	srand(1);
+	for (i = 0; i < DATA_SIZE; i++)
+		data[i] = rand();
+	return 0;
+}
+
+static RSA *make_rsa(int bits)
+{
+	BIGNUM *e = BN_new();
+	RSA *rsa = RSA_new();
+
+	if (!e || !rsa || !BN_set_word(e, RSA_F4) ||
+	    !RSA_generate_key_ex(rsa, bits, e, NULL)) {
+		RSA_free(rsa);
+		rsa = NULL;
+	}
+	BN_free(e);
+	return rsa;
+}
+
+static RSA *read_rsa(int bits)
+{
+	char path[PATH_MAX];
+	RSA *rsa = NULL;
+	FILE *fp;
+
+	if (keydir) {
+		snprintf(path, sizeof(path), "%s/rsa%d.pem", keydir, bits);
+		fp = fopen(path, "r");
+		if (fp) {
+			rsa = PEM_read_RSAPrivateKey(fp, NULL, NULL, NULL);
+			fclose(fp);
+			if (rsa)
+				return rsa;
+		}
+	}
+
+	fprintf(stderr, "Creating a %d-bit RSA key...\n", bits);
+	rsa = make_rsa(bits);
+	if (rsa && keydir) {
+		fp = fopen(path, "w");
+		if (!fp || !PEM_write_RSAPrivateKey(fp, rsa, NULL, NULL, 0,
+						    NULL, NULL))
+			fprintf(stderr, "Can't save %s\n", path);
+		if (fp)
+			fclose(fp);
+	}
+	return rsa;
+}
+
+static int need_key(struct bench_key_s *k)
+{
+	uint8_t *keyb;
+	uint32_t keyb_size;
+	RSA *rsa;
+
+	if (k->priv)
+		return 0;
+	if (need_data())
+		return 1;
+
+	rsa = read_rsa(k->bits);
+	if (!rsa)
+		return 1;
+	if (vb_keyb_from_rsa(rsa, &keyb, &keyb_size)) {
+		RSA_free(rsa);
+		return 1;
+	}
+
+	k->priv = malloc(sizeof(*k->priv));
+	k->pub = PublicKeyAlloc(keyb_size, k->algorithm, 1);
+	k->rsa = RSAPublicKeyFromBuf(keyb, keyb_size);
+	if (!k->priv || !k->pub || !k->rsa) {
+		RSA_free(rsa);
+		free(keyb);
+		return 1;
+	}
+	k->priv->rsa_private_key = rsa;
+	k->priv->algorithm = k->algorithm;
+	k->priv->signer = NULL;
+	k->priv->signer_data = NULL;
+	memcpy(GetPublicKeyData(k->pub), keyb, keyb_size);
+	free(keyb);
+
+	/* Make sure there's something real to verify */
+	k->sig = CalculateSignature(data, SIGNED_SIZE, k->priv);
+	internal_SHA256(data, SIGNED_SIZE, k->digest);
+	if (!k->sig || !RSAVerify(k->rsa, GetSignatureData(k->sig),
+				  k->sig->sig_size, k->algorithm, k->digest)) {
+		fprintf(stderr, "The %d-bit key doesn't work\n", k->bits);
+		return 1;
+	}
+	return 0;
+}
+
+/* Signs [body] and returns its keyblock and preamble, like sign does */
+static int make_vblock(uint8_t *out, uint64_t size,
+		       const uint8_t *body, uint64_t body_size)
+{
+	struct bench_key_s *k = image_key;
+	VbFirmwarePreambleHeader *preamble;
+	VbKeyBlockHeader *keyblock;
+	VbSignature *body_sig;
+	int rv = 1;
+
+	keyblock = KeyBlockCreate(k->pub, k->priv, KEY_BLOCK_FLAG_DEVELOPER_0 |
+				  KEY_BLOCK_FLAG_DEVELOPER_1 |
+				  KEY_BLOCK_FLAG_RECOVERY_0);
+	body_sig = CalculateSignature(body, body_size, k->priv);
+	preamble = body_sig ?
+		CreateFirmwarePreamble(1, k->pub, body_sig, k->priv, 0) : NULL;
+	if (keyblock && preamble &&
+	    keyblock->key_block_size + preamble->preamble_size <= size) {
+		memcpy(out, keyblock, keyblock->key_block_size);
+		memcpy(out + keyblock->key_block_size, preamble,
+		       preamble->preamble_size);
+		rv = 0;
+	}
+	free(keyblock);
+	free(body_sig);
+	free(preamble);
+	return rv;
+}
+
+static int make_bios(struct bench_image_s *img)
+{
+	static const struct {
+		const char *name;
+		uint32_t size;
+	} area[] = {
+		{"FMAP", 0x1000},
+		{"GBB", 0x40000},
+		{"VBLOCK_A", 0x10000},
+		{"FW_MAIN_A", 0x60000},
+		{"VBLOCK_B", 0x10000},
+		{"FW_MAIN_B", 0x60000},
+	};
+	struct bench_key_s *k = image_key;
+	GoogleBinaryBlockHeader *gbb;
+	FmapHeader *fmap;
+	FmapAreaHeader *ah;
+	uint8_t *base[ARRAY_SIZE(area)];
+	uint32_t offset = 0, keysize;
+	int i;
+
+	img->len = 0x200000;
+	img->buf = malloc(img->len);
+	if (!img->buf)
+		return 1;
+	memset(img->buf, 0xff, img->len);
+
+	fmap = (FmapHeader *)img->buf;
+	memset(fmap, 0, sizeof(*fmap));
+	memcpy(fmap->fmap_signature, FMAP_SIGNATURE, FMAP_SIGNATURE_SIZE);
+	fmap->fmap_ver_major = FMAP_VER_MAJOR;
+	fmap->fmap_size = img->len;
+	strcpy(fmap->fmap_name, "BENCH");
+	fmap->fmap_nareas = ARRAY_SIZE(area);
+	ah = (FmapAreaHeader *)(fmap + 1);
+	for (i = 0; i < ARRAY_SIZE(area); i++) {
+		memset(&ah[i], 0, sizeof(ah[i]));
+		ah[i].area_offset = offset;
+		ah[i].area_size = area[i].size;
+		strcpy(ah[i].area_name, area[i].name);
+		base[i] = img->buf + offset;
+		offset += area[i].size;
+	}
+
+	/* Both keys in the GBB are the image key */
+	gbb = (GoogleBinaryBlockHeader *)base[1];
+	keysize = k->pub->key_offset + k->pub->key_size;
+	memset(gbb, 0, 0x3000);
+	memcpy(gbb->signature, GBB_SIGNATURE, GBB_SIGNATURE_SIZE);
+	gbb->major_version = GBB_MAJOR_VER;
+	gbb->minor_version = GBB_MINOR_VER;
+	gbb->header_size = GBB_HEADER_SIZE;
+	gbb->hwid_offset = GBB_HEADER_SIZE;
+	gbb->hwid_size = 0x100;
+	gbb->rootkey_offset = 0x200;
+	gbb->rootkey_size = 0x1000;
+	gbb->bmpfv_offset = 0x1200;
+	gbb->bmpfv_size = 0;
+	gbb->recovery_key_offset = 0x1200;
+	gbb->recovery_key_size = 0x1000;
+	strcpy((char *)gbb + gbb->hwid_offset, "BENCH TEST 0000");
+	update_hwid_digest(gbb);
+	if (keysize > gbb->rootkey_size)
+		return 1;
+	memcpy((uint8_t *)gbb + gbb->rootkey_offset, k->pub, keysize);
+	memcpy((uint8_t *)gbb + gbb->recovery_key_offset, k->pub, keysize);
+
+	memcpy(base[3], data, area[3].size);
+	memcpy(base[5], data + area[3].size, area[5].size);
+	return make_vblock(base[2], area[2].size, base[3], area[3].size) ||
+		make_vblock(base[4], area[4].size, base[5], area[5].size);
+}
+
+static int make_kernel(struct bench_image_s *img)
+{
+	struct bench_key_s *k = image_key;
+	struct kernel_blob_ctx_s kb;
+	VbKeyBlockHeader *keyblock;
+	uint8_t *blob, *vblock;
+	uint64_t blob_size, vblock_size;
+	static char config[] = "console=tty0 root=/dev/sda3 -- quiet";
+	uint8_t bootloader[0x1000];
+
+	memset(bootloader, 0, sizeof(bootloader));
+	memset(&kb, 0, sizeof(kb));
+	blob = CreateKernelBlob(&kb, data, DATA_SIZE / 2, ARCH_ARM, 0x100000,
+				(uint8_t *)config, sizeof(config),
+				bootloader, sizeof(bootloader), &blob_size);
+	keyblock = KeyBlockCreate(k->pub, k->priv,
+				  KEY_BLOCK_FLAG_DEVELOPER_0 |
+				  KEY_BLOCK_FLAG_RECOVERY_0);
+	vblock = blob && keyblock ?
+		SignKernelBlob(&kb, blob, blob_size, 0x10000, 1, 0x100000,
+			       keyblock, k->priv, 0, &vblock_size) : NULL;
+	free(keyblock);
+	if (!vblock) {
+		free(blob);
+		return 1;
+	}
+
+	img->len = vblock_size + blob_size;
+	img->buf = malloc(img->len);
+	if (img->buf) {
+		memcpy(img->buf, vblock, vblock_size);
+		memcpy(img->buf + vblock_size, blob, blob_size);
+	}
+	free(vblock);
+	free(blob);
+	return !img->buf;
+}
+
+static int make_gpt(struct bench_image_s *img)
+{
+	static const Guid disk_uuid;
+	uint64_t sectors = GPT_SECTORS + 1 + GPT_TAIL_SECTORS;
+	uint8_t *tail;
+
+	/* A GPT with no partitions, around one usable sector */
+	img->len = sectors * DISK_SECTOR_SIZE;
+	img->buf = calloc(1, img->len);
+	if (!img->buf)
+		return 1;
+	tail = img->buf + (sectors - GPT_TAIL_SECTORS) * DISK_SECTOR_SIZE;
+	return futil_make_gpt(img->buf, tail, sectors, &disk_uuid) !=
+		GPT_SUCCESS;
+}
+
+static int need_image(struct bench_image_s *img)
+{
+	int rv;
+
+	if (img->buf)
+		return 0;
+	if (need_data() || need_key(image_key))
+		return 1;
+
+	if (img->type == FILE_TYPE_BIOS_IMAGE)
+		rv = make_bios(img);
+	else if (img->type == FILE_TYPE_KERN_PREAMBLE)
+		rv = make_kernel(img);
+	else
+		rv = make_gpt(img);
+
+	if (rv || futil_file_type_buf(img->buf, img->len) != img->type) {
+		fprintf(stderr, "Can't make the %s image\n", img->name);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The things being timed. Each call is one unit of work. The hashes go
+ * through DigestBufInto(), which takes a signature algorithm, but the first
+ * three of those (RSA1024 with each hash) are numbered like the hashes.
+ */
+static void run_sha1(void *arg)
+{
+	uint8_t digest[SHA1_DIGEST_SIZE];
+
+	DigestBufInto(data, DATA_SIZE, SHA1_DIGEST_ALGORITHM, digest);
+}
+
+static void run_sha256(void *arg)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+
+	DigestBufInto(data, DATA_SIZE, SHA256_DIGEST_ALGORITHM, digest);
+}
+
+static void run_sha512(void *arg)
+{
+	uint8_t digest[SHA512_DIGEST_SIZE];
+
+	DigestBufInto(data, DATA_SIZE, SHA512_DIGEST_ALGORITHM, digest);
+}
+
+static void run_crc32(void *arg)
+{
+	Crc32(data, DATA_SIZE);
+}
+
+static void run_verify(void *arg)
+{
+	struct bench_key_s *k = arg;
+
+	if (!RSAVerify(k->rsa, GetSignatureData(k->sig), k->sig->sig_size,
+		       k->algorithm, k->digest))
+		DIE;
+}
+
+static void run_sign(void *arg)
+{
+	struct bench_key_s *k = arg;
+
+	free(CalculateSignature(data, SIGNED_SIZE, k->priv));
+}
+
+static void run_file_type(void *arg)
+{
+	struct bench_image_s *img = arg;
+
+	futil_file_type_buf(img->buf, img->len);
+}
+
+static void run_traverse(void *arg)
+{
+	struct bench_image_s *img = arg;
+	struct futil_traverse_state_s state;
+
+	memset(&state, 0, sizeof(state));
+	state.in_filename = img->name;
+	state.op = FUTIL_OP_SHOW;
+	if (futil_traverse(img->buf, img->len, &state, FILE_TYPE_UNKNOWN))
+		DIE;
+}
+
+static int prep_data(void *arg)
+{
+	return need_data();
+}
+
+static int prep_key(void *arg)
+{
+	return need_key(arg);
+}
+
+static int prep_image(void *arg)
+{
+	if (need_image(arg))
+		return 1;
+	/* It has to find good signatures, or we'd time the wrong thing */
+	futil_show_init(devnull, devnull, image_key->pub, 1);
+	return 0;
+}
+
+#define MB (DATA_SIZE / 1e6)
+
+static const struct bench_s {
+	const char *name;
+	int (*prep)(void *arg);
+	void (*run)(void *arg);
+	void *arg;
+	double scale;			/* Units of work per call */
+	const char *unit;
+	const CryptoProvider *provider;	/* Instead of the current one */
+} benches[] = {
+	{"sha1", prep_data, run_sha1, NULL, MB, "MB/s"},
+	{"sha256", prep_data, run_sha256, NULL, MB, "MB/s"},
+	{"sha512", prep_data, run_sha512, NULL, MB, "MB/s"},
+	{"crc32", prep_data, run_crc32, NULL, MB, "MB/s"},
+	{"rsa1024_verify", prep_key, run_verify, &keys[0], 1, "verifies/s"},
+	{"rsa2048_verify", prep_key, run_verify, &keys[1], 1, "verifies/s"},
+	{"rsa4096_verify", prep_key, run_verify, &keys[2], 1, "verifies/s"},
+	{"rsa8192_verify", prep_key, run_verify, &keys[3], 1, "verifies/s"},
+	{"rsa1024_sign", prep_key, run_sign, &keys[0], 1, "signs/s"},
+	{"rsa2048_sign", prep_key, run_sign, &keys[1], 1, "signs/s"},
+	{"rsa4096_sign", prep_key, run_sign, &keys[2], 1, "signs/s"},
+	{"rsa8192_sign", prep_key, run_sign, &keys[3], 1, "signs/s"},
+	{"sha1_libcrypto", prep_data, run_sha1, NULL, MB, "MB/s",
+	 &libcrypto_provider},
+	{"sha256_libcrypto", prep_data, run_sha256, NULL, MB, "MB/s",
+	 &libcrypto_provider},
+	{"sha512_libcrypto", prep_data, run_sha512, NULL, MB, "MB/s",
+	 &libcrypto_provider},
+	{"sha1_afalg", prep_data, run_sha1, NULL, MB, "MB/s",
+	 &afalg_provider},
+	{"sha256_afalg", prep_data, run_sha256, NULL, MB, "MB/s",
+	 &afalg_provider},
+	{"sha512_afalg", prep_data, run_sha512, NULL, MB, "MB/s",
+	 &afalg_provider},
+	{"rsa1024_verify_libcrypto", prep_key, run_verify, &keys[0], 1,
+	 "verifies/s", &libcrypto_provider},
+	{"rsa2048_verify_libcrypto", prep_key, run_verify, &keys[1], 1,
+	 "verifies/s", &libcrypto_provider},
+	{"rsa4096_verify_libcrypto", prep_key, run_verify, &keys[2], 1,
+	 "verifies/s", &libcrypto_provider},
+	{"rsa8192_verify_libcrypto", prep_key, run_verify, &keys[3], 1,
+	 "verifies/s", &libcrypto_provider},
+	{"file_type_bios", prep_image, run_file_type, &images[0], 1,
+	 "files/s"},
+	{"file_type_kernel", prep_image, run_file_type, &images[1], 1,
+	 "files/s"},
+	{"file_type_gpt", prep_image, run_file_type, &images[2], 1,
+	 "files/s"},
+	{"traverse_bios", prep_image, run_traverse, &images[0], 1,
+	 "files/s"},
+	{"traverse_kernel", prep_image, run_traverse, &images[1], 1,
+	 "files/s"},
+	{"traverse_gpt", prep_image, run_traverse, &images[2], 1,
+	 "files/s"},
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns calls per second, after one untimed call to warm up */
+static double time_calls(const struct bench_s *b)
+{
+	double start, elapsed, limit = time_ms / 1000.0;
+	uint64_t calls = 0;
+
+	b->run(b->arg);
+	start = now();
+	do {
+		b->run(b->arg);
+		calls++;
+		elapsed = now() - start;
+	} while (elapsed < limit);
+
+	return calls / elapsed;
+}
+
+static int selected(const char *name, int argc, char *argv[])
+{
+	int i;
+
+	if (argc <= 0)
+		return 1;
+	for (i = 0; i < argc; i++)
+		if (!strncmp(name, argv[i], strlen(argv[i])))
+			return 1;
+	return 0;
+}
+
+enum no_short_opts {
+	OPT_KEYDIR = 1000,
+	OPT_TIME,
+	OPT_LIST,
+	OPT_HELP,
+};
+
+static const struct option long_opts[] = {
+	/* name    hasarg *flag  val */
+	{"keydir",  1, NULL, OPT_KEYDIR},
+	{"time",    1, NULL, OPT_TIME},
+	{"list",    0, NULL, OPT_LIST},
+	{"help",    0, NULL, OPT_HELP},
+	{NULL,      0, NULL, 0},
+};
+
+static int do_bench(int argc, char *argv[])
+{
+	const CryptoProvider *provider = crypto_provider;
+	char *e = NULL;
+	int list = 0;
+	int errorcnt = 0;
+	int i;
+
+	opterr = 0;		/* quiet, you */
+	while ((i = getopt_long(argc, argv, ":", long_opts, NULL)) != -1) {
+		switch (i) {
+		case OPT_KEYDIR:
+			keydir = optarg;
+			break;
+		case OPT_TIME:
+			time_ms = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || time_ms <= 0) {
+				fprintf(stderr,
+					"Invalid --time \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_LIST:
+			list = 1;
+			break;
+		case OPT_HELP:
+			print_help(argv[0]);
+			return 0;
+		case '?':
+			fprintf(stderr, "Unrecognized option: %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument to %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		default:
+			DIE;
+		}
+	}
+	if (errorcnt) {
+		print_help(argv[0]);
+		return 1;
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (list) {
+		for (i = 0; i < ARRAY_SIZE(benches); i++)
+			printf("%s\n", benches[i].name);
+		return 0;
+	}
+
+	/* The traversal is for show, but we don't want to see it */
+	devnull = fopen("/dev/null", "w");
+	if (!devnull) {
+		fprintf(stderr, "Can't open /dev/null\n");
+		return 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		const struct bench_s *b = &benches[i];
+
+		if (!selected(b->name, argc, argv))
+			continue;
+		crypto_provider = b->provider ? b->provider : provider;
+		if (b->prep(b->arg)) {
+			fprintf(stderr, "Can't set up %s\n", b->name);
+			errorcnt++;
+			continue;
+		}
+		printf("{\"name\":\"%s\",\"value\":%.1f,\"unit\":\"%s\"}\n",
+		       b->name, time_calls(b) * b->scale, b->unit);
+		fflush(stdout);
+	}
+
+	crypto_provider = provider;
+	fclose(devnull);
+	return !!errorcnt;
+}
+
+DECLARE_FUTIL_COMMAND(bench, do_bench,
+		      VBOOT_VERSION_ALL,
+		      "Time the library's and traversal's hot paths",
+		      print_help);
@@ -0,0 +1,901 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Building the bitmap block (the GBB's bmpfv) that the firmware draws its
+ * screens from.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "bmpblk_font.h"
+#include "bmpblk_header.h"
+#include "cryptolib.h"
+#include "futility.h"
+#include "host_common.h"
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] CONFIG OUTFILE\n"
+	"\n"
+	"Builds a bitmap block, for \"" MYNAME " gbb_utility -s --bmpfv\",\n"
+	"from the images and screens described in CONFIG. Each line of it\n"
+	"is one of:\n"
+	"\n"
+	"  image NAME FILE     An image: a BMP, or a font from bmpblk_font.\n"
+	"                        The HWID is drawn with a font named\n"
+	"                        " RENDER_HWID " (or " RENDER_HWID_RTOL
+	" for right-to-left).\n"
+	"  screen NAME X Y IMAGE [X Y IMAGE]...\n"
+	"                      A screen: images drawn in order, each with its\n"
+	"                        upper left corner at X,Y\n"
+	"  locale NAME SCREEN...\n"
+	"                      The screens for one localization, in the\n"
+	"                        order the firmware numbers them, or \"-\"\n"
+	"                        for none. Every locale has the same number.\n"
+	"\n"
+	"Anything after a '#' is ignored. Identical images are only stored\n"
+	"once, however many names, screens and locales they're used under.\n"
+	"\n"
+	"Options:\n"
+	"  --compress TYPE     \"lzma\" (the default), \"lz4\" or \"none\".\n"
+	"                        LZ4 is bigger, but much quicker for the\n"
+	"                        firmware to undo. Images that don't get any\n"
+	"                        smaller are stored as they are.\n"
+	"  --jobs NUM          Number of images to compress at once\n"
+	"                        (default is one per CPU)\n"
+	"\n";
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog);
+}
+
+enum {
+	OPT_COMPRESS = 1000,
+	OPT_JOBS,
+};
+
+static const struct option long_opts[] = {
+	/* name    hasarg *flag  val */
+	{"compress", 1, NULL, OPT_COMPRESS},
+	{"jobs",     1, NULL, OPT_JOBS},
+	{NULL,       0, NULL, 0},
+};
+
+struct bmp_image_s {
+	char *name;
+	char *file;
+	int lineno;
+	uint8_t *data;
+	uint64_t len;
+	ImageInfo info;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	/* An earlier image that's stored for this one, or NULL */
+	struct bmp_image_s *same;
+	/* For the ones that are stored, what gets stored, and where */
+	uint8_t *packed;
+	uint32_t offset;
+};
+
+/* These refer to images and screens by index, since those arrays grow */
+struct bmp_screen_s {
+	char *name;
+	ScreenLayout layout;
+	int image[MAX_IMAGE_IN_LAYOUT];
+	int count;
+};
+
+struct bmp_locale_s {
+	char *name;
+	int *screen;		/* -1 for none */
+};
+
+struct bmp_config_s {
+	struct bmp_image_s *image;
+	int image_count;
+	struct bmp_screen_s *screen;
+	int screen_count;
+	struct bmp_locale_s *locale;
+	int locale_count;
+	int screens_per_locale;
+};
+
+/* The images to compress, shared out among the workers */
+struct bmp_batch_s {
+	struct bmp_image_s **job;
+	int count;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+/* A config line has at most this many words */
+#define MAX_WORDS (2 + 3 * MAX_IMAGE_IN_LAYOUT)
+
+/* Each image's ImageInfo starts on a 4-byte boundary */
+#define BMP_ALIGN(x) (((x) + 3) & ~3ULL)
+
+static uint32_t compression = COMPRESS_LZMA1;
+static const char *config_name;
+
+static struct bmp_image_s *find_image(struct bmp_config_s *cfg,
+				      const char *name)
+{
+	int i;
+
+	for (i = 0; i < cfg->image_count; i++)
+		if (!strcmp(cfg->image[i].name, name))
+			return &cfg->image[i];
+	return NULL;
+}
+
+static struct bmp_screen_s *find_screen(struct bmp_config_s *cfg,
+					const char *name)
+{
+	int i;
+
+	for (i = 0; i < cfg->screen_count; i++)
+		if (!strcmp(cfg->screen[i].name, name))
+			return &cfg->screen[i];
+	return NULL;
+}
+
+/* Works out the ImageInfo for what [img] holds. Returns 0 if it's usable. */
+static int identify_image(struct bmp_image_s *img)
+{
+	const uint8_t *p = img->data;
+	int32_t width, height;
+
+	memset(&img->info, 0, sizeof(img->info));
+	if (img->len > UINT32_MAX) {
+		fprintf(stderr, "%s:%d: %s is too big\n",
+			config_name, img->lineno, img->file);
+		return 1;
+	}
+	img->info.original_size = img->len;
+
+	if (img->len >= 26 && p[0] == 'B' && p[1] == 'M') {
+		memcpy(&width, p + 18, sizeof(width));
+		memcpy(&height, p + 22, sizeof(height));
+		img->info.format = FORMAT_BMP;
+		img->info.width = width;
+		/* Negative heights are for top-down bitmaps */
+		img->info.height = height < 0 ? -height : height;
+	} else if (img->len >= sizeof(FontArrayHeader) &&
+		   !memcmp(p, FONT_SIGNATURE, FONT_SIGNATURE_SIZE)) {
+		img->info.format = FORMAT_FONT;
+	} else {
+		fprintf(stderr, "%s:%d: %s isn't a BMP or a font\n",
+			config_name, img->lineno, img->file);
+		return 1;
+	}
+
+	if (!strcmp(img->name, RENDER_HWID))
+		img->info.tag = TAG_HWID;
+	else if (!strcmp(img->name, RENDER_HWID_RTOL))
+		img->info.tag = TAG_HWID_RTOL;
+	if (img->info.tag && img->info.format != FORMAT_FONT) {
+		fprintf(stderr, "%s:%d: %s needs to be a font\n",
+			config_name, img->lineno, img->name);
+		return 1;
+	}
+
+	DigestBufInto(img->data, img->len, SHA256_DIGEST_ALGORITHM,
+		      img->digest);
+	return 0;
+}
+
+static int parse_image(struct bmp_config_s *cfg, int argc, char *argv[],
+		       int lineno)
+{
+	struct bmp_image_s *img;
+
+	if (argc != 3) {
+		fprintf(stderr, "%s:%d: image needs a NAME and a FILE\n",
+			config_name, lineno);
+		return 1;
+	}
+	if (find_image(cfg, argv[1])) {
+		fprintf(stderr, "%s:%d: there's already an image %s\n",
+			config_name, lineno, argv[1]);
+		return 1;
+	}
+
+	img = realloc(cfg->image, (cfg->image_count + 1) * sizeof(*img));
+	if (!img) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	cfg->image = img;
+	img = &cfg->image[cfg->image_count++];
+	memset(img, 0, sizeof(*img));
+	img->name = strdup(argv[1]);
+	img->file = strdup(argv[2]);
+	img->lineno = lineno;
+	if (!img->name || !img->file) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	img->data = ReadFile(img->file, &img->len);
+	if (!img->data) {
+		fprintf(stderr, "%s:%d: can't read %s\n",
+			config_name, lineno, img->file);
+		return 1;
+	}
+	return identify_image(img);
+}
+
+static int parse_screen(struct bmp_config_s *cfg, int argc, char *argv[],
+			int lineno)
+{
+	struct bmp_screen_s *scr;
+	struct bmp_image_s *img;
+	char *e;
+	int i;
+
+	if (argc < 2 || (argc - 2) % 3) {
+		fprintf(stderr, "%s:%d: screen needs a NAME, then an X, a Y "
+			"and an IMAGE for each image\n", config_name, lineno);
+		return 1;
+	}
+	if (find_screen(cfg, argv[1])) {
+		fprintf(stderr, "%s:%d: there's already a screen %s\n",
+			config_name, lineno, argv[1]);
+		return 1;
+	}
+
+	scr = realloc(cfg->screen, (cfg->screen_count + 1) * sizeof(*scr));
+	if (!scr) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	cfg->screen = scr;
+	scr = &cfg->screen[cfg->screen_count++];
+	memset(scr, 0, sizeof(*scr));
+	scr->name = strdup(argv[1]);
+	if (!scr->name) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	for (i = 2; i < argc; i += 3, scr->count++) {
+		scr->layout.images[scr->count].x = strtoul(argv[i], &e, 0);
+		if (!*argv[i] || *e) {
+			fprintf(stderr, "%s:%d: bad X \"%s\"\n",
+				config_name, lineno, argv[i]);
+			return 1;
+		}
+		scr->layout.images[scr->count].y = strtoul(argv[i + 1], &e, 0);
+		if (!*argv[i + 1] || *e) {
+			fprintf(stderr, "%s:%d: bad Y \"%s\"\n",
+				config_name, lineno, argv[i + 1]);
+			return 1;
+		}
+		img = find_image(cfg, argv[i + 2]);
+		if (!img) {
+			fprintf(stderr, "%s:%d: no image %s\n",
+				config_name, lineno, argv[i + 2]);
+			return 1;
+		}
+		scr->image[scr->count] = img - cfg->image;
+	}
+	return 0;
+}
+
+static int parse_locale(struct bmp_config_s *cfg, int argc, char *argv[],
+			int lineno)
+{
+	struct bmp_locale_s *loc;
+	struct bmp_screen_s *scr;
+	int i;
+
+	if (argc < 3) {
+		fprintf(stderr, "%s:%d: locale needs a NAME and its SCREENs\n",
+			config_name, lineno);
+		return 1;
+	}
+	if (cfg->locale_count && argc - 2 != cfg->screens_per_locale) {
+		fprintf(stderr, "%s:%d: locale %s has %d screens, not %d\n",
+			config_name, lineno, argv[1], argc - 2,
+			cfg->screens_per_locale);
+		return 1;
+	}
+	cfg->screens_per_locale = argc - 2;
+
+	loc = realloc(cfg->locale, (cfg->locale_count + 1) * sizeof(*loc));
+	if (!loc) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	cfg->locale = loc;
+	loc = &cfg->locale[cfg->locale_count++];
+	loc->name = strdup(argv[1]);
+	loc->screen = calloc(argc - 2, sizeof(*loc->screen));
+	if (!loc->name || !loc->screen) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	for (i = 2; i < argc; i++) {
+		loc->screen[i - 2] = -1;
+		if (!strcmp(argv[i], "-"))
+			continue;
+		scr = find_screen(cfg, argv[i]);
+		if (!scr) {
+			fprintf(stderr, "%s:%d: no screen %s\n",
+				config_name, lineno, argv[i]);
+			return 1;
+		}
+		loc->screen[i - 2] = scr - cfg->screen;
+	}
+	return 0;
+}
+
+/* Returns the number of errors */
+static int parse_config(struct bmp_config_s *cfg)
+{
+	char *argv[MAX_WORDS];
+	char *line = NULL;
+	size_t linesize = 0;
+	int lineno = 0;
+	int errors = 0;
+	int argc;
+	FILE *fp;
+
+	fp = fopen(config_name, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			config_name, strerror(errno));
+		return 1;
+	}
+
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		argc = futil_split_line(line, argv, MAX_WORDS);
+		if (!argc)
+			continue;
+		if (argc < 0) {
+			fprintf(stderr, "%s:%d: too many words\n",
+				config_name, lineno);
+			errors++;
+		} else if (!strcmp(argv[0], "image")) {
+			errors += parse_image(cfg, argc, argv, lineno);
+		} else if (!strcmp(argv[0], "screen")) {
+			errors += parse_screen(cfg, argc, argv, lineno);
+		} else if (!strcmp(argv[0], "locale")) {
+			errors += parse_locale(cfg, argc, argv, lineno);
+		} else {
+			fprintf(stderr, "%s:%d: don't know what \"%s\" is\n",
+				config_name, lineno, argv[0]);
+			errors++;
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	if (!errors && !cfg->locale_count) {
+		fprintf(stderr, "%s: no locales\n", config_name);
+		errors++;
+	}
+	return errors;
+}
+
+/*
+ * Compresses [img] with "xz --format=lzma", which is the LZMA1 the firmware
+ * undoes, into [*outp]. Returns 0 on success.
+ */
+static int compress_lzma(struct bmp_image_s *img, uint8_t **outp,
+			 uint64_t *lenp)
+{
+	char *const argv[] = {"xz", "--format=lzma", "-c", NULL};
+	uint64_t cap = img->len / 2 + 4096;
+	uint64_t got = 0;
+	uint8_t *out, *more;
+	ssize_t n = 0;
+	pid_t pid;
+	int fd, rfd;
+
+	fd = open(img->file, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			img->file, strerror(errno));
+		return 1;
+	}
+	rfd = futil_filter_start(fd, argv, &pid);
+	close(fd);
+	if (rfd < 0)
+		return 1;
+
+	out = malloc(cap);
+	while (out) {
+		if (got == cap) {
+			cap *= 2;
+			more = realloc(out, cap);
+			if (!more) {
+				free(out);
+				out = NULL;
+				break;
+			}
+			out = more;
+		}
+		n = read(rfd, out + got, cap - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+
+	if (futil_filter_finish(rfd, pid, argv[0], out && !n) || !out ||
+	    n < 0) {
+		fprintf(stderr, "Couldn't compress %s\n", img->file);
+		free(out);
+		return 1;
+	}
+
+	*outp = out;
+	*lenp = got;
+	return 0;
+}
+
+/* LZ4 frames; see lz4_Frame_format.md in the LZ4 sources */
+#define LZ4F_MAGIC 0x184D2204
+#define LZ4F_FLG_VERSION 0x40
+#define LZ4F_FLG_BLOCK_INDEPENDENT 0x20
+#define LZ4F_FLG_CONTENT_SIZE 0x08
+#define LZ4F_BD_4MB 0x70
+#define LZ4F_BLOCK_MAX (4 << 20)
+#define LZ4F_BLOCK_UNCOMPRESSED 0x80000000
+/* A block can't need more room than this to compress */
+#define LZ4_BOUND(len) ((len) + (len) / 255 + 16)
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+/* The format wants the last match to start this far from the end at least */
+#define LZ4_MF_LIMIT 12
+/* ...and the last 5 bytes to be literals */
+#define LZ4_LAST_LITERALS 5
+#define LZ4_HASH_BITS 12
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* xxHash32 of fewer than 16 bytes, which is all a frame descriptor can be */
+static uint32_t xxh32_short(const uint8_t *p, uint32_t len)
+{
+	const uint32_t p1 = 2654435761U, p2 = 2246822519U, p3 = 3266489917U;
+	const uint32_t p4 = 668265263U, p5 = 374761393U;
+	uint32_t h = p5 + len;
+	uint32_t v;
+
+	for (; len >= 4; len -= 4, p += 4) {
+		v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+		h += v * p3;
+		h = ((h << 17) | (h >> 15)) * p4;
+	}
+	for (; len; len--, p++) {
+		h += *p * p5;
+		h = ((h << 11) | (h >> 21)) * p1;
+	}
+	h ^= h >> 15;
+	h *= p2;
+	h ^= h >> 13;
+	h *= p3;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Writes the rest of an LZ4 length that didn't fit in 4 bits of the token */
+static uint8_t *lz4_length(uint8_t *op, uint32_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/* Writes a sequence of literals, then a match unless [match_len] is 0 */
+static uint8_t *lz4_sequence(uint8_t *op, const uint8_t *lit,
+			     uint32_t lit_len, uint32_t offset,
+			     uint32_t match_len)
+{
+	uint8_t *token = op++;
+
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		op = lz4_length(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (!match_len)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+	match_len -= LZ4_MIN_MATCH;
+	*token |= match_len < 15 ? match_len : 15;
+	if (match_len >= 15)
+		op = lz4_length(op, match_len - 15);
+	return op;
+}
+
+/*
+ * Compresses [len] bytes into an LZ4 block at [out], which has room for
+ * LZ4_BOUND(len), and returns its size. It only takes the first match it
+ * finds, since it's decompression speed we're after.
+ */
+static uint32_t lz4_block(const uint8_t *in, uint32_t len, uint8_t *out)
+{
+	uint32_t table[1 << LZ4_HASH_BITS];	/* Offsets + 1, or 0 */
+	const uint8_t *ip = in, *anchor = in, *ref;
+	const uint8_t *match_end = in + len - LZ4_LAST_LITERALS;
+	uint8_t *op = out;
+	uint32_t v, h, m;
+
+	memset(table, 0, sizeof(table));
+	while (len > LZ4_MF_LIMIT && ip < in + len - LZ4_MF_LIMIT) {
+		memcpy(&v, ip, sizeof(v));
+		h = (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+		ref = table[h] ? in + table[h] - 1 : NULL;
+		table[h] = ip - in + 1;
+		if (!ref || ip - ref > LZ4_MAX_OFFSET ||
+		    memcmp(ref, ip, LZ4_MIN_MATCH)) {
+			ip++;
+			continue;
+		}
+
+		for (m = LZ4_MIN_MATCH; ip + m < match_end && ref[m] == ip[m];
+		     m++)
+			;
+		op = lz4_sequence(op, anchor, ip - anchor, ip - ref, m);
+		ip += m;
+		anchor = ip;
+	}
+
+	return lz4_sequence(op, anchor, in + len - anchor, 0, 0) - out;
+}
+
+/*
+ * Compresses [img] into an LZ4 frame of independent blocks, with the
+ * content size, in [*out]. Returns 0 on success.
+ */
+static int compress_lz4(struct bmp_image_s *img, uint8_t **outp,
+			uint64_t *lenp)
+{
+	uint64_t cap = 15 + LZ4_BOUND(img->len) + 4 * (img->len /
+						       LZ4F_BLOCK_MAX + 2);
+	uint64_t pos, chunk;
+	uint8_t *out, *op;
+	uint32_t size;
+
+	out = malloc(cap);
+	if (!out) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	op = out;
+	put_le32(op, LZ4F_MAGIC);
+	op[4] = LZ4F_FLG_VERSION | LZ4F_FLG_BLOCK_INDEPENDENT |
+		LZ4F_FLG_CONTENT_SIZE;
+	op[5] = LZ4F_BD_4MB;
+	put_le32(op + 6, img->len);
+	put_le32(op + 10, img->len >> 32);
+	op[14] = xxh32_short(op + 4, 10) >> 8;
+	op += 15;
+
+	for (pos = 0; pos < img->len; pos += chunk) {
+		chunk = img->len - pos;
+		if (chunk > LZ4F_BLOCK_MAX)
+			chunk = LZ4F_BLOCK_MAX;
+		size = lz4_block(img->data + pos, chunk, op + 4);
+		/* Store it as it is if that's no bigger */
+		if (size >= chunk) {
+			memcpy(op + 4, img->data + pos, chunk);
+			size = chunk | LZ4F_BLOCK_UNCOMPRESSED;
+		}
+		put_le32(op, size);
+		op += 4 + (size & ~LZ4F_BLOCK_UNCOMPRESSED);
+	}
+	put_le32(op, 0);
+	op += 4;
+
+	*outp = out;
+	*lenp = op - out;
+	return 0;
+}
+
+/* Compresses [img] into img->packed. Returns 0 on success. */
+static int compress_image(struct bmp_image_s *img)
+{
+	uint8_t *out;
+	uint64_t len;
+
+	if (compression == COMPRESS_LZ4 ? compress_lz4(img, &out, &len) :
+	    compress_lzma(img, &out, &len))
+		return 1;
+
+	/* There's no point making the firmware undo it if it didn't help */
+	if (len >= img->len) {
+		free(out);
+		return 0;
+	}
+	img->packed = out;
+	img->info.compression = compression;
+	img->info.compressed_size = len;
+	return 0;
+}
+
+static void compress_one(void *arg, uint32_t index)
+{
+	struct bmp_batch_s *batch = arg;
+
+	if (compress_image(batch->job[index])) {
+		pthread_mutex_lock(&batch->lock);
+		batch->failed++;
+		pthread_mutex_unlock(&batch->lock);
+	}
+}
+
+/*
+ * Points each image at an earlier identical one, if there is one. Returns
+ * the images that are left to store, which the caller must free.
+ */
+static struct bmp_image_s **find_unique(struct bmp_config_s *cfg, int *count)
+{
+	struct bmp_image_s **unique;
+	struct bmp_image_s *a, *b;
+	int i, j;
+
+	unique = calloc(cfg->image_count, sizeof(*unique));
+	if (!unique)
+		return NULL;
+
+	*count = 0;
+	for (i = 0; i < cfg->image_count; i++) {
+		a = &cfg->image[i];
+		for (j = 0; j < *count && !a->same; j++) {
+			b = unique[j];
+			if (a->len == b->len && a->info.tag == b->info.tag &&
+			    !memcmp(a->digest, b->digest, sizeof(a->digest)) &&
+			    !memcmp(a->data, b->data, a->len))
+				a->same = b;
+		}
+		if (!a->same)
+			unique[(*count)++] = a;
+	}
+	return unique;
+}
+
+static int compress_all(struct bmp_image_s **unique, int count,
+			int nthreads)
+{
+	struct bmp_batch_s batch;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.job = unique;
+	batch.count = count;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	futil_run_jobs(compress_one, NULL, &batch, count, nthreads);
+	pthread_mutex_destroy(&batch.lock);
+	return batch.failed;
+}
+
+/* Lays out and writes the bitmap block. Returns 0 on success. */
+static int write_bmpblk(struct bmp_config_s *cfg, struct bmp_image_s **unique,
+			int count, const char *outfile)
+{
+	BmpBlockHeader *hdr;
+	ScreenLayout *layout;
+	struct bmp_screen_s *scr;
+	struct bmp_image_s *img;
+	uint64_t size, locale_offset, saved = 0;
+	uint8_t *buf, *p;
+	int i, j, k;
+
+	/* Work out where everything goes */
+	size = sizeof(*hdr) + (uint64_t)cfg->locale_count *
+		cfg->screens_per_locale * sizeof(*layout);
+	for (i = 0; i < count; i++) {
+		img = unique[i];
+		if (!img->packed)
+			img->info.compressed_size = img->len;
+		size = BMP_ALIGN(size);
+		img->offset = size;
+		size += sizeof(img->info) + img->info.compressed_size;
+	}
+	locale_offset = size;
+	for (i = 0; i < cfg->locale_count; i++)
+		size += strlen(cfg->locale[i].name) + 1;
+	size++;
+	if (size > UINT32_MAX) {
+		fprintf(stderr, "The bitmap block would be too big\n");
+		return 1;
+	}
+
+	buf = calloc(1, size);
+	if (!buf) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	hdr = (BmpBlockHeader *)buf;
+	memcpy(hdr->signature, BMPBLOCK_SIGNATURE, BMPBLOCK_SIGNATURE_SIZE);
+	hdr->major_version = BMPBLOCK_MAJOR_VERSION;
+	hdr->minor_version = BMPBLOCK_MINOR_VERSION;
+	hdr->number_of_localizations = cfg->locale_count;
+	hdr->number_of_screenlayouts = cfg->screens_per_locale;
+	hdr->number_of_imageinfos = count;
+	hdr->locale_string_offset = locale_offset;
+
+	/* Every use of an image points at the one copy of it */
+	layout = (ScreenLayout *)(hdr + 1);
+	for (i = 0; i < cfg->locale_count; i++) {
+		for (j = 0; j < cfg->screens_per_locale; j++, layout++) {
+			if (cfg->locale[i].screen[j] < 0)
+				continue;
+			scr = &cfg->screen[cfg->locale[i].screen[j]];
+			*layout = scr->layout;
+			for (k = 0; k < scr->count; k++) {
+				img = &cfg->image[scr->image[k]];
+				if (img->same)
+					img = img->same;
+				layout->images[k].image_info_offset =
+					img->offset;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		img = unique[i];
+		p = buf + img->offset;
+		memcpy(p, &img->info, sizeof(img->info));
+		memcpy(p + sizeof(img->info),
+		       img->packed ? img->packed : img->data,
+		       img->info.compressed_size);
+	}
+	for (i = 0; i < cfg->image_count; i++)
+		if (cfg->image[i].same)
+			saved += cfg->image[i].same->info.compressed_size;
+
+	p = buf + locale_offset;
+	for (i = 0; i < cfg->locale_count; i++) {
+		strcpy((char *)p, cfg->locale[i].name);
+		p += strlen(cfg->locale[i].name) + 1;
+	}
+
+	i = futil_write_file(outfile, buf, size);
+	free(buf);
+	if (i)
+		return 1;
+
+	printf("Wrote %s: %" PRIu64 " bytes, %d locales, %d of %d images"
+	       " stored (%" PRIu64 " bytes saved by sharing)\n", outfile,
+	       size, cfg->locale_count, count, cfg->image_count, saved);
+	return 0;
+}
+
+static void free_config(struct bmp_config_s *cfg)
+{
+	int i;
+
+	for (i = 0; i < cfg->image_count; i++) {
+		free(cfg->image[i].name);
+		free(cfg->image[i].file);
+		free(cfg->image[i].data);
+		free(cfg->image[i].packed);
+	}
+	free(cfg->image);
+	for (i = 0; i < cfg->screen_count; i++)
+		free(cfg->screen[i].name);
+	free(cfg->screen);
+	for (i = 0; i < cfg->locale_count; i++) {
+		free(cfg->locale[i].name);
+		free(cfg->locale[i].screen);
+	}
+	free(cfg->locale);
+}
+
+static int do_bmpblk(int argc, char *argv[])
+{
+	struct bmp_config_s cfg;
+	struct bmp_image_s **unique = NULL;
+	int count = 0;
+	int jobs = 0;
+	int errorcnt = 0;
+	char *e;
+	int i;
+
+	opterr = 0;		/* quiet, you */
+	while ((i = getopt_long(argc, argv, ":", long_opts, NULL)) != -1) {
+		switch (i) {
+		case OPT_COMPRESS:
+			if (!strcmp(optarg, "lzma")) {
+				compression = COMPRESS_LZMA1;
+			} else if (!strcmp(optarg, "lz4")) {
+				compression = COMPRESS_LZ4;
+			} else if (!strcmp(optarg, "none")) {
+				compression = COMPRESS_NONE;
+			} else {
+				fprintf(stderr, "Unknown --compress \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_JOBS:
+			jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || jobs < 1) {
+				fprintf(stderr, "Invalid --jobs \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case '?':
+			if (optopt)
+				fprintf(stderr, "Unrecognized option: -%c\n",
+					optopt);
+			else
+				fprintf(stderr, "Unrecognized option: %s\n",
+					argv[optind - 1]);
+			errorcnt++;
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument to %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, "Give a CONFIG and an OUTFILE\n");
+		errorcnt++;
+	}
+	if (errorcnt) {
+		print_help(argv[0]);
+		return 1;
+	}
+	config_name = argv[optind];
+
+	memset(&cfg, 0, sizeof(cfg));
+	errorcnt = parse_config(&cfg);
+	if (errorcnt)
+		goto done;
+
+	unique = find_unique(&cfg, &count);
+	if (!unique) {
+		fprintf(stderr, "Out of memory\n");
+		errorcnt++;
+		goto done;
+	}
+
+	if (compression != COMPRESS_NONE)
+		errorcnt += compress_all(unique, count, jobs);
+	if (!errorcnt)
+		errorcnt += write_bmpblk(&cfg, unique, count,
+					 argv[optind + 1]);
+
+done:
+	free(unique);
+	free_config(&cfg);
+	return !!errorcnt;
+}
+
+DECLARE_FUTIL_COMMAND(bmpblk, do_bmpblk,
+		      VBOOT_VERSION_ALL,
+		      "Build a bitmap block of firmware screens for the GBB",
+		      print_help);
@@ -0,0 +1,504 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Runs the firmware's verified boot path on the host against real images,
+ * adding up how long its reads would have taken on the storage a device
+ * has, so that changes to that path can be judged end to end.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "futility.h"
+#include "rollback_index.h"
+#include "tpm_bootmode.h"
+#include "vboot_api.h"
+#include "vboot_api_stub_disk.h"
+#include "vboot_api_stub_sf.h"
+#include "vboot_struct.h"
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] BIOS DISK\n"
+	"\n"
+	"Boots the BIOS image from the DISK image the way the firmware would,\n"
+	"by running VbInit(), VbSelectFirmware() and VbSelectAndLoadKernel()\n"
+	"on them, and prints how long each step would have taken on a device.\n"
+	"That's the CPU time it took here, times --cpu-scale, plus the time\n"
+	"each read would have taken on the flash or disk, plus the time for\n"
+	"each TPM command. Reads are modeled as a fixed time per transaction\n"
+	"and a bandwidth, one at a time; prefetch hints cost nothing.\n"
+	"\n"
+	"Options:\n"
+	"  --flash MODEL       What the BIOS is read from (default spi)\n"
+	"  --disk MODEL        What the DISK is read from (default emmc)\n"
+	"  --tpm US            Microseconds per TPM command (default %d)\n"
+	"  --cpu-scale NUM     How many times slower the device's CPU is than\n"
+	"                        this one (default 1)\n"
+	"  --gbb-cache SIZE    Give the firmware a GBB read cache of SIZE\n"
+	"                        bytes (K or M; default none)\n"
+	"  --kernel-buffer SIZE\n"
+	"                      Room for the kernel (default %dM)\n"
+	"  --json              Print one JSON object per step instead\n"
+	"\n"
+	"A MODEL is one of\n"
+	"\n";
+
+/* The time for one read is setup_us, plus its size over the bandwidth */
+struct sim_bus_s {
+	const char *name;
+	double setup_us;
+	double mb_per_s;
+	const char *desc;
+};
+
+static const struct sim_bus_s sim_buses[] = {
+	{"spi", 10, 25, "SPI flash, 50MHz quad fast read"},
+	{"emmc", 100, 150, "eMMC, HS200"},
+	{"usb2", 500, 30, "USB 2.0 mass storage"},
+	{"nvme", 20, 1500, "NVMe SSD, PCIe gen3 x2"},
+};
+
+#define DEFAULT_TPM_US 1000
+#define DEFAULT_KERNEL_BUFFER_MB 64
+
+static void print_help(const char *prog)
+{
+	int i;
+
+	printf(usage, prog, DEFAULT_TPM_US, DEFAULT_KERNEL_BUFFER_MB);
+	for (i = 0; i < ARRAY_SIZE(sim_buses); i++)
+		printf("  %-6s  %s: %gus + %gMB/s\n", sim_buses[i].name,
+		       sim_buses[i].desc, sim_buses[i].setup_us,
+		       sim_buses[i].mb_per_s);
+	printf("\n"
+	       "or US,MB for US microseconds per read plus MB megabytes a "
+	       "second.\n\n");
+}
+
+/* What went on in one step of the boot */
+struct sim_phase_s {
+	const char *name;
+	uint64_t flash_reads, flash_bytes;
+	uint64_t disk_reads, disk_bytes;
+	uint64_t tpm_cmds;
+	double flash_ms, disk_ms, tpm_ms;
+	double cpu_ms;
+};
+
+enum {
+	PHASE_INIT,
+	PHASE_FIRMWARE,
+	PHASE_KERNEL,
+	NUM_PHASES,
+};
+
+static struct sim_phase_s phases[NUM_PHASES] = {
+	{"VbInit"},
+	{"VbSelectFirmware"},
+	{"VbSelectAndLoadKernel"},
+};
+
+/* Where the reads and TPM commands go. The disks may be read by threads. */
+static struct sim_phase_s *phase = &phases[PHASE_INIT];
+static pthread_mutex_t phase_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sim_bus_s flash_bus, disk_bus;
+static double tpm_us = DEFAULT_TPM_US;
+
+static double read_ms(const struct sim_bus_s *bus, uint64_t bytes)
+{
+	return (bus->setup_us + bytes / bus->mb_per_s) / 1000.0;
+}
+
+static void flash_read(void *arg, uint64_t offset, uint64_t bytes)
+{
+	pthread_mutex_lock(&phase_lock);
+	phase->flash_reads++;
+	phase->flash_bytes += bytes;
+	phase->flash_ms += read_ms(&flash_bus, bytes);
+	pthread_mutex_unlock(&phase_lock);
+}
+
+static void disk_read(void *arg, uint64_t offset, uint64_t bytes)
+{
+	pthread_mutex_lock(&phase_lock);
+	phase->disk_reads++;
+	phase->disk_bytes += bytes;
+	phase->disk_ms += read_ms(&disk_bus, bytes);
+	pthread_mutex_unlock(&phase_lock);
+}
+
+/*
+ * A TPM that's been set up already, with every version at 0, so anything
+ * properly signed boots. Each call costs one command.
+ */
+static uint32_t sim_fw_version, sim_kernel_version;
+static uint8_t sim_backup[BACKUP_NV_SIZE];
+
+static uint32_t tpm_command(void)
+{
+	pthread_mutex_lock(&phase_lock);
+	phase->tpm_cmds++;
+	phase->tpm_ms += tpm_us / 1000.0;
+	pthread_mutex_unlock(&phase_lock);
+	return TPM_SUCCESS;
+}
+
+uint32_t RollbackS3Resume(void)
+{
+	return tpm_command();
+}
+
+uint32_t RollbackFirmwareSetup(int is_hw_dev, int disable_dev_request,
+			       int clear_tpm_owner_request,
+			       int *is_virt_dev, uint32_t *tpm_version)
+{
+	*is_virt_dev = 0;
+	*tpm_version = sim_fw_version;
+	return tpm_command();
+}
+
+uint32_t RollbackFirmwareWrite(uint32_t version)
+{
+	sim_fw_version = version;
+	return tpm_command();
+}
+
+uint32_t RollbackFirmwareLock(void)
+{
+	return tpm_command();
+}
+
+uint32_t RollbackKernelRead(uint32_t *version)
+{
+	*version = sim_kernel_version;
+	return tpm_command();
+}
+
+uint32_t RollbackKernelWrite(uint32_t version)
+{
+	sim_kernel_version = version;
+	return tpm_command();
+}
+
+uint32_t RollbackBackupRead(uint8_t *raw)
+{
+	memcpy(raw, sim_backup, sizeof(sim_backup));
+	return tpm_command();
+}
+
+uint32_t RollbackBackupWrite(uint8_t *raw)
+{
+	memcpy(sim_backup, raw, sizeof(sim_backup));
+	return tpm_command();
+}
+
+uint32_t RollbackKernelLock(int recovery_mode)
+{
+	return tpm_command();
+}
+
+uint32_t SetVirtualDevMode(int val)
+{
+	return tpm_command();
+}
+
+uint32_t SetTPMBootModeState(int developer_mode, int recovery_mode,
+			     uint64_t fw_keyblock_flags,
+			     GoogleBinaryBlockHeader *gbb)
+{
+	return tpm_command();
+}
+
+/* CPU time of every thread, in ms */
+static double cpu_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Takes "spi" or "10,25" */
+static int parse_bus(const char *str, struct sim_bus_s *bus)
+{
+	char *e;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sim_buses); i++) {
+		if (!strcmp(str, sim_buses[i].name)) {
+			*bus = sim_buses[i];
+			return 0;
+		}
+	}
+
+	bus->name = str;
+	bus->setup_us = strtod(str, &e);
+	if (e == str || *e != ',' || bus->setup_us < 0)
+		return 1;
+	str = e + 1;
+	bus->mb_per_s = strtod(str, &e);
+	return e == str || *e || bus->mb_per_s <= 0;
+}
+
+static double phase_ms(const struct sim_phase_s *p, double cpu_scale)
+{
+	return p->cpu_ms * cpu_scale + p->flash_ms + p->disk_ms + p->tpm_ms;
+}
+
+static void print_phase(const struct sim_phase_s *p, double cpu_scale,
+			int json)
+{
+	if (json) {
+		printf("{\"name\":\"%s\",\"ms\":%.3f,\"cpu_ms\":%.3f,"
+		       "\"flash_reads\":%" PRIu64 ",\"flash_bytes\":%" PRIu64
+		       ",\"flash_ms\":%.3f,\"disk_reads\":%" PRIu64
+		       ",\"disk_bytes\":%" PRIu64 ",\"disk_ms\":%.3f,"
+		       "\"tpm_cmds\":%" PRIu64 ",\"tpm_ms\":%.3f}\n",
+		       p->name, phase_ms(p, cpu_scale), p->cpu_ms * cpu_scale,
+		       p->flash_reads, p->flash_bytes, p->flash_ms,
+		       p->disk_reads, p->disk_bytes, p->disk_ms,
+		       p->tpm_cmds, p->tpm_ms);
+		return;
+	}
+	printf("%-22s %9.3f %9.3f %6" PRIu64 " %10" PRIu64 " %9.3f %6" PRIu64
+	       " %10" PRIu64 " %9.3f %4" PRIu64 " %8.3f\n",
+	       p->name, phase_ms(p, cpu_scale), p->cpu_ms * cpu_scale,
+	       p->flash_reads, p->flash_bytes, p->flash_ms,
+	       p->disk_reads, p->disk_bytes, p->disk_ms,
+	       p->tpm_cmds, p->tpm_ms);
+}
+
+enum no_short_opts {
+	OPT_FLASH = 1000,
+	OPT_DISK,
+	OPT_TPM,
+	OPT_CPU_SCALE,
+	OPT_GBB_CACHE,
+	OPT_KERNEL_BUFFER,
+	OPT_JSON,
+	OPT_HELP,
+};
+
+static const struct option long_opts[] = {
+	/* name    hasarg *flag  val */
+	{"flash",         1, NULL, OPT_FLASH},
+	{"disk",          1, NULL, OPT_DISK},
+	{"tpm",           1, NULL, OPT_TPM},
+	{"cpu-scale",     1, NULL, OPT_CPU_SCALE},
+	{"gbb-cache",     1, NULL, OPT_GBB_CACHE},
+	{"kernel-buffer", 1, NULL, OPT_KERNEL_BUFFER},
+	{"json",          0, NULL, OPT_JSON},
+	{"help",          0, NULL, OPT_HELP},
+	{NULL,            0, NULL, 0},
+};
+
+static int do_bootsim(int argc, char *argv[])
+{
+	VbCommonParams cparams;
+	VbInitParams iparams;
+	VbSelectFirmwareParams fparams;
+	VbSelectAndLoadKernelParams kparams;
+	VbDiskInfo disk;
+	struct sim_phase_s total = {"total"};
+	uint64_t gbb_cache_size = 0;
+	uint64_t kernel_buffer_size = DEFAULT_KERNEL_BUFFER_MB << 20;
+	double cpu_scale = 1, start;
+	VbError_t rv;
+	char *e;
+	int json = 0;
+	int errorcnt = 0;
+	int i;
+
+	flash_bus = sim_buses[0];
+	disk_bus = sim_buses[1];
+
+	opterr = 0;		/* quiet, you */
+	while ((i = getopt_long(argc, argv, ":", long_opts, NULL)) != -1) {
+		switch (i) {
+		case OPT_FLASH:
+			if (parse_bus(optarg, &flash_bus)) {
+				fprintf(stderr, "Invalid --flash \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_DISK:
+			if (parse_bus(optarg, &disk_bus)) {
+				fprintf(stderr, "Invalid --disk \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_TPM:
+			tpm_us = strtod(optarg, &e);
+			if (e == optarg || *e || tpm_us < 0) {
+				fprintf(stderr, "Invalid --tpm \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_CPU_SCALE:
+			cpu_scale = strtod(optarg, &e);
+			if (e == optarg || *e || cpu_scale <= 0) {
+				fprintf(stderr, "Invalid --cpu-scale \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_GBB_CACHE:
+			if (futil_parse_size(optarg, &gbb_cache_size) ||
+			    gbb_cache_size < VB_GBB_CACHE_SIZE(1) ||
+			    gbb_cache_size > UINT32_MAX) {
+				fprintf(stderr, "Invalid --gbb-cache \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_KERNEL_BUFFER:
+			if (futil_parse_size(optarg, &kernel_buffer_size) ||
+			    kernel_buffer_size > UINT32_MAX) {
+				fprintf(stderr,
+					"Invalid --kernel-buffer \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_JSON:
+			json = 1;
+			break;
+		case OPT_HELP:
+			print_help(argv[0]);
+			return 0;
+		case '?':
+			fprintf(stderr, "Unrecognized option: %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument to %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		default:
+			DIE;
+		}
+	}
+	if (errorcnt || argc - optind != 2) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	memset(&cparams, 0, sizeof(cparams));
+	memset(&iparams, 0, sizeof(iparams));
+	memset(&fparams, 0, sizeof(fparams));
+	memset(&kparams, 0, sizeof(kparams));
+
+	/* The GBB is read through VbExRegionRead(), as from flash */
+	if (VbExFirmwareOpenFile(argv[optind], &cparams, &fparams)) {
+		fprintf(stderr, "Can't find VBLOCK_A/B and FW_MAIN_A/B in %s\n",
+			argv[optind]);
+		return 1;
+	}
+	VbExFirmwareSetReadHook(&cparams, flash_read, NULL);
+	if (VbExDiskOpenFile(argv[optind + 1], 512, &disk)) {
+		fprintf(stderr, "Can't open %s\n", argv[optind + 1]);
+		VbExFirmwareCloseFile(&cparams);
+		return 1;
+	}
+	VbExDiskSetReadHook(disk.handle, disk_read, NULL);
+
+	cparams.shared_data_size = VB_SHARED_DATA_REC_SIZE;
+	cparams.shared_data_blob = calloc(1, cparams.shared_data_size);
+	cparams.gbb_cache_size = gbb_cache_size;
+	cparams.gbb_cache = gbb_cache_size ? calloc(1, gbb_cache_size) : NULL;
+	kparams.kernel_buffer_size = kernel_buffer_size;
+	kparams.kernel_buffer = malloc(kernel_buffer_size);
+	if (!cparams.shared_data_blob || !kparams.kernel_buffer ||
+	    (gbb_cache_size && !cparams.gbb_cache)) {
+		fprintf(stderr, "Out of memory\n");
+		errorcnt++;
+		goto done;
+	}
+
+	phase = &phases[PHASE_INIT];
+	start = cpu_ms();
+	rv = VbInit(&cparams, &iparams);
+	phase->cpu_ms = cpu_ms() - start;
+	if (rv) {
+		fprintf(stderr, "VbInit() failed: 0x%x\n", rv);
+		errorcnt++;
+		goto done;
+	}
+
+	/* The caller reads both verification blocks before asking */
+	phase = &phases[PHASE_FIRMWARE];
+	flash_read(NULL, 0, fparams.verification_size_A);
+	flash_read(NULL, 0, fparams.verification_size_B);
+	start = cpu_ms();
+	rv = VbSelectFirmware(&cparams, &fparams);
+	phase->cpu_ms = cpu_ms() - start;
+	if (rv) {
+		fprintf(stderr, "VbSelectFirmware() failed: 0x%x\n", rv);
+		errorcnt++;
+		goto done;
+	}
+
+	phase = &phases[PHASE_KERNEL];
+	start = cpu_ms();
+	rv = VbSelectAndLoadKernel(&cparams, &kparams);
+	phase->cpu_ms = cpu_ms() - start;
+	if (rv) {
+		fprintf(stderr, "VbSelectAndLoadKernel() failed: 0x%x\n", rv);
+		errorcnt++;
+		goto done;
+	}
+
+	if (!json) {
+		printf("Booted firmware %c and kernel partition %u\n"
+		       "flash: %s (%gus + %gMB/s), disk: %s (%gus + %gMB/s), "
+		       "TPM: %gus, CPU x%g\n\n",
+		       fparams.selected_firmware == VB_SELECT_FIRMWARE_B ?
+		       'B' : 'A', kparams.partition_number,
+		       flash_bus.name, flash_bus.setup_us, flash_bus.mb_per_s,
+		       disk_bus.name, disk_bus.setup_us, disk_bus.mb_per_s,
+		       tpm_us, cpu_scale);
+		printf("%-22s %9s %9s %6s %10s %9s %6s %10s %9s %4s %8s\n",
+		       "step", "ms", "cpu_ms", "flash", "bytes", "ms",
+		       "disk", "bytes", "ms", "tpm", "ms");
+	}
+	for (i = 0; i < NUM_PHASES; i++) {
+		print_phase(&phases[i], cpu_scale, json);
+		total.flash_reads += phases[i].flash_reads;
+		total.flash_bytes += phases[i].flash_bytes;
+		total.flash_ms += phases[i].flash_ms;
+		total.disk_reads += phases[i].disk_reads;
+		total.disk_bytes += phases[i].disk_bytes;
+		total.disk_ms += phases[i].disk_ms;
+		total.tpm_cmds += phases[i].tpm_cmds;
+		total.tpm_ms += phases[i].tpm_ms;
+		total.cpu_ms += phases[i].cpu_ms;
+	}
+	print_phase(&total, cpu_scale, json);
+
+done:
+	VbExDiskCloseFile(disk.handle);
+	VbExFirmwareCloseFile(&cparams);
+	free(cparams.shared_data_blob);
+	free(cparams.gbb_cache);
+	free(kparams.kernel_buffer);
+	return !!errorcnt;
+}
+
+DECLARE_FUTIL_COMMAND(bootsim, do_bootsim,
+		      VBOOT_VERSION_1_0,
+		      "Time the boot path on modeled flash, disk and TPM",
+		      print_help);
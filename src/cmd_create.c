@@ -3,115 +3,172 @@
  * found in the LICENSE file.
  */
 
+#include <dirent.h>
+#include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <openssl/pem.h>
 
-#include "2sysincludes.h"
-#include "2common.h"
-#include "2guid.h"
-#include "2rsa.h"
-#include "util_misc.h"
-#include "vb2_common.h"
-#include "vb2_struct.h"
-
-#include "host_key.h"
-#include "host_key2.h"
-#include "host_misc2.h"
-
 #include "futility.h"
+#include "host_common.h"
+#include "util_misc.h"
 
 /* Command line options */
 enum {
 	OPT_OUTFILE = 1000,
 	OPT_VERSION,
-	OPT_DESC,
-	OPT_GUID,
 	OPT_HASH_ALG,
+	OPT_BATCH,
+	OPT_GENERATE,
+	OPT_BITS,
+	OPT_JOBS,
+};
+
+/* The hashes a vb1 key can use, numbered as the vb21 tools number them */
+static const struct {
+	const char *name;
+	int num;
+} hash_algs[] = {
+	{"SHA1", 1},
+	{"SHA256", 2},
+	{"SHA512", 3},
 };
 
+/* The RSA sizes, in the order of the vb1 algorithms */
+static const int rsa_bits[] = { 1024, 2048, 4096, 8192 };
+
 #define DEFAULT_VERSION 1
-#define DEFAULT_HASH VB2_HASH_SHA256;
+#define DEFAULT_HASH 2
+#define DEFAULT_BITS 2048
 
-static char *infile, *outfile, *outext;
+static char *infile;
 static uint32_t opt_version = DEFAULT_VERSION;
-enum vb2_hash_algorithm opt_hash_alg = DEFAULT_HASH;
-static char *opt_desc;
-static struct vb2_guid opt_guid;
+static int opt_hash_alg = DEFAULT_HASH;
+static char *opt_batch;
+static int opt_generate;
+static int opt_bits = DEFAULT_BITS;
+static int opt_jobs;
+
+/* Batches only report the status of each keypair */
+static int quiet;
 
 static const struct option long_opts[] = {
 	{"version",  1, 0, OPT_VERSION},
-	{"desc",     1, 0, OPT_DESC},
-	{"guid",     1, 0, OPT_GUID},
 	{"hash_alg", 1, 0, OPT_HASH_ALG},
+	{"batch",    1, 0, OPT_BATCH},
+	{"generate", 1, 0, OPT_GENERATE},
+	{"bits",     1, 0, OPT_BITS},
+	{"jobs",     1, 0, OPT_JOBS},
 	{NULL, 0, 0, 0}
 };
 
 static void print_help(const char *progname)
 {
-	struct vb2_text_vs_enum *entry;
+	int i;
 
 	printf("\n"
 "Usage:  " MYNAME " %s [options] <INFILE> [<BASENAME>]\n", progname);
 	printf("\n"
-"Create a keypair from an RSA key (.pem file).\n"
+"Create a vb1 keypair (.vbprivk and .vbpubk) from an RSA key (.pem file).\n"
 "\n"
 "Options:\n"
 "\n"
 "  --version <number>          Key version (default %d)\n"
 "  --hash_alg <number>         Hashing algorithm to use:\n",
 		DEFAULT_VERSION);
-	for (entry = vb2_text_vs_hash; entry->name; entry++)
+	for (i = 0; i < ARRAY_SIZE(hash_algs); i++)
 		printf("                                %d / %s%s\n",
-		       entry->num, entry->name,
-		       entry->num == VB2_HASH_SHA256 ? " (default)" : "");
+		       hash_algs[i].num, hash_algs[i].name,
+		       hash_algs[i].num == DEFAULT_HASH ? " (default)" : "");
 	printf(
-"  --guid <guid>               Identifier for this keypair (vb21 only)\n"
-"  --desc <text>               Human-readable description (vb21 only)\n"
-"\n");
+"\n"
+"To create many keypairs at once:\n"
+"\n"
+"  " MYNAME " %s [options] --batch <DIR | MANIFEST>\n"
+"  " MYNAME " %s [options] --generate <count> <BASENAME>\n"
+"\n"
+"  --batch <DIR | MANIFEST>    Convert every .pem file in DIR, or those\n"
+"                                named by MANIFEST, one <INFILE>\n"
+"                                [<BASENAME>] per line\n"
+"  --generate <count>          Make <count> new RSA keys, named\n"
+"                                <BASENAME>_1 and so on\n"
+"  --bits <number>             Size of the new keys (default %d)\n"
+"  --jobs <number>             Number of keypairs to create in\n"
+"                                parallel (default is one per CPU)\n"
+"\n", progname, progname, DEFAULT_BITS);
 
 }
 
-static int vb1_make_keypair()
+/* Returns NULL (with a complaint) if it can't */
+static RSA *read_rsa_key(const char *filename)
 {
-	VbPrivateKey *privkey = 0;
-	VbPublicKey *pubkey = 0;
-	RSA *rsa_key = 0;
-	uint8_t *keyb_data = 0;
-	uint32_t keyb_size;
-	enum vb2_signature_algorithm sig_alg;
-	uint64_t vb1_algorithm;
+	RSA *rsa_key;
 	FILE *fp;
-	int ret = 1;
 
-	fp = fopen(infile, "rb");
+	fp = fopen(filename, "rb");
 	if (!fp) {
-		fprintf(stderr, "Unable to open %s\n", infile);
-		goto done;
+		fprintf(stderr, "Unable to open %s\n", filename);
+		return NULL;
 	}
 
 	rsa_key = PEM_read_RSAPrivateKey(fp, NULL, NULL, NULL);
 	fclose(fp);
 
-	if (!rsa_key) {
-		fprintf(stderr, "Unable to read RSA key from %s\n", infile);
-		goto done;
+	if (!rsa_key)
+		fprintf(stderr, "Unable to read RSA key from %s\n", filename);
+	return rsa_key;
+}
+
+/* Returns NULL (with a complaint) if it can't */
+static RSA *generate_rsa_key(int bits)
+{
+	BIGNUM *e = BN_new();
+	RSA *rsa_key = RSA_new();
+
+	if (!e || !rsa_key || !BN_set_word(e, RSA_F4) ||
+	    !RSA_generate_key_ex(rsa_key, bits, e, NULL)) {
+		fprintf(stderr, "Unable to generate a %d-bit RSA key\n", bits);
+		RSA_free(rsa_key);
+		rsa_key = NULL;
 	}
+	BN_free(e);
+	return rsa_key;
+}
 
-	sig_alg = vb2_rsa_sig_alg(rsa_key);
-	if (sig_alg == VB2_SIG_INVALID) {
+/*
+ * Writes the keypair for [rsa_key] to [outfile], with the extensions put
+ * at [outext]. The caller still owns [rsa_key].
+ */
+static int vb1_make_keypair(RSA *rsa_key, char *outfile, char *outext)
+{
+	VbPrivateKey *privkey = 0;
+	VbPublicKey *pubkey = 0;
+	uint8_t *keyb_data = 0;
+	uint32_t keyb_size;
+	uint64_t vb1_algorithm;
+	int i, ret = 1;
+
+	for (i = 0; i < ARRAY_SIZE(rsa_bits); i++)
+		if (RSA_size(rsa_key) * 8 == rsa_bits[i])
+			break;
+	if (i == ARRAY_SIZE(rsa_bits)) {
 		fprintf(stderr, "Unsupported sig algorithm in RSA key\n");
 		goto done;
 	}
 
-	/* combine the sig_alg with the hash_alg to get the vb1 algorithm */
-	vb1_algorithm = (sig_alg - VB2_SIG_RSA1024) * 3
-		+ opt_hash_alg - VB2_HASH_SHA1;
+	/* combine the RSA size with the hash_alg to get the vb1 algorithm */
+	vb1_algorithm = i * ARRAY_SIZE(hash_algs) + opt_hash_alg - 1;
 
-	/* Create the private key */
-	privkey = (VbPrivateKey *)malloc(sizeof(VbPrivateKey));
+	/* Create the private key, which is only written, never signed with */
+	privkey = calloc(1, sizeof(*privkey));
 	if (!privkey)
 		goto done;
 
@@ -124,7 +181,8 @@ static int vb1_make_keypair()
 		fprintf(stderr, "unable to write private key\n");
 		goto done;
 	}
-	fprintf(stderr, "wrote %s\n", outfile);
+	if (!quiet)
+		fprintf(stderr, "wrote %s\n", outfile);
 
 	/* Create the public key */
 	ret = vb_keyb_from_rsa(rsa_key, &keyb_data, &keyb_size);
@@ -132,6 +190,7 @@ static int vb1_make_keypair()
 		fprintf(stderr, "couldn't extract the public key\n");
 		goto done;
 	}
+	ret = 1;
 
 	pubkey = PublicKeyAlloc(keyb_size, vb1_algorithm, opt_version);
 	if (!pubkey)
@@ -144,7 +203,8 @@ static int vb1_make_keypair()
 		fprintf(stderr, "unable to write public key\n");
 		goto done;
 	}
-	fprintf(stderr, "wrote %s\n", outfile);
+	if (!quiet)
+		fprintf(stderr, "wrote %s\n", outfile);
 
 	ret = 0;
 
@@ -152,128 +212,275 @@ done:
 	free(privkey);
 	free(pubkey);
 	free(keyb_data);
-	RSA_free(rsa_key);
 	return ret;
 }
 
-static int vb2_make_keypair()
+/*
+ * Creates one keypair, from [pemfile] or, if that's NULL, a new RSA key. The
+ * output files are named for [base], or if that's NULL, for [pemfile] with
+ * its extension removed. Returns 0 if successful.
+ */
+static int create_one(const char *pemfile, const char *base)
 {
-	struct vb2_private_key *privkey = 0;
-	struct vb2_public_key *pubkey = 0;
-	RSA *rsa_key = 0;
-	uint8_t *keyb_data = 0;
-	uint32_t keyb_size;
-	enum vb2_signature_algorithm sig_alg;
-	uint8_t *pubkey_buf = 0;
+	const char *s = base ? base : pemfile;
+	char *outfile, *outext;
+	RSA *rsa_key;
+	int r;
 
-	FILE *fp;
-	int ret = 1;
-
-	fp = fopen(infile, "rb");
-	if (!fp) {
-		fprintf(stderr, "Unable to open %s\n", infile);
-		goto done;
+	/* Make an extra-large copy to leave room for filename extensions */
+	outfile = (char *)malloc(strlen(s) + 20);
+	if (!outfile) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		return 1;
 	}
+	strcpy(outfile, s);
 
-	rsa_key = PEM_read_RSAPrivateKey(fp, NULL, NULL, NULL);
-	fclose(fp);
+	if (!base) {
+		/* Find the last '/' if any, then the last '.' before that. */
+		outext = strrchr(outfile, '/');
+		if (!outext)
+			outext = outfile;
+		outext = strrchr(outext, '.');
+		/* Cut off the extension */
+		if (outext)
+			*outext = '\0';
+	}
+	/* Remember that spot for later */
+	outext = outfile + strlen(outfile);
 
+	rsa_key = pemfile ? read_rsa_key(pemfile) : generate_rsa_key(opt_bits);
 	if (!rsa_key) {
-		fprintf(stderr, "Unable to read RSA key from %s\n", infile);
-		goto done;
+		free(outfile);
+		return 1;
 	}
 
-	sig_alg = vb2_rsa_sig_alg(rsa_key);
-	if (sig_alg == VB2_SIG_INVALID) {
-		fprintf(stderr, "Unsupported sig algorithm in RSA key\n");
-		goto done;
+	/* Okay, do it */
+	r = vb1_make_keypair(rsa_key, outfile, outext);
+
+	RSA_free(rsa_key);
+	free(outfile);
+	return r;
+}
+
+/* One keypair of a batch */
+struct create_job_s {
+	const char *pemfile;
+	const char *base;
+	char *buf;			/* what they point into */
+	int id;				/* manifest line, or key number */
+	int errorcnt;
+};
+
+struct create_batch_s {
+	struct create_job_s *job;
+	int count;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+static void batch_one(void *arg, uint32_t index)
+{
+	struct create_batch_s *batch = arg;
+	struct create_job_s *job = &batch->job[index];
+
+	if (!job->errorcnt)
+		job->errorcnt = create_one(job->pemfile, job->base);
+
+	pthread_mutex_lock(&batch->lock);
+	if (job->errorcnt)
+		batch->failed++;
+	printf("%d: %s %s\n", job->id,
+	       job->base ? job->base : job->pemfile,
+	       job->errorcnt ? "FAILED" : "OK");
+	fflush(stdout);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static struct create_job_s *add_job(struct create_batch_s *batch)
+{
+	struct create_job_s *job;
+
+	job = realloc(batch->job, (batch->count + 1) * sizeof(*job));
+	if (!job) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return NULL;
 	}
+	batch->job = job;
+	job = &batch->job[batch->count++];
+	memset(job, 0, sizeof(*job));
+	job->id = batch->count;
+	return job;
+}
 
-	/* Create the private key */
-	privkey = calloc(1, sizeof(*privkey));
-	if (!privkey) {
-		fprintf(stderr, "Unable to allocate the private key\n");
-		goto done;
+static int cmp_job_pemfile(const void *a, const void *b)
+{
+	return strcmp(((const struct create_job_s *)a)->pemfile,
+		      ((const struct create_job_s *)b)->pemfile);
+}
+
+/* Every .pem file in the directory, in order. Returns nonzero on error. */
+static int read_batch_dir(struct create_batch_s *batch, const char *dir)
+{
+	struct create_job_s *job;
+	struct dirent *ent;
+	DIR *dp;
+	size_t len;
+	int i, errorcnt = 0;
+
+	dp = opendir(dir);
+	if (!dp) {
+		fprintf(stderr, "ERROR: Can't open %s: %s\n",
+			dir, strerror(errno));
+		return 1;
 	}
-	privkey->rsa_private_key = rsa_key;
-	privkey->sig_alg = sig_alg;
-	privkey->hash_alg = opt_hash_alg;
-	privkey->guid = opt_guid;
-	if (opt_desc && vb2_private_key_set_desc(privkey, opt_desc)) {
-		fprintf(stderr, "Unable to set the private key description\n");
-		goto done;
+	while ((ent = readdir(dp))) {
+		len = strlen(ent->d_name);
+		if (len <= 4 || strcmp(ent->d_name + len - 4, ".pem"))
+			continue;
+		job = add_job(batch);
+		if (job)
+			job->buf = malloc(strlen(dir) + len + 2);
+		if (!job || !job->buf) {
+			fprintf(stderr, "ERROR: Out of memory\n");
+			errorcnt++;
+			break;
+		}
+		sprintf(job->buf, "%s/%s", dir, ent->d_name);
+		job->pemfile = job->buf;
 	}
+	closedir(dp);
+	if (errorcnt)
+		return 1;
 
-	/* Write it out */
-	strcpy(outext, ".vbprik2");
-	if (vb2_private_key_write(privkey, outfile)) {
-		fprintf(stderr, "unable to write private key\n");
-		goto done;
-	}
-	fprintf(stderr, "wrote %s\n", outfile);
+	qsort(batch->job, batch->count, sizeof(*batch->job),
+	      cmp_job_pemfile);
+	for (i = 0; i < batch->count; i++)
+		batch->job[i].id = i + 1;
+	return 0;
+}
 
-	/* Create the public key */
-	if (vb2_public_key_alloc(&pubkey, sig_alg)) {
-		fprintf(stderr, "Unable to allocate the public key\n");
-		goto done;
-	}
+#define MAX_BATCH_ARGS 2
 
-	/* Extract the keyb blob */
-	if (vb_keyb_from_rsa(rsa_key, &keyb_data, &keyb_size)) {
-		fprintf(stderr, "Couldn't extract the public key\n");
-		goto done;
+/* One <INFILE> [<BASENAME>] per line. Returns nonzero on error. */
+static int read_batch_manifest(struct create_batch_s *batch,
+			       const char *manifest)
+{
+	struct create_job_s *job;
+	char *argv[MAX_BATCH_ARGS];
+	char *line = NULL;
+	size_t linesize = 0;
+	int lineno = 0;
+	int argc, errorcnt = 0;
+	FILE *fp;
+
+	fp = fopen(manifest, "r");
+	if (!fp) {
+		fprintf(stderr, "ERROR: Can't open %s: %s\n",
+			manifest, strerror(errno));
+		return 1;
 	}
 
-	/*
-	 * Copy the keyb blob to the public key's buffer, because that's where
-	 * vb2_unpack_key_data() and vb2_public_key_pack() expect to find it.
-	 */
-	pubkey_buf = vb2_public_key_packed_data(pubkey);
-	memcpy(pubkey_buf, keyb_data, keyb_size);
+	while (getline(&line, &linesize, fp) != -1) {
+		char *copy;
 
-	/* Fill in the internal struct pointers */
-	if (vb2_unpack_key_data(pubkey, pubkey_buf, keyb_size)) {
-		fprintf(stderr, "Unable to unpack the public key blob\n");
-		goto done;
-	}
+		lineno++;
+		copy = strdup(line);
+		argc = copy ? futil_split_line(copy, argv,
+					       MAX_BATCH_ARGS) : -1;
+		if (argc == 0) {
+			free(copy);
+			continue;
+		}
 
-	pubkey->hash_alg = opt_hash_alg;
-	pubkey->version = opt_version;
-	memcpy((struct vb2_guid *)pubkey->guid, &opt_guid, sizeof(opt_guid));
-	if (opt_desc && vb2_public_key_set_desc(pubkey, opt_desc)) {
-		fprintf(stderr, "Unable to set pubkey description\n");
-		goto done;
+		job = add_job(batch);
+		if (!job || !copy) {
+			free(copy);
+			errorcnt++;
+			break;
+		}
+		job->id = lineno;
+		job->buf = copy;
+		if (argc < 0) {
+			fprintf(stderr, "%s:%d: too many arguments\n",
+				manifest, lineno);
+			job->errorcnt = 1;
+			job->pemfile = manifest;
+			continue;
+		}
+		job->pemfile = argv[0];
+		job->base = argc > 1 ? argv[1] : NULL;
 	}
+	free(line);
+	fclose(fp);
 
-	/* Write it out */
-	strcpy(outext, ".vbpubk2");
-	if (vb2_public_key_write(pubkey, outfile)) {
-		fprintf(stderr, "unable to write public key\n");
-		goto done;
+	return errorcnt;
+}
+
+static int do_batch(const char *base)
+{
+	struct create_batch_s batch;
+	struct create_job_s *job;
+	struct timespec start, end;
+	struct stat sb;
+	int i, errorcnt = 0;
+	double secs;
+
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+
+	if (opt_generate) {
+		for (i = 1; i <= opt_generate; i++) {
+			job = add_job(&batch);
+			if (!job) {
+				errorcnt++;
+				break;
+			}
+			job->buf = malloc(strlen(base) + 16);
+			if (!job->buf) {
+				errorcnt++;
+				break;
+			}
+			sprintf(job->buf, "%s_%d", base, i);
+			job->base = job->buf;
+		}
+	} else if (0 == stat(opt_batch, &sb) && S_ISDIR(sb.st_mode)) {
+		errorcnt += read_batch_dir(&batch, opt_batch);
+	} else {
+		errorcnt += read_batch_manifest(&batch, opt_batch);
 	}
-	fprintf(stderr, "wrote %s\n", outfile);
+	if (errorcnt)
+		goto done;
 
-	ret = 0;
+	quiet = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	futil_run_jobs(batch_one, NULL, &batch, batch.count, opt_jobs);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	quiet = 0;
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Created %d of %d keypairs in %.3f seconds "
+	       "(%.1f keypairs/sec)\n",
+	       batch.count - batch.failed, batch.count, secs,
+	       secs > 0 ? batch.count / secs : 0.0);
+	errorcnt += batch.failed;
 
 done:
-	RSA_free(rsa_key);
-	if (privkey)				/* prevent double-free */
-		privkey->rsa_private_key = 0;
-	vb2_private_key_free(privkey);
-	vb2_public_key_free(pubkey);
-	free(keyb_data);
-	return ret;
+	for (i = 0; i < batch.count; i++)
+		free(batch.job[i].buf);
+	free(batch.job);
+	pthread_mutex_destroy(&batch.lock);
+	return !!errorcnt;
 }
 
 static int do_create(int argc, char *argv[])
 {
 	int errorcnt = 0;
-	char *e, *s;
-	int i, r, len, remove_ext = 0;
-	const struct vb2_text_vs_enum *entry;
+	char *e;
+	int c, i;
 
-	while ((i = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
-		switch (i) {
+	while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+		switch (c) {
 
 		case OPT_VERSION:
 			opt_version = strtoul(optarg, &e, 0);
@@ -284,24 +491,13 @@ static int do_create(int argc, char *argv[])
 			}
 			break;
 
-		case OPT_DESC:
-			opt_desc = optarg;
-			break;
-
-		case OPT_GUID:
-			if (VB2_SUCCESS != vb2_str_to_guid(optarg,
-							   &opt_guid)) {
-				fprintf(stderr, "invalid guid \"%s\"\n",
-					optarg);
-				errorcnt = 1;
-			}
-			break;
-
 		case OPT_HASH_ALG:
 			/* try string first */
-			entry = vb2_lookup_by_name(vb2_text_vs_hash, optarg);
-			if (entry) {
-				opt_hash_alg = entry->num;
+			for (i = 0; i < ARRAY_SIZE(hash_algs); i++)
+				if (!strcasecmp(hash_algs[i].name, optarg))
+					break;
+			if (i < ARRAY_SIZE(hash_algs)) {
+				opt_hash_alg = hash_algs[i].num;
 				break;
 			}
 			/* fine, try number */
@@ -312,8 +508,10 @@ static int do_create(int argc, char *argv[])
 				errorcnt++;
 				break;
 			}
-			if (!vb2_lookup_by_num(vb2_text_vs_hash,
-					       opt_hash_alg)) {
+			for (i = 0; i < ARRAY_SIZE(hash_algs); i++)
+				if (hash_algs[i].num == opt_hash_alg)
+					break;
+			if (i == ARRAY_SIZE(hash_algs)) {
 				fprintf(stderr,
 					"Hash algorithm %d is unsupported\n",
 					opt_hash_alg);
@@ -321,6 +519,37 @@ static int do_create(int argc, char *argv[])
 			}
 			break;
 
+		case OPT_BATCH:
+			opt_batch = optarg;
+			break;
+
+		case OPT_GENERATE:
+			opt_generate = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || opt_generate < 1) {
+				fprintf(stderr,
+					"invalid count \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+
+		case OPT_BITS:
+			opt_bits = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || opt_bits < 1) {
+				fprintf(stderr,
+					"invalid bits \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+
+		case OPT_JOBS:
+			opt_jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || opt_jobs < 1) {
+				fprintf(stderr,
+					"invalid jobs \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+
 		case '?':
 			if (optopt)
 				fprintf(stderr, "Unrecognized option: -%c\n",
@@ -340,8 +569,22 @@ static int do_create(int argc, char *argv[])
 		}
 	}
 
-	/* If we don't have an input file already, we need one */
-	if (!infile) {
+	if (opt_batch && opt_generate) {
+		fprintf(stderr, "ERROR: use --batch or --generate, not both\n");
+		errorcnt++;
+	} else if (opt_batch) {
+		if (argc - optind > 0) {
+			fprintf(stderr,
+				"ERROR: input files go in the --batch\n");
+			errorcnt++;
+		}
+	} else if (opt_generate) {
+		if (argc - optind != 1) {
+			fprintf(stderr, "ERROR: --generate needs a BASENAME\n");
+			errorcnt++;
+		}
+	} else if (!infile) {
+		/* If we don't have an input file already, we need one */
 		if (argc - optind <= 0) {
 			fprintf(stderr, "ERROR: missing input filename\n");
 			errorcnt++;
@@ -355,47 +598,14 @@ static int do_create(int argc, char *argv[])
 		return 1;
 	}
 
-	/* Decide how to determine the output filenames. */
-	if (argc > optind) {
-		s = argv[optind++];		/* just use this */
-	} else {
-		s = infile;			/* based on pem file name */
-		remove_ext = 1;
-	}
-
-	/* Make an extra-large copy to leave room for filename extensions */
-	len = strlen(s) + 20;
-	outfile = (char *)malloc(len);
-	if (!outfile) {
-		fprintf(stderr, "ERROR: malloc() failed\n");
-		return 1;
-	}
-	strcpy(outfile, s);
-
-	if (remove_ext) {
-		/* Find the last '/' if any, then the last '.' before that. */
-		s = strrchr(outfile, '/');
-		if (!s)
-			s = outfile;
-		s = strrchr(s, '.');
-		/* Cut off the extension */
-		if (s)
-			*s = '\0';
-	}
-	/* Remember that spot for later */
-	outext = outfile + strlen(outfile);
+	if (opt_batch || opt_generate)
+		return do_batch(argv[optind]);
 
-	/* Okay, do it */
-	if (vboot_version == VBOOT_VERSION_1_0)
-		r = vb1_make_keypair();
-	else
-		r = vb2_make_keypair();
-
-	free(outfile);
-	return r;
+	/* Decide how to determine the output filenames. */
+	return create_one(infile, argc > optind ? argv[optind] : NULL);
 }
 
 DECLARE_FUTIL_COMMAND(create, do_create,
-		      VBOOT_VERSION_ALL,
+		      VBOOT_VERSION_1_0,
 		      "Create a keypair from an RSA .pem file",
 		      print_help);
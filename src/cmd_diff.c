@@ -0,0 +1,464 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Compares two firmware images area by area.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "file_type.h"
+#include "fmap.h"
+#include "futility.h"
+#include "traversal.h"
+
+/* Each thread compares this much at a time, and counts blocks this big */
+#define DIFF_CHUNK (1 << 20)
+#define DIFF_BLOCK 4096
+
+enum {
+	OPT_JOBS = 1000,
+	OPT_ALL,
+};
+
+static const struct option long_opts[] = {
+	{"jobs", 1, NULL, OPT_JOBS},
+	{"all",  0, NULL, OPT_ALL},
+	{NULL, 0, NULL, 0}
+};
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] IMAGE_A IMAGE_B\n"
+	"\n"
+	"Compares two firmware images, FMAP area by FMAP area, and says which\n"
+	"areas differ and by how much. Where the GBB or a VBLOCK differs, the\n"
+	"fields that changed are shown as \"-\" (IMAGE_A) and \"+\" (IMAGE_B)\n"
+	"lines. Images without an FMAP are compared as a whole. The exit\n"
+	"status is 0 if they're the same, 1 if they differ and 2 on errors.\n"
+	"\n"
+	"Options:\n"
+	"  --all             List the identical areas too\n"
+	"  -j|--jobs NUM     Compare with NUM threads (default is one per CPU)\n"
+	"\n";
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog);
+}
+
+/* The areas that the show callbacks can tell us more about */
+static const struct {
+	const char *name;
+	enum futil_cb_component component;
+	int (*show)(struct futil_traverse_state_s *state);
+} decoders[] = {
+	{"GBB",            CB_FMAP_GBB,      futil_cb_show_gbb},
+	{"VBLOCK_A",       CB_FMAP_VBLOCK_A, futil_cb_show_fw_preamble},
+	{"VBLOCK_B",       CB_FMAP_VBLOCK_B, futil_cb_show_fw_preamble},
+	{"GBB Area",       CB_FMAP_GBB,      futil_cb_show_gbb},
+	{"Firmware A Key", CB_FMAP_VBLOCK_A, futil_cb_show_fw_preamble},
+	{"Firmware B Key", CB_FMAP_VBLOCK_B, futil_cb_show_fw_preamble},
+};
+
+struct diff_image_s {
+	const char *infile;
+	int fd;
+	uint8_t *buf;
+	uint64_t len;
+	int decompressed;
+	FmapIndex *idx;
+};
+
+/* An area, as it is in each image. buf is NULL where it's missing. */
+struct diff_area_s {
+	char name[FMAP_NAMELEN + 1];
+	const uint8_t *buf[2];
+	uint64_t offset[2];
+	uint64_t len[2];
+	/* What the comparison found */
+	uint64_t diff_blocks;
+	uint64_t first_diff;
+	int differs;
+};
+
+struct diff_chunk_s {
+	struct diff_area_s *area;
+	uint64_t offset;
+	uint64_t len;
+	uint64_t diff_blocks;
+	uint64_t first_diff;
+};
+
+struct diff_batch_s {
+	struct diff_chunk_s *chunk;
+	int count;
+};
+
+static void diff_one(void *arg, uint32_t index)
+{
+	struct diff_batch_s *batch = arg;
+	struct diff_chunk_s *c = &batch->chunk[index];
+	const uint8_t *a = c->area->buf[0] + c->offset;
+	const uint8_t *b = c->area->buf[1] + c->offset;
+	uint64_t off, n;
+
+	/* Nearly everything is usually the same, which is quick */
+	if (!memcmp(a, b, c->len))
+		return;
+
+	for (off = 0; off < c->len; off += n) {
+		n = c->len - off < DIFF_BLOCK ? c->len - off : DIFF_BLOCK;
+		if (!memcmp(a + off, b + off, n))
+			continue;
+		if (!c->diff_blocks++)
+			c->first_diff = c->offset + off;
+	}
+}
+
+static int open_image(struct diff_image_s *img, const char *infile)
+{
+	memset(img, 0, sizeof(*img));
+	img->infile = infile;
+	img->fd = open(infile, O_RDONLY);
+	if (img->fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			infile, strerror(errno));
+		return 1;
+	}
+	if (futil_map_input(img->fd, &img->buf, &img->len,
+			    &img->decompressed)) {
+		close(img->fd);
+		img->fd = -1;
+		return 1;
+	}
+	futil_advise(img->buf, img->len, MADV_SEQUENTIAL);
+	img->idx = fmap_index_create(img->buf, img->len);
+	return 0;
+}
+
+static void close_image(struct diff_image_s *img)
+{
+	if (img->fd < 0)
+		return;
+	fmap_index_free(img->idx);
+	futil_unmap_input(img->fd, img->buf, img->len, img->decompressed, 0);
+	close(img->fd);
+}
+
+/* Finds [name] in the image, or the whole image if it has no FMAP */
+static void find_area(struct diff_area_s *area, int which,
+		      const struct diff_image_s *img)
+{
+	FmapAreaHeader *ah;
+
+	if (!img->idx) {
+		area->buf[which] = img->buf;
+		area->len[which] = img->len;
+		return;
+	}
+
+	ah = fmap_index_find(img->idx, area->name);
+	if (!ah || (uint64_t)ah->area_offset + ah->area_size > img->len)
+		return;
+	area->buf[which] = img->buf + ah->area_offset;
+	area->offset[which] = ah->area_offset;
+	area->len[which] = ah->area_size;
+}
+
+/*
+ * Every area in A, in order, then the ones that are only in B. Returns the
+ * number of them, or -1 if there's no memory.
+ */
+static int list_areas(struct diff_area_s **areas,
+		      const struct diff_image_s *img)
+{
+	struct diff_area_s *list;
+	FmapAreaHeader *ah;
+	int max, count = 0;
+	int i, j;
+
+	max = (img[0].idx ? img[0].idx->nareas : 1) +
+		(img[1].idx ? img[1].idx->nareas : 1);
+	list = calloc(max, sizeof(*list));
+	if (!list)
+		return -1;
+
+	if (!img[0].idx || !img[1].idx) {
+		strcpy(list[0].name, "-");
+		list[0].buf[0] = img[0].buf;
+		list[0].len[0] = img[0].len;
+		list[0].buf[1] = img[1].buf;
+		list[0].len[1] = img[1].len;
+		*areas = list;
+		return 1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; (ah = fmap_index_by_offset(img[i].idx, j)); j++) {
+			memcpy(list[count].name, ah->area_name, FMAP_NAMELEN);
+			/* Already listed from A? */
+			if (i && fmap_index_find(img[0].idx, list[count].name))
+				continue;
+			find_area(&list[count], 0, &img[0]);
+			find_area(&list[count], 1, &img[1]);
+			count++;
+		}
+	}
+
+	*areas = list;
+	return count;
+}
+
+/* Compares the areas both images have, on all the threads */
+static int compare_areas(struct diff_area_s *areas, int count, int jobs)
+{
+	struct diff_batch_s batch;
+	struct diff_chunk_s *c;
+	uint64_t len, off;
+	int i;
+
+	memset(&batch, 0, sizeof(batch));
+	for (i = 0; i < count; i++) {
+		if (!areas[i].buf[0] || !areas[i].buf[1])
+			continue;
+		len = areas[i].len[0] < areas[i].len[1] ?
+			areas[i].len[0] : areas[i].len[1];
+		for (off = 0; off < len; off += DIFF_CHUNK) {
+			c = realloc(batch.chunk,
+				    (batch.count + 1) * sizeof(*c));
+			if (!c) {
+				fprintf(stderr, "Out of memory\n");
+				free(batch.chunk);
+				return 1;
+			}
+			batch.chunk = c;
+			c = &batch.chunk[batch.count++];
+			memset(c, 0, sizeof(*c));
+			c->area = &areas[i];
+			c->offset = off;
+			c->len = len - off < DIFF_CHUNK ? len - off : DIFF_CHUNK;
+		}
+	}
+
+	futil_run_jobs(diff_one, NULL, &batch, batch.count, jobs);
+
+	/* The chunks are in order, so the first difference is the first seen */
+	for (i = 0; i < batch.count; i++) {
+		c = &batch.chunk[i];
+		if (!c->diff_blocks)
+			continue;
+		if (!c->area->diff_blocks)
+			c->area->first_diff = c->first_diff;
+		c->area->diff_blocks += c->diff_blocks;
+	}
+	free(batch.chunk);
+	return 0;
+}
+
+/*
+ * Runs the show callback for the area on its own, to get its fields as text.
+ * There's no firmware body or root key to go with it, so this only checks
+ * what the area can check by itself. Returns NULL if there's no memory.
+ */
+static char *decode_area(int d, const struct diff_area_s *area, int which,
+			 const char *infile)
+{
+	struct futil_traverse_state_s state;
+	char *out = NULL, *err = NULL;
+	size_t out_len, err_len;
+	FILE *fout, *ferr;
+
+	fout = open_memstream(&out, &out_len);
+	ferr = open_memstream(&err, &err_len);
+	if (!fout || !ferr) {
+		if (fout)
+			fclose(fout);
+		if (ferr)
+			fclose(ferr);
+		free(out);
+		free(err);
+		return NULL;
+	}
+	futil_show_init(fout, ferr, NULL, 0);
+
+	memset(&state, 0, sizeof(state));
+	state.in_filename = infile;
+	state.op = FUTIL_OP_SHOW;
+	state.in_type = FILE_TYPE_BIOS_IMAGE;
+	state.component = decoders[d].component;
+	state.name = area->name;
+	state.my_area = &state.cb_area[decoders[d].component];
+	state.my_area->offset = area->offset[which];
+	state.my_area->buf = (uint8_t *)area->buf[which];
+	state.my_area->len = area->len[which];
+	decoders[d].show(&state);
+
+	fclose(fout);
+	fclose(ferr);
+	free(err);
+	return out;
+}
+
+/* Prints the lines of the two descriptions that aren't the same */
+static void print_decoded_diff(char *a, char *b)
+{
+	char *save_a = NULL, *save_b = NULL;
+	char *la, *lb;
+
+	la = strtok_r(a, "\n", &save_a);
+	lb = strtok_r(b, "\n", &save_b);
+	while (la || lb) {
+		if (la && lb && !strcmp(la, lb)) {
+			la = strtok_r(NULL, "\n", &save_a);
+			lb = strtok_r(NULL, "\n", &save_b);
+			continue;
+		}
+		if (la)
+			printf("  - %s\n", la);
+		if (lb)
+			printf("  + %s\n", lb);
+		if (la)
+			la = strtok_r(NULL, "\n", &save_a);
+		if (lb)
+			lb = strtok_r(NULL, "\n", &save_b);
+	}
+}
+
+static void decode_diff(const struct diff_area_s *area,
+			const struct diff_image_s *img)
+{
+	char *a, *b;
+	int d;
+
+	for (d = 0; d < ARRAY_SIZE(decoders); d++)
+		if (!strcmp(area->name, decoders[d].name))
+			break;
+	if (d == ARRAY_SIZE(decoders))
+		return;
+
+	a = decode_area(d, area, 0, img[0].infile);
+	b = decode_area(d, area, 1, img[1].infile);
+	if (a && b)
+		print_decoded_diff(a, b);
+	free(a);
+	free(b);
+}
+
+static int report_area(struct diff_area_s *area,
+		       const struct diff_image_s *img, int all)
+{
+	uint64_t blocks;
+
+	if (!area->buf[0] || !area->buf[1]) {
+		printf("%s: only in %s\n", area->name,
+		       area->buf[0] ? img[0].infile : img[1].infile);
+		return 1;
+	}
+
+	if (area->len[0] != area->len[1]) {
+		printf("%s: size 0x%" PRIx64 " vs 0x%" PRIx64 "\n",
+		       area->name, area->len[0], area->len[1]);
+		area->differs = 1;
+	}
+	if (area->offset[0] != area->offset[1]) {
+		printf("%s: offset 0x%" PRIx64 " vs 0x%" PRIx64 "\n",
+		       area->name, area->offset[0], area->offset[1]);
+		area->differs = 1;
+	}
+	if (area->diff_blocks) {
+		blocks = ((area->len[0] < area->len[1] ? area->len[0] :
+			   area->len[1]) + DIFF_BLOCK - 1) / DIFF_BLOCK;
+		printf("%s: %" PRIu64 " of %" PRIu64 " 4 KiB blocks differ,"
+		       " the first at 0x%" PRIx64 "\n", area->name,
+		       area->diff_blocks, blocks, area->first_diff);
+		area->differs = 1;
+	}
+
+	if (area->differs)
+		decode_diff(area, img);
+	else if (all)
+		printf("%s: identical\n", area->name);
+
+	return area->differs;
+}
+
+static int do_diff(int argc, char *argv[])
+{
+	struct diff_image_s img[2];
+	struct diff_area_s *areas = NULL;
+	int count, differ = 0;
+	int errorcnt = 0;
+	int jobs = 0, all = 0;
+	char *e;
+	int i;
+
+	opterr = 0;
+	while ((i = getopt_long(argc, argv, "j:", long_opts, NULL)) != -1) {
+		switch (i) {
+		case 'j':
+		case OPT_JOBS:
+			jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || jobs < 1) {
+				fprintf(stderr,
+					"Invalid --jobs \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_ALL:
+			all = 1;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option\n");
+			errorcnt++;
+			break;
+		}
+	}
+
+	if (errorcnt || argc - optind != 2) {
+		print_help(argv[0]);
+		return 2;
+	}
+
+	if (open_image(&img[0], argv[optind])) {
+		return 2;
+	}
+	if (open_image(&img[1], argv[optind + 1])) {
+		close_image(&img[0]);
+		return 2;
+	}
+
+	count = list_areas(&areas, img);
+	if (count < 0 || compare_areas(areas, count, jobs)) {
+		fprintf(stderr, "Out of memory\n");
+		errorcnt++;
+		goto done;
+	}
+
+	for (i = 0; i < count; i++)
+		differ += report_area(&areas[i], img, all);
+	if (differ)
+		printf("%d of %d areas differ\n", differ, count);
+
+done:
+	free(areas);
+	close_image(&img[0]);
+	close_image(&img[1]);
+	if (errorcnt)
+		return 2;
+	return !!differ;
+}
+
+DECLARE_FUTIL_COMMAND(diff, do_diff,
+		      VBOOT_VERSION_ALL,
+		      "Compare two firmware images by FMAP area",
+		      print_help);
@@ -17,6 +17,7 @@
 
 #include "fmap.h"
 #include "futility.h"
+#include "image_scan.h"
 
 enum { FMT_NORMAL, FMT_PRETTY, FMT_FLASHROM, FMT_HUMAN };
 
@@ -27,17 +28,95 @@ static int opt_overlap;
 static char *progname;
 static void *base_of_rom;
 static size_t size_of_rom;
+static int fd_of_rom = -1;
 static int opt_gaps;
+static int opt_fill;
+static int opt_sparse;
+
+/*
+ * Write [offset, offset + len) of the image to fd at [to]. The kernel can
+ * usually copy it straight from the image, so we only write from the
+ * mapping if it can't. Return 0 if successful.
+ */
+static int write_range(int fd, uint64_t offset, uint64_t len, uint64_t to)
+{
+	const uint8_t *buf = (uint8_t *)base_of_rom + offset;
+	uint64_t done;
+
+	done = futil_copy_range(fd_of_rom, offset, fd, to, len);
+	return futil_write_at(fd, buf + done, len - done, to + done);
+}
+
+/* The end of the erase block [pos] is in, or [end] if that's sooner */
+static uint64_t block_end(uint64_t pos, uint64_t end)
+{
+	uint64_t next = (pos / IMAGE_ERASE_BLOCK + 1) * IMAGE_ERASE_BLOCK;
+
+	return next < end ? next : end;
+}
+
+/*
+ * Write an area to a new file. With -s, the zeroed blocks are left as holes,
+ * which read back the same. Return 0 if successful.
+ */
+static int write_area(int fd, const FmapAreaHeader *ah)
+{
+	const uint8_t *base = base_of_rom;
+	uint64_t start = ah->area_offset, end = start + ah->area_size;
+	uint64_t pos, next, run;
+
+	if (!opt_sparse)
+		return write_range(fd, start, ah->area_size, 0);
+
+	for (pos = run = start; pos < end; pos = next) {
+		next = block_end(pos, end);
+		if (image_fill(base + pos, next - pos) != IMAGE_FILL_ZERO)
+			continue;
+		if (run < pos && write_range(fd, run, pos - run, run - start))
+			return 1;
+		run = next;
+	}
+	if (run < end && write_range(fd, run, end - run, run - start))
+		return 1;
+
+	return ftruncate(fd, ah->area_size) ? 1 : 0;
+}
+
+/* How much of an area is erased blocks, and how much zeroed ones */
+static void area_fill(const FmapAreaHeader *ah, uint32_t *erased,
+		      uint32_t *zero)
+{
+	const uint8_t *base = base_of_rom;
+	uint64_t pos = ah->area_offset, end = pos + ah->area_size, next;
+
+	*erased = *zero = 0;
+	for (; pos < end; pos = next) {
+		next = block_end(pos, end);
+		switch (image_fill(base + pos, next - pos)) {
+		case IMAGE_FILL_ERASED:
+			*erased += next - pos;
+			break;
+		case IMAGE_FILL_ZERO:
+			*zero += next - pos;
+			break;
+		default:
+			break;
+		}
+	}
+}
 
 /* Return 0 if successful */
-static int dump_fmap(const FmapHeader *fmh, int argc, char *argv[])
+static int dump_fmap(const FmapIndex *idx, int argc, char *argv[])
 {
 	int i, retval = 0;
 	char buf[80];		/* DWR: magic number */
-	const FmapAreaHeader *ah;
-	ah = (const FmapAreaHeader *) (fmh + 1);
+	const FmapHeader *fmh = idx->fmap;
+	const FmapAreaHeader *ah = idx->areas;
 	char *extract_names[argc];
+	int wanted[idx->nareas];
 	char *outname = 0;
+	uint32_t erased = 0, zero = 0;
+	int fill;
 
 	if (opt_extract) {
 		/* prepare the filenames to write areas to */
@@ -60,6 +139,20 @@ static int dump_fmap(const FmapHeader *fmh, int argc, char *argv[])
 			return retval;
 	}
 
+	/*
+	 * Note which NAME, if any, selects each area. Areas with the same name
+	 * are all selected, by way of the first one.
+	 */
+	for (i = 0; i < idx->nareas; i++)
+		wanted[i] = -1;
+	for (i = argc - 1; i >= 0; i--) {
+		const FmapAreaHeader *match = NULL;
+		if (strlen(argv[i]) <= FMAP_NAMELEN)
+			match = fmap_index_find(idx, argv[i]);
+		if (match)
+			wanted[match - idx->areas] = i;
+	}
+
 	if (FMT_NORMAL == opt_format) {
 		snprintf(buf, FMAP_SIGNATURE_SIZE + 1, "%s",
 			 fmh->fmap_signature);
@@ -74,26 +167,31 @@ static int dump_fmap(const FmapHeader *fmh, int argc, char *argv[])
 		printf("fmap_nareas:     %d\n", fmh->fmap_nareas);
 	}
 
-	for (i = 0; i < fmh->fmap_nareas; i++, ah++) {
+	for (i = 0; i < idx->nareas; i++, ah++) {
 		snprintf(buf, FMAP_NAMELEN + 1, "%s", ah->area_name);
 
 		if (argc) {
-			int j, found = 0;
-			outname = NULL;
-			for (j = 0; j < argc; j++)
-				if (!strcmp(argv[j], buf)) {
-					found = 1;
-					outname = extract_names[j];
-					break;
-				}
-			if (!found)
+			int j = wanted[fmap_index_find(idx, buf) - idx->areas];
+			if (j < 0)
 				continue;
+			outname = extract_names[j];
 		}
 
+		/* Areas that aren't all in the image don't get a count */
+		fill = opt_fill && (uint64_t)ah->area_offset + ah->area_size <=
+			size_of_rom;
+		if (fill)
+			area_fill(ah, &erased, &zero);
+
 		switch (opt_format) {
 		case FMT_PRETTY:
-			printf("%s %d %d\n", buf, ah->area_offset,
-			       ah->area_size);
+			if (fill)
+				printf("%s %d %d %d %d\n", buf,
+				       ah->area_offset, ah->area_size,
+				       erased, zero);
+			else
+				printf("%s %d %d\n", buf, ah->area_offset,
+				       ah->area_size);
 			break;
 		case FMT_FLASHROM:
 			if (ah->area_size)
@@ -107,6 +205,12 @@ static int dump_fmap(const FmapHeader *fmh, int argc, char *argv[])
 			printf("area_size:       0x%08x (%d)\n", ah->area_size,
 			       ah->area_size);
 			printf("area_name:       %s\n", buf);
+			if (fill) {
+				printf("area_erased:     0x%08x (%d)\n",
+				       erased, erased);
+				printf("area_zero:       0x%08x (%d)\n",
+				       zero, zero);
+			}
 		}
 
 		if (opt_extract) {
@@ -117,8 +221,9 @@ static int dump_fmap(const FmapHeader *fmh, int argc, char *argv[])
 						*s = '_';
 				outname = buf;
 			}
-			FILE *fp = fopen(outname, "wb");
-			if (!fp) {
+			int fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC,
+				      0666);
+			if (fd < 0) {
 				fprintf(stderr, "%s: can't open %s: %s\n",
 					progname, outname, strerror(errno));
 				retval = 1;
@@ -131,8 +236,7 @@ static int dump_fmap(const FmapHeader *fmh, int argc, char *argv[])
 				fprintf(stderr, "%s: section %s is larger"
 					" than the image\n", progname, buf);
 				retval = 1;
-			} else if (1 != fwrite(base_of_rom + ah->area_offset,
-					       ah->area_size, 1, fp)) {
+			} else if (write_area(fd, ah)) {
 				fprintf(stderr, "%s: can't write %s: %s\n",
 					progname, buf, strerror(errno));
 				retval = 1;
@@ -140,7 +244,8 @@ static int dump_fmap(const FmapHeader *fmh, int argc, char *argv[])
 				if (FMT_NORMAL == opt_format)
 					printf("saved as \"%s\"\n", outname);
 			}
-			fclose(fp);
+			if (fd >= 0)
+				close(fd);
 		}
 	}
 
@@ -168,23 +273,6 @@ struct node_s {
 
 static struct node_s *all_nodes;
 
-static void sort_nodes(int num, struct node_s *ary[])
-{
-	int i, j;
-	struct node_s *tmp;
-
-	/* bubble-sort is quick enough with only a few entries */
-	for (i = 0; i < num; i++) {
-		for (j = i + 1; j < num; j++) {
-			if (ary[j]->start > ary[i]->start) {
-				tmp = ary[i];
-				ary[i] = ary[j];
-				ary[j] = tmp;
-			}
-		}
-	}
-}
-
 static void line(int indent, char *name,
 		 uint32_t start, uint32_t end, uint32_t size, char *append)
 {
@@ -216,7 +304,6 @@ static void show(struct node_s *p, int indent, int show_first)
 			line(indent, alias->name, p->start, p->end, p->size,
 			     "  // DUPLICATE");
 	}
-	sort_nodes(p->num_children, p->child);
 	for (i = 0; i < p->num_children; i++) {
 		if (i == 0 && p->end != p->child[i]->end)
 			empty(indent, p->child[i]->end, p->end, p->name);
@@ -230,67 +317,214 @@ static void show(struct node_s *p, int indent, int show_first)
 	}
 }
 
-static int overlaps(int i, int j)
+/* Node indices, ordered by start, then end (largest first), then index */
+static int cmp_nest(const void *a, const void *b)
 {
-	struct node_s *a = all_nodes + i;
-	struct node_s *b = all_nodes + j;
+	const struct node_s *na = all_nodes + *(const int *)a;
+	const struct node_s *nb = all_nodes + *(const int *)b;
+
+	if (na->start != nb->start)
+		return na->start < nb->start ? -1 : 1;
+	if (na->end != nb->end)
+		return na->end > nb->end ? -1 : 1;
+	return *(const int *)a - *(const int *)b;
+}
 
-	return ((a->start < b->start) && (b->start < a->end) &&
-		(b->start < a->end) && (a->end < b->end));
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a, ub = *(const uint32_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
 }
 
-static int encloses(int i, int j)
+/* Pairs of overlapping nodes, in the order we complain about them */
+static int cmp_pair(const void *a, const void *b)
 {
-	struct node_s *a = all_nodes + i;
-	struct node_s *b = all_nodes + j;
+	const int *pa = a, *pb = b;
 
-	return ((a->start <= b->start) && (a->end >= b->end));
+	if (pa[0] != pb[0])
+		return pa[0] - pb[0];
+	return pa[1] - pb[1];
 }
 
-static int duplicates(int i, int j)
+static void *xcalloc(size_t nmemb, size_t size)
 {
-	struct node_s *a = all_nodes + i;
-	struct node_s *b = all_nodes + j;
+	void *p = calloc(nmemb ? nmemb : 1, size);
 
-	return ((a->start == b->start) && (a->end == b->end));
+	if (!p) {
+		perror("calloc failed");
+		exit(1);
+	}
+	return p;
 }
 
-static void add_dupe(int i, int j, int numnodes)
+/*
+ * Fold duplicate regions into the first of them, keeping the rest of
+ * all_nodes (and the root at the end) in order. [order] is sorted with
+ * cmp_nest, so duplicates are next to each other; it's updated to match.
+ * Returns the new number of nodes.
+ */
+static int coalesce_dupes(int numnodes, int *order)
 {
-	int k;
+	int *newidx = xcalloc(numnodes + 1, sizeof(int));
 	struct dup_s *alias;
+	struct node_s *p, *q;
+	int i, j, n;
 
-	alias = (struct dup_s *) malloc(sizeof(struct dup_s));
-	alias->name = all_nodes[j].name;
-	alias->next = all_nodes[i].alias;
-	all_nodes[i].alias = alias;
-	for (k = j; k < numnodes; k++)
-		all_nodes[k] = all_nodes[k + 1];
+	for (i = 0; i < numnodes; i = j) {
+		p = all_nodes + order[i];
+		for (j = i + 1; j < numnodes; j++) {
+			q = all_nodes + order[j];
+			if (q->start != p->start || q->end != p->end)
+				break;
+			alias = (struct dup_s *) malloc(sizeof(struct dup_s));
+			if (!alias) {
+				perror("malloc failed");
+				exit(1);
+			}
+			alias->name = q->name;
+			alias->next = p->alias;
+			p->alias = alias;
+			newidx[order[j]] = -1;
+		}
+	}
+
+	for (i = 0, n = 0; i <= numnodes; i++) {
+		if (newidx[i] < 0)
+			continue;
+		newidx[i] = n;
+		all_nodes[n++] = all_nodes[i];
+	}
+	for (i = 0, j = 0; i < numnodes; i++)
+		if (newidx[order[i]] >= 0)
+			order[j++] = newidx[order[i]];
+
+	free(newidx);
+	return n - 1;
 }
 
-static void add_child(struct node_s *p, int n)
+/*
+ * Report each pair of regions where one starts inside the other and ends
+ * outside it. The other regions starting inside one are all next to it in
+ * [order], so this only looks at each region's contents. Returns the
+ * number of errors.
+ */
+static int check_overlaps(int numnodes, const int *order)
 {
-	int i;
-	if (p->num_children && !p->child) {
-		p->child =
-		    (struct node_s **)calloc(p->num_children,
-					     sizeof(struct node_s *));
-		if (!p->child) {
-			perror("calloc failed");
-			exit(1);
+	struct node_s *a, *b;
+	int *pairs = NULL;
+	int npairs = 0, maxpairs = 0;
+	int i, j, k, errorcnt = 0;
+
+	for (i = 0; i < numnodes; i++) {
+		a = all_nodes + order[i];
+		for (j = i + 1; j < numnodes; j++) {
+			b = all_nodes + order[j];
+			if (b->start >= a->end)
+				break;
+			if (b->start == a->start || b->end <= a->end)
+				continue;
+			if (npairs == maxpairs) {
+				maxpairs = maxpairs ? 2 * maxpairs : 16;
+				pairs = realloc(pairs,
+						2 * maxpairs * sizeof(int));
+				if (!pairs) {
+					perror("realloc failed");
+					exit(1);
+				}
+			}
+			pairs[2 * npairs] = order[i];
+			pairs[2 * npairs + 1] = order[j];
+			npairs++;
 		}
 	}
-	for (i = 0; i < p->num_children; i++)
-		if (!p->child[i]) {
-			p->child[i] = all_nodes + n;
-			return;
+
+	qsort(pairs, npairs, 2 * sizeof(int), cmp_pair);
+	for (k = 0; k < npairs; k++) {
+		a = all_nodes + pairs[2 * k];
+		b = all_nodes + pairs[2 * k + 1];
+		printf("ERROR: %s and %s overlap\n", a->name, b->name);
+		printf("  %s: 0x%x - 0x%x\n", a->name, a->start, a->end);
+		printf("  %s: 0x%x - 0x%x\n", b->name, b->start, b->end);
+		if (opt_overlap < 2) {
+			printf("Use more -h args to ignore this error\n");
+			errorcnt++;
 		}
+	}
+
+	free(pairs);
+	return errorcnt;
+}
+
+/* Is a a better parent than b? Smaller wins, then whichever came first. */
+static int better_parent(int a, int b)
+{
+	if (b < 0)
+		return 1;
+	if (all_nodes[a].size != all_nodes[b].size)
+		return all_nodes[a].size < all_nodes[b].size;
+	return a < b;
+}
+
+/*
+ * Each node's parent is the smallest node enclosing it (or the root, if
+ * nothing smaller than the root does). Visiting the nodes in [order], the
+ * ones that start before each node (or with it and end after it) have
+ * already been seen, so its parent is the best of those that end at or
+ * after its end. The seen nodes are kept in a Fenwick tree indexed by end,
+ * from the highest down, which finds that in O(log n).
+ */
+static void find_parents(int numnodes, const int *order)
+{
+	struct node_s *root = all_nodes + numnodes;
+	uint32_t *ends = xcalloc(numnodes, sizeof(uint32_t));
+	int *tree = xcalloc(numnodes + 1, sizeof(int));
+	int nends, i, k, n, pos, best;
+
+	for (i = 0; i < numnodes; i++)
+		ends[i] = all_nodes[i].end;
+	qsort(ends, numnodes, sizeof(uint32_t), cmp_uint32);
+	for (i = 0, nends = 0; i < numnodes; i++)
+		if (!nends || ends[i] != ends[nends - 1])
+			ends[nends++] = ends[i];
+
+	for (i = 0; i <= numnodes; i++)
+		tree[i] = -1;
+
+	for (i = 0; i < numnodes; i++) {
+		struct node_s *p;
+		uint32_t *e;
+
+		n = order[i];
+		p = all_nodes + n;
+		e = bsearch(&p->end, ends, nends, sizeof(uint32_t),
+			    cmp_uint32);
+		/* Tree position 1 is the largest end */
+		pos = nends - (e - ends);
+
+		best = -1;
+		for (k = pos; k > 0; k -= k & -k)
+			if (tree[k] >= 0 && better_parent(tree[k], best))
+				best = tree[k];
+		p->parent = best >= 0 ? all_nodes + best : root;
+
+		if (p->size >= root->size)
+			continue;
+		for (k = pos; k <= nends; k += k & -k)
+			if (better_parent(n, tree[k]))
+				tree[k] = n;
+	}
+
+	free(tree);
+	free(ends);
 }
 
 static int human_fmap(const FmapHeader *fmh)
 {
 	FmapAreaHeader *ah;
-	int i, j, errorcnt = 0;
+	struct node_s *p;
+	int *order;
+	int i, errorcnt = 0;
 	int numnodes;
 
 	ah = (FmapAreaHeader *) (fmh + 1);
@@ -304,12 +538,8 @@ static int human_fmap(const FmapHeader *fmh)
 	numnodes = fmh->fmap_nareas;
 
 	/* plus one for the all-enclosing "root" */
-	all_nodes = (struct node_s *) calloc(numnodes + 1,
-					     sizeof(struct node_s));
-	if (!all_nodes) {
-		perror("calloc failed");
-		exit(1);
-	}
+	all_nodes = (struct node_s *) xcalloc(numnodes + 1,
+					      sizeof(struct node_s));
 	for (i = 0; i < numnodes; i++) {
 		char buf[FMAP_NAMELEN + 1];
 		strncpy(buf, ah[i].area_name, FMAP_NAMELEN);
@@ -329,56 +559,41 @@ static int human_fmap(const FmapHeader *fmh)
 	all_nodes[numnodes].size = fmh->fmap_size;
 	all_nodes[numnodes].end = fmh->fmap_base + fmh->fmap_size;
 
+	/* Everything else works from one sorted list of the nodes */
+	order = xcalloc(numnodes, sizeof(int));
+	for (i = 0; i < numnodes; i++)
+		order[i] = i;
+	qsort(order, numnodes, sizeof(int), cmp_nest);
+
 	/* First, coalesce any duplicates */
-	for (i = 0; i < numnodes; i++) {
-		for (j = i + 1; j < numnodes; j++) {
-			if (duplicates(i, j)) {
-				add_dupe(i, j, numnodes);
-				numnodes--;
-			}
-		}
+	numnodes = coalesce_dupes(numnodes, order);
+
+	errorcnt = check_overlaps(numnodes, order);
+	if (errorcnt) {
+		free(order);
+		return 1;
 	}
 
 	/* Each node should have at most one parent, which is the smallest
-	 * enclosing node. Duplicate nodes "enclose" each other, but if there's
-	 * already a relationship in one direction, we won't create another.
-	 */
-	for (i = 0; i < numnodes; i++) {
-		/* Find the smallest parent, which might be the root node. */
-		int k = numnodes;
-		for (j = 0; j < numnodes; j++) { /* full O(N^2) comparison */
-			if (i == j)
-				continue;
-			if (overlaps(i, j)) {
-				printf("ERROR: %s and %s overlap\n",
-				       all_nodes[i].name, all_nodes[j].name);
-				printf("  %s: 0x%x - 0x%x\n", all_nodes[i].name,
-				       all_nodes[i].start, all_nodes[i].end);
-				printf("  %s: 0x%x - 0x%x\n", all_nodes[j].name,
-				       all_nodes[j].start, all_nodes[j].end);
-				if (opt_overlap < 2) {
-					printf("Use more -h args to ignore"
-					       " this error\n");
-					errorcnt++;
-				}
-				continue;
-			}
-			if (encloses(j, i)
-			    && all_nodes[j].size < all_nodes[k].size)
-				k = j;
-		}
-		all_nodes[i].parent = all_nodes + k;
-	}
-	if (errorcnt)
-		return 1;
+	 * enclosing node. */
+	find_parents(numnodes, order);
 
-	/* Force those deadbeat parents to recognize their children */
+	/* Force those deadbeat parents to recognize their children, which
+	 * show() wants from last to first. */
 	for (i = 0; i < numnodes; i++)	/* how many */
-		if (all_nodes[i].parent)
-			all_nodes[i].parent->num_children++;
-	for (i = 0; i < numnodes; i++)	/* here they are */
-		if (all_nodes[i].parent)
-			add_child(all_nodes[i].parent, i);
+		all_nodes[i].parent->num_children++;
+	for (i = 0; i <= numnodes; i++) {
+		p = all_nodes + i;
+		if (p->num_children)
+			p->child = xcalloc(p->num_children,
+					   sizeof(struct node_s *));
+		p->num_children = 0;
+	}
+	for (i = numnodes - 1; i >= 0; i--) {	/* here they are */
+		p = all_nodes[order[i]].parent;
+		p->child[p->num_children++] = all_nodes + order[i];
+	}
+	free(order);
 
 	/* Ready to go */
 	printf("# name                     start       end         size\n");
@@ -403,6 +618,9 @@ static const char usage[] =
 	"  -H             With -h, display any gaps\n"
 	"  -p             Use a format easy to parse by scripts\n"
 	"  -F             Use the format expected by flashrom\n"
+	"  -f             Show how much of each area is in erased (0xff)\n"
+	"                   or zeroed 4KiB blocks; -p adds those two numbers\n"
+	"  -s             With -x, leave the zeroed blocks as holes\n"
 	"\n"
 	"Specify one or more NAMEs to dump only those sections.\n"
 	"\n";
@@ -418,13 +636,13 @@ static int do_dump_fmap(int argc, char *argv[])
 	int errorcnt = 0;
 	struct stat sb;
 	int fd;
-	const FmapHeader *fmap;
+	FmapIndex *idx;
 	int retval = 1;
 
 	progname = argv[0];
 
 	opterr = 0;		/* quiet, you */
-	while ((c = getopt(argc, argv, ":xpFhH")) != -1) {
+	while ((c = getopt(argc, argv, ":xpFfshH")) != -1) {
 		switch (c) {
 		case 'x':
 			opt_extract = 1;
@@ -435,6 +653,12 @@ static int do_dump_fmap(int argc, char *argv[])
 		case 'F':
 			opt_format = FMT_FLASHROM;
 			break;
+		case 'f':
+			opt_fill = 1;
+			break;
+		case 's':
+			opt_sparse = 1;
+			break;
 		case 'H':
 			opt_gaps = 1;
 			/* fallthrough */
@@ -484,26 +708,30 @@ static int do_dump_fmap(int argc, char *argv[])
 		close(fd);
 		return 1;
 	}
-	close(fd);		/* done with this now */
+	fd_of_rom = fd;		/* for copying areas out */
 	size_of_rom = sb.st_size;
 
-	fmap = fmap_find(base_of_rom, size_of_rom);
-	if (fmap) {
+	idx = fmap_index_create(base_of_rom, size_of_rom);
+	if (idx) {
 		switch (opt_format) {
 		case FMT_HUMAN:
-			retval = human_fmap(fmap);
+			retval = human_fmap(idx->fmap);
 			break;
 		case FMT_NORMAL:
 			printf("hit at 0x%08x\n",
-			       (uint32_t) ((char *)fmap - (char *)base_of_rom));
+			       (uint32_t) ((char *)idx->fmap -
+					   (char *)base_of_rom));
 			/* fallthrough */
 		default:
 			retval =
-			    dump_fmap(fmap, argc - optind - 1,
+			    dump_fmap(idx, argc - optind - 1,
 				      argv + optind + 1);
 		}
+		fmap_index_free(idx);
 	}
 
+	close(fd);
+	fd_of_rom = -1;
 	if (0 != munmap(base_of_rom, sb.st_size)) {
 		fprintf(stderr, "%s: can't munmap %s: %s\n",
 			progname, argv[optind], strerror(errno));
@@ -5,20 +5,25 @@
  * Exports the kernel commandline from a given partition/image.
  */
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 #include "futility.h"
+#include "kernel_blob.h"
 #include "vboot_host.h"
 
 enum {
 	OPT_KLOADADDR = 1000,
+	OPT_JOBS,
 };
 
 static const struct option long_opts[] = {
 	{"kloadaddr", 1, NULL, OPT_KLOADADDR},
+	{"jobs", 1, NULL, OPT_JOBS},
 	{NULL, 0, NULL, 0}
 };
 
@@ -26,7 +31,100 @@ static const struct option long_opts[] = {
 static void PrintHelp(const char *progname)
 {
 	printf("\nUsage:  " MYNAME " %s [--kloadaddr ADDRESS] "
-	       "KERNEL_PARTITION\n\n", progname);
+	       "KERNEL_PARTITION [...]\n\n"
+	       "Given more than one partition, each command line is printed\n"
+	       "on its own line, after the partition's name. They are read\n"
+	       "in parallel, by --jobs NUM threads (default is one per CPU).\n"
+	       "\n", progname);
+}
+
+/*
+ * A compressed partition is only decompressed as far as the config, which is
+ * usually well short of the end. Anything else is left to FindKernelConfig().
+ */
+static char *find_config(const char *infile,
+			 uint64_t kernel_body_load_address)
+{
+	uint8_t magic[8];
+	const char *prog = NULL;
+	char *config;
+	ssize_t n;
+	pid_t pid;
+	int fd, rfd;
+
+	fd = open(infile, O_RDONLY);
+	if (fd >= 0) {
+		/* Pipes can't be peeked at, but they're read in order anyway */
+		n = pread(fd, magic, sizeof(magic), 0);
+		if (n > 0)
+			prog = futil_decompressor(magic, n);
+		if (!prog)
+			close(fd);
+	}
+	if (!prog)
+		return FindKernelConfig(infile, kernel_body_load_address);
+
+	rfd = futil_decompress_start(fd, prog, &pid);
+	close(fd);
+	if (rfd < 0)
+		return NULL;
+
+	config = FindKernelConfigFromFd(rfd, kernel_body_load_address);
+	futil_decompress_finish(rfd, pid, prog, 0);
+	return config;
+}
+
+struct config_batch_s {
+	char **infile;
+	char **config;
+	int count;
+	uint64_t kernel_body_load_address;
+};
+
+static void config_one(void *arg, uint32_t index)
+{
+	struct config_batch_s *batch = arg;
+
+	batch->config[index] = find_config(batch->infile[index],
+					   batch->kernel_body_load_address);
+}
+
+/* Find them all, then print them in order */
+static int dump_many(int count, char **infile,
+		     uint64_t kernel_body_load_address, int jobs)
+{
+	struct config_batch_s batch;
+	int i, errorcnt = 0;
+	size_t len;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.infile = infile;
+	batch.count = count;
+	batch.kernel_body_load_address = kernel_body_load_address;
+	batch.config = calloc(count, sizeof(*batch.config));
+	if (!batch.config) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	futil_run_jobs(config_one, NULL, &batch, count, jobs);
+
+	for (i = 0; i < count; i++) {
+		if (!batch.config[i]) {
+			printf("%s: FAILED\n", infile[i]);
+			errorcnt++;
+			continue;
+		}
+		/* The config is padded out to CROS_CONFIG_SIZE */
+		len = strnlen(batch.config[i], CROS_CONFIG_SIZE);
+		while (len && batch.config[i][len - 1] == '\n')
+			len--;
+		printf("%s: %.*s\n", infile[i], (int)len, batch.config[i]);
+		free(batch.config[i]);
+	}
+
+	free(batch.config);
+	return !!errorcnt;
 }
 
 static int do_dump_kernel_config(int argc, char *argv[])
@@ -35,6 +133,7 @@ static int do_dump_kernel_config(int argc, char *argv[])
 	char *config = NULL;
 	uint64_t kernel_body_load_address = USE_PREAMBLE_LOAD_ADDR;
 	int parse_error = 0;
+	int jobs = 0;
 	char *e;
 	int i;
 
@@ -58,6 +157,14 @@ static int do_dump_kernel_config(int argc, char *argv[])
 				parse_error = 1;
 			}
 			break;
+
+		case OPT_JOBS:
+			jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || jobs < 1) {
+				fprintf(stderr, "Invalid --jobs\n");
+				parse_error = 1;
+			}
+			break;
 		}
 	}
 
@@ -77,7 +184,11 @@ static int do_dump_kernel_config(int argc, char *argv[])
 		return 1;
 	}
 
-	config = FindKernelConfig(infile, kernel_body_load_address);
+	if (argc - optind > 1)
+		return dump_many(argc - optind, argv + optind,
+				 kernel_body_load_address, jobs);
+
+	config = find_config(infile, kernel_body_load_address);
 	if (!config)
 		return 1;
 
@@ -4,8 +4,10 @@
  * found in the LICENSE file.
  */
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,10 +15,15 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "file_type.h"
+#include "fmap.h"
 #include "futility.h"
 #include "gbb_header.h"
+#include "image_scan.h"
+#include "traversal.h"
 
 static void print_help(const char *prog)
 {
@@ -43,6 +50,12 @@ static void print_help(const char *prog)
 		" -k, --rootkey=FILE  \tFile name of new Root Key.\n"
 		" -b, --bmpfv=FILE    \tFile name of new Bitmap FV.\n"
 		" -r  --recoverykey=FILE\tFile name of new Recovery Key.\n"
+		"     --batch=FILE    \tManifest with the above options (which\n"
+		"                     \tmay also be given as defaults), the\n"
+		"                     \tbios_file and the output_file for one\n"
+		"                     \timage per line.\n"
+		"     --jobs=NUM      \tNumber of images to set in parallel\n"
+		"                     \t(default is one per CPU).\n"
 		"\n"
 		"CREATE MODE:\n"
 		"-c, --create=hwid_size,rootkey_size,bmpfv_size,"
@@ -60,6 +73,8 @@ enum {
 	OPT_HWID = 1000,
 	OPT_FLAGS,
 	OPT_DIGEST,
+	OPT_BATCH,
+	OPT_JOBS,
 };
 
 /* Command line options */
@@ -75,6 +90,8 @@ static struct option long_opts[] = {
 	{"hwid", 0, NULL, OPT_HWID},
 	{"flags", 0, NULL, OPT_FLAGS},
 	{"digest", 0, NULL, OPT_DIGEST},
+	{"batch", 1, NULL, OPT_BATCH},
+	{"jobs", 1, NULL, OPT_JOBS},
 	{NULL, 0, NULL, 0},
 };
 
@@ -91,25 +108,33 @@ static void opt_has_arg(const char *name, int val)
 		}
 }
 
-static int errorcnt;
+/* Batch workers each keep their own count */
+static __thread int errorcnt;
+
+/* Batches only report the status of each image */
+static int quiet;
 
-#define GBB_SEARCH_STRIDE 4
 static GoogleBinaryBlockHeader *FindGbbHeader(uint8_t *ptr, size_t size)
 {
-	size_t i;
 	GoogleBinaryBlockHeader *tmp, *gbb_header = NULL;
-	int count = 0;
+	ImageScan *scan;
+	int i, count = 0;
 
-	for (i = 0; i <= size - GBB_SEARCH_STRIDE; i += GBB_SEARCH_STRIDE) {
-		if (0 != memcmp(ptr + i, GBB_SIGNATURE, GBB_SIGNATURE_SIZE))
-			continue;
+	scan = image_scan(ptr, size);
+	if (!scan) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		errorcnt++;
+		return NULL;
+	}
 
+	for (i = 0; i < scan->num_gbb; i++) {
 		/* Found something. See if it's any good. */
-		tmp = (GoogleBinaryBlockHeader *) (ptr + i);
-		if (futil_valid_gbb_header(tmp, size - i, NULL))
+		tmp = (GoogleBinaryBlockHeader *) (ptr + scan->gbb[i]);
+		if (futil_valid_gbb_header(tmp, size - scan->gbb[i], NULL))
 			if (!count++)
 				gbb_header = tmp;
 	}
+	image_scan_free(scan);
 
 	switch (count) {
 	case 0:
@@ -253,37 +278,16 @@ fail:
 static int write_to_file(const char *msg, const char *filename,
 			 uint8_t *start, size_t size)
 {
-	FILE *fp;
-	int r = 0;
-
-	fp = fopen(filename, "wb");
-	if (!fp) {
-		fprintf(stderr, "ERROR: Unable to open %s for writing: %s\n",
-			filename, strerror(errno));
+	/* Which keeps the padding in a big GBB as holes */
+	if (futil_write_file(filename, start, size) != FILE_ERR_NONE) {
 		errorcnt++;
-		return errno;
-	}
-
-	/* Don't write zero bytes */
-	if (size && 1 != fwrite(start, size, 1, fp)) {
-		fprintf(stderr, "ERROR: Unable to write to %s: %s\n",
-			filename, strerror(errno));
-		errorcnt++;
-		r = errno;
-	}
-
-	if (0 != fclose(fp)) {
-		fprintf(stderr, "ERROR: Unable to close %s: %s\n",
-			filename, strerror(errno));
-		errorcnt++;
-		if (!r)
-			r = errno;
+		return 1;
 	}
 
-	if (!r && msg)
+	if (msg && !quiet)
 		printf("%s %s\n", msg, filename);
 
-	return r;
+	return 0;
 }
 
 static int read_from_file(const char *msg, const char *filename,
@@ -341,12 +345,449 @@ done_close:
 			r = errno;
 	}
 
-	if (!r && msg)
+	if (!r && msg && !quiet)
 		printf(" - import %s from %s: success\n", msg, filename);
 
 	return r;
 }
 
+/* What to change in one image */
+struct gbb_set_s {
+	char *infile;
+	char *outfile;
+	char *hwid;
+	char *flags;
+	char *rootkey;
+	char *bmpfv;
+	char *recoverykey;
+};
+
+/*
+ * Where we found the GBB in the images of a batch. Another image of the
+ * same size with an identical FMAP has its GBB in the same place, so we can
+ * check the header there instead of scanning the whole image for it.
+ */
+struct gbb_layout_s {
+	uint64_t size;
+	uint64_t fmap_offset;
+	uint64_t fmap_len;
+	uint8_t *fmap;
+	uint64_t gbb_offset;
+};
+
+struct gbb_layouts_s {
+	struct gbb_layout_s *layout;
+	int count;
+	pthread_mutex_t lock;
+};
+
+static GoogleBinaryBlockHeader *find_gbb(uint8_t *buf, uint64_t size,
+					 struct gbb_layouts_s *layouts)
+{
+	GoogleBinaryBlockHeader *gbb = NULL;
+	struct gbb_layout_s *l;
+	FmapHeader *fmap;
+	uint64_t len;
+	int i;
+
+	if (!layouts)
+		return FindGbbHeader(buf, size);
+
+	pthread_mutex_lock(&layouts->lock);
+	for (i = 0; i < layouts->count && !gbb; i++) {
+		l = &layouts->layout[i];
+		if (l->size == size &&
+		    !memcmp(buf + l->fmap_offset, l->fmap, l->fmap_len) &&
+		    futil_valid_gbb_header((GoogleBinaryBlockHeader *)
+					   (buf + l->gbb_offset),
+					   size - l->gbb_offset, NULL))
+			gbb = (GoogleBinaryBlockHeader *)(buf + l->gbb_offset);
+	}
+	pthread_mutex_unlock(&layouts->lock);
+	if (gbb)
+		return gbb;
+
+	gbb = FindGbbHeader(buf, size);
+	fmap = gbb ? fmap_find(buf, size) : NULL;
+	if (!fmap)
+		return gbb;
+	len = sizeof(*fmap) + fmap->fmap_nareas * sizeof(FmapAreaHeader);
+	if ((uint8_t *)fmap - buf + len > size)
+		return gbb;
+
+	/* Remember it for next time, if we can */
+	pthread_mutex_lock(&layouts->lock);
+	l = realloc(layouts->layout, (layouts->count + 1) * sizeof(*l));
+	if (l) {
+		layouts->layout = l;
+		l = &l[layouts->count];
+		l->fmap = malloc(len);
+		if (l->fmap) {
+			memcpy(l->fmap, fmap, len);
+			l->size = size;
+			l->fmap_offset = (uint8_t *)fmap - buf;
+			l->fmap_len = len;
+			l->gbb_offset = (uint8_t *)gbb - buf;
+			layouts->count++;
+		}
+	}
+	pthread_mutex_unlock(&layouts->lock);
+
+	return gbb;
+}
+
+/*
+ * Makes the changes to one image. Returns the number of errors, which are
+ * also added to errorcnt.
+ */
+static int set_gbb(const struct gbb_set_s *set, struct gbb_layouts_s *layouts)
+{
+	struct futil_traverse_state_s state;
+	GoogleBinaryBlockHeader *gbb;
+	uint8_t *gbb_base;
+	uint64_t gbb_start;
+	uint8_t *inbuf = NULL;
+	uint8_t *outbuf = NULL;
+	uint8_t *mapbuf = NULL;
+	uint64_t maplen = 0;
+	off_t filesize;
+	int before = errorcnt;
+	int fd = -1;
+
+	memset(&state, 0, sizeof(state));
+
+	/*
+	 * Editing the file in place only needs the GBB, so map the image
+	 * privately and write back just the parts we change.
+	 */
+	if (futil_same_file(set->infile, set->outfile)) {
+		fd = open(set->infile, O_RDWR);
+		if (fd < 0) {
+			fprintf(stderr,
+				"ERROR: Can't open %s for writing: %s\n",
+				set->infile, strerror(errno));
+			errorcnt++;
+			goto done;
+		}
+		if (futil_map_file(fd, MAP_RO, &mapbuf, &maplen)) {
+			errorcnt++;
+			close(fd);
+			fd = -1;
+			goto done;
+		}
+		outbuf = mapbuf;
+		filesize = maplen;
+	} else {
+		/* With no args, we'll either copy it or do nothing */
+		inbuf = read_entire_file(set->infile, &filesize);
+		if (!inbuf)
+			goto done;
+	}
+
+	gbb = find_gbb(inbuf ? inbuf : outbuf, filesize, layouts);
+	if (!gbb) {
+		fprintf(stderr, "ERROR: No GBB found in %s\n", set->infile);
+		goto done;
+	}
+	gbb_base = (uint8_t *) gbb;
+
+	if (inbuf) {
+		outbuf = (uint8_t *) malloc(filesize);
+		if (!outbuf) {
+			errorcnt++;
+			fprintf(stderr,
+				"ERROR: can't malloc %" PRIi64 " bytes: %s\n",
+				filesize, strerror(errno));
+			goto done;
+		}
+
+		/* Switch pointers to outbuf */
+		memcpy(outbuf, inbuf, filesize);
+		gbb_base = outbuf + (gbb_base - inbuf);
+		gbb = (GoogleBinaryBlockHeader *) gbb_base;
+	}
+	gbb_start = gbb_base - outbuf;
+
+	if (set->hwid) {
+		if (strlen(set->hwid) + 1 > gbb->hwid_size) {
+			fprintf(stderr,
+				"ERROR: null-terminated HWID"
+				" exceeds capacity (%d)\n",
+				gbb->hwid_size);
+			errorcnt++;
+		} else {
+			/* Wipe data before writing new value. */
+			memset(gbb_base + gbb->hwid_offset, 0,
+			       gbb->hwid_size);
+			strcpy((char *)(gbb_base + gbb->hwid_offset),
+			       set->hwid);
+			update_hwid_digest(gbb);
+			futil_mark_dirty(&state, gbb_start + gbb->hwid_offset,
+					 gbb->hwid_size);
+			futil_mark_dirty(&state, gbb_start, GBB_HEADER_SIZE);
+		}
+	}
+
+	if (set->flags) {
+		char *e = NULL;
+		uint32_t val;
+		val = (uint32_t) strtoul(set->flags, &e, 0);
+		if (e && *e) {
+			fprintf(stderr,
+				"ERROR: invalid flags value: %s\n",
+				set->flags);
+			errorcnt++;
+		} else {
+			gbb->flags = val;
+			futil_mark_dirty(&state, gbb_start, GBB_HEADER_SIZE);
+		}
+	}
+
+	if (set->rootkey) {
+		read_from_file("root_key", set->rootkey,
+			       gbb_base + gbb->rootkey_offset,
+			       gbb->rootkey_size);
+		futil_mark_dirty(&state, gbb_start + gbb->rootkey_offset,
+				 gbb->rootkey_size);
+	}
+	if (set->bmpfv) {
+		read_from_file("bmp_fv", set->bmpfv,
+			       gbb_base + gbb->bmpfv_offset,
+			       gbb->bmpfv_size);
+		futil_mark_dirty(&state, gbb_start + gbb->bmpfv_offset,
+				 gbb->bmpfv_size);
+	}
+	if (set->recoverykey) {
+		read_from_file("recovery_key", set->recoverykey,
+			       gbb_base + gbb->recovery_key_offset,
+			       gbb->recovery_key_size);
+		futil_mark_dirty(&state,
+				 gbb_start + gbb->recovery_key_offset,
+				 gbb->recovery_key_size);
+	}
+
+	/* Write it out if there are no problems. */
+	if (errorcnt != before)
+		goto done;
+	if (inbuf) {
+		write_to_file("successfully saved new image to:",
+			      set->outfile, outbuf, filesize);
+	} else if (futil_write_dirty(fd, outbuf, &state, 0)) {
+		errorcnt++;
+	} else if (!quiet) {
+		printf("successfully saved new image to: %s\n", set->outfile);
+	}
+
+done:
+	if (fd >= 0) {
+		errorcnt += futil_unmap_file(fd, MAP_RO, mapbuf, maplen);
+		if (close(fd)) {
+			fprintf(stderr, "ERROR: Can't close %s: %s\n",
+				set->infile, strerror(errno));
+			errorcnt++;
+		}
+	} else {
+		free(outbuf);
+	}
+	free(inbuf);
+	return errorcnt - before;
+}
+
+/* One line of a batch manifest */
+struct gbb_job_s {
+	struct gbb_set_s set;
+	char *line;
+	int lineno;
+	int errorcnt;
+};
+
+struct gbb_batch_s {
+	struct gbb_job_s *job;
+	int count;
+	int failed;
+	struct gbb_layouts_s layouts;
+	pthread_mutex_t lock;
+};
+
+static void batch_one(void *arg, uint32_t index)
+{
+	struct gbb_batch_s *batch = arg;
+	struct gbb_job_s *job = &batch->job[index];
+
+	if (!job->errorcnt)
+		job->errorcnt = set_gbb(&job->set, &batch->layouts);
+
+	pthread_mutex_lock(&batch->lock);
+	if (job->errorcnt)
+		batch->failed++;
+	printf("%d: %s %s\n", job->lineno,
+	       job->set.outfile ? job->set.outfile : "-",
+	       job->errorcnt ? "FAILED" : "OK");
+	fflush(stdout);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/* Parses the options on one manifest line. Returns the number of errors. */
+static int parse_batch_line(int argc, char *argv[], struct gbb_set_s *set,
+			    const char *batchfile, int lineno)
+{
+	int errors = 0;
+	int i;
+
+	optind = 0;
+	while ((i = getopt_long(argc, argv, ":o:k:b:r:",
+				long_opts, 0)) != -1) {
+		switch (i) {
+		case 'o':
+			set->outfile = optarg;
+			break;
+		case 'k':
+			set->rootkey = optarg;
+			break;
+		case 'b':
+			set->bmpfv = optarg;
+			break;
+		case 'r':
+			set->recoverykey = optarg;
+			break;
+		case OPT_HWID:
+			set->hwid = optarg;
+			break;
+		case OPT_FLAGS:
+			set->flags = optarg;
+			if (!*optarg) {
+				fprintf(stderr,
+					"%s:%d: missing new flags value\n",
+					batchfile, lineno);
+				errors++;
+			}
+			break;
+		case ':':
+			fprintf(stderr, "%s:%d: missing argument to %s\n",
+				batchfile, lineno, argv[optind - 1]);
+			errors++;
+			break;
+		default:
+			fprintf(stderr, "%s:%d: can't use %s in a manifest\n",
+				batchfile, lineno, argv[optind - 1]);
+			errors++;
+		}
+	}
+
+	if (argc - optind < 1) {
+		fprintf(stderr, "%s:%d: missing input filename\n",
+			batchfile, lineno);
+		return errors + 1;
+	}
+	set->infile = argv[optind++];
+	if (!set->outfile)
+		set->outfile = (argc - optind < 1) ?
+			set->infile : argv[optind++];
+	if (argc - optind > 0) {
+		fprintf(stderr, "%s:%d: too many filenames\n",
+			batchfile, lineno);
+		errors++;
+	}
+
+	return errors;
+}
+
+#define MAX_BATCH_ARGS 16
+
+/*
+ * Each line of the manifest gives the options and files for one image. The
+ * options from the command line apply to every line.
+ */
+static int do_batch(const struct gbb_set_s *defaults, const char *batchfile,
+		    int nthreads)
+{
+	struct gbb_batch_s batch;
+	struct timespec start, end;
+	char *line = NULL;
+	size_t linesize = 0;
+	char *argv[MAX_BATCH_ARGS + 1];
+	int argc;
+	int lineno = 0;
+	int i;
+	double secs;
+	FILE *fp;
+
+	fp = fopen(batchfile, "r");
+	if (!fp) {
+		fprintf(stderr, "ERROR: Can't open %s: %s\n",
+			batchfile, strerror(errno));
+		return 1;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_mutex_init(&batch.layouts.lock, NULL);
+
+	/* Parse every line up front, since getopt isn't reentrant */
+	while (getline(&line, &linesize, fp) != -1) {
+		struct gbb_job_s *job;
+		char *copy;
+
+		lineno++;
+		copy = strdup(line);
+		argv[0] = "gbb_utility";
+		argc = copy ? futil_split_line(copy, argv + 1,
+					       MAX_BATCH_ARGS) : -1;
+		if (argc == 0) {
+			free(copy);
+			continue;
+		}
+
+		job = realloc(batch.job, (batch.count + 1) * sizeof(*job));
+		if (!job) {
+			fprintf(stderr, "ERROR: Out of memory\n");
+			free(copy);
+			batch.failed = 1;
+			goto done;
+		}
+		batch.job = job;
+		job = &batch.job[batch.count++];
+		memset(job, 0, sizeof(*job));
+		job->set = *defaults;
+		job->line = copy;
+		job->lineno = lineno;
+
+		if (argc < 0) {
+			fprintf(stderr, "%s:%d: too many arguments\n",
+				batchfile, lineno);
+			job->errorcnt = 1;
+			continue;
+		}
+		job->errorcnt = parse_batch_line(argc + 1, argv, &job->set,
+						 batchfile, lineno);
+	}
+
+	quiet = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	futil_run_jobs(batch_one, NULL, &batch, batch.count, nthreads);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	quiet = 0;
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Updated %d of %d images in %.3f seconds (%.1f images/sec)\n",
+	       batch.count - batch.failed, batch.count, secs,
+	       secs > 0 ? batch.count / secs : 0.0);
+
+done:
+	free(line);
+	fclose(fp);
+	for (i = 0; i < batch.count; i++)
+		free(batch.job[i].line);
+	free(batch.job);
+	for (i = 0; i < batch.layouts.count; i++)
+		free(batch.layouts.layout[i].fmap);
+	free(batch.layouts.layout);
+	pthread_mutex_destroy(&batch.layouts.lock);
+	pthread_mutex_destroy(&batch.lock);
+	return !!batch.failed;
+}
+
 static int do_gbb_utility(int argc, char *argv[])
 {
 	enum do_what_now { DO_GET, DO_SET, DO_CREATE } mode = DO_GET;
@@ -366,6 +807,10 @@ static int do_gbb_utility(int argc, char *argv[])
 	uint8_t *outbuf = NULL;
 	GoogleBinaryBlockHeader *gbb;
 	uint8_t *gbb_base;
+	struct gbb_set_s set;
+	char *batchfile = NULL;
+	int jobs = 0;
+	char *e;
 	int i;
 
 	opterr = 0;		/* quiet, you */
@@ -410,6 +855,18 @@ static int do_gbb_utility(int argc, char *argv[])
 		case OPT_DIGEST:
 			sel_digest = 1;
 			break;
+		case OPT_BATCH:
+			batchfile = optarg;
+			break;
+		case OPT_JOBS:
+			jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || jobs < 1) {
+				fprintf(stderr,
+					"ERROR: invalid --jobs \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
 		case '?':
 			errorcnt++;
 			if (optopt)
@@ -442,6 +899,11 @@ static int do_gbb_utility(int argc, char *argv[])
 		}
 	}
 
+	if (batchfile && mode != DO_SET) {
+		fprintf(stderr, "ERROR: --batch only works with --set\n");
+		errorcnt++;
+	}
+
 	/* Problems? */
 	if (errorcnt) {
 		print_help(argv[0]);
@@ -482,7 +944,7 @@ static int do_gbb_utility(int argc, char *argv[])
 							 gbb->
 							 hwid_offset) : "");
 		if (sel_digest)
-			print_hwid_digest(gbb, "digest: ", "\n");
+			print_hwid_digest(stdout, gbb, "digest: ", "\n");
 
 		if (sel_flags)
 			printf("flags: 0x%08x\n", gbb->flags);
@@ -503,15 +965,6 @@ static int do_gbb_utility(int argc, char *argv[])
 		break;
 
 	case DO_SET:
-		if (argc - optind < 1) {
-			fprintf(stderr, "\nERROR: missing input filename\n");
-			print_help(argv[0]);
-			return 1;
-		}
-		infile = argv[optind++];
-		if (!outfile)
-			outfile = (argc - optind < 1) ? infile : argv[optind++];
-
 		if (sel_hwid && !opt_hwid) {
 			fprintf(stderr, "\nERROR: missing new HWID value\n");
 			print_help(argv[0]);
@@ -523,86 +976,37 @@ static int do_gbb_utility(int argc, char *argv[])
 			return 1;
 		}
 
-		/* With no args, we'll either copy it unchanged or do nothing */
-		inbuf = read_entire_file(infile, &filesize);
-		if (!inbuf)
-			break;
-
-		gbb = FindGbbHeader(inbuf, filesize);
-		if (!gbb) {
-			fprintf(stderr, "ERROR: No GBB found in %s\n", infile);
-			break;
-		}
-		gbb_base = (uint8_t *) gbb;
-
-		outbuf = (uint8_t *) malloc(filesize);
-		if (!outbuf) {
-			errorcnt++;
-			fprintf(stderr,
-				"ERROR: can't malloc %" PRIi64 " bytes: %s\n",
-				filesize, strerror(errno));
-			break;
-		}
-
-		/* Switch pointers to outbuf */
-		memcpy(outbuf, inbuf, filesize);
-		gbb = FindGbbHeader(outbuf, filesize);
-		if (!gbb) {
-			fprintf(stderr,
-				"INTERNAL ERROR: No GBB found in outbuf\n");
-			exit(1);
-		}
-		gbb_base = (uint8_t *) gbb;
-
-		if (opt_hwid) {
-			if (strlen(opt_hwid) + 1 > gbb->hwid_size) {
-				fprintf(stderr,
-					"ERROR: null-terminated HWID"
-					" exceeds capacity (%d)\n",
-					gbb->hwid_size);
-				errorcnt++;
-			} else {
-				/* Wipe data before writing new value. */
-				memset(gbb_base + gbb->hwid_offset, 0,
-				       gbb->hwid_size);
-				strcpy((char *)(gbb_base + gbb->hwid_offset),
-				       opt_hwid);
-				update_hwid_digest(gbb);
+		memset(&set, 0, sizeof(set));
+		set.hwid = opt_hwid;
+		set.flags = opt_flags;
+		set.rootkey = opt_rootkey;
+		set.bmpfv = opt_bmpfv;
+		set.recoverykey = opt_recoverykey;
+
+		if (batchfile) {
+			if (outfile || argc - optind > 0) {
+				fprintf(stderr, "\nERROR: bios_file and "
+					"output_file go in the --batch "
+					"manifest\n");
+				print_help(argv[0]);
+				return 1;
 			}
+			errorcnt += do_batch(&set, batchfile, jobs);
+			break;
 		}
 
-		if (opt_flags) {
-			char *e = NULL;
-			uint32_t val;
-			val = (uint32_t) strtoul(opt_flags, &e, 0);
-			if (e && *e) {
-				fprintf(stderr,
-					"ERROR: invalid flags value: %s\n",
-					opt_flags);
-				errorcnt++;
-			} else {
-				gbb->flags = val;
-			}
+		if (argc - optind < 1) {
+			fprintf(stderr, "\nERROR: missing input filename\n");
+			print_help(argv[0]);
+			return 1;
 		}
+		set.infile = argv[optind++];
+		set.outfile = outfile;
+		if (!set.outfile)
+			set.outfile = (argc - optind < 1) ?
+				set.infile : argv[optind++];
 
-		if (opt_rootkey)
-			read_from_file("root_key", opt_rootkey,
-				       gbb_base + gbb->rootkey_offset,
-				       gbb->rootkey_size);
-		if (opt_bmpfv)
-			read_from_file("bmp_fv", opt_bmpfv,
-				       gbb_base + gbb->bmpfv_offset,
-				       gbb->bmpfv_size);
-		if (opt_recoverykey)
-			read_from_file("recovery_key", opt_recoverykey,
-				       gbb_base + gbb->recovery_key_offset,
-				       gbb->recovery_key_size);
-
-		/* Write it out if there are no problems. */
-		if (!errorcnt)
-			write_to_file("successfully saved new image to:",
-				      outfile, outbuf, filesize);
-
+		set_gbb(&set, NULL);
 		break;
 
 	case DO_CREATE:
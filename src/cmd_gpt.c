@@ -0,0 +1,588 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Shows and edits the GPT of disk images and block devices. The same edits
+ * are made to every file named, in one run, and only the headers and the
+ * sectors holding the entries that changed are written back.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgptlib.h"
+#include "cgptlib_internal.h"
+#include "file_type.h"
+#include "futility.h"
+#include "gpt.h"
+#include "gpt_misc.h"
+#include "vboot_api.h"
+#include "vboot_api_stub_disk.h"
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] FILE [FILE ...]\n"
+	"\n"
+	"Makes the EDITS given by the options, in order, to the GPT of each\n"
+	"FILE, which may be a disk image or a block device, then shows it.\n"
+	"Only the headers and the sectors holding the entries that changed\n"
+	"are written back. A damaged copy of the GPT is repaired from the\n"
+	"good one.\n"
+	"\n"
+	"Edits:\n"
+	"  -i NUM              Select partition NUM (from 1) for the edits\n"
+	"                        after it\n"
+	"  -P NUM              Set its priority (0-15)\n"
+	"  -T NUM              Set its tries (0-15)\n"
+	"  -S NUM              Set its successful flag (0-1)\n"
+	"  --prioritize        Make it the kernel to boot first, keeping the\n"
+	"                        order of the others below it\n"
+	"  --update TYPE       Update it as firmware would after a boot:\n"
+	"                        try, bad, reset or invalid\n"
+	"  --add TYPE:START:SIZE[:LABEL]\n"
+	"                      Add a partition in the first unused entry,\n"
+	"                        and select it. TYPE is kernel, rootfs,\n"
+	"                        data, fs, reserved, efi or firmware. START\n"
+	"                        and SIZE are in bytes, and may end in K, M\n"
+	"                        or G.\n"
+	"\n"
+	"Options:\n"
+	"  -n, --dry-run       Show the edits without writing them\n"
+	"  -q, --quiet         Don't show the GPT\n"
+	"\n"
+	"A FILE whose edits fail isn't written at all.\n"
+	"\n";
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog);
+}
+
+enum edit_op {
+	EDIT_SELECT,
+	EDIT_PRIORITY,
+	EDIT_TRIES,
+	EDIT_SUCCESSFUL,
+	EDIT_PRIORITIZE,
+	EDIT_UPDATE,
+	EDIT_ADD,
+};
+
+/* The options for them, for messages */
+static const char *const edit_names[] = {
+	"-i", "-P", "-T", "-S", "--prioritize", "--update", "--add",
+};
+
+struct edit_s {
+	enum edit_op op;
+	const char *arg;		/* as given, for messages */
+	int val;
+	/* For EDIT_ADD */
+	char *buf;			/* arg, split up */
+	Guid type;
+	uint64_t start, size;		/* in bytes */
+	const char *label;
+};
+
+struct gpt_s {
+	struct edit_s *edit;
+	int count;
+	int dry_run;
+	int quiet;
+};
+
+static const struct {
+	const char *name;
+	uint32_t type;
+} update_types[] = {
+	{"try",     GPT_UPDATE_ENTRY_TRY},
+	{"bad",     GPT_UPDATE_ENTRY_BAD},
+	{"reset",   GPT_UPDATE_ENTRY_RESET},
+	{"invalid", GPT_UPDATE_ENTRY_INVALID},
+};
+
+static int parse_num(const char *str, int max, int *val)
+{
+	char *e;
+	long v = strtol(str, &e, 0);
+
+	if (!*str || *e || v < 0 || v > max)
+		return 1;
+	*val = v;
+	return 0;
+}
+
+/* Parses TYPE:START:SIZE[:LABEL] into [ed]. Returns 0 if it's good. */
+static int parse_add(char *str, struct edit_s *ed)
+{
+	char *word[4] = {NULL};
+	int n = 0;
+
+	word[n++] = str;
+	while (n < ARRAY_SIZE(word) && (str = strchr(str, ':'))) {
+		*str++ = '\0';
+		word[n++] = str;
+	}
+	if (n < 3 || futil_gpt_type(word[0], &ed->type) ||
+	    futil_parse_size(word[1], &ed->start) ||
+	    futil_parse_size(word[2], &ed->size) || !ed->size ||
+	    ed->start % DISK_SECTOR_SIZE || ed->size % DISK_SECTOR_SIZE)
+		return 1;
+	ed->label = n == 4 ? word[3] : "";
+	return strlen(ed->label) > ARRAY_SIZE(((GptEntry *)0)->name);
+}
+
+/* Returns the first unused entry in [gpt], or NULL if they're all used */
+static GptEntry *unused_entry(GptData *gpt)
+{
+	GptHeader *h = (GptHeader *)gpt->primary_header;
+	GptEntry *entries = (GptEntry *)gpt->primary_entries;
+	uint32_t i;
+
+	for (i = 0; i < h->number_of_entries; i++)
+		if (IsUnusedEntry(&entries[i]))
+			return &entries[i];
+	return NULL;
+}
+
+static int add_entry(const char *file, GptData *gpt, GptEntry **sel,
+		     const struct edit_s *ed)
+{
+	GptHeader *h = (GptHeader *)gpt->primary_header;
+	GptEntry *e = unused_entry(gpt);
+	GptEntry old, new;
+	int fd, rv, i;
+
+	if (!e) {
+		fprintf(stderr, "%s: no unused entry for --add %s\n",
+			file, ed->arg);
+		return 1;
+	}
+
+	memset(&new, 0, sizeof(new));
+	new.type = ed->type;
+	fd = open("/dev/urandom", O_RDONLY);
+	rv = fd >= 0 ? read(fd, new.unique.u.raw, GUID_SIZE) : -1;
+	if (fd >= 0)
+		close(fd);
+	if (rv != GUID_SIZE) {
+		fprintf(stderr, "Can't read /dev/urandom: %s\n",
+			strerror(errno));
+		return 1;
+	}
+	/* A random (version 4) UUID */
+	new.unique.u.Uuid.time_high_and_version =
+		(new.unique.u.Uuid.time_high_and_version & 0x0fff) | 0x4000;
+	new.unique.u.Uuid.clock_seq_high_and_reserved =
+		(new.unique.u.Uuid.clock_seq_high_and_reserved & 0x3f) | 0x80;
+	new.starting_lba = ed->start / DISK_SECTOR_SIZE;
+	new.ending_lba = new.starting_lba + ed->size / DISK_SECTOR_SIZE - 1;
+	for (i = 0; ed->label[i]; i++)
+		new.name[i] = ed->label[i];
+
+	old = *e;
+	*e = new;
+	GptModifiedEntry(gpt, e, &old);
+	rv = CheckEntries((GptEntry *)gpt->primary_entries, h);
+	if (rv) {
+		fprintf(stderr, "%s: can't --add %s: %s\n", file, ed->arg,
+			GptErrorText(rv));
+		return 1;
+	}
+	*sel = e;
+	return 0;
+}
+
+/*
+ * Gives [e] a higher priority than any other kernel. If that would be more
+ * than 15, the others are ranked again from 14 down, in the same order, the
+ * lowest sharing priority 1 if there are too many.
+ */
+static void prioritize(GptData *gpt, GptEntry *e)
+{
+	GptHeader *h = (GptHeader *)gpt->primary_header;
+	GptEntry *entries = (GptEntry *)gpt->primary_entries;
+	GptEntry *o;
+	uint64_t old;
+	uint32_t i;
+	int rank[16];
+	int top;
+	int p, r;
+
+	memset(rank, 0, sizeof(rank));
+	for (i = 0; i < h->number_of_entries; i++) {
+		o = &entries[i];
+		if (o != e && IsKernelEntry(o))
+			rank[GetEntryPriority(o)] = 1;
+	}
+	for (p = 15; p > 0 && !rank[p]; p--)
+		;
+	if (GetEntryPriority(e) > p)
+		return;
+	top = p + 1;
+
+	if (top > 15) {
+		/* Rank the priorities in use from 14 down */
+		for (r = 14, p = 15; p > 0; p--)
+			if (rank[p]) {
+				rank[p] = r;
+				if (r > 1)
+					r--;
+			}
+		for (i = 0; i < h->number_of_entries; i++) {
+			o = &entries[i];
+			p = GetEntryPriority(o);
+			if (o == e || !IsKernelEntry(o) || !p || rank[p] == p)
+				continue;
+			old = o->attrs.whole;
+			SetEntryPriority(o, rank[p]);
+			GptModifiedAttrs(gpt, o, old);
+		}
+		top = 15;
+	}
+
+	if (GetEntryPriority(e) != top) {
+		old = e->attrs.whole;
+		SetEntryPriority(e, top);
+		GptModifiedAttrs(gpt, e, old);
+	}
+}
+
+/* Makes the edits to [gpt]. Returns the number of errors. */
+static int apply_edits(struct gpt_s *g, const char *file, GptData *gpt)
+{
+	GptHeader *h = (GptHeader *)gpt->primary_header;
+	GptEntry *entries = (GptEntry *)gpt->primary_entries;
+	GptEntry *e = NULL;
+	struct edit_s *ed;
+	uint64_t old;
+	int rv;
+	int i;
+
+	for (i = 0; i < g->count; i++) {
+		ed = &g->edit[i];
+		if (ed->op == EDIT_SELECT) {
+			if (ed->val > h->number_of_entries) {
+				fprintf(stderr, "%s: there's no partition"
+					" %d\n", file, ed->val);
+				return 1;
+			}
+			e = &entries[ed->val - 1];
+			continue;
+		}
+		if (ed->op == EDIT_ADD) {
+			if (add_entry(file, gpt, &e, ed))
+				return 1;
+			continue;
+		}
+
+		if (!e) {
+			fprintf(stderr, "No partition selected for %s\n",
+				edit_names[ed->op]);
+			return 1;
+		}
+		if (IsUnusedEntry(e)) {
+			fprintf(stderr, "%s: partition %d is unused\n",
+				file, (int)(e - entries) + 1);
+			return 1;
+		}
+
+		old = e->attrs.whole;
+		switch (ed->op) {
+		case EDIT_PRIORITY:
+			SetEntryPriority(e, ed->val);
+			break;
+		case EDIT_TRIES:
+			SetEntryTries(e, ed->val);
+			break;
+		case EDIT_SUCCESSFUL:
+			SetEntrySuccessful(e, ed->val);
+			break;
+		case EDIT_PRIORITIZE:
+		case EDIT_UPDATE:
+			if (!IsKernelEntry(e)) {
+				fprintf(stderr, "%s: partition %d isn't a"
+					" kernel\n", file,
+					(int)(e - entries) + 1);
+				return 1;
+			}
+			if (ed->op == EDIT_PRIORITIZE) {
+				prioritize(gpt, e);
+				continue;
+			}
+			rv = GptUpdateKernelWithEntry(gpt, e, ed->val);
+			if (rv) {
+				fprintf(stderr, "%s: --update %s: %s\n",
+					file, ed->arg, GptErrorText(rv));
+				return 1;
+			}
+			continue;
+		default:
+			DIE;
+		}
+		if (e->attrs.whole != old)
+			GptModifiedAttrs(gpt, e, old);
+	}
+	return 0;
+}
+
+static void show_gpt(const char *file, GptData *gpt)
+{
+	GptHeader *h = (GptHeader *)gpt->primary_header;
+	GptEntry *entries = (GptEntry *)gpt->primary_entries;
+	const char *type;
+	GptEntry *e;
+	uint32_t i;
+	int j;
+
+	printf("%s:\n", file);
+	printf("part  start        sectors      type      P  T  S  label\n");
+	for (i = 0; i < h->number_of_entries; i++) {
+		e = &entries[i];
+		if (IsUnusedEntry(e))
+			continue;
+		type = futil_gpt_type_name(&e->type);
+		printf("%4d  %-12" PRIu64 " %-12" PRIu64 " %-9s", i + 1,
+		       e->starting_lba, e->ending_lba - e->starting_lba + 1,
+		       type ? type : "?");
+		if (IsKernelEntry(e))
+			printf(" %-2d %-2d %d  ", GetEntryPriority(e),
+			       GetEntryTries(e), GetEntrySuccessful(e));
+		else
+			printf(" -  -  -  ");
+		for (j = 0; j < ARRAY_SIZE(e->name) && e->name[j]; j++)
+			putchar(e->name[j] < 0x80 ? e->name[j] : '?');
+		putchar('\n');
+	}
+}
+
+/*
+ * How many sectors WriteAndFreeGptData() will write: each copy's header
+ * and the sectors holding the entries that changed.
+ */
+static uint64_t sectors_to_write(GptData *gpt)
+{
+	GptHeader *h = (GptHeader *)gpt->primary_header;
+	uint64_t n = gpt->sector_bytes;
+	uint64_t count = h->number_of_entries * h->size_of_entry / n;
+	uint64_t sectors = 0;
+
+	if (gpt->modified_entries_start < gpt->modified_entries_end)
+		count = (gpt->modified_entries_end + n - 1) / n -
+			gpt->modified_entries_start / n;
+	if (gpt->modified & GPT_MODIFIED_HEADER1)
+		sectors++;
+	if (gpt->modified & GPT_MODIFIED_HEADER2)
+		sectors++;
+	if (gpt->modified & GPT_MODIFIED_ENTRIES1)
+		sectors += count;
+	if (gpt->modified & GPT_MODIFIED_ENTRIES2)
+		sectors += count;
+	return sectors;
+}
+
+/* Edits, shows and writes back one FILE. Returns the number of errors. */
+static int do_file(struct gpt_s *g, const char *file)
+{
+	VbDiskInfo disk;
+	GptData gpt;
+	uint64_t sectors;
+	int errorcnt = 0;
+	int rv;
+
+	if (VbExDiskOpenFile(file, DISK_SECTOR_SIZE, &disk)) {
+		fprintf(stderr, "Can't open %s: %s\n", file, strerror(errno));
+		return 1;
+	}
+
+	memset(&gpt, 0, sizeof(gpt));
+	gpt.sector_bytes = DISK_SECTOR_SIZE;
+	gpt.streaming_drive_sectors = disk.lba_count;
+	gpt.gpt_drive_sectors = disk.lba_count;
+	if (AllocAndReadGptData(disk.handle, &gpt)) {
+		fprintf(stderr, "%s: no valid GPT\n", file);
+		errorcnt++;
+	} else if ((rv = GptInit(&gpt))) {
+		fprintf(stderr, "%s: %s\n", file, GptErrorText(rv));
+		errorcnt++;
+	} else {
+		errorcnt += apply_edits(g, file, &gpt);
+	}
+
+	if (!errorcnt && !g->quiet)
+		show_gpt(file, &gpt);
+
+	/* Nothing is written for a failed or dry run, only freed */
+	sectors = gpt.primary_header && gpt.modified ?
+		sectors_to_write(&gpt) : 0;
+	if (errorcnt || g->dry_run)
+		gpt.modified = 0;
+	if (WriteAndFreeGptData(disk.handle, &gpt)) {
+		fprintf(stderr, "Can't write %s\n", file);
+		errorcnt++;
+	} else if (sectors && !errorcnt && !g->quiet) {
+		printf("%s %" PRIu64 " sectors of %s\n",
+		       gpt.modified ? "Wrote" : "Would write", sectors, file);
+	}
+
+	VbExDiskCloseFile(disk.handle);
+	return errorcnt;
+}
+
+enum no_short_opts {
+	OPT_PRIORITIZE = 1000,
+	OPT_UPDATE,
+	OPT_ADD,
+	OPT_HELP,
+};
+
+static const struct option long_opts[] = {
+	/* name          hasarg *flag  val */
+	{"prioritize",   0, NULL, OPT_PRIORITIZE},
+	{"update",       1, NULL, OPT_UPDATE},
+	{"add",          1, NULL, OPT_ADD},
+	{"dry-run",      0, NULL, 'n'},
+	{"quiet",        0, NULL, 'q'},
+	{"help",         0, NULL, OPT_HELP},
+	{NULL,           0, NULL, 0},
+};
+
+static void free_edits(struct gpt_s *g)
+{
+	int i;
+
+	for (i = 0; i < g->count; i++)
+		free(g->edit[i].buf);
+	free(g->edit);
+}
+
+static int do_gpt(int argc, char *argv[])
+{
+	struct gpt_s g;
+	struct edit_s *ed;
+	int errorcnt = 0;
+	int i, j;
+
+	memset(&g, 0, sizeof(g));
+
+	opterr = 0;		/* quiet, you */
+	while ((i = getopt_long(argc, argv, ":i:P:T:S:nq", long_opts,
+				NULL)) != -1) {
+		switch (i) {
+		case 'n':
+			g.dry_run = 1;
+			continue;
+		case 'q':
+			g.quiet = 1;
+			continue;
+		case OPT_HELP:
+			print_help(argv[0]);
+			free_edits(&g);
+			return 0;
+		case '?':
+			fprintf(stderr, "Unrecognized option: %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			continue;
+		case ':':
+			fprintf(stderr, "Missing argument to %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			continue;
+		}
+
+		/* The rest are edits */
+		ed = realloc(g.edit, (g.count + 1) * sizeof(*ed));
+		if (!ed) {
+			fprintf(stderr, "Out of memory\n");
+			free_edits(&g);
+			return 1;
+		}
+		g.edit = ed;
+		ed = &g.edit[g.count++];
+		memset(ed, 0, sizeof(*ed));
+		ed->arg = optarg;
+
+		switch (i) {
+		case 'i':
+			ed->op = EDIT_SELECT;
+			if (parse_num(optarg, MAX_NUMBER_OF_ENTRIES,
+				      &ed->val) || !ed->val) {
+				fprintf(stderr, "Invalid -i \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case 'P':
+			ed->op = EDIT_PRIORITY;
+			if (parse_num(optarg, 15, &ed->val)) {
+				fprintf(stderr, "Invalid -P \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case 'T':
+			ed->op = EDIT_TRIES;
+			if (parse_num(optarg, 15, &ed->val)) {
+				fprintf(stderr, "Invalid -T \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case 'S':
+			ed->op = EDIT_SUCCESSFUL;
+			if (parse_num(optarg, 1, &ed->val)) {
+				fprintf(stderr, "Invalid -S \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_PRIORITIZE:
+			ed->op = EDIT_PRIORITIZE;
+			break;
+		case OPT_UPDATE:
+			ed->op = EDIT_UPDATE;
+			for (j = 0; j < ARRAY_SIZE(update_types); j++)
+				if (!strcmp(optarg, update_types[j].name))
+					break;
+			if (j == ARRAY_SIZE(update_types)) {
+				fprintf(stderr, "Invalid --update \"%s\"\n",
+					optarg);
+				errorcnt++;
+				break;
+			}
+			ed->val = update_types[j].type;
+			break;
+		case OPT_ADD:
+			ed->op = EDIT_ADD;
+			/* Split up a copy, so messages show it whole */
+			ed->buf = strdup(optarg);
+			if (!ed->buf || parse_add(ed->buf, ed)) {
+				fprintf(stderr, "Invalid --add \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		default:
+			DIE;
+		}
+	}
+	if (errorcnt || optind >= argc) {
+		print_help(argv[0]);
+		free_edits(&g);
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++)
+		errorcnt += do_file(&g, argv[i]);
+
+	free_edits(&g);
+	return !!errorcnt;
+}
+
+DECLARE_FUTIL_COMMAND(gpt, do_gpt, VBOOT_VERSION_ALL,
+		      "Show and edit the GPT of disk images",
+		      print_help);
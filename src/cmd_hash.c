@@ -0,0 +1,366 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Digests of each part of an image, for release manifests.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "file_type.h"
+#include "fmap.h"
+#include "futility.h"
+#include "vboot_struct.h"
+
+enum {
+	OPT_ALG = 1000,
+	OPT_JOBS,
+};
+
+static const struct option long_opts[] = {
+	{"alg",  1, NULL, OPT_ALG},
+	{"jobs", 1, NULL, OPT_JOBS},
+	{NULL, 0, NULL, 0}
+};
+
+static const struct {
+	const char *name;
+	int size;
+} hash_algs[] = {
+	{"sha1",   SHA1_DIGEST_SIZE},		/* SHA1_DIGEST_ALGORITHM */
+	{"sha256", SHA256_DIGEST_SIZE},		/* SHA256_DIGEST_ALGORITHM */
+	{"sha512", SHA512_DIGEST_SIZE},		/* SHA512_DIGEST_ALGORITHM */
+};
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] IMAGE [...]\n"
+	"\n"
+	"Prints the digests of each part of each IMAGE, one line per part:\n"
+	"\n"
+	"  IMAGE  PART  OFFSET  SIZE  sha1:HEX  sha256:HEX  sha512:HEX\n"
+	"\n"
+	"separated by tabs. The parts of a BIOS image are its FMAP areas,\n"
+	"those of a kernel partition are its vblock and its body, and\n"
+	"anything else is one part, \"-\". Each part is read only once, to\n"
+	"compute all of its digests.\n"
+	"\n"
+	"Options:\n"
+	"  --alg LIST        The digests to compute: any of sha1, sha256\n"
+	"                      and sha512, separated by commas (the\n"
+	"                      default is all of them)\n"
+	"  -j|--jobs NUM     Hash NUM parts at once (default is one per CPU)\n"
+	"\n";
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog);
+}
+
+struct hash_job_s {
+	const char *infile;
+	const char *part;
+	const uint8_t *buf;		/* or NULL, to read it from fd */
+	int fd;
+	uint64_t offset;
+	uint64_t len;
+	uint8_t digest[ARRAY_SIZE(hash_algs)][SHA512_DIGEST_SIZE];
+};
+
+struct hash_batch_s {
+	struct hash_job_s *job;
+	int count;
+	uint32_t algorithms;
+};
+
+static struct hash_job_s *add_job(struct hash_batch_s *batch,
+				  const char *infile, const char *part,
+				  const uint8_t *buf, uint64_t offset,
+				  uint64_t len)
+{
+	struct hash_job_s *job;
+
+	job = realloc(batch->job, (batch->count + 1) * sizeof(*job));
+	if (!job) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	batch->job = job;
+	job = &batch->job[batch->count++];
+	job->infile = infile;
+	job->part = part;
+	job->buf = buf ? buf + offset : NULL;
+	job->fd = -1;
+	job->offset = offset;
+	job->len = len;
+	return job;
+}
+
+/*
+ * Works out the parts of [buf]. The names point into [buf] or are constant,
+ * so they last as long as it's mapped.
+ */
+static int add_parts(struct hash_batch_s *batch, const char *infile,
+		     uint8_t *buf, uint64_t len)
+{
+	VbKeyBlockHeader *key_block = (VbKeyBlockHeader *)buf;
+	VbKernelPreambleHeader *preamble;
+	FmapAreaHeader *ah;
+	FmapIndex *idx;
+	uint64_t vblock, body;
+	int errorcnt = 0;
+	int i;
+
+	idx = fmap_index_create(buf, len);
+	if (idx) {
+		for (i = 0; (ah = fmap_index_by_offset(idx, i)); i++) {
+			if ((uint64_t)ah->area_offset + ah->area_size > len) {
+				fprintf(stderr, "%s: %.*s is past the end\n",
+					infile, FMAP_NAMELEN, ah->area_name);
+				errorcnt++;
+				continue;
+			}
+			if (!add_job(batch, infile, ah->area_name, buf,
+				     ah->area_offset, ah->area_size))
+				errorcnt++;
+		}
+		fmap_index_free(idx);
+		return errorcnt;
+	}
+
+	/* Only the shape matters here, which is all the type says */
+	if (futil_file_type_buf(buf, len) == FILE_TYPE_KERN_PREAMBLE) {
+		preamble = (VbKernelPreambleHeader *)
+			(buf + key_block->key_block_size);
+		vblock = key_block->key_block_size + preamble->preamble_size;
+		body = preamble->body_signature.data_size;
+		if (vblock > len || body > len - vblock) {
+			fprintf(stderr, "%s: the kernel body is past the end\n",
+				infile);
+			return 1;
+		}
+		if (!add_job(batch, infile, "vblock", buf, 0, vblock) ||
+		    !add_job(batch, infile, "body", buf, vblock, body))
+			return 1;
+		return 0;
+	}
+
+	return !add_job(batch, infile, "-", buf, 0, len);
+}
+
+/*
+ * Hashes a whole file that's too big to map, a window at a time. A
+ * DigestContext for each algorithm stands in for DigestMulti().
+ */
+static void hash_window(struct hash_batch_s *batch, struct hash_job_s *job)
+{
+	DigestContext ctx[ARRAY_SIZE(hash_algs)];
+	struct futil_window_s win;
+	uint64_t offset, chunk;
+	const uint8_t *p;
+	int i;
+
+	if (futil_window_open(&win, job->fd))
+		return;
+	for (i = 0; i < ARRAY_SIZE(hash_algs); i++)
+		if (batch->algorithms & (1 << i))
+			DigestInit(&ctx[i], i);
+	for (offset = 0; offset < job->len; offset += chunk) {
+		chunk = futil_window_clamp(job->len - offset);
+		p = futil_window_get(&win, offset, chunk);
+		if (!p)
+			break;
+		for (i = 0; i < ARRAY_SIZE(hash_algs); i++)
+			if (batch->algorithms & (1 << i))
+				DigestUpdate(&ctx[i], p, chunk);
+	}
+	for (i = 0; i < ARRAY_SIZE(hash_algs); i++)
+		if (batch->algorithms & (1 << i))
+			DigestFinalInto(&ctx[i], job->digest[i]);
+	futil_window_close(&win);
+}
+
+static void hash_one(void *arg, uint32_t index)
+{
+	struct hash_batch_s *batch = arg;
+	struct hash_job_s *job = &batch->job[index];
+	uint8_t *digests[ARRAY_SIZE(hash_algs)];
+	int i;
+
+	if (!job->buf) {
+		hash_window(batch, job);
+		return;
+	}
+	for (i = 0; i < ARRAY_SIZE(hash_algs); i++)
+		digests[i] = job->digest[i];
+	futil_advise(job->buf, job->len, MADV_SEQUENTIAL);
+	DigestMulti(job->buf, job->len, batch->algorithms, digests);
+}
+
+static int parse_algs(const char *str, uint32_t *algorithms)
+{
+	const char *s = str;
+	size_t n;
+	int i;
+
+	*algorithms = 0;
+	while (*s) {
+		n = strcspn(s, ",");
+		for (i = 0; i < ARRAY_SIZE(hash_algs); i++)
+			if (n == strlen(hash_algs[i].name) &&
+			    !strncmp(s, hash_algs[i].name, n))
+				break;
+		if (i == ARRAY_SIZE(hash_algs)) {
+			fprintf(stderr, "Invalid --alg \"%s\"\n", str);
+			return 1;
+		}
+		*algorithms |= 1 << i;
+		s += n;
+		if (*s)
+			s++;
+	}
+
+	if (!*algorithms) {
+		fprintf(stderr, "Invalid --alg \"%s\"\n", str);
+		return 1;
+	}
+	return 0;
+}
+
+static int do_hash(int argc, char *argv[])
+{
+	struct hash_batch_s batch;
+	struct hash_job_s *job;
+	uint8_t **buf;
+	uint64_t *len;
+	int *fd, *decompressed;
+	int errorcnt = 0;
+	int count, jobs = 0;
+	char *e;
+	int i, j, k;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.algorithms = (1 << ARRAY_SIZE(hash_algs)) - 1;
+
+	opterr = 0;
+	while ((i = getopt_long(argc, argv, "j:", long_opts, NULL)) != -1) {
+		switch (i) {
+		case OPT_ALG:
+			errorcnt += parse_algs(optarg, &batch.algorithms);
+			break;
+		case 'j':
+		case OPT_JOBS:
+			jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || jobs < 1) {
+				fprintf(stderr,
+					"Invalid --jobs \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option\n");
+			errorcnt++;
+			break;
+		}
+	}
+
+	count = argc - optind;
+	if (errorcnt || count < 1) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	buf = calloc(count, sizeof(*buf));
+	len = calloc(count, sizeof(*len));
+	fd = calloc(count, sizeof(*fd));
+	decompressed = calloc(count, sizeof(*decompressed));
+	if (!buf || !len || !fd || !decompressed) {
+		fprintf(stderr, "Out of memory\n");
+		free(buf);
+		free(len);
+		free(fd);
+		free(decompressed);
+		return 1;
+	}
+
+	/* Find all the parts first, so the threads can share them out */
+	for (i = 0; i < count; i++) {
+		fd[i] = open(argv[optind + i], O_RDONLY);
+		if (fd[i] < 0) {
+			fprintf(stderr, "Can't open %s: %s\n",
+				argv[optind + i], strerror(errno));
+			errorcnt++;
+			continue;
+		}
+		/* Too big to map, so it's hashed whole */
+		if (futil_window_wanted(fd[i])) {
+			struct futil_window_s win;
+
+			if (futil_window_open(&win, fd[i]) ||
+			    !(job = add_job(&batch, argv[optind + i], "-",
+					    NULL, 0, win.len))) {
+				close(fd[i]);
+				fd[i] = -1;
+				errorcnt++;
+				continue;
+			}
+			job->fd = fd[i];
+			continue;
+		}
+		if (futil_map_input(fd[i], &buf[i], &len[i],
+				    &decompressed[i])) {
+			close(fd[i]);
+			fd[i] = -1;
+			errorcnt++;
+			continue;
+		}
+		errorcnt += add_parts(&batch, argv[optind + i],
+				      buf[i], len[i]);
+	}
+
+	futil_run_jobs(hash_one, NULL, &batch, batch.count, jobs);
+
+	for (i = 0; i < batch.count; i++) {
+		job = &batch.job[i];
+		printf("%s\t%.*s\t0x%08" PRIx64 "\t0x%08" PRIx64,
+		       job->infile, FMAP_NAMELEN, job->part,
+		       job->offset, job->len);
+		for (j = 0; j < ARRAY_SIZE(hash_algs); j++) {
+			if (!(batch.algorithms & (1 << j)))
+				continue;
+			printf("\t%s:", hash_algs[j].name);
+			for (k = 0; k < hash_algs[j].size; k++)
+				printf("%02x", job->digest[j][k]);
+		}
+		printf("\n");
+	}
+
+	for (i = 0; i < count; i++) {
+		if (fd[i] < 0)
+			continue;
+		if (buf[i])
+			futil_unmap_input(fd[i], buf[i], len[i],
+					  decompressed[i], 0);
+		close(fd[i]);
+	}
+	free(batch.job);
+	free(buf);
+	free(len);
+	free(fd);
+	free(decompressed);
+	return !!errorcnt;
+}
+
+DECLARE_FUTIL_COMMAND(hash, do_hash,
+		      VBOOT_VERSION_ALL,
+		      "Print the digests of each part of an image",
+		      print_help);
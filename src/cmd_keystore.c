@@ -0,0 +1,96 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "futility.h"
+#include "keystore.h"
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] STORE [FILE ...]\n"
+	"\n"
+	"Lists the keys in a key store, or packs the given .vbpubk and\n"
+	".keyblock FILEs into a new one.\n"
+	"\n"
+	"Options:\n"
+	"  -c|--create     Create STORE from the FILE args\n"
+	"\n"
+	"Keys in a store are named as STORE:ID, where ID is enough leading\n"
+	"hex digits of the key's sha1sum (for a keyblock, of its data key)\n"
+	"to tell it apart from the rest. The sign, verify and show commands\n"
+	"accept these names wherever they take a .vbpubk or .keyblock.\n"
+	"\n"
+	"Examples:\n"
+	"\n"
+	"  " MYNAME " %s -c keys.vbks kernel_subkey.vbpubk *.keyblock\n"
+	"  " MYNAME " sign -s fw.vbprivk -K keys.vbks:1b07 "
+	"-K keys.vbks:93f0 bios.bin\n"
+	"\n";
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog, prog);
+}
+
+static const struct option long_opts[] = {
+	/* name    hasarg *flag  val */
+	{"create",  0, NULL, 'c'},
+	{NULL,      0, NULL, 0},
+};
+
+static int do_keystore(int argc, char *argv[])
+{
+	int opt_create = 0;
+	int errorcnt = 0;
+	int i;
+
+	opterr = 0;		/* quiet, you */
+	while ((i = getopt_long(argc, argv, ":c", long_opts, NULL)) != -1) {
+		switch (i) {
+		case 'c':
+			opt_create = 1;
+			break;
+		case '?':
+			if (optopt)
+				fprintf(stderr, "Unrecognized option: -%c\n",
+					optopt);
+			else
+				fprintf(stderr, "Unrecognized option\n");
+			errorcnt++;
+			break;
+		default:
+			DIE;
+		}
+	}
+
+	if (argc - optind < 1) {
+		fprintf(stderr, "You must name a key store\n");
+		errorcnt++;
+	} else if (!opt_create && argc - optind > 1) {
+		fprintf(stderr, "Use --create to pack files into a store\n");
+		errorcnt++;
+	}
+
+	if (errorcnt) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	if (opt_create)
+		return !!futil_keystore_create(argv[optind],
+					       argc - optind - 1,
+					       argv + optind + 1);
+
+	return !!futil_keystore_list(argv[optind]);
+}
+
+DECLARE_FUTIL_COMMAND(keystore, do_keystore,
+		      VBOOT_VERSION_ALL,
+		      "Create or list a store of public keys and keyblocks",
+		      print_help);
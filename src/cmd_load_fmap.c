@@ -19,6 +19,7 @@
 
 #include "fmap.h"
 #include "futility.h"
+#include "image_scan.h"
 
 
 static const char usage[] = "\n"
@@ -31,6 +32,12 @@ static const char usage[] = "\n"
 	"  -o OUTFILE     Write the result to this file, instead of modifying\n"
 	"                   the input file. This is safer, since there are no\n"
 	"                   safeguards against doing something stupid.\n"
+	"  --changed FILE Write the 4KiB erase blocks of the areas that are\n"
+	"                   different now to FILE (\"-\" for stdout), so only\n"
+	"                   those need flashing. Each run of them is a line\n"
+	"                   \"START:END AREA\", with END inclusive as in\n"
+	"                   dump_fmap -F, and \" erase\" after the AREA if\n"
+	"                   they only need erasing.\n"
 	"\n"
 	"Example:\n"
 	"\n"
@@ -44,58 +51,335 @@ static void help_and_quit(const char *prog)
 	printf(usage, prog, prog);
 }
 
+enum {
+	OPT_CHANGED = 1000,
+};
+
 static const struct option long_opts[] = {
 	/* name    hasarg *flag  val */
+	{"changed",     1, NULL, OPT_CHANGED},
 	{NULL,          0, NULL, 0},
 };
 static char *short_opts = ":o:";
 
 
-static int copy_to_area(char *file, uint8_t *buf, uint32_t len, char *area)
+/* One AREA:file argument */
+struct load_job_s {
+	char *area;
+	char *file;
+	uint32_t offset;
+	uint32_t size;
+	int ifd;
+	int errorcnt;
+	uint8_t *old;			/* what was there, for --changed */
+};
+
+struct load_s {
+	struct load_job_s *job;
+	int count;
+	uint8_t *buf;			/* the input image, mapped privately */
+	int ifd;			/* which is this long */
+	uint64_t len;
+	int ofd;			/* where the result goes */
+	int new_file;			/* ofd isn't the input image */
+	int rest_errorcnt;		/* from copying everything else */
+};
+
+/*
+ * The kernel can usually copy a regular file straight to its place in the
+ * output. For anything else (/dev/zero, pipes, ...) we read it into our
+ * private copy of the image and write it from there.
+ */
+static int copy_to_area(struct load_s *load, struct load_job_s *job)
 {
-	FILE *fp;
+	uint8_t *area = load->buf + job->offset;
+	uint64_t copied, n;
+	ssize_t r;
 	int retval = 0;
-	int n;
 
-	fp = fopen(file, "r");
-	if (!fp) {
-		fprintf(stderr, "area %s: can't open %s for reading: %s\n",
-			area, file, strerror(errno));
-		return 1;
+	copied = futil_copy_range(job->ifd, 0, load->ofd, job->offset,
+				  job->size);
+
+	/* Read whatever that didn't copy */
+	n = copied;
+	if (n && lseek(job->ifd, n, SEEK_SET) != n) {
+		fprintf(stderr, "area %s: can't seek in %s: %s\n",
+			job->area, job->file, strerror(errno));
+		retval = 1;
 	}
 
-	n = fread(buf, 1, len, fp);
-	if (n == 0) {
-		if (feof(fp))
-			fprintf(stderr, "area %s: unexpected EOF on %s\n",
-				area, file);
-		if (ferror(fp))
+	while (!retval && n < job->size) {
+		r = read(job->ifd, area + n, job->size - n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
 			fprintf(stderr, "area %s: can't read from %s: %s\n",
-				area, file, strerror(errno));
+				job->area, job->file, strerror(errno));
+			retval = 1;
+			break;
+		}
+		if (r == 0)
+			break;
+		n += r;
+	}
+
+	if (retval) {
+		/* Already complained */
+	} else if (n == 0) {
+		fprintf(stderr, "area %s: unexpected EOF on %s\n",
+			job->area, job->file);
 		retval = 1;
-	} else if (n < len) {
-		fprintf(stderr, "Warning on area %s: only read %d "
-			"(not %d) from %s\n", area, n, len, file);
+	} else {
+		if (n < job->size)
+			fprintf(stderr, "Warning on area %s: only read %"
+				PRIu64 " (not %d) from %s\n",
+				job->area, n, job->size, job->file);
+
+		/* A new file also needs whatever we didn't replace */
+		if (futil_write_at(load->ofd, area + copied,
+				   (load->new_file ? job->size : n) - copied,
+				   job->offset + copied)) {
+			fprintf(stderr, "area %s: can't write: %s\n",
+				job->area, strerror(errno));
+			retval = 1;
+		}
 	}
 
-	if (0 != fclose(fp)) {
+	if (0 != close(job->ifd)) {
 		fprintf(stderr, "area %s: error closing %s: %s\n",
-			area, file, strerror(errno));
+			job->area, job->file, strerror(errno));
 		retval = 1;
 	}
+	job->ifd = -1;
 
 	return retval;
 }
 
+static int cmp_job_offset(const void *a, const void *b)
+{
+	const struct load_job_s *ja = a, *jb = b;
+
+	if (ja->offset != jb->offset)
+		return ja->offset < jb->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Looks up every AREA:file argument, and opens the files, before anything
+ * is written. Returns the number of errors.
+ */
+static int prepare_jobs(struct load_s *load, FmapIndex *idx, uint64_t len,
+			int argc, char *argv[])
+{
+	struct load_job_s *job;
+	FmapAreaHeader *ah;
+	struct stat sb;
+	int i;
+
+	load->job = calloc(argc, sizeof(*load->job));
+	if (!load->job) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < argc; i++) {
+		char *a = argv[i];
+		char *f = strchr(a, ':');
+
+		if (!f || a == f || *(f+1) == '\0') {
+			fprintf(stderr, "argument \"%s\" is bogus\n", a);
+			return 1;
+		}
+		*f++ = '\0';
+		ah = fmap_index_find(idx, a);
+		if (!ah) {
+			fprintf(stderr, "Can't find area \"%s\" in FMAP\n", a);
+			return 1;
+		}
+		if ((uint64_t)ah->area_offset + ah->area_size > len) {
+			fprintf(stderr, "area %s is beyond the end of the "
+				"image\n", a);
+			return 1;
+		}
+
+		job = &load->job[load->count++];
+		job->area = a;
+		job->file = f;
+		job->offset = ah->area_offset;
+		job->size = ah->area_size;
+		job->ifd = open(f, O_RDONLY);
+		if (job->ifd < 0) {
+			fprintf(stderr,
+				"area %s: can't open %s for reading: %s\n",
+				a, f, strerror(errno));
+			return 1;
+		}
+		if (0 == fstat(job->ifd, &sb) && S_ISREG(sb.st_mode) &&
+		    sb.st_size == 0 && job->size) {
+			fprintf(stderr, "area %s: unexpected EOF on %s\n",
+				a, f);
+			return 1;
+		}
+	}
+
+	/* They'll be written in parallel, so they can't overlap */
+	qsort(load->job, load->count, sizeof(*load->job), cmp_job_offset);
+	for (i = 1; i < load->count; i++) {
+		job = &load->job[i];
+		if (job[-1].offset + job[-1].size > job->offset) {
+			fprintf(stderr, "areas %s and %s overlap\n",
+				job[-1].area, job->area);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Fills in the parts of a new file that aren't being replaced */
+static int copy_the_rest(struct load_s *load, int ifd, uint64_t len)
+{
+	uint64_t start, end, n;
+	int i;
+
+	for (i = 0, start = 0; i <= load->count; i++) {
+		end = i < load->count ? load->job[i].offset : len;
+		if (end > start) {
+			n = futil_copy_range(ifd, start, load->ofd, start,
+					     end - start);
+			if (futil_write_at(load->ofd, load->buf + start + n,
+					   end - start - n, start + n)) {
+				fprintf(stderr, "Can't write output: %s\n",
+					strerror(errno));
+				return 1;
+			}
+		}
+		if (i < load->count)
+			start = load->job[i].offset + load->job[i].size;
+	}
+
+	return 0;
+}
+
+/* Read [buf, buf + len) back from fd at offset. Returns 0 if successful. */
+static int read_in(int fd, uint8_t *buf, uint64_t len, uint64_t offset)
+{
+	uint64_t done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += n) {
+		n = pread(fd, buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* One line of --changed output, if there's a run to report */
+static void changed_run(FILE *fp, const struct load_job_s *job,
+			uint64_t start, uint64_t end, int kind)
+{
+	if (kind < 0 || start == end)
+		return;
+	fprintf(fp, "0x%08" PRIx64 ":0x%08" PRIx64 " %s%s\n", start, end - 1,
+		job->area, kind == IMAGE_FILL_ERASED ? " erase" : "");
+}
+
+/*
+ * Compare each area's erase blocks with what was there before, and list the
+ * runs of them that are different. A block that's now all 0xff only needs
+ * erasing, so those runs are kept apart from the ones to program. Returns
+ * the number of errors.
+ */
+static int write_changed(struct load_s *load, const char *filename)
+{
+	struct load_job_s *job;
+	uint64_t pos, next, end, run;
+	uint8_t *new;
+	FILE *fp;
+	int i, kind, run_kind, errorcnt = 0;
+
+	fp = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+	if (!fp) {
+		fprintf(stderr, "Can't open %s for writing: %s\n",
+			filename, strerror(errno));
+		return 1;
+	}
+
+	for (i = 0; i < load->count; i++) {
+		job = &load->job[i];
+		new = malloc(job->size ? job->size : 1);
+		if (!new) {
+			fprintf(stderr, "Out of memory\n");
+			errorcnt++;
+			break;
+		}
+		if (read_in(load->ofd, new, job->size, job->offset)) {
+			fprintf(stderr, "area %s: can't read it back: %s\n",
+				job->area, strerror(errno));
+			free(new);
+			errorcnt++;
+			break;
+		}
+
+		run_kind = -1;
+		end = (uint64_t)job->offset + job->size;
+		for (pos = run = job->offset; pos < end; pos = next) {
+			next = (pos / IMAGE_ERASE_BLOCK + 1) *
+				IMAGE_ERASE_BLOCK;
+			if (next > end)
+				next = end;
+			if (!memcmp(job->old + pos - job->offset,
+				    new + pos - job->offset, next - pos))
+				kind = -1;
+			else if (image_fill(new + pos - job->offset,
+					    next - pos) == IMAGE_FILL_ERASED)
+				kind = IMAGE_FILL_ERASED;
+			else
+				kind = IMAGE_FILL_DATA;
+			if (kind != run_kind) {
+				changed_run(fp, job, run, pos, run_kind);
+				run = pos;
+				run_kind = kind;
+			}
+		}
+		changed_run(fp, job, run, end, run_kind);
+		free(new);
+	}
+
+	if (fp != stdout ? fclose(fp) : fflush(fp)) {
+		fprintf(stderr, "Error writing %s: %s\n",
+			filename, strerror(errno));
+		errorcnt++;
+	}
+	return errorcnt;
+}
+
+/* What's outside the areas is copied while the areas are loaded */
+static void load_one(void *arg, uint32_t index)
+{
+	struct load_s *load = arg;
+
+	if (load->new_file && !index--) {
+		load->rest_errorcnt = copy_the_rest(load, load->ifd,
+						    load->len);
+		return;
+	}
+	load->job[index].errorcnt = copy_to_area(load, &load->job[index]);
+}
 
 static int do_load_fmap(int argc, char *argv[])
 {
+	struct load_s load;
+	struct stat sb;
 	char *infile = 0;
 	char *outfile = 0;
-	uint8_t *buf;
-	uint32_t len;
-	FmapHeader *fmap;
-	FmapAreaHeader *ah;
+	char *changed_file = 0;
+	uint64_t len;
+	FmapIndex *idx;
 	int errorcnt = 0;
 	int fd, i;
 
@@ -105,6 +389,9 @@ static int do_load_fmap(int argc, char *argv[])
 		case 'o':
 			outfile = optarg;
 			break;
+		case OPT_CHANGED:
+			changed_file = optarg;
+			break;
 		case '?':
 			if (optopt)
 				fprintf(stderr, "Unrecognized option: -%c\n",
@@ -138,63 +425,106 @@ static int do_load_fmap(int argc, char *argv[])
 	infile = argv[optind++];
 
 	/* okay, let's do it ... */
-	if (outfile)
-		futil_copy_file_or_die(infile, outfile);
-	else
-		outfile = infile;
+	if (outfile && futil_same_file(infile, outfile)) {
+		fprintf(stderr, "%s and %s are the same file\n",
+			infile, outfile);
+		return 1;
+	}
 
-	fd = open(outfile, O_RDWR);
+	fd = open(infile, outfile ? O_RDONLY : O_RDWR);
 	if (fd < 0) {
 		fprintf(stderr, "Can't open %s: %s\n",
-			outfile, strerror(errno));
+			infile, strerror(errno));
 		return 1;
 	}
+	if (0 != fstat(fd, &sb)) {
+		fprintf(stderr, "Can't stat %s: %s\n",
+			infile, strerror(errno));
+		errorcnt++;
+		goto done_file;
+	}
+
+	memset(&load, 0, sizeof(load));
+	load.ofd = -1;
 
-	errorcnt |= futil_map_file(fd, MAP_RW, &buf, &len);
+	errorcnt |= futil_map_file(fd, MAP_RO, &load.buf, &len);
 	if (errorcnt)
 		goto done_file;
 
-	fmap = fmap_find(buf, len);
-	if (!fmap) {
+	idx = fmap_index_create(load.buf, len);
+	if (!idx) {
 		fprintf(stderr, "Can't find an FMAP in %s\n", infile);
 		errorcnt++;
 		goto done_map;
 	}
+	errorcnt += prepare_jobs(&load, idx, len, argc - optind,
+				 argv + optind);
+	fmap_index_free(idx);
+	if (errorcnt)
+		goto done_jobs;
 
-	for (i = optind; i < argc; i++) {
-		char *a = argv[i];
-		char *f = strchr(a, ':');
-
-		if (!f || a == f || *(f+1) == '\0') {
-			fprintf(stderr, "argument \"%s\" is bogus\n", a);
+	/* Keep what the areas held, before anything changes it */
+	for (i = 0; changed_file && i < load.count; i++) {
+		load.job[i].old = malloc(load.job[i].size ?
+					 load.job[i].size : 1);
+		if (!load.job[i].old) {
+			fprintf(stderr, "Out of memory\n");
 			errorcnt++;
-			break;
-		}
-		*f++ = '\0';
-		uint8_t *area_buf = fmap_find_by_name(buf, len, fmap, a, &ah);
-		if (!area_buf) {
-			fprintf(stderr, "Can't find area \"%s\" in FMAP\n", a);
-			errorcnt++;
-			break;
+			goto done_jobs;
 		}
+		memcpy(load.job[i].old, load.buf + load.job[i].offset,
+		       load.job[i].size);
+	}
 
-		if (0 != copy_to_area(f, area_buf, ah->area_size, a)) {
+	if (outfile) {
+		/* --changed reads the areas back */
+		load.ofd = open(outfile,
+				(changed_file ? O_RDWR : O_WRONLY) |
+				O_CREAT | O_TRUNC, sb.st_mode & 0777);
+		if (load.ofd < 0) {
+			fprintf(stderr, "Can't open %s for writing: %s\n",
+				outfile, strerror(errno));
 			errorcnt++;
-			break;
+			goto done_jobs;
 		}
+		load.new_file = 1;
+	} else {
+		load.ofd = fd;
 	}
 
-done_map:
-	errorcnt |= futil_unmap_file(fd, 1, buf, len);
+	load.ifd = fd;
+	load.len = len;
+	futil_run_jobs(load_one, NULL, &load, load.count + load.new_file, 0);
 
-done_file:
+	errorcnt += load.rest_errorcnt;
+	for (i = 0; i < load.count; i++)
+		errorcnt += load.job[i].errorcnt;
 
-	if (0 != close(fd)) {
+	if (changed_file && !errorcnt)
+		errorcnt += write_changed(&load, changed_file);
+
+	if (load.new_file && 0 != close(load.ofd)) {
 		fprintf(stderr, "Error closing %s: %s\n",
 			outfile, strerror(errno));
 		errorcnt++;
 	}
 
+done_jobs:
+	for (i = 0; i < load.count; i++) {
+		if (load.job[i].ifd >= 0)
+			close(load.job[i].ifd);
+		free(load.job[i].old);
+	}
+	free(load.job);
+done_map:
+	errorcnt |= futil_unmap_file(fd, MAP_RO, load.buf, len);
+done_file:
+	if (0 != close(fd)) {
+		fprintf(stderr, "Error closing %s: %s\n",
+			infile, strerror(errno));
+		errorcnt++;
+	}
+
 	return !!errorcnt;
 }
 
@@ -5,7 +5,9 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,6 +16,7 @@
 
 static const char usage[] = "\n"
 	"Usage:  " MYNAME " %s [OPTIONS] DIGEST [...]\n"
+	"        " MYNAME " %s [OPTIONS] -f FILE\n"
 	"\n"
 	"This simulates a TPM PCR extension, to determine the expected output\n"
 	"\n"
@@ -25,19 +28,48 @@ static const char usage[] = "\n"
 	"  -i      Initialize the PCR with the first DIGEST argument\n"
 	"            (the default is to start with all zeros)\n"
 	"  -2      Use sha256 DIGESTS (the default is sha1)\n"
+	"  -1      Use sha1 DIGESTS. With -2, simulate both PCR banks, and\n"
+	"            each DIGEST is the sha1 digest followed by the sha256\n"
+	"  -f FILE Read the DIGESTs from FILE (\"-\" for stdin), and only\n"
+	"            display the final value. Whitespace between the hex\n"
+	"            digits is ignored.\n"
+	"  -b      With -f, the FILE holds raw binary digests, not hex\n"
+	"  -v      With -f, display each step as well\n"
 	"\n"
 	"Examples:\n"
 	"\n"
 	"  " MYNAME " %s b52791126f96a21a8ba4d511c6f25a1c1eb6dc9e\n"
 	"  " MYNAME " %s "
 	"'b5 27 91 12 6f 96 a2 1a 8b a4 d5 11 c6 f2 5a 1c 1e b6 dc 9e'\n"
+	"  " MYNAME " %s -1 -2 -f measurements.txt\n"
 	"\n";
 
 static void help_and_quit(const char *prog)
 {
-	printf(usage, prog, prog, prog);
+	printf(usage, prog, prog, prog, prog, prog);
 }
 
+/* The PCR banks we know how to simulate, in the order their digests go */
+static struct pcr_bank_s {
+	const char *name;
+	int alg;
+	int size;
+	uint8_t pcr[SHA256_DIGEST_SIZE];
+} bank[] = {
+	{"sha1", SHA1_DIGEST_ALGORITHM, SHA1_DIGEST_SIZE},
+	{"sha256", SHA256_DIGEST_ALGORITHM, SHA256_DIGEST_SIZE},
+};
+
+/* What to do with each DIGEST */
+struct pcr_state_s {
+	int use[ARRAY_SIZE(bank)];
+	int num_banks;
+	int record_size;		/* all the banks' digests */
+	int opt_init;
+	int verbose;
+	uint64_t count;			/* DIGESTs so far */
+};
+
 static int parse_hex(uint8_t *val, const char *str)
 {
 	uint8_t v = 0;
@@ -96,27 +128,154 @@ static void print_digest(const uint8_t *buf, int len)
 		printf("%02x", buf[i]);
 }
 
+/* With more than one bank, each line says which one it's about */
+static void print_line(const struct pcr_state_s *st,
+		       const struct pcr_bank_s *b, const char *what,
+		       const uint8_t *digest)
+{
+	if (st->num_banks > 1)
+		printf("%-7s", b->name);
+	printf("%s", what);
+	print_digest(digest, b->size);
+	printf("\n");
+}
+
+static void print_pcrs(const struct pcr_state_s *st)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bank); i++)
+		if (st->use[i])
+			print_line(st, &bank[i], "PCR: ", bank[i].pcr);
+}
+
+/* PCR = HASH(PCR || DIGEST) */
+static void extend(struct pcr_bank_s *b, const uint8_t *digest)
+{
+	DigestContext ctx;
+
+	DigestInit(&ctx, b->alg);
+	DigestUpdate(&ctx, b->pcr, b->size);
+	DigestUpdate(&ctx, digest, b->size);
+	DigestFinalInto(&ctx, b->pcr);
+}
+
+/* Handle one DIGEST, which holds a digest for each bank in use */
+static void process_record(struct pcr_state_s *st, const uint8_t *rec)
+{
+	int first = !st->count++;
+	int i;
+
+	if (st->opt_init && first) {
+		for (i = 0; i < ARRAY_SIZE(bank); i++)
+			if (st->use[i]) {
+				memcpy(bank[i].pcr, rec, bank[i].size);
+				rec += bank[i].size;
+			}
+		if (st->verbose)
+			print_pcrs(st);
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bank); i++) {
+		if (!st->use[i])
+			continue;
+		if (st->verbose)
+			print_line(st, &bank[i], "   + ", rec);
+		extend(&bank[i], rec);
+		rec += bank[i].size;
+	}
+	if (st->verbose)
+		print_pcrs(st);
+}
+
+/*
+ * Stream the DIGESTs from a file, a record at a time. In hex, digits may be
+ * split up by any amount of whitespace. Returns 0 if successful.
+ */
+static int process_file(struct pcr_state_s *st, FILE *fp, const char *name,
+			int binary)
+{
+	uint8_t buf[64 * 1024];
+	uint8_t rec[SHA1_DIGEST_SIZE + SHA256_DIGEST_SIZE];
+	uint64_t offset = 0;
+	int have = 0;			/* bytes (or, in hex, nibbles) */
+	size_t n, i;
+	int c;
+
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		for (i = 0; i < n; i++, offset++) {
+			if (binary) {
+				rec[have++] = buf[i];
+				if (have < st->record_size)
+					continue;
+			} else {
+				c = buf[i];
+				if (isspace(c))
+					continue;
+				if (!isxdigit(c)) {
+					fprintf(stderr, "%s: invalid hex digit"
+						" at offset %" PRIu64 "\n",
+						name, offset);
+					return 1;
+				}
+				c = isdigit(c) ? c - '0' :
+					10 + tolower(c) - 'a';
+				if (have & 1)
+					rec[have / 2] |= c;
+				else
+					rec[have / 2] = c << 4;
+				if (++have < 2 * st->record_size)
+					continue;
+			}
+			process_record(st, rec);
+			have = 0;
+		}
+	}
+
+	if (ferror(fp)) {
+		fprintf(stderr, "%s: read error: %s\n", name, strerror(errno));
+		return 1;
+	}
+	if (have) {
+		fprintf(stderr, "%s: partial DIGEST at the end\n", name);
+		return 1;
+	}
+
+	return 0;
+}
 
 static int do_pcr(int argc, char *argv[])
 {
-	uint8_t accum[SHA256_DIGEST_SIZE * 2];
-	uint8_t pcr[SHA256_DIGEST_SIZE];
-	int digest_alg = SHA1_DIGEST_ALGORITHM;
-	int digest_size = SHA1_DIGEST_SIZE;
-	int opt_init = 0;
+	struct pcr_state_s st;
+	uint8_t rec[SHA1_DIGEST_SIZE + SHA256_DIGEST_SIZE];
+	char *opt_file = NULL;
+	int opt_binary = 0;
 	int errorcnt = 0;
-	uint8_t *digest;
+	FILE *fp;
 	int i;
 
+	memset(&st, 0, sizeof(st));
 	opterr = 0;		/* quiet, you */
-	while ((i = getopt(argc, argv, ":i2")) != -1) {
+	while ((i = getopt(argc, argv, ":i12f:bv")) != -1) {
 		switch (i) {
 		case 'i':
-			opt_init = 1;
+			st.opt_init = 1;
+			break;
+		case '1':
+			st.use[0] = 1;
 			break;
 		case '2':
-			digest_alg = SHA256_DIGEST_ALGORITHM;
-			digest_size = SHA256_DIGEST_SIZE;
+			st.use[1] = 1;
+			break;
+		case 'f':
+			opt_file = optarg;
+			break;
+		case 'b':
+			opt_binary = 1;
+			break;
+		case 'v':
+			st.verbose = 1;
 			break;
 		case '?':
 			if (optopt)
@@ -135,47 +294,68 @@ static int do_pcr(int argc, char *argv[])
 		}
 	}
 
+	if (opt_file && argc - optind > 0) {
+		fprintf(stderr, "Give the DIGESTs as args or with -f, "
+			"not both\n");
+		errorcnt++;
+	}
+	if (opt_binary && !opt_file) {
+		fprintf(stderr, "-b only applies to -f\n");
+		errorcnt++;
+	}
+
 	if (errorcnt) {
 		help_and_quit(argv[0]);
 		return 1;
 	}
 
-	if (argc - optind < 1 + opt_init) {
+	if (!opt_file && argc - optind < 1 + st.opt_init) {
 		fprintf(stderr, "You must extend at least one DIGEST\n");
 		help_and_quit(argv[0]);
 		return 1;
 	}
 
-	memset(pcr, 0, sizeof(pcr));
-
-	if (opt_init) {
-		parse_digest_or_die(pcr, digest_size, argv[optind]);
-		optind++;
+	/* The default is sha1 */
+	if (!st.use[0] && !st.use[1])
+		st.use[0] = 1;
+	for (i = 0; i < ARRAY_SIZE(bank); i++) {
+		memset(bank[i].pcr, 0, sizeof(bank[i].pcr));
+		if (st.use[i]) {
+			st.num_banks++;
+			st.record_size += bank[i].size;
+		}
 	}
 
-	printf("PCR: ");
-	print_digest(pcr, digest_size);
-	printf("\n");
-
-	for (i = optind; i < argc; i++) {
-		memcpy(accum, pcr, sizeof(pcr));
-		parse_digest_or_die(accum + digest_size, digest_size, argv[i]);
-
-		printf("   + ");
-		print_digest(accum + digest_size, digest_size);
-		printf("\n");
-
-		digest = DigestBuf(accum, digest_size * 2, digest_alg);
-		if (!digest) {
-			fprintf(stderr, "Error computing digest!\n");
-			return 1;
+	if (opt_file) {
+		if (!strcmp(opt_file, "-")) {
+			fp = stdin;
+		} else {
+			fp = fopen(opt_file, "rb");
+			if (!fp) {
+				fprintf(stderr, "Can't open %s: %s\n",
+					opt_file, strerror(errno));
+				return 1;
+			}
 		}
-		memcpy(pcr, digest, digest_size);
-		free(digest);
+		if (st.verbose && !st.opt_init)
+			print_pcrs(&st);
+		errorcnt = process_file(&st, fp, opt_file, opt_binary);
+		if (fp != stdin)
+			fclose(fp);
+		if (errorcnt)
+			return 1;
+		if (!st.verbose)
+			print_pcrs(&st);
+		return 0;
+	}
 
-		printf("PCR: ");
-		print_digest(pcr, digest_size);
-		printf("\n");
+	/* Show every step */
+	st.verbose = 1;
+	if (!st.opt_init)
+		print_pcrs(&st);
+	for (i = optind; i < argc; i++) {
+		parse_digest_or_die(rec, st.record_size, argv[i]);
+		process_record(&st, rec);
 	}
 
 	return 0;
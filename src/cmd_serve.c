@@ -0,0 +1,400 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "futility.h"
+#include "metrics.h"
+#include "serve.h"
+#include "stats.h"
+
+/* A client gets this many seconds to send its request or take the reply */
+#define SERVE_TIMEOUT	10
+
+/* Only these commands are safe to run over and over in one process */
+static const char * const serve_cmds[] = {
+	"sign",
+	"verify",
+};
+
+static volatile sig_atomic_t time_to_quit;
+static volatile sig_atomic_t time_to_reload;
+
+static void handle_signal(int sig)
+{
+	if (sig == SIGHUP)
+		time_to_reload = 1;
+	else
+		time_to_quit = 1;
+}
+
+static const struct futil_cmd_t *serve_find_command(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(serve_cmds); i++)
+		if (!strcmp(serve_cmds[i], name))
+			return find_command(name);
+	return NULL;
+}
+
+/* Run the command with the client's cwd, stdout and stderr in place */
+static int run_for_client(const struct futil_cmd_t *cmd, int argc,
+			  char *argv[], int *fds)
+{
+	int saved_cwd, saved_out, saved_err;
+	int status;
+
+	fflush(stdout);
+	fflush(stderr);
+	saved_cwd = open(".", O_RDONLY | O_DIRECTORY);
+	saved_out = dup(STDOUT_FILENO);
+	saved_err = dup(STDERR_FILENO);
+	if (saved_cwd < 0 || saved_out < 0 || saved_err < 0) {
+		fprintf(stderr, "Can't save server state: %s\n",
+			strerror(errno));
+		status = 1;
+		goto done;
+	}
+
+	if (fchdir(fds[SERVE_FD_CWD]) ||
+	    dup2(fds[SERVE_FD_STDOUT], STDOUT_FILENO) < 0 ||
+	    dup2(fds[SERVE_FD_STDERR], STDERR_FILENO) < 0) {
+		status = 1;
+	} else {
+		optind = 0;
+		status = run_command(cmd, argc, argv);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	if (fchdir(saved_cwd) ||
+	    dup2(saved_out, STDOUT_FILENO) < 0 ||
+	    dup2(saved_err, STDERR_FILENO) < 0)
+		DIE;
+
+done:
+	if (saved_cwd >= 0)
+		close(saved_cwd);
+	if (saved_out >= 0)
+		close(saved_out);
+	if (saved_err >= 0)
+		close(saved_err);
+	return status;
+}
+
+static void serve_one(int sock)
+{
+	struct serve_request_s req;
+	struct serve_reply_s reply;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct timeval timeout = { SERVE_TIMEOUT, 0 };
+	const struct futil_cmd_t *cmd;
+	char *argv[SERVE_MAX_ARGS + 1];
+	char fdname[SERVE_MAX_FDS][sizeof(FD_PREFIX) + 12];
+	char *payload = NULL;
+	int fds[SERVE_MAX_FDS];
+	int nfds = 0, nfdargs = 0;
+	int argc = 0;
+	enum futil_metric_op op = METRIC_OP_OTHER;
+	int status = 1;
+	uint64_t start;
+	uint32_t i;
+	char *s;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	/* Requests are served one at a time, so don't wait for ever on one */
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(req))
+		return;
+	start = futil_stats_now();
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		for (i = 0; CMSG_LEN((i + 1) * sizeof(int)) <= cmsg->cmsg_len &&
+			     nfds < SERVE_MAX_FDS; i++)
+			memcpy(&fds[nfds++],
+			       CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+	}
+
+	if (req.magic != SERVE_MAGIC || req.argc < 1 ||
+	    req.argc > SERVE_MAX_ARGS || req.size > SERVE_MAX_SIZE ||
+	    (msg.msg_flags & MSG_CTRUNC) || nfds < SERVE_FD_ARGS) {
+		fprintf(stderr, "Bad request\n");
+		goto done;
+	}
+
+	payload = malloc(req.size + 1);
+	if (!payload || serve_read_all(sock, payload, req.size)) {
+		fprintf(stderr, "Short request\n");
+		goto done;
+	}
+	payload[req.size] = '\0';
+
+	/* Split the payload, pointing "/dev/fd/N" args at our copy of N */
+	for (s = payload; s < payload + req.size; s += strlen(s) + 1) {
+		if (argc == req.argc)
+			break;
+		argv[argc] = s;
+		if (serve_is_fd_arg(s)) {
+			if (SERVE_FD_ARGS + nfdargs >= nfds)
+				break;
+			sprintf(fdname[nfdargs], FD_PREFIX "%d",
+				fds[SERVE_FD_ARGS + nfdargs]);
+			argv[argc] = fdname[nfdargs++];
+		}
+		argc++;
+	}
+	argv[argc] = NULL;
+	if (argc != req.argc) {
+		fprintf(stderr, "Malformed request\n");
+		goto done;
+	}
+
+	reply.magic = SERVE_MAGIC;
+	cmd = serve_find_command(argv[0]);
+	if (!cmd) {
+		dprintf(fds[SERVE_FD_STDERR],
+			MYNAME " serve: \"%s\" is not supported\n", argv[0]);
+		reply.status = 1;
+	} else {
+		if (!strcmp(argv[0], "sign"))
+			op = METRIC_OP_SIGN;
+		else if (!strcmp(argv[0], "verify"))
+			op = METRIC_OP_VERIFY;
+		reply.status = run_for_client(cmd, argc, argv, fds);
+	}
+	status = reply.status;
+
+	serve_write_all(sock, &reply, sizeof(reply));
+
+done:
+	futil_metrics_request(op, status, futil_stats_now() - start);
+	free(payload);
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+}
+
+static int serve(const char *path, const char *metrics_file,
+		 const char *metrics_socket)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	mode_t old_umask;
+	int sock, client;
+	int errorcnt = 0;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket name %s is too long\n", path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		fprintf(stderr, "Can't create socket: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* Whoever can connect can use our keys, so keep it to ourselves */
+	old_umask = umask(0077);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(sock, 16)) {
+		fprintf(stderr, "Can't listen on %s: %s\n",
+			path, strerror(errno));
+		umask(old_umask);
+		close(sock);
+		return 1;
+	}
+	umask(old_umask);
+
+	if ((metrics_file || metrics_socket) &&
+	    futil_metrics_start(metrics_file, metrics_socket)) {
+		close(sock);
+		unlink(path);
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	futil_sign_keep_keys();
+
+	while (!time_to_quit) {
+		client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "accept failed: %s\n",
+				strerror(errno));
+			errorcnt++;
+			break;
+		}
+		/* Keys that have changed are read again when next wanted */
+		futil_sign_refresh_keys(time_to_reload);
+		time_to_reload = 0;
+		serve_one(client);
+		close(client);
+		futil_metrics_update();
+	}
+
+	futil_metrics_stop();
+	close(sock);
+	unlink(path);
+	return !!errorcnt;
+}
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [--metrics FILE] [--metrics_socket MSOCKET]"
+	" SOCKET\n"
+	"        " MYNAME " %s --connect SOCKET COMMAND [ARGS...]\n"
+	"\n"
+	"The first form listens on the Unix socket SOCKET and runs the\n"
+	"commands sent to it one at a time, keeping any keys it reads\n"
+	"loaded between requests. A key is read again once its file\n"
+	"changes, and SIGHUP makes it forget them all. A client that\n"
+	"takes more than %d seconds to send its request is dropped. It\n"
+	"exits on SIGINT or SIGTERM.\n"
+	"\n"
+	"Metrics about the requests, the signing keys and the caches are\n"
+	"kept in the Prometheus text format. With --metrics they're\n"
+	"rewritten to FILE after every request (for node_exporter's\n"
+	"textfile collector), and with --metrics_socket they're sent to\n"
+	"whoever connects to the Unix socket MSOCKET, as an HTTP response\n"
+	"if they ask with a GET.\n"
+	"\n"
+	"The second form sends COMMAND to that server and waits for it to\n"
+	"finish. Relative pathnames are resolved in the client's current\n"
+	"directory, and output goes to the client's stdout and stderr.\n"
+	"Arguments of the form " FD_PREFIX "N pass the client's open file\n"
+	"descriptor N to the server.\n"
+	"\n"
+	"Supported commands:\n"
+	"\n";
+
+static void print_help(const char *prog)
+{
+	int i;
+
+	printf(usage, prog, prog, SERVE_TIMEOUT);
+	for (i = 0; i < ARRAY_SIZE(serve_cmds); i++)
+		printf("  %s\n", serve_cmds[i]);
+	printf("\n");
+}
+
+static const struct option long_opts[] = {
+	/* name    hasarg *flag val */
+	{"connect",     1, NULL, 'c'},
+	{"metrics",     1, NULL, 'm'},
+	{"metrics_socket", 1, NULL, 'M'},
+	{NULL,          0, NULL, 0},
+};
+
+static int do_serve(int argc, char *argv[])
+{
+	char *connect_to = NULL;
+	char *metrics_file = NULL, *metrics_socket = NULL;
+	int errorcnt = 0;
+	int i;
+
+	opterr = 0;		/* quiet, you */
+	while ((i = getopt_long(argc, argv, "+:", long_opts, NULL)) != -1) {
+		switch (i) {
+		case 'c':
+			connect_to = optarg;
+			break;
+		case 'm':
+			metrics_file = optarg;
+			break;
+		case 'M':
+			metrics_socket = optarg;
+			break;
+		case '?':
+			if (optopt)
+				fprintf(stderr, "Unrecognized option: -%c\n",
+					optopt);
+			else
+				fprintf(stderr, "Unrecognized option: %s\n",
+					argv[optind - 1]);
+			errorcnt++;
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument to -%c\n", optopt);
+			errorcnt++;
+			break;
+		default:
+			DIE;
+		}
+	}
+
+	if (connect_to) {
+		if (argc - optind < 1) {
+			fprintf(stderr, "ERROR: missing command\n");
+			errorcnt++;
+		}
+		if (metrics_file || metrics_socket) {
+			fprintf(stderr, "ERROR: metrics are the server's\n");
+			errorcnt++;
+		}
+	} else if (argc - optind != 1) {
+		fprintf(stderr, "ERROR: need exactly one socket name\n");
+		errorcnt++;
+	}
+
+	if (errorcnt) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	if (connect_to) {
+		if (futil_serve_request(connect_to, argc - optind,
+					argv + optind, &i))
+			return 1;
+		return i;
+	}
+
+	return serve(argv[optind], metrics_file, metrics_socket);
+}
+
+DECLARE_FUTIL_COMMAND(serve, do_serve,
+		      VBOOT_VERSION_ALL,
+		      "Run sign/verify requests from a long-lived server",
+		      print_help);
@@ -7,11 +7,14 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -22,7 +25,10 @@
 #include "futility.h"
 #include "gbb_header.h"
 #include "host_common.h"
+#include "keystore.h"
 #include "traversal.h"
+#include "host_vb21.h"
+#include "kernel_blob.h"
 #include "util_misc.h"
 #include "vb1_helper.h"
 #include "vboot_common.h"
@@ -40,69 +46,318 @@ static struct local_data_s {
 	uint32_t padding;
 	int strict;
 	int t_flag;
-} option = {
+	int jobs;
+	int json;
+	int headers;
+	int cbfs;
+	char *cache_dir;
+	char *fetch;
+	struct futil_known_keys *known;
+	uint8_t cache_context[SHA256_DIGEST_SIZE];
+	/* Policy, which is checked for all the files before anything else */
+	uint64_t min_key_version;
+	uint64_t min_version;
+	const char *boot_mode;
+	uint64_t boot_flags;
+	int triage;
+} option;
+
+/* The keyblock flags that have to be set to boot in each mode */
+static const struct {
+	const char *name;
+	uint64_t flags;
+} boot_modes[] = {
+	{"normal", KEY_BLOCK_FLAG_DEVELOPER_0 | KEY_BLOCK_FLAG_RECOVERY_0},
+	{"dev",    KEY_BLOCK_FLAG_DEVELOPER_1 | KEY_BLOCK_FLAG_RECOVERY_0},
+	{"rec",    KEY_BLOCK_FLAG_DEVELOPER_0 | KEY_BLOCK_FLAG_RECOVERY_1},
+};
+
+static const struct local_data_s default_option = {
 	.padding = 65536,
+	.jobs = 1,
 };
 
-static void show_key(VbPublicKey *pubkey, const char *sp)
+/* Where the output for the current file goes. With -j it's buffered. */
+static __thread FILE *show_out;
+static __thread FILE *show_err;
+
+/* Human-readable output. This is all suppressed by --json. */
+static void tprintf(const char *format, ...)
+{
+	va_list ap;
+
+	if (option.json)
+		return;
+
+	va_start(ap, format);
+	vfprintf(show_out, format, ap);
+	va_end(ap);
+}
+
+/*
+ * With --json, each component is described by a single JSON object on a line
+ * by itself. The record is built up in memory while the callback does its
+ * checks, then written out in one go when it's done. These do nothing
+ * otherwise.
+ */
+static __thread struct {
+	char *buf;
+	size_t len;
+	size_t size;
+} rec;
+
+static void rec_printf(const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, format);
+		n = vsnprintf(rec.buf + rec.len, rec.size - rec.len, format, ap);
+		va_end(ap);
+		if (n < 0)
+			DIE;
+		if (rec.len + n < rec.size)
+			break;
+		rec.size = 2 * rec.size + n;
+		rec.buf = realloc(rec.buf, rec.size);
+		if (!rec.buf)
+			DIE;
+	}
+	rec.len += n;
+}
+
+static void rec_key(const char *prefix, const char *key)
+{
+	rec_printf("%s\"%s%s\":", rec.buf[rec.len - 1] == '{' ? "" : ",",
+		   prefix, key);
+}
+
+static void rec_str(const char *key, const char *val)
+{
+	const unsigned char *c = (const unsigned char *)val;
+	int n;
+
+	if (!option.json)
+		return;
+
+	rec_key("", key);
+	rec_printf("\"");
+	while (*c) {
+		/* Copy as much as we can, then escape the next one */
+		for (n = 0; c[n] >= 0x20 && c[n] != '"' && c[n] != '\\'; n++)
+			;
+		rec_printf("%.*s", n, c);
+		c += n;
+		if (!*c)
+			break;
+		if (*c < 0x20)
+			rec_printf("\\u%04x", *c);
+		else
+			rec_printf("\\%c", *c);
+		c++;
+	}
+	rec_printf("\"");
+}
+
+static void rec_u64(const char *key, uint64_t val)
+{
+	if (!option.json)
+		return;
+
+	rec_key("", key);
+	rec_printf("%" PRIu64, val);
+}
+
+static void rec_key_info(const char *prefix, VbPublicKey *pubkey)
 {
-	printf("%sAlgorithm:           %" PRIu64 " %s\n", sp, pubkey->algorithm,
-	       (pubkey->algorithm < kNumAlgorithms ?
-		algo_strings[pubkey->algorithm] : "(invalid)"));
-	printf("%sKey Version:         %" PRIu64 "\n", sp, pubkey->key_version);
-	printf("%sKey sha1sum:         ", sp);
-	PrintPubKeySha1Sum(pubkey);
-	printf("\n");
+	char sha1[PUBKEY_SHA1_STRLEN];
+	const char *name;
+
+	if (!option.json)
+		return;
+
+	PubKeySha1String(pubkey, sha1);
+	rec_key(prefix, "algorithm");
+	rec_printf("%" PRIu64, pubkey->algorithm);
+	rec_key(prefix, "version");
+	rec_printf("%" PRIu64, pubkey->key_version);
+	rec_key(prefix, "sha1");
+	rec_printf("\"%s\"", sha1);
+	name = futil_known_key_name(option.known, pubkey);
+	if (name) {
+		char key[64];
+
+		snprintf(key, sizeof(key), "%sname", prefix);
+		rec_str(key, name);
+	}
+}
+
+/* Finishes a "sha1sum:" line, saying which known key it is if we can */
+static void print_sha1(VbPublicKey *pubkey)
+{
+	const char *name = futil_known_key_name(option.known, pubkey);
+
+	FPrintPubKeySha1Sum(show_out, pubkey);
+	if (name)
+		fprintf(show_out, "  (%s)", name);
+	fprintf(show_out, "\n");
+}
+
+static void rec_open(const char *filename, const char *component)
+{
+	if (!option.json)
+		return;
+
+	if (!rec.buf) {
+		rec.size = 1024;
+		rec.buf = malloc(rec.size);
+		if (!rec.buf)
+			DIE;
+	}
+	rec.len = 0;
+	rec_printf("{");
+	rec_str("file", filename);
+	rec_str("component", component);
+}
+
+/* Start the record for the component we're looking at now */
+static void rec_begin(struct futil_traverse_state_s *state,
+		      const char *component)
+{
+	rec_open(state->in_filename, component);
+	rec_str("name", state->name);
+	rec_u64("offset", state->my_area->offset);
+	/* The size of the whole partition, even if that's not all we read */
+	rec_u64("size", state->vblock_only ? state->part_len :
+		state->my_area->len);
+}
+
+static int rec_end(int retval)
+{
+	if (!option.json)
+		return retval;
+
+	rec_printf(",\"ok\":%s}\n", retval ? "false" : "true");
+	fwrite(rec.buf, 1, rec.len, show_out);
+	return retval;
+}
+
+static void rec_free(void)
+{
+	free(rec.buf);
+	memset(&rec, 0, sizeof(rec));
+}
+
+/*
+ * The traversal may run a callback on a thread of its own, with its output
+ * buffered, then hand that output back here, on the thread that started it.
+ */
+void futil_show_thread_begin(FILE *out, FILE *err)
+{
+	show_out = out;
+	show_err = err;
+}
+
+void futil_show_thread_end(void)
+{
+	rec_free();
+	futil_rsa_cache_free();
+	show_out = show_err = NULL;
+}
+
+void futil_show_flush(const char *out, size_t out_len,
+		      const char *err, size_t err_len)
+{
+	fwrite(out, 1, out_len, show_out);
+	fwrite(err, 1, err_len, show_err);
+}
+
+static void show_key(VbPublicKey *pubkey, const char *sp, const char *prefix)
+{
+	tprintf("%sAlgorithm:           %" PRIu64 " %s\n",
+		sp, pubkey->algorithm,
+		(pubkey->algorithm < kNumAlgorithms ?
+		 algo_strings[pubkey->algorithm] : "(invalid)"));
+	tprintf("%sKey Version:         %" PRIu64 "\n",
+		sp, pubkey->key_version);
+	if (!option.json) {
+		fprintf(show_out, "%sKey sha1sum:         ", sp);
+		print_sha1(pubkey);
+	}
+	rec_key_info(prefix, pubkey);
+}
+
+static void show_keyblock_flags(uint64_t flags)
+{
+	tprintf("  Flags:                 %" PRIu64 " ", flags);
+	if (flags & KEY_BLOCK_FLAG_DEVELOPER_0)
+		tprintf(" !DEV");
+	if (flags & KEY_BLOCK_FLAG_DEVELOPER_1)
+		tprintf(" DEV");
+	if (flags & KEY_BLOCK_FLAG_RECOVERY_0)
+		tprintf(" !REC");
+	if (flags & KEY_BLOCK_FLAG_RECOVERY_1)
+		tprintf(" REC");
+	tprintf("\n");
 }
 
 static void show_keyblock(VbKeyBlockHeader *key_block, const char *name,
-			  int sign_key, int good_sig)
+			  VbPublicKey *sign_key, int good_sig)
 {
+	const char *sig = sign_key ? (good_sig ? "valid" : "invalid")
+		: "ignored";
+	const char *signer = good_sig ?
+		futil_known_key_name(option.known, sign_key) : NULL;
+
 	if (name)
-		printf("Key block:               %s\n", name);
+		tprintf("Key block:               %s\n", name);
 	else
-		printf("Key block:\n");
-	printf("  Signature:             %s\n",
-	       sign_key ? (good_sig ? "valid" : "invalid") : "ignored");
-	printf("  Size:                  0x%" PRIx64 "\n",
-	       key_block->key_block_size);
-	printf("  Flags:                 %" PRIu64 " ",
-	       key_block->key_block_flags);
-	if (key_block->key_block_flags & KEY_BLOCK_FLAG_DEVELOPER_0)
-		printf(" !DEV");
-	if (key_block->key_block_flags & KEY_BLOCK_FLAG_DEVELOPER_1)
-		printf(" DEV");
-	if (key_block->key_block_flags & KEY_BLOCK_FLAG_RECOVERY_0)
-		printf(" !REC");
-	if (key_block->key_block_flags & KEY_BLOCK_FLAG_RECOVERY_1)
-		printf(" REC");
-	printf("\n");
+		tprintf("Key block:\n");
+	tprintf("  Signature:             %s\n", sig);
+	if (signer)
+		tprintf("  Signed by:             %s\n", signer);
+	tprintf("  Size:                  0x%" PRIx64 "\n",
+		key_block->key_block_size);
+	show_keyblock_flags(key_block->key_block_flags);
+
+	rec_str("keyblock_signature", sig);
+	if (signer)
+		rec_str("keyblock_signer", signer);
+	rec_u64("keyblock_size", key_block->key_block_size);
+	rec_u64("keyblock_flags", key_block->key_block_flags);
 
 	VbPublicKey *data_key = &key_block->data_key;
-	printf("  Data key algorithm:    %" PRIu64 " %s\n", data_key->algorithm,
-	       (data_key->algorithm < kNumAlgorithms
-		? algo_strings[data_key->algorithm]
-		: "(invalid)"));
-	printf("  Data key version:      %" PRIu64 "\n", data_key->key_version);
-	printf("  Data key sha1sum:      ");
-	PrintPubKeySha1Sum(data_key);
-	printf("\n");
+	tprintf("  Data key algorithm:    %" PRIu64 " %s\n",
+		data_key->algorithm,
+		(data_key->algorithm < kNumAlgorithms
+		 ? algo_strings[data_key->algorithm]
+		 : "(invalid)"));
+	tprintf("  Data key version:      %" PRIu64 "\n",
+		data_key->key_version);
+	if (!option.json) {
+		fprintf(show_out, "  Data key sha1sum:      ");
+		print_sha1(data_key);
+	}
+	rec_key_info("data_key_", data_key);
 }
 
 int futil_cb_show_pubkey(struct futil_traverse_state_s *state)
 {
 	VbPublicKey *pubkey = (VbPublicKey *)state->my_area->buf;
 
+	rec_begin(state, "pubkey");
+
 	if (!PublicKeyLooksOkay(pubkey, state->my_area->len)) {
-		printf("%s looks bogus\n", state->name);
-		return 1;
+		tprintf("%s looks bogus\n", state->name);
+		return rec_end(1);
 	}
 
-	printf("Public Key file:       %s\n", state->in_filename);
-	show_key(pubkey, "  ");
+	tprintf("Public Key file:       %s\n", state->in_filename);
+	show_key(pubkey, "  ", "key_");
 
 	state->my_area->_flags |= AREA_IS_VALID;
-	return 0;
+	return rec_end(0);
 }
 
 int futil_cb_show_privkey(struct futil_traverse_state_s *state)
@@ -110,19 +365,92 @@ int futil_cb_show_privkey(struct futil_traverse_state_s *state)
 	VbPrivateKey key;
 	int alg_okay;
 
+	rec_begin(state, "privkey");
+
 	key.algorithm = *(typeof(key.algorithm) *)state->my_area->buf;
 
-	printf("Private Key file:      %s\n", state->in_filename);
+	tprintf("Private Key file:      %s\n", state->in_filename);
 	alg_okay = key.algorithm < kNumAlgorithms;
-	printf("  Algorithm:           %" PRIu64 " %s\n", key.algorithm,
-	       alg_okay ? algo_strings[key.algorithm] : "(unknown)");
+	tprintf("  Algorithm:           %" PRIu64 " %s\n",
+		key.algorithm,
+		alg_okay ? algo_strings[key.algorithm] : "(unknown)");
+	rec_u64("key_algorithm", key.algorithm);
 
 	if (alg_okay)
 		state->my_area->_flags |= AREA_IS_VALID;
 
+	rec_end(!alg_okay);
 	return 0;
 }
 
+/* The timestamps, oldest first, each with how long it was since the last */
+static void show_timestamps(const VbSharedDataHeader *sh)
+{
+	const VbSharedDataTimestamp *ts;
+	uint64_t prev = 0, delta;
+	uint32_t first = 0;
+	uint32_t i;
+
+	if (sh->timestamp_count > VBSD_MAX_TIMESTAMPS)
+		first = sh->timestamp_count - VBSD_MAX_TIMESTAMPS;
+
+	tprintf("  Timestamps:          %u\n", sh->timestamp_count);
+	if (option.json) {
+		rec_key("", "timestamps");
+		rec_printf("[");
+	}
+	for (i = first; i < sh->timestamp_count; i++) {
+		ts = sh->timestamps + (i & (VBSD_MAX_TIMESTAMPS - 1));
+		delta = prev && ts->time > prev ? ts->time - prev : 0;
+		prev = ts->time;
+		tprintf("    %-18s %3d %3d  %20" PRIu64 "  +%" PRIu64 "\n",
+			VbSharedDataStageName(ts->stage), ts->index, ts->part,
+			ts->time, delta);
+		if (option.json)
+			rec_printf("%s{\"stage\":\"%s\",\"index\":%d,"
+				   "\"part\":%d,\"time\":%" PRIu64
+				   ",\"delta\":%" PRIu64 "}",
+				   i == first ? "" : ",",
+				   VbSharedDataStageName(ts->stage),
+				   ts->index, ts->part, ts->time, delta);
+	}
+	if (option.json)
+		rec_printf("]");
+}
+
+int futil_cb_show_vbsd(struct futil_traverse_state_s *state)
+{
+	VbSharedDataHeader *sh = (VbSharedDataHeader *)state->my_area->buf;
+
+	rec_begin(state, "vbsd");
+
+	/* It's at least a version 1 header or we wouldn't be called. */
+	tprintf("VbSharedData:          %s\n", state->in_filename);
+	tprintf("  Version:             %d\n", sh->struct_version);
+	tprintf("  Flags:               0x%08x\n", sh->flags);
+	tprintf("  Firmware index:      0x%02x\n", sh->firmware_index);
+	tprintf("  LoadKernel() calls:  %d\n", sh->lk_call_count);
+	tprintf("  Timers:              VbInit %" PRIu64 ",%" PRIu64
+		" VbSelectFirmware %" PRIu64 ",%" PRIu64
+		" VbSelectAndLoadKernel %" PRIu64 ",%" PRIu64 "\n",
+		sh->timer_vb_init_enter, sh->timer_vb_init_exit,
+		sh->timer_vb_select_firmware_enter,
+		sh->timer_vb_select_firmware_exit,
+		sh->timer_vb_select_and_load_kernel_enter,
+		sh->timer_vb_select_and_load_kernel_exit);
+	rec_u64("version", sh->struct_version);
+	rec_u64("flags", sh->flags);
+	rec_u64("firmware_index", sh->firmware_index);
+	rec_u64("lk_call_count", sh->lk_call_count);
+
+	if (sh->struct_version >= 3 &&
+	    sh->struct_size >= VB_SHARED_DATA_HEADER_SIZE_V3)
+		show_timestamps(sh);
+
+	state->my_area->_flags |= AREA_IS_VALID;
+	return rec_end(0);
+}
+
 int futil_cb_show_gbb(struct futil_traverse_state_s *state)
 {
 	uint8_t *buf = state->my_area->buf;
@@ -133,43 +461,62 @@ int futil_cb_show_gbb(struct futil_traverse_state_s *state)
 	int retval = 0;
 	uint32_t maxlen = 0;
 
+	rec_begin(state, "gbb");
+
 	if (!len) {
-		printf("GBB header:              %s <invalid>\n",
-		       state->component == CB_GBB ?
-		       state->in_filename : state->name);
-		return 1;
+		tprintf("GBB header:              %s <invalid>\n",
+			state->component == CB_GBB ?
+			state->in_filename : state->name);
+		return rec_end(1);
 	}
 
 	/* It looks like a GBB or we wouldn't be called. */
 	if (!futil_valid_gbb_header(gbb, len, &maxlen))
 		retval = 1;
 
-	printf("GBB header:              %s\n",
-	       state->component == CB_GBB ? state->in_filename : state->name);
-	printf("  Version:               %d.%d\n",
-	       gbb->major_version, gbb->minor_version);
-	printf("  Flags:                 0x%08x\n", gbb->flags);
-	printf("  Regions:                 offset       size\n");
-	printf("    hwid                 0x%08x   0x%08x\n",
-	       gbb->hwid_offset, gbb->hwid_size);
-	printf("    bmpvf                0x%08x   0x%08x\n",
-	       gbb->bmpfv_offset, gbb->bmpfv_size);
-	printf("    rootkey              0x%08x   0x%08x\n",
-	       gbb->rootkey_offset, gbb->rootkey_size);
-	printf("    recovery_key         0x%08x   0x%08x\n",
-	       gbb->recovery_key_offset, gbb->recovery_key_size);
-
-	printf("  Size:                  0x%08x / 0x%08x%s\n",
-	       maxlen, len, maxlen > len ? "  (not enough)" : "");
+	tprintf("GBB header:              %s\n",
+		state->component == CB_GBB ? state->in_filename : state->name);
+	tprintf("  Version:               %d.%d\n",
+		gbb->major_version, gbb->minor_version);
+	tprintf("  Flags:                 0x%08x\n", gbb->flags);
+	tprintf("  Regions:                 offset       size\n");
+	tprintf("    hwid                 0x%08x   0x%08x\n",
+		gbb->hwid_offset, gbb->hwid_size);
+	tprintf("    bmpvf                0x%08x   0x%08x\n",
+		gbb->bmpfv_offset, gbb->bmpfv_size);
+	tprintf("    rootkey              0x%08x   0x%08x\n",
+		gbb->rootkey_offset, gbb->rootkey_size);
+	tprintf("    recovery_key         0x%08x   0x%08x\n",
+		gbb->recovery_key_offset, gbb->recovery_key_size);
+
+	tprintf("  Size:                  0x%08x / 0x%08x%s\n",
+		maxlen, len, maxlen > len ? "  (not enough)" : "");
+
+	rec_u64("major_version", gbb->major_version);
+	rec_u64("minor_version", gbb->minor_version);
+	rec_u64("flags", gbb->flags);
+	rec_u64("hwid_offset", gbb->hwid_offset);
+	rec_u64("hwid_size", gbb->hwid_size);
+	rec_u64("bmpfv_offset", gbb->bmpfv_offset);
+	rec_u64("bmpfv_size", gbb->bmpfv_size);
+	rec_u64("rootkey_offset", gbb->rootkey_offset);
+	rec_u64("rootkey_size", gbb->rootkey_size);
+	rec_u64("recovery_key_offset", gbb->recovery_key_offset);
+	rec_u64("recovery_key_size", gbb->recovery_key_size);
+	rec_u64("needed_size", maxlen);
 
 	if (retval) {
-		printf("GBB header is invalid, ignoring content\n");
-		return 1;
+		tprintf("GBB header is invalid, ignoring content\n");
+		rec_str("error", "invalid GBB header");
+		return rec_end(1);
 	}
 
-	printf("GBB content:\n");
-	printf("  HWID:                  %s\n", buf + gbb->hwid_offset);
-	print_hwid_digest(gbb, "     digest:             ", "\n");
+	tprintf("GBB content:\n");
+	tprintf("  HWID:                  %s\n", buf + gbb->hwid_offset);
+	if (!option.json)
+		print_hwid_digest(show_out, gbb,
+				  "     digest:             ", "\n");
+	rec_str("hwid", (const char *)buf + gbb->hwid_offset);
 
 	pubkey = (VbPublicKey *)(buf + gbb->rootkey_offset);
 	if (PublicKeyLooksOkay(pubkey, gbb->rootkey_size)) {
@@ -178,11 +525,12 @@ int futil_cb_show_gbb(struct futil_traverse_state_s *state)
 		state->rootkey.buf = buf + gbb->rootkey_offset;
 		state->rootkey.len = gbb->rootkey_size;
 		state->rootkey._flags |= AREA_IS_VALID;
-		printf("  Root Key:\n");
-		show_key(pubkey, "    ");
+		tprintf("  Root Key:\n");
+		show_key(pubkey, "    ", "rootkey_");
 	} else {
 		retval = 1;
-		printf("  Root Key:              <invalid>\n");
+		tprintf("  Root Key:              <invalid>\n");
+		rec_str("rootkey", "invalid");
 	}
 
 	pubkey = (VbPublicKey *)(buf + gbb->recovery_key_offset);
@@ -192,34 +540,37 @@ int futil_cb_show_gbb(struct futil_traverse_state_s *state)
 		state->recovery_key.buf = buf + gbb->recovery_key_offset;
 		state->recovery_key.len = gbb->recovery_key_size;
 		state->recovery_key._flags |= AREA_IS_VALID;
-		printf("  Recovery Key:\n");
-		show_key(pubkey, "    ");
+		tprintf("  Recovery Key:\n");
+		show_key(pubkey, "    ", "recovery_key_");
 	} else {
 		retval = 1;
-		printf("  Recovery Key:          <invalid>\n");
+		tprintf("  Recovery Key:          <invalid>\n");
+		rec_str("recovery_key", "invalid");
 	}
 
 	bmp = (BmpBlockHeader *)(buf + gbb->bmpfv_offset);
 	if (0 != memcmp(bmp, BMPBLOCK_SIGNATURE, BMPBLOCK_SIGNATURE_SIZE)) {
-		printf("  BmpBlock:              <invalid>\n");
+		tprintf("  BmpBlock:              <invalid>\n");
 		/* We don't support older BmpBlock formats, so we can't
 		 * be strict about this. */
 	} else {
-		printf("  BmpBlock:\n");
-		printf("    Version:             %d.%d\n",
-		       bmp->major_version, bmp->minor_version);
-		printf("    Localizations:       %d\n",
-		       bmp->number_of_localizations);
-		printf("    Screen layouts:      %d\n",
-		       bmp->number_of_screenlayouts);
-		printf("    Image infos:         %d\n",
-		       bmp->number_of_imageinfos);
+		tprintf("  BmpBlock:\n");
+		tprintf("    Version:             %d.%d\n",
+			bmp->major_version, bmp->minor_version);
+		tprintf("    Localizations:       %d\n",
+			bmp->number_of_localizations);
+		tprintf("    Screen layouts:      %d\n",
+			bmp->number_of_screenlayouts);
+		tprintf("    Image infos:         %d\n",
+			bmp->number_of_imageinfos);
+		rec_u64("bmpblock_major_version", bmp->major_version);
+		rec_u64("bmpblock_minor_version", bmp->minor_version);
 	}
 
 	if (!retval)
 		state->my_area->_flags |= AREA_IS_VALID;
 
-	return retval;
+	return rec_end(retval);
 }
 
 int futil_cb_show_keyblock(struct futil_traverse_state_s *state)
@@ -229,25 +580,28 @@ int futil_cb_show_keyblock(struct futil_traverse_state_s *state)
 	int good_sig = 0;
 	int retval = 0;
 
+	rec_begin(state, "keyblock");
+
 	/* Check the hash only first */
 	if (0 != KeyBlockVerify(block, state->my_area->len, NULL, 1)) {
-		printf("%s is invalid\n", state->name);
-		return 1;
+		tprintf("%s is invalid\n", state->name);
+		rec_str("error", "invalid keyblock");
+		return rec_end(1);
 	}
 
 	/* Check the signature if we have one */
 	if (sign_key && VBOOT_SUCCESS ==
-	    KeyBlockVerify(block, state->my_area->len, sign_key, 0))
+	    futil_keyblock_verify(block, state->my_area->len, sign_key))
 		good_sig = 1;
 
 	if (option.strict && (!sign_key || !good_sig))
 		retval = 1;
 
-	show_keyblock(block, state->in_filename, !!sign_key, good_sig);
+	show_keyblock(block, state->in_filename, sign_key, good_sig);
 
 	state->my_area->_flags |= AREA_IS_VALID;
 
-	return retval;
+	return rec_end(retval);
 }
 
 /*
@@ -259,20 +613,86 @@ int futil_cb_show_keyblock(struct futil_traverse_state_s *state)
  */
 int futil_cb_show_fw_main(struct futil_traverse_state_s *state)
 {
+	rec_begin(state, "fw_main");
+
 	if (!state->my_area->len) {
-		printf("Firmware body:           %s <invalid>\n", state->name);
-		return 1;
+		tprintf("Firmware body:           %s <invalid>\n",
+			state->name);
+		return rec_end(1);
 	}
 
-	printf("Firmware body:           %s\n", state->name);
-	printf("  Offset:                0x%08x\n", state->my_area->offset);
-	printf("  Size:                  0x%08x\n", state->my_area->len);
+	/* Its vblock will want it soon */
+	if (!option.headers)
+		futil_prefetch_area(state, state->component);
+
+	tprintf("Firmware body:           %s\n", state->name);
+	tprintf("  Offset:                0x%08" PRIx64 "\n",
+		state->my_area->offset);
+	tprintf("  Size:                  0x%08" PRIx64 "\n",
+		state->my_area->len);
 
 	state->my_area->_flags |= AREA_IS_VALID;
 
+	/* The files in it get records of their own, after this one */
+	rec_end(0);
+	if (option.cbfs)
+		return futil_traverse_cbfs(state, state->component,
+					   state->name);
 	return 0;
 }
 
+int futil_cb_show_cbfs_file(struct futil_traverse_state_s *state)
+{
+	const CbfsEntry *e = state->cbfs_file;
+	const char *type = cbfs_type_name(e->type);
+	VB_SHA256_CTX ctx;
+	char hex[2 * SHA256_DIGEST_SIZE + 1];
+	uint8_t *digest;
+	int i;
+
+	rec_begin(state, "cbfs_file");
+	rec_str("area", state->cbfs_area);
+	rec_u64("type", e->type);
+
+	tprintf("  CBFS file:             %s\n", state->name);
+	tprintf("    Type:                0x%x%s%s%s\n", e->type,
+		type ? " (" : "", type ? type : "", type ? ")" : "");
+	tprintf("    Offset:              0x%08" PRIx64 "\n",
+		state->my_area->offset);
+	tprintf("    Size:                0x%08" PRIx64 "\n",
+		state->my_area->len);
+	if (type)
+		rec_str("type_name", type);
+
+	if (option.headers)
+		return rec_end(0);
+
+	/* It's hashed where it is, in the image */
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, state->my_area->buf, state->my_area->len);
+	digest = SHA256_final(&ctx);
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+	tprintf("    SHA-256:             %s\n", hex);
+	rec_str("sha256", hex);
+
+	return rec_end(0);
+}
+
+/*
+ * VerifyData(), unless the body was just signed by this process: then only
+ * the signature has to be checked against the digest that went into it.
+ */
+static int verify_body(const uint8_t *data, uint64_t size,
+		       const VbSignature *sig, const RSAPublicKey *rsa)
+{
+	uint8_t digest[SHA512_DIGEST_SIZE];
+
+	if (sig->data_size <= size && futil_signed_digest_take(sig, digest))
+		return VerifyDigest(digest, sig, rsa);
+	return VerifyData(data, size, sig, rsa);
+}
+
 int futil_cb_show_fw_preamble(struct futil_traverse_state_s *state)
 {
 	VbKeyBlockHeader *key_block = (VbKeyBlockHeader *)state->my_area->buf;
@@ -284,10 +704,13 @@ int futil_cb_show_fw_preamble(struct futil_traverse_state_s *state)
 	int good_sig = 0;
 	int retval = 0;
 
+	rec_begin(state, "fw_preamble");
+
 	/* Check the hash... */
 	if (VBOOT_SUCCESS != KeyBlockVerify(key_block, len, NULL, 1)) {
-		printf("%s keyblock component is invalid\n", state->name);
-		return 1;
+		tprintf("%s keyblock component is invalid\n", state->name);
+		rec_str("error", "invalid keyblock");
+		return rec_end(1);
 	}
 
 	switch (state->component) {
@@ -314,21 +737,24 @@ int futil_cb_show_fw_preamble(struct futil_traverse_state_s *state)
 
 	/* If we have a key, check the signature too */
 	if (sign_key && VBOOT_SUCCESS ==
-	    KeyBlockVerify(key_block, len, sign_key, 0))
+	    futil_keyblock_verify(key_block, len, sign_key))
 		good_sig = 1;
 
 	show_keyblock(key_block,
 		      state->component == CB_FW_PREAMBLE
 		      ? state->in_filename : state->name,
-		      !!sign_key, good_sig);
+		      sign_key, good_sig);
 
 	if (option.strict && (!sign_key || !good_sig))
 		retval = 1;
 
-	RSAPublicKey *rsa = PublicKeyToRSA(&key_block->data_key);
+	const RSAPublicKey *rsa = RSAKeyCacheGet(futil_rsa_cache(),
+						 &key_block->data_key);
 	if (!rsa) {
-		fprintf(stderr, "Error parsing data key in %s\n", state->name);
-		return 1;
+		fprintf(show_err, "Error parsing data key in %s\n",
+			state->name);
+		rec_str("error", "invalid data key");
+		return rec_end(1);
 	}
 	uint32_t more = key_block->key_block_size;
 	VbFirmwarePreambleHeader *preamble =
@@ -336,41 +762,57 @@ int futil_cb_show_fw_preamble(struct futil_traverse_state_s *state)
 
 	if (VBOOT_SUCCESS != VerifyFirmwarePreamble(preamble,
 						    len - more, rsa)) {
-		printf("%s is invalid\n", state->name);
-		return 1;
+		tprintf("%s is invalid\n", state->name);
+		rec_str("error", "invalid preamble");
+		return rec_end(1);
 	}
 
 	uint32_t flags = VbGetFirmwarePreambleFlags(preamble);
-	printf("Firmware Preamble:\n");
-	printf("  Size:                  %" PRIu64 "\n",
-	       preamble->preamble_size);
-	printf("  Header version:        %" PRIu32 ".%" PRIu32 "\n",
-	       preamble->header_version_major, preamble->header_version_minor);
-	printf("  Firmware version:      %" PRIu64 "\n",
-	       preamble->firmware_version);
+	tprintf("Firmware Preamble:\n");
+	tprintf("  Size:                  %" PRIu64 "\n",
+		preamble->preamble_size);
+	tprintf("  Header version:        %" PRIu32 ".%" PRIu32 "\n",
+		preamble->header_version_major, preamble->header_version_minor);
+	tprintf("  Firmware version:      %" PRIu64 "\n",
+		preamble->firmware_version);
 	VbPublicKey *kernel_subkey = &preamble->kernel_subkey;
-	printf("  Kernel key algorithm:  %" PRIu64 " %s\n",
-	       kernel_subkey->algorithm,
-	       (kernel_subkey->algorithm < kNumAlgorithms ?
-		algo_strings[kernel_subkey->algorithm] : "(invalid)"));
+	tprintf("  Kernel key algorithm:  %" PRIu64 " %s\n",
+		kernel_subkey->algorithm,
+		(kernel_subkey->algorithm < kNumAlgorithms ?
+		 algo_strings[kernel_subkey->algorithm] : "(invalid)"));
 	if (kernel_subkey->algorithm >= kNumAlgorithms)
 		retval = 1;
-	printf("  Kernel key version:    %" PRIu64 "\n",
-	       kernel_subkey->key_version);
-	printf("  Kernel key sha1sum:    ");
-	PrintPubKeySha1Sum(kernel_subkey);
-	printf("\n");
-	printf("  Firmware body size:    %" PRIu64 "\n",
-	       preamble->body_signature.data_size);
-	printf("  Preamble flags:        %" PRIu32 "\n", flags);
-
+	tprintf("  Kernel key version:    %" PRIu64 "\n",
+		kernel_subkey->key_version);
+	if (!option.json) {
+		fprintf(show_out, "  Kernel key sha1sum:    ");
+		print_sha1(kernel_subkey);
+	}
+	tprintf("  Firmware body size:    %" PRIu64 "\n",
+		preamble->body_signature.data_size);
+	tprintf("  Preamble flags:        %" PRIu32 "\n", flags);
+
+	rec_u64("preamble_size", preamble->preamble_size);
+	rec_u64("header_version_major", preamble->header_version_major);
+	rec_u64("header_version_minor", preamble->header_version_minor);
+	rec_u64("firmware_version", preamble->firmware_version);
+	rec_key_info("kernel_key_", kernel_subkey);
+	rec_u64("body_size", preamble->body_signature.data_size);
+	rec_u64("preamble_flags", flags);
 
 	if (flags & VB_FIRMWARE_PREAMBLE_USE_RO_NORMAL) {
-		printf("Preamble requests USE_RO_NORMAL;"
-		       " skipping body verification.\n");
+		tprintf("Preamble requests USE_RO_NORMAL;"
+			" skipping body verification.\n");
+		rec_str("body", "skipped");
 		goto done;
 	}
 
+	if (option.headers) {
+		tprintf("Body verification skipped.\n");
+		rec_str("body", "skipped");
+		return rec_end(retval);
+	}
+
 	/* We'll need to get the firmware body from somewhere... */
 	if (fw_body_area && (fw_body_area->_flags & AREA_IS_VALID)) {
 		fv_data = fw_body_area->buf;
@@ -378,16 +820,19 @@ int futil_cb_show_fw_preamble(struct futil_traverse_state_s *state)
 	}
 
 	if (!fv_data) {
-		printf("No firmware body available to verify.\n");
+		tprintf("No firmware body available to verify.\n");
+		rec_str("body", "missing");
 		if (option.strict)
-			return 1;
-		return 0;
+			return rec_end(1);
+		return rec_end(0);
 	}
 
-	if (VBOOT_SUCCESS !=
-	    VerifyData(fv_data, fv_size, &preamble->body_signature, rsa)) {
-		fprintf(stderr, "Error verifying firmware body.\n");
-		return 1;
+	futil_advise(fv_data, fv_size, MADV_SEQUENTIAL);
+	if (VBOOT_SUCCESS != verify_body(fv_data, fv_size,
+					 &preamble->body_signature, rsa)) {
+		fprintf(show_err, "Error verifying firmware body.\n");
+		rec_str("body", "invalid");
+		return rec_end(1);
 	}
 
 done:
@@ -395,16 +840,91 @@ done:
 	 * but standalone files are okay. */
 	if ((state->component == CB_FW_PREAMBLE) ||
 	    (sign_key && good_sig)) {
-		if (!(flags & VB_FIRMWARE_PREAMBLE_USE_RO_NORMAL))
-			printf("Body verification succeeded.\n");
+		if (!(flags & VB_FIRMWARE_PREAMBLE_USE_RO_NORMAL)) {
+			tprintf("Body verification succeeded.\n");
+			rec_str("body", "valid");
+		}
 		state->my_area->_flags |= AREA_IS_VALID;
 	} else {
-		printf("Seems legit, but the signature is unverified.\n");
+		tprintf("Seems legit, but the signature is unverified.\n");
+		if (!(flags & VB_FIRMWARE_PREAMBLE_USE_RO_NORMAL))
+			rec_str("body", "unverified");
 		if (option.strict)
 			retval = 1;
 	}
 
-	return retval;
+	return rec_end(retval);
+}
+
+/*
+ * The rest of a kernel partition that futil_traverse_disk() only read the
+ * vblock of. Unless the body is to be verified, only the config is read from
+ * it; if it is, it's mapped, so each partition is hashed on its own thread.
+ */
+static int show_partition_body(struct futil_traverse_state_s *state,
+			       VbKernelPreambleHeader *preamble,
+			       const RSAPublicKey *rsa)
+{
+	uint64_t offset = state->my_area->offset + option.padding;
+	uint64_t config_offset = KernelCmdLineOffset(preamble);
+	uint64_t kernel_size, map_len, skip, n;
+	char config[CROS_CONFIG_SIZE + 1];
+	uint8_t *map, *kernel_blob;
+	int retval = 0;
+
+	if (state->part_len <= option.padding) {
+		fprintf(show_err, "No kernel blob available to verify.\n");
+		rec_str("body", "missing");
+		return 1;
+	}
+	kernel_size = state->part_len - option.padding;
+
+	memset(config, 0, sizeof(config));
+	n = 0;
+	if (config_offset < kernel_size)
+		n = kernel_size - config_offset < CROS_CONFIG_SIZE ?
+			kernel_size - config_offset : CROS_CONFIG_SIZE;
+
+	if (option.headers || (!option.strict && !option.k)) {
+		tprintf("Body verification skipped.\n");
+		rec_str("body", "skipped");
+		if (n && pread(state->fd, config, n,
+			       offset + config_offset) < 0)
+			memset(config, 0, sizeof(config));
+		goto config;
+	}
+
+	skip = offset % sysconf(_SC_PAGESIZE);
+	map_len = skip + kernel_size;
+	map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, state->fd,
+		   offset - skip);
+	if (map == MAP_FAILED) {
+		fprintf(show_err, "Can't map partition %" PRIu32 ": %s\n",
+			state->partition, strerror(errno));
+		rec_str("body", "unreadable");
+		return 1;
+	}
+	kernel_blob = map + skip;
+
+	futil_advise(kernel_blob, kernel_size, MADV_SEQUENTIAL);
+	if (0 != verify_body(kernel_blob, kernel_size,
+			     &preamble->body_signature, rsa)) {
+		fprintf(show_err, "Error verifying kernel body.\n");
+		rec_str("body", "invalid");
+		retval = 1;
+	} else {
+		tprintf("Body verification succeeded.\n");
+		rec_str("body", "valid");
+		memcpy(config, kernel_blob + config_offset, n);
+	}
+	munmap(map, map_len);
+	if (retval)
+		return retval;
+
+config:
+	tprintf("Config:\n%s\n", config);
+	rec_str("config", config);
+	return 0;
 }
 
 int futil_cb_show_kernel_preamble(struct futil_traverse_state_s *state)
@@ -421,27 +941,39 @@ int futil_cb_show_kernel_preamble(struct futil_traverse_state_s *state)
 	uint64_t vmlinuz_header_address = 0;
 	uint32_t flags = 0;
 
+	rec_begin(state, "kernel");
+
 	/* Check the hash... */
 	if (VBOOT_SUCCESS != KeyBlockVerify(key_block, len, NULL, 1)) {
-		printf("%s keyblock component is invalid\n", state->name);
-		return 1;
+		tprintf("%s keyblock component is invalid\n", state->name);
+		rec_str("error", "invalid keyblock");
+		return rec_end(1);
 	}
 
 	/* If we have a key, check the signature too */
 	if (sign_key && VBOOT_SUCCESS ==
-	    KeyBlockVerify(key_block, len, sign_key, 0))
+	    futil_keyblock_verify(key_block, len, sign_key))
 		good_sig = 1;
 
-	printf("Kernel partition:        %s\n", state->in_filename);
-	show_keyblock(key_block, NULL, !!sign_key, good_sig);
+	if (state->component == CB_GPT_KERNEL) {
+		tprintf("Kernel partition:        %s partition %" PRIu32 "\n",
+			state->in_filename, state->partition);
+		rec_u64("partition", state->partition);
+	} else {
+		tprintf("Kernel partition:        %s\n", state->in_filename);
+	}
+	show_keyblock(key_block, NULL, sign_key, good_sig);
 
 	if (option.strict && (!sign_key || !good_sig))
 		retval = 1;
 
-	RSAPublicKey *rsa = PublicKeyToRSA(&key_block->data_key);
+	const RSAPublicKey *rsa = RSAKeyCacheGet(futil_rsa_cache(),
+						 &key_block->data_key);
 	if (!rsa) {
-		fprintf(stderr, "Error parsing data key in %s\n", state->name);
-		return 1;
+		fprintf(show_err, "Error parsing data key in %s\n",
+			state->name);
+		rec_str("error", "invalid data key");
+		return rec_end(1);
 	}
 	uint32_t more = key_block->key_block_size;
 	VbKernelPreambleHeader *preamble =
@@ -449,46 +981,63 @@ int futil_cb_show_kernel_preamble(struct futil_traverse_state_s *state)
 
 	if (VBOOT_SUCCESS != VerifyKernelPreamble(preamble,
 						    len - more, rsa)) {
-		printf("%s is invalid\n", state->name);
-		return 1;
+		tprintf("%s is invalid\n", state->name);
+		rec_str("error", "invalid preamble");
+		return rec_end(1);
 	}
 
-	printf("Kernel Preamble:\n");
-	printf("  Size:                  0x%" PRIx64 "\n",
-	       preamble->preamble_size);
-	printf("  Header version:        %" PRIu32 ".%" PRIu32 "\n",
-	       preamble->header_version_major,
-	       preamble->header_version_minor);
-	printf("  Kernel version:        %" PRIu64 "\n",
-	       preamble->kernel_version);
-	printf("  Body load address:     0x%" PRIx64 "\n",
-	       preamble->body_load_address);
-	printf("  Body size:             0x%" PRIx64 "\n",
-	       preamble->body_signature.data_size);
-	printf("  Bootloader address:    0x%" PRIx64 "\n",
-	       preamble->bootloader_address);
-	printf("  Bootloader size:       0x%" PRIx64 "\n",
-	       preamble->bootloader_size);
+	tprintf("Kernel Preamble:\n");
+	tprintf("  Size:                  0x%" PRIx64 "\n",
+		preamble->preamble_size);
+	tprintf("  Header version:        %" PRIu32 ".%" PRIu32 "\n",
+		preamble->header_version_major,
+		preamble->header_version_minor);
+	tprintf("  Kernel version:        %" PRIu64 "\n",
+		preamble->kernel_version);
+	tprintf("  Body load address:     0x%" PRIx64 "\n",
+		preamble->body_load_address);
+	tprintf("  Body size:             0x%" PRIx64 "\n",
+		preamble->body_signature.data_size);
+	tprintf("  Bootloader address:    0x%" PRIx64 "\n",
+		preamble->bootloader_address);
+	tprintf("  Bootloader size:       0x%" PRIx64 "\n",
+		preamble->bootloader_size);
+
+	rec_u64("preamble_size", preamble->preamble_size);
+	rec_u64("header_version_major", preamble->header_version_major);
+	rec_u64("header_version_minor", preamble->header_version_minor);
+	rec_u64("kernel_version", preamble->kernel_version);
+	rec_u64("body_load_address", preamble->body_load_address);
+	rec_u64("body_size", preamble->body_signature.data_size);
+	rec_u64("bootloader_address", preamble->bootloader_address);
+	rec_u64("bootloader_size", preamble->bootloader_size);
 
 	if (VbGetKernelVmlinuzHeader(preamble,
 				     &vmlinuz_header_address,
 				     &vmlinuz_header_size)
 	    != VBOOT_SUCCESS) {
-		fprintf(stderr, "Unable to retrieve Vmlinuz Header!");
-		return 1;
+		fprintf(show_err, "Unable to retrieve Vmlinuz Header!");
+		rec_str("error", "invalid vmlinuz header");
+		return rec_end(1);
 	}
 	if (vmlinuz_header_size) {
-		printf("  Vmlinuz_header address:    0x%" PRIx64 "\n",
-		       vmlinuz_header_address);
-		printf("  Vmlinuz header size:       0x%" PRIx64 "\n",
-		       vmlinuz_header_size);
+		tprintf("  Vmlinuz_header address:    0x%" PRIx64 "\n",
+			vmlinuz_header_address);
+		tprintf("  Vmlinuz header size:       0x%" PRIx64 "\n",
+			vmlinuz_header_size);
+		rec_u64("vmlinuz_header_address", vmlinuz_header_address);
+		rec_u64("vmlinuz_header_size", vmlinuz_header_size);
 	}
 
 	if (VbKernelHasFlags(preamble) == VBOOT_SUCCESS)
 		flags = preamble->flags;
-	printf("  Flags:                 0x%" PRIx32 "\n", flags);
+	tprintf("  Flags:                 0x%" PRIx32 "\n", flags);
+	rec_u64("preamble_flags", flags);
 
 	/* Verify kernel body */
+	if (state->vblock_only)
+		return rec_end(retval | show_partition_body(state, preamble,
+							    rsa));
 	if (option.fv) {
 		/* It's in a separate file, which we've already read in */
 		kernel_blob = option.fv;
@@ -499,36 +1048,325 @@ int futil_cb_show_kernel_preamble(struct futil_traverse_state_s *state)
 		kernel_size = state->my_area->len - option.padding;
 	}
 
+	if (option.headers) {
+		tprintf("Body verification skipped.\n");
+		rec_str("body", "skipped");
+		if (!kernel_blob)
+			return rec_end(retval);
+		goto config;
+	}
+
 	if (!kernel_blob) {
 		/* TODO: Is this always a failure? The preamble is okay. */
-		fprintf(stderr, "No kernel blob available to verify.\n");
-		return 1;
+		fprintf(show_err, "No kernel blob available to verify.\n");
+		rec_str("body", "missing");
+		return rec_end(1);
+	}
+
+	futil_advise(kernel_blob, kernel_size, MADV_SEQUENTIAL);
+	if (0 != verify_body(kernel_blob, kernel_size,
+			     &preamble->body_signature, rsa)) {
+		fprintf(show_err, "Error verifying kernel body.\n");
+		rec_str("body", "invalid");
+		return rec_end(1);
 	}
 
-	if (0 != VerifyData(kernel_blob, kernel_size,
-			    &preamble->body_signature, rsa)) {
-		fprintf(stderr, "Error verifying kernel body.\n");
+	tprintf("Body verification succeeded.\n");
+	rec_str("body", "valid");
+
+config:
+	tprintf("Config:\n%s\n", kernel_blob + KernelCmdLineOffset(preamble));
+	rec_str("config",
+		(const char *)kernel_blob + KernelCmdLineOffset(preamble));
+
+	return rec_end(retval);
+}
+
+/* vb21 objects name the key that made them by its ID */
+static void show_vb21_id(const char *label, const struct vb2_id *id,
+			 const char *key)
+{
+	char hex[2 * VB2_ID_NUM_BYTES + 1];
+	int i;
+
+	for (i = 0; i < VB2_ID_NUM_BYTES; i++)
+		sprintf(hex + 2 * i, "%02x", id->raw[i]);
+	tprintf("%s%s\n", label, hex);
+	rec_str(key, hex);
+}
+
+static void show_vb21_desc(const char *sp, const void *obj, const char *key)
+{
+	const char *desc = Vb21Desc(obj);
+
+	if (!*desc)
+		return;
+	tprintf("%sDescription:         %s\n", sp, desc);
+	rec_str(key, desc);
+}
+
+/* Shows a packed key the way a VbPublicKey is shown, since it's the same */
+static int show_vb21_key(const struct vb21_packed_key *key, const char *sp,
+			 const char *prefix)
+{
+	VbPublicKey *v1 = Vb21PackedKeyToV1(key);
+	char name[64];
+
+	if (!v1)
 		return 1;
+	snprintf(name, sizeof(name), "%sdesc", prefix);
+	show_vb21_desc(sp, key, name);
+	show_key(v1, sp, prefix);
+	snprintf(name, sizeof(name), "%sid", prefix);
+	tprintf("%sKey ID:              ", sp);
+	show_vb21_id("", &key->id, name);
+	free(v1);
+	return 0;
+}
+
+/*
+ * Checks [block] with [sign_key], if there is one, then shows it. Returns
+ * nonzero if the signature is good.
+ */
+static int show_vb21_keyblock(const struct vb21_keyblock *block,
+			      uint64_t len, const char *name,
+			      VbPublicKey *sign_key)
+{
+	struct vb21_packed_key *packed = NULL;
+	const char *signer = NULL;
+	const char *sig;
+	int good_sig = 0;
+
+	if (sign_key) {
+		packed = Vb21PackedKeyCreate(sign_key, NULL);
+		if (packed && VBOOT_SUCCESS ==
+		    Vb21VerifyKeyblock(block, len, packed))
+			good_sig = 1;
+		free(packed);
 	}
+	sig = sign_key ? (good_sig ? "valid" : "invalid") : "ignored";
+	if (good_sig)
+		signer = futil_known_key_name(option.known, sign_key);
+
+	tprintf("vb21 Key block:          %s\n", name);
+	tprintf("  Signature:             %s\n", sig);
+	if (signer)
+		tprintf("  Signed by:             %s\n", signer);
+	tprintf("  Size:                  0x%" PRIx32 "\n", block->c.total_size);
+	tprintf("  Signatures:            %" PRIu32 "\n", block->sig_count);
+	show_keyblock_flags(block->flags);
+	show_vb21_desc("  ", block, "keyblock_desc");
+
+	rec_str("keyblock_signature", sig);
+	if (signer)
+		rec_str("keyblock_signer", signer);
+	rec_u64("keyblock_size", block->c.total_size);
+	rec_u64("keyblock_flags", block->flags);
+
+	tprintf("  Data key:\n");
+	show_vb21_key(Vb21KeyblockDataKey(block), "    ", "data_key_");
+	return good_sig;
+}
 
-	printf("Body verification succeeded.\n");
+int futil_cb_show_vb21_pubkey(struct futil_traverse_state_s *state)
+{
+	const struct vb21_packed_key *key =
+		Vb21PackedKeyInside(state->my_area->buf, state->my_area->len,
+				    0, NULL);
 
-	printf("Config:\n%s\n", kernel_blob + KernelCmdLineOffset(preamble));
+	rec_begin(state, "vb21_pubkey");
 
-	return retval;
+	tprintf("vb21 Public Key file:    %s\n", state->in_filename);
+	if (!key || show_vb21_key(key, "  ", "key_")) {
+		tprintf("%s looks bogus\n", state->name);
+		return rec_end(1);
+	}
+
+	state->my_area->_flags |= AREA_IS_VALID;
+	return rec_end(0);
+}
+
+int futil_cb_show_vb21_signature(struct futil_traverse_state_s *state)
+{
+	const struct vb21_signature *sig =
+		Vb21SignatureInside(state->my_area->buf, state->my_area->len,
+				    0, NULL);
+	int algorithm;
+
+	rec_begin(state, "vb21_signature");
+
+	if (!sig) {
+		tprintf("%s looks bogus\n", state->name);
+		return rec_end(1);
+	}
+
+	algorithm = Vb21Algorithm(sig->sig_alg, sig->hash_alg);
+	tprintf("vb21 Signature file:     %s\n", state->in_filename);
+	show_vb21_desc("  ", sig, "desc");
+	if (sig->sig_alg == VB2_SIG_NONE)
+		tprintf("  Algorithm:             hash only, %s\n",
+			strchr(algo_strings[algorithm], ' ') + 1);
+	else
+		tprintf("  Algorithm:             %d %s\n", algorithm,
+			algo_strings[algorithm]);
+	tprintf("  Data size:             %" PRIu32 "\n", sig->data_size);
+	tprintf("  Signature size:        %" PRIu32 "\n", sig->sig_size);
+	show_vb21_id("  Key ID:                ", &sig->id, "key_id");
+
+	rec_u64("sig_alg", sig->sig_alg);
+	rec_u64("hash_alg", sig->hash_alg);
+	rec_u64("data_size", sig->data_size);
+
+	state->my_area->_flags |= AREA_IS_VALID;
+	return rec_end(0);
+}
+
+int futil_cb_show_vb21_keyblock(struct futil_traverse_state_s *state)
+{
+	const struct vb21_keyblock *block =
+		(const struct vb21_keyblock *)state->my_area->buf;
+	int good_sig;
+
+	rec_begin(state, "vb21_keyblock");
+
+	if (VBOOT_SUCCESS !=
+	    Vb21VerifyKeyblock(block, state->my_area->len, NULL)) {
+		tprintf("%s is invalid\n", state->name);
+		rec_str("error", "invalid keyblock");
+		return rec_end(1);
+	}
+
+	good_sig = show_vb21_keyblock(block, state->my_area->len,
+				      state->in_filename, option.k);
+
+	state->my_area->_flags |= AREA_IS_VALID;
+	return rec_end(option.strict && !good_sig);
+}
+
+/*
+ * The body is checked against each of the preamble's hashes in turn, a
+ * piece at a time, the way firmware would check it as it streams in.
+ */
+static int verify_vb21_body(const struct vb21_fw_preamble *preamble,
+			    const uint8_t *fv_data, uint64_t fv_size)
+{
+	const struct vb21_signature *hash;
+	uint64_t offset;
+	uint32_t i;
+
+	for (i = 0; i < preamble->hash_count; i++) {
+		hash = Vb21FwPreambleHash(preamble, i, &offset);
+		if (offset > fv_size ||
+		    Vb21VerifyData(fv_data + offset, fv_size - offset,
+				   hash, NULL)) {
+			fprintf(show_err, "Error verifying firmware body"
+				" at 0x%" PRIx64 ".\n", offset);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int futil_cb_show_vb21_fw_preamble(struct futil_traverse_state_s *state)
+{
+	const struct vb21_keyblock *block =
+		(const struct vb21_keyblock *)state->my_area->buf;
+	const struct vb21_fw_preamble *preamble;
+	const struct vb21_signature *hash;
+	uint64_t len = state->my_area->len;
+	RSAPublicKey *rsa;
+	uint32_t more;
+	int retval = 0;
+
+	rec_begin(state, "vb21_fw_preamble");
+
+	if (VBOOT_SUCCESS != Vb21VerifyKeyblock(block, len, NULL)) {
+		tprintf("%s keyblock component is invalid\n", state->name);
+		rec_str("error", "invalid keyblock");
+		return rec_end(1);
+	}
+
+	if (!show_vb21_keyblock(block, len, state->in_filename, option.k) &&
+	    option.strict)
+		retval = 1;
+
+	rsa = Vb21PackedKeyToRSA(Vb21KeyblockDataKey(block));
+	if (!rsa) {
+		fprintf(show_err, "Error parsing data key in %s\n",
+			state->name);
+		rec_str("error", "invalid data key");
+		return rec_end(1);
+	}
+	more = block->c.total_size;
+	preamble = (const struct vb21_fw_preamble *)(state->my_area->buf +
+						     more);
+	if (VBOOT_SUCCESS != Vb21VerifyFwPreamble(preamble, len - more, rsa)) {
+		RSAPublicKeyFree(rsa);
+		tprintf("%s is invalid\n", state->name);
+		rec_str("error", "invalid preamble");
+		return rec_end(1);
+	}
+	RSAPublicKeyFree(rsa);
+
+	hash = Vb21FwPreambleHash(preamble, 0, NULL);
+	tprintf("vb21 Firmware Preamble:\n");
+	tprintf("  Size:                  %" PRIu32 "\n",
+		preamble->c.total_size);
+	tprintf("  Header version:        %" PRIu32 ".%" PRIu32 "\n",
+		preamble->c.struct_version_major,
+		preamble->c.struct_version_minor);
+	tprintf("  Firmware version:      %" PRIu32 "\n", preamble->fw_version);
+	show_vb21_desc("  ", preamble, "preamble_desc");
+	tprintf("  Firmware body size:    %" PRIu64 "\n",
+		Vb21FwPreambleBodySize(preamble));
+	tprintf("  Body hashes:           %" PRIu32 "\n", preamble->hash_count);
+	if (hash)
+		tprintf("  Body hash size:        %" PRIu32 "\n",
+			hash->data_size);
+	tprintf("  Preamble flags:        %" PRIu32 "\n", preamble->flags);
+
+	rec_u64("preamble_size", preamble->c.total_size);
+	rec_u64("firmware_version", preamble->fw_version);
+	rec_u64("body_size", Vb21FwPreambleBodySize(preamble));
+	rec_u64("body_hashes", preamble->hash_count);
+	rec_u64("preamble_flags", preamble->flags);
+
+	if (option.headers) {
+		tprintf("Body verification skipped.\n");
+		rec_str("body", "skipped");
+		return rec_end(retval);
+	}
+
+	if (!option.fv) {
+		tprintf("No firmware body available to verify.\n");
+		rec_str("body", "missing");
+		return rec_end(option.strict || retval);
+	}
+
+	futil_advise(option.fv, option.fv_size, MADV_SEQUENTIAL);
+	if (verify_vb21_body(preamble, option.fv, option.fv_size)) {
+		rec_str("body", "invalid");
+		return rec_end(1);
+	}
+
+	tprintf("Body verification succeeded.\n");
+	rec_str("body", "valid");
+	state->my_area->_flags |= AREA_IS_VALID;
+	return rec_end(retval);
 }
 
 int futil_cb_show_begin(struct futil_traverse_state_s *state)
 {
 	switch (state->in_type) {
 	case FILE_TYPE_UNKNOWN:
-		fprintf(stderr, "Unable to determine type of %s\n",
+		fprintf(show_err, "Unable to determine type of %s\n",
 			state->in_filename);
 		return 1;
 
 	case FILE_TYPE_BIOS_IMAGE:
 	case FILE_TYPE_OLD_BIOS_IMAGE:
-		printf("BIOS:                    %s\n", state->in_filename);
+		tprintf("BIOS:                    %s\n", state->in_filename);
 		break;
 
 	default:
@@ -537,8 +1375,152 @@ int futil_cb_show_begin(struct futil_traverse_state_s *state)
 	return 0;
 }
 
+/*
+ * Triage: the checks that are cheap enough to make on every file before the
+ * costly ones (signatures, body hashes) are made on any of them, so files that
+ * can't pass aren't worth verifying. They print nothing. The first reason to
+ * reject the file goes in the buffer the state's cb_data points to.
+ */
+#define TRIAGE_WHY_SIZE 128
+
+static int reject(struct futil_traverse_state_s *state,
+		  const char *format, ...)
+{
+	char *why = state->cb_data;
+	va_list ap;
+	int n = 0;
+
+	if (why[0])
+		return 1;
+
+	if (state->component == CB_GPT_KERNEL)
+		n = snprintf(why, TRIAGE_WHY_SIZE, "partition %" PRIu32 ": ",
+			     state->partition);
+	else if (state->component == CB_FMAP_VBLOCK_A ||
+		 state->component == CB_FMAP_VBLOCK_B)
+		n = snprintf(why, TRIAGE_WHY_SIZE, "%s: ", state->name);
+
+	va_start(ap, format);
+	vsnprintf(why + n, TRIAGE_WHY_SIZE - n, format, ap);
+	va_end(ap);
+	return 1;
+}
+
+static int triage_keyblock(struct futil_traverse_state_s *state,
+			   VbKeyBlockHeader *key_block, uint64_t len)
+{
+	/* Only a hash, and a small one */
+	if (VBOOT_SUCCESS != KeyBlockVerify(key_block, len, NULL, 1))
+		return reject(state, "invalid keyblock");
+
+	if ((key_block->key_block_flags & option.boot_flags) !=
+	    option.boot_flags)
+		return reject(state, "keyblock flags %" PRIu64
+			      " don't allow %s mode",
+			      key_block->key_block_flags, option.boot_mode);
+
+	if (key_block->data_key.key_version < option.min_key_version)
+		return reject(state, "data key version %" PRIu64
+			      " is below %" PRIu64,
+			      key_block->data_key.key_version,
+			      option.min_key_version);
+
+	return 0;
+}
+
+int futil_cb_triage_keyblock(struct futil_traverse_state_s *state)
+{
+	return triage_keyblock(state, (VbKeyBlockHeader *)state->my_area->buf,
+			       state->my_area->len);
+}
+
+int futil_cb_triage_fw_preamble(struct futil_traverse_state_s *state)
+{
+	VbKeyBlockHeader *key_block = (VbKeyBlockHeader *)state->my_area->buf;
+	uint64_t len = state->my_area->len;
+	uint64_t body_size = option.fv_size;
+	VbFirmwarePreambleHeader *preamble;
+	uint64_t more;
+
+	if (triage_keyblock(state, key_block, len))
+		return 1;
+
+	more = key_block->key_block_size;
+	preamble = (VbFirmwarePreambleHeader *)(state->my_area->buf + more);
+	if (!FirmwarePreambleLooksOkay(preamble, len - more))
+		return reject(state, "invalid preamble");
+
+	if (preamble->firmware_version < option.min_version)
+		return reject(state, "firmware version %" PRIu64
+			      " is below %" PRIu64,
+			      preamble->firmware_version, option.min_version);
+
+	if (option.headers || (VbGetFirmwarePreambleFlags(preamble) &
+			       VB_FIRMWARE_PREAMBLE_USE_RO_NORMAL))
+		return 0;
+
+	/* In a BIOS image, every area is known before the callbacks run */
+	if (state->component == CB_FMAP_VBLOCK_A)
+		body_size = state->cb_area[CB_FMAP_FW_MAIN_A].len;
+	else if (state->component == CB_FMAP_VBLOCK_B)
+		body_size = state->cb_area[CB_FMAP_FW_MAIN_B].len;
+
+	if (body_size && preamble->body_signature.data_size > body_size)
+		return reject(state, "body signature covers 0x%" PRIx64
+			      " bytes, but the body is 0x%" PRIx64,
+			      preamble->body_signature.data_size, body_size);
+
+	return 0;
+}
+
+int futil_cb_triage_kernel_preamble(struct futil_traverse_state_s *state)
+{
+	VbKeyBlockHeader *key_block = (VbKeyBlockHeader *)state->my_area->buf;
+	uint64_t len = state->my_area->len;
+	VbKernelPreambleHeader *preamble;
+	uint64_t body_size = 0;
+	uint64_t more;
+
+	if (triage_keyblock(state, key_block, len))
+		return 1;
+
+	more = key_block->key_block_size;
+	preamble = (VbKernelPreambleHeader *)(state->my_area->buf + more);
+	if (!KernelPreambleLooksOkay(preamble, len - more))
+		return reject(state, "invalid preamble");
+
+	if (preamble->kernel_version < option.min_version)
+		return reject(state, "kernel version %" PRIu64
+			      " is below %" PRIu64,
+			      preamble->kernel_version, option.min_version);
+
+	if (option.headers)
+		return 0;
+
+	/* The same body futil_cb_show_kernel_preamble() would verify */
+	if (option.fv)
+		body_size = option.fv_size;
+	else if (len > option.padding)
+		body_size = len - option.padding;
+
+	if (!body_size)
+		return reject(state, "no kernel body");
+	if (preamble->body_signature.data_size > body_size)
+		return reject(state, "body signature covers 0x%" PRIx64
+			      " bytes, but the body is 0x%" PRIx64,
+			      preamble->body_signature.data_size, body_size);
+
+	return 0;
+}
+
 enum no_short_opts {
 	OPT_PADDING = 1000,
+	OPT_CACHE,
+	OPT_FETCH,
+	OPT_KNOWN_KEYS,
+	OPT_MIN_KEY_VERSION,
+	OPT_MIN_VERSION,
+	OPT_BOOT_MODE,
 };
 
 static const char usage[] = "\n"
@@ -551,13 +1533,45 @@ static const char usage[] = "\n"
 	"  firmware preamble signature (VBLOCK_A/B)\n"
 	"  firmware image (bios.bin)\n"
 	"  kernel partition (/dev/sda2, /dev/mmcblk0p2)\n"
+	"  Chrome OS disk image (/dev/sda, chromiumos_image.bin)\n"
+	"\n"
+	"A FILE of \"-\" (or any pipe) is read to the end first.\n"
+	"Only the GPT of a disk image and the headers of its kernel\n"
+	"partitions are read, unless -k or --verify is given; then all the\n"
+	"kernel bodies are verified at once.\n"
 	"\n"
 	"Options:\n"
 	"  -t                               Just show the type of each file\n"
 	"  -k|--publickey   FILE"
 	"            Use this public key for validation\n"
+	"  -K|--storedkey   STORE:ID        Use this key from a key store\n"
+	"                                   (also accepted by -k)\n"
 	"  -f|--fv          FILE            Verify this payload (FW_MAIN_A/B)\n"
 	"  --pad            NUM             Kernel vblock padding size\n"
+	"  -j               NUM             Process NUM files at once\n"
+	"  --json                           Print one JSON object per line for\n"
+	"                                   each component, instead of text\n"
+	"  --cbfs                           Also list the CBFS files in\n"
+	"                                   FW_MAIN_A/B, with their SHA-256\n"
+	"  --cache          DIR             Remember the results in DIR, and\n"
+	"                                   reuse them for unchanged files\n"
+	"  --fetch          PROG            Each FILE is an object that PROG\n"
+	"                                   fetches, only the parts that are\n"
+	"                                   needed: \"PROG FILE\" prints its\n"
+	"                                   size, \"PROG FILE OFFSET LENGTH\"\n"
+	"                                   writes those bytes to stdout\n"
+	"  --known-keys     STORE|DIR       Name the keys that are in this key\n"
+	"                                   store or directory of key files,\n"
+	"                                   and what signed each keyblock\n"
+	"  --min-key-version NUM            Reject keyblocks whose data key\n"
+	"                                   version is below NUM\n"
+	"  --min-version    NUM             Reject firmware and kernels whose\n"
+	"                                   version is below NUM\n"
+	"  --boot-mode      MODE            Reject keyblocks that can't be used\n"
+	"                                   in MODE (normal, dev or rec)\n"
+	"\n"
+	"The --min-* and --boot-mode checks are made on every FILE before any\n"
+	"signatures are checked, and only the files that pass are verified.\n"
 	"%s"
 	"\n";
 
@@ -567,7 +1581,9 @@ static void print_help(const char *prog)
 		printf(usage, prog,
 		       "  public key (.vbpubk)\n",
 		       "  --strict                         "
-		       "Fail unless all signatures are valid\n");
+		       "Fail unless all signatures are valid\n"
+		       "  --headers                        "
+		       "Only read the headers; don't verify bodies\n");
 	else
 		printf(usage, prog, "",
 		       "\nIt will fail unless all signatures are valid\n");
@@ -576,51 +1592,531 @@ static void print_help(const char *prog)
 static const struct option long_opts[] = {
 	/* name    hasarg *flag val */
 	{"publickey",   1, 0, 'k'},
+	{"storedkey",   1, 0, 'K'},
 	{"fv",          1, 0, 'f'},
 	{"pad",         1, NULL, OPT_PADDING},
+	{"cache",       1, NULL, OPT_CACHE},
+	{"fetch",       1, NULL, OPT_FETCH},
+	{"known-keys",  1, NULL, OPT_KNOWN_KEYS},
+	{"min-key-version", 1, NULL, OPT_MIN_KEY_VERSION},
+	{"min-version", 1, NULL, OPT_MIN_VERSION},
+	{"boot-mode",   1, NULL, OPT_BOOT_MODE},
 	{"verify",      0, &option.strict, 1},
+	{"json",        0, &option.json, 1},
+	{"headers",     0, &option.headers, 1},
+	{"cbfs",        0, &option.cbfs, 1},
 	{"debug",       0, &debugging_enabled, 1},
 	{NULL, 0, NULL, 0},
 };
-static char *short_opts = ":f:k:t";
+static char *short_opts = ":f:j:k:K:t";
 
 
-static void show_type(char *filename)
+static void show_type(const char *filename)
 {
 	enum futil_file_err err;
 	enum futil_file_type type;
+	const char *str;
+
 	err = futil_file_type(filename, &type);
 	switch (err) {
 	case FILE_ERR_NONE:
-		printf("%s:\t%s\n", filename, futil_file_type_str(type));
+		str = futil_file_type_str(type);
 		break;
 	case FILE_ERR_DIR:
-		printf("%s:\t%s\n", filename, "directory");
+		str = "directory";
 		break;
 	case FILE_ERR_CHR:
-		printf("%s:\t%s\n", filename, "character special");
-		break;
-	case FILE_ERR_FIFO:
-		printf("%s:\t%s\n", filename, "FIFO");
-		break;
-	case FILE_ERR_SOCK:
-		printf("%s:\t%s\n", filename, "socket");
+		str = "character special";
 		break;
 	default:
-		break;
+		return;
 	}
+
+	tprintf("%s:\t%s\n", filename, str);
+	rec_open(filename, "file");
+	rec_str("type", str);
+	rec_end(0);
 }
 
-static int do_show(int argc, char *argv[])
+/*
+ * Everything that can change what we'd say about a file, besides the file
+ * itself, so that cached results are only reused under the same conditions.
+ */
+static void set_cache_context(void)
 {
-	char *infile = 0;
-	int ifd, i;
+	VB_SHA256_CTX ctx;
+	uint32_t n;
+
+	SHA256_init(&ctx);
+	n = vboot_version;
+	SHA256_update(&ctx, (uint8_t *)&n, sizeof(n));
+	SHA256_update(&ctx, (uint8_t *)&option.padding,
+		      sizeof(option.padding));
+	n = (!!option.strict << 0) | (!!option.json << 1) |
+		(!!option.headers << 2) | (!!option.k << 3) |
+		(!!option.fv << 4) | (!!option.cbfs << 5);
+	SHA256_update(&ctx, (uint8_t *)&n, sizeof(n));
+	if (option.k) {
+		SHA256_update(&ctx, (uint8_t *)&option.k->algorithm,
+			      sizeof(option.k->algorithm));
+		SHA256_update(&ctx, (uint8_t *)&option.k->key_version,
+			      sizeof(option.k->key_version));
+		SHA256_update(&ctx, GetPublicKeyData(option.k),
+			      option.k->key_size);
+	}
+	if (option.fv)
+		SHA256_update(&ctx, option.fv, option.fv_size);
+	memcpy(option.cache_context, SHA256_final(&ctx),
+	       sizeof(option.cache_context));
+}
+
+/*
+ * Describe one mapped file, or repeat what we said about it last time. If it
+ * gets looked at, and [found] is given, that's filled in with what we saw.
+ */
+static int show_buf(const char *infile, uint8_t *buf, uint64_t buf_len,
+		    enum futil_file_type type,
+		    struct futil_file_meta_s *found)
+{
+	struct futil_traverse_state_s state;
+	struct futil_verify_result_s result;
+	FILE *out = show_out, *err = show_err;
+	int errorcnt;
+
+	if (option.cache_dir) {
+		if (futil_verify_cache_lookup(option.cache_dir, infile,
+					      buf, buf_len,
+					      option.cache_context,
+					      &result)) {
+			fwrite(result.out, 1, result.out_len, show_out);
+			fwrite(result.err, 1, result.err_len, show_err);
+			errorcnt = result.errorcnt;
+			futil_verify_result_free(&result);
+			return errorcnt;
+		}
+
+		/* Keep a copy of everything we say */
+		show_out = open_memstream(&result.out, &result.out_len);
+		show_err = open_memstream(&result.err, &result.err_len);
+		if (!show_out || !show_err)
+			DIE;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.in_filename = infile;
+	state.op = FUTIL_OP_SHOW;
+
+	/* Only the pages we look at should be read in */
+	if (option.headers)
+		madvise(buf, buf_len, MADV_RANDOM);
+
+	errorcnt = futil_traverse(buf, buf_len, &state, type);
+	if (found) {
+		found->type = state.in_type;
+		found->fmap_offset = futil_fmap_offset(buf);
+	}
+
+	/* The last record sums up the whole file */
+	rec_open(infile, "file");
+	rec_str("type", futil_file_type_str(state.in_type));
+	rec_u64("size", buf_len);
+	errorcnt = rec_end(errorcnt);
+
+	if (option.cache_dir) {
+		fclose(show_out);
+		fclose(show_err);
+		show_out = out;
+		show_err = err;
+		fwrite(result.out, 1, result.out_len, show_out);
+		fwrite(result.err, 1, result.err_len, show_err);
+		result.errorcnt = errorcnt;
+		futil_verify_cache_store(option.cache_dir, infile,
+					 buf, buf_len, option.cache_context,
+					 &result);
+		futil_verify_result_free(&result);
+	}
+
+	return errorcnt;
+}
+
+/*
+ * Whether [ifd] is a disk image that can be read a piece at a time, and if
+ * so how big it is. What we found last time, if [meta] says, saves looking.
+ * A pipe, or a compressed image, has to be read in whole instead.
+ */
+static int is_disk(int ifd, const struct futil_file_meta_s *meta,
+		   uint64_t *len)
+{
+	uint8_t head[2 * DISK_SECTOR_SIZE];
+	struct stat sb;
+
+	if (meta && meta->type != FILE_TYPE_CHROMIUMOS_DISK)
+		return 0;
+	if (futil_fstat(ifd, &sb) ||
+	    !(S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode)))
+		return 0;
+	if (pread(ifd, head, sizeof(head), 0) != sizeof(head) ||
+	    FILE_TYPE_CHROMIUMOS_DISK != recognize_gpt(head, sizeof(head)))
+		return 0;
+	*len = sb.st_size;
+	return 1;
+}
+
+/* A disk image, which is only read as far as it needs to be */
+static int show_disk(const char *infile, int ifd, uint64_t len)
+{
+	struct futil_traverse_state_s state;
+	int errorcnt;
+
+	memset(&state, 0, sizeof(state));
+	state.in_filename = infile;
+	state.op = FUTIL_OP_SHOW;
+	errorcnt = futil_traverse_disk(ifd, len, &state);
+
+	rec_open(infile, "file");
+	rec_str("type", futil_file_type_str(state.in_type));
+	rec_u64("size", len);
+	return rec_end(errorcnt);
+}
+
+/* One that's too big to map, a window at a time */
+static int show_window(const char *infile, int ifd)
+{
+	struct futil_traverse_state_s state;
+	struct futil_window_s win;
+	int errorcnt;
+
+	memset(&state, 0, sizeof(state));
+	state.in_filename = infile;
+	state.op = FUTIL_OP_SHOW;
+
+	if (futil_window_open(&win, ifd)) {
+		rec_open(infile, "file");
+		rec_str("type", futil_file_type_str(FILE_TYPE_UNKNOWN));
+		return rec_end(1);
+	}
+	errorcnt = futil_traverse_window(&win, &state);
+	futil_window_close(&win);
+
+	rec_open(infile, "file");
+	rec_str("type", futil_file_type_str(state.in_type));
+	rec_u64("size", win.len);
+	return rec_end(errorcnt);
+}
+
+static int show_file(const char *infile)
+{
+	struct futil_file_meta_s meta, found;
+	struct stat sb;
+	uint8_t *buf;
+	uint64_t buf_len = 0, disk_len;
+	int decompressed;
 	int errorcnt = 0;
+	int have_meta;
+	int ifd;
+
+	ifd = futil_open_input(infile);
+	if (ifd < 0) {
+		rec_open(infile, "file");
+		rec_str("error", strerror(errno));
+		fprintf(show_err, "Can't open %s: %s\n",
+			infile, strerror(errno));
+		return rec_end(1);
+	}
+
+	/* What we found last time saves looking for it again */
+	if (fstat(ifd, &sb))
+		memset(&sb, 0, sizeof(sb));
+	have_meta = !futil_meta_load(ifd, &sb, &meta);
+	found.type = NUM_FILE_TYPES;
+
+	if (is_disk(ifd, have_meta ? &meta : NULL, &disk_len)) {
+		errorcnt += show_disk(infile, ifd, disk_len);
+	} else if (futil_window_wanted(ifd)) {
+		errorcnt += show_window(infile, ifd);
+	} else if (0 != futil_map_input(ifd, &buf, &buf_len, &decompressed)) {
+		errorcnt++;
+		rec_open(infile, "file");
+		rec_str("type", futil_file_type_str(FILE_TYPE_UNKNOWN));
+		rec_u64("size", buf_len);
+		errorcnt = rec_end(errorcnt);
+	} else {
+		if (have_meta)
+			futil_fmap_hint(buf, meta.fmap_offset);
+		errorcnt += show_buf(infile, buf, buf_len,
+				     have_meta ? meta.type : FILE_TYPE_UNKNOWN,
+				     &found);
+		if (!have_meta && found.type < NUM_FILE_TYPES)
+			futil_meta_save(ifd, &sb, &found);
+		errorcnt += futil_unmap_input(ifd, buf, buf_len,
+					      decompressed, 0);
+	}
+
+	if (close(ifd)) {
+		errorcnt++;
+		fprintf(show_err, "Error when closing %s: %s\n",
+			infile, strerror(errno));
+	}
+
+	return errorcnt;
+}
+
+/* An object that only the --fetch program can get at */
+static int show_remote(const char *infile)
+{
+	uint8_t *buf;
+	uint64_t buf_len = 0;
+	int errorcnt = 0;
+
+	if (0 != futil_map_remote(option.fetch, infile, &buf, &buf_len)) {
+		rec_open(infile, "file");
+		rec_str("type", futil_file_type_str(FILE_TYPE_UNKNOWN));
+		return rec_end(1);
+	}
+
+	if (option.t_flag) {
+		const char *str =
+			futil_file_type_str(futil_file_type_buf(buf, buf_len));
+
+		tprintf("%s:\t%s\n", infile, str);
+		rec_open(infile, "file");
+		rec_str("type", str);
+		rec_end(0);
+	} else {
+		errorcnt += show_buf(infile, buf, buf_len, FILE_TYPE_UNKNOWN,
+				     NULL);
+	}
+
+	if (futil_unmap_remote(buf, buf_len)) {
+		fprintf(show_err, "Couldn't fetch all of %s\n", infile);
+		errorcnt++;
+	}
+	return errorcnt;
+}
+
+static int show_one(const char *infile)
+{
+	if (option.fetch)
+		return show_remote(infile);
+
+	if (option.t_flag) {
+		show_type(infile);
+		return 0;
+	}
+
+	return show_file(infile);
+}
+
+/* The cheap checks on a file that's too big to map */
+static void triage_window(const char *infile, int ifd, char *why)
+{
+	struct futil_traverse_state_s state;
+	struct futil_window_s win;
+
+	if (futil_window_open(&win, ifd)) {
+		snprintf(why, TRIAGE_WHY_SIZE, "can't be read");
+		return;
+	}
+	memset(&state, 0, sizeof(state));
+	state.in_filename = infile;
+	state.op = FUTIL_OP_TRIAGE;
+	state.cb_data = why;
+	futil_traverse_window(&win, &state);
+	futil_window_close(&win);
+}
+
+/*
+ * Makes the cheap checks on a file, leaving [why] empty if it passes. If it
+ * can't even be opened, the full look at it will say so.
+ */
+static void triage_one(const char *infile, char *why)
+{
 	struct futil_traverse_state_s state;
 	uint8_t *buf;
-	uint32_t buf_len;
+	uint64_t buf_len;
+	int decompressed = 0;
+	int ifd = -1;
+
+	why[0] = '\0';
+
+	if (option.fetch) {
+		if (futil_map_remote(option.fetch, infile, &buf, &buf_len)) {
+			snprintf(why, TRIAGE_WHY_SIZE, "can't be fetched");
+			return;
+		}
+	} else {
+		ifd = futil_open_input(infile);
+		if (ifd < 0)
+			return;
+		if (futil_window_wanted(ifd)) {
+			triage_window(infile, ifd, why);
+			close(ifd);
+			return;
+		}
+		if (futil_map_input(ifd, &buf, &buf_len, &decompressed)) {
+			snprintf(why, TRIAGE_WHY_SIZE, "can't be read");
+			close(ifd);
+			return;
+		}
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.in_filename = infile;
+	state.op = FUTIL_OP_TRIAGE;
+	state.cb_data = why;
+	futil_traverse(buf, buf_len, &state, FILE_TYPE_UNKNOWN);
+
+	if (option.fetch) {
+		/* Anything it says about zeroes we didn't get means nothing */
+		if (futil_unmap_remote(buf, buf_len))
+			snprintf(why, TRIAGE_WHY_SIZE, "can't all be fetched");
+	} else {
+		futil_unmap_input(ifd, buf, buf_len, decompressed, 0);
+		close(ifd);
+	}
+}
+
+/* Each file is described in full, unless triage has ruled it out */
+struct show_job_s {
+	const char *infile;
+	char why[TRIAGE_WHY_SIZE];
+	char *out, *err;
+	size_t out_len, err_len;
+	int errorcnt;
+	int done;
+};
+
+static int show_job(struct show_job_s *job)
+{
+	if (!job->why[0])
+		return show_one(job->infile);
+
+	tprintf("%s: rejected: %s\n", job->infile, job->why);
+	rec_open(job->infile, "file");
+	rec_str("rejected", job->why);
+	return rec_end(1);
+}
+
+/* With -j, each file's output is collected and printed in order */
+struct show_pool_s {
+	struct show_job_s *job;
+	int count;
+	int printed;
+	int errorcnt;
+	int triage;
+	pthread_mutex_t lock;
+};
+
+static void show_pool_one(void *arg, uint32_t index)
+{
+	struct show_pool_s *pool = arg;
+	struct show_job_s *job = &pool->job[index];
+
+	if (pool->triage) {
+		triage_one(job->infile, job->why);
+		return;
+	}
+
+	show_out = open_memstream(&job->out, &job->out_len);
+	show_err = open_memstream(&job->err, &job->err_len);
+	if (!show_out || !show_err)
+		DIE;
+	job->errorcnt = show_job(job);
+	fclose(show_out);
+	fclose(show_err);
+
+	/* Print whatever's ready, in order */
+	pthread_mutex_lock(&pool->lock);
+	job->done = 1;
+	pool->errorcnt += job->errorcnt;
+	while (pool->printed < pool->count &&
+	       pool->job[pool->printed].done) {
+		job = &pool->job[pool->printed++];
+		fwrite(job->out, 1, job->out_len, stdout);
+		fflush(stdout);
+		fwrite(job->err, 1, job->err_len, stderr);
+		free(job->out);
+		free(job->err);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void show_thread_done(void *arg)
+{
+	rec_free();
+	futil_rsa_cache_free();
+}
+
+static int show_files(int count, char *files[])
+{
+	struct show_pool_s pool;
+	int errorcnt = 0;
+	int i;
+
+	show_out = stdout;
+	show_err = stderr;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.job = calloc(count, sizeof(*pool.job));
+	if (!pool.job) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	pool.count = count;
+	for (i = 0; i < count; i++)
+		pool.job[i].infile = files[i];
+
+	/*
+	 * With a policy to check, rule out every file that can't pass before
+	 * spending any time on signatures.
+	 */
+	if (option.triage && !option.t_flag)
+		pool.triage = 1;
+
+	if (option.jobs <= 1 || count == 1) {
+		for (i = 0; pool.triage && i < count; i++)
+			triage_one(pool.job[i].infile, pool.job[i].why);
+		for (i = 0; i < count; i++)
+			errorcnt += show_job(&pool.job[i]);
+	} else {
+		pthread_mutex_init(&pool.lock, NULL);
+		if (pool.triage) {
+			futil_run_jobs(show_pool_one, show_thread_done, &pool,
+				       count, option.jobs);
+			pool.triage = 0;
+		}
+		futil_run_jobs(show_pool_one, show_thread_done, &pool,
+			       count, option.jobs);
+		pthread_mutex_destroy(&pool.lock);
+		errorcnt = pool.errorcnt;
+	}
+	rec_free();
+
+	show_out = stdout;
+	show_err = stderr;
+	free(pool.job);
+	return errorcnt;
+}
+
+void futil_show_init(FILE *out, FILE *err, VbPublicKey *key, int strict)
+{
+	option = default_option;
+	option.k = key;
+	option.strict = strict;
+	show_out = out;
+	show_err = err;
+}
+
+static int show_or_verify(int argc, char *argv[], int strict)
+{
+	int i, j;
+	int errorcnt = 0;
 	char *e = 0;
 
+	/* We may be called more than once by "futility serve" */
+	option = default_option;
+	option.strict = strict;
+
 	opterr = 0;		/* quiet, you */
 	while ((i = getopt_long(argc, argv, short_opts, long_opts, 0)) != -1) {
 		switch (i) {
@@ -633,7 +2129,14 @@ static int do_show(int argc, char *argv[])
 			}
 			break;
 		case 'k':
-			option.k = PublicKeyRead(optarg);
+		case 'K':
+			if (i == 'K' || futil_is_keystore_spec(optarg)) {
+				enum futil_file_type type = FILE_TYPE_PUBKEY;
+
+				option.k = futil_keystore_read(optarg, &type);
+			} else {
+				option.k = PublicKeyRead(optarg);
+			}
 			if (!option.k) {
 				fprintf(stderr, "Error reading %s\n", optarg);
 				errorcnt++;
@@ -642,6 +2145,60 @@ static int do_show(int argc, char *argv[])
 		case 't':
 			option.t_flag = 1;
 			break;
+		case 'j':
+			option.jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || option.jobs < 1) {
+				fprintf(stderr,
+					"Invalid -j \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_CACHE:
+			option.cache_dir = optarg;
+			break;
+		case OPT_FETCH:
+			option.fetch = optarg;
+			break;
+		case OPT_KNOWN_KEYS:
+			futil_known_keys_free(option.known);
+			option.known = futil_known_keys_load(optarg);
+			if (!option.known)
+				errorcnt++;
+			break;
+		case OPT_MIN_KEY_VERSION:
+			option.min_key_version = strtoull(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr,
+					"Invalid --min-key-version \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			option.triage = 1;
+			break;
+		case OPT_MIN_VERSION:
+			option.min_version = strtoull(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr,
+					"Invalid --min-version \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			option.triage = 1;
+			break;
+		case OPT_BOOT_MODE:
+			for (j = 0; j < ARRAY_SIZE(boot_modes); j++)
+				if (!strcmp(optarg, boot_modes[j].name))
+					break;
+			if (j == ARRAY_SIZE(boot_modes)) {
+				fprintf(stderr,
+					"Invalid --boot-mode \"%s\"\n", optarg);
+				errorcnt++;
+				break;
+			}
+			option.boot_mode = boot_modes[j].name;
+			option.boot_flags = boot_modes[j].flags;
+			option.triage = 1;
+			break;
 		case OPT_PADDING:
 			option.padding = strtoul(optarg, &e, 0);
 			if (!*optarg || (e && *e)) {
@@ -675,52 +2232,32 @@ static int do_show(int argc, char *argv[])
 		return 1;
 	}
 
-	if (argc - optind < 1) {
-		fprintf(stderr, "ERROR: missing input filename\n");
+	if (option.headers && option.strict) {
+		fprintf(stderr, "ERROR: can't verify only the headers\n");
 		print_help(argv[0]);
 		return 1;
 	}
 
-	if (option.t_flag) {
-		for (i = optind; i < argc; i++)
-			show_type(argv[i]);
-		goto done;
+	/* The names depend on files that the cache doesn't know about */
+	if (option.known && option.cache_dir) {
+		fprintf(stderr,
+			"ERROR: can't use --cache with --known-keys\n");
+		print_help(argv[0]);
+		return 1;
 	}
 
-	for (i = optind; i < argc; i++) {
-		infile = argv[i];
-		ifd = open(infile, O_RDONLY);
-		if (ifd < 0) {
-			errorcnt++;
-			fprintf(stderr, "Can't open %s: %s\n",
-				infile, strerror(errno));
-			continue;
-		}
-
-		if (0 != futil_map_file(ifd, MAP_RO, &buf, &buf_len)) {
-			errorcnt++;
-			goto boo;
-		}
-
-		memset(&state, 0, sizeof(state));
-		state.in_filename = infile ? infile : "<none>";
-		state.op = FUTIL_OP_SHOW;
-
-		errorcnt += futil_traverse(buf, buf_len, &state,
-					   FILE_TYPE_UNKNOWN);
-
+	if (argc - optind < 1) {
+		fprintf(stderr, "ERROR: missing input filename\n");
+		print_help(argv[0]);
+		return 1;
+	}
 
-		errorcnt += futil_unmap_file(ifd, MAP_RO, buf, buf_len);
+	if (option.cache_dir)
+		set_cache_context();
 
-boo:
-		if (close(ifd)) {
-			errorcnt++;
-			fprintf(stderr, "Error when closing %s: %s\n",
-				infile, strerror(errno));
-		}
-	}
+	errorcnt += show_files(argc - optind, argv + optind);
 
-done:
+	futil_known_keys_free(option.known);
 	if (option.k)
 		free(option.k);
 	if (option.fv)
@@ -729,6 +2266,11 @@ done:
 	return !!errorcnt;
 }
 
+static int do_show(int argc, char *argv[])
+{
+	return show_or_verify(argc, argv, 0);
+}
+
 DECLARE_FUTIL_COMMAND(show, do_show,
 		      VBOOT_VERSION_ALL,
 		      "Display the content of various binary components",
@@ -736,8 +2278,7 @@ DECLARE_FUTIL_COMMAND(show, do_show,
 
 static int do_verify(int argc, char *argv[])
 {
-	option.strict = 1;
-	return do_show(argc, argv);
+	return show_or_verify(argc, argv, 1);
 }
 
 DECLARE_FUTIL_COMMAND(verify, do_verify,
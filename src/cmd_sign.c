@@ -5,16 +5,22 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bmpblk_header.h"
@@ -23,7 +29,9 @@
 #include "futility.h"
 #include "gbb_header.h"
 #include "host_common.h"
+#include "host_vb21.h"
 #include "kernel_blob.h"
+#include "keystore.h"
 #include "traversal.h"
 #include "util_misc.h"
 #include "vb1_helper.h"
@@ -34,19 +42,38 @@ enum callback_flags {
 	AREA_IS_VALID =     0x00000001,
 };
 
-/* Local structure for args, etc. */
-static struct local_data_s {
+/* One line of a --loems file: a LOEM ID and any keys of its own */
+struct loem_s {
+	char *id;
+	VbPrivateKey *signprivate;
+	VbKeyBlockHeader *keyblock;
+	VbPrivateKey *devsignprivate;
+	VbKeyBlockHeader *devkeyblock;
+};
+
+/*
+ * Local structure for args, etc. The options are parsed into [option], and
+ * each job gets its own copy, which the callbacks find in the traversal
+ * state's cb_data.
+ */
+struct local_data_s {
 	VbPrivateKey *signprivate;
 	VbKeyBlockHeader *keyblock;
 	VbPublicKey *kernel_subkey;
 	VbPrivateKey *devsignprivate;
 	VbKeyBlockHeader *devkeyblock;
+	struct vb21_keyblock *keyblock21;
+	struct vb2_id signprivate_id;
+	uint32_t hash_chunk;
 	uint32_t version;
 	int version_specified;
 	uint32_t flags;
 	int flags_specified;
 	char *loemdir;
 	char *loemid;
+	struct loem_s *loems;
+	int num_loems;
+	int ecrw_hash;
 	uint8_t *bootloader_data;
 	uint64_t bootloader_size;
 	uint8_t *config_data;
@@ -62,11 +89,57 @@ static struct local_data_s {
 	int pem_algo_specified;
 	uint32_t pem_algo;
 	char *pem_external;
-} option = {
+	int pem_persistent;
+	char *batchfile;
+	int batch_jobs;
+	int group_commit;
+	char *archive;
+	char *journal;
+	char **nodes;
+	int num_nodes;
+	char *watchdir;
+	char *rulesfile;
+	int nosync;
+	int verify_after;
+	int skip_if_current;
+	/* With --skip_if_current, the public halves of the signing keys */
+	VbPublicKey *signpub;
+	VbPublicKey *devsignpub;
+	char *hashcache;
+	/* Trusted to have signed the keyblocks of kernels not to rehash */
+	VbPublicKey *old_subkey;
+	char *digest_cache;
+	char *emit_digests;
+	char *attach_signatures;
+	const char *signprivate_name;
+	const char *devsignprivate_name;
+	VbSignSchedule sched;
+	int sched_specified;
+	int priority;
+};
+
+static const struct local_data_s default_option = {
+	.version = 1,
+	.arch = ARCH_UNSPECIFIED,
+	.kloadaddr = CROS_32BIT_ENTRY_ADDR,
+	.padding = 65536,
+	.priority = VB_SIGN_PRIORITY_DEV,
+	.hash_chunk = VB21_FW_HASH_CHUNK,
+};
+
+static __thread struct local_data_s option = {
 	.version = 1,
 	.arch = ARCH_UNSPECIFIED,
 	.kloadaddr = CROS_32BIT_ENTRY_ADDR,
 	.padding = 65536,
+	.priority = VB_SIGN_PRIORITY_DEV,
+	.hash_chunk = VB21_FW_HASH_CHUNK,
+};
+
+static const char * const priority_names[] = {
+	"release",			/* VB_SIGN_PRIORITY_RELEASE */
+	"nightly",			/* VB_SIGN_PRIORITY_NIGHTLY */
+	"dev",				/* VB_SIGN_PRIORITY_DEV */
 };
 
 
@@ -80,40 +153,289 @@ static int no_opt_if(int expr, const char *optname)
 	return 0;
 }
 
+/*
+ * The public half of [key], or NULL if there isn't one to be had here (as
+ * when the key is held by an external signer). Caller must free it.
+ */
+static VbPublicKey *private_key_pub(const VbPrivateKey *key)
+{
+	VbPublicKey *pub;
+	uint8_t *keyb;
+	uint32_t keyb_size;
+
+	if (!key || !key->rsa_private_key ||
+	    vb_keyb_from_rsa(key->rsa_private_key, &keyb, &keyb_size))
+		return NULL;
+	pub = PublicKeyAlloc(keyb_size, key->algorithm, 0);
+	if (pub)
+		Memcpy(GetPublicKeyData(pub), keyb, keyb_size);
+	free(keyb);
+	return pub;
+}
+
+/* Whether [a] and [b] are the same key, whatever their versions */
+static int same_key(const VbPublicKey *a, const VbPublicKey *b)
+{
+	return a && b && a->algorithm == b->algorithm &&
+		a->key_size == b->key_size &&
+		!memcmp(GetPublicKeyDataC(a), GetPublicKeyDataC(b),
+			a->key_size);
+}
+
+/*
+ * With --pem_persistent, each thread keeps its external signer running for
+ * as long as the PEM file and program stay the same, so a batch or a serve
+ * session only starts it once.
+ */
+static __thread struct {
+	char *pem;
+	char *program;
+	uint32_t algo;
+	VbPrivateKey *key;
+} ext_signer;
+
+static void free_ext_signer(void)
+{
+	PrivateKeyFree(ext_signer.key);
+	free(ext_signer.pem);
+	free(ext_signer.program);
+	memset(&ext_signer, 0, sizeof(ext_signer));
+}
+
+static int batch_mode;
+static int keep_keys;
+
+/* With --emit_digests or --attach_signatures, every private key signs here */
+static VbSplitSigning *split;
+
+/* Signatures remembered per key, in a batch or a serve session */
+#define SIGN_MEMO_SIZE 1024
+
+/*
+ * With --sign_rate or --sign_window, or in a batch or serve session,
+ * returns a key that signs with [key] but shares its limits, and the
+ * signatures it has made, with every other use of the key file [name] (as
+ * run by [program], if that's not NULL) in any thread. Otherwise, returns
+ * [key] itself. Anything else must be freed with PrivateKeyFree() when the
+ * signing is done.
+ */
+static VbPrivateKey *sched_key(const struct local_data_s *opt,
+			       VbPrivateKey *key, const char *name,
+			       const char *program)
+{
+	VbSignSchedule sched = opt->sched;
+	VbPrivateKey *wrapper;
+	char *path, *id = NULL;
+
+	if (!key || !name ||
+	    !(opt->sched_specified || batch_mode || keep_keys))
+		return key;
+
+	/*
+	 * Many board variants sign the same body with the same key, and
+	 * the same digest always gets the same signature. Split signing
+	 * remembers them itself, and mustn't be given placeholders back.
+	 */
+	if ((batch_mode || keep_keys) && !split)
+		sched.memo = SIGN_MEMO_SIZE;
+
+	/* The same relative name may mean different files over time */
+	path = realpath(name, NULL);
+	if (path && program &&
+	    asprintf(&id, "%s %s", path, program) < 0)
+		id = NULL;
+	wrapper = PrivateKeyScheduled(key, id ? id : path ? path : name,
+				      &sched, opt->priority);
+	free(id);
+	free(path);
+	if (!wrapper) {
+		fprintf(stderr, "Can't schedule signing with %s\n", name);
+		return NULL;
+	}
+	return wrapper;
+}
+
+static VbPrivateKey *get_ext_signer(const char *pem, uint32_t algo,
+				    const char *program)
+{
+	/* The same relative name may mean different files over time */
+	char *pem_path = realpath(pem, NULL);
+	char *program_path = realpath(program, NULL);
+
+	if (!pem_path || !program_path) {
+		fprintf(stderr, "Can't find %s: %s\n",
+			pem_path ? program : pem, strerror(errno));
+		free(pem_path);
+		free(program_path);
+		return NULL;
+	}
+
+	if (ext_signer.key && ext_signer.algo == algo &&
+	    !strcmp(ext_signer.pem, pem_path) &&
+	    !strcmp(ext_signer.program, program_path)) {
+		free(pem_path);
+		free(program_path);
+		return ext_signer.key;
+	}
+
+	free_ext_signer();
+	ext_signer.key = PrivateKeyExternalPersistent(pem_path, algo,
+						       program_path);
+	if (!ext_signer.key) {
+		fprintf(stderr, "Unable to start %s\n", program);
+		free(pem_path);
+		free(program_path);
+		return NULL;
+	}
+	ext_signer.pem = pem_path;
+	ext_signer.program = program_path;
+	ext_signer.algo = algo;
+	return ext_signer.key;
+}
+
+/* With --vb21, a v1 public key or a vb21 one becomes a vb21 keyblock */
+static int sign_pubkey_vb21(struct futil_traverse_state_s *state)
+{
+	struct local_data_s *opt = state->cb_data;
+	const struct vb21_packed_key *data_key;
+	struct vb21_packed_key *packed = NULL;
+	struct vb21_keyblock *block;
+	VbPrivateKey *key = opt->signprivate, *owned = NULL, *sched;
+	struct vb2_id id = opt->signprivate_id;
+	int rv;
+
+	if (state->component == CB_VB21_PUBKEY) {
+		data_key = (struct vb21_packed_key *)state->my_area->buf;
+	} else {
+		packed = Vb21PackedKeyCreate((VbPublicKey *)state->my_area->buf,
+					     NULL);
+		if (!packed) {
+			fprintf(stderr, "Unable to pack the public key\n");
+			return 1;
+		}
+		data_key = packed;
+	}
+
+	if (opt->pem_signpriv) {
+		if (opt->pem_external && opt->pem_persistent)
+			key = get_ext_signer(opt->pem_signpriv, opt->pem_algo,
+					     opt->pem_external);
+		else if (opt->pem_external)
+			key = owned = PrivateKeyExternal(opt->pem_signpriv,
+							 opt->pem_algo,
+							 opt->pem_external);
+		else
+			key = owned = PrivateKeyReadPem(opt->pem_signpriv,
+							opt->pem_algo);
+		if (!key) {
+			fprintf(stderr, "Unable to use PEM signing key %s\n",
+				opt->pem_signpriv);
+			free(packed);
+			return 1;
+		}
+		/* An external signer's ID isn't known, so it stays zero */
+		Vb21PrivateKeyId(key, &id);
+	}
+
+	sched = key;
+	if (key && key != opt->signprivate) {
+		sched = opt->pem_persistent ?
+			sched_key(opt, key, ext_signer.pem,
+				  ext_signer.program) :
+			sched_key(opt, key, opt->pem_signpriv,
+				  opt->pem_external);
+		if (!sched) {
+			PrivateKeyFree(owned);
+			free(packed);
+			return 1;
+		}
+	}
+
+	block = Vb21KeyblockCreate(data_key, sched, &id, opt->flags, NULL);
+	if (sched != key)
+		PrivateKeyFree(sched);
+	PrivateKeyFree(owned);
+	free(packed);
+	if (!block) {
+		fprintf(stderr, "Unable to create keyblock\n");
+		return 1;
+	}
+
+	rv = WriteSomeParts(opt->outfile, block, block->c.total_size,
+			    NULL, 0);
+	free(block);
+	return rv;
+}
+
 /* This wraps/signs a public key, producing a keyblock. */
 int futil_cb_sign_pubkey(struct futil_traverse_state_s *state)
 {
+	struct local_data_s *opt = state->cb_data;
 	VbPublicKey *data_key = (VbPublicKey *)state->my_area->buf;
 	VbKeyBlockHeader *vblock;
+	VbPrivateKey *key, *sched;
+
+	if (vboot_version == VBOOT_VERSION_2_1 ||
+	    state->component == CB_VB21_PUBKEY)
+		return sign_pubkey_vb21(state);
 
-	if (option.pem_signpriv) {
-		if (option.pem_external) {
+	if (opt->pem_signpriv && split) {
+		key = PrivateKeySplit(split, opt->pem_signpriv, opt->pem_algo);
+		if (!key) {
+			fprintf(stderr, "Can't sign with %s\n",
+				opt->pem_signpriv);
+			return 1;
+		}
+		vblock = KeyBlockCreate(data_key, key, opt->flags);
+		PrivateKeyFree(key);
+	} else if (opt->pem_signpriv) {
+		if (opt->pem_external && opt->pem_persistent) {
+			key = get_ext_signer(opt->pem_signpriv, opt->pem_algo,
+					     opt->pem_external);
+			sched = sched_key(opt, key, ext_signer.pem,
+					  ext_signer.program);
+			if (!sched)
+				return 1;
+			vblock = KeyBlockCreate(data_key, sched, opt->flags);
+			if (sched != key)
+				PrivateKeyFree(sched);
+		} else if (opt->pem_external) {
 			/* External signing uses the PEM file directly. */
 			vblock = KeyBlockCreate_external(
 				data_key,
-				option.pem_signpriv,
-				option.pem_algo, option.flags,
-				option.pem_external);
+				opt->pem_signpriv,
+				opt->pem_algo, opt->flags,
+				opt->pem_external);
 		} else {
-			option.signprivate = PrivateKeyReadPem(
-				option.pem_signpriv, option.pem_algo);
-			if (!option.signprivate) {
+			opt->signprivate = PrivateKeyReadPem(
+				opt->pem_signpriv, opt->pem_algo);
+			if (!opt->signprivate) {
 				fprintf(stderr,
 					"Unable to read PEM signing key: %s\n",
 					strerror(errno));
 				return 1;
 			}
-			vblock = KeyBlockCreate(data_key, option.signprivate,
-						option.flags);
+			sched = sched_key(opt, opt->signprivate,
+					  opt->pem_signpriv, NULL);
+			if (!sched)
+				return 1;
+			vblock = KeyBlockCreate(data_key, sched, opt->flags);
+			if (sched != opt->signprivate)
+				PrivateKeyFree(sched);
 		}
 	} else {
 		/* Not PEM. Should already have a signing key. */
-		vblock = KeyBlockCreate(data_key, option.signprivate,
-					option.flags);
+		vblock = KeyBlockCreate(data_key, opt->signprivate,
+					opt->flags);
+	}
+
+	if (!vblock) {
+		fprintf(stderr, "Unable to create keyblock\n");
+		return 1;
 	}
 
 	/* Write it out */
-	return WriteSomeParts(option.outfile,
+	return WriteSomeParts(opt->outfile,
 			      vblock, vblock->key_block_size,
 			      NULL, 0);
 }
@@ -126,6 +448,8 @@ int futil_cb_sign_pubkey(struct futil_traverse_state_s *state)
  */
 int futil_cb_sign_fw_main(struct futil_traverse_state_s *state)
 {
+	/* It gets hashed at the end */
+	futil_prefetch_area(state, state->component);
 	state->my_area->_flags |= AREA_IS_VALID;
 	return 0;
 }
@@ -137,6 +461,7 @@ int futil_cb_sign_fw_main(struct futil_traverse_state_s *state)
  */
 int futil_cb_sign_fw_vblock(struct futil_traverse_state_s *state)
 {
+	struct local_data_s *opt = state->cb_data;
 	VbKeyBlockHeader *key_block = (VbKeyBlockHeader *)state->my_area->buf;
 	uint32_t len = state->my_area->len;
 
@@ -152,8 +477,7 @@ int futil_cb_sign_fw_vblock(struct futil_traverse_state_s *state)
 		goto whatever;
 	}
 
-	RSAPublicKey *rsa = PublicKeyToRSA(&key_block->data_key);
-	if (!rsa) {
+	if (!RSAKeyCacheGet(futil_rsa_cache(), &key_block->data_key)) {
 		fprintf(stderr, "Warning: %s public key is invalid. "
 			"Signing the entire FW FMAP region...\n",
 			state->name);
@@ -169,8 +493,8 @@ int futil_cb_sign_fw_vblock(struct futil_traverse_state_s *state)
 	case CB_FMAP_VBLOCK_A:
 		fw_body_area = &state->cb_area[CB_FMAP_FW_MAIN_A];
 		/* Preserve the flags if they're not specified */
-		if (!option.flags_specified)
-			option.flags = preamble->flags;
+		if (!opt->flags_specified)
+			opt->flags = preamble->flags;
 		break;
 	case CB_FMAP_VBLOCK_B:
 		fw_body_area = &state->cb_area[CB_FMAP_FW_MAIN_B];
@@ -197,6 +521,8 @@ whatever:
 
 int futil_cb_create_kernel_part(struct futil_traverse_state_s *state)
 {
+	struct local_data_s *opt = state->cb_data;
+	struct kernel_blob_ctx_s kb;
 	uint8_t *vmlinuz_data, *kblob_data, *vblock_data;
 	uint64_t vmlinuz_size, kblob_size, vblock_size;
 	int rv;
@@ -204,11 +530,34 @@ int futil_cb_create_kernel_part(struct futil_traverse_state_s *state)
 	vmlinuz_data = state->my_area->buf;
 	vmlinuz_size = state->my_area->len;
 
+	/* We should be creating a completely new output file.
+	 * If not, something's wrong. */
+	if (!opt->create_new_outfile)
+		DIE;
+
+	/*
+	 * Normally the partition is streamed straight from the input, but
+	 * that's mapped, so if it's also the output we need a copy first.
+	 */
+	if (!futil_same_file(state->in_filename, opt->outfile))
+		return WriteKernelPart(opt->outfile,
+				       vmlinuz_data, vmlinuz_size,
+				       opt->arch, opt->kloadaddr,
+				       opt->config_data, opt->config_size,
+				       opt->bootloader_data,
+				       opt->bootloader_size,
+				       opt->padding, opt->version,
+				       opt->keyblock, opt->signprivate,
+				       opt->flags, opt->vblockonly,
+				       opt->digest_cache,
+				       state->in_filename);
+
+	memset(&kb, 0, sizeof(kb));
 	kblob_data = CreateKernelBlob(
-		vmlinuz_data, vmlinuz_size,
-		option.arch, option.kloadaddr,
-		option.config_data, option.config_size,
-		option.bootloader_data, option.bootloader_size,
+		&kb, vmlinuz_data, vmlinuz_size,
+		opt->arch, opt->kloadaddr,
+		opt->config_data, opt->config_size,
+		opt->bootloader_data, opt->bootloader_size,
 		&kblob_size);
 	if (!kblob_data) {
 		fprintf(stderr, "Unable to create kernel blob\n");
@@ -216,10 +565,10 @@ int futil_cb_create_kernel_part(struct futil_traverse_state_s *state)
 	}
 	Debug("kblob_size = 0x%" PRIx64 "\n", kblob_size);
 
-	vblock_data = SignKernelBlob(kblob_data, kblob_size, option.padding,
-				     option.version, option.kloadaddr,
-				     option.keyblock, option.signprivate,
-				     option.flags, &vblock_size);
+	vblock_data = SignKernelBlob(&kb, kblob_data, kblob_size, opt->padding,
+				     opt->version, opt->kloadaddr,
+				     opt->keyblock, opt->signprivate,
+				     opt->flags, &vblock_size);
 	if (!vblock_data) {
 		fprintf(stderr, "Unable to sign kernel blob\n");
 		free(kblob_data);
@@ -227,17 +576,12 @@ int futil_cb_create_kernel_part(struct futil_traverse_state_s *state)
 	}
 	Debug("vblock_size = 0x%" PRIx64 "\n", vblock_size);
 
-	/* We should be creating a completely new output file.
-	 * If not, something's wrong. */
-	if (!option.create_new_outfile)
-		DIE;
-
-	if (option.vblockonly)
-		rv = WriteSomeParts(option.outfile,
+	if (opt->vblockonly)
+		rv = WriteSomeParts(opt->outfile,
 				    vblock_data, vblock_size,
 				    NULL, 0);
 	else
-		rv = WriteSomeParts(option.outfile,
+		rv = WriteSomeParts(opt->outfile,
 				    vblock_data, vblock_size,
 				    kblob_data, kblob_size);
 
@@ -246,24 +590,93 @@ int futil_cb_create_kernel_part(struct futil_traverse_state_s *state)
 	return rv;
 }
 
-int futil_cb_resign_kernel_part(struct futil_traverse_state_s *state)
+/*
+ * With --skip_if_current, whether resigning the kernel partition at
+ * [kpart_data] (with [fd] as for resign_kpart()) would change nothing: it
+ * has the keyblock asked for, whose data key is the signing key, and a
+ * preamble of the current format with the version and flags asked for,
+ * signed by that key, over a body that matches its signature.
+ */
+static int kpart_is_current(const struct local_data_s *opt,
+			    uint8_t *kpart_data, uint64_t kpart_size, int fd)
 {
-	uint8_t *kpart_data, *kblob_data, *vblock_data;
-	uint64_t kpart_size, kblob_size, vblock_size;
+	struct kernel_blob_ctx_s kb;
 	VbKeyBlockHeader *keyblock = NULL;
 	VbKernelPreambleHeader *preamble = NULL;
-	int rv = 0;
+	const VbSignature *sig;
+	const RSAPublicKey *rsa;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	DigestContext ctx;
+	uint8_t *kblob_data;
+	uint64_t kblob_size, more;
 
-	kpart_data = state->my_area->buf;
-	kpart_size = state->my_area->len;
+	/* A new config always means a change */
+	if (!opt->skip_if_current || opt->config_data)
+		return 0;
 
-	/* Note: This just sets some static pointers. It doesn't malloc. */
-	kblob_data = UnpackKPart(kpart_data, kpart_size, option.padding,
+	memset(&kb, 0, sizeof(kb));
+	kblob_data = UnpackKPart(&kb, kpart_data, kpart_size, opt->padding,
 				 &keyblock, &preamble, &kblob_size);
+	if (!kblob_data)
+		return 0;
+	more = keyblock->key_block_size;
+	if ((opt->keyblock &&
+	     (opt->keyblock->key_block_size != more ||
+	      memcmp(opt->keyblock, keyblock, more))) ||
+	    !same_key(opt->signpub, &keyblock->data_key))
+		return 0;
+
+	rsa = RSAKeyCacheGet(futil_rsa_cache(), &keyblock->data_key);
+	if (!rsa || VerifyKernelPreamble(preamble, kpart_size - more, rsa) ||
+	    preamble->header_version_minor !=
+	    KERNEL_PREAMBLE_HEADER_VERSION_MINOR ||
+	    (opt->version_specified &&
+	     preamble->kernel_version != opt->version) ||
+	    (opt->flags_specified && preamble->flags != opt->flags))
+		return 0;
+
+	sig = &preamble->body_signature;
+	if (sig->data_size != kblob_size)
+		return 0;
+	if (fd < 0)
+		return !VerifyData(kblob_data, kblob_size, sig, rsa);
+	DigestInit(&ctx, keyblock->data_key.algorithm);
+	if (DigestFileRegion(&ctx, fd, kblob_data - kpart_data, kblob_size,
+			     NULL, NULL))
+		return 0;
+	DigestFinalInto(&ctx, digest);
+	return !VerifyDigest(digest, sig, rsa);
+}
+
+/*
+ * Resigns the kernel partition at [kpart_data] as [opt] says, replacing its
+ * config in place if asked. Returns the new vblock, which the caller must
+ * free, or NULL on error. The kernel blob is at [*kblob_ptr]. If [fd] isn't
+ * -1, [kpart_data] is only the vblock, and the blob is read from [fd] at the
+ * same offset instead, without changing the config.
+ */
+static uint8_t *resign_kpart(const struct local_data_s *opt,
+			     uint8_t *kpart_data, uint64_t kpart_size, int fd,
+			     uint8_t **kblob_ptr, uint64_t *kblob_size_ptr,
+			     uint64_t *vblock_size_ptr)
+{
+	struct kernel_blob_ctx_s kb;
+	uint8_t *kblob_data, *vblock_data;
+	VbKeyBlockHeader *keyblock = NULL;
+	VbKernelPreambleHeader *preamble = NULL;
+	uint32_t version = opt->version;
+	uint32_t flags = opt->flags;
+	uint64_t body_ofs, body_avail = 0;
+	struct stat sb;
+
+	/* Note: This just fills in kb. It doesn't malloc. */
+	memset(&kb, 0, sizeof(kb));
+	kblob_data = UnpackKPart(&kb, kpart_data, kpart_size, opt->padding,
+				 &keyblock, &preamble, kblob_size_ptr);
 
 	if (!kblob_data) {
 		fprintf(stderr, "Unable to unpack kernel partition\n");
-		return 1;
+		return NULL;
 	}
 
 	/*
@@ -273,101 +686,398 @@ int futil_cb_resign_kernel_part(struct futil_traverse_state_s *state)
 	 * it here either. To enable it, we'd need to update the zeropage
 	 * table's cmd_line_ptr as well as the preamble.
 	 */
-	option.kloadaddr = preamble->body_load_address;
-
-	/* Replace the config if asked */
-	if (option.config_data &&
-	    0 != UpdateKernelBlobConfig(kblob_data, kblob_size,
-					option.config_data,
-					option.config_size)) {
-		fprintf(stderr, "Unable to update config\n");
-		return 1;
-	}
 
 	/* Preserve the version unless a new one is given */
-	if (!option.version_specified)
-		option.version = preamble->kernel_version;
+	if (!opt->version_specified)
+		version = preamble->kernel_version;
 
 	/* Preserve the flags if not specified */
 	if (VbKernelHasFlags(preamble) == VBOOT_SUCCESS) {
-		if (option.flags_specified == 0)
-			option.flags = preamble->flags;
+		if (opt->flags_specified == 0)
+			flags = preamble->flags;
 	}
 
 	/* Replace the keyblock if asked */
-	if (option.keyblock)
-		keyblock = option.keyblock;
-
-	/* Compute the new signature */
-	vblock_data = SignKernelBlob(kblob_data, kblob_size, option.padding,
-				     option.version, option.kloadaddr,
-				     keyblock, option.signprivate,
-				     option.flags, &vblock_size);
+	if (opt->keyblock)
+		keyblock = opt->keyblock;
+
+	/* An unchanged body can be signed without reading it, if trusted */
+	vblock_data = NULL;
+	body_ofs = kblob_data - kpart_data;
+	if (opt->old_subkey && !opt->config_data) {
+		if (fd < 0)
+			body_avail = kpart_size - body_ofs;
+		else if (!futil_fstat(fd, &sb) &&
+			 (uint64_t)sb.st_size > body_ofs)
+			body_avail = sb.st_size - body_ofs;
+		vblock_data = ResignKernelRecovered(&kb, body_avail,
+						    opt->old_subkey,
+						    opt->padding, version,
+						    preamble->body_load_address,
+						    keyblock, opt->signprivate,
+						    flags, vblock_size_ptr);
+		Debug("body digest %s\n", vblock_data ? "recovered" :
+		      "not recovered, rehashing");
+	}
+
+	/* Replace the config if asked, and compute the new signature */
+	if (!vblock_data && fd >= 0)
+		vblock_data = ResignKernelPartFd(&kb, fd, body_ofs,
+						 *kblob_size_ptr, opt->padding,
+						 version,
+						 preamble->body_load_address,
+						 keyblock, opt->signprivate,
+						 flags, vblock_size_ptr);
+	else if (!vblock_data)
+		vblock_data = ResignKernelBlob(&kb, kblob_data,
+					       *kblob_size_ptr,
+					       opt->config_data,
+					       opt->config_size,
+					       opt->hashcache, opt->padding,
+					       version,
+					       preamble->body_load_address,
+					       keyblock, opt->signprivate,
+					       flags, vblock_size_ptr);
 	if (!vblock_data) {
 		fprintf(stderr, "Unable to sign kernel blob\n");
-		return 1;
+		return NULL;
 	}
-	Debug("vblock_size = 0x%" PRIx64 "\n", vblock_size);
+	Debug("vblock_size = 0x%" PRIx64 "\n", *vblock_size_ptr);
+
+	*kblob_ptr = kblob_data;
+	return vblock_data;
+}
+
+int futil_cb_resign_kernel_part(struct futil_traverse_state_s *state)
+{
+	struct local_data_s *opt = state->cb_data;
+	uint8_t *kpart_data, *kblob_data, *vblock_data;
+	uint64_t kpart_size, kblob_size, vblock_size;
+	int rv = 0;
+
+	kpart_data = state->my_area->buf;
+	kpart_size = state->my_area->len;
 
-	if (option.create_new_outfile) {
+	/* A new file is written whatever happens, so it's always signed */
+	if (!opt->create_new_outfile &&
+	    kpart_is_current(opt, kpart_data, kpart_size, -1)) {
+		Debug("%s is already signed\n", state->in_filename);
+		return 0;
+	}
+
+	vblock_data = resign_kpart(opt, kpart_data, kpart_size, -1,
+				   &kblob_data, &kblob_size, &vblock_size);
+	if (!vblock_data)
+		return 1;
+
+	if (opt->create_new_outfile) {
 		/* Write out what we've been asked for */
-		if (option.vblockonly)
-			rv = WriteSomeParts(option.outfile,
+		if (opt->vblockonly)
+			rv = WriteSomeParts(opt->outfile,
 					    vblock_data, vblock_size,
 					    NULL, 0);
 		else
-			rv = WriteSomeParts(option.outfile,
+			rv = WriteSomeParts(opt->outfile,
 					    vblock_data, vblock_size,
 					    kblob_data, kblob_size);
 	} else {
-		/* If we're modifying an existing file, it's mmap'ed so that
-		 * all our modifications to the buffer will get flushed to
-		 * disk when we close it. */
+		/* If we're modifying an existing file, it's mmap'ed and
+		 * just the parts we change get written back when we're
+		 * done. */
 		Memcpy(kpart_data, vblock_data, vblock_size);
+		futil_mark_dirty(state, state->my_area->offset, vblock_size);
+		if (opt->config_data)
+			futil_mark_dirty(state, state->my_area->offset +
+					 (kblob_data - kpart_data), kblob_size);
 	}
 
 	free(vblock_data);
 	return rv;
 }
 
+/* O_DIRECT wants the buffer, offset and length aligned to this */
+#define DIRECT_IO_ALIGN 4096
+
+/*
+ * A kernel partition on a block device is resigned without mapping it, since
+ * that would fault in (and readahead) far more than the vblock and body.
+ * The vblock is read with pread(), the body is hashed as it streams past,
+ * and just the [padding] bytes of vblock are written back, bypassing the
+ * page cache if the device allows it. The config can't be replaced this
+ * way. Returns the number of errors.
+ */
+static int resign_kpart_blkdev(const struct local_data_s *opt, int fd)
+{
+	uint8_t *vblock = NULL, *kblob_data, *vblock_data = NULL;
+	uint64_t kblob_size, vblock_size, done;
+	ssize_t n;
+	int dfd = -1;
+	int errorcnt = 1;
+
+	if (posix_memalign((void **)&vblock, DIRECT_IO_ALIGN, opt->padding)) {
+		fprintf(stderr, "Couldn't allocate 0x%" PRIx32 " bytes\n",
+			opt->padding);
+		return 1;
+	}
+	for (done = 0; done < opt->padding; done += n) {
+		n = pread(fd, vblock + done, opt->padding - done, done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			fprintf(stderr, "Can't read the vblock of %s: %s\n",
+				opt->outfile, n < 0 ? strerror(errno) :
+				"it's too short");
+			goto done;
+		}
+	}
+
+	if (kpart_is_current(opt, vblock, opt->padding, fd)) {
+		Debug("%s is already signed\n", opt->outfile);
+		errorcnt = 0;
+		goto done;
+	}
+
+	vblock_data = resign_kpart(opt, vblock, opt->padding, fd,
+				   &kblob_data, &kblob_size, &vblock_size);
+	if (!vblock_data)
+		goto done;
+	if (vblock_size > (uint64_t)(kblob_data - vblock)) {
+		fprintf(stderr, "The new vblock doesn't fit in front of the"
+			" kernel blob\n");
+		goto done;
+	}
+	Memcpy(vblock, vblock_data, vblock_size);
+
+	/* Fall back to the page cache if the device won't do direct I/O */
+	if (opt->padding % DIRECT_IO_ALIGN == 0)
+		dfd = open(opt->outfile, O_WRONLY | O_DIRECT);
+	for (done = 0; done < opt->padding; done += n) {
+		n = pwrite(dfd >= 0 ? dfd : fd, vblock + done,
+			   opt->padding - done, done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+		} else if (n < 0 && errno == EINVAL && dfd >= 0) {
+			Debug("no O_DIRECT for %s\n", opt->outfile);
+			close(dfd);
+			dfd = -1;
+			n = 0;
+		} else if (n <= 0) {
+			fprintf(stderr, "Can't write back changes: %s\n",
+				strerror(errno));
+			goto done;
+		}
+	}
+
+	if (!opt->nosync && fdatasync(dfd >= 0 ? dfd : fd)) {
+		fprintf(stderr, "Can't sync changes: %s\n", strerror(errno));
+		goto done;
+	}
+	errorcnt = 0;
+
+done:
+	if (dfd >= 0)
+		close(dfd);
+	free(vblock_data);
+	free(vblock);
+	return errorcnt;
+}
+
+/* Chrome OS disks have three, but leave room for more */
+#define MAX_KERNEL_PARTS 16
+
+/* A kernel partition in a disk image, and what became of it */
+struct kpart_job_s {
+	const struct local_data_s *opt;
+	struct cb_area_s area;
+	uint32_t partition;
+	uint64_t vblock_size;
+	uint64_t kblob_offset;
+	uint64_t kblob_size;
+	int current;
+	int retval;
+};
+
+/* The kernel partitions found so far, signed when the traversal ends */
+static __thread struct {
+	struct kpart_job_s job[MAX_KERNEL_PARTS];
+	int count;
+} kpart_jobs;
+
+int futil_cb_sign_gpt_kernel(struct futil_traverse_state_s *state)
+{
+	struct kpart_job_s *job;
+
+	if (kpart_jobs.count == MAX_KERNEL_PARTS) {
+		fprintf(stderr, "Too many kernel partitions in %s\n",
+			state->in_filename);
+		return 1;
+	}
+
+	job = &kpart_jobs.job[kpart_jobs.count++];
+	memset(job, 0, sizeof(*job));
+	job->opt = state->cb_data;
+	job->area = *state->my_area;
+	job->partition = state->partition;
+
+	/* Let the kernel start reading it while we look for the others */
+	futil_prefetch_area(state, CB_GPT_KERNEL);
+	return 0;
+}
+
+static void kpart_sign_job(void *arg, uint32_t index)
+{
+	struct kpart_job_s *job = (struct kpart_job_s *)arg + index;
+	uint8_t *kblob_data, *vblock_data;
+
+	if (kpart_is_current(job->opt, job->area.buf, job->area.len, -1)) {
+		Debug("partition %" PRIu32 " is already signed\n",
+		      job->partition);
+		job->current = 1;
+		return;
+	}
+
+	vblock_data = resign_kpart(job->opt, job->area.buf, job->area.len, -1,
+				   &kblob_data, &job->kblob_size,
+				   &job->vblock_size);
+	if (!vblock_data) {
+		job->retval = 1;
+		return;
+	}
+
+	job->kblob_offset = kblob_data - job->area.buf;
+	if (job->vblock_size > job->kblob_offset) {
+		fprintf(stderr, "The new vblock won't fit in partition %"
+			PRIu32 "\n", job->partition);
+		job->retval = 1;
+	} else {
+		Memcpy(job->area.buf, vblock_data, job->vblock_size);
+	}
+
+	free(vblock_data);
+}
+
+/* Resign every kernel partition in place, several at once. */
+static int sign_disk_at_end(struct futil_traverse_state_s *state)
+{
+	struct local_data_s *opt = state->cb_data;
+	struct kpart_job_s *job = kpart_jobs.job;
+	int count = kpart_jobs.count;
+	int retval = 0;
+	int i;
+
+	if (state->errors) {
+		fprintf(stderr, "Something's wrong. Not changing anything\n");
+		return 1;
+	}
+	if (!count) {
+		fprintf(stderr, "%s has no kernel partitions to sign\n",
+			state->in_filename);
+		return 1;
+	}
+
+	futil_run_jobs(kpart_sign_job, NULL, job, count, 0);
+
+	/* Only the vblocks change, and the blobs too for a new config */
+	for (i = 0; i < count; i++) {
+		retval |= job[i].retval;
+		if (job[i].retval || job[i].current)
+			continue;
+		futil_mark_dirty(state, job[i].area.offset, job[i].vblock_size);
+		if (opt->config_data)
+			futil_mark_dirty(state, job[i].area.offset +
+					 job[i].kblob_offset,
+					 job[i].kblob_size);
+	}
+
+	return retval;
+}
+
+
+/* Enough for a body signature and preamble with the biggest keys */
+#define PREAMBLE_SCRATCH_SIZE 16384
+
+/*
+ * With --vb21, the vblock is the vb21 keyblock and a preamble that hashes the
+ * body a piece at a time, so it can be checked as it's read in.
+ */
+static int sign_raw_firmware_vb21(struct futil_traverse_state_s *state)
+{
+	struct local_data_s *opt = state->cb_data;
+	struct vb21_fw_preamble *preamble;
+	int rv;
+
+	preamble = Vb21FwPreambleCreate(state->my_area->buf,
+					state->my_area->len, opt->hash_chunk,
+					opt->signprivate, &opt->signprivate_id,
+					opt->version, opt->flags, NULL);
+	if (!preamble) {
+		fprintf(stderr, "Error creating firmware preamble.\n");
+		return 1;
+	}
+
+	rv = WriteSomeParts(opt->outfile,
+			    opt->keyblock21, opt->keyblock21->c.total_size,
+			    preamble, preamble->c.total_size);
+	free(preamble);
+	return rv;
+}
 
 int futil_cb_sign_raw_firmware(struct futil_traverse_state_s *state)
 {
+	struct local_data_s *opt = state->cb_data;
 	VbSignature *body_sig;
 	VbFirmwarePreambleHeader *preamble;
+	DigestContext ctx;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	uint8_t scratch_buf[PREAMBLE_SCRATCH_SIZE];
+	VbScratch scratch;
 	int rv;
 
-	body_sig = CalculateSignature(state->my_area->buf, state->my_area->len,
-				      option.signprivate);
+	if (vboot_version == VBOOT_VERSION_2_1)
+		return sign_raw_firmware_vb21(state);
+
+	futil_digest_region(opt->digest_cache, state->in_filename,
+			    state->my_area->offset,
+			    state->my_area->buf, state->my_area->len,
+			    opt->signprivate->algorithm, &ctx);
+	DigestFinalInto(&ctx, digest);
+	ScratchInit(&scratch, scratch_buf, sizeof(scratch_buf));
+	body_sig = CalculateSignatureForDigestScratch(digest,
+						      state->my_area->len,
+						      opt->signprivate,
+						      &scratch);
 	if (!body_sig) {
 		fprintf(stderr, "Error calculating body signature\n");
+		ScratchReset(&scratch);
 		return 1;
 	}
+	futil_signed_digest_add(body_sig, digest, opt->signprivate->algorithm);
 
-	preamble = CreateFirmwarePreamble(option.version,
-					  option.kernel_subkey,
-					  body_sig,
-					  option.signprivate,
-					  option.flags);
+	preamble = CreateFirmwarePreambleScratch(opt->version,
+						 opt->kernel_subkey,
+						 body_sig,
+						 opt->signprivate,
+						 opt->flags,
+						 &scratch);
 	if (!preamble) {
 		fprintf(stderr, "Error creating firmware preamble.\n");
-		free(body_sig);
+		ScratchReset(&scratch);
 		return 1;
 	}
 
-	rv = WriteSomeParts(option.outfile,
-			    option.keyblock, option.keyblock->key_block_size,
+	rv = WriteSomeParts(opt->outfile,
+			    opt->keyblock, opt->keyblock->key_block_size,
 			    preamble, preamble->preamble_size);
 
-	free(preamble);
-	free(body_sig);
-
+	ScratchReset(&scratch);
 	return rv;
 }
 
 
 int futil_cb_sign_begin(struct futil_traverse_state_s *state)
 {
+	kpart_jobs.count = 0;
+
 	if (state->in_type == FILE_TYPE_UNKNOWN) {
 		fprintf(stderr, "Unable to determine type of %s\n",
 			state->in_filename);
@@ -377,84 +1087,332 @@ int futil_cb_sign_begin(struct futil_traverse_state_s *state)
 	return 0;
 }
 
-static int write_new_preamble(struct cb_area_s *vblock,
+static int write_new_preamble(const struct local_data_s *opt,
+			      struct cb_area_s *vblock,
 			      struct cb_area_s *fw_body,
+			      const uint8_t *fw_digest,
 			      VbPrivateKey *signkey,
 			      VbKeyBlockHeader *keyblock)
 {
 	VbSignature *body_sig;
 	VbFirmwarePreambleHeader *preamble;
+	uint8_t scratch_buf[PREAMBLE_SCRATCH_SIZE];
+	VbScratch scratch;
+	uint64_t more;
 
-	body_sig = CalculateSignature(fw_body->buf, fw_body->len, signkey);
+	ScratchInit(&scratch, scratch_buf, sizeof(scratch_buf));
+	body_sig = CalculateSignatureForDigestScratch(fw_digest, fw_body->len,
+						      signkey, &scratch);
 	if (!body_sig) {
 		fprintf(stderr, "Error calculating body signature\n");
+		ScratchReset(&scratch);
 		return 1;
 	}
+	futil_signed_digest_add(body_sig, fw_digest, signkey->algorithm);
 
-	preamble = CreateFirmwarePreamble(option.version,
-					  option.kernel_subkey,
-					  body_sig,
-					  signkey,
-					  option.flags);
-	if (!preamble) {
-		fprintf(stderr, "Error creating firmware preamble.\n");
-		free(body_sig);
+	/* Build the new keyblock and preamble right where they go */
+	more = keyblock->key_block_size;
+	if (more > vblock->len ||
+	    FirmwarePreambleSize(opt->kernel_subkey, body_sig, signkey) >
+	    vblock->len - more) {
+		fprintf(stderr, "New keyblock and preamble won't fit in"
+			" the 0x%" PRIx64 "-byte VBLOCK\n", vblock->len);
+		ScratchReset(&scratch);
 		return 1;
 	}
-
-	/* Write the new keyblock */
-	uint32_t more = keyblock->key_block_size;
 	memcpy(vblock->buf, keyblock, more);
-	/* and the new preamble */
-	memcpy(vblock->buf + more, preamble, preamble->preamble_size);
+	preamble = (VbFirmwarePreambleHeader *)(vblock->buf + more);
+	if (CreateFirmwarePreambleInto(opt->version, opt->kernel_subkey,
+				       body_sig, signkey, opt->flags,
+				       preamble, vblock->len - more)) {
+		fprintf(stderr, "Error creating firmware preamble.\n");
+		ScratchReset(&scratch);
+		return 1;
+	}
 
-	free(preamble);
-	free(body_sig);
+	ScratchReset(&scratch);
 
 	return 0;
 }
 
-static int write_loem(const char *ab, struct cb_area_s *vblock)
+static int write_loem(const struct local_data_s *opt, const char *ab,
+		      const char *id, struct cb_area_s *vblock)
 {
 	char filename[PATH_MAX];
 	int n;
+
 	n = snprintf(filename, sizeof(filename), "%s/vblock_%s.%s",
-		     option.loemdir ? option.loemdir : ".",
-		     ab, option.loemid);
+		     opt->loemdir ? opt->loemdir : ".", ab, id);
 	if (n >= sizeof(filename)) {
 		fprintf(stderr, "LOEM args produce bogus filename\n");
 		return 1;
 	}
 
-	FILE *fp = fopen(filename, "w");
-	if (!fp) {
-		fprintf(stderr, "Can't open %s for writing: %s\n",
-			filename, strerror(errno));
-		return 1;
-	}
-
-	if (1 != fwrite(vblock->buf, vblock->len, 1, fp)) {
-		fprintf(stderr, "Can't write to %s: %s\n",
-			filename, strerror(errno));
-		fclose(fp);
-		return 1;
-	}
-	if (fclose(fp)) {
-		fprintf(stderr, "Failed closing loem output: %s\n",
-			strerror(errno));
-		return 1;
-	}
-
-	return 0;
+	/* Written like any other output, so it can go in an --archive */
+	return futil_write_file(filename, vblock->buf, vblock->len) !=
+		FILE_ERR_NONE;
 }
 
-/* This signs a full BIOS image after it's been traversed. */
-static int sign_bios_at_end(struct futil_traverse_state_s *state)
+/* One firmware slot's worth of work for sign_bios_at_end() */
+struct fw_sign_job_s {
+	struct cb_area_s *vblock;
+	struct cb_area_s *fw_body;
+	VbPrivateKey *signkey;
+	VbKeyBlockHeader *keyblock;
+	const struct local_data_s *opt;
+	const char *filename;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	int current;
+	int retval;
+};
+
+static void fw_hash_job(void *arg, uint32_t index)
+{
+	struct fw_sign_job_s *job = (struct fw_sign_job_s *)arg + index;
+	DigestContext ctx;
+
+	futil_digest_region(job->opt->digest_cache, job->filename,
+			    job->fw_body->offset,
+			    job->fw_body->buf, job->fw_body->len,
+			    job->signkey->algorithm, &ctx);
+	DigestFinalInto(&ctx, job->digest);
+}
+
+static void fw_sign_job(void *arg, uint32_t index)
+{
+	struct fw_sign_job_s *job = (struct fw_sign_job_s *)arg + index;
+
+	if (job->current)
+		return;
+	job->retval = write_new_preamble(job->opt, job->vblock, job->fw_body,
+					 job->digest, job->signkey,
+					 job->keyblock);
+}
+
+/*
+ * With --skip_if_current, whether signing [job]'s slot would change nothing:
+ * its vblock has the keyblock asked for, whose data key is [signpub], and a
+ * preamble of the current format with the version, flags and kernel subkey
+ * asked for, signed by that key, whose body signature matches the digest.
+ */
+static int fw_vblock_is_current(const struct fw_sign_job_s *job,
+				const VbPublicKey *signpub)
+{
+	const struct local_data_s *opt = job->opt;
+	const VbKeyBlockHeader *keyblock = job->keyblock;
+	const VbFirmwarePreambleHeader *preamble;
+	const RSAPublicKey *rsa;
+	uint64_t more = keyblock->key_block_size;
+
+	if (more > job->vblock->len ||
+	    memcmp(job->vblock->buf, keyblock, more) ||
+	    !same_key(signpub, &keyblock->data_key))
+		return 0;
+
+	preamble = (VbFirmwarePreambleHeader *)(job->vblock->buf + more);
+	rsa = RSAKeyCacheGet(futil_rsa_cache(), &keyblock->data_key);
+	if (!rsa ||
+	    VerifyFirmwarePreamble(preamble, job->vblock->len - more, rsa) ||
+	    preamble->header_version_minor !=
+	    FIRMWARE_PREAMBLE_HEADER_VERSION_MINOR ||
+	    preamble->firmware_version != opt->version ||
+	    VbGetFirmwarePreambleFlags(preamble) != opt->flags ||
+	    !same_key(&preamble->kernel_subkey, opt->kernel_subkey) ||
+	    preamble->kernel_subkey.key_version !=
+	    opt->kernel_subkey->key_version ||
+	    preamble->body_signature.data_size != job->fw_body->len)
+		return 0;
+
+	return !VerifyDigest(job->digest, &preamble->body_signature, rsa);
+}
+
+/* Run func on both jobs, B on its own thread if we can get one. */
+static void run_fw_jobs(void (*func)(void *, uint32_t),
+			struct fw_sign_job_s *job)
+{
+	futil_run_jobs(func, NULL, job, 2, 0);
+}
+
+/* Body digests, by hash algorithm and by slot (A, B) */
+struct fw_digests_s {
+	uint8_t digest[SHA512_DIGEST_ALGORITHM + 1][2][SHA512_DIGEST_SIZE];
+	int valid[SHA512_DIGEST_ALGORITHM + 1];
+};
+
+/* Hashes both bodies for [key]'s algorithm, unless that's been done */
+static void fw_digests_for(struct fw_digests_s *d, struct fw_sign_job_s *job,
+			   VbPrivateKey *key)
+{
+	struct fw_sign_job_s tmp[2];
+	int h = hash_type_map[key->algorithm];
+	const uint8_t *bodies[2] = { job[0].fw_body->buf, job[1].fw_body->buf };
+	uint64_t lens[2] = { job[0].fw_body->len, job[1].fw_body->len };
+	uint8_t *digests[2] = { d->digest[h][0], d->digest[h][1] };
+	const char *cache_dir = job[0].opt->digest_cache;
+
+	if (d->valid[h])
+		return;
+	d->valid[h] = 1;
+
+	/*
+	 * Both in one pass of the multi-buffer hash, unless either might be
+	 * found in a store instead. Each of those lookups can wait on the
+	 * store, so they get a thread each.
+	 */
+	if (!futil_digest_region_stored(cache_dir, job[0].filename, lens[0]) &&
+	    !futil_digest_region_stored(cache_dir, job[1].filename, lens[1]) &&
+	    !DigestBufMulti(bodies, lens, 2, key->algorithm, digests))
+		return;
+
+	tmp[0] = job[0];
+	tmp[1] = job[1];
+	tmp[0].signkey = tmp[1].signkey = key;
+	run_fw_jobs(fw_hash_job, tmp);
+	memcpy(d->digest[h][0], tmp[0].digest, SHA512_DIGEST_SIZE);
+	memcpy(d->digest[h][1], tmp[1].digest, SHA512_DIGEST_SIZE);
+}
+
+/* Both vblocks for each --loems line */
+struct loem_batch_s {
+	struct fw_sign_job_s *job;	/* A, B for each LOEM */
+	int count;
+};
+
+/*
+ * Signs a vblock A and B for each --loems line, as if the image had been
+ * signed with its keys, and writes them out. The bodies are only hashed
+ * once for each hash algorithm the keys use, and the lines are signed in
+ * parallel.
+ */
+static int sign_loems(const struct local_data_s *opt, struct fw_sign_job_s *job,
+		      struct fw_digests_s *digests, int differ)
+{
+	struct loem_batch_s batch;
+	struct cb_area_s *area;
+	struct fw_sign_job_s *j;
+	const struct loem_s *loem;
+	int retval = 0;
+	int i, ab;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.count = 2 * opt->num_loems;
+	batch.job = calloc(batch.count, sizeof(*batch.job));
+	area = calloc(batch.count, sizeof(*area));
+	if (!batch.job || !area) {
+		fprintf(stderr, "Out of memory\n");
+		free(batch.job);
+		free(area);
+		return 1;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		loem = &opt->loems[i / 2];
+		ab = i % 2;
+		j = &batch.job[i];
+		*j = job[ab];
+		j->signkey = loem->signprivate ? loem->signprivate :
+			opt->signprivate;
+		j->keyblock = loem->keyblock ? loem->keyblock : opt->keyblock;
+		if (!ab && differ) {
+			j->signkey = loem->devsignprivate ?
+				loem->devsignprivate : opt->devsignprivate;
+			j->keyblock = loem->devkeyblock ?
+				loem->devkeyblock : opt->devkeyblock;
+		}
+		if (!j->signkey || !j->keyblock) {
+			fprintf(stderr, "LOEM %s has no DEV keys\n", loem->id);
+			retval = 1;
+			break;
+		}
+
+		/* Whatever follows the preamble stays as it was */
+		area[i] = *job[ab].vblock;
+		area[i].buf = malloc(area[i].len);
+		if (!area[i].buf) {
+			fprintf(stderr, "Out of memory\n");
+			retval = 1;
+			break;
+		}
+		memcpy(area[i].buf, job[ab].vblock->buf, area[i].len);
+		j->vblock = &area[i];
+
+		fw_digests_for(digests, job, j->signkey);
+		memcpy(j->digest,
+		       digests->digest[hash_type_map[j->signkey->algorithm]][ab],
+		       SHA512_DIGEST_SIZE);
+	}
+
+	if (!retval) {
+		futil_run_jobs(fw_sign_job, NULL, batch.job, batch.count, 0);
+
+		for (i = 0; i < batch.count; i++) {
+			retval |= batch.job[i].retval;
+			if (!batch.job[i].retval)
+				retval |= write_loem(opt, i % 2 ? "B" : "A",
+						     opt->loems[i / 2].id,
+						     &area[i]);
+		}
+	}
+
+	for (i = 0; i < batch.count; i++)
+		free(area[i].buf);
+	free(area);
+	free(batch.job);
+	return retval;
+}
+
+/*
+ * Store the SHA-256 of the CBFS file "ecrw" in the signed part of a firmware
+ * body in its "ecrw.hash" file, so EC software sync can compare hashes
+ * instead of hashing the image at boot. Returns 1 if the hash changed, 0 if
+ * it was already right, or -1 on error.
+ */
+static int update_ecrw_hash(struct futil_traverse_state_s *state,
+			    enum futil_cb_component c, const char *name)
+{
+	struct cb_area_s *area = &state->cb_area[c];
+	const CbfsIndex *idx = futil_cbfs_index(state, c);
+	const CbfsEntry *rw, *hash;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+
+	rw = cbfs_index_find(idx, "ecrw");
+	hash = cbfs_index_find(idx, "ecrw.hash");
+	if (!rw) {
+		fprintf(stderr, "%s has no signed ecrw file\n", name);
+		return -1;
+	}
+	if (!hash || hash->len != SHA256_DIGEST_SIZE) {
+		fprintf(stderr, "%s has no signed %d-byte ecrw.hash file\n",
+			name, SHA256_DIGEST_SIZE);
+		return -1;
+	}
+
+	internal_SHA256(area->buf + rw->data_offset, rw->len, digest);
+	if (!memcmp(area->buf + hash->data_offset, digest, sizeof(digest)))
+		return 0;
+
+	memcpy(area->buf + hash->data_offset, digest, sizeof(digest));
+	futil_mark_dirty(state, area->offset + hash->data_offset,
+			 sizeof(digest));
+	return 1;
+}
+
+/* This signs a full BIOS image after it's been traversed. */
+static int sign_bios_at_end(struct futil_traverse_state_s *state)
 {
+	struct local_data_s *opt = state->cb_data;
 	struct cb_area_s *vblock_a = &state->cb_area[CB_FMAP_VBLOCK_A];
 	struct cb_area_s *vblock_b = &state->cb_area[CB_FMAP_VBLOCK_B];
 	struct cb_area_s *fw_a = &state->cb_area[CB_FMAP_FW_MAIN_A];
 	struct cb_area_s *fw_b = &state->cb_area[CB_FMAP_FW_MAIN_B];
+	struct fw_sign_job_s job[2] = {
+		{ vblock_a, fw_a, opt->signprivate, opt->keyblock,
+		  opt, state->in_filename },
+		{ vblock_b, fw_b, opt->signprivate, opt->keyblock,
+		  opt, state->in_filename },
+	};
+	struct fw_digests_s digests;
+	int differ;
 	int retval = 0;
 
 	if (state->errors ||
@@ -466,35 +1424,85 @@ static int sign_bios_at_end(struct futil_traverse_state_s *state)
 		return 1;
 	}
 
-	/* Do A & B differ ? */
-	if (fw_a->len != fw_b->len ||
-	    memcmp(fw_a->buf, fw_b->buf, fw_a->len)) {
+	/*
+	 * The EC hashes go in the bodies before those are hashed. A body
+	 * that's changed no longer matches the input file, so its digest
+	 * can't come from the cache.
+	 */
+	if (opt->ecrw_hash) {
+		int changed_a = update_ecrw_hash(state, CB_FMAP_FW_MAIN_A,
+						 "FW_MAIN_A");
+		int changed_b = update_ecrw_hash(state, CB_FMAP_FW_MAIN_B,
+						 "FW_MAIN_B");
+
+		if (changed_a < 0 || changed_b < 0)
+			return 1;
+		if (changed_a)
+			job[0].filename = NULL;
+		if (changed_b)
+			job[1].filename = NULL;
+	}
+
+	/* Hash both bodies with the normal key's algorithm */
+	memset(&digests, 0, sizeof(digests));
+	fw_digests_for(&digests, job, opt->signprivate);
+	memcpy(job[0].digest,
+	       digests.digest[hash_type_map[opt->signprivate->algorithm]][0],
+	       SHA512_DIGEST_SIZE);
+	memcpy(job[1].digest,
+	       digests.digest[hash_type_map[opt->signprivate->algorithm]][1],
+	       SHA512_DIGEST_SIZE);
+
+	/*
+	 * Do A & B differ? Comparing digests is as strong as the signature
+	 * itself, and saves a pass over the data.
+	 */
+	differ = fw_a->len != fw_b->len ||
+		memcmp(job[0].digest, job[1].digest,
+		       hash_size_map[opt->signprivate->algorithm]);
+	if (differ) {
 		/* Yes, must use DEV keys for A */
-		if (!option.devsignprivate || !option.devkeyblock) {
+		if (!opt->devsignprivate || !opt->devkeyblock) {
 			fprintf(stderr,
 				"FW A & B differ. DEV keys are required.\n");
 			return 1;
 		}
-		retval |= write_new_preamble(vblock_a, fw_a,
-					     option.devsignprivate,
-					     option.devkeyblock);
-	} else {
-		retval |= write_new_preamble(vblock_a, fw_a,
-					     option.signprivate,
-					     option.keyblock);
+		job[0].signkey = opt->devsignprivate;
+		job[0].keyblock = opt->devkeyblock;
+		fw_digests_for(&digests, job, opt->devsignprivate);
+		memcpy(job[0].digest, digests.digest[
+			       hash_type_map[opt->devsignprivate->algorithm]][0],
+		       SHA512_DIGEST_SIZE);
 	}
 
-	/* FW B is always normal keys */
-	retval |= write_new_preamble(vblock_b, fw_b,
-				     option.signprivate,
-				     option.keyblock);
-
+	/* The LOEM vblocks start from the image's, before it's signed */
+	if (opt->num_loems)
+		retval |= sign_loems(opt, job, &digests, differ);
 
+	/* A slot that's already signed just so is left alone */
+	if (opt->skip_if_current) {
+		job[0].current = fw_vblock_is_current(&job[0], differ ?
+						      opt->devsignpub :
+						      opt->signpub);
+		job[1].current = fw_vblock_is_current(&job[1], opt->signpub);
+		if (job[0].current)
+			Debug("VBLOCK_A is already signed\n");
+		if (job[1].current)
+			Debug("VBLOCK_B is already signed\n");
+	}
 
+	/* FW B is always normal keys */
+	run_fw_jobs(fw_sign_job, job);
+	retval |= job[0].retval;
+	retval |= job[1].retval;
+	if (!job[0].current)
+		futil_mark_dirty(state, vblock_a->offset, vblock_a->len);
+	if (!job[1].current)
+		futil_mark_dirty(state, vblock_b->offset, vblock_b->len);
 
-	if (option.loemid) {
-		retval |= write_loem("A", vblock_a);
-		retval |= write_loem("B", vblock_b);
+	if (opt->loemid) {
+		retval |= write_loem(opt, "A", opt->loemid, vblock_a);
+		retval |= write_loem(opt, "B", opt->loemid, vblock_b);
 	}
 
 	return retval;
@@ -507,6 +1515,9 @@ int futil_cb_sign_end(struct futil_traverse_state_s *state)
 	case FILE_TYPE_OLD_BIOS_IMAGE:
 		return sign_bios_at_end(state);
 
+	case FILE_TYPE_CHROMIUMOS_DISK:
+		return sign_disk_at_end(state);
+
 	default:
 		/* Any other cleanup needed? */
 		break;
@@ -524,7 +1535,17 @@ static const char usage[] = "\n"
 	"  raw firmware blob (FW_MAIN_A/B); OUTFILE is a VBLOCK_A/B\n"
 	"  complete firmware image (bios.bin)\n"
 	"  raw linux kernel; OUTFILE is a kernel partition image\n"
-	"  kernel partition image (/dev/sda2, /dev/mmcblk0p2)\n";
+	"  kernel partition image (/dev/sda2, /dev/mmcblk0p2)\n"
+	"  Chrome OS disk image (chromiumos_image.bin, /dev/sda)\n"
+	"\n"
+	"INFILE may be \"-\" to read stdin, and OUTFILE \"-\" to write to\n"
+	"stdout.\n"
+	"\n"
+	"Any FILE.vbpubk or FILE.keyblock below may instead be STORE:ID,\n"
+	"naming a key in a store made by \"" MYNAME " keystore\". Also,\n"
+	"\n"
+	"  -K|--storedkey   STORE:ID        Acts as -b for a stored keyblock,\n"
+	"                                     or as -k for a stored pubkey\n";
 
 static const char usage_pubkey[] = "\n"
 	"-----------------------------------------------------------------\n"
@@ -547,7 +1568,16 @@ static const char usage_pubkey[] = "\n"
 	"  -f|--flags       NUM             Flags specifying use conditions\n"
 	"  --pem_external   PROGRAM"
 	"         External program to compute the signature\n"
-	"                                     (requires a PEM signing key)\n";
+	"                                     (requires a PEM signing key)\n"
+	"  --pem_persistent"
+	"                 Start PROGRAM once, as \"PROGRAM FILE.pem\n"
+	"                                     --persistent\", and send it each\n"
+	"                                     request on stdin as a 4-byte\n"
+	"                                     big-endian length and the data;\n"
+	"                                     it answers each the same way\n"
+	"\n"
+	"With --vb21, INFILE may be a vb21 packed key too, and OUTFILE is a\n"
+	"vb21 keyblock.\n";
 
 static const char usage_fw_main[] = "\n"
 	"-----------------------------------------------------------------\n"
@@ -565,7 +1595,18 @@ static const char usage_fw_main[] = "\n"
 	"\n"
 	"Optional PARAMS:\n"
 	"  -f|--flags       NUM             The preamble flags value"
-	" (default is 0)\n";
+	" (default is 0)\n"
+	"  --digest_cache   DIR             Reuse body hashes of input files\n"
+	"                                     unchanged since an earlier run\n"
+	"  --digest_remote  PROG            Share body hashes with other\n"
+	"                                     machines through the store PROG\n"
+	"                                     talks to\n"
+	"\n"
+	"With --vb21, -b is a vb21 keyblock, there's no -k, and OUTFILE is a\n"
+	"vb21 keyblock and preamble. Also,\n"
+	"\n"
+	"  --hash_chunk     NUM             Hash the body in pieces of this\n"
+	"                                     many bytes (default 65536)\n";
 
 static const char usage_bios[] = "\n"
 	"-----------------------------------------------------------------\n"
@@ -577,7 +1618,10 @@ static const char usage_bios[] = "\n"
 	"                                     public firmware data key\n"
 	"  -k|--kernelkey   FILE.vbpubk     The public kernel subkey\n"
 	"  [--infile]       INFILE          Input firmware image (modified\n"
-	"                                     in place if no OUTFILE given)\n"
+	"                                     in place if no OUTFILE given).\n"
+	"                                     It can be the flash itself\n"
+	"                                     (/dev/mtdN), which is only read\n"
+	"                                     and written where it has to be\n"
 	"\n"
 	"These are required if the A and B firmware differ:\n"
 	"  -S|--devsign     FILE.vbprivk    The DEV private firmware data key\n"
@@ -592,7 +1636,24 @@ static const char usage_bios[] = "\n"
 	"                                     unchanged, or 0 if unknown)\n"
 	"  -d|--loemdir     DIR             Local OEM output vblock directory\n"
 	"  -l|--loemid      STRING          Local OEM vblock suffix\n"
-	"  [--outfile]      OUTFILE         Output firmware image\n";
+	"  --loems          FILE            Also write LOEM vblocks for each\n"
+	"                                     line \"ID [-s FILE] [-b FILE]\n"
+	"                                     [-S FILE] [-B FILE]\" of FILE,\n"
+	"                                     with the keys above for any it\n"
+	"                                     doesn't give\n"
+	"  --ecrw_hash                      Store the SHA-256 of each body's\n"
+	"                                     CBFS file ecrw in its ecrw.hash\n"
+	"                                     before signing\n"
+	"  [--outfile]      OUTFILE         Output firmware image\n"
+	"  --nosync                         Don't wait for in-place changes\n"
+	"                                     to reach the disk\n"
+	"  --skip_if_current                Don't sign or write what's\n"
+	"                                     already signed as asked\n"
+	"  --digest_cache   DIR             Reuse body hashes of input files\n"
+	"                                     unchanged since an earlier run\n"
+	"  --digest_remote  PROG            Share body hashes with other\n"
+	"                                     machines through the store PROG\n"
+	"                                     talks to\n";
 
 static const char usage_new_kpart[] = "\n"
 	"-----------------------------------------------------------------\n"
@@ -619,7 +1680,12 @@ static const char usage_new_kpart[] = "\n"
 	"                                     (default 0x%x)\n"
 	" --vblockonly                      Emit just the vblock (requires a\n"
 	"                                     distinct outfile)\n"
-	"  -f|--flags       NUM             The preamble flags value\n";
+	"  -f|--flags       NUM             The preamble flags value\n"
+	"  --digest_cache   DIR             Reuse body hashes of input files\n"
+	"                                     unchanged since an earlier run\n"
+	"  --digest_remote  PROG            Share body hashes with other\n"
+	"                                     machines through the store PROG\n"
+	"                                     talks to\n";
 
 static const char usage_old_kpart[] = "\n"
 	"-----------------------------------------------------------------\n"
@@ -641,7 +1707,150 @@ static const char usage_old_kpart[] = "\n"
 	"  [--outfile]      OUTFILE         Output kernel partition or vblock\n"
 	"  --vblockonly                     Emit just the vblock (requires a\n"
 	"                                     distinct OUTFILE)\n"
-	"  -f|--flags       NUM             The preamble flags value\n"
+	"  --nosync                         Don't wait for in-place changes\n"
+	"                                     to reach the disk\n"
+	"  --skip_if_current                Don't sign or write what's\n"
+	"                                     already signed as asked\n"
+	"  --hashcache      DIR             Keep partial kernel hashes here,\n"
+	"                                     so a later --config change only\n"
+	"                                     rehashes what follows the kernel\n"
+	"  --old_subkey     FILE.vbpubk     Don't rehash a kernel whose\n"
+	"                                     keyblock this key signed; sign\n"
+	"                                     the digest its body signature\n"
+	"                                     holds instead\n"
+	"  -f|--flags       NUM             The preamble flags value\n";
+
+static const char usage_disk[] = "\n"
+	"-----------------------------------------------------------------\n"
+	"To resign the kernel partitions of a Chrome OS disk image:\n"
+	"\n"
+	"  Every kernel partition that holds a kernel is resigned at once,\n"
+	"  taking the PARAMS for an existing kernel partition (except\n"
+	"  --vblockonly). With no OUTFILE, only what changes is written.\n";
+
+static const char usage_batch[] = "\n"
+	"-----------------------------------------------------------------\n"
+	"To sign many files at once:\n"
+	"\n"
+	"Required PARAMS:\n"
+	"  --batch          FILE            Manifest with one set of PARAMS,\n"
+	"                                     INFILE and OUTFILE per line\n"
+	"\n"
+	"Optional PARAMS:\n"
+	"  --jobs           NUM             Number of files to sign in\n"
+	"                                     parallel (default is one per CPU,\n"
+	"                                     or two per --node)\n"
+	"  --group_commit   NUM             Make the outputs safe on disk NUM\n"
+	"                                     at a time, each only put in\n"
+	"                                     place once it's there (not with\n"
+	"                                     --node)\n"
+	"  --archive        FILE            Put the new files in one tar\n"
+	"                                     archive (\"-\" for stdout)\n"
+	"                                     under their OUTFILE names, with\n"
+	"                                     an index of where each starts\n"
+	"                                     (not with --node)\n"
+	"  --journal        FILE            Note each line in FILE as it's\n"
+	"                                     done, and skip the lines FILE\n"
+	"                                     says were done if their inputs,\n"
+	"                                     keys, options and outputs are\n"
+	"                                     the same (not with --node,\n"
+	"                                     --group_commit or --archive)\n"
+	"  --node           SOCKET          Send the lines to the \"" MYNAME "\n"
+	"                                     serve\" server on SOCKET; give it\n"
+	"                                     once for each server to use\n"
+	"\n"
+	"  Any other PARAMS given on the command line apply to every line.\n"
+	"  Each key file is read only once, and the inputs of the next few\n"
+	"  lines are read ahead while each is signed. Blank lines and text\n"
+	"  following a '#' are ignored.\n"
+	"\n"
+	"  With --node, each line goes to the server with the fewest lines\n"
+	"  outstanding, preferring one that has already used the same keys.\n"
+	"  A line is tried on another server if its server can't be reached,\n"
+	"  but not if its server got it and didn't answer, and a server that\n"
+	"  keeps failing is dropped.\n"
+	"\n"
+	"  With --journal, a batch that was stopped part way can be run again\n"
+	"  to sign only what it hadn't finished.\n"
+	"\n";
+
+static const char usage_watch[] = "\n"
+	"-----------------------------------------------------------------\n"
+	"To sign files as they're written to a directory:\n"
+	"\n"
+	"Required PARAMS:\n"
+	"  --watch          DIR             Directory to watch\n"
+	"  --rules          FILE            One PATTERN and the PARAMS,\n"
+	"                                     INFILE and OUTFILE to sign the\n"
+	"                                     files matching it per line\n"
+	"\n"
+	"  PATTERN is a shell wildcard for the names of the files in DIR.\n"
+	"  In the rest of the line, {} stands for the pathname of the file\n"
+	"  that changed and {.} for the same without its extension. The\n"
+	"  first rule that matches is used. Changes are gathered until DIR\n"
+	"  has been quiet for a moment, and then each changed file is\n"
+	"  signed once. Keys are read only once, so any PARAMS on the\n"
+	"  command line (a --digest_cache, say) apply to every file. Runs\n"
+	"  until interrupted.\n"
+	"\n";
+
+static const char usage_sched[] = "\n"
+	"-----------------------------------------------------------------\n"
+	"To keep within the limits of a signing service (an HSM, say):\n"
+	"\n"
+	"Optional PARAMS, for any of the above:\n"
+	"  --sign_rate      NUM             Start at most NUM signatures a\n"
+	"                                     second with each key\n"
+	"  --sign_burst     NUM             But allow NUM at once after a\n"
+	"                                     lull (default 1)\n"
+	"  --sign_window    NUM             Have at most NUM signatures with\n"
+	"                                     each key outstanding at once\n"
+	"  --priority       CLASS           release, nightly or dev (the\n"
+	"                                     default); waiting signatures\n"
+	"                                     start in that order\n"
+	"\n"
+	"  The limits apply to each key file across every thread, so they\n"
+	"  hold for a whole batch, or a whole serve session. A signature\n"
+	"  that's already being made for one thread is shared with any other\n"
+	"  that asks for the same one meanwhile. Keys given as --pem_external\n"
+	"  without --pem_persistent are not limited.\n"
+	"\n";
+
+static const char usage_split[] = "\n"
+	"-----------------------------------------------------------------\n"
+	"To sign with keys kept somewhere else:\n"
+	"\n"
+	"Optional PARAMS, for any of the above but --node and --watch:\n"
+	"  --emit_digests   FILE            Don't write anything, but list\n"
+	"                                     the signatures needed in FILE\n"
+	"  --attach_signatures FILE         Take the signatures from FILE\n"
+	"\n"
+	"  With --emit_digests, each line of FILE names a private key as it\n"
+	"  was given, its algorithm, and the DigestInfo-prefixed digest to\n"
+	"  sign, in hex: all that the signer needs to see. Wherever the keys\n"
+	"  are, add the PKCS #1 v1.5 signature of each digest that has none\n"
+	"  to the end of its line, in hex. A preamble covers its body's\n"
+	"  signature, so run the command again with both options, taking\n"
+	"  the signatures from the signed FILE and listing those still\n"
+	"  needed, until it says they're all there. Then run it with just\n"
+	"  --attach_signatures to make the real output. A private key may\n"
+	"  be given as its .vbpubk instead.\n"
+	"\n";
+
+static const char usage_verify[] = "\n"
+	"-----------------------------------------------------------------\n"
+	"To check each output once it's written:\n"
+	"\n"
+	"Optional PARAMS, for any of the above but --emit_digests:\n"
+	"  --verify_after                   Read the output back and verify\n"
+	"                                     it as \"" MYNAME " show\" would\n"
+	"\n"
+	"  The keyblocks, preambles and signatures are read from what was\n"
+	"  written and checked with the public halves of the keys they hold,\n"
+	"  so a mismatched key or a bad write is caught. Bodies that were\n"
+	"  just signed aren't hashed again: their signatures are checked\n"
+	"  against the digests that were signed. Not with --vblockonly,\n"
+	"  --group_commit or --archive, or for a block device.\n"
 	"\n";
 
 static void print_help(const char *prog)
@@ -652,6 +1861,12 @@ static void print_help(const char *prog)
 	printf(usage_bios, option.version);
 	printf(usage_new_kpart, option.kloadaddr, option.padding);
 	printf(usage_old_kpart, option.padding);
+	puts(usage_disk);
+	puts(usage_batch);
+	puts(usage_watch);
+	puts(usage_sched);
+	puts(usage_split);
+	puts(usage_verify);
 }
 
 enum no_short_opts {
@@ -666,6 +1881,32 @@ enum no_short_opts {
 	OPT_PEM_SIGNPRIV,
 	OPT_PEM_ALGO,
 	OPT_PEM_EXTERNAL,
+	OPT_PEM_PERSISTENT,
+	OPT_VBLOCKONLY,
+	OPT_BATCH,
+	OPT_JOBS,
+	OPT_NODE,
+	OPT_WATCH,
+	OPT_RULES,
+	OPT_SIGN_RATE,
+	OPT_SIGN_BURST,
+	OPT_SIGN_WINDOW,
+	OPT_PRIORITY,
+	OPT_LOEMS,
+	OPT_ECRW_HASH,
+	OPT_NOSYNC,
+	OPT_HASHCACHE,
+	OPT_OLD_SUBKEY,
+	OPT_DIGEST_CACHE,
+	OPT_DIGEST_REMOTE,
+	OPT_HASH_CHUNK,
+	OPT_EMIT_DIGESTS,
+	OPT_ATTACH_SIGNATURES,
+	OPT_GROUP_COMMIT,
+	OPT_ARCHIVE,
+	OPT_JOURNAL,
+	OPT_VERIFY_AFTER,
+	OPT_SKIP_IF_CURRENT,
 };
 
 static const struct option long_opts[] = {
@@ -673,12 +1914,15 @@ static const struct option long_opts[] = {
 	{"signprivate",  1, NULL, 's'},
 	{"keyblock",     1, NULL, 'b'},
 	{"kernelkey",    1, NULL, 'k'},
+	{"storedkey",    1, NULL, 'K'},
 	{"devsign",      1, NULL, 'S'},
 	{"devkeyblock",  1, NULL, 'B'},
 	{"version",      1, NULL, 'v'},
 	{"flags",        1, NULL, 'f'},
 	{"loemdir",      1, NULL, 'd'},
 	{"loemid",       1, NULL, 'l'},
+	{"loems",        1, NULL, OPT_LOEMS},
+	{"ecrw_hash",    0, NULL, OPT_ECRW_HASH},
 	{"fv",           1, NULL, OPT_FV},
 	{"infile",       1, NULL, OPT_INFILE},
 	{"datapubkey",   1, NULL, OPT_INFILE},	/* alias */
@@ -692,59 +1936,423 @@ static const struct option long_opts[] = {
 	{"pem_signpriv", 1, NULL, OPT_PEM_SIGNPRIV},
 	{"pem_algo",     1, NULL, OPT_PEM_ALGO},
 	{"pem_external", 1, NULL, OPT_PEM_EXTERNAL},
-	{"vblockonly",   0, &option.vblockonly, 1},
+	{"pem_persistent", 0, NULL, OPT_PEM_PERSISTENT},
+	{"vblockonly",   0, NULL, OPT_VBLOCKONLY},
+	{"batch",        1, NULL, OPT_BATCH},
+	{"jobs",         1, NULL, OPT_JOBS},
+	{"group_commit", 1, NULL, OPT_GROUP_COMMIT},
+	{"archive",      1, NULL, OPT_ARCHIVE},
+	{"journal",      1, NULL, OPT_JOURNAL},
+	{"node",         1, NULL, OPT_NODE},
+	{"watch",        1, NULL, OPT_WATCH},
+	{"rules",        1, NULL, OPT_RULES},
+	{"sign_rate",    1, NULL, OPT_SIGN_RATE},
+	{"sign_burst",   1, NULL, OPT_SIGN_BURST},
+	{"sign_window",  1, NULL, OPT_SIGN_WINDOW},
+	{"priority",     1, NULL, OPT_PRIORITY},
+	{"nosync",       0, NULL, OPT_NOSYNC},
+	{"hashcache",    1, NULL, OPT_HASHCACHE},
+	{"old_subkey",   1, NULL, OPT_OLD_SUBKEY},
+	{"digest_cache", 1, NULL, OPT_DIGEST_CACHE},
+	{"digest_remote", 1, NULL, OPT_DIGEST_REMOTE},
+	{"hash_chunk",   1, NULL, OPT_HASH_CHUNK},
+	{"emit_digests", 1, NULL, OPT_EMIT_DIGESTS},
+	{"attach_signatures", 1, NULL, OPT_ATTACH_SIGNATURES},
+	{"verify_after", 0, NULL, OPT_VERIFY_AFTER},
+	{"skip_if_current", 0, NULL, OPT_SKIP_IF_CURRENT},
 	{"debug",        0, &debugging_enabled, 1},
 	{NULL,           0, NULL, 0},
 };
-static char *short_opts = ":s:b:k:S:B:v:f:d:l:";
+static char *short_opts = ":s:b:k:K:S:B:v:f:d:l:";
 
-static int do_sign(int argc, char *argv[])
+/* Keys are read once and then shared by every job in a batch */
+enum key_kind {
+	KEY_PRIVATE,
+	KEY_KEYBLOCK,
+	KEY_PUBLIC,
+	KEY_VB21_KEYBLOCK,
+};
+
+/*
+ * A kept key is only good while its file is the one it was read from, so
+ * rotating a key in place doesn't leave a server signing with the old one.
+ * One command sees the same key all the way through, though.
+ */
+struct key_cache_s {
+	struct key_cache_s *next;
+	char *filename;
+	enum key_kind kind;
+	void *key;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+static struct key_cache_s *key_cache;
+
+void futil_sign_keep_keys(void)
+{
+	keep_keys = 1;
+}
+
+/* Stats a key file, or the key store a STORE:ID names */
+static int key_stat(const char *filename, struct stat *sb)
+{
+	if (!stat(filename, sb))
+		return 0;
+	return futil_keystore_stat(filename, sb);
+}
+
+static int key_unchanged(const struct key_cache_s *k, const struct stat *sb)
+{
+	return k->dev == sb->st_dev && k->ino == sb->st_ino &&
+		k->size == sb->st_size &&
+		k->mtime.tv_sec == sb->st_mtim.tv_sec &&
+		k->mtime.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+static void free_cached_key(struct key_cache_s *k)
+{
+	if (k->kind == KEY_PRIVATE)
+		PrivateKeyFree(k->key);
+	else
+		free(k->key);
+	free(k->filename);
+	free(k);
+}
+
+void futil_sign_refresh_keys(int all)
+{
+	struct key_cache_s **kp, *k;
+	struct stat sb;
+	int dropped = 0;
+
+	for (kp = &key_cache; (k = *kp); ) {
+		if (all || key_stat(k->filename, &sb) ||
+		    !key_unchanged(k, &sb)) {
+			*kp = k->next;
+			free_cached_key(k);
+			dropped = 1;
+		} else {
+			kp = &k->next;
+		}
+	}
+
+	/* The signatures remembered for a key file go with its old key */
+	if (dropped)
+		PrivateKeyScheduledCleanup();
+}
+
+static struct vb21_keyblock *read_vb21_keyblock(const char *filename)
 {
-	char *infile = 0;
-	int i;
-	int ifd = -1;
-	int errorcnt = 0;
-	struct futil_traverse_state_s state;
 	uint8_t *buf;
-	uint32_t buf_len;
-	char *e = 0;
+	uint64_t len;
+
+	buf = ReadFile(filename, &len);
+	if (!buf)
+		return NULL;
+	if (Vb21VerifyKeyblock((struct vb21_keyblock *)buf, len, NULL)) {
+		fprintf(stderr, "%s isn't a vb21 keyblock\n", filename);
+		free(buf);
+		return NULL;
+	}
+	return (struct vb21_keyblock *)buf;
+}
+
+/*
+ * When signing is split, a private key only has to say what algorithm it
+ * uses, so its .vbpubk will do. The signatures are asked for by [name].
+ */
+static VbPrivateKey *read_split_key(const char *filename, const char *name)
+{
 	enum futil_file_type type;
-	int inout_file_count = 0;
-	int mapping;
+	VbPrivateKey *priv;
+	VbPublicKey *pub;
+	uint64_t algorithm;
+
+	if (futil_file_type(filename, &type))
+		return NULL;
+	if (type == FILE_TYPE_PUBKEY) {
+		pub = PublicKeyRead(filename);
+		if (!pub)
+			return NULL;
+		algorithm = pub->algorithm;
+		free(pub);
+	} else {
+		priv = PrivateKeyRead(filename);
+		if (!priv)
+			return NULL;
+		algorithm = priv->algorithm;
+		PrivateKeyFree(priv);
+	}
+	return PrivateKeySplit(split, name, algorithm);
+}
+
+static void *read_key(const char *filename, enum key_kind kind)
+{
+	enum futil_file_type type;
+	struct key_cache_s *k;
+	const char *name = filename;
+	void *key = NULL;
+	char *path = NULL;
+	struct stat sb;
+	int have_stat = 0;
+
+	if (batch_mode || keep_keys) {
+		/* The same relative name may mean different files over time */
+		path = realpath(filename, NULL);
+		if (path)
+			filename = path;
+		for (k = key_cache; k; k = k->next)
+			if (k->kind == kind && !strcmp(k->filename, filename)) {
+				free(path);
+				return k->key;
+			}
+		/* Before reading it, so a change in between isn't missed */
+		have_stat = !key_stat(filename, &sb);
+	}
+
+	switch (kind) {
+	case KEY_PRIVATE:
+		key = split ? read_split_key(filename, name) :
+			PrivateKeyRead(filename);
+		/* It'll be used over and over, by any of the threads */
+		if (!split && (batch_mode || keep_keys))
+			PrivateKeyPrepare(key);
+		break;
+	case KEY_KEYBLOCK:
+		if (futil_is_keystore_spec(filename)) {
+			type = FILE_TYPE_KEYBLOCK;
+			key = futil_keystore_read(filename, &type);
+		} else {
+			key = KeyBlockRead(filename);
+		}
+		break;
+	case KEY_PUBLIC:
+		if (futil_is_keystore_spec(filename)) {
+			type = FILE_TYPE_PUBKEY;
+			key = futil_keystore_read(filename, &type);
+		} else {
+			key = PublicKeyRead(filename);
+		}
+		break;
+	case KEY_VB21_KEYBLOCK:
+		key = read_vb21_keyblock(filename);
+		break;
+	}
+
+	/* Without a stat it's dropped at the next refresh */
+	if (key && (batch_mode || keep_keys)) {
+		k = calloc(1, sizeof(*k));
+		if (k) {
+			k->filename = strdup(filename);
+			k->kind = kind;
+			k->key = key;
+			if (have_stat) {
+				k->dev = sb.st_dev;
+				k->ino = sb.st_ino;
+				k->size = sb.st_size;
+				k->mtime = sb.st_mtim;
+			}
+			k->next = key_cache;
+			key_cache = k;
+		}
+	}
+
+	free(path);
+	return key;
+}
+
+#define MAX_LOEM_ARGS 9
+
+/* Reads a --loems file into option.loems */
+static int read_loems(const char *filename)
+{
+	struct loem_s *loem;
+	char *line = NULL;
+	size_t linesize = 0;
+	char *argv[MAX_LOEM_ARGS];
+	int argc, lineno = 0;
+	int errorcnt = 0;
+	int i;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s: %s\n", filename,
+			strerror(errno));
+		return 1;
+	}
+
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		argc = futil_split_line(line, argv, MAX_LOEM_ARGS);
+		if (!argc)
+			continue;
+		if (argc < 0 || !(argc % 2)) {
+			fprintf(stderr, "%s:%d: need an ID and pairs of"
+				" -s, -b, -S or -B and a FILE\n",
+				filename, lineno);
+			errorcnt++;
+			continue;
+		}
+
+		loem = realloc(option.loems,
+			       (option.num_loems + 1) * sizeof(*loem));
+		if (!loem) {
+			fprintf(stderr, "Out of memory\n");
+			errorcnt++;
+			break;
+		}
+		option.loems = loem;
+		loem = &option.loems[option.num_loems];
+		memset(loem, 0, sizeof(*loem));
+		loem->id = strdup(argv[0]);
+		if (!loem->id) {
+			fprintf(stderr, "Out of memory\n");
+			errorcnt++;
+			break;
+		}
+		option.num_loems++;
+
+		for (i = 1; i < argc; i += 2) {
+			void **key;
+			enum key_kind kind;
+
+			if (!strcmp(argv[i], "-s")) {
+				key = (void **)&loem->signprivate;
+				kind = KEY_PRIVATE;
+			} else if (!strcmp(argv[i], "-b")) {
+				key = (void **)&loem->keyblock;
+				kind = KEY_KEYBLOCK;
+			} else if (!strcmp(argv[i], "-S")) {
+				key = (void **)&loem->devsignprivate;
+				kind = KEY_PRIVATE;
+			} else if (!strcmp(argv[i], "-B")) {
+				key = (void **)&loem->devkeyblock;
+				kind = KEY_KEYBLOCK;
+			} else {
+				fprintf(stderr, "%s:%d: unknown option %s\n",
+					filename, lineno, argv[i]);
+				errorcnt++;
+				continue;
+			}
+			if (*key) {
+				fprintf(stderr, "%s:%d: %s given twice\n",
+					filename, lineno, argv[i]);
+				errorcnt++;
+				continue;
+			}
+			*key = read_key(argv[i + 1], kind);
+			if (!*key) {
+				fprintf(stderr, "Error reading %s\n",
+					argv[i + 1]);
+				errorcnt++;
+			}
+		}
+	}
+	free(line);
+	fclose(fp);
+	return errorcnt;
+}
+
+/* Uses a keyblock from a key store as -b, or a public key as -k */
+static void *read_stored_key(const char *spec)
+{
+	enum futil_file_type type = FILE_TYPE_UNKNOWN;
+	void *key;
+
+	key = futil_keystore_read(spec, &type);
+	if (!key)
+		return NULL;
+	free(key);
+
+	if (type == FILE_TYPE_KEYBLOCK)
+		return option.keyblock = read_key(spec, KEY_KEYBLOCK);
+	return option.kernel_subkey = read_key(spec, KEY_PUBLIC);
+}
+
+/* Keys that aren't cached belong to whoever read them */
+static void free_loems(struct local_data_s *opt)
+{
+	struct loem_s *loem;
+	int i;
+
+	for (i = 0; i < opt->num_loems; i++) {
+		loem = &opt->loems[i];
+		if (!batch_mode && !keep_keys) {
+			PrivateKeyFree(loem->signprivate);
+			free(loem->keyblock);
+			PrivateKeyFree(loem->devsignprivate);
+			free(loem->devkeyblock);
+		}
+		free(loem->id);
+	}
+	free(opt->loems);
+	opt->loems = NULL;
+	opt->num_loems = 0;
+}
+
+static void free_key_cache(void)
+{
+	futil_sign_refresh_keys(1);
+}
+
+/* Parse the options into option. Returns the number of errors. */
+static int parse_sign_opts(int argc, char *argv[], char **infile,
+			   int *inout_file_count)
+{
+	char **nodes;
+	char *e = 0;
+	int errorcnt = 0;
+	int i;
 
 	opterr = 0;		/* quiet, you */
 	while ((i = getopt_long(argc, argv, short_opts, long_opts, 0)) != -1) {
 		switch (i) {
 		case 's':
-			option.signprivate = PrivateKeyRead(optarg);
+			option.signprivate_name = optarg;
+			option.signprivate = read_key(optarg, KEY_PRIVATE);
 			if (!option.signprivate) {
 				fprintf(stderr, "Error reading %s\n", optarg);
 				errorcnt++;
 			}
 			break;
 		case 'b':
-			option.keyblock = KeyBlockRead(optarg);
-			if (!option.keyblock) {
+			if (vboot_version == VBOOT_VERSION_2_1 ?
+			    !(option.keyblock21 = read_key(optarg,
+							   KEY_VB21_KEYBLOCK)) :
+			    !(option.keyblock = read_key(optarg,
+							 KEY_KEYBLOCK))) {
 				fprintf(stderr, "Error reading %s\n", optarg);
 				errorcnt++;
 			}
 			break;
 		case 'k':
-			option.kernel_subkey = PublicKeyRead(optarg);
+			option.kernel_subkey = read_key(optarg, KEY_PUBLIC);
 			if (!option.kernel_subkey) {
 				fprintf(stderr, "Error reading %s\n", optarg);
 				errorcnt++;
 			}
 			break;
+		case 'K':
+			/* What it's for depends on what it is */
+			if (!read_stored_key(optarg)) {
+				fprintf(stderr, "Error reading %s\n", optarg);
+				errorcnt++;
+			}
+			break;
 		case 'S':
-			option.devsignprivate = PrivateKeyRead(optarg);
+			option.devsignprivate_name = optarg;
+			option.devsignprivate = read_key(optarg, KEY_PRIVATE);
 			if (!option.devsignprivate) {
 				fprintf(stderr, "Error reading %s\n", optarg);
 				errorcnt++;
 			}
 			break;
 		case 'B':
-			option.devkeyblock = KeyBlockRead(optarg);
+			option.devkeyblock = read_key(optarg, KEY_KEYBLOCK);
 			if (!option.devkeyblock) {
 				fprintf(stderr, "Error reading %s\n", optarg);
 				errorcnt++;
@@ -775,15 +2383,21 @@ static int do_sign(int argc, char *argv[])
 		case 'l':
 			option.loemid = optarg;
 			break;
+		case OPT_LOEMS:
+			errorcnt += read_loems(optarg);
+			break;
+		case OPT_ECRW_HASH:
+			option.ecrw_hash = 1;
+			break;
 		case OPT_FV:
 			option.fv_specified = 1;
 			/* fallthrough */
 		case OPT_INFILE:		/* aka "--vmlinuz" */
-			inout_file_count++;
-			infile = optarg;
+			(*inout_file_count)++;
+			*infile = optarg;
 			break;
 		case OPT_OUTFILE:
-			inout_file_count++;
+			(*inout_file_count)++;
 			option.outfile = optarg;
 			break;
 		case OPT_BOOTLOADER:
@@ -843,7 +2457,15 @@ static int do_sign(int argc, char *argv[])
 				errorcnt++;
 			}
 			break;
-		case OPT_PEM_SIGNPRIV:
+		case OPT_HASH_CHUNK:
+			option.hash_chunk = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || !option.hash_chunk) {
+				fprintf(stderr,
+					"Invalid --hash_chunk \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_PEM_SIGNPRIV:
 			option.pem_signpriv = optarg;
 			break;
 		case OPT_PEM_ALGO:
@@ -859,6 +2481,125 @@ static int do_sign(int argc, char *argv[])
 		case OPT_PEM_EXTERNAL:
 			option.pem_external = optarg;
 			break;
+		case OPT_PEM_PERSISTENT:
+			option.pem_persistent = 1;
+			break;
+		case OPT_VBLOCKONLY:
+			option.vblockonly = 1;
+			break;
+		case OPT_NOSYNC:
+			option.nosync = 1;
+			break;
+		case OPT_VERIFY_AFTER:
+			option.verify_after = 1;
+			break;
+		case OPT_SKIP_IF_CURRENT:
+			option.skip_if_current = 1;
+			break;
+		case OPT_HASHCACHE:
+			option.hashcache = optarg;
+			break;
+		case OPT_OLD_SUBKEY:
+			option.old_subkey = read_key(optarg, KEY_PUBLIC);
+			if (!option.old_subkey) {
+				fprintf(stderr, "Error reading %s\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_DIGEST_CACHE:
+			option.digest_cache = optarg;
+			break;
+		case OPT_DIGEST_REMOTE:
+			/* There's one store for the whole run */
+			futil_set_digest_remote(optarg);
+			break;
+		case OPT_EMIT_DIGESTS:
+			option.emit_digests = optarg;
+			break;
+		case OPT_ATTACH_SIGNATURES:
+			option.attach_signatures = optarg;
+			break;
+		case OPT_BATCH:
+			option.batchfile = optarg;
+			break;
+		case OPT_JOBS:
+			option.batch_jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || option.batch_jobs < 1) {
+				fprintf(stderr,
+					"Invalid --jobs \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_GROUP_COMMIT:
+			option.group_commit = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || option.group_commit < 1) {
+				fprintf(stderr,
+					"Invalid --group_commit \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_ARCHIVE:
+			option.archive = optarg;
+			break;
+		case OPT_JOURNAL:
+			option.journal = optarg;
+			break;
+		case OPT_NODE:
+			nodes = realloc(option.nodes, (option.num_nodes + 1) *
+					sizeof(*nodes));
+			if (!nodes) {
+				fprintf(stderr, "Out of memory\n");
+				errorcnt++;
+				break;
+			}
+			nodes[option.num_nodes++] = optarg;
+			option.nodes = nodes;
+			break;
+		case OPT_WATCH:
+			option.watchdir = optarg;
+			break;
+		case OPT_RULES:
+			option.rulesfile = optarg;
+			break;
+		case OPT_SIGN_RATE:
+			option.sched_specified = 1;
+			option.sched.rate = strtod(optarg, &e);
+			if (!*optarg || (e && *e) || option.sched.rate <= 0) {
+				fprintf(stderr,
+					"Invalid --sign_rate \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_SIGN_BURST:
+			option.sched.burst = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || option.sched.burst < 1) {
+				fprintf(stderr,
+					"Invalid --sign_burst \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_SIGN_WINDOW:
+			option.sched_specified = 1;
+			option.sched.window = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || option.sched.window < 1) {
+				fprintf(stderr,
+					"Invalid --sign_window \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_PRIORITY:
+			for (i = 0; i < ARRAY_SIZE(priority_names); i++)
+				if (!strcmp(optarg, priority_names[i]))
+					break;
+			if (i == ARRAY_SIZE(priority_names)) {
+				fprintf(stderr,
+					"Invalid --priority \"%s\"\n", optarg);
+				errorcnt++;
+				break;
+			}
+			option.priority = i;
+			break;
 
 		case '?':
 			if (optopt)
@@ -881,49 +2622,70 @@ static int do_sign(int argc, char *argv[])
 		}
 	}
 
+	return errorcnt;
+}
+
+/*
+ * Figure out what we're signing and make sure we have everything we need for
+ * it. Returns the number of errors.
+ */
+static int check_sign_args(int argc, char *argv[], char **infile,
+			   enum futil_file_type *type_ptr,
+			   int *inout_file_count)
+{
+	enum futil_file_type type;
+	int errorcnt = 0;
+
 	/* If we don't have an input file already, we need one */
-	if (!infile) {
+	if (!*infile) {
 		if (argc - optind <= 0) {
-			errorcnt++;
 			fprintf(stderr, "ERROR: missing input filename\n");
-			goto done;
+			return ++errorcnt;
 		} else {
-			inout_file_count++;
-			infile = argv[optind++];
+			(*inout_file_count)++;
+			*infile = argv[optind++];
 		}
 	}
 
 	/* Look for an output file if we don't have one, just in case. */
 	if (!option.outfile && argc - optind > 0) {
-		inout_file_count++;
+		(*inout_file_count)++;
 		option.outfile = argv[optind++];
 	}
 
 	/* What are we looking at? */
-	if (futil_file_type(infile, &type)) {
-		errorcnt++;
-		goto done;
-	}
+	if (futil_file_type(*infile, &type))
+		return ++errorcnt;
 
 	/* We may be able to infer the type based on the other args */
 	if (type == FILE_TYPE_UNKNOWN) {
 		if (option.bootloader_data || option.config_data
 		    || option.arch != ARCH_UNSPECIFIED)
 			type = FILE_TYPE_RAW_KERNEL;
-		else if (option.kernel_subkey || option.fv_specified)
+		else if (option.kernel_subkey || option.keyblock21 ||
+			 option.fv_specified)
 			type = FILE_TYPE_RAW_FIRMWARE;
 	}
 
 	Debug("type=%s\n", futil_file_type_str(type));
 
+	/* Only keys and firmware have vb21 formats so far */
+	if (vboot_version == VBOOT_VERSION_2_1 &&
+	    type != FILE_TYPE_UNKNOWN && type != FILE_TYPE_PUBKEY &&
+	    type != FILE_TYPE_VB21_PUBKEY && type != FILE_TYPE_RAW_FIRMWARE) {
+		fprintf(stderr, "Can't sign a %s with --vb21\n",
+			futil_file_type_str(type));
+		return ++errorcnt;
+	}
+
 	/* Check the arguments for the type of thing we want to sign */
 	switch (type) {
 	case FILE_TYPE_UNKNOWN:
 		fprintf(stderr,
 			"Unable to determine the type of the input file\n");
-		errorcnt++;
-		goto done;
+		return ++errorcnt;
 	case FILE_TYPE_PUBKEY:
+	case FILE_TYPE_VB21_PUBKEY:
 		option.create_new_outfile = 1;
 		if (option.signprivate && option.pem_signpriv) {
 			fprintf(stderr,
@@ -942,18 +2704,26 @@ static int do_sign(int argc, char *argv[])
 				" --pem_signpriv\n");
 			errorcnt++;
 		}
+		if (option.pem_persistent && !option.pem_external) {
+			fprintf(stderr, "--pem_persistent must be used with"
+				" --pem_external\n");
+			errorcnt++;
+		}
 		/* We'll wait to read the PEM file, since the external signer
 		 * may want to read it instead. */
 		break;
 	case FILE_TYPE_KEYBLOCK:
+	case FILE_TYPE_VB21_KEYBLOCK:
 		fprintf(stderr, "Resigning a keyblock is kind of pointless.\n");
 		fprintf(stderr, "Just create a new one.\n");
 		errorcnt++;
 		break;
 	case FILE_TYPE_FW_PREAMBLE:
+	case FILE_TYPE_VB21_FW_PREAMBLE:
+	case FILE_TYPE_VB21_SIGNATURE:
 		fprintf(stderr,
 			"%s IS a signature. Sign the firmware instead\n",
-			infile);
+			*infile);
 		break;
 	case FILE_TYPE_GBB:
 		fprintf(stderr, "There's no way to sign a GBB\n");
@@ -967,15 +2737,20 @@ static int do_sign(int argc, char *argv[])
 		break;
 	case FILE_TYPE_KERN_PREAMBLE:
 		errorcnt += no_opt_if(!option.signprivate, "signprivate");
-		if (option.vblockonly || inout_file_count > 1)
+		if (option.vblockonly || *inout_file_count > 1)
 			option.create_new_outfile = 1;
 		break;
 	case FILE_TYPE_RAW_FIRMWARE:
 		option.create_new_outfile = 1;
 		errorcnt += no_opt_if(!option.signprivate, "signprivate");
+		errorcnt += no_opt_if(!option.version_specified, "version");
+		/* A vb21 preamble doesn't carry a kernel subkey */
+		if (vboot_version == VBOOT_VERSION_2_1) {
+			errorcnt += no_opt_if(!option.keyblock21, "keyblock");
+			break;
+		}
 		errorcnt += no_opt_if(!option.keyblock, "keyblock");
 		errorcnt += no_opt_if(!option.kernel_subkey, "kernelkey");
-		errorcnt += no_opt_if(!option.version_specified, "version");
 		break;
 	case FILE_TYPE_RAW_KERNEL:
 		option.create_new_outfile = 1;
@@ -987,92 +2762,1547 @@ static int do_sign(int argc, char *argv[])
 		errorcnt += no_opt_if(option.arch == ARCH_UNSPECIFIED, "arch");
 		break;
 	case FILE_TYPE_CHROMIUMOS_DISK:
-		fprintf(stderr, "Signing a %s is not yet supported\n",
-			futil_file_type_str(type));
-		errorcnt++;
+		errorcnt += no_opt_if(!option.signprivate, "signprivate");
+		if (option.vblockonly) {
+			fprintf(stderr, "--vblockonly can't be used to sign"
+				" a %s\n", futil_file_type_str(type));
+			errorcnt++;
+		}
 		break;
 	default:
 		DIE;
 	}
 
-	Debug("infile=%s\n", infile);
-	Debug("inout_file_count=%d\n", inout_file_count);
+	Debug("infile=%s\n", *infile);
+	Debug("inout_file_count=%d\n", *inout_file_count);
 	Debug("option.create_new_outfile=%d\n", option.create_new_outfile);
 
 	/* Make sure we have an output file if one is needed */
 	if (!option.outfile) {
 		if (option.create_new_outfile) {
-			errorcnt++;
 			fprintf(stderr, "Missing output filename\n");
-			goto done;
+			return ++errorcnt;
+		} else if (!strcmp(*infile, "-")) {
+			fprintf(stderr, "Can't sign stdin in place. Name an"
+				" output file (\"-\" for stdout).\n");
+			return ++errorcnt;
 		} else {
-			option.outfile = infile;
+			option.outfile = *infile;
 		}
 	}
 
 	Debug("option.outfile=%s\n", option.outfile);
 
+	if (option.verify_after &&
+	    (option.vblockonly || !strcmp(option.outfile, "-"))) {
+		fprintf(stderr, "--verify_after needs a whole output file\n");
+		errorcnt++;
+	}
+
 	if (argc - optind > 0) {
 		errorcnt++;
 		fprintf(stderr, "ERROR: too many arguments left over\n");
 	}
 
-	if (errorcnt)
-		goto done;
+	*type_ptr = type;
+	return errorcnt;
+}
+
+/* Sign one input with the settings in [opt] */
+/*
+ * Roughly how much memory signing [size] bytes of [type] takes: all of it
+ * is mapped, and a kernel is copied into a new blob besides. A compressed
+ * input is bigger once it's been unpacked, but there's no telling how much.
+ */
+static uint64_t sign_footprint(enum futil_file_type type, uint64_t size)
+{
+	if (type == FILE_TYPE_RAW_KERNEL || type == FILE_TYPE_KERN_PREAMBLE)
+		return 2 * size;
+	return size;
+}
+
+/* Remember what's signed, for checking what's written */
+static pthread_once_t verify_once = PTHREAD_ONCE_INIT;
+
+static void verify_init(void)
+{
+	futil_remember_signed_digests();
+	futil_show_init(stdout, stderr, NULL, 0);
+}
+
+/*
+ * Reads back what was just written to [filename] and checks it the way
+ * "show" would, against the keys in its keyblocks. Only what it says when
+ * that fails is printed.
+ */
+static int verify_after(const char *filename)
+{
+	struct futil_traverse_state_s state;
+	FILE *out, *err;
+	char *out_buf = NULL, *err_buf = NULL;
+	size_t out_len = 0, err_len = 0;
+	uint8_t *buf;
+	uint64_t len;
+	struct stat sb;
+	int fd, errorcnt = 1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s to verify it: %s\n",
+			filename, strerror(errno));
+		return 1;
+	}
+	if (futil_fstat(fd, &sb) || !S_ISREG(sb.st_mode)) {
+		fprintf(stderr, "%s isn't a file, so it can't be verified\n",
+			filename);
+		close(fd);
+		return 1;
+	}
+
+	/* What's still cached and clean is what's on disk; make sure */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	if (futil_map_file(fd, MAP_RO, &buf, &len)) {
+		close(fd);
+		return 1;
+	}
+
+	out = open_memstream(&out_buf, &out_len);
+	err = open_memstream(&err_buf, &err_len);
+	if (out && err) {
+		memset(&state, 0, sizeof(state));
+		state.in_filename = filename;
+		state.op = FUTIL_OP_SHOW;
+		futil_show_thread_begin(out, err);
+		errorcnt = futil_traverse(buf, len, &state, FILE_TYPE_UNKNOWN);
+		futil_show_thread_end();
+		futil_fmap_index_forget(buf);
+	}
+	if (out)
+		fclose(out);
+	if (err)
+		fclose(err);
+
+	if (errorcnt) {
+		if (out_buf)
+			fwrite(out_buf, 1, out_len, stderr);
+		if (err_buf)
+			fwrite(err_buf, 1, err_len, stderr);
+		fprintf(stderr, "%s doesn't verify after signing\n", filename);
+	}
+	free(out_buf);
+	free(err_buf);
+	futil_unmap_file(fd, MAP_RO, buf, len);
+	close(fd);
+	return errorcnt;
+}
+
+static int sign_one(struct local_data_s *opt, char *infile,
+		    enum futil_file_type type,
+		    int inout_file_count)
+{
+	struct futil_traverse_state_s state;
+	enum futil_file_err err;
+	uint8_t *buf;
+	uint64_t buf_len;
+	VbPrivateKey *signprivate = opt->signprivate;
+	VbPrivateKey *devsignprivate = opt->devsignprivate;
+	char *outfile = opt->outfile;
+	int emitting = split && opt->emit_digests;
+	struct stat sb;
+	uint64_t mem = 0;
+	int decompressed = 0;
+	int ifd;
+	int errorcnt = 0;
 
 	memset(&state, 0, sizeof(state));
 	state.op = FUTIL_OP_SIGN;
+	state.cb_data = opt;
+
+	/* A scheduled key can't say who it is, so ask the real one */
+	if (vboot_version == VBOOT_VERSION_2_1 && signprivate)
+		Vb21PrivateKeyId(signprivate, &opt->signprivate_id);
+
+	/* Nor what its public half is */
+	if (opt->skip_if_current) {
+		opt->signpub = private_key_pub(signprivate);
+		opt->devsignpub = private_key_pub(devsignprivate);
+	}
+
+	if (opt->verify_after)
+		pthread_once(&verify_once, verify_init);
 
-	if (option.create_new_outfile) {
-		/* The input is read-only, the output is write-only. */
-		mapping = MAP_RO;
+	/* Everything signs through these, so they're what gets paced */
+	opt->signprivate = sched_key(opt, signprivate, opt->signprivate_name,
+				     NULL);
+	opt->devsignprivate = sched_key(opt, devsignprivate,
+					opt->devsignprivate_name, NULL);
+	if ((signprivate && !opt->signprivate) ||
+	    (devsignprivate && !opt->devsignprivate)) {
+		errorcnt++;
+		goto unsched;
+	}
+
+	/* Naming the same file twice just means in-place */
+	if (inout_file_count > 1 && !opt->create_new_outfile &&
+	    futil_same_file(infile, opt->outfile))
+		inout_file_count = 1;
+
+	/*
+	 * Collecting digests only reads the input, as if there were another
+	 * output file, and what would be written is thrown away.
+	 */
+	if (emitting) {
+		inout_file_count = 2;
+		opt->outfile = "/dev/null";
+	}
+
+	if (opt->create_new_outfile || inout_file_count > 1) {
+		/*
+		 * The input is read-only. We either write a new output file
+		 * from scratch, or modify a private mapping of the input and
+		 * write that out, so there's no need to copy it first.
+		 */
 		state.in_filename = infile;
 		Debug("open RO %s\n", infile);
-		ifd = open(infile, O_RDONLY);
+		ifd = futil_open_input(infile);
 		if (ifd < 0) {
-			errorcnt++;
 			fprintf(stderr, "Can't open %s for reading: %s\n",
 				infile, strerror(errno));
-			goto done;
+			errorcnt++;
+			goto unsched;
 		}
 	} else {
-		/* We'll read-modify-write the output file */
-		mapping = MAP_RW;
-		state.in_filename = option.outfile;
-		if (inout_file_count > 1)
-			futil_copy_file_or_die(infile, option.outfile);
-		Debug("open RW %s\n", option.outfile);
-		ifd = open(option.outfile, O_RDWR);
+		/*
+		 * We'll modify the file in place. It's mapped privately, so
+		 * only the parts that actually change are written back.
+		 */
+		state.in_filename = opt->outfile;
+		Debug("open RW %s\n", opt->outfile);
+		ifd = open(opt->outfile, O_RDWR);
 		if (ifd < 0) {
-			errorcnt++;
 			fprintf(stderr, "Can't open %s for writing: %s\n",
-				option.outfile, strerror(errno));
+				opt->outfile, strerror(errno));
+			errorcnt++;
+			goto unsched;
+		}
+	}
+
+	/*
+	 * Wait until there's room for it, so a batch can't have more in
+	 * memory at once than there is. A block device reads as empty here,
+	 * which is right, since it's never mapped.
+	 */
+	if (!fstat(ifd, &sb) && S_ISREG(sb.st_mode))
+		mem = futil_mem_reserve(sign_footprint(type, sb.st_size));
+
+	/* A kernel partition on a block device isn't mapped at all */
+	if (inout_file_count == 1 && !opt->create_new_outfile &&
+	    type == FILE_TYPE_KERN_PREAMBLE && !opt->config_data &&
+	    !fstat(ifd, &sb) && S_ISBLK(sb.st_mode)) {
+		errorcnt += resign_kpart_blkdev(opt, ifd);
+		goto close_ifd;
+	}
+
+	/*
+	 * Raw bodies are signed as they are, compressed or not. A pipe has
+	 * to be read into memory, but that leaves it as it is anyway.
+	 */
+	if ((type == FILE_TYPE_RAW_KERNEL || type == FILE_TYPE_RAW_FIRMWARE) &&
+	    !S_ISFIFO(sb.st_mode) && !S_ISSOCK(sb.st_mode))
+		err = futil_map_file(ifd, MAP_RO, &buf, &buf_len);
+	else
+		err = futil_map_input(ifd, &buf, &buf_len, &decompressed);
+
+	if (err) {
+		errorcnt++;
+	} else if (decompressed && inout_file_count == 1) {
+		fprintf(stderr, "%s is compressed, so it can't be signed in"
+			" place. Name an output file.\n", infile);
+		errorcnt++;
+		futil_unmap_input(ifd, buf, buf_len, decompressed, 0);
+	} else {
+		errorcnt += futil_traverse(buf, buf_len, &state, type);
+		if (!errorcnt && !opt->create_new_outfile && !emitting) {
+			if (inout_file_count > 1)
+				errorcnt += futil_write_file(opt->outfile,
+							     buf, buf_len);
+			else
+				errorcnt += futil_write_dirty(ifd, buf, &state,
+							      !opt->nosync);
+		}
+		errorcnt += futil_unmap_input(ifd, buf, buf_len,
+					      decompressed, 0);
+	}
+
+close_ifd:
+	futil_mem_release(mem);
+	if (close(ifd)) {
+		errorcnt++;
+		fprintf(stderr, "Error when closing ifd: %s\n",
+			strerror(errno));
+	}
+	if (!errorcnt && opt->verify_after && !emitting)
+		errorcnt += verify_after(opt->outfile);
+
+unsched:
+	free(opt->signpub);
+	free(opt->devsignpub);
+	opt->signpub = opt->devsignpub = NULL;
+	if (opt->signprivate != signprivate)
+		PrivateKeyFree(opt->signprivate);
+	if (opt->devsignprivate != devsignprivate)
+		PrivateKeyFree(opt->devsignprivate);
+	opt->signprivate = signprivate;
+	opt->devsignprivate = devsignprivate;
+	opt->outfile = outfile;
+	return errorcnt;
+}
+
+/* One line of a batch manifest */
+struct sign_job_s {
+	struct local_data_s opt;
+	char *line;
+	char *infile;
+	enum futil_file_type type;
+	int inout_file_count;
+	int lineno;
+	int errorcnt;
+	uint64_t ahead;		/* bytes of it read ahead */
+};
+
+struct sign_batch_s {
+	struct sign_job_s *job;
+	int count;
+	int failed;
+	int skipped;
+	/* With --journal, a digest of the PARAMS on the command line */
+	const uint8_t *common;
+	/* Reading the inputs of the lines to come */
+	uint32_t started;		/* lines that have been started */
+	uint32_t ahead_next;		/* first line not read ahead */
+	uint32_t ahead_depth;		/* how many lines to keep ahead */
+	uint64_t ahead_bytes, ahead_max;
+	int ahead_busy;
+	pthread_mutex_t lock;
+};
+
+/* Where the progress goes, which isn't stdout if the archive is */
+static FILE *batch_log;
+
+static void digest_pubkey(VB_SHA256_CTX *ctx, const VbPublicKey *key)
+{
+	if (key)
+		SHA256_update(ctx, GetPublicKeyDataC(key), key->key_size);
+}
+
+/*
+ * What a line of a --journal batch is known by: its PARAMS, the ones on the
+ * command line, and the keys themselves rather than just where they were
+ * read from.
+ */
+static void journal_key(const struct sign_job_s *job, const uint8_t *common,
+			uint8_t *key)
+{
+	const struct local_data_s *opt = &job->opt;
+	VbPublicKey *pub;
+	VB_SHA256_CTX ctx;
+
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, common, SHA256_DIGEST_SIZE);
+	SHA256_update(&ctx, (const uint8_t *)job->line, strlen(job->line));
+	pub = private_key_pub(opt->signprivate);
+	digest_pubkey(&ctx, pub);
+	free(pub);
+	pub = private_key_pub(opt->devsignprivate);
+	digest_pubkey(&ctx, pub);
+	free(pub);
+	if (opt->keyblock)
+		SHA256_update(&ctx, (const uint8_t *)opt->keyblock,
+			      opt->keyblock->key_block_size);
+	if (opt->devkeyblock)
+		SHA256_update(&ctx, (const uint8_t *)opt->devkeyblock,
+			      opt->devkeyblock->key_block_size);
+	if (opt->keyblock21)
+		SHA256_update(&ctx, (const uint8_t *)opt->keyblock21,
+			      opt->keyblock21->c.total_size);
+	digest_pubkey(&ctx, opt->kernel_subkey);
+	memcpy(key, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+}
+
+/*
+ * Ask for the inputs of the next few lines to be read while this one is
+ * signed, so that on cold storage the CPUs aren't left waiting for each in
+ * turn. What's read ahead and not yet started is kept to ahead_max, and
+ * only one thread at a time does it, so they don't queue up on a slow open.
+ */
+static void batch_readahead(struct sign_batch_s *batch, uint32_t index)
+{
+	struct sign_job_s *job;
+	struct stat sb;
+	uint32_t i;
+	int fd;
+
+	pthread_mutex_lock(&batch->lock);
+	batch->ahead_bytes -= batch->job[index].ahead;
+	batch->job[index].ahead = 0;
+	if (batch->started < index + 1)
+		batch->started = index + 1;
+	if (batch->ahead_busy) {
+		pthread_mutex_unlock(&batch->lock);
+		return;
+	}
+	batch->ahead_busy = 1;
+	if (batch->ahead_next < batch->started)
+		batch->ahead_next = batch->started;
+	i = batch->ahead_next;
+	pthread_mutex_unlock(&batch->lock);
+
+	for (; i < batch->count && i <= index + batch->ahead_depth; i++) {
+		job = &batch->job[i];
+		fd = job->errorcnt || !job->infile ? -1 :
+			open(job->infile, O_RDONLY);
+		if (fd >= 0 && (fstat(fd, &sb) || !S_ISREG(sb.st_mode))) {
+			close(fd);
+			fd = -1;
+		}
+
+		pthread_mutex_lock(&batch->lock);
+		if (fd >= 0 && batch->ahead_bytes &&
+		    batch->ahead_bytes + sb.st_size > batch->ahead_max) {
+			pthread_mutex_unlock(&batch->lock);
+			close(fd);
+			break;
+		}
+		/* It may have been started while this one was opened */
+		if (fd >= 0 && i >= batch->started) {
+			job->ahead = sb.st_size;
+			batch->ahead_bytes += job->ahead;
+		}
+		batch->ahead_next = i + 1;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (fd >= 0) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+	}
+
+	pthread_mutex_lock(&batch->lock);
+	batch->ahead_busy = 0;
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static void batch_one(void *arg, uint32_t index)
+{
+	struct sign_batch_s *batch = arg;
+	struct sign_job_s *job = &batch->job[index];
+	const char *outfile = job->opt.outfile ? job->opt.outfile :
+		job->infile;
+	uint8_t key[SHA256_DIGEST_SIZE], in[SHA256_DIGEST_SIZE];
+	int journaled = 0, skipped = 0;
+
+	batch_readahead(batch, index);
+
+	if (!job->errorcnt && batch->common && job->infile && outfile) {
+		journal_key(job, batch->common, key);
+		journaled = !futil_file_sha256(job->infile, in);
+		skipped = journaled &&
+			futil_journal_done(key, in, outfile,
+					   !strcmp(job->infile, outfile));
+	}
+
+	if (!job->errorcnt && !skipped) {
+		job->errorcnt = sign_one(&job->opt, job->infile, job->type,
+					 job->inout_file_count);
+		if (!job->errorcnt && journaled)
+			futil_journal_add(key, in, outfile);
+	}
+
+	pthread_mutex_lock(&batch->lock);
+	if (job->errorcnt)
+		batch->failed++;
+	if (skipped)
+		batch->skipped++;
+	fprintf(batch_log, "%d: %s %s\n", job->lineno,
+		job->opt.outfile ? job->opt.outfile :
+		job->infile ? job->infile : "-",
+		job->errorcnt ? "FAILED" : skipped ? "DONE" : "OK");
+	fflush(batch_log);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static void batch_thread_done(void *arg)
+{
+	futil_rsa_cache_free();
+	free_ext_signer();
+}
+
+#define MAX_BATCH_ARGS 64
+
+static int common_params(int argc, char *argv[], char *common[]);
+
+/*
+ * Each line of the manifest holds the arguments for one sign operation. Any
+ * options given on the command line apply to every line.
+ */
+static int do_batch(const struct local_data_s *defaults,
+		    int argc_main, char *argv_main[])
+{
+	struct sign_batch_s batch;
+	struct timespec start, end;
+	uint8_t common[SHA256_DIGEST_SIZE];
+	int journal_errors = 0;
+	char *line = NULL;
+	size_t linesize = 0;
+	char *argv[MAX_BATCH_ARGS + 1];
+	int argc;
+	int lineno = 0;
+	int commit_errors = 0;
+	int archive_errors = 0;
+	int archiving;
+	int i;
+	double secs;
+	FILE *fp;
+
+	fp = fopen(defaults->batchfile, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			defaults->batchfile, strerror(errno));
+		return 1;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+
+	if (defaults->journal) {
+		char **params = calloc(argc_main, sizeof(*params));
+		VB_SHA256_CTX ctx;
+		int n;
+
+		if (!params || futil_journal_open(defaults->journal)) {
+			free(params);
+			fclose(fp);
+			return 1;
+		}
+		SHA256_init(&ctx);
+		n = common_params(argc_main, argv_main, params);
+		for (i = 0; i < n; i++)
+			SHA256_update(&ctx, (const uint8_t *)params[i],
+				      strlen(params[i]) + 1);
+		memcpy(common, SHA256_final(&ctx), sizeof(common));
+		batch.common = common;
+		free(params);
+	}
+
+	/* Parse every line up front, since getopt isn't reentrant */
+	while (getline(&line, &linesize, fp) != -1) {
+		struct sign_job_s *job;
+		char *copy;
+
+		lineno++;
+		copy = strdup(line);
+		argv[0] = "sign";
+		argc = copy ? futil_split_line(copy, argv + 1,
+						     MAX_BATCH_ARGS) : -1;
+		if (argc == 0) {
+			free(copy);
+			continue;
+		}
+
+		job = realloc(batch.job, (batch.count + 1) * sizeof(*job));
+		if (!job) {
+			fprintf(stderr, "Out of memory\n");
+			fclose(fp);
+			return 1;
+		}
+		batch.job = job;
+		job = &batch.job[batch.count++];
+		memset(job, 0, sizeof(*job));
+		job->lineno = lineno;
+		job->line = strdup(line);
+		if (job->line)
+			job->line[strcspn(job->line, "\r\n")] = '\0';
+		else
+			job->errorcnt = 1;
+
+		if (argc < 0) {
+			fprintf(stderr, "%s:%d: too many arguments\n",
+				defaults->batchfile, lineno);
+			job->errorcnt = 1;
+			continue;
+		}
+
+		option = *defaults;
+		option.batchfile = NULL;
+		option.journal = NULL;
+		option.nodes = NULL;
+		option.num_nodes = 0;
+		option.loems = NULL;
+		option.num_loems = 0;
+		optind = 0;
+		job->errorcnt = parse_sign_opts(argc + 1, argv, &job->infile,
+						&job->inout_file_count);
+		if (!option.num_loems) {
+			option.loems = defaults->loems;
+			option.num_loems = defaults->num_loems;
+		}
+		if (option.batchfile || option.nodes || option.watchdir) {
+			fprintf(stderr, "%s:%d: --batch can't be nested\n",
+				defaults->batchfile, lineno);
+			free(option.nodes);
+			job->errorcnt++;
+		}
+		if (option.journal) {
+			fprintf(stderr, "%s:%d: --journal only goes on the"
+				" command line\n", defaults->batchfile, lineno);
+			job->errorcnt++;
+		}
+		option.journal = defaults->journal;
+		option.nodes = defaults->nodes;
+		option.num_nodes = defaults->num_nodes;
+		if (!job->errorcnt)
+			job->errorcnt = check_sign_args(argc + 1, argv,
+							&job->infile,
+							&job->type,
+							&job->inout_file_count);
+		job->opt = option;
+	}
+	free(line);
+	fclose(fp);
+
+	/* What collecting digests writes is thrown away, not archived */
+	archiving = defaults->archive && !(split && defaults->emit_digests);
+	batch_log = archiving && !strcmp(defaults->archive, "-") ?
+		stderr : stdout;
+	if (archiving && futil_archive_begin(defaults->archive)) {
+		archive_errors = 1;
+		goto done;
+	}
+
+	/*
+	 * Keep two lines ahead for each thread, with no more than half the
+	 * memory budget read ahead, so it's still cached when it's wanted.
+	 */
+	batch.ahead_depth = 2 * (defaults->batch_jobs ? defaults->batch_jobs :
+				 futil_jobs());
+	batch.ahead_max = futil_mem_budget() / 2;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (defaults->group_commit)
+		futil_commit_begin(defaults->group_commit);
+	futil_run_jobs(batch_one, batch_thread_done, &batch, batch.count,
+		       defaults->batch_jobs);
+	batch_thread_done(&batch);
+	if (defaults->group_commit)
+		commit_errors = futil_commit_end();
+	if (archiving)
+		archive_errors = futil_archive_end(!defaults->nosync);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(batch_log,
+		"Signed %d of %d items in %.3f seconds (%.1f items/sec)\n",
+		batch.count - batch.failed - batch.skipped, batch.count, secs,
+		secs > 0 ? batch.count / secs : 0.0);
+	if (defaults->journal)
+		fprintf(batch_log, "%d items were already done\n",
+			batch.skipped);
+
+done:
+	if (defaults->journal)
+		journal_errors = futil_journal_close();
+	pthread_mutex_destroy(&batch.lock);
+	for (i = 0; i < batch.count; i++) {
+		if (batch.job[i].opt.loems != defaults->loems)
+			free_loems(&batch.job[i].opt);
+		free(batch.job[i].line);
+	}
+	free(batch.job);
+	return batch.failed || commit_errors || archive_errors ||
+		journal_errors;
+}
+
+/* Transport failures in a row before a node is given up on */
+#define NODE_MAX_FAILURES 3
+/* Key sets a node is remembered to have used */
+#define NODE_AFFINITY 8
+
+struct sign_node_s {
+	const char *path;
+	int inflight;
+	int failures;			/* in a row */
+	int dead;
+	int done, retried;
+	uint32_t affinity[NODE_AFFINITY];
+	int next_affinity;
+};
+
+/* One line of a manifest that's signed elsewhere */
+struct remote_job_s {
+	char **argv;			/* "sign", the common PARAMS, the line */
+	int argc;
+	char *words;			/* what the line's argv points into */
+	uint32_t affinity;
+	int lineno;
+	int status;
+};
+
+struct remote_batch_s {
+	struct remote_job_s *job;
+	int count;
+	int failed;
+	struct sign_node_s *node;
+	int num_nodes;
+	pthread_mutex_t lock;
+};
+
+/*
+ * Lines that use the same keys should go where those keys are already
+ * loaded, so this hashes the names of the key files a line gives.
+ */
+static uint32_t job_affinity(int argc, char *argv[])
+{
+	static const char * const key_opts[] = {
+		"-s", "--signprivate", "-b", "--keyblock", "-k", "--kernelkey",
+		"-K", "--storedkey", "-S", "--devsign", "-B", "--devkeyblock",
+		"--pem_signpriv", "--pem_external",
+	};
+	uint32_t h = 2166136261u;
+	const char *val, *eq;
+	size_t n;
+	int i, j;
+
+	for (i = 0; i < argc; i++) {
+		eq = strchr(argv[i], '=');
+		n = eq ? eq - argv[i] : strlen(argv[i]);
+		for (j = 0; j < ARRAY_SIZE(key_opts); j++)
+			if (n == strlen(key_opts[j]) &&
+			    !strncmp(argv[i], key_opts[j], n))
+				break;
+		if (j == ARRAY_SIZE(key_opts))
+			continue;
+		val = eq ? eq + 1 : i + 1 < argc ? argv[++i] : "";
+		for (; *val; val++)
+			h = (h ^ (uint8_t)*val) * 16777619u;
+		h = (h ^ '\n') * 16777619u;
+	}
+	return h;
+}
+
+/*
+ * The least busy live node, or one that's nearly so and has used the same
+ * keys before. Called with the lock held. Returns NULL if they're all dead.
+ */
+static struct sign_node_s *pick_node(struct remote_batch_s *batch,
+				     uint32_t affinity)
+{
+	struct sign_node_s *best = NULL, *node;
+	int i, j, load, best_load = 0;
+
+	for (i = 0; i < batch->num_nodes; i++) {
+		node = &batch->node[i];
+		if (node->dead)
+			continue;
+		load = 2 * node->inflight;
+		for (j = 0; j < NODE_AFFINITY; j++)
+			if (node->affinity[j] == affinity) {
+				load -= 3;
+				break;
+			}
+		if (!best || load < best_load) {
+			best = node;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+static void remember_affinity(struct sign_node_s *node, uint32_t affinity)
+{
+	int i;
+
+	for (i = 0; i < NODE_AFFINITY; i++)
+		if (node->affinity[i] == affinity)
+			return;
+	node->affinity[node->next_affinity] = affinity;
+	node->next_affinity = (node->next_affinity + 1) % NODE_AFFINITY;
+}
+
+static void remote_one(void *arg, uint32_t index)
+{
+	struct remote_batch_s *batch = arg;
+	struct remote_job_s *job = &batch->job[index];
+	struct sign_node_s *node;
+	int lost;
+
+	job->status = 1;
+	node = NULL;
+	/* Only a line that no server ran is tried on another */
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		if (node) {
+			node->inflight--;
+			node->retried++;
+		}
+		node = pick_node(batch, job->affinity);
+		if (node) {
+			node->inflight++;
+			remember_affinity(node, job->affinity);
+		}
+		pthread_mutex_unlock(&batch->lock);
+		if (!node)
+			break;
+
+		lost = futil_serve_request(node->path, job->argc,
+					   job->argv, &job->status);
+
+		pthread_mutex_lock(&batch->lock);
+		if (lost == SERVE_NOT_SENT || lost == SERVE_NO_REPLY) {
+			node->failures++;
+			if (node->failures >= NODE_MAX_FAILURES &&
+			    !node->dead) {
+				node->dead = 1;
+				fprintf(stderr, "Giving up on %s\n",
+					node->path);
+			}
+		} else if (!lost) {
+			node->failures = 0;
+			node->done++;
+		}
+		if (lost != SERVE_NOT_SENT)
+			node->inflight--;
+		pthread_mutex_unlock(&batch->lock);
+
+		/*
+		 * A server that got the line and went away may have been
+		 * taken down by it, so it's not passed on to do the same to
+		 * the next one.
+		 */
+		if (lost == SERVE_NO_REPLY)
+			fprintf(stderr, "%d: not retried, in case it's what "
+				"stopped %s\n", job->lineno, node->path);
+		if (lost != SERVE_NOT_SENT)
+			break;
+	}
+
+	pthread_mutex_lock(&batch->lock);
+	if (job->status)
+		batch->failed++;
+	printf("%d: %s %s\n", job->lineno,
+	       node ? node->path : "(no node)",
+	       job->status ? "FAILED" : "OK");
+	fflush(stdout);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * Like do_batch(), but each line is sent to one of the --node servers
+ * instead of being signed here. The lines aren't parsed locally, so any
+ * complaints about them come from the servers. [common] holds the PARAMS
+ * from the command line, other than those that set up the batch.
+ */
+static int do_remote_batch(const struct local_data_s *defaults,
+			   int ncommon, char *common[])
+{
+	struct remote_batch_s batch;
+	struct remote_job_s *job;
+	struct timespec start, end;
+	char *line = NULL;
+	size_t linesize = 0;
+	char *words[MAX_BATCH_ARGS];
+	char *copy;
+	int argc;
+	int lineno = 0;
+	int nthreads;
+	int errorcnt = 0;
+	int i;
+	double secs;
+	FILE *fp;
+
+	fp = fopen(defaults->batchfile, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			defaults->batchfile, strerror(errno));
+		return 1;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	batch.num_nodes = defaults->num_nodes;
+	batch.node = calloc(batch.num_nodes, sizeof(*batch.node));
+	if (!batch.node) {
+		fprintf(stderr, "Out of memory\n");
+		fclose(fp);
+		return 1;
+	}
+	for (i = 0; i < batch.num_nodes; i++)
+		batch.node[i].path = defaults->nodes[i];
+
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		copy = strdup(line);
+		argc = copy ? futil_split_line(copy, words,
+					       MAX_BATCH_ARGS) : -1;
+		if (argc <= 0) {
+			if (argc < 0) {
+				fprintf(stderr, "%s:%d: too many arguments\n",
+					defaults->batchfile, lineno);
+				errorcnt++;
+			}
+			free(copy);
+			continue;
+		}
+
+		job = realloc(batch.job, (batch.count + 1) * sizeof(*job));
+		if (!job) {
+			fprintf(stderr, "Out of memory\n");
+			free(copy);
+			errorcnt++;
+			break;
+		}
+		batch.job = job;
+		job = &batch.job[batch.count];
+		job->argc = 1 + ncommon + argc;
+		job->argv = malloc((job->argc + 1) * sizeof(char *));
+		if (!job->argv) {
+			fprintf(stderr, "Out of memory\n");
+			free(copy);
+			errorcnt++;
+			break;
+		}
+		job->argv[0] = "sign";
+		memcpy(job->argv + 1, common, ncommon * sizeof(char *));
+		memcpy(job->argv + 1 + ncommon, words, argc * sizeof(char *));
+		job->argv[job->argc] = NULL;
+		job->words = copy;
+		job->affinity = job_affinity(argc, words);
+		job->lineno = lineno;
+		batch.count++;
+	}
+	free(line);
+	fclose(fp);
+
+	if (!errorcnt) {
+		/* The servers take one request at a time; keep them busy */
+		nthreads = defaults->batch_jobs;
+		if (nthreads < 1)
+			nthreads = 2 * batch.num_nodes;
+
+		pthread_mutex_init(&batch.lock, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		futil_run_jobs(remote_one, NULL, &batch, batch.count,
+			       nthreads);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		pthread_mutex_destroy(&batch.lock);
+
+		secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+		for (i = 0; i < batch.num_nodes; i++)
+			printf("%s: %d items, %d retried elsewhere%s\n",
+			       batch.node[i].path, batch.node[i].done,
+			       batch.node[i].retried,
+			       batch.node[i].dead ? ", dropped" : "");
+		printf("Signed %d of %d items in %.3f seconds "
+		       "(%.1f items/sec)\n",
+		       batch.count - batch.failed, batch.count, secs,
+		       secs > 0 ? batch.count / secs : 0.0);
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		free(batch.job[i].words);
+		free(batch.job[i].argv);
+	}
+	free(batch.job);
+	free(batch.node);
+	return errorcnt || batch.failed;
+}
+
+/*
+ * Copies the command-line PARAMS to pass on to the --node servers, leaving
+ * out the ones that only mean something here. Returns how many there are.
+ */
+static int common_params(int argc, char *argv[], char *common[])
+{
+	static const char * const local_opts[] = {
+		"--batch", "--jobs", "--node", "--journal",
+	};
+	size_t n;
+	int count = 0;
+	int i, j;
+
+	for (i = 1; i < argc; i++) {
+		for (j = 0; j < ARRAY_SIZE(local_opts); j++) {
+			n = strlen(local_opts[j]);
+			if (!strncmp(argv[i], local_opts[j], n) &&
+			    (!argv[i][n] || argv[i][n] == '='))
+				break;
+		}
+		if (j == ARRAY_SIZE(local_opts)) {
+			common[count++] = argv[i];
+			continue;
+		}
+		if (!strchr(argv[i], '='))
+			i++;
+	}
+	return count;
+}
+
+/* How long DIR has to be quiet before the changes in it are signed */
+#define WATCH_SETTLE_MS 250
+#define MAX_WATCH_RULES 256
+
+struct watch_rule_s {
+	char *pattern;
+	char *words[MAX_BATCH_ARGS];
+	int nwords;
+	int lineno;
+};
+
+/* Names of the files that changed, or that we wrote */
+struct name_list_s {
+	char **name;
+	int count;
+};
+
+static volatile sig_atomic_t stop_watching;
+
+static void handle_watch_signal(int sig)
+{
+	stop_watching = 1;
+}
+
+static int name_list_find(struct name_list_s *list, const char *name)
+{
+	int i;
+
+	for (i = 0; i < list->count; i++)
+		if (!strcmp(list->name[i], name))
+			return i;
+	return -1;
+}
+
+static void name_list_add(struct name_list_s *list, const char *name)
+{
+	char **more;
+
+	if (name_list_find(list, name) >= 0)
+		return;
+	more = realloc(list->name, (list->count + 1) * sizeof(*more));
+	if (!more)
+		return;
+	list->name = more;
+	list->name[list->count] = strdup(name);
+	if (list->name[list->count])
+		list->count++;
+}
+
+static void name_list_remove(struct name_list_s *list, int i)
+{
+	free(list->name[i]);
+	list->name[i] = list->name[--list->count];
+}
+
+static void name_list_clear(struct name_list_s *list)
+{
+	while (list->count)
+		name_list_remove(list, 0);
+	free(list->name);
+	list->name = NULL;
+}
+
+static int read_watch_rules(const char *rulesfile, struct watch_rule_s *rule)
+{
+	char *line = NULL;
+	size_t linesize = 0;
+	char *words[MAX_BATCH_ARGS + 1];
+	int count = 0, lineno = 0;
+	int errorcnt = 0;
+	int n;
+	FILE *fp;
+
+	fp = fopen(rulesfile, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			rulesfile, strerror(errno));
+		return -1;
+	}
+
+	while (getline(&line, &linesize, fp) != -1) {
+		char *copy;
+
+		lineno++;
+		copy = strdup(line);
+		n = copy ? futil_split_line(copy, words,
+					    MAX_BATCH_ARGS + 1) : -1;
+		if (n == 0) {
+			free(copy);
+			continue;
+		}
+		if (n < 2 || count == MAX_WATCH_RULES) {
+			fprintf(stderr, "%s:%d: %s\n", rulesfile, lineno,
+				n < 0 ? "too many arguments" :
+				n < 2 ? "a PATTERN needs PARAMS" :
+				"too many rules");
+			free(copy);
+			errorcnt++;
+			continue;
+		}
+		/* The pattern is the first word, so it owns the copy */
+		rule[count].pattern = words[0];
+		memcpy(rule[count].words, words + 1,
+		       (n - 1) * sizeof(char *));
+		rule[count].nwords = n - 1;
+		rule[count].lineno = lineno;
+		count++;
+	}
+	free(line);
+	fclose(fp);
+
+	if (!errorcnt && !count)
+		fprintf(stderr, "%s has no rules in it\n", rulesfile);
+	return errorcnt || !count ? -1 : count;
+}
+
+/* Replaces each {} in [word] with [path], and each {.} with its stem */
+static char *expand_word(const char *word, const char *path)
+{
+	const char *dot = strrchr(path, '.');
+	const char *slash = strrchr(path, '/');
+	size_t stem, len = strlen(path);
+	size_t size = 1;
+	const char *w;
+	char *out, *o;
+
+	stem = dot && (!slash || dot > slash + 1) ? dot - path : len;
+	for (w = word; *w; w++)
+		size += len;
+	out = malloc(strlen(word) + size);
+	if (!out)
+		return NULL;
+
+	for (o = out, w = word; *w; ) {
+		if (!strncmp(w, "{}", 2)) {
+			o = mempcpy(o, path, len);
+			w += 2;
+		} else if (!strncmp(w, "{.}", 3)) {
+			o = mempcpy(o, path, stem);
+			w += 3;
+		} else {
+			*o++ = *w++;
+		}
+	}
+	*o = '\0';
+	return out;
+}
+
+/*
+ * Signs [path] the way [rule] says to, with the command-line PARAMS in
+ * [defaults], and adds the file it wrote to [wrote].
+ */
+static int watch_sign(const struct local_data_s *defaults,
+		      const struct watch_rule_s *rule, const char *path,
+		      struct name_list_s *wrote)
+{
+	char *argv[MAX_BATCH_ARGS + 2];
+	char *infile = NULL;
+	enum futil_file_type type;
+	int inout_file_count = 0;
+	int argc = 0;
+	int errorcnt = 0;
+	int i;
+
+	argv[argc++] = "sign";
+	for (i = 0; i < rule->nwords; i++) {
+		argv[argc] = expand_word(rule->words[i], path);
+		if (!argv[argc]) {
+			fprintf(stderr, "Out of memory\n");
+			errorcnt++;
 			goto done;
 		}
+		argc++;
+	}
+	argv[argc] = NULL;
+
+	option = *defaults;
+	option.watchdir = NULL;
+	option.nodes = NULL;
+	option.loems = NULL;
+	option.num_loems = 0;
+	optind = 0;
+	errorcnt = parse_sign_opts(argc, argv, &infile, &inout_file_count);
+	if (!option.num_loems) {
+		option.loems = defaults->loems;
+		option.num_loems = defaults->num_loems;
+	}
+	if (option.batchfile || option.nodes || option.watchdir ||
+	    option.journal) {
+		fprintf(stderr, "%s:%d: --batch and --watch can't be nested\n",
+			defaults->rulesfile, rule->lineno);
+		free(option.nodes);
+		errorcnt++;
 	}
+	if (!errorcnt)
+		errorcnt = check_sign_args(argc, argv, &infile, &type,
+					   &inout_file_count);
+	if (!errorcnt)
+		errorcnt = sign_one(&option, infile, type, inout_file_count);
+
+	/* An in-place resign writes the input */
+	if (option.outfile)
+		name_list_add(wrote, option.outfile);
+	else if (infile)
+		name_list_add(wrote, infile);
+
+	printf("%s %s\n", path, errorcnt ? "FAILED" : "OK");
+	fflush(stdout);
+	if (option.loems != defaults->loems)
+		free_loems(&option);
+
+done:
+	for (i = 1; i < argc; i++)
+		free(argv[i]);
+	return errorcnt;
+}
+
+/*
+ * Waits for files in the watched directory to be written or moved there,
+ * and signs each one that a rule matches. The keys stay cached, so a
+ * rebuild costs only the signing itself.
+ */
+static int do_watch(const struct local_data_s *defaults)
+{
+	struct watch_rule_s rule[MAX_WATCH_RULES];
+	struct name_list_s changed = {0}, wrote = {0};
+	struct sigaction sa;
+	struct pollfd pfd;
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	char *path;
+	size_t dirlen = strlen(defaults->watchdir);
+	ssize_t len;
+	int nrules, fd, n, i, j;
+	int errorcnt = 0;
+
+	nrules = read_watch_rules(defaults->rulesfile, rule);
+	if (nrules < 0)
+		return 1;
 
-	if (0 != futil_map_file(ifd, mapping, &buf, &buf_len)) {
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, defaults->watchdir,
+					IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		fprintf(stderr, "Can't watch %s: %s\n",
+			defaults->watchdir, strerror(errno));
+		if (fd >= 0)
+			close(fd);
 		errorcnt++;
 		goto done;
 	}
 
-	errorcnt += futil_traverse(buf, buf_len, &state, type);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_watch_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	stop_watching = 0;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!stop_watching) {
+		/* Block until something happens, then until it settles */
+		n = poll(&pfd, 1, changed.count ? WATCH_SETTLE_MS : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			errorcnt++;
+			break;
+		}
+
+		if (n > 0) {
+			len = read(fd, buf, sizeof(buf));
+			if (len < 0 && errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "Can't read events: %s\n",
+					strerror(errno));
+				errorcnt++;
+				break;
+			}
+			for (i = 0; i < len; i += sizeof(*ev) + ev->len) {
+				ev = (const struct inotify_event *)(buf + i);
+				if (ev->mask & IN_Q_OVERFLOW)
+					fprintf(stderr, "Missed some changes "
+						"in %s\n", defaults->watchdir);
+				if (!ev->len || (ev->mask & IN_ISDIR))
+					continue;
+				for (j = 0; j < nrules; j++)
+					if (!fnmatch(rule[j].pattern,
+						     ev->name, 0))
+						break;
+				if (j == nrules)
+					continue;
+				path = malloc(dirlen + strlen(ev->name) + 2);
+				if (!path)
+					continue;
+				sprintf(path, "%s/%s", defaults->watchdir,
+					ev->name);
+				/* Don't sign what we just signed */
+				j = name_list_find(&wrote, path);
+				if (j >= 0)
+					name_list_remove(&wrote, j);
+				else
+					name_list_add(&changed, path);
+				free(path);
+			}
+			continue;
+		}
+
+		/* It's been quiet for a while, so sign what changed */
+		name_list_clear(&wrote);
+		for (i = 0; i < changed.count; i++) {
+			const char *name = strrchr(changed.name[i], '/') + 1;
 
-	errorcnt += futil_unmap_file(ifd, MAP_RW, buf, buf_len);
+			for (j = 0; j < nrules; j++)
+				if (!fnmatch(rule[j].pattern, name, 0))
+					break;
+			errorcnt += watch_sign(defaults, &rule[j],
+					       changed.name[i], &wrote);
+		}
+		name_list_clear(&changed);
+	}
 
+	close(fd);
 done:
-	if (ifd >= 0 && close(ifd)) {
+	free_ext_signer();
+	name_list_clear(&changed);
+	name_list_clear(&wrote);
+	for (i = 0; i < nrules; i++)
+		free(rule[i].pattern);
+	return !!errorcnt;
+}
+
+/* Check the options for split signing, and read any signatures */
+static int split_begin(void)
+{
+	int errorcnt = 0;
+
+	if (!option.emit_digests && !option.attach_signatures)
+		return 0;
+
+	if (!split) {
+		fprintf(stderr, "Can't split signing\n");
+		return 1;
+	}
+	if (keep_keys || option.nodes || option.watchdir) {
+		fprintf(stderr, "Signing can't be split with --node, --watch"
+			" or in a serve session\n");
+		errorcnt++;
+	}
+	if (option.pem_external) {
+		fprintf(stderr, "Signing can't be split with"
+			" --pem_external\n");
+		errorcnt++;
+	}
+	if (vboot_version == VBOOT_VERSION_2_1) {
+		fprintf(stderr, "Signing can't be split with --vb21\n");
+		errorcnt++;
+	}
+
+	if (!errorcnt && option.attach_signatures &&
+	    SplitSigningReadSignatures(split, option.attach_signatures)) {
+		fprintf(stderr, "Can't read signatures from %s\n",
+			option.attach_signatures);
 		errorcnt++;
-		fprintf(stderr, "Error when closing ifd: %s\n",
-			strerror(errno));
 	}
+	return errorcnt;
+}
+
+/* Write out the digests, if that's what we're doing. Keys must be freed. */
+static int split_end(int errorcnt)
+{
+	uint32_t missing;
 
-	if (option.signprivate)
-		free(option.signprivate);
-	if (option.keyblock)
-		free(option.keyblock);
-	if (option.kernel_subkey)
-		free(option.kernel_subkey);
+	if (split && !errorcnt && option.emit_digests) {
+		if (SplitSigningWriteRequests(split, option.emit_digests,
+					      &missing)) {
+			fprintf(stderr, "Can't write %s\n",
+				option.emit_digests);
+			errorcnt++;
+		} else if (missing) {
+			printf("%u signature%s to make in %s\n", missing,
+			       missing == 1 ? "" : "s", option.emit_digests);
+		} else {
+			printf("All the signatures are there; use"
+			       " --attach_signatures\n");
+		}
+	}
+	SplitSigningFree(split);
+	split = NULL;
+	return errorcnt;
+}
+
+static int do_sign(int argc, char *argv[])
+{
+	char *infile = 0;
+	int errorcnt = 0;
+	enum futil_file_type type;
+	int inout_file_count = 0;
+	struct local_data_s defaults;
+	char **common;
+	int split_args = 0, collect = 0;
+	int i;
+
+	/* We may be called more than once by "futility serve" */
+	option = default_option;
+
+	/* Look ahead for --batch, so keys get cached as they're read */
+	for (i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "--batch") ||
+		    !strncmp(argv[i], "--batch=", 8) ||
+		    !strcmp(argv[i], "--watch") ||
+		    !strncmp(argv[i], "--watch=", 8))
+			batch_mode = 1;
+
+	/* Private keys are made as they're read, so they need this first */
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--emit_digests", 14))
+			collect = 1;
+		if (!strncmp(argv[i], "--emit_digests", 14) ||
+		    !strncmp(argv[i], "--attach_signatures", 19))
+			split_args = 1;
+	}
+	if (split_args)
+		split = SplitSigningNew(collect);
+
+	errorcnt += parse_sign_opts(argc, argv, &infile, &inout_file_count);
+	errorcnt += split_begin();
+
+	if (option.watchdir) {
+		if (infile || argc - optind > 0) {
+			fprintf(stderr,
+				"Input files go in the --rules file\n");
+			errorcnt++;
+		}
+		if (!option.rulesfile) {
+			fprintf(stderr, "--watch needs --rules\n");
+			errorcnt++;
+		}
+		if (option.batchfile || option.nodes || option.journal) {
+			fprintf(stderr, "--watch doesn't go with --batch,"
+				" --node or --journal\n");
+			errorcnt++;
+		}
+		if (!errorcnt) {
+			defaults = option;
+			errorcnt = do_watch(&defaults);
+		}
+		free(option.nodes);
+		free_loems(&option);
+		batch_mode = 0;
+		if (!keep_keys) {
+			free_key_cache();
+			PrivateKeyScheduledCleanup();
+		}
+		errorcnt = split_end(errorcnt);
+		return !!errorcnt;
+	}
+
+	if (option.batchfile) {
+		if (infile || argc - optind > 0) {
+			fprintf(stderr,
+				"Input files go in the --batch manifest\n");
+			errorcnt++;
+		}
+		if (option.group_commit && option.num_nodes) {
+			fprintf(stderr,
+				"--group_commit doesn't go with --node\n");
+			errorcnt++;
+		}
+		if (option.archive && option.num_nodes) {
+			fprintf(stderr, "--archive doesn't go with --node\n");
+			errorcnt++;
+		}
+		if (option.journal &&
+		    (option.num_nodes || option.group_commit ||
+		     option.archive || (split && option.emit_digests))) {
+			fprintf(stderr, "--journal doesn't go with --node,"
+				" --group_commit, --archive or"
+				" --emit_digests\n");
+			errorcnt++;
+		}
+		if ((option.group_commit || option.archive) &&
+		    option.verify_after) {
+			fprintf(stderr, "--verify_after can't read back"
+				" --group_commit or --archive outputs\n");
+			errorcnt++;
+		}
+		if (!errorcnt && option.num_nodes) {
+			common = calloc(argc, sizeof(*common));
+			errorcnt = !common ||
+				do_remote_batch(&option,
+						common_params(argc, argv, common),
+						common);
+			free(common);
+		} else if (!errorcnt) {
+			defaults = option;
+			errorcnt = do_batch(&defaults, argc, argv);
+		}
+		free(option.nodes);
+		free_loems(&option);
+		batch_mode = 0;
+		if (!keep_keys) {
+			free_key_cache();
+			PrivateKeyScheduledCleanup();
+		}
+		errorcnt = split_end(errorcnt);
+		return !!errorcnt;
+	}
+
+	if (option.rulesfile) {
+		fprintf(stderr, "--rules only works with --watch\n");
+		errorcnt++;
+	}
+	if (option.group_commit) {
+		fprintf(stderr, "--group_commit only works with --batch\n");
+		errorcnt++;
+	}
+	if (option.archive) {
+		fprintf(stderr, "--archive only works with --batch\n");
+		errorcnt++;
+	}
+	if (option.journal) {
+		fprintf(stderr, "--journal only works with --batch\n");
+		errorcnt++;
+	}
+
+	if (option.nodes) {
+		fprintf(stderr, "--node only works with --batch\n");
+		free(option.nodes);
+		option.nodes = NULL;
+		errorcnt++;
+	}
+
+	errorcnt += check_sign_args(argc, argv, &infile, &type,
+				    &inout_file_count);
+	if (errorcnt)
+		goto done;
+
+	errorcnt += sign_one(&option, infile, type, inout_file_count);
+
+done:
+	/* Cached keys belong to the cache */
+	if (!keep_keys) {
+		free_ext_signer();
+		PrivateKeyScheduledCleanup();
+		if (option.signprivate)
+			PrivateKeyFree(option.signprivate);
+		if (option.keyblock)
+			free(option.keyblock);
+		if (option.keyblock21)
+			free(option.keyblock21);
+		if (option.kernel_subkey)
+			free(option.kernel_subkey);
+	}
+	free_loems(&option);
+	errorcnt = split_end(errorcnt);
 
 	if (errorcnt)
 		fprintf(stderr, "Use --help for usage instructions\n");
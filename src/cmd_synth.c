@@ -0,0 +1,1302 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "cgptlib_internal.h"
+#include "cryptolib.h"
+#include "file_type.h"
+#include "fmap.h"
+#include "futility.h"
+#include "gbb_header.h"
+#include "gpt.h"
+#include "gpt_misc.h"
+#include "host_common.h"
+#include "util_misc.h"
+#include "vb1_helper.h"
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] OUTDIR\n"
+	"\n"
+	"Writes synthetic keys, BIOS images, kernel partitions and disk\n"
+	"images into OUTDIR, for load and scaling tests. Nothing in them is\n"
+	"real, but they're signed properly and \"" MYNAME " show\" and\n"
+	"\"" MYNAME " sign\" treat them like the real thing. The same\n"
+	"options and seed always give the same files.\n"
+	"\n"
+	"  keys/rsaBITS/     A keyset for each RSA size: root_key,\n"
+	"                      firmware_data_key, kernel_subkey and\n"
+	"                      kernel_data_key (.vbprivk, .vbpubk, .pem), and\n"
+	"                      firmware.keyblock and kernel.keyblock\n"
+	"  bios-NNNN.bin     BIOS images\n"
+	"  kernel-NNNN.bin   Kernel partitions\n"
+	"  disk-NNNN.bin     Sparse GPT disk images with kernels in them\n"
+	"  sign.batch        A \"" MYNAME " sign --batch\" manifest that\n"
+	"                      resigns them all into OUTDIR/signed/\n"
+	"\n"
+	"The images are signed with the --sign-bits keyset.\n"
+	"\n"
+	"Options:\n"
+	"  --seed NUM          Seed for everything (default 1)\n"
+	"  --count NUM         How many of each image to make (default 1)\n"
+	"  --types LIST        Which of keys,bios,kernel,disk to make\n"
+	"                        (default all)\n"
+	"  --bits LIST         RSA sizes to make keysets for (default\n"
+	"                        1024,2048,4096,8192; 8192 takes a while)\n"
+	"  --sign-bits NUM     The keyset to sign the images with\n"
+	"                        (default 2048)\n"
+	"  --layout NAME       BIOS FMAP layout: \"basic\", with just what\n"
+	"                        verified boot needs, or \"chromeos\", with\n"
+	"                        the RO/RW sections, VPDs and so on too\n"
+	"                        (default chromeos)\n"
+	"  --fmap-areas NUM    Extra, unused FMAP areas (default 0)\n"
+	"  --fw-size SIZE      FW_MAIN_A/B size (default 1M)\n"
+	"  --kernel-size SIZE  Kernel size (default 4M)\n"
+	"  --disk-size SIZE    Disk image size (default just big enough)\n"
+	"  --partitions NUM    GPT entries used in each disk image, up to\n"
+	"                        %d (default 12)\n"
+	"  --kernels NUM       Kernel partitions in each disk image, each\n"
+	"                        with a ROOT partition (default 2)\n"
+	"\n"
+	"A SIZE may end in K, M or G, and may be a range like 1M-4M, in which\n"
+	"case each image gets its own size from the range.\n"
+	"\n";
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog, MAX_NUMBER_OF_ENTRIES);
+}
+
+enum synth_type {
+	SYNTH_KEYS = 1 << 0,
+	SYNTH_BIOS = 1 << 1,
+	SYNTH_KERNEL = 1 << 2,
+	SYNTH_DISK = 1 << 3,
+};
+
+static const char *const type_names[] = {"keys", "bios", "kernel", "disk"};
+
+struct size_range_s {
+	uint64_t min;
+	uint64_t max;
+};
+
+static uint64_t seed = 1;
+static unsigned count = 1;
+static unsigned types = SYNTH_KEYS | SYNTH_BIOS | SYNTH_KERNEL | SYNTH_DISK;
+static unsigned bits_wanted;			/* Bitmap of keysets[] */
+static int sign_bits = 2048;
+static int chromeos_layout = 1;
+static unsigned fmap_areas;
+static struct size_range_s fw_size = {0x100000, 0x100000};
+static struct size_range_s kernel_size = {0x400000, 0x400000};
+static uint64_t disk_size;
+static unsigned partitions = 12;
+static unsigned kernels = 2;
+static const char *outdir;
+static FILE *batch;
+
+/*
+ * Everything comes from splitmix64, seeded from --seed and what's being made,
+ * so each file is the same however many others are made alongside it.
+ */
+struct rng_s {
+	uint64_t state;
+};
+
+static uint64_t rng_next(struct rng_s *r)
+{
+	uint64_t z = (r->state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void rng_init(struct rng_s *r, const char *what, uint32_t index)
+{
+	r->state = seed;
+	while (*what)
+		r->state = rng_next(r) ^ (uint8_t)*what++;
+	r->state = rng_next(r) ^ index;
+}
+
+static void rng_fill(struct rng_s *r, uint8_t *buf, uint64_t len)
+{
+	uint64_t v;
+	int i;
+
+	for (; len >= 8; buf += 8, len -= 8) {
+		v = rng_next(r);
+		for (i = 0; i < 8; i++)
+			buf[i] = v >> (8 * i);
+	}
+	v = rng_next(r);
+	for (i = 0; i < len; i++)
+		buf[i] = v >> (8 * i);
+}
+
+static uint64_t rng_size(struct rng_s *r, const struct size_range_s *range)
+{
+	if (range->max <= range->min)
+		return range->min;
+	return range->min + rng_next(r) % (range->max - range->min + 1);
+}
+
+/* Keysets, one per RSA size, all using SHA-256 */
+enum key_role {
+	ROOT_KEY,
+	FIRMWARE_DATA_KEY,
+	KERNEL_SUBKEY,
+	KERNEL_DATA_KEY,
+	NUM_KEY_ROLES
+};
+
+static const char *const role_names[] = {
+	"root_key", "firmware_data_key", "kernel_subkey", "kernel_data_key",
+};
+
+struct keyset_s {
+	int bits;
+	int algorithm;
+	VbPrivateKey *priv[NUM_KEY_ROLES];
+	VbPublicKey *pub[NUM_KEY_ROLES];
+	/* firmware_data_key signed by root_key */
+	VbKeyBlockHeader *fw_keyblock;
+	/* kernel_data_key signed by kernel_subkey */
+	VbKeyBlockHeader *kernel_keyblock;
+};
+
+static struct keyset_s keysets[] = {
+	{1024, 1},
+	{2048, 4},
+	{4096, 7},
+	{8192, 10},
+};
+
+static struct keyset_s *sign_keyset;
+
+#define FW_KEYBLOCK_FLAGS (KEY_BLOCK_FLAG_DEVELOPER_0 | \
+			   KEY_BLOCK_FLAG_DEVELOPER_1 | \
+			   KEY_BLOCK_FLAG_RECOVERY_0)
+#define KERNEL_KEYBLOCK_FLAGS (KEY_BLOCK_FLAG_DEVELOPER_0 | \
+			       KEY_BLOCK_FLAG_RECOVERY_0)
+
+/* Odd primes below this are sieved out before testing for a prime */
+#define SIEVE_LIMIT 8192
+#define RSA_E 65537
+
+static uint16_t small_primes[SIEVE_LIMIT / 4];
+static int num_small_primes;
+
+static void init_small_primes(void)
+{
+	uint8_t composite[SIEVE_LIMIT];
+	int i, j;
+
+	if (num_small_primes)
+		return;
+	memset(composite, 0, sizeof(composite));
+	for (i = 3; i < SIEVE_LIMIT; i += 2) {
+		if (composite[i])
+			continue;
+		small_primes[num_small_primes++] = i;
+		for (j = i * i; j < SIEVE_LIMIT; j += 2 * i)
+			composite[j] = 1;
+	}
+}
+
+/*
+ * Returns the first prime at or after a [bits]-bit random number from [r],
+ * for which p - 1 is coprime to RSA_E. The search itself doesn't depend on
+ * anything but the starting point, so the same seed gives the same prime.
+ */
+static BIGNUM *make_prime(struct rng_s *r, int bits, BN_CTX *ctx)
+{
+	uint8_t buf[RSA8192NUMBYTES / 2];
+	uint32_t rem[ARRAY_SIZE(small_primes)];
+	uint32_t rem_e, delta, added = 0;
+	int bytes = bits / 8;
+	BIGNUM *p;
+	int i;
+
+	rng_fill(r, buf, bytes);
+	/* The top two bits make the modulus exactly twice as long */
+	buf[0] |= 0xc0;
+	buf[bytes - 1] |= 1;
+	p = BN_bin2bn(buf, bytes, NULL);
+	if (!p)
+		return NULL;
+
+	init_small_primes();
+	for (i = 0; i < num_small_primes; i++)
+		rem[i] = BN_mod_word(p, small_primes[i]);
+	rem_e = BN_mod_word(p, RSA_E);
+
+	for (delta = 0; ; delta += 2) {
+		for (i = 0; i < num_small_primes; i++)
+			if ((rem[i] + delta) % small_primes[i] == 0)
+				break;
+		if (i < num_small_primes || (rem_e + delta) % RSA_E == 1)
+			continue;
+
+		if (!BN_add_word(p, delta - added))
+			break;
+		added = delta;
+		switch (BN_is_prime_ex(p, BN_prime_checks, ctx, NULL)) {
+		case 1:
+			return p;
+		case 0:
+			continue;
+		}
+		break;
+	}
+	BN_free(p);
+	return NULL;
+}
+
+/* Appends the DER encoding of the non-negative [n] to [p] */
+static uint8_t *der_integer(uint8_t *p, const BIGNUM *n)
+{
+	int len = BN_num_bytes(n);
+	uint8_t *start;
+
+	*p++ = 0x02;
+	/* Room for a leading zero and a length of up to three bytes */
+	start = p + 4;
+	start[0] = 0;
+	BN_bn2bin(n, start + 1);
+	if (!len || (start[1] & 0x80))
+		len++;
+	else
+		start++;
+
+	if (len >= 0x100) {
+		*p++ = 0x82;
+		*p++ = len >> 8;
+	} else if (len >= 0x80) {
+		*p++ = 0x81;
+	}
+	*p++ = len;
+	memmove(p, start, len);
+	return p + len;
+}
+
+/*
+ * Builds the key from its parts by way of its DER encoding, because struct
+ * rsa_st isn't the same in every OpenSSL release.
+ */
+static RSA *rsa_from_primes(BIGNUM *p, BIGNUM *q, BN_CTX *ctx)
+{
+	BIGNUM *n = BN_new(), *e = BN_new(), *d = BN_new();
+	BIGNUM *p1 = BN_new(), *q1 = BN_new(), *phi = BN_new();
+	BIGNUM *dmp1 = BN_new(), *dmq1 = BN_new(), *iqmp = BN_new();
+	const BIGNUM *parts[] = {n, e, d, p, q, dmp1, dmq1, iqmp};
+	const unsigned char *in;
+	uint8_t *der = NULL, *body, *end;
+	RSA *rsa = NULL;
+	uint32_t len;
+	int i;
+
+	if (!n || !e || !d || !p1 || !q1 || !phi || !dmp1 || !dmq1 || !iqmp ||
+	    !BN_set_word(e, RSA_E) ||
+	    !BN_mul(n, p, q, ctx) ||
+	    !BN_copy(p1, p) || !BN_sub_word(p1, 1) ||
+	    !BN_copy(q1, q) || !BN_sub_word(q1, 1) ||
+	    !BN_mul(phi, p1, q1, ctx) ||
+	    !BN_mod_inverse(d, e, phi, ctx) ||
+	    !BN_mod(dmp1, d, p1, ctx) ||
+	    !BN_mod(dmq1, d, q1, ctx) ||
+	    !BN_mod_inverse(iqmp, q, p, ctx))
+		goto done;
+
+	/* RSAPrivateKey ::= SEQUENCE { version 0, n, e, d, p, q, ... } */
+	der = malloc(ARRAY_SIZE(parts) * (BN_num_bytes(n) + 8) + 16);
+	if (!der)
+		goto done;
+	body = der + 4;
+	end = body;
+	*end++ = 0x02;
+	*end++ = 0x01;
+	*end++ = 0x00;
+	for (i = 0; i < ARRAY_SIZE(parts); i++)
+		end = der_integer(end, parts[i]);
+	len = end - body;
+	der[0] = 0x30;
+	der[1] = 0x82;
+	der[2] = len >> 8;
+	der[3] = len;
+
+	in = der;
+	rsa = d2i_RSAPrivateKey(NULL, &in, len + 4);
+
+done:
+	free(der);
+	BN_free(n);
+	BN_free(e);
+	BN_free(d);
+	BN_free(p1);
+	BN_free(q1);
+	BN_free(phi);
+	BN_free(dmp1);
+	BN_free(dmq1);
+	BN_free(iqmp);
+	return rsa;
+}
+
+static RSA *make_rsa(int bits, enum key_role role)
+{
+	struct rng_s r;
+	BN_CTX *ctx = BN_CTX_new();
+	BIGNUM *p = NULL, *q = NULL;
+	RSA *rsa = NULL;
+
+	rng_init(&r, role_names[role], bits);
+	if (ctx)
+		p = make_prime(&r, bits / 2, ctx);
+	if (p)
+		q = make_prime(&r, bits / 2, ctx);
+	if (q && BN_cmp(p, q))
+		rsa = rsa_from_primes(p, q, ctx);
+
+	BN_free(p);
+	BN_free(q);
+	if (ctx)
+		BN_CTX_free(ctx);
+	return rsa;
+}
+
+static int need_keyset(struct keyset_s *ks)
+{
+	uint8_t *keyb;
+	uint32_t keyb_size;
+	RSA *rsa;
+	int i;
+
+	if (ks->fw_keyblock)
+		return 0;
+
+	fprintf(stderr, "Making the %d-bit keys...\n", ks->bits);
+	for (i = 0; i < NUM_KEY_ROLES; i++) {
+		rsa = make_rsa(ks->bits, i);
+		if (!rsa)
+			return 1;
+		if (vb_keyb_from_rsa(rsa, &keyb, &keyb_size)) {
+			RSA_free(rsa);
+			return 1;
+		}
+		ks->priv[i] = malloc(sizeof(*ks->priv[i]));
+		ks->pub[i] = PublicKeyAlloc(keyb_size, ks->algorithm, 1);
+		if (!ks->priv[i] || !ks->pub[i]) {
+			RSA_free(rsa);
+			free(keyb);
+			return 1;
+		}
+		ks->priv[i]->rsa_private_key = rsa;
+		ks->priv[i]->algorithm = ks->algorithm;
+		ks->priv[i]->signer = NULL;
+		ks->priv[i]->signer_data = NULL;
+		memcpy(GetPublicKeyData(ks->pub[i]), keyb, keyb_size);
+		free(keyb);
+	}
+
+	ks->fw_keyblock = KeyBlockCreate(ks->pub[FIRMWARE_DATA_KEY],
+					 ks->priv[ROOT_KEY], FW_KEYBLOCK_FLAGS);
+	ks->kernel_keyblock = KeyBlockCreate(ks->pub[KERNEL_DATA_KEY],
+					     ks->priv[KERNEL_SUBKEY],
+					     KERNEL_KEYBLOCK_FLAGS);
+	return !ks->fw_keyblock || !ks->kernel_keyblock;
+}
+
+static void free_keysets(void)
+{
+	struct keyset_s *ks;
+	int i;
+
+	for (ks = keysets; ks < keysets + ARRAY_SIZE(keysets); ks++) {
+		for (i = 0; i < NUM_KEY_ROLES; i++) {
+			PrivateKeyFree(ks->priv[i]);
+			free(ks->pub[i]);
+		}
+		free(ks->fw_keyblock);
+		free(ks->kernel_keyblock);
+	}
+}
+
+/* Returns OUTDIR/[name], or NULL if it's too long */
+static const char *out_path(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+static const char *out_path(const char *fmt, ...)
+{
+	static char path[PATH_MAX];
+	char name[PATH_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof(name), fmt, ap);
+	va_end(ap);
+	if (snprintf(path, sizeof(path), "%s/%s", outdir, name) >=
+	    sizeof(path)) {
+		fprintf(stderr, "%s/%s is too long\n", outdir, name);
+		return NULL;
+	}
+	return path;
+}
+
+static int make_dir(const char *path)
+{
+	if (path && (!mkdir(path, 0777) || errno == EEXIST))
+		return 0;
+	fprintf(stderr, "Can't create %s: %s\n", path ? path : outdir,
+		strerror(errno));
+	return 1;
+}
+
+static int write_pem(const char *path, RSA *rsa)
+{
+	FILE *fp;
+	int rv = 1;
+
+	if (!path)
+		return 1;
+	fp = fopen(path, "w");
+	if (fp && PEM_write_RSAPrivateKey(fp, rsa, NULL, NULL, 0, NULL, NULL))
+		rv = 0;
+	if (fp && fclose(fp))
+		rv = 1;
+	if (rv)
+		fprintf(stderr, "Can't write %s\n", path);
+	return rv;
+}
+
+static int write_keyset(struct keyset_s *ks)
+{
+	const char *path;
+	int errorcnt = 0;
+	int i;
+
+	if (make_dir(out_path("keys")) ||
+	    make_dir(out_path("keys/rsa%d", ks->bits)))
+		return 1;
+
+	for (i = 0; i < NUM_KEY_ROLES; i++) {
+		path = out_path("keys/rsa%d/%s.vbprivk", ks->bits,
+				role_names[i]);
+		errorcnt += !path || PrivateKeyWrite(path, ks->priv[i]);
+		path = out_path("keys/rsa%d/%s.vbpubk", ks->bits,
+				role_names[i]);
+		errorcnt += !path || PublicKeyWrite(path, ks->pub[i]);
+		errorcnt += write_pem(out_path("keys/rsa%d/%s.pem", ks->bits,
+					       role_names[i]),
+				      ks->priv[i]->rsa_private_key);
+	}
+	path = out_path("keys/rsa%d/firmware.keyblock", ks->bits);
+	errorcnt += !path || KeyBlockWrite(path, ks->fw_keyblock);
+	path = out_path("keys/rsa%d/kernel.keyblock", ks->bits);
+	errorcnt += !path || KeyBlockWrite(path, ks->kernel_keyblock);
+	return errorcnt;
+}
+
+/* Writes a vblock for the firmware [body] into [out], like sign does */
+static int make_fw_vblock(uint8_t *out, uint64_t size,
+			  const uint8_t *body, uint64_t body_size)
+{
+	struct keyset_s *ks = sign_keyset;
+	VbFirmwarePreambleHeader *preamble;
+	VbSignature *body_sig;
+	uint64_t kb_size = ks->fw_keyblock->key_block_size;
+	int rv = 1;
+
+	body_sig = CalculateSignature(body, body_size,
+				      ks->priv[FIRMWARE_DATA_KEY]);
+	preamble = body_sig ?
+		CreateFirmwarePreamble(1, ks->pub[KERNEL_SUBKEY], body_sig,
+				       ks->priv[FIRMWARE_DATA_KEY], 0) : NULL;
+	if (preamble && kb_size + preamble->preamble_size <= size) {
+		memcpy(out, ks->fw_keyblock, kb_size);
+		memcpy(out + kb_size, preamble, preamble->preamble_size);
+		rv = 0;
+	}
+	free(body_sig);
+	free(preamble);
+	return rv;
+}
+
+#define MAX_FMAP_AREAS 256
+#define GBB_SIZE 0x40000
+#define VBLOCK_SIZE 0x10000
+#define FWID_SIZE 0x1000
+
+struct layout_s {
+	FmapAreaHeader area[MAX_FMAP_AREAS];
+	int count;
+	uint32_t end;
+};
+
+/* Adds an area after all the others, and returns its index */
+static int add_area(struct layout_s *l, const char *name, uint32_t size)
+{
+	FmapAreaHeader *ah = &l->area[l->count];
+
+	memset(ah, 0, sizeof(*ah));
+	ah->area_offset = l->end;
+	ah->area_size = size;
+	snprintf(ah->area_name, sizeof(ah->area_name), "%s", name);
+	l->end += size;
+	return l->count++;
+}
+
+/* Adds an area covering area [first] and everything after it */
+static void add_parent(struct layout_s *l, const char *name, int first)
+{
+	FmapAreaHeader *ah = &l->area[l->count++];
+
+	memset(ah, 0, sizeof(*ah));
+	ah->area_offset = l->area[first].area_offset;
+	ah->area_size = l->end - ah->area_offset;
+	snprintf(ah->area_name, sizeof(ah->area_name), "%s", name);
+}
+
+static FmapAreaHeader *find_area(struct layout_s *l, const char *name)
+{
+	int i;
+
+	for (i = 0; i < l->count; i++)
+		if (!strcmp(l->area[i].area_name, name))
+			return &l->area[i];
+	return NULL;
+}
+
+static void make_layout(struct layout_s *l, uint32_t fw_main_size)
+{
+	char name[FMAP_NAMELEN];
+	uint32_t fmap_size;
+	int first, section;
+	unsigned i;
+	char ab;
+
+	memset(l, 0, sizeof(*l));
+	fw_main_size = (fw_main_size + FWID_SIZE - 1) & ~(FWID_SIZE - 1);
+	/* Room for every area there might be */
+	fmap_size = (sizeof(FmapHeader) + MAX_FMAP_AREAS *
+		     sizeof(FmapAreaHeader) + 0xfff) & ~0xfff;
+
+	if (!chromeos_layout) {
+		add_area(l, "FMAP", fmap_size);
+		add_area(l, "GBB", GBB_SIZE);
+		add_area(l, "VBLOCK_A", VBLOCK_SIZE);
+		add_area(l, "FW_MAIN_A", fw_main_size);
+		add_area(l, "VBLOCK_B", VBLOCK_SIZE);
+		add_area(l, "FW_MAIN_B", fw_main_size);
+	} else {
+		first = add_area(l, "FMAP", fmap_size);
+		add_area(l, "GBB", GBB_SIZE);
+		add_area(l, "RO_FRID", FWID_SIZE);
+		add_parent(l, "RO_SECTION", first);
+		add_area(l, "RO_VPD", 0x4000);
+		add_parent(l, "WP_RO", first);
+
+		for (ab = 'A'; ab <= 'B'; ab++) {
+			snprintf(name, sizeof(name), "VBLOCK_%c", ab);
+			section = add_area(l, name, VBLOCK_SIZE);
+			snprintf(name, sizeof(name), "FW_MAIN_%c", ab);
+			add_area(l, name, fw_main_size);
+			snprintf(name, sizeof(name), "RW_FWID_%c", ab);
+			add_area(l, name, FWID_SIZE);
+			snprintf(name, sizeof(name), "RW_SECTION_%c", ab);
+			add_parent(l, name, section);
+		}
+		add_area(l, "RW_VPD", 0x2000);
+		add_area(l, "RW_SHARED", 0x4000);
+	}
+
+	for (i = 0; i < fmap_areas; i++) {
+		snprintf(name, sizeof(name), "RW_UNUSED_%u", i);
+		add_area(l, name, 0x1000);
+	}
+}
+
+static void fill_gbb(uint8_t *buf, unsigned index)
+{
+	GoogleBinaryBlockHeader *gbb = (GoogleBinaryBlockHeader *)buf;
+	VbPublicKey *root = sign_keyset->pub[ROOT_KEY];
+	uint64_t keysize = root->key_offset + root->key_size;
+
+	memset(gbb, 0, 0x3000);
+	memcpy(gbb->signature, GBB_SIGNATURE, GBB_SIGNATURE_SIZE);
+	gbb->major_version = GBB_MAJOR_VER;
+	gbb->minor_version = GBB_MINOR_VER;
+	gbb->header_size = GBB_HEADER_SIZE;
+	gbb->hwid_offset = GBB_HEADER_SIZE;
+	gbb->hwid_size = 0x100;
+	gbb->rootkey_offset = 0x200;
+	gbb->rootkey_size = 0x1000;
+	gbb->bmpfv_offset = 0x2200;
+	gbb->bmpfv_size = 0;
+	gbb->recovery_key_offset = 0x1200;
+	gbb->recovery_key_size = 0x1000;
+	snprintf((char *)gbb + gbb->hwid_offset, gbb->hwid_size,
+		 "SYNTH TEST %04u", index);
+	update_hwid_digest(gbb);
+	/* The root key is the recovery key too */
+	memcpy(buf + gbb->rootkey_offset, root, keysize);
+	memcpy(buf + gbb->recovery_key_offset, root, keysize);
+}
+
+static int make_bios(unsigned index)
+{
+	struct layout_s l;
+	struct rng_s r;
+	FmapHeader *fmap;
+	FmapAreaHeader *ah, *vblock, *fw_main;
+	uint8_t *buf;
+	uint32_t size;
+	const char *path;
+	char ab;
+	int rv = 1;
+
+	rng_init(&r, "bios", index);
+	make_layout(&l, rng_size(&r, &fw_size));
+
+	/* Flash parts are a power of two, with whatever's left over last */
+	for (size = 0x100000; size < l.end; size *= 2)
+		;
+	if (chromeos_layout && size > l.end)
+		add_area(&l, "RW_LEGACY", size - l.end);
+
+	buf = malloc(size);
+	if (!buf)
+		return 1;
+	memset(buf, 0xff, size);
+
+	fmap = (FmapHeader *)(buf + find_area(&l, "FMAP")->area_offset);
+	memset(fmap, 0, sizeof(*fmap));
+	memcpy(fmap->fmap_signature, FMAP_SIGNATURE, FMAP_SIGNATURE_SIZE);
+	fmap->fmap_ver_major = FMAP_VER_MAJOR;
+	fmap->fmap_size = size;
+	snprintf(fmap->fmap_name, sizeof(fmap->fmap_name),
+		 "SYNTH_%04u", index);
+	fmap->fmap_nareas = l.count;
+	memcpy(fmap + 1, l.area, l.count * sizeof(l.area[0]));
+
+	fill_gbb(buf + find_area(&l, "GBB")->area_offset, index);
+
+	/* Both slots have the same firmware in them, as usual */
+	fw_main = find_area(&l, "FW_MAIN_A");
+	rng_fill(&r, buf + fw_main->area_offset, fw_main->area_size);
+	memcpy(buf + find_area(&l, "FW_MAIN_B")->area_offset,
+	       buf + fw_main->area_offset, fw_main->area_size);
+
+	for (ab = 'A'; ab <= 'B'; ab++) {
+		char name[FMAP_NAMELEN];
+
+		snprintf(name, sizeof(name), "VBLOCK_%c", ab);
+		vblock = find_area(&l, name);
+		snprintf(name, sizeof(name), "FW_MAIN_%c", ab);
+		fw_main = find_area(&l, name);
+		if (make_fw_vblock(buf + vblock->area_offset,
+				   vblock->area_size,
+				   buf + fw_main->area_offset,
+				   fw_main->area_size))
+			goto done;
+		snprintf(name, sizeof(name), "RW_FWID_%c", ab);
+		ah = find_area(&l, name);
+		if (ah)
+			snprintf((char *)buf + ah->area_offset,
+				 ah->area_size, "Google_Synth.%u.0.0", index);
+	}
+	ah = find_area(&l, "RO_FRID");
+	if (ah)
+		snprintf((char *)buf + ah->area_offset, ah->area_size,
+			 "Google_Synth.%u.0.0", index);
+
+	if (futil_file_type_buf(buf, size) != FILE_TYPE_BIOS_IMAGE) {
+		fprintf(stderr, "BIOS image %u isn't right\n", index);
+		goto done;
+	}
+
+	path = out_path("bios-%04u.bin", index);
+	if (path && !WriteFile(path, buf, size))
+		rv = 0;
+	if (batch)
+		fprintf(batch, "-s %s/keys/rsa%d/firmware_data_key.vbprivk"
+			" -b %s/keys/rsa%d/firmware.keyblock"
+			" -k %s/keys/rsa%d/kernel_subkey.vbpubk"
+			" %s/bios-%04u.bin %s/signed/bios-%04u.bin\n",
+			outdir, sign_bits, outdir, sign_bits,
+			outdir, sign_bits, outdir, index, outdir, index);
+done:
+	free(buf);
+	return rv;
+}
+
+#define KERNEL_PADDING 0x10000
+#define KERNEL_LOAD_ADDRESS 0x100000
+
+/* Makes a signed kernel partition, vblock first, with a kernel from [r] */
+static uint8_t *make_kernel_part(struct rng_s *r, uint64_t *size_ptr)
+{
+	struct keyset_s *ks = sign_keyset;
+	struct kernel_blob_ctx_s kb;
+	uint8_t *vmlinuz, *blob, *vblock, *part = NULL;
+	uint64_t vmlinuz_size = rng_size(r, &kernel_size);
+	uint64_t blob_size, vblock_size;
+	static char config[] = "console=tty0 root=/dev/dm-0 cros_synth quiet";
+	uint8_t bootloader[0x1000];
+
+	vmlinuz = malloc(vmlinuz_size);
+	if (!vmlinuz)
+		return NULL;
+	rng_fill(r, vmlinuz, vmlinuz_size);
+	memset(bootloader, 0, sizeof(bootloader));
+	memset(&kb, 0, sizeof(kb));
+
+	blob = CreateKernelBlob(&kb, vmlinuz, vmlinuz_size, ARCH_ARM,
+				KERNEL_LOAD_ADDRESS,
+				(uint8_t *)config, sizeof(config),
+				bootloader, sizeof(bootloader), &blob_size);
+	free(vmlinuz);
+	vblock = blob ?
+		SignKernelBlob(&kb, blob, blob_size, KERNEL_PADDING, 1,
+			       KERNEL_LOAD_ADDRESS, ks->kernel_keyblock,
+			       ks->priv[KERNEL_DATA_KEY], 0, &vblock_size) :
+		NULL;
+	if (vblock) {
+		*size_ptr = vblock_size + blob_size;
+		part = malloc(*size_ptr);
+	}
+	if (part) {
+		memcpy(part, vblock, vblock_size);
+		memcpy(part + vblock_size, blob, blob_size);
+	}
+	free(vblock);
+	free(blob);
+	return part;
+}
+
+static int make_kernel(unsigned index)
+{
+	struct rng_s r;
+	const char *path;
+	uint8_t *part;
+	uint64_t size;
+	int rv = 1;
+
+	rng_init(&r, "kernel", index);
+	part = make_kernel_part(&r, &size);
+	if (!part || futil_file_type_buf(part, size) !=
+	    FILE_TYPE_KERN_PREAMBLE) {
+		fprintf(stderr, "Kernel partition %u isn't right\n", index);
+		free(part);
+		return 1;
+	}
+
+	path = out_path("kernel-%04u.bin", index);
+	if (path && !WriteFile(path, part, size))
+		rv = 0;
+	if (batch)
+		fprintf(batch, "-s %s/keys/rsa%d/kernel_data_key.vbprivk"
+			" -b %s/keys/rsa%d/kernel.keyblock"
+			" %s/kernel-%04u.bin %s/signed/kernel-%04u.bin\n",
+			outdir, sign_bits, outdir, sign_bits,
+			outdir, index, outdir, index);
+	free(part);
+	return rv;
+}
+
+/* Partitions start on a multiple of this many sectors */
+#define PART_ALIGN 64
+/* Non-kernel partitions get at least this much if --disk-size isn't given */
+#define MIN_PART_SECTORS (0x100000 / DISK_SECTOR_SIZE)
+
+static void set_guid(struct rng_s *r, Guid *guid)
+{
+	rng_fill(r, guid->u.raw, sizeof(guid->u.raw));
+	futil_make_uuid(guid);
+}
+
+static void set_name(GptEntry *e, const char *fmt, unsigned n)
+{
+	char name[ARRAY_SIZE(e->name)];
+	int i;
+
+	snprintf(name, sizeof(name), fmt, n);
+	for (i = 0; name[i]; i++)
+		e->name[i] = name[i];
+}
+
+static int make_disk(unsigned index)
+{
+	static const Guid kernel_type = GPT_ENT_TYPE_CHROMEOS_KERNEL;
+	static const Guid rootfs_type = GPT_ENT_TYPE_CHROMEOS_ROOTFS;
+	static const Guid data_type = GPT_ENT_TYPE_LINUX_DATA;
+	static const Guid reserved_type = GPT_ENT_TYPE_CHROMEOS_RESERVED;
+	struct rng_s r;
+	uint8_t *part[MAX_NUMBER_OF_ENTRIES] = {NULL};
+	uint64_t part_size[MAX_NUMBER_OF_ENTRIES];
+	uint8_t *gpt = NULL, *tail;
+	GptEntry *entries, *e;
+	Guid disk_uuid;
+	uint64_t sectors, lba, others, share;
+	const char *path;
+	unsigned i, k;
+	int fd = -1, rv = 1, err;
+
+	rng_init(&r, "disk", index);
+	gpt = calloc(GPT_SECTORS + GPT_TAIL_SECTORS, DISK_SECTOR_SIZE);
+	if (!gpt)
+		return 1;
+	entries = (GptEntry *)(gpt + (GPT_PMBR_SECTORS + GPT_HEADER_SECTORS) *
+			       DISK_SECTOR_SIZE);
+	tail = gpt + GPT_SECTORS * DISK_SECTOR_SIZE;
+
+	/* Like Chrome OS: STATE, then KERN-A, ROOT-A, KERN-B, ROOT-B, ... */
+	lba = futil_align_lba(GPT_SECTORS, PART_ALIGN);
+	for (k = 0; k < kernels; k++) {
+		i = 1 + 2 * k;
+		part[i] = make_kernel_part(&r, &part_size[i]);
+		if (!part[i])
+			goto done;
+		e = &entries[i];
+		e->type = kernel_type;
+		set_name(e, "KERN-%c", 'A' + k);
+		e->starting_lba = lba;
+		e->ending_lba = lba +
+			(part_size[i] + DISK_SECTOR_SIZE - 1) /
+			DISK_SECTOR_SIZE - 1;
+		lba = futil_align_lba(e->ending_lba + 1, PART_ALIGN);
+		/* The first one boots, the rest are fallbacks */
+		SetEntryPriority(e, k ? 1 : 2);
+		SetEntrySuccessful(e, 1);
+	}
+
+	/* Everything else shares what's left */
+	others = partitions - kernels;
+	if (!disk_size) {
+		sectors = lba + others *
+			futil_align_lba(MIN_PART_SECTORS, PART_ALIGN) +
+			GPT_SECTORS;
+	} else {
+		sectors = disk_size / DISK_SECTOR_SIZE;
+		if (sectors < lba + others * PART_ALIGN + GPT_SECTORS) {
+			fprintf(stderr, "--disk-size is too small for the"
+				" kernels and partitions\n");
+			goto done;
+		}
+	}
+	share = (sectors - GPT_SECTORS - lba) / others / PART_ALIGN *
+		PART_ALIGN;
+
+	for (i = 0; i < partitions; i++) {
+		e = &entries[i];
+		set_guid(&r, &e->unique);
+		if (i && i <= 2 * kernels && (i & 1))
+			continue;		/* A kernel, done already */
+
+		e->starting_lba = lba;
+		e->ending_lba = lba + share - 1;
+		lba += share;
+		if (!i) {
+			e->type = data_type;
+			set_name(e, "STATE", 0);
+		} else if (i <= 2 * kernels) {
+			e->type = rootfs_type;
+			set_name(e, "ROOT-%c", 'A' + (i - 1) / 2);
+		} else {
+			e->type = reserved_type;
+			set_name(e, "RESERVED-%u", i + 1);
+		}
+	}
+
+	set_guid(&r, &disk_uuid);
+	err = futil_make_gpt(gpt, tail, sectors, &disk_uuid);
+	if (err != GPT_SUCCESS) {
+		fprintf(stderr, "Disk %u's GPT isn't right: %s\n", index,
+			GptErrorText(err));
+		goto done;
+	}
+
+	path = out_path("disk-%04u.bin", index);
+	if (!path)
+		goto done;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 ||
+	    ftruncate(fd, sectors * DISK_SECTOR_SIZE) ||
+	    futil_write_at(fd, gpt, GPT_SECTORS * DISK_SECTOR_SIZE, 0) ||
+	    futil_write_at(fd, tail, GPT_TAIL_SECTORS * DISK_SECTOR_SIZE,
+			   (sectors - GPT_TAIL_SECTORS) * DISK_SECTOR_SIZE)) {
+		fprintf(stderr, "Can't write %s: %s\n", path, strerror(errno));
+		goto done;
+	}
+	for (k = 0; k < kernels; k++) {
+		i = 1 + 2 * k;
+		lba = entries[i].starting_lba;
+		if (futil_write_at(fd, part[i], part_size[i],
+				   lba * DISK_SECTOR_SIZE)) {
+			fprintf(stderr, "Can't write %s: %s\n", path,
+				strerror(errno));
+			goto done;
+		}
+	}
+	if (close(fd)) {
+		fd = -1;
+		fprintf(stderr, "Can't write %s: %s\n", path, strerror(errno));
+		goto done;
+	}
+	fd = -1;
+	rv = 0;
+
+	if (batch)
+		fprintf(batch, "-s %s/keys/rsa%d/kernel_data_key.vbprivk"
+			" %s/disk-%04u.bin %s/signed/disk-%04u.bin\n",
+			outdir, sign_bits, outdir, index, outdir, index);
+done:
+	if (fd >= 0)
+		close(fd);
+	for (i = 0; i < ARRAY_SIZE(part); i++)
+		free(part[i]);
+	free(gpt);
+	return rv;
+}
+
+/* Parses NUM[K|M|G], returning 0 on success */
+static int parse_size(const char *str, char **end, uint64_t *size)
+{
+	uint64_t val;
+
+	errno = 0;
+	val = strtoull(str, end, 0);
+	if (errno || *end == str)
+		return 1;
+	switch (**end) {
+	case 'G':
+	case 'g':
+		val <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		val <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		val <<= 10;
+		(*end)++;
+	}
+	*size = val;
+	return 0;
+}
+
+/* Parses SIZE or SIZE-SIZE */
+static int parse_size_range(const char *str, struct size_range_s *range)
+{
+	char *e;
+
+	if (parse_size(str, &e, &range->min))
+		return 1;
+	range->max = range->min;
+	if (*e == '-' && parse_size(e + 1, &e, &range->max))
+		return 1;
+	return *e || !range->min || range->max < range->min;
+}
+
+/* Parses a comma-separated LIST of [names], returning a bitmap */
+static int parse_list(const char *str, const char *const names[], int count,
+		      unsigned *bitmap)
+{
+	const char *s = str;
+	size_t len;
+	int i;
+
+	*bitmap = 0;
+	while (*s) {
+		len = strcspn(s, ",");
+		for (i = 0; i < count; i++)
+			if (strlen(names[i]) == len &&
+			    !strncmp(s, names[i], len))
+				break;
+		if (i == count)
+			return 1;
+		*bitmap |= 1 << i;
+		s += len;
+		if (*s)
+			s++;
+	}
+	return !*bitmap;
+}
+
+static int parse_bits(const char *str)
+{
+	static char names[ARRAY_SIZE(keysets)][8];
+	static const char *ptrs[ARRAY_SIZE(keysets)];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(keysets); i++) {
+		snprintf(names[i], sizeof(names[i]), "%d", keysets[i].bits);
+		ptrs[i] = names[i];
+	}
+	return parse_list(str, ptrs, ARRAY_SIZE(keysets), &bits_wanted);
+}
+
+enum no_short_opts {
+	OPT_SEED = 1000,
+	OPT_COUNT,
+	OPT_TYPES,
+	OPT_BITS,
+	OPT_SIGN_BITS,
+	OPT_LAYOUT,
+	OPT_FMAP_AREAS,
+	OPT_FW_SIZE,
+	OPT_KERNEL_SIZE,
+	OPT_DISK_SIZE,
+	OPT_PARTITIONS,
+	OPT_KERNELS,
+	OPT_HELP,
+};
+
+static const struct option long_opts[] = {
+	/* name    hasarg *flag  val */
+	{"seed",        1, NULL, OPT_SEED},
+	{"count",       1, NULL, OPT_COUNT},
+	{"types",       1, NULL, OPT_TYPES},
+	{"bits",        1, NULL, OPT_BITS},
+	{"sign-bits",   1, NULL, OPT_SIGN_BITS},
+	{"layout",      1, NULL, OPT_LAYOUT},
+	{"fmap-areas",  1, NULL, OPT_FMAP_AREAS},
+	{"fw-size",     1, NULL, OPT_FW_SIZE},
+	{"kernel-size", 1, NULL, OPT_KERNEL_SIZE},
+	{"disk-size",   1, NULL, OPT_DISK_SIZE},
+	{"partitions",  1, NULL, OPT_PARTITIONS},
+	{"kernels",     1, NULL, OPT_KERNELS},
+	{"help",        0, NULL, OPT_HELP},
+	{NULL,          0, NULL, 0},
+};
+
+static int do_synth(int argc, char *argv[])
+{
+	struct size_range_s range;
+	struct keyset_s *ks;
+	char *e = NULL;
+	const char *path;
+	unsigned images = types & (SYNTH_BIOS | SYNTH_KERNEL | SYNTH_DISK);
+	int errorcnt = 0;
+	int i;
+
+	opterr = 0;		/* quiet, you */
+	while ((i = getopt_long(argc, argv, ":", long_opts, NULL)) != -1) {
+		switch (i) {
+		case OPT_SEED:
+			seed = strtoull(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr,
+					"Invalid --seed \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_COUNT:
+			count = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr,
+					"Invalid --count \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_TYPES:
+			if (parse_list(optarg, type_names,
+				       ARRAY_SIZE(type_names), &types)) {
+				fprintf(stderr,
+					"Invalid --types \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_BITS:
+			if (parse_bits(optarg)) {
+				fprintf(stderr,
+					"Invalid --bits \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_SIGN_BITS:
+			sign_bits = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr,
+					"Invalid --sign-bits \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_LAYOUT:
+			if (!strcmp(optarg, "chromeos")) {
+				chromeos_layout = 1;
+			} else if (!strcmp(optarg, "basic")) {
+				chromeos_layout = 0;
+			} else {
+				fprintf(stderr,
+					"Invalid --layout \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_FMAP_AREAS:
+			fmap_areas = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) ||
+			    fmap_areas > MAX_FMAP_AREAS - 32) {
+				fprintf(stderr,
+					"Invalid --fmap-areas \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_FW_SIZE:
+			if (parse_size_range(optarg, &fw_size) ||
+			    fw_size.max > 0x10000000) {
+				fprintf(stderr,
+					"Invalid --fw-size \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_KERNEL_SIZE:
+			if (parse_size_range(optarg, &kernel_size) ||
+			    kernel_size.max > 0x40000000) {
+				fprintf(stderr,
+					"Invalid --kernel-size \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_DISK_SIZE:
+			if (parse_size_range(optarg, &range) ||
+			    range.max != range.min) {
+				fprintf(stderr,
+					"Invalid --disk-size \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			disk_size = range.min;
+			break;
+		case OPT_PARTITIONS:
+			partitions = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || !partitions ||
+			    partitions > MAX_NUMBER_OF_ENTRIES) {
+				fprintf(stderr,
+					"Invalid --partitions \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_KERNELS:
+			kernels = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || kernels > 26) {
+				fprintf(stderr,
+					"Invalid --kernels \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_HELP:
+			print_help(argv[0]);
+			return 0;
+		case '?':
+			fprintf(stderr, "Unrecognized option: %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument to %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		default:
+			DIE;
+		}
+	}
+
+	if (partitions < 2 * kernels + 1) {
+		fprintf(stderr, "--partitions must leave room for a ROOT for"
+			" each kernel, and STATE\n");
+		errorcnt++;
+	}
+	for (i = 0; i < ARRAY_SIZE(keysets); i++)
+		if (keysets[i].bits == sign_bits)
+			sign_keyset = &keysets[i];
+	if (!sign_keyset) {
+		fprintf(stderr, "Invalid --sign-bits %d\n", sign_bits);
+		errorcnt++;
+	}
+	if (argc - optind != 1) {
+		fprintf(stderr, "Give one OUTDIR\n");
+		errorcnt++;
+	}
+	if (errorcnt) {
+		print_help(argv[0]);
+		return 1;
+	}
+	outdir = argv[optind];
+	if (!bits_wanted)
+		bits_wanted = (1 << ARRAY_SIZE(keysets)) - 1;
+
+	if (make_dir(outdir))
+		return 1;
+
+	/* The images need the signing keys, and so does anyone using them */
+	for (i = 0; i < ARRAY_SIZE(keysets); i++) {
+		ks = &keysets[i];
+		if (!(ks == sign_keyset && images) &&
+		    !((types & SYNTH_KEYS) && (bits_wanted & (1 << i))))
+			continue;
+		if (need_keyset(ks)) {
+			fprintf(stderr, "Can't make the %d-bit keys\n",
+				ks->bits);
+			errorcnt++;
+			goto done;
+		}
+		errorcnt += write_keyset(ks);
+	}
+
+	if (images) {
+		path = out_path("sign.batch");
+		batch = path ? fopen(path, "w") : NULL;
+		if (!batch || make_dir(out_path("signed"))) {
+			fprintf(stderr, "Can't write %s\n",
+				path ? path : "sign.batch");
+			errorcnt++;
+			goto done;
+		}
+	}
+
+	for (i = 0; i < count && !errorcnt; i++) {
+		if (types & SYNTH_BIOS)
+			errorcnt += make_bios(i);
+		if (types & SYNTH_KERNEL)
+			errorcnt += make_kernel(i);
+		if (types & SYNTH_DISK)
+			errorcnt += make_disk(i);
+	}
+
+done:
+	if (batch && fclose(batch)) {
+		fprintf(stderr, "Can't write sign.batch\n");
+		errorcnt++;
+	}
+	free_keysets();
+	return !!errorcnt;
+}
+
+DECLARE_FUTIL_COMMAND(synth, do_synth,
+		      VBOOT_VERSION_ALL,
+		      "Make synthetic keys and images for load tests",
+		      print_help);
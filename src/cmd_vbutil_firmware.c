@@ -5,11 +5,15 @@
  * Verified boot firmware utility
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>		/* For PRIu64 */
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "cryptolib.h"
@@ -74,6 +78,43 @@ static void print_help(const char *prog)
 	       prog);
 }
 
+/* Open the firmware volume for DigestFileRegion(). Returns the fd, or -1. */
+static int OpenFirmwareVolume(const char *fv_file, uint64_t *size_ptr)
+{
+	struct stat sb;
+	int fd;
+
+	fd = open(fv_file, O_RDONLY);
+	if (fd < 0) {
+		VbExError("Can't open %s: %s\n", fv_file, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &sb)) {
+		VbExError("Can't stat %s: %s\n", fv_file, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	*size_ptr = sb.st_size;
+	return fd;
+}
+
+/* Map a keyblock or vblock read-only. Undo with futil_unmap_file(). */
+static uint8_t *MapVblockFile(const char *filename, uint64_t *size_ptr)
+{
+	uint8_t *buf;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		VbExError("Can't open %s: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	if (FILE_ERR_NONE != futil_map_file(fd, MAP_RO, &buf, size_ptr))
+		buf = NULL;
+	close(fd);
+	return buf;
+}
+
 /* Create a firmware .vblock */
 static int Vblock(const char *outfile, const char *keyblock_file,
 		  const char *signprivate, uint64_t version,
@@ -81,14 +122,17 @@ static int Vblock(const char *outfile, const char *keyblock_file,
 		  uint32_t preamble_flags)
 {
 
-	VbPrivateKey *signing_key;
-	VbPublicKey *kernel_subkey;
-	VbSignature *body_sig;
-	VbFirmwarePreambleHeader *preamble;
-	VbKeyBlockHeader *key_block;
-	uint64_t key_block_size;
-	uint8_t *fv_data;
+	VbPrivateKey *signing_key = NULL;
+	VbPublicKey *kernel_subkey = NULL;
+	VbSignature *body_sig = NULL;
+	VbFirmwarePreambleHeader *preamble = NULL;
+	VbKeyBlockHeader *key_block = NULL;
+	uint64_t key_block_size = 0;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	DigestContext ctx;
 	uint64_t fv_size;
+	int fv_fd = -1;
+	int rv = 1;
 	FILE *f;
 	uint64_t i;
 
@@ -106,39 +150,44 @@ static int Vblock(const char *outfile, const char *keyblock_file,
 	}
 
 	/* Read the key block and keys */
-	key_block =
-	    (VbKeyBlockHeader *) ReadFile(keyblock_file, &key_block_size);
+	key_block = (VbKeyBlockHeader *)MapVblockFile(keyblock_file,
+						      &key_block_size);
 	if (!key_block) {
 		VbExError("Error reading key block.\n");
-		return 1;
+		goto done;
 	}
 
 	signing_key = PrivateKeyRead(signprivate);
 	if (!signing_key) {
 		VbExError("Error reading signing key.\n");
-		return 1;
+		goto done;
 	}
 
 	kernel_subkey = PublicKeyRead(kernelkey_file);
 	if (!kernel_subkey) {
 		VbExError("Error reading kernel subkey.\n");
-		return 1;
+		goto done;
 	}
 
 	/* Read and sign the firmware volume */
-	fv_data = ReadFile(fv_file, &fv_size);
-	if (!fv_data)
-		return 1;
+	fv_fd = OpenFirmwareVolume(fv_file, &fv_size);
+	if (fv_fd < 0)
+		goto done;
 	if (!fv_size) {
 		VbExError("Empty firmware volume file\n");
-		return 1;
+		goto done;
+	}
+	DigestInit(&ctx, signing_key->algorithm);
+	if (DigestFileRegion(&ctx, fv_fd, 0, fv_size, NULL, NULL)) {
+		VbExError("Error reading firmware volume\n");
+		goto done;
 	}
-	body_sig = CalculateSignature(fv_data, fv_size, signing_key);
+	DigestFinalInto(&ctx, digest);
+	body_sig = CalculateSignatureForDigest(digest, fv_size, signing_key);
 	if (!body_sig) {
 		VbExError("Error calculating body signature\n");
-		return 1;
+		goto done;
 	}
-	free(fv_data);
 
 	/* Create preamble */
 	preamble = CreateFirmwarePreamble(version,
@@ -147,14 +196,14 @@ static int Vblock(const char *outfile, const char *keyblock_file,
 					  signing_key, preamble_flags);
 	if (!preamble) {
 		VbExError("Error creating preamble.\n");
-		return 1;
+		goto done;
 	}
 
 	/* Write the output file */
 	f = fopen(outfile, "wb");
 	if (!f) {
 		VbExError("Can't open output file %s\n", outfile);
-		return 1;
+		goto done;
 	}
 	i = ((1 != fwrite(key_block, key_block_size, 1, f)) ||
 	     (1 != fwrite(preamble, preamble->preamble_size, 1, f)));
@@ -162,11 +211,23 @@ static int Vblock(const char *outfile, const char *keyblock_file,
 	if (i) {
 		VbExError("Can't write output file %s\n", outfile);
 		unlink(outfile);
-		return 1;
+		goto done;
 	}
 
 	/* Success */
-	return 0;
+	rv = 0;
+
+done:
+	if (fv_fd >= 0)
+		close(fv_fd);
+	free(preamble);
+	free(body_sig);
+	free(kernel_subkey);
+	free(signing_key);
+	if (key_block)
+		futil_unmap_file(-1, MAP_RO, (uint8_t *)key_block,
+				 key_block_size);
+	return rv;
 }
 
 static int Verify(const char *infile, const char *signpubkey,
@@ -176,13 +237,16 @@ static int Verify(const char *infile, const char *signpubkey,
 	VbKeyBlockHeader *key_block;
 	VbFirmwarePreambleHeader *preamble;
 	VbPublicKey *data_key;
-	VbPublicKey *sign_key;
+	VbPublicKey *sign_key = NULL;
 	VbPublicKey *kernel_subkey;
-	RSAPublicKey *rsa;
-	uint8_t *blob;
-	uint64_t blob_size;
-	uint8_t *fv_data;
+	RSAPublicKey *rsa = NULL;
+	uint8_t *blob = NULL;
+	uint64_t blob_size = 0;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	DigestContext ctx;
 	uint64_t fv_size;
+	int fv_fd = -1;
+	int rv = 1;
 	uint64_t now = 0;
 	uint32_t flags;
 
@@ -198,27 +262,26 @@ static int Verify(const char *infile, const char *signpubkey,
 		return 1;
 	}
 
-	/* Read blob */
-	blob = ReadFile(infile, &blob_size);
+	/* Map the vblock; only its headers are ever looked at */
+	blob = MapVblockFile(infile, &blob_size);
 	if (!blob) {
 		VbExError("Error reading input file\n");
-		return 1;
+		goto done;
 	}
 
-	/* Read firmware volume */
-	fv_data = ReadFile(fv_file, &fv_size);
-	if (!fv_data) {
+	/* Open firmware volume; it's read as it's hashed */
+	fv_fd = OpenFirmwareVolume(fv_file, &fv_size);
+	if (fv_fd < 0) {
 		VbExError("Error reading firmware volume\n");
-		return 1;
+		goto done;
 	}
 
 	/* Verify key block */
 	key_block = (VbKeyBlockHeader *) blob;
 	if (0 != KeyBlockVerify(key_block, blob_size, sign_key, 0)) {
 		VbExError("Error verifying key block.\n");
-		return 1;
+		goto done;
 	}
-	free(sign_key);
 	now += key_block->key_block_size;
 
 	printf("Key block:\n");
@@ -239,14 +302,14 @@ static int Verify(const char *infile, const char *signpubkey,
 	rsa = PublicKeyToRSA(&key_block->data_key);
 	if (!rsa) {
 		VbExError("Error parsing data key.\n");
-		return 1;
+		goto done;
 	}
 
 	/* Verify preamble */
 	preamble = (VbFirmwarePreambleHeader *) (blob + now);
 	if (0 != VerifyFirmwarePreamble(preamble, blob_size - now, rsa)) {
 		VbExError("Error verifying preamble.\n");
-		return 1;
+		goto done;
 	}
 	now += preamble->preamble_size;
 
@@ -280,11 +343,22 @@ static int Verify(const char *infile, const char *signpubkey,
 		    ("Preamble requests USE_RO_NORMAL;"
 		     " skipping body verification.\n");
 	} else {
-		if (0 !=
-		    VerifyData(fv_data, fv_size, &preamble->body_signature,
-			       rsa)) {
+		if (preamble->body_signature.data_size > fv_size) {
 			VbExError("Error verifying firmware body.\n");
-			return 1;
+			goto done;
+		}
+		DigestInit(&ctx, rsa->algorithm);
+		if (DigestFileRegion(&ctx, fv_fd, 0,
+				     preamble->body_signature.data_size,
+				     NULL, NULL)) {
+			VbExError("Error reading firmware volume\n");
+			goto done;
+		}
+		DigestFinalInto(&ctx, digest);
+		if (0 != VerifyDigest(digest, &preamble->body_signature,
+				      rsa)) {
+			VbExError("Error verifying firmware body.\n");
+			goto done;
 		}
 		printf("Body verification succeeded.\n");
 	}
@@ -292,11 +366,21 @@ static int Verify(const char *infile, const char *signpubkey,
 	if (kernelkey_file) {
 		if (0 != PublicKeyWrite(kernelkey_file, kernel_subkey)) {
 			VbExError("Unable to write kernel subkey\n");
-			return 1;
+			goto done;
 		}
 	}
 
-	return 0;
+	rv = 0;
+
+done:
+	if (fv_fd >= 0)
+		close(fv_fd);
+	if (rsa)
+		RSAPublicKeyFree(rsa);
+	if (blob)
+		futil_unmap_file(-1, MAP_RO, blob, blob_size);
+	free(sign_key);
+	return rv;
 }
 
 static int do_vbutil_firmware(int argc, char *argv[])
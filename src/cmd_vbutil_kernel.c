@@ -11,18 +11,9 @@
 #include <getopt.h>
 #include <inttypes.h>		/* For PRIu64 */
 
-#if defined(__CYGWIN__)
-#include <cygwin/fs.h>		/* For BLKGETSIZE64 */
-#elif defined(__linux__)
-#include <linux/fs.h>       /* for BLKGETSIZE64 */
-#elif defined(__FreeBSD_kernel__)
-#include <sys/disk.h>       /* for DIOCGMEDIASIZE */
-#endif
-
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -124,10 +115,13 @@ static const char usage[] =
 	"  Required parameters:\n"
 	"    --signprivate <file>      Private key to sign kernel data,\n"
 	"                                in .vbprivk format\n"
-	"    --oldblob <file>          Previously packed kernel blob\n"
-	"                                (including verfication blob)\n"
 	"\n"
 	"  Optional:\n"
+	"    --oldblob <file>          Previously packed kernel blob\n"
+	"                                (including verfication blob);\n"
+	"                                without it, <file> is repacked\n"
+	"                                in place, and only its vblock\n"
+	"                                and config are rewritten\n"
 	"    --keyblock <file>         Key block in .keyblock format\n"
 	"    --config <file>           New command line file\n"
 	"    --version <number>        Kernel version\n"
@@ -161,61 +155,29 @@ static void print_help(const char *progname)
 }
 
 
-/* Return an explanation when fread() fails. */
-static const char *error_fread(FILE *fp)
-{
-	const char *retval = "beats me why";
-	if (feof(fp))
-		retval = "EOF";
-	else if (ferror(fp))
-		retval = strerror(errno);
-	clearerr(fp);
-	return retval;
-}
-
-
-/* This reads a complete kernel partition into a buffer */
-static uint8_t *ReadOldKPartFromFileOrDie(const char *filename,
+/* This maps a complete kernel partition (or block device) read-only. Pages
+ * we write to, such as the config during --repack, are copied privately. */
+static uint8_t *MapOldKPartFromFileOrDie(const char *filename,
 					 uint64_t *size_ptr)
 {
-	FILE *fp = NULL;
-	struct stat statbuf;
 	uint8_t *buf;
 	uint64_t file_size = 0;
+	int fd;
 
-	if (0 != stat(filename, &statbuf))
-		Fatal("Unable to stat %s: %s\n", filename, strerror(errno));
-
-	if (S_ISBLK(statbuf.st_mode)) {
-		int fd = open(filename, O_RDONLY);
-		if (fd >= 0) {
-#ifdef BLKGETSIZE64
-			/* Linux, Cygwin */
-			ioctl(fd, BLKGETSIZE64, &file_size);
-#endif
-#ifdef DIOCGMEDIASIZE
-			/* FreeBSD */
-			ioctl(fd, DIOCGMEDIASIZE, &file_size);
-#endif
-			close(fd);
-		}
-	} else {
-		file_size = statbuf.st_size;
-	}
-	Debug("%s size is 0x%" PRIx64 "\n", filename, file_size);
-	if (file_size < opt_pad)
-		Fatal("%s is too small to be a valid kernel blob\n");
-
-	Debug("Reading %s\n", filename);
-	fp = fopen(filename, "rb");
-	if (!fp)
+	Debug("Mapping %s\n", filename);
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
 		Fatal("Unable to open file %s: %s\n", filename,
 		      strerror(errno));
 
-	buf = malloc(file_size);
-	if (1 != fread(buf, file_size, 1, fp))
-		Fatal("Unable to read entirety of %s: %s\n", filename,
-		      error_fread(fp));
+	if (FILE_ERR_NONE != futil_map_file(fd, MAP_RO, &buf, &file_size))
+		Fatal("Unable to map %s\n", filename);
+	close(fd);
+
+	Debug("%s size is 0x%" PRIx64 "\n", filename, file_size);
+	if (file_size < opt_pad)
+		Fatal("%s is too small to be a valid kernel blob\n",
+		      filename);
 
 	if (size_ptr)
 		*size_ptr = file_size;
@@ -223,6 +185,44 @@ static uint8_t *ReadOldKPartFromFileOrDie(const char *filename,
 	return buf;
 }
 
+/*
+ * Repacks a kernel partition into itself, mapped at [kpart_data], by writing
+ * back just the [vblock_size] bytes of the new [vblock_data] and, if [kb] is
+ * given, the new config. The rest of it, which is mostly the kernel, stays as
+ * it is on disk. Returns zero on success.
+ */
+static int RepackInPlace(const char *filename, uint8_t *kpart_data,
+			 const uint8_t *vblock_data, uint64_t vblock_size,
+			 const struct kernel_blob_ctx_s *kb)
+{
+	struct futil_traverse_state_s state;
+	int fd, rv;
+
+	Debug("Repacking %s in place\n", filename);
+	fd = open(filename, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", filename,
+			strerror(errno));
+		return 1;
+	}
+
+	/* The mapping is private, so this just changes our copy */
+	Memcpy(kpart_data, vblock_data, vblock_size);
+	memset(&state, 0, sizeof(state));
+	futil_mark_dirty(&state, 0, vblock_size);
+	if (kb)
+		futil_mark_dirty(&state, kb->config_data - kpart_data,
+				 kb->config_size);
+	rv = futil_write_dirty(fd, kpart_data, &state, 1);
+
+	if (close(fd)) {
+		fprintf(stderr, "Error when closing %s: %s\n", filename,
+			strerror(errno));
+		rv = 1;
+	}
+	return rv;
+}
+
 /****************************************************************************/
 
 static int do_vbutil_kernel(int argc, char *argv[])
@@ -263,6 +263,7 @@ static int do_vbutil_kernel(int argc, char *argv[])
 	uint64_t vmlinuz_header_address = 0;
 	uint64_t vmlinuz_header_offset = 0;
 	VbKernelPreambleHeader *preamble = NULL;
+	struct kernel_blob_ctx_s kb = { 0 };
 	uint8_t *kblob_data = NULL;
 	uint64_t kblob_size = 0;
 	uint8_t *vblock_data = NULL;
@@ -447,34 +448,15 @@ static int do_vbutil_kernel(int argc, char *argv[])
 		if (!vmlinuz_size)
 			Fatal("Empty vmlinuz file\n");
 
-		kblob_data = CreateKernelBlob(
-			vmlinuz_buf, vmlinuz_size,
-			arch, kernel_body_load_address,
-			t_config_data, t_config_size,
-			t_bootloader_data, t_bootloader_size,
-			&kblob_size);
-		if (!kblob_data)
-			Fatal("Unable to create kernel blob\n");
-
-		Debug("kblob_size = 0x%" PRIx64 "\n", kblob_size);
-
-		vblock_data = SignKernelBlob(kblob_data, kblob_size, opt_pad,
-					     version, kernel_body_load_address,
-					     t_keyblock, signpriv_key, flags,
-					     &vblock_size);
-		if (!vblock_data)
-			Fatal("Unable to sign kernel blob\n");
-
-		Debug("vblock_size = 0x%" PRIx64 "\n", vblock_size);
-
-		if (opt_vblockonly)
-			rv = WriteSomeParts(filename,
-					    vblock_data, vblock_size,
-					    NULL, 0);
-		else
-			rv = WriteSomeParts(filename,
-					    vblock_data, vblock_size,
-					    kblob_data, kblob_size);
+		rv = WriteKernelPart(filename, vmlinuz_buf, vmlinuz_size,
+				     arch, kernel_body_load_address,
+				     t_config_data, t_config_size,
+				     t_bootloader_data, t_bootloader_size,
+				     opt_pad, version, t_keyblock,
+				     signpriv_key, flags, opt_vblockonly,
+				     NULL, NULL);
+		if (rv)
+			Fatal("Unable to create kernel partition\n");
 		return rv;
 
 	case OPT_MODE_REPACK:
@@ -488,18 +470,19 @@ static int do_vbutil_kernel(int argc, char *argv[])
 		if (!signpriv_key)
 			Fatal("Error reading signing key.\n");
 
+		/* Without one, the partition is repacked in place */
 		if (!oldfile)
-			Fatal("Missing previously packed blob.\n");
+			oldfile = filename;
 
 		/* Load the kernel partition */
-		kpart_data = ReadOldKPartFromFileOrDie(oldfile, &kpart_size);
+		kpart_data = MapOldKPartFromFileOrDie(oldfile, &kpart_size);
 
 		/* Make sure we have a kernel partition */
 		if (FILE_TYPE_KERN_PREAMBLE !=
 		    futil_file_type_buf(kpart_data, kpart_size))
 			Fatal("%s is not a kernel blob\n", oldfile);
 
-		kblob_data = UnpackKPart(kpart_data, kpart_size, opt_pad,
+		kblob_data = UnpackKPart(&kb, kpart_data, kpart_size, opt_pad,
 					 &keyblock, &preamble, &kblob_size);
 
 		if (!kblob_data)
@@ -515,7 +498,7 @@ static int do_vbutil_kernel(int argc, char *argv[])
 			if (!t_config_data)
 				Fatal("Error reading config file.\n");
 			if (0 != UpdateKernelBlobConfig(
-				    kblob_data, kblob_size,
+				    &kb, kblob_data, kblob_size,
 				    t_config_data, t_config_size))
 				Fatal("Unable to update config\n");
 		}
@@ -534,13 +517,31 @@ static int do_vbutil_kernel(int argc, char *argv[])
 		}
 
 		/* Reuse previous body size */
-		vblock_data = SignKernelBlob(kblob_data, kblob_size, opt_pad,
+		vblock_data = SignKernelBlob(&kb, kblob_data, kblob_size,
+					     opt_pad,
 					     version, kernel_body_load_address,
 					     t_keyblock ? t_keyblock : keyblock,
 					     signpriv_key, flags, &vblock_size);
 		if (!vblock_data)
 			Fatal("Unable to sign kernel blob\n");
 
+		/* Into itself, only what's changed needs writing */
+		if (!opt_vblockonly && futil_same_file(oldfile, filename) &&
+		    vblock_size <= (uint64_t)(kblob_data - kpart_data))
+			return RepackInPlace(filename, kpart_data,
+					     vblock_data, vblock_size,
+					     config_file ? &kb : NULL);
+
+		/* Rewriting the old file would pull it out from under us */
+		if (!opt_vblockonly && futil_same_file(oldfile, filename)) {
+			uint8_t *copy = malloc(kblob_size);
+			if (!copy)
+				Fatal("Can't allocate 0x%" PRIx64 " bytes\n",
+				      kblob_size);
+			memcpy(copy, kblob_data, kblob_size);
+			kblob_data = copy;
+		}
+
 		if (opt_vblockonly)
 			rv = WriteSomeParts(filename,
 					    vblock_data, vblock_size,
@@ -563,16 +564,9 @@ static int do_vbutil_kernel(int argc, char *argv[])
 
 		/* Do it */
 
-		/* Load the kernel partition */
-		kpart_data = ReadOldKPartFromFileOrDie(filename, &kpart_size);
-
-		kblob_data = UnpackKPart(kpart_data, kpart_size, opt_pad,
-					 0, 0, &kblob_size);
-		if (!kblob_data)
-			Fatal("Unable to unpack kernel partition\n");
-
-		rv = VerifyKernelBlob(kblob_data, kblob_size,
-				      signpub_key, keyblock_file, min_version);
+		/* Read the kernel partition as we go */
+		rv = VerifyKernelPartFile(filename, opt_pad, signpub_key,
+					  keyblock_file, min_version);
 
 		return rv;
 
@@ -586,9 +580,9 @@ static int do_vbutil_kernel(int argc, char *argv[])
 			return 1;
 		}
 
-		kpart_data = ReadOldKPartFromFileOrDie(filename, &kpart_size);
+		kpart_data = MapOldKPartFromFileOrDie(filename, &kpart_size);
 
-		kblob_data = UnpackKPart(kpart_data, kpart_size, opt_pad,
+		kblob_data = UnpackKPart(&kb, kpart_data, kpart_size, opt_pad,
 					 &keyblock, &preamble, &kblob_size);
 
 		if (!kblob_data)
@@ -5,11 +5,15 @@
  * Verified boot key block utility
  */
 
+#include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cryptolib.h"
 #include "futility.h"
@@ -28,6 +32,8 @@ enum {
 	OPT_PEM_ALGORITHM,
 	OPT_EXTERNAL_SIGNER,
 	OPT_FLAGS,
+	OPT_MODE_PACK_BATCH,
+	OPT_JOBS,
 };
 
 static const struct option long_opts[] = {
@@ -40,12 +46,15 @@ static const struct option long_opts[] = {
 	{"pem_algorithm", 1, 0, OPT_PEM_ALGORITHM},
 	{"externalsigner", 1, 0, OPT_EXTERNAL_SIGNER},
 	{"flags", 1, 0, OPT_FLAGS},
+	{"pack-batch", 1, 0, OPT_MODE_PACK_BATCH},
+	{"jobs", 1, 0, OPT_JOBS},
 	{NULL, 0, 0, 0}
 };
 
 static const char usage[] =
 	"\n"
-	"Usage:  " MYNAME " %s <--pack|--unpack> <file> [OPTIONS]\n"
+	"Usage:  " MYNAME " %s <--pack|--unpack|--pack-batch> <file>"
+	" [OPTIONS]\n"
 	"\n"
 	"For '--pack <file>', required OPTIONS are:\n"
 	"  --datapubkey <file>         Data public key in .vbpubk format\n"
@@ -69,7 +78,15 @@ static const char usage[] =
 	"        Signing public key in .vbpubk format. This is required to\n"
 	"                                verify a signed keyblock.\n"
 	"  --datapubkey <file>"
-	"        Write the data public key to this file.\n\n";
+	"        Write the data public key to this file.\n"
+	"\n"
+	"For '--pack-batch <file>', each line of the file names one keyblock\n"
+	"to pack, as <outfile> <datapubkey> [<flags>]. The signing key is\n"
+	"read once, and the options for '--pack' apply to every line, with\n"
+	"--flags as the default for lines that don't give their own.\n"
+	"  --jobs <number>"
+	"             Number of keyblocks to pack in parallel\n"
+	"                                (default is one per CPU)\n\n";
 
 static void print_help(const char *progname)
 {
@@ -150,6 +167,222 @@ static int Pack(const char *outfile, const char *datapubkey,
 	return 0;
 }
 
+/* One keyblock of a --pack-batch */
+struct pack_job_s {
+	char *buf;			/* the manifest line, split up */
+	const char *outfile;
+	const char *datapubkey;
+	uint64_t flags;
+	int lineno;
+	int errorcnt;
+};
+
+struct pack_batch_s {
+	struct pack_job_s *job;
+	int count;
+	int failed;
+	const VbPrivateKey *signing_key;
+	pthread_mutex_t lock;
+};
+
+static int pack_one(const struct pack_job_s *job,
+		    const VbPrivateKey *signing_key)
+{
+	VbPublicKey *data_key;
+	VbKeyBlockHeader *block;
+	int rv;
+
+	data_key = PublicKeyRead(job->datapubkey);
+	if (!data_key) {
+		fprintf(stderr, "vbutil_keyblock: Error reading data key %s.\n",
+			job->datapubkey);
+		return 1;
+	}
+
+	block = KeyBlockCreate(data_key, signing_key, job->flags);
+	free(data_key);
+	if (!block) {
+		fprintf(stderr, "vbutil_keyblock: Error signing %s.\n",
+			job->outfile);
+		return 1;
+	}
+
+	rv = KeyBlockWrite(job->outfile, block);
+	if (rv)
+		fprintf(stderr, "vbutil_keyblock: Error writing %s.\n",
+			job->outfile);
+	free(block);
+	return rv;
+}
+
+static void pack_batch_one(void *arg, uint32_t index)
+{
+	struct pack_batch_s *batch = arg;
+	struct pack_job_s *job = &batch->job[index];
+
+	if (!job->errorcnt)
+		job->errorcnt = pack_one(job, batch->signing_key);
+
+	pthread_mutex_lock(&batch->lock);
+	if (job->errorcnt)
+		batch->failed++;
+	printf("%d: %s %s\n", job->lineno,
+	       job->outfile ? job->outfile : "-",
+	       job->errorcnt ? "FAILED" : "OK");
+	fflush(stdout);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+#define MAX_BATCH_ARGS 3
+
+/* Reads the manifest. Returns nonzero if it can't. */
+static int read_pack_batch(struct pack_batch_s *batch, const char *manifest,
+			   uint64_t default_flags)
+{
+	struct pack_job_s *job;
+	char *argv[MAX_BATCH_ARGS];
+	char *line = NULL;
+	size_t linesize = 0;
+	int lineno = 0;
+	int argc;
+	char *e;
+	FILE *fp;
+
+	fp = fopen(manifest, "r");
+	if (!fp) {
+		fprintf(stderr, "vbutil_keyblock: Can't open %s: %s\n",
+			manifest, strerror(errno));
+		return 1;
+	}
+
+	while (getline(&line, &linesize, fp) != -1) {
+		char *copy;
+
+		lineno++;
+		copy = strdup(line);
+		argc = copy ? futil_split_line(copy, argv,
+					       MAX_BATCH_ARGS) : -1;
+		if (argc == 0) {
+			free(copy);
+			continue;
+		}
+
+		job = realloc(batch->job, (batch->count + 1) * sizeof(*job));
+		if (!job || !copy) {
+			fprintf(stderr, "vbutil_keyblock: Out of memory\n");
+			free(copy);
+			free(line);
+			fclose(fp);
+			return 1;
+		}
+		batch->job = job;
+		job = &batch->job[batch->count++];
+		memset(job, 0, sizeof(*job));
+		job->buf = copy;
+		job->lineno = lineno;
+		job->flags = default_flags;
+
+		if (argc < 2) {
+			fprintf(stderr, "%s:%d: %s\n", manifest, lineno,
+				argc < 0 ? "too many arguments" :
+				"need <outfile> <datapubkey> [<flags>]");
+			job->errorcnt = 1;
+			continue;
+		}
+		job->outfile = argv[0];
+		job->datapubkey = argv[1];
+		if (argc > 2) {
+			job->flags = strtoul(argv[2], &e, 0);
+			if (e && *e) {
+				fprintf(stderr, "%s:%d: Invalid flags\n",
+					manifest, lineno);
+				job->errorcnt = 1;
+			}
+		}
+	}
+	free(line);
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Pack every keyblock in the manifest, reading the signing key just once.
+ * Each thread has one signature outstanding at a time, so with
+ * --externalsigner there are that many signers running at once.
+ */
+static int PackBatch(const char *manifest, const char *signprivate,
+		     const char *signprivate_pem, uint64_t pem_algorithm,
+		     uint64_t flags, const char *external_signer, int jobs)
+{
+	struct pack_batch_s batch;
+	struct timespec start, end;
+	VbPrivateKey *signing_key = NULL;
+	int i;
+	double secs;
+
+	if (!manifest) {
+		fprintf(stderr,
+			"vbutil_keyblock: Must specify a batch filename.\n");
+		return 1;
+	}
+
+	if (signprivate_pem) {
+		if (pem_algorithm >= kNumAlgorithms) {
+			fprintf(stderr,
+				"vbutil_keyblock: Invalid --pem_algorithm %"
+				PRIu64 "\n", pem_algorithm);
+			return 1;
+		}
+		if (external_signer)
+			signing_key = PrivateKeyExternal(signprivate_pem,
+							 pem_algorithm,
+							 external_signer);
+		else
+			signing_key = PrivateKeyReadPem(signprivate_pem,
+							pem_algorithm);
+		if (!signing_key) {
+			fprintf(stderr, "vbutil_keyblock:"
+				" Error reading signing key.\n");
+			return 1;
+		}
+	} else if (signprivate) {
+		signing_key = PrivateKeyRead(signprivate);
+		if (!signing_key) {
+			fprintf(stderr, "vbutil_keyblock:"
+				" Error reading signing key.\n");
+			return 1;
+		}
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+	batch.signing_key = signing_key;
+	if (read_pack_batch(&batch, manifest, flags)) {
+		batch.failed = 1;
+		goto done;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	futil_run_jobs(pack_batch_one, NULL, &batch, batch.count, jobs);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Packed %d of %d keyblocks in %.3f seconds"
+	       " (%.1f keyblocks/sec)\n",
+	       batch.count - batch.failed, batch.count, secs,
+	       secs > 0 ? batch.count / secs : 0.0);
+
+done:
+	for (i = 0; i < batch.count; i++)
+		free(batch.job[i].buf);
+	free(batch.job);
+	pthread_mutex_destroy(&batch.lock);
+	if (signing_key)
+		PrivateKeyFree(signing_key);
+	return !!batch.failed;
+}
+
 static int Unpack(const char *infile, const char *datapubkey,
 		  const char *signpubkey)
 {
@@ -232,6 +465,7 @@ static int do_vbutil_keyblock(int argc, char *argv[])
 	uint64_t flags = 0;
 	uint64_t pem_algorithm = 0;
 	int is_pem_algorithm = 0;
+	int jobs = 0;
 	int mode = 0;
 	int parse_error = 0;
 	char *e;
@@ -247,6 +481,7 @@ static int do_vbutil_keyblock(int argc, char *argv[])
 
 		case OPT_MODE_PACK:
 		case OPT_MODE_UNPACK:
+		case OPT_MODE_PACK_BATCH:
 			mode = i;
 			filename = optarg;
 			break;
@@ -288,6 +523,14 @@ static int do_vbutil_keyblock(int argc, char *argv[])
 				parse_error = 1;
 			}
 			break;
+
+		case OPT_JOBS:
+			jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || jobs < 1) {
+				fprintf(stderr, "Invalid --jobs\n");
+				parse_error = 1;
+			}
+			break;
 		}
 	}
 
@@ -324,6 +567,10 @@ static int do_vbutil_keyblock(int argc, char *argv[])
 			    flags, external_signer);
 	case OPT_MODE_UNPACK:
 		return Unpack(filename, datapubkey, signpubkey);
+	case OPT_MODE_PACK_BATCH:
+		return PackBatch(filename, signprivate,
+				 signprivate_pem, pem_algorithm,
+				 flags, external_signer, jobs);
 	default:
 		printf("Must specify a mode.\n");
 		print_help(argv[0]);
@@ -0,0 +1,468 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Checks that the kernels on a disk image would be trusted by a BIOS image:
+ * the keys are taken from the BIOS once, and then every kernel partition is
+ * verified against them, all at once.
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cgptlib_internal.h"
+#include "file_type.h"
+#include "futility.h"
+#include "host_common.h"
+#include "traversal.h"
+#include "util_misc.h"
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] BIOS DISK\n"
+	"\n"
+	"Verifies the firmware in the BIOS image against the root key in\n"
+	"its GBB, and then the keyblock, preamble and body of every kernel\n"
+	"partition in the DISK image against the kernel subkeys that the\n"
+	"firmware holds and the GBB's recovery key (for a recovery or\n"
+	"installer image). The partitions are verified in parallel, and\n"
+	"what was found is reported once everything is done. It fails\n"
+	"unless a firmware slot and every kernel partition verify.\n"
+	"\n"
+	"Options:\n"
+	"  --pad NUM           Kernel vblock padding size (default 0x%x)\n"
+	"  --json              Print one JSON object per line for each slot\n"
+	"                        and partition, instead of text\n"
+	"\n";
+
+#define DEFAULT_PADDING 65536
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog, DEFAULT_PADDING);
+}
+
+/* The keys a kernel keyblock may be signed by */
+enum chain_key {
+	CHAIN_SUBKEY_A,
+	CHAIN_SUBKEY_B,
+	CHAIN_RECOVERY_KEY,
+	NUM_CHAIN_KEYS
+};
+
+static const char * const chain_key_name[] = {
+	"kernel subkey A",
+	"kernel subkey B",
+	"recovery key",
+};
+
+/* What was found in each firmware slot */
+struct chain_fw_s {
+	const char *status;		/* NULL once it's verified */
+	uint64_t version;
+	uint32_t flags;
+};
+
+/* And in each kernel partition */
+struct chain_kernel_s {
+	uint32_t partition;		/* 0 if it has no kernel */
+	const char *status;		/* NULL if it verified */
+	uint32_t signers;		/* a bit for each chain_key */
+	uint64_t data_key_version;
+	uint64_t kernel_version;
+	uint64_t body_size;
+};
+
+struct chain_s {
+	uint64_t padding;
+	/* Each points into the BIOS image, which stays mapped */
+	VbPublicKey *rootkey;
+	VbPublicKey *key[NUM_CHAIN_KEYS];
+	struct chain_fw_s fw[2];
+	/* Each callback only touches its own partition's */
+	struct chain_kernel_s kernel[MAX_NUMBER_OF_ENTRIES];
+};
+
+int futil_cb_chain_gbb(struct futil_traverse_state_s *state)
+{
+	struct chain_s *chain = state->cb_data;
+	GoogleBinaryBlockHeader *gbb =
+		(GoogleBinaryBlockHeader *)state->my_area->buf;
+	uint32_t len = state->my_area->len;
+	uint32_t maxlen = 0;
+	VbPublicKey *key;
+
+	if (!futil_valid_gbb_header(gbb, len, &maxlen) || maxlen > len) {
+		fprintf(stderr, "The GBB is invalid\n");
+		return 1;
+	}
+
+	key = (VbPublicKey *)(state->my_area->buf + gbb->rootkey_offset);
+	if (PublicKeyLooksOkay(key, gbb->rootkey_size))
+		chain->rootkey = key;
+	key = (VbPublicKey *)(state->my_area->buf + gbb->recovery_key_offset);
+	if (PublicKeyLooksOkay(key, gbb->recovery_key_size))
+		chain->key[CHAIN_RECOVERY_KEY] = key;
+	return !chain->rootkey || !chain->key[CHAIN_RECOVERY_KEY];
+}
+
+int futil_cb_chain_fw_vblock(struct futil_traverse_state_s *state)
+{
+	struct chain_s *chain = state->cb_data;
+	int slot = state->component == CB_FMAP_VBLOCK_B;
+	struct chain_fw_s *fw = &chain->fw[slot];
+	const struct cb_area_s *body =
+		&state->cb_area[slot ? CB_FMAP_FW_MAIN_B : CB_FMAP_FW_MAIN_A];
+	VbKeyBlockHeader *keyblock = (VbKeyBlockHeader *)state->my_area->buf;
+	uint64_t len = state->my_area->len;
+	VbFirmwarePreambleHeader *preamble;
+	const VbSignature *sig;
+	const RSAPublicKey *rsa;
+	uint64_t more;
+
+	if (!chain->rootkey) {
+		fw->status = "no root key";
+		return 1;
+	}
+	if (futil_keyblock_verify(keyblock, len, chain->rootkey)) {
+		fw->status = "keyblock isn't signed by the root key";
+		return 1;
+	}
+	rsa = RSAKeyCacheGet(futil_rsa_cache(), &keyblock->data_key);
+	more = keyblock->key_block_size;
+	preamble = (VbFirmwarePreambleHeader *)(state->my_area->buf + more);
+	if (!rsa || VerifyFirmwarePreamble(preamble, len - more, rsa)) {
+		fw->status = "invalid preamble";
+		return 1;
+	}
+	fw->version = preamble->firmware_version;
+	fw->flags = VbGetFirmwarePreambleFlags(preamble);
+
+	/* The firmware runs the RO copy instead, so this one isn't checked */
+	if (!(fw->flags & VB_FIRMWARE_PREAMBLE_USE_RO_NORMAL)) {
+		sig = &preamble->body_signature;
+		if (sig->data_size > body->len) {
+			fw->status = "body is bigger than its area";
+			return 1;
+		}
+		if (VerifyData(body->buf, sig->data_size, sig, rsa)) {
+			fw->status = "invalid body";
+			return 1;
+		}
+	}
+
+	chain->key[slot ? CHAIN_SUBKEY_B : CHAIN_SUBKEY_A] =
+		&preamble->kernel_subkey;
+	fw->status = NULL;
+	return 0;
+}
+
+/*
+ * Just the vblock was read by futil_traverse_disk(), so the body is hashed
+ * from the disk as it's read, on this partition's own thread.
+ */
+int futil_cb_chain_kernel(struct futil_traverse_state_s *state)
+{
+	struct chain_s *chain = state->cb_data;
+	VbKeyBlockHeader *keyblock = (VbKeyBlockHeader *)state->my_area->buf;
+	uint64_t len = state->my_area->len;
+	struct chain_kernel_s *k;
+	VbKernelPreambleHeader *preamble;
+	const VbSignature *sig;
+	const RSAPublicKey *rsa;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	DigestContext ctx;
+	uint64_t more;
+	int i;
+
+	if (state->partition < 1 ||
+	    state->partition > MAX_NUMBER_OF_ENTRIES)
+		return 1;
+	k = &chain->kernel[state->partition - 1];
+	k->partition = state->partition;
+	k->data_key_version = keyblock->data_key.key_version;
+
+	for (i = 0; i < NUM_CHAIN_KEYS; i++)
+		if (chain->key[i] &&
+		    !futil_keyblock_verify(keyblock, len, chain->key[i]))
+			k->signers |= 1 << i;
+	if (!k->signers) {
+		k->status = "keyblock isn't signed by any of the BIOS's keys";
+		return 1;
+	}
+
+	rsa = RSAKeyCacheGet(futil_rsa_cache(), &keyblock->data_key);
+	more = keyblock->key_block_size;
+	preamble = (VbKernelPreambleHeader *)(state->my_area->buf + more);
+	if (!rsa || VerifyKernelPreamble(preamble, len - more, rsa)) {
+		k->status = "invalid preamble";
+		return 1;
+	}
+	k->kernel_version = preamble->kernel_version;
+
+	sig = &preamble->body_signature;
+	k->body_size = sig->data_size;
+	if (state->part_len < chain->padding ||
+	    sig->data_size > state->part_len - chain->padding) {
+		k->status = "body is bigger than its partition";
+		return 1;
+	}
+	DigestInit(&ctx, keyblock->data_key.algorithm);
+	if (DigestFileRegion(&ctx, state->fd,
+			     state->my_area->offset + chain->padding,
+			     sig->data_size, NULL, NULL)) {
+		k->status = "body is unreadable";
+		return 1;
+	}
+	DigestFinalInto(&ctx, digest);
+	if (VerifyDigest(digest, sig, rsa)) {
+		k->status = "invalid body";
+		return 1;
+	}
+	return 0;
+}
+
+static void print_key(const char *name, VbPublicKey *key, int json)
+{
+	char sha1[PUBKEY_SHA1_STRLEN];
+
+	if (key)
+		PubKeySha1String(key, sha1);
+	if (json)
+		printf("{\"key\":\"%s\",\"sha1\":\"%s\"}\n", name,
+		       key ? sha1 : "");
+	else
+		printf("  %-22s %s\n", name, key ? sha1 : "<invalid>");
+}
+
+static void print_fw(const struct chain_s *chain, int slot, int json)
+{
+	const struct chain_fw_s *fw = &chain->fw[slot];
+
+	if (json) {
+		printf("{\"slot\":\"%c\",\"status\":\"%s\"", 'A' + slot,
+		       fw->status ? fw->status : "valid");
+		if (!fw->status)
+			printf(",\"firmware_version\":%" PRIu64
+			       ",\"preamble_flags\":%" PRIu32, fw->version,
+			       fw->flags);
+		printf("}\n");
+		return;
+	}
+	printf("  VBLOCK_%c               ", 'A' + slot);
+	if (fw->status) {
+		printf("invalid: %s\n", fw->status);
+		return;
+	}
+	printf("valid, firmware version %" PRIu64 "%s\n", fw->version,
+	       fw->flags & VB_FIRMWARE_PREAMBLE_USE_RO_NORMAL ?
+	       ", body not checked (uses RO)" : "");
+}
+
+static void print_kernel(const struct chain_kernel_s *k, int json)
+{
+	const char *sep = "";
+	int i;
+
+	if (json) {
+		printf("{\"partition\":%" PRIu32 ",\"status\":\"%s\","
+		       "\"signed_by\":[", k->partition,
+		       k->status ? k->status : "valid");
+		for (i = 0; i < NUM_CHAIN_KEYS; i++) {
+			if (!(k->signers & (1 << i)))
+				continue;
+			printf("%s\"%s\"", sep, chain_key_name[i]);
+			sep = ",";
+		}
+		printf("],\"data_key_version\":%" PRIu64
+		       ",\"kernel_version\":%" PRIu64
+		       ",\"body_size\":%" PRIu64 "}\n",
+		       k->data_key_version, k->kernel_version, k->body_size);
+		return;
+	}
+	printf("  Partition %-11" PRIu32 "  ", k->partition);
+	if (k->status) {
+		printf("invalid: %s\n", k->status);
+		if (!k->signers)
+			return;
+	} else {
+		printf("valid, kernel version %" PRIu64 ", data key version %"
+		       PRIu64 "\n", k->kernel_version, k->data_key_version);
+	}
+	printf("%25ssigned by ", "");
+	for (i = 0; i < NUM_CHAIN_KEYS; i++) {
+		if (!(k->signers & (1 << i)))
+			continue;
+		printf("%s%s", sep, chain_key_name[i]);
+		sep = ", ";
+	}
+	printf("\n");
+}
+
+enum no_short_opts {
+	OPT_PADDING = 1000,
+	OPT_JSON,
+	OPT_HELP,
+};
+
+static const struct option long_opts[] = {
+	/* name    hasarg *flag  val */
+	{"pad",  1, NULL, OPT_PADDING},
+	{"json", 0, NULL, OPT_JSON},
+	{"help", 0, NULL, OPT_HELP},
+	{NULL,   0, NULL, 0},
+};
+
+static int do_verify_chain(int argc, char *argv[])
+{
+	struct chain_s chain;
+	struct futil_traverse_state_s state;
+	const char *bios_file, *disk_file;
+	uint8_t *buf = NULL;
+	uint64_t len = 0;
+	struct stat sb;
+	int decompressed = 0;
+	int bfd = -1, dfd = -1;
+	int json = 0;
+	int good_fw, kernels;
+	int errorcnt = 0;
+	char *e;
+	int i;
+
+	memset(&chain, 0, sizeof(chain));
+	chain.padding = DEFAULT_PADDING;
+	chain.fw[0].status = chain.fw[1].status = "missing";
+
+	opterr = 0;		/* quiet, you */
+	while ((i = getopt_long(argc, argv, ":", long_opts, NULL)) != -1) {
+		switch (i) {
+		case OPT_PADDING:
+			chain.padding = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e)) {
+				fprintf(stderr, "Invalid --pad \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_JSON:
+			json = 1;
+			break;
+		case OPT_HELP:
+			print_help(argv[0]);
+			return 0;
+		case '?':
+			fprintf(stderr, "Unrecognized option: %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument to %s\n",
+				argv[optind - 1]);
+			errorcnt++;
+			break;
+		default:
+			DIE;
+		}
+	}
+	if (errorcnt || argc - optind != 2) {
+		print_help(argv[0]);
+		return 1;
+	}
+	bios_file = argv[optind];
+	disk_file = argv[optind + 1];
+
+	/* The keys, once */
+	bfd = futil_open_input(bios_file);
+	if (bfd < 0) {
+		fprintf(stderr, "Can't open %s\n", bios_file);
+		return 1;
+	}
+	if (futil_map_input(bfd, &buf, &len, &decompressed)) {
+		fprintf(stderr, "Can't read %s\n", bios_file);
+		close(bfd);
+		return 1;
+	}
+	if (futil_file_type_buf(buf, len) != FILE_TYPE_BIOS_IMAGE &&
+	    futil_file_type_buf(buf, len) != FILE_TYPE_OLD_BIOS_IMAGE) {
+		fprintf(stderr, "%s isn't a BIOS image\n", bios_file);
+		errorcnt++;
+		goto done;
+	}
+	memset(&state, 0, sizeof(state));
+	state.in_filename = bios_file;
+	state.op = FUTIL_OP_VERIFY_CHAIN;
+	state.cb_data = &chain;
+	futil_traverse(buf, len, &state, FILE_TYPE_UNKNOWN);
+
+	good_fw = !chain.fw[0].status + !chain.fw[1].status;
+	if (!good_fw)
+		errorcnt++;
+
+	/* Then every kernel, against them */
+	dfd = open(disk_file, O_RDONLY);
+	if (dfd < 0 || futil_fstat(dfd, &sb)) {
+		fprintf(stderr, "Can't open %s\n", disk_file);
+		errorcnt++;
+		goto report;
+	}
+	memset(&state, 0, sizeof(state));
+	state.in_filename = disk_file;
+	state.op = FUTIL_OP_VERIFY_CHAIN;
+	state.cb_data = &chain;
+	if (futil_traverse_disk(dfd, sb.st_size, &state))
+		errorcnt++;
+
+report:
+	kernels = 0;
+	if (!json) {
+		printf("BIOS:                    %s\n", bios_file);
+		print_key("Root key", chain.rootkey, json);
+		print_key("Recovery key", chain.key[CHAIN_RECOVERY_KEY],
+			  json);
+	} else {
+		print_key("root_key", chain.rootkey, json);
+		print_key("recovery_key", chain.key[CHAIN_RECOVERY_KEY],
+			  json);
+	}
+	for (i = 0; i < 2; i++) {
+		print_fw(&chain, i, json);
+		if (chain.key[CHAIN_SUBKEY_A + i])
+			print_key(json ? (i ? "kernel_subkey_b" :
+					  "kernel_subkey_a") :
+				  (i ? "Kernel subkey B" : "Kernel subkey A"),
+				  chain.key[CHAIN_SUBKEY_A + i], json);
+	}
+	if (!json)
+		printf("Disk:                    %s\n", disk_file);
+	for (i = 0; i < MAX_NUMBER_OF_ENTRIES; i++) {
+		if (!chain.kernel[i].partition)
+			continue;
+		print_kernel(&chain.kernel[i], json);
+		kernels++;
+	}
+	if (!kernels) {
+		fprintf(stderr, "%s has no kernels\n", disk_file);
+		errorcnt++;
+	}
+	if (!json)
+		printf("%s\n", errorcnt ? "FAILED" : "PASSED");
+
+done:
+	if (dfd >= 0)
+		close(dfd);
+	futil_unmap_input(bfd, buf, len, decompressed, 0);
+	close(bfd);
+	return !!errorcnt;
+}
+
+DECLARE_FUTIL_COMMAND(verify_chain, do_verify_chain,
+		      VBOOT_VERSION_1_0,
+		      "Verify a disk image's kernels against a BIOS image",
+		      print_help);
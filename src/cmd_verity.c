@@ -0,0 +1,395 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Builds the dm-verity hash tree for a root filesystem, the way the Chrome OS
+ * kernel's dm-bht expects it: 4 KiB blocks, sha256, each block hashed with the
+ * salt after it, and the tree stored root level first.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "futility.h"
+
+#define VERITY_BLOCK 4096
+#define VERITY_SECTOR 512
+#define VERITY_SALT_SIZE 32
+#define DIGESTS_PER_BLOCK (VERITY_BLOCK / SHA256_DIGEST_SIZE)
+/* How much each thread reads at once */
+#define VERITY_CHUNK_BLOCKS 256
+/* Enough levels for 2^64 bytes */
+#define MAX_LEVELS 12
+
+enum {
+	OPT_BLOCKS = 1000,
+	OPT_SALT,
+	OPT_JOBS,
+};
+
+static const struct option long_opts[] = {
+	{"blocks", 1, NULL, OPT_BLOCKS},
+	{"salt",   1, NULL, OPT_SALT},
+	{"jobs",   1, NULL, OPT_JOBS},
+	{NULL, 0, NULL, 0}
+};
+
+static const char usage[] = "\n"
+	"Usage:  " MYNAME " %s [OPTIONS] ROOTFS HASHTREE\n"
+	"\n"
+	"Builds the dm-verity hash tree for ROOTFS (an image or a partition)\n"
+	"and writes it to HASHTREE. The device-mapper table for the kernel\n"
+	"command line is printed on stdout, for example\n"
+	"\n"
+	"  0 SECTORS verity payload=ROOT_DEV hashtree=HASH_DEV"
+	" hashstart=SECTORS\n"
+	"    alg=sha256 root_hexdigest=HEX salt=HEX\n"
+	"\n"
+	"ready to go in the --config file given to \"" MYNAME " sign\". The\n"
+	"hash tree is meant to follow the filesystem in the same partition.\n"
+	"\n"
+	"Options:\n"
+	"  --blocks NUM      Only the first NUM 4 KiB blocks of ROOTFS\n"
+	"                      (the default is all of it)\n"
+	"  --salt   HEX      Hash with this salt, up to 32 bytes, or with a\n"
+	"                      new one if HEX is \"random\" (the default is\n"
+	"                      no salt)\n"
+	"  -j|--jobs NUM     Hash with NUM threads (default is one per CPU)\n"
+	"\n";
+
+static void print_help(const char *prog)
+{
+	printf(usage, prog);
+}
+
+struct verity_s {
+	int fd;
+	const char *infile;
+	uint64_t blocks;
+	uint8_t salt[VERITY_SALT_SIZE];
+	int have_salt;
+	/* The tree, root level first, and where each level starts in it */
+	uint8_t *tree;
+	uint64_t tree_size;
+	uint64_t level_offset[MAX_LEVELS];
+	uint64_t level_blocks[MAX_LEVELS];
+	int levels;
+	int failed;
+};
+
+static void hash_block(const struct verity_s *v, const uint8_t *block,
+		       uint8_t *digest)
+{
+	VB_SHA256_CTX ctx;
+
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, block, VERITY_BLOCK);
+	if (v->have_salt)
+		SHA256_update(&ctx, v->salt, sizeof(v->salt));
+	memcpy(digest, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+}
+
+/* Each thread reads a chunk at a time into this */
+static __thread uint8_t *leaf_buf;
+
+static void leaf_buf_free(void *arg)
+{
+	free(leaf_buf);
+	leaf_buf = NULL;
+}
+
+/* The bottom level is the digest of every block of ROOTFS, in order */
+static void leaf_chunk(void *arg, uint32_t chunk)
+{
+	struct verity_s *v = arg;
+	uint8_t *leaves = v->tree + v->level_offset[v->levels - 1];
+	uint64_t first, count, i;
+	size_t want, got;
+	ssize_t n;
+
+	if (v->failed)
+		return;
+	if (!leaf_buf)
+		leaf_buf = malloc(VERITY_CHUNK_BLOCKS * VERITY_BLOCK);
+	if (!leaf_buf) {
+		fprintf(stderr, "Out of memory\n");
+		v->failed = 1;
+		return;
+	}
+
+	first = (uint64_t)chunk * VERITY_CHUNK_BLOCKS;
+	count = v->blocks - first;
+	if (count > VERITY_CHUNK_BLOCKS)
+		count = VERITY_CHUNK_BLOCKS;
+
+	want = count * VERITY_BLOCK;
+	for (got = 0; got < want; got += n) {
+		n = pread(v->fd, leaf_buf + got, want - got,
+			  first * VERITY_BLOCK + got);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			break;
+	}
+	if (got < want) {
+		fprintf(stderr, "Can't read block %" PRIu64
+			" of %s: %s\n", first + got / VERITY_BLOCK,
+			v->infile, n < 0 ? strerror(errno) :
+			"it's too short");
+		v->failed = 1;
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		hash_block(v, leaf_buf + i * VERITY_BLOCK,
+			   leaves + (first + i) * SHA256_DIGEST_SIZE);
+}
+
+/*
+ * Works out how big each level is. There are 128 digests to a hash block, and
+ * the levels go on until one block holds them all.
+ */
+static int plan_tree(struct verity_s *v)
+{
+	uint64_t count = v->blocks;
+	uint64_t offset = 0;
+	int i, n = 0;
+
+	do {
+		if (n == MAX_LEVELS)
+			return 1;
+		count = (count + DIGESTS_PER_BLOCK - 1) / DIGESTS_PER_BLOCK;
+		v->level_blocks[n++] = count;
+	} while (count > 1);
+
+	/* That was bottom up, but they're stored top down */
+	v->levels = n;
+	for (i = 0; i < n / 2; i++) {
+		count = v->level_blocks[i];
+		v->level_blocks[i] = v->level_blocks[n - 1 - i];
+		v->level_blocks[n - 1 - i] = count;
+	}
+	for (i = 0; i < n; i++) {
+		v->level_offset[i] = offset;
+		offset += v->level_blocks[i] * VERITY_BLOCK;
+	}
+	v->tree_size = offset;
+	return 0;
+}
+
+static int build_tree(struct verity_s *v, int jobs)
+{
+	uint64_t b;
+	int i;
+
+	v->tree = calloc(1, v->tree_size);
+	if (!v->tree) {
+		fprintf(stderr, "Can't allocate 0x%" PRIx64
+			" bytes for the hash tree\n", v->tree_size);
+		return 1;
+	}
+
+	posix_fadvise(v->fd, 0, v->blocks * VERITY_BLOCK,
+		      POSIX_FADV_SEQUENTIAL);
+	futil_run_jobs(leaf_chunk, leaf_buf_free, v,
+		       (v->blocks + VERITY_CHUNK_BLOCKS - 1) /
+		       VERITY_CHUNK_BLOCKS, jobs);
+	leaf_buf_free(NULL);
+	if (v->failed)
+		return 1;
+
+	/* The rest is a fraction of a percent of the work */
+	for (i = v->levels - 1; i > 0; i--)
+		for (b = 0; b < v->level_blocks[i]; b++)
+			hash_block(v, v->tree + v->level_offset[i] +
+				   b * VERITY_BLOCK,
+				   v->tree + v->level_offset[i - 1] +
+				   b * SHA256_DIGEST_SIZE);
+	return 0;
+}
+
+static int parse_salt(struct verity_s *v, const char *str)
+{
+	size_t len = strlen(str);
+	unsigned int byte;
+	size_t i;
+	int fd;
+
+	if (!strcmp(str, "random")) {
+		fd = open("/dev/urandom", O_RDONLY);
+		if (fd < 0 ||
+		    read(fd, v->salt, sizeof(v->salt)) != sizeof(v->salt)) {
+			fprintf(stderr, "Can't make a random salt: %s\n",
+				strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			return 1;
+		}
+		close(fd);
+		v->have_salt = 1;
+		return 0;
+	}
+
+	/* A short one is padded with zeroes, as the kernel does */
+	if (!len || len % 2 || len > 2 * sizeof(v->salt) ||
+	    strspn(str, "0123456789abcdefABCDEF") != len) {
+		fprintf(stderr, "Invalid --salt \"%s\"\n", str);
+		return 1;
+	}
+	memset(v->salt, 0, sizeof(v->salt));
+	for (i = 0; i < len / 2; i++) {
+		sscanf(str + 2 * i, "%2x", &byte);
+		v->salt[i] = byte;
+	}
+	v->have_salt = 1;
+	return 0;
+}
+
+static int write_tree(const struct verity_s *v, const char *outfile)
+{
+	FILE *fp = fopen(outfile, "wb");
+
+	if (!fp) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			outfile, strerror(errno));
+		return 1;
+	}
+	if (fwrite(v->tree, v->tree_size, 1, fp) != 1 || fclose(fp)) {
+		fprintf(stderr, "Can't write %s: %s\n",
+			outfile, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static void print_hex(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		printf("%02x", buf[i]);
+}
+
+static int do_verity(int argc, char *argv[])
+{
+	struct verity_s v;
+	uint8_t root[SHA256_DIGEST_SIZE];
+	uint64_t size, sectors;
+	off_t end;
+	int errorcnt = 0;
+	int jobs = 0;
+	char *e;
+	int i;
+
+	memset(&v, 0, sizeof(v));
+
+	opterr = 0;
+	while ((i = getopt_long(argc, argv, "j:", long_opts, NULL)) != -1) {
+		switch (i) {
+		case OPT_BLOCKS:
+			v.blocks = strtoull(optarg, &e, 0);
+			if (!*optarg || (e && *e) || !v.blocks) {
+				fprintf(stderr,
+					"Invalid --blocks \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_SALT:
+			errorcnt += parse_salt(&v, optarg);
+			break;
+		case 'j':
+		case OPT_JOBS:
+			jobs = strtoul(optarg, &e, 0);
+			if (!*optarg || (e && *e) || jobs < 1) {
+				fprintf(stderr,
+					"Invalid --jobs \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option\n");
+			errorcnt++;
+			break;
+		}
+	}
+
+	if (errorcnt || argc - optind != 2) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	v.infile = argv[optind];
+	v.fd = open(v.infile, O_RDONLY);
+	if (v.fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			v.infile, strerror(errno));
+		return 1;
+	}
+
+	/* A partition's size isn't in st_size, but this works for both */
+	end = lseek(v.fd, 0, SEEK_END);
+	if (end < 0) {
+		fprintf(stderr, "Can't find the size of %s: %s\n",
+			v.infile, strerror(errno));
+		errorcnt++;
+		goto done;
+	}
+	size = end;
+	if (!v.blocks) {
+		if (!size || size % VERITY_BLOCK) {
+			fprintf(stderr, "%s isn't a whole number of 4 KiB"
+				" blocks; use --blocks\n", v.infile);
+			errorcnt++;
+			goto done;
+		}
+		v.blocks = size / VERITY_BLOCK;
+	} else if (v.blocks > size / VERITY_BLOCK) {
+		fprintf(stderr, "%s has fewer than %" PRIu64 " blocks\n",
+			v.infile, v.blocks);
+		errorcnt++;
+		goto done;
+	}
+
+	if (plan_tree(&v) || build_tree(&v, jobs)) {
+		errorcnt++;
+		goto done;
+	}
+	hash_block(&v, v.tree, root);
+
+	if (write_tree(&v, argv[optind + 1])) {
+		errorcnt++;
+		goto done;
+	}
+
+	sectors = v.blocks * (VERITY_BLOCK / VERITY_SECTOR);
+	printf("0 %" PRIu64 " verity payload=ROOT_DEV hashtree=HASH_DEV"
+	       " hashstart=%" PRIu64 " alg=sha256 root_hexdigest=",
+	       sectors, sectors);
+	print_hex(root, sizeof(root));
+	if (v.have_salt) {
+		printf(" salt=");
+		print_hex(v.salt, sizeof(v.salt));
+	}
+	printf("\n");
+
+done:
+	free(v.tree);
+	close(v.fd);
+	return !!errorcnt;
+}
+
+DECLARE_FUTIL_COMMAND(verity, do_verity,
+		      VBOOT_VERSION_ALL,
+		      "Build the dm-verity hash tree for a root filesystem",
+		      print_help);
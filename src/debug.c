@@ -0,0 +1,336 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Debug output. Writing each piece of a line to unbuffered stderr as it's
+ * printed has the threads of a batch run queue up on the stream lock and
+ * make a system call or two per line, and mixes their lines up. Instead each
+ * thread gathers whole lines in a buffer of its own and passes them through
+ * a lock-free ring to one writer thread, which writes all that's waiting at
+ * once.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "futility.h"
+#include "vboot_api_stub_init.h"
+
+/* How many records may wait for the writer. A power of two. */
+#define RING_SIZE 1024
+/* How many it writes at once */
+#define WRITE_BATCH 64
+/* How long it sleeps when there's nothing to write */
+#define WRITER_IDLE_NS 1000000
+
+/*
+ * Any thread may add a record to the ring, and only the writer takes them
+ * out. A slot's seq is the position it'll be filled at while it's empty,
+ * and one more than that once it's full.
+ */
+struct debug_slot_s {
+	uint64_t seq;
+	char *rec;
+	size_t len;
+};
+
+static struct debug_slot_s ring[RING_SIZE];
+static uint64_t ring_head;		/* where the next record goes */
+static uint64_t ring_tail;		/* the writer's next one */
+
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static pthread_t writer_tid;
+static int writer_running;
+static int writer_stop;
+
+/* What a thread has printed since its last whole line */
+struct debug_buf_s {
+	char *buf;
+	size_t len, size;
+};
+
+static __thread struct debug_buf_s *my_buf;
+static pthread_key_t buf_key;
+
+int debugging_enabled;
+
+static void write_all(const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(STDERR_FILENO, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Takes up to [max] records off the ring. Returns how many. */
+static int ring_take(char **rec, struct iovec *iov, int max)
+{
+	struct debug_slot_s *slot;
+	int n;
+
+	for (n = 0; n < max; n++) {
+		slot = &ring[ring_tail % RING_SIZE];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+		    ring_tail + 1)
+			break;
+		rec[n] = slot->rec;
+		iov[n].iov_base = slot->rec;
+		iov[n].iov_len = slot->len;
+		__atomic_store_n(&slot->seq, ring_tail + RING_SIZE,
+				 __ATOMIC_RELEASE);
+		ring_tail++;
+	}
+	return n;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct timespec idle = { 0, WRITER_IDLE_NS };
+	char *rec[WRITE_BATCH];
+	struct iovec iov[WRITE_BATCH], *v;
+	ssize_t done;
+	int stop, n, left, i;
+
+	for (;;) {
+		/* Whatever was added before we're told to stop gets written */
+		stop = __atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE);
+		n = ring_take(rec, iov, WRITE_BATCH);
+		if (!n) {
+			if (stop)
+				break;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		for (v = iov, left = n; left; ) {
+			done = writev(STDERR_FILENO, v, left);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done <= 0)
+				break;
+			for (; left && (size_t)done >= v->iov_len; v++, left--)
+				done -= v->iov_len;
+			if (left) {
+				v->iov_base = (char *)v->iov_base + done;
+				v->iov_len -= done;
+			}
+		}
+		for (i = 0; i < n; i++)
+			free(rec[i]);
+	}
+	return NULL;
+}
+
+/* Hands [rec], a whole number of lines, to the writer */
+static void ring_add(char *rec, size_t len)
+{
+	struct debug_slot_s *slot;
+	uint64_t pos, seq;
+
+	if (!writer_running) {
+		write_all(rec, len);
+		free(rec);
+		return;
+	}
+
+	pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &ring[pos % RING_SIZE];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ring_head, &pos,
+							pos + 1, 0,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+			/* Someone else got it, and pos is now theirs + 1 */
+		} else if (seq < pos) {
+			/* Full, so wait for the writer to catch up */
+			sched_yield();
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		}
+	}
+	slot->rec = rec;
+	slot->len = len;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Hands over the first [len] bytes of [b], keeping the rest */
+static void buf_flush(struct debug_buf_s *b, size_t len)
+{
+	char *rec = malloc(len);
+
+	if (rec) {
+		memcpy(rec, b->buf, len);
+		ring_add(rec, len);
+	} else {
+		write_all(b->buf, len);
+	}
+	b->len -= len;
+	memmove(b->buf, b->buf + len, b->len);
+}
+
+/* Ends a line that's been left unfinished, and hands it over */
+static void buf_finish(struct debug_buf_s *b)
+{
+	if (b->len && b->len < b->size)
+		b->buf[b->len++] = '\n';
+	if (b->len)
+		buf_flush(b, b->len);
+}
+
+/* When a thread goes away */
+static void buf_free(void *arg)
+{
+	struct debug_buf_s *b = arg;
+
+	buf_finish(b);
+	free(b->buf);
+	free(b);
+	my_buf = NULL;
+}
+
+static int buf_append(struct debug_buf_s *b, const char *s, size_t len)
+{
+	size_t size = b->size ? b->size : 256;
+	char *p;
+
+	/* One spare for buf_finish()'s newline */
+	while (b->len + len + 1 > size)
+		size *= 2;
+	if (size != b->size) {
+		p = realloc(b->buf, size);
+		if (!p)
+			return 1;
+		b->buf = p;
+		b->size = size;
+	}
+	memcpy(b->buf + b->len, s, len);
+	b->len += len;
+	return 0;
+}
+
+static void debug_finish(void)
+{
+	if (my_buf)
+		buf_finish(my_buf);
+	__atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(writer_tid, NULL);
+	writer_running = 0;
+}
+
+static void writer_start(void)
+{
+	uint64_t i;
+
+	for (i = 0; i < RING_SIZE; i++)
+		ring[i].seq = i;
+	if (pthread_key_create(&buf_key, buf_free))
+		return;
+	if (pthread_create(&writer_tid, NULL, writer_thread, NULL))
+		return;
+	writer_running = 1;
+	atexit(debug_finish);
+}
+
+static void debug_vprintf(const char *format, va_list ap)
+{
+	struct debug_buf_s *b;
+	char msg[1024], tag[64];
+	char *text = msg, *heap = NULL;
+	const char *p, *nl;
+	size_t len;
+	int64_t job;
+	va_list aq;
+	int n;
+
+	pthread_once(&writer_once, writer_start);
+	b = my_buf;
+	if (!b && writer_running && (b = calloc(1, sizeof(*b)))) {
+		my_buf = b;
+		pthread_setspecific(buf_key, b);
+	}
+
+	va_copy(aq, ap);
+	n = vsnprintf(msg, sizeof(msg), format, aq);
+	va_end(aq);
+	if (n < 0)
+		return;
+	if ((size_t)n >= sizeof(msg)) {
+		heap = malloc(n + 1);
+		if (heap) {
+			vsnprintf(heap, n + 1, format, ap);
+			text = heap;
+		}
+	}
+
+	job = futil_job_id();
+	if (job >= 0)
+		snprintf(tag, sizeof(tag), "DEBUG: [t%d j%" PRId64 "] ",
+			 futil_thread_id(), job);
+	else
+		snprintf(tag, sizeof(tag), "DEBUG: [t%d] ",
+			 futil_thread_id());
+
+	if (!b) {
+		/* No writer or no buffer, so it'll have to do as it is */
+		fprintf(stderr, "%s%s", tag, text);
+		free(heap);
+		return;
+	}
+
+	/* Tag each line as it's started */
+	for (p = text; *p; p += len) {
+		nl = strchr(p, '\n');
+		len = nl ? nl - p + 1 : strlen(p);
+		if ((!b->len || b->buf[b->len - 1] == '\n') &&
+		    buf_append(b, tag, strlen(tag)))
+			break;
+		if (buf_append(b, p, len))
+			break;
+	}
+	free(heap);
+
+	/* Hand over all the lines that are finished, as one record */
+	for (len = b->len; len && b->buf[len - 1] != '\n'; len--)
+		;
+	if (len)
+		buf_flush(b, len);
+}
+
+void Debug(const char *format, ...)
+{
+	va_list ap;
+
+	if (!debugging_enabled)
+		return;
+
+	va_start(ap, format);
+	debug_vprintf(format, ap);
+	va_end(ap);
+}
+
+void futil_debug_init(void)
+{
+	VbExSetDebugHook(debug_vprintf);
+}
@@ -0,0 +1,387 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Reading compressed images without unpacking them to disk first.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "futility.h"
+#include "stats.h"
+#include "traversal.h"
+
+/* What we can undo, and which program undoes it */
+static const struct {
+	const char *magic;
+	int magic_len;
+	const char *prog;
+} compressors[] = {
+	{"\xfd" "7zXZ\0", 6, "xz"},
+	{"\x28\xb5\x2f\xfd", 4, "zstd"},
+	{"\x1f\x8b", 2, "gzip"},
+};
+
+/* Compressed images tend to shrink by about this much */
+#define GUESS_RATIO 4
+#define MIN_GUESS (1 << 20)
+
+const char *futil_decompressor(const uint8_t *buf, uint64_t len)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(compressors); i++)
+		if (len >= compressors[i].magic_len &&
+		    !memcmp(buf, compressors[i].magic,
+			    compressors[i].magic_len))
+			return compressors[i].prog;
+	return NULL;
+}
+
+int futil_filter_start(int fd, char *const argv[], pid_t *pid)
+{
+	const char *prog = argv[0];
+	int p[2];
+
+	if (pipe(p)) {
+		fprintf(stderr, "Can't make a pipe for %s: %s\n",
+			prog, strerror(errno));
+		return -1;
+	}
+
+	*pid = fork();
+	if (*pid < 0) {
+		fprintf(stderr, "Can't fork for %s: %s\n",
+			prog, strerror(errno));
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+
+	if (!*pid) {
+		/* The child shares our file offset, but we only pread */
+		if (dup2(fd, STDIN_FILENO) != STDIN_FILENO ||
+		    dup2(p[1], STDOUT_FILENO) != STDOUT_FILENO ||
+		    lseek(STDIN_FILENO, 0, SEEK_SET) != 0)
+			_exit(127);
+		close(p[0]);
+		close(p[1]);
+		execvp(prog, argv);
+		fprintf(stderr, "Can't run %s: %s\n", prog, strerror(errno));
+		_exit(127);
+	}
+
+	close(p[1]);
+	return p[0];
+}
+
+int futil_decompress_start(int fd, const char *prog, pid_t *pid)
+{
+	char *const argv[] = {(char *)prog, "-dc", NULL};
+
+	return futil_filter_start(fd, argv, pid);
+}
+
+int futil_filter_finish(int rfd, pid_t pid, const char *prog, int all_read)
+{
+	int status;
+
+	/* If we stopped early, it doesn't need to finish */
+	close(rfd);
+	if (!all_read)
+		kill(pid, SIGTERM);
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR) {
+			fprintf(stderr, "Lost track of %s: %s\n",
+				prog, strerror(errno));
+			return 1;
+		}
+
+	return all_read && !(WIFEXITED(status) && !WEXITSTATUS(status));
+}
+
+int futil_decompress_finish(int rfd, pid_t pid, const char *prog,
+			    int all_read)
+{
+	if (!futil_filter_finish(rfd, pid, prog, all_read))
+		return 0;
+	if (all_read)
+		fprintf(stderr, "%s couldn't decompress the input\n", prog);
+	return 1;
+}
+
+/*
+ * Reads [rfd] to the end into an anonymous mapping, which starts at [cap]
+ * bytes and grows as needed, so futil_unmap_file() can release it like any
+ * other. [what] is where it's coming from, for complaining.
+ */
+static enum futil_file_err read_all(int rfd, uint64_t cap, const char *what,
+				    uint8_t **buf, uint64_t *len)
+{
+	uint64_t got = 0;
+	uint8_t *out;
+	ssize_t n;
+
+	out = mmap(0, cap, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (out == MAP_FAILED) {
+		fprintf(stderr, "Can't map 0x%" PRIx64 " bytes: %s\n",
+			cap, strerror(errno));
+		return FILE_ERR_MMAP;
+	}
+
+	for (;;) {
+		if (got == cap) {
+			void *bigger = mremap(out, cap, cap * 2,
+					      MREMAP_MAYMOVE);
+			if (bigger == MAP_FAILED) {
+				fprintf(stderr, "Can't grow %s"
+					" past 0x%" PRIx64 " bytes: %s\n",
+					what, cap, strerror(errno));
+				munmap(out, cap);
+				return FILE_ERR_MMAP;
+			}
+			out = bigger;
+			cap *= 2;
+		}
+		n = read(rfd, out + got, cap - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+
+	if (n < 0) {
+		fprintf(stderr, "Can't read from %s: %s\n",
+			what, strerror(errno));
+		munmap(out, cap);
+		return FILE_ERR_OPEN;
+	}
+	if (!got) {
+		fprintf(stderr, "There's nothing in %s\n", what);
+		munmap(out, cap);
+		return FILE_ERR_SIZE;
+	}
+
+	/* Give back what the guess overshot. Shrinking in place can't fail. */
+	if (got < cap)
+		mremap(out, cap, got, 0);
+
+	*buf = out;
+	*len = got;
+	return FILE_ERR_NONE;
+}
+
+/*
+ * Reads everything [prog] makes of [fd], guessing how much that will be from
+ * the [in_len] compressed bytes.
+ */
+static enum futil_file_err decompress_all(int fd, uint64_t in_len,
+					  const char *prog,
+					  uint8_t **buf, uint64_t *len)
+{
+	uint64_t start = futil_stats_begin();
+	uint64_t cap = in_len * GUESS_RATIO;
+	enum futil_file_err err;
+	char what[64];
+	pid_t pid;
+	int rfd;
+
+	if (cap < MIN_GUESS)
+		cap = MIN_GUESS;
+
+	rfd = futil_decompress_start(fd, prog, &pid);
+	if (rfd < 0)
+		return FILE_ERR_OPEN;
+
+	snprintf(what, sizeof(what), "the %s output", prog);
+	err = read_all(rfd, cap, what, buf, len);
+	if (futil_decompress_finish(rfd, pid, prog,
+				    err == FILE_ERR_NONE ||
+				    err == FILE_ERR_SIZE)) {
+		if (err == FILE_ERR_NONE)
+			munmap(*buf, *len);
+		return FILE_ERR_OPEN;
+	}
+	if (err)
+		return err;
+
+	futil_stats_end(STAT_MAP, prog, start, *len);
+	return FILE_ERR_NONE;
+}
+
+/*
+ * A pipe can only be read once, but most commands look at their input twice
+ * (once to work out what it is), so whatever came down the last one is kept
+ * until we exit, and everyone who maps it gets a copy of their own to write
+ * on.
+ */
+static struct {
+	dev_t dev;
+	ino_t ino;
+	uint8_t *buf;
+	uint64_t len;
+} piped;
+static pthread_mutex_t piped_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_stream(const struct stat *sb)
+{
+	return S_ISFIFO(sb->st_mode) || S_ISSOCK(sb->st_mode);
+}
+
+static enum futil_file_err map_stream(int fd, const struct stat *sb,
+				      uint8_t **buf, uint64_t *len)
+{
+	uint64_t start = futil_stats_begin();
+	enum futil_file_err err = FILE_ERR_NONE;
+	uint8_t *copy;
+
+	pthread_mutex_lock(&piped_lock);
+	if (!piped.buf || piped.dev != sb->st_dev ||
+	    piped.ino != sb->st_ino) {
+		if (piped.buf)
+			munmap(piped.buf, piped.len);
+		piped.buf = NULL;
+		piped.dev = sb->st_dev;
+		piped.ino = sb->st_ino;
+		err = read_all(fd, MIN_GUESS, "the input pipe",
+			       &piped.buf, &piped.len);
+	}
+	if (err == FILE_ERR_NONE) {
+		copy = mmap(0, piped.len, PROT_READ|PROT_WRITE,
+			    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (copy == MAP_FAILED) {
+			fprintf(stderr, "Can't map 0x%" PRIx64 " bytes: %s\n",
+				piped.len, strerror(errno));
+			err = FILE_ERR_MMAP;
+		} else {
+			memcpy(copy, piped.buf, piped.len);
+			*buf = copy;
+			*len = piped.len;
+		}
+	}
+	pthread_mutex_unlock(&piped_lock);
+
+	if (err == FILE_ERR_NONE)
+		futil_stats_end(STAT_MAP, "pipe", start, *len);
+	return err;
+}
+
+int futil_open_input(const char *filename)
+{
+	if (!strcmp(filename, "-"))
+		return dup(STDIN_FILENO);
+	return open(filename, O_RDONLY);
+}
+
+/*
+ * Working out a file's type decompresses the whole thing, and reading it
+ * again straight afterwards would do it all over again, so each thread
+ * keeps the last one until then.
+ */
+static __thread struct {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	uint8_t *buf;
+	uint64_t len;
+} kept;
+
+static int kept_matches(const struct stat *sb)
+{
+	return kept.buf && kept.dev == sb->st_dev && kept.ino == sb->st_ino &&
+		kept.size == sb->st_size &&
+		kept.mtime.tv_sec == sb->st_mtim.tv_sec &&
+		kept.mtime.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+enum futil_file_err futil_map_input(int fd, uint8_t **buf, uint64_t *len,
+				    int *decompressed)
+{
+	enum futil_file_err err;
+	const char *prog;
+	struct stat sb;
+	uint8_t *mbuf;
+	uint64_t mlen;
+	int have_sb;
+
+	*decompressed = 0;
+	have_sb = !fstat(fd, &sb);
+
+	/* What comes down a pipe is taken as it is */
+	if (have_sb && is_stream(&sb)) {
+		err = map_stream(fd, &sb, buf, len);
+		if (err == FILE_ERR_NONE)
+			*decompressed = 1;
+		return err;
+	}
+
+	if (have_sb && kept_matches(&sb)) {
+		*buf = kept.buf;
+		*len = kept.len;
+		*decompressed = 1;
+		kept.buf = NULL;
+		return FILE_ERR_NONE;
+	}
+
+	err = futil_map_file(fd, MAP_RO, &mbuf, &mlen);
+	if (err)
+		return err;
+
+	prog = futil_decompressor(mbuf, mlen);
+	if (!prog) {
+		*buf = mbuf;
+		*len = mlen;
+		return FILE_ERR_NONE;
+	}
+
+	err = decompress_all(fd, mlen, prog, buf, len);
+	futil_unmap_file(fd, MAP_RO, mbuf, mlen);
+	if (err)
+		return err;
+
+	*decompressed = 1;
+	return FILE_ERR_NONE;
+}
+
+enum futil_file_err futil_unmap_input(int fd, uint8_t *buf, uint64_t len,
+				      int decompressed, int keep)
+{
+	struct stat sb;
+
+	if (keep && !decompressed && !futil_unmap_flash(buf, 1)) {
+		futil_fmap_index_forget(buf);
+		return FILE_ERR_NONE;
+	}
+
+	/* A pipe's contents are kept anyway */
+	if (!decompressed || !keep || fstat(fd, &sb) || is_stream(&sb))
+		return futil_unmap_file(fd, MAP_RO, buf, len);
+
+	if (kept.buf)
+		futil_unmap_file(fd, MAP_RO, kept.buf, kept.len);
+	futil_fmap_index_forget(buf);
+	kept.dev = sb.st_dev;
+	kept.ino = sb.st_ino;
+	kept.size = sb.st_size;
+	kept.mtime = sb.st_mtim;
+	kept.buf = buf;
+	kept.len = len;
+	return FILE_ERR_NONE;
+}
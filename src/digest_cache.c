@@ -0,0 +1,815 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "futility.h"
+#include "host_common.h"
+#include "metrics.h"
+
+/*
+ * Each entry records the hash state left after hashing one region of one
+ * file. The file is identified by what stat() says about it, so changing it
+ * in any way (even just touching it) makes its entries unreachable.
+ */
+#define DIGEST_CACHE_MAGIC 0x31636466		/* "fdc1" */
+
+struct digest_cache_key_s {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint64_t offset;
+	uint64_t len;
+	uint64_t hash_alg;		/* Not the signature algorithm */
+};
+
+struct digest_cache_entry_s {
+	uint32_t magic;
+	uint32_t ctx_size;
+	struct digest_cache_key_s key;
+	DigestContext ctx;
+};
+
+char *futil_cache_path(const char *dir, const uint8_t *id, int id_len)
+{
+	size_t n = strlen(dir);
+	char *path;
+	int i;
+
+	path = malloc(n + 1 + 2 * id_len + 1);
+	if (!path)
+		return NULL;
+	sprintf(path, "%s/", dir);
+	for (i = 0; i < id_len; i++)
+		sprintf(path + n + 1 + 2 * i, "%02x", id[i]);
+	return path;
+}
+
+int futil_cache_write(const char *path, const void *buf, size_t len)
+{
+	char *tmpname;
+	int fd, ok;
+
+	tmpname = malloc(strlen(path) + 8);
+	if (!tmpname)
+		return 1;
+	sprintf(tmpname, "%s.XXXXXX", path);
+
+	/* Other signers may be using the same cache */
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		Debug("can't create %s: %s\n", tmpname, strerror(errno));
+		free(tmpname);
+		return 1;
+	}
+	ok = write(fd, buf, len) == len;
+	ok = !close(fd) && ok;
+	if (!ok || rename(tmpname, path)) {
+		Debug("can't write %s: %s\n", path, strerror(errno));
+		unlink(tmpname);
+		ok = 0;
+	}
+
+	free(tmpname);
+	return !ok;
+}
+
+/*
+ * The hash states can be shared with other machines, too, through a store
+ * that the --digest_remote program talks to. It's started once, and reads
+ * requests on stdin and answers on stdout, a line each, all in hex:
+ *
+ *   get FINGERPRINT ALG          answered by "FINGERPRINT CONTEXT", or
+ *                                "FINGERPRINT -" if the store hasn't got it
+ *   put FINGERPRINT ALG CONTEXT  not answered
+ *
+ * Answers can come in any order, so the program is free to gather requests
+ * up and send them on together. Since other machines' stat() means nothing
+ * here, the fingerprint is a SHA-256 of the SHA-256 of each megabyte of the
+ * region, which is made on every CPU at once, so it takes a fraction of the
+ * time of the one-thread hash being looked up. That hash is made here
+ * anyway while the answer is on its way, and whichever is done first wins.
+ */
+#define DIGEST_REMOTE_MAGIC 0x31726466		/* "fdr1" */
+#define REMOTE_CHUNK (1 << 20)
+#define REMOTE_STEP (4 << 20)		/* hashed between looks for answers */
+#define REMOTE_FP_HEX (2 * SHA256_DIGEST_SIZE)
+#define REMOTE_LINE_MAX (2 * sizeof(DigestContext) + 2 * REMOTE_FP_HEX)
+
+/* A lookup that hasn't been answered yet */
+struct remote_wait_s {
+	struct remote_wait_s *next;
+	char fp[REMOTE_FP_HEX + 1];
+	int hash_alg;
+	int answered;
+	int hit;
+	DigestContext ctx;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	const char *prog;
+	pid_t pid;
+	int to_fd;
+	int from_fd;
+	int started;
+	int broken;
+	char line[REMOTE_LINE_MAX];
+	size_t line_len;
+	struct remote_wait_s *waiting;
+} remote = { PTHREAD_MUTEX_INITIALIZER };
+
+void futil_set_digest_remote(const char *prog)
+{
+	remote.prog = prog;
+}
+
+static void put_hex(char *out, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--) {
+		sprintf(out, "%02x", *p++);
+		out += 2;
+	}
+}
+
+/* Returns non-zero unless [hex] is exactly [len] bytes' worth */
+static int get_hex(const char *hex, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	unsigned int b;
+
+	if (strlen(hex) != 2 * len)
+		return 1;
+	for (; len--; hex += 2) {
+		if (sscanf(hex, "%2x", &b) != 1)
+			return 1;
+		*p++ = b;
+	}
+	return 0;
+}
+
+/*
+ * Lets the program finish what it was given (storing what we've put) before
+ * we go, reading anything else it says so that it can't get stuck saying it.
+ */
+static void remote_end(void)
+{
+	char buf[REMOTE_LINE_MAX];
+
+	pthread_mutex_lock(&remote.lock);
+	close(remote.to_fd);
+	fcntl(remote.from_fd, F_SETFL, 0);
+	while (read(remote.from_fd, buf, sizeof(buf)) > 0 ||
+	       errno == EINTR)
+		;
+	close(remote.from_fd);
+	waitpid(remote.pid, NULL, 0);
+	remote.broken = 1;
+	pthread_mutex_unlock(&remote.lock);
+}
+
+/* Starts the program the first time it's wanted. The lock is held. */
+static int remote_start(void)
+{
+	int to[2], from[2];
+
+	if (remote.started)
+		return remote.broken;
+	remote.started = 1;
+	remote.broken = 1;
+
+	if (pipe(to))
+		return 1;
+	if (pipe(from)) {
+		close(to[0]);
+		close(to[1]);
+		return 1;
+	}
+	remote.pid = fork();
+	if (remote.pid < 0) {
+		close(to[0]);
+		close(to[1]);
+		close(from[0]);
+		close(from[1]);
+		return 1;
+	}
+	if (!remote.pid) {
+		if (dup2(to[0], STDIN_FILENO) != STDIN_FILENO ||
+		    dup2(from[1], STDOUT_FILENO) != STDOUT_FILENO)
+			_exit(127);
+		close(to[0]);
+		close(to[1]);
+		close(from[0]);
+		close(from[1]);
+		execlp(remote.prog, remote.prog, (char *)NULL);
+		fprintf(stderr, "Can't run %s: %s\n",
+			remote.prog, strerror(errno));
+		_exit(127);
+	}
+	close(to[0]);
+	close(from[1]);
+	remote.to_fd = to[1];
+	remote.from_fd = from[0];
+
+	/* Answers are only looked for between pieces of hashing */
+	fcntl(remote.from_fd, F_SETFL, O_NONBLOCK);
+	/* If it goes away, we just carry on without it */
+	signal(SIGPIPE, SIG_IGN);
+	atexit(remote_end);
+
+	remote.broken = 0;
+	return 0;
+}
+
+/* The lock is held */
+static void remote_send(const char *line)
+{
+	size_t len = strlen(line);
+	ssize_t n;
+
+	while (!remote.broken && len) {
+		n = write(remote.to_fd, line, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			Debug("lost %s: %s\n", remote.prog, strerror(errno));
+			remote.broken = 1;
+			break;
+		}
+		line += n;
+		len -= n;
+	}
+}
+
+/* Hands one answer to whoever's waiting for it. The lock is held. */
+static void remote_answer(char *line)
+{
+	struct remote_wait_s *w;
+	char *ctx_hex;
+
+	ctx_hex = strchr(line, ' ');
+	if (!ctx_hex)
+		return;
+	*ctx_hex++ = '\0';
+
+	for (w = remote.waiting; w; w = w->next) {
+		if (w->answered || strcmp(w->fp, line))
+			continue;
+		w->answered = 1;
+		w->hit = strcmp(ctx_hex, "-") &&
+			!get_hex(ctx_hex, &w->ctx, sizeof(w->ctx)) &&
+			w->ctx.algorithm == w->hash_alg;
+		if (!w->hit)
+			Debug("%s hasn't got %s\n", remote.prog, w->fp);
+	}
+}
+
+/* Takes in whatever answers are there, without waiting. The lock is held. */
+static void remote_poll(void)
+{
+	char *nl;
+	ssize_t n;
+
+	while (!remote.broken) {
+		n = read(remote.from_fd, remote.line + remote.line_len,
+			 sizeof(remote.line) - 1 - remote.line_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0) {
+			Debug("%s went away\n", remote.prog);
+			remote.broken = 1;
+			return;
+		}
+		remote.line_len += n;
+		remote.line[remote.line_len] = '\0';
+
+		while ((nl = strchr(remote.line, '\n'))) {
+			*nl = '\0';
+			remote_answer(remote.line);
+			remote.line_len -= nl + 1 - remote.line;
+			memmove(remote.line, nl + 1, remote.line_len + 1);
+		}
+		if (remote.line_len == sizeof(remote.line) - 1) {
+			Debug("%s answered nonsense\n", remote.prog);
+			remote.broken = 1;
+		}
+	}
+}
+
+struct fingerprint_s {
+	const uint8_t *buf;
+	uint64_t len;
+	uint8_t *digests;
+};
+
+static void fingerprint_one(void *arg, uint32_t index)
+{
+	struct fingerprint_s *fp = arg;
+	uint64_t offset = (uint64_t)index * REMOTE_CHUNK;
+	uint64_t len = fp->len - offset;
+
+	if (len > REMOTE_CHUNK)
+		len = REMOTE_CHUNK;
+	internal_SHA256(fp->buf + offset, len,
+			fp->digests + index * SHA256_DIGEST_SIZE);
+}
+
+/* Returns non-zero if there's no memory for it */
+static int fingerprint(const uint8_t *buf, uint64_t len, uint32_t hash_alg,
+		       char *hex)
+{
+	struct fingerprint_s fp = { buf, len };
+	uint32_t count = (len + REMOTE_CHUNK - 1) / REMOTE_CHUNK;
+	uint32_t head[3] = { DIGEST_REMOTE_MAGIC, sizeof(DigestContext),
+			     hash_alg };
+	VB_SHA256_CTX ctx;
+
+	fp.digests = malloc(count * SHA256_DIGEST_SIZE);
+	if (!fp.digests)
+		return 1;
+	futil_run_jobs(fingerprint_one, NULL, &fp, count, 0);
+
+	/* The layout of the context is part of what's looked up */
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, (uint8_t *)head, sizeof(head));
+	SHA256_update(&ctx, (uint8_t *)&len, sizeof(len));
+	SHA256_update(&ctx, fp.digests, count * SHA256_DIGEST_SIZE);
+	put_hex(hex, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+	free(fp.digests);
+	return 0;
+}
+
+/*
+ * Hashes [buf] into [ctx], unless the store has the answer first. Returns
+ * non-zero if there's no store to ask, or it's not worth asking.
+ */
+static int digest_remote(const uint8_t *buf, uint64_t len, int sig_algorithm,
+			 DigestContext *ctx)
+{
+	char line[REMOTE_LINE_MAX];
+	struct remote_wait_s w, **wp;
+	uint64_t done, n;
+	int hit = 0;
+
+	if (!remote.prog || len < REMOTE_CHUNK)
+		return 1;
+
+	memset(&w, 0, sizeof(w));
+	w.hash_alg = hash_type_map[sig_algorithm];
+	if (fingerprint(buf, len, w.hash_alg, w.fp))
+		return 1;
+
+	pthread_mutex_lock(&remote.lock);
+	if (remote_start()) {
+		pthread_mutex_unlock(&remote.lock);
+		return 1;
+	}
+	snprintf(line, sizeof(line), "get %s %d\n", w.fp, w.hash_alg);
+	remote_send(line);
+	w.next = remote.waiting;
+	remote.waiting = &w;
+	pthread_mutex_unlock(&remote.lock);
+
+	DigestInit(ctx, sig_algorithm);
+	for (done = 0; done < len; done += n) {
+		pthread_mutex_lock(&remote.lock);
+		remote_poll();
+		hit = w.hit;
+		pthread_mutex_unlock(&remote.lock);
+		if (hit)
+			break;
+		n = len - done < REMOTE_STEP ? len - done : REMOTE_STEP;
+		DigestUpdate(ctx, buf + done, n);
+	}
+
+	pthread_mutex_lock(&remote.lock);
+	for (wp = &remote.waiting; *wp != &w; wp = &(*wp)->next)
+		;
+	*wp = w.next;
+	if (w.hit) {
+		Debug("%s had %s\n", remote.prog, w.fp);
+		*ctx = w.ctx;
+	} else {
+		/* Let everyone else have it */
+		n = snprintf(line, sizeof(line), "put %s %d ",
+			     w.fp, w.hash_alg);
+		put_hex(line + n, ctx, sizeof(*ctx));
+		strcat(line, "\n");
+		remote_send(line);
+	}
+	pthread_mutex_unlock(&remote.lock);
+	return 0;
+}
+
+int futil_digest_region_stored(const char *cache_dir, const char *filename,
+			       uint64_t len)
+{
+	return (cache_dir && filename) || (remote.prog && len >= REMOTE_CHUNK);
+}
+
+void futil_digest_region(const char *cache_dir, const char *filename,
+			 uint64_t offset, const uint8_t *buf, uint64_t len,
+			 int sig_algorithm, DigestContext *ctx)
+{
+	struct digest_cache_entry_s e;
+	uint8_t id[SHA256_DIGEST_SIZE];
+	struct stat sb;
+	char *path = NULL;
+	FILE *fp;
+
+	if (!cache_dir || !filename ||
+	    stat(filename, &sb) || !S_ISREG(sb.st_mode))
+		goto uncached;
+
+	memset(&e, 0, sizeof(e));
+	e.magic = DIGEST_CACHE_MAGIC;
+	e.ctx_size = sizeof(e.ctx);
+	e.key.dev = sb.st_dev;
+	e.key.ino = sb.st_ino;
+	e.key.size = sb.st_size;
+	e.key.mtime_sec = sb.st_mtim.tv_sec;
+	e.key.mtime_nsec = sb.st_mtim.tv_nsec;
+	e.key.ctime_sec = sb.st_ctim.tv_sec;
+	e.key.ctime_nsec = sb.st_ctim.tv_nsec;
+	e.key.offset = offset;
+	e.key.len = len;
+	e.key.hash_alg = hash_type_map[sig_algorithm];
+
+	internal_SHA256((const uint8_t *)&e.key, sizeof(e.key), id);
+	path = futil_cache_path(cache_dir, id, sizeof(id));
+	if (!path)
+		goto uncached;
+
+	fp = fopen(path, "rb");
+	if (fp) {
+		struct digest_cache_entry_s found;
+		int ok = 1 == fread(&found, sizeof(found), 1, fp);
+
+		fclose(fp);
+		if (ok && found.magic == e.magic &&
+		    found.ctx_size == e.ctx_size &&
+		    !memcmp(&found.key, &e.key, sizeof(e.key)) &&
+		    found.ctx.algorithm == e.key.hash_alg) {
+			Debug("digest cache hit for %s\n", filename);
+			futil_metrics_count(METRIC_DIGEST_CACHE_HIT);
+			*ctx = found.ctx;
+			free(path);
+			return;
+		}
+	}
+	Debug("digest cache miss for %s\n", filename);
+	futil_metrics_count(METRIC_DIGEST_CACHE_MISS);
+
+uncached:
+	if (digest_remote(buf, len, sig_algorithm, ctx)) {
+		futil_advise(buf, len, MADV_SEQUENTIAL);
+		DigestInit(ctx, sig_algorithm);
+		DigestUpdate(ctx, buf, len);
+	}
+	if (path) {
+		e.ctx = *ctx;
+		futil_cache_write(path, &e, sizeof(e));
+		free(path);
+	}
+}
+
+/*
+ * The digests of the bodies signed since futil_remember_signed_digests() was
+ * called. The signature is the key: finding it again in what was written
+ * means the digest is the one that went into it, so checking it only takes
+ * the public-key operation.
+ */
+struct signed_digest_s {
+	struct signed_digest_s *next;
+	uint64_t data_size;
+	uint64_t sig_size;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	uint8_t sig[];
+};
+
+static struct {
+	int enabled;
+	struct signed_digest_s *list;
+	pthread_mutex_t lock;
+} signed_digests = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void futil_remember_signed_digests(void)
+{
+	signed_digests.enabled = 1;
+}
+
+void futil_signed_digest_add(const VbSignature *sig, const uint8_t *digest,
+			     int sig_algorithm)
+{
+	struct signed_digest_s *d;
+
+	if (!signed_digests.enabled || !sig)
+		return;
+	d = calloc(1, sizeof(*d) + sig->sig_size);
+	if (!d)
+		return;
+	d->data_size = sig->data_size;
+	d->sig_size = sig->sig_size;
+	memcpy(d->digest, digest, hash_size_map[sig_algorithm]);
+	memcpy(d->sig, GetSignatureDataC(sig), sig->sig_size);
+
+	pthread_mutex_lock(&signed_digests.lock);
+	d->next = signed_digests.list;
+	signed_digests.list = d;
+	pthread_mutex_unlock(&signed_digests.lock);
+}
+
+int futil_signed_digest_take(const VbSignature *sig, uint8_t *digest)
+{
+	struct signed_digest_s **p, *d = NULL;
+
+	if (!signed_digests.list)
+		return 0;
+
+	pthread_mutex_lock(&signed_digests.lock);
+	for (p = &signed_digests.list; *p; p = &(*p)->next) {
+		d = *p;
+		if (d->data_size == sig->data_size &&
+		    d->sig_size == sig->sig_size &&
+		    !memcmp(d->sig, GetSignatureDataC(sig), d->sig_size)) {
+			*p = d->next;
+			break;
+		}
+		d = NULL;
+	}
+	pthread_mutex_unlock(&signed_digests.lock);
+
+	if (!d)
+		return 0;
+	memcpy(digest, d->digest, sizeof(d->digest));
+	free(d);
+	return 1;
+}
+
+/*
+ * Verification results are kept the same way, but since a hit means skipping
+ * the signature checks altogether, each entry is also signed with an
+ * HMAC-SHA256 key private to the cache directory. An entry that was written
+ * by anyone who can't read that key won't be believed.
+ */
+#define VERIFY_CACHE_MAGIC 0x31637666		/* "fvc1" */
+#define VERIFY_CACHE_KEY_FILE "hmac.key"
+#define VERIFY_CACHE_KEY_SIZE 32
+#define VERIFY_CACHE_MAX_OUTPUT (16 << 20)
+
+/* How much of each end of the file to fingerprint, besides its stat() */
+#define VERIFY_CACHE_FINGERPRINT (64 << 10)
+
+struct verify_cache_key_s {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint8_t head[SHA256_DIGEST_SIZE];
+	uint8_t tail[SHA256_DIGEST_SIZE];
+	uint8_t context[SHA256_DIGEST_SIZE];
+};
+
+struct verify_cache_entry_s {
+	uint32_t magic;
+	uint32_t errorcnt;
+	uint64_t out_len;
+	uint64_t err_len;
+	struct verify_cache_key_s key;
+	/* Followed by the output, the errors, and the HMAC of all that */
+};
+
+static void hmac_sha256(const uint8_t *key, const uint8_t *buf, size_t len,
+			uint8_t *mac)
+{
+	uint8_t pad[SHA256_BLOCK_SIZE];
+	VB_SHA256_CTX ctx;
+	int i;
+
+	/* Our keys are always shorter than a block */
+	memset(pad, 0x36, sizeof(pad));
+	for (i = 0; i < VERIFY_CACHE_KEY_SIZE; i++)
+		pad[i] ^= key[i];
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, pad, sizeof(pad));
+	SHA256_update(&ctx, buf, len);
+	memcpy(mac, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+
+	memset(pad, 0x5c, sizeof(pad));
+	for (i = 0; i < VERIFY_CACHE_KEY_SIZE; i++)
+		pad[i] ^= key[i];
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, pad, sizeof(pad));
+	SHA256_update(&ctx, mac, SHA256_DIGEST_SIZE);
+	memcpy(mac, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+}
+
+/* Reads the directory's HMAC key, making one if it doesn't have one yet */
+static int verify_cache_key(const char *cache_dir, uint8_t *key)
+{
+	char *path;
+	int fd, ok = 0;
+
+	path = malloc(strlen(cache_dir) + sizeof(VERIFY_CACHE_KEY_FILE) + 1);
+	if (!path)
+		return 1;
+	sprintf(path, "%s/%s", cache_dir, VERIFY_CACHE_KEY_FILE);
+
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		ok = read(fd, key, VERIFY_CACHE_KEY_SIZE) ==
+			VERIFY_CACHE_KEY_SIZE;
+		close(fd);
+	} else if (errno == ENOENT) {
+		int rfd = open("/dev/urandom", O_RDONLY);
+
+		ok = rfd >= 0 && read(rfd, key, VERIFY_CACHE_KEY_SIZE) ==
+			VERIFY_CACHE_KEY_SIZE;
+		if (rfd >= 0)
+			close(rfd);
+		/* Whoever gets there first wins, so read theirs instead */
+		fd = ok ? open(path, O_WRONLY | O_CREAT | O_EXCL, 0600) : -1;
+		if (fd >= 0) {
+			ok = write(fd, key, VERIFY_CACHE_KEY_SIZE) ==
+				VERIFY_CACHE_KEY_SIZE;
+			ok = !close(fd) && ok;
+			if (!ok)
+				unlink(path);
+		} else if (ok && errno == EEXIST) {
+			free(path);
+			return verify_cache_key(cache_dir, key);
+		} else {
+			ok = 0;
+		}
+	}
+	if (!ok)
+		Debug("can't get the key in %s: %s\n", path, strerror(errno));
+
+	free(path);
+	return !ok;
+}
+
+/* Returns the entry's path, or NULL if there can't be one */
+static char *verify_cache_path(const char *cache_dir, const char *filename,
+			       const uint8_t *buf, uint64_t len,
+			       const uint8_t *context,
+			       struct verify_cache_key_s *key)
+{
+	uint8_t id[SHA256_DIGEST_SIZE];
+	uint64_t n = len < VERIFY_CACHE_FINGERPRINT ?
+		len : VERIFY_CACHE_FINGERPRINT;
+	struct stat sb;
+
+	if (stat(filename, &sb) || !S_ISREG(sb.st_mode) ||
+	    (uint64_t)sb.st_size != len)
+		return NULL;
+
+	memset(key, 0, sizeof(*key));
+	key->dev = sb.st_dev;
+	key->ino = sb.st_ino;
+	key->size = sb.st_size;
+	key->mtime_sec = sb.st_mtim.tv_sec;
+	key->mtime_nsec = sb.st_mtim.tv_nsec;
+	key->ctime_sec = sb.st_ctim.tv_sec;
+	key->ctime_nsec = sb.st_ctim.tv_nsec;
+	internal_SHA256(buf, n, key->head);
+	internal_SHA256(buf + len - n, n, key->tail);
+	memcpy(key->context, context, sizeof(key->context));
+
+	internal_SHA256((const uint8_t *)key, sizeof(*key), id);
+	return futil_cache_path(cache_dir, id, sizeof(id));
+}
+
+int futil_verify_cache_lookup(const char *cache_dir, const char *filename,
+			      const uint8_t *buf, uint64_t len,
+			      const uint8_t *context,
+			      struct futil_verify_result_s *result)
+{
+	uint8_t hmac_key[VERIFY_CACHE_KEY_SIZE];
+	uint8_t mac[SHA256_DIGEST_SIZE];
+	struct verify_cache_entry_s *e;
+	struct verify_cache_key_s key;
+	uint64_t entry_len;
+	uint8_t *entry = NULL;
+	char *path;
+	int hit = 0;
+
+	memset(result, 0, sizeof(*result));
+	path = verify_cache_path(cache_dir, filename, buf, len, context, &key);
+	if (!path || verify_cache_key(cache_dir, hmac_key))
+		goto done;
+
+	entry = ReadFile(path, &entry_len);
+	if (!entry || entry_len < sizeof(*e) + SHA256_DIGEST_SIZE)
+		goto done;
+	e = (struct verify_cache_entry_s *)entry;
+	if (e->magic != VERIFY_CACHE_MAGIC ||
+	    e->out_len > VERIFY_CACHE_MAX_OUTPUT ||
+	    e->err_len > VERIFY_CACHE_MAX_OUTPUT ||
+	    entry_len != sizeof(*e) + e->out_len + e->err_len +
+	    SHA256_DIGEST_SIZE ||
+	    memcmp(&e->key, &key, sizeof(key)))
+		goto done;
+
+	entry_len -= SHA256_DIGEST_SIZE;
+	hmac_sha256(hmac_key, entry, entry_len, mac);
+	if (memcmp(mac, entry + entry_len, sizeof(mac))) {
+		fprintf(stderr, "WARNING: ignoring forged verify cache entry"
+			" %s\n", path);
+		goto done;
+	}
+
+	result->errorcnt = e->errorcnt;
+	result->out_len = e->out_len;
+	result->err_len = e->err_len;
+	result->out = malloc(e->out_len + 1);
+	result->err = malloc(e->err_len + 1);
+	if (!result->out || !result->err) {
+		futil_verify_result_free(result);
+		goto done;
+	}
+	memcpy(result->out, entry + sizeof(*e), e->out_len);
+	memcpy(result->err, entry + sizeof(*e) + e->out_len, e->err_len);
+	hit = 1;
+
+done:
+	Debug("verify cache %s for %s\n", hit ? "hit" : "miss", filename);
+	futil_metrics_count(hit ? METRIC_VERIFY_CACHE_HIT :
+			    METRIC_VERIFY_CACHE_MISS);
+	free(entry);
+	free(path);
+	return hit;
+}
+
+void futil_verify_cache_store(const char *cache_dir, const char *filename,
+			      const uint8_t *buf, uint64_t len,
+			      const uint8_t *context,
+			      const struct futil_verify_result_s *result)
+{
+	uint8_t hmac_key[VERIFY_CACHE_KEY_SIZE];
+	struct verify_cache_entry_s *e;
+	uint8_t *entry;
+	size_t entry_len;
+	char *path;
+
+	if (result->out_len > VERIFY_CACHE_MAX_OUTPUT ||
+	    result->err_len > VERIFY_CACHE_MAX_OUTPUT)
+		return;
+
+	entry_len = sizeof(*e) + result->out_len + result->err_len;
+	entry = calloc(1, entry_len + SHA256_DIGEST_SIZE);
+	if (!entry)
+		return;
+	e = (struct verify_cache_entry_s *)entry;
+	path = verify_cache_path(cache_dir, filename, buf, len, context,
+				 &e->key);
+	if (path && !verify_cache_key(cache_dir, hmac_key)) {
+		e->magic = VERIFY_CACHE_MAGIC;
+		e->errorcnt = result->errorcnt;
+		e->out_len = result->out_len;
+		e->err_len = result->err_len;
+		memcpy(entry + sizeof(*e), result->out, result->out_len);
+		memcpy(entry + sizeof(*e) + result->out_len, result->err,
+		       result->err_len);
+		hmac_sha256(hmac_key, entry, entry_len, entry + entry_len);
+		futil_cache_write(path, entry, entry_len + SHA256_DIGEST_SIZE);
+	}
+
+	free(path);
+	free(entry);
+}
+
+void futil_verify_result_free(struct futil_verify_result_s *result)
+{
+	free(result->out);
+	free(result->err);
+	memset(result, 0, sizeof(*result));
+}
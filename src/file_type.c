@@ -6,17 +6,27 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
 #include "file_type.h"
+#include "fmap.h"
 #include "futility.h"
 #include "gbb_header.h"
+#include "gpt.h"
+#include "host_key.h"
+#include "stats.h"
+#include "traversal.h"
+#include "vb21_struct.h"
+#include "vboot_probe.h"
+#include "vboot_struct.h"
 
 /* Human-readable strings */
 static const char * const type_strings[] = {
@@ -32,6 +42,11 @@ static const char * const type_strings[] = {
 	"raw kernel",
 	"chromiumos disk image",
 	"VbPrivateKey",
+	"VbSharedData",
+	"vb21 packed key",
+	"vb21 keyblock",
+	"vb21 firmware preamble",
+	"vb21 signature",
 };
 BUILD_ASSERT(ARRAY_SIZE(type_strings) == NUM_FILE_TYPES);
 
@@ -43,42 +58,193 @@ const char * const futil_file_type_str(enum futil_file_type type)
 	return type_strings[type];
 }
 
-/* Try these in order so we recognize the larger objects first */
-enum futil_file_type (*recognizers[])(uint8_t *buf, uint32_t len) = {
-	&recognize_gpt,
-	&recognize_bios_image,
-	&recognize_gbb,
-	&recognize_vblock1,
-	&recognize_privkey,
+/*
+ * Things a quick look at the buffer can tell us. A recognizer is only worth
+ * calling if its hint is present, because it can't match otherwise.
+ */
+enum magic_hint {
+	HINT_ALWAYS =   0x00000001,
+	HINT_GPT =      0x00000002,
+	HINT_FMAP =     0x00000004,
+	HINT_GBB =      0x00000008,
+	HINT_DER =      0x00000010,
+	HINT_KEYBLOCK = 0x00000020,
+	HINT_VBSD =     0x00000040,
+	HINT_VB21 =     0x00000080,
+};
+
+/*
+ * Try these in order so we recognize the larger objects first. Anything that
+ * starts with a keyblock can't be a BIOS image, so we check for that before
+ * searching the whole file for an FMAP.
+ */
+static const struct {
+	enum futil_file_type (*recognize)(uint8_t *buf, uint64_t len);
+	uint32_t hint;
+} recognizers[] = {
+	{&recognize_gpt,        HINT_GPT},
+	{&recognize_vblock1,    HINT_KEYBLOCK},
+	{&recognize_bios_image, HINT_FMAP},
+	{&recognize_gbb,        HINT_GBB},
+	{&recognize_vbsd,       HINT_VBSD},
+	{&recognize_vb21,       HINT_VB21},
+	/* VbPublicKey has no magic */
+	{&recognize_vblock1,    HINT_ALWAYS},
+#ifndef FUTIL_VERIFY_ONLY
+	/* It takes libcrypto to parse one */
+	{&recognize_privkey,    HINT_DER},
+#endif
 };
 
+/* Check all the magic numbers in the first few sectors at once */
+static uint32_t find_hints(const uint8_t *buf, uint64_t len)
+{
+	const uint8_t *gpt = buf + DISK_SECTOR_SIZE;
+	size_t der = sizeof(((VbPrivateKey *)0)->algorithm);
+	uint32_t hints = HINT_ALWAYS;
+
+	if (len >= 2 * DISK_SECTOR_SIZE &&
+	    (!memcmp(gpt, GPT_HEADER_SIGNATURE, GPT_HEADER_SIGNATURE_SIZE) ||
+	     !memcmp(gpt, GPT_HEADER_SIGNATURE2, GPT_HEADER_SIGNATURE_SIZE)))
+		hints |= HINT_GPT;
+
+	if (len >= GBB_SIGNATURE_SIZE &&
+	    !memcmp(buf, GBB_SIGNATURE, GBB_SIGNATURE_SIZE))
+		hints |= HINT_GBB;
+
+	if (len >= KEY_BLOCK_MAGIC_SIZE &&
+	    !memcmp(buf, KEY_BLOCK_MAGIC, KEY_BLOCK_MAGIC_SIZE))
+		hints |= HINT_KEYBLOCK;
+
+	if (len >= sizeof(uint32_t) &&
+	    *(const uint32_t *)buf == VB_SHARED_DATA_MAGIC)
+		hints |= HINT_VBSD;
+
+	if (len >= sizeof(uint32_t) &&
+	    (*(const uint32_t *)buf & VB21_MAGIC_PREFIX_MASK) ==
+	    VB21_MAGIC_PREFIX)
+		hints |= HINT_VB21;
+
+	/* An RSAPrivateKey is a DER SEQUENCE */
+	if (len > der && buf[der] == 0x30)
+		hints |= HINT_DER;
+
+	return hints;
+}
+
+/*
+ * The FMAP could be anywhere, so this has to read the whole file. We only do
+ * it if nothing before it has matched. memmem is still much faster than
+ * fmap_find() at ruling it out.
+ */
+static uint32_t find_fmap_hint(const uint8_t *buf, uint64_t len)
+{
+	if (memmem(buf, len, FMAP_SIGNATURE, FMAP_SIGNATURE_SIZE))
+		return HINT_FMAP;
+	return 0;
+}
+
 /* Try to figure out what we're looking at */
-enum futil_file_type futil_file_type_buf(uint8_t *buf, uint32_t len)
+enum futil_file_type futil_file_type_buf(uint8_t *buf, uint64_t len)
 {
-	enum futil_file_type type;
+	enum futil_file_type type = FILE_TYPE_UNKNOWN;
+	uint64_t start = futil_stats_begin();
+	uint32_t hints;
 	int i;
 
+	VB_PROBE1(recognize_entry, len);
+	hints = find_hints(buf, len);
+
 	for (i = 0; i < ARRAY_SIZE(recognizers); i++) {
-		type = recognizers[i](buf, len);
+		if (recognizers[i].hint == HINT_FMAP)
+			hints |= find_fmap_hint(buf, len);
+		if (!(hints & recognizers[i].hint))
+			continue;
+		type = recognizers[i].recognize(buf, len);
 		if (type != FILE_TYPE_UNKNOWN)
-			return type;
+			break;
 	}
 
-	return FILE_TYPE_UNKNOWN;
+	futil_stats_end(STAT_RECOGNIZE, NULL, start, len);
+	VB_PROBE1(recognize_return, type);
+	return type;
+}
+
+/*
+ * The record is "VERSION INODE SIZE MTIME_SEC MTIME_NSEC TYPE FMAP_OFFSET".
+ * Bump the version whenever the types are renumbered.
+ */
+#define META_XATTR "user.futility.meta"
+#define META_VERSION 1
+#define META_MAX 128
+
+static int xattr_cache;
+
+void futil_set_xattr_cache(int on)
+{
+	xattr_cache = on;
+}
+
+int futil_meta_load(int fd, const struct stat *sb,
+		    struct futil_file_meta_s *meta)
+{
+	char rec[META_MAX];
+	uintmax_t ino, size, fmap_offset;
+	intmax_t sec;
+	long nsec;
+	int version, type;
+	ssize_t n;
+
+	if (!xattr_cache || !S_ISREG(sb->st_mode))
+		return 1;
+	n = fgetxattr(fd, META_XATTR, rec, sizeof(rec) - 1);
+	if (n <= 0)
+		return 1;
+	rec[n] = '\0';
+
+	if (sscanf(rec, "%d %ju %ju %jd %ld %d %ju", &version, &ino, &size,
+		   &sec, &nsec, &type, &fmap_offset) != 7 ||
+	    version != META_VERSION || ino != (uintmax_t)sb->st_ino ||
+	    size != (uintmax_t)sb->st_size || sec != sb->st_mtim.tv_sec ||
+	    nsec != sb->st_mtim.tv_nsec || type < 0 || type >= NUM_FILE_TYPES)
+		return 1;
+
+	meta->type = type;
+	meta->fmap_offset = fmap_offset;
+	return 0;
+}
+
+void futil_meta_save(int fd, const struct stat *sb,
+		     const struct futil_file_meta_s *meta)
+{
+	char rec[META_MAX];
+
+	if (!xattr_cache || !S_ISREG(sb->st_mode))
+		return;
+	snprintf(rec, sizeof(rec), "%d %ju %ju %jd %ld %d %ju", META_VERSION,
+		 (uintmax_t)sb->st_ino, (uintmax_t)sb->st_size,
+		 (intmax_t)sb->st_mtim.tv_sec, (long)sb->st_mtim.tv_nsec,
+		 meta->type, (uintmax_t)meta->fmap_offset);
+
+	/* Not being allowed to (or a filesystem without them) is fine */
+	if (fsetxattr(fd, META_XATTR, rec, strlen(rec), 0))
+		Debug("can't keep %s: %s\n", META_XATTR, strerror(errno));
 }
 
 enum futil_file_err futil_file_type(const char *filename,
 				    enum futil_file_type *type)
 {
+	struct futil_file_meta_s meta;
 	int ifd;
 	uint8_t *buf;
-	uint32_t buf_len;
+	uint64_t buf_len;
 	struct stat sb;
+	int decompressed;
 	enum futil_file_err err = FILE_ERR_NONE;
 
 	*type = FILE_TYPE_UNKNOWN;
 
-	ifd = open(filename, O_RDONLY);
+	ifd = futil_open_input(filename);
 	if (ifd < 0) {
 		fprintf(stderr, "Can't open %s: %s\n",
 			filename, strerror(errno));
@@ -91,16 +257,24 @@ enum futil_file_err futil_file_type(const char *filename,
 		return FILE_ERR_STAT;
 	}
 
-	if (S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode)) {
-		err = futil_map_file(ifd, MAP_RO, &buf, &buf_len);
+	if (!futil_meta_load(ifd, &sb, &meta)) {
+		*type = meta.type;
+	} else if (S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode) ||
+		   S_ISFIFO(sb.st_mode) || S_ISSOCK(sb.st_mode) ||
+		   futil_is_flash(ifd)) {
+		err = futil_map_input(ifd, &buf, &buf_len, &decompressed);
 		if (err) {
 			close(ifd);
 			return err;
 		}
 
 		*type = futil_file_type_buf(buf, buf_len);
+		meta.type = *type;
+		meta.fmap_offset = futil_fmap_offset(buf);
+		futil_meta_save(ifd, &sb, &meta);
 
-		err = futil_unmap_file(ifd, MAP_RO, buf, buf_len);
+		/* Whoever asked will probably want to read it next */
+		err = futil_unmap_input(ifd, buf, buf_len, decompressed, 1);
 		if (err) {
 			close(ifd);
 			return err;
@@ -109,10 +283,6 @@ enum futil_file_err futil_file_type(const char *filename,
 		err = FILE_ERR_DIR;
 	} else if (S_ISCHR(sb.st_mode)) {
 		err = FILE_ERR_CHR;
-	} else if (S_ISFIFO(sb.st_mode)) {
-		err = FILE_ERR_FIFO;
-	} else if (S_ISSOCK(sb.st_mode)) {
-		err = FILE_ERR_SOCK;
 	}
 
 	if (close(ifd)) {
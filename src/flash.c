@@ -0,0 +1,400 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Signing the firmware on the device itself, straight from the SPI flash.
+ * Reading all of it and writing it all back takes minutes over SPI, so only
+ * the areas that signing looks at are read, and only the erase blocks that
+ * end up different are erased and programmed again.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <mtd/mtd-user.h>
+#endif
+
+#include "fmap.h"
+#include "futility.h"
+#include "host_common.h"
+#include "image_scan.h"
+#include "stats.h"
+#include "traversal.h"
+
+/* The areas signing looks at, and the really old names for them */
+static const char * const flash_areas[] = {
+	"FMAP", "GBB", "VBLOCK_A", "VBLOCK_B", "FW_MAIN_A", "FW_MAIN_B",
+	"GBB Area", "Firmware A Key", "Firmware B Key",
+	"Firmware A Data", "Firmware B Data",
+};
+
+/* fmap_find() looks at these alignments first; see FMAP_PROBE_ALIGN */
+#define FLASH_PROBE_ALIGN 0x10000
+#define MAX_FLASH 4
+
+struct flash_s {
+	uint8_t *buf;
+	uint64_t len;
+	uint32_t erasesize;
+	uint8_t *read;			/* one per erase block */
+	dev_t rdev;
+};
+
+static struct flash_s *flashes[MAX_FLASH];
+static pthread_mutex_t flash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Working out what's on the flash reads it, and signing it straight after
+ * would read it all again, so each thread keeps the last one it did that
+ * for until it's mapped again.
+ */
+static __thread struct flash_s *kept;
+
+static void flash_free(struct flash_s *f)
+{
+	if (f->buf)
+		munmap(f->buf, f->len);
+	free(f->read);
+	free(f);
+}
+
+static struct flash_s *find_flash(const uint8_t *buf)
+{
+	struct flash_s *f = NULL;
+	int i;
+
+	pthread_mutex_lock(&flash_lock);
+	for (i = 0; i < MAX_FLASH; i++)
+		if (flashes[i] && flashes[i]->buf == buf)
+			f = flashes[i];
+	pthread_mutex_unlock(&flash_lock);
+	return f;
+}
+
+static int add_flash(struct flash_s *f)
+{
+	int i;
+
+	pthread_mutex_lock(&flash_lock);
+	for (i = 0; i < MAX_FLASH && flashes[i]; i++)
+		;
+	if (i < MAX_FLASH)
+		flashes[i] = f;
+	pthread_mutex_unlock(&flash_lock);
+	if (i == MAX_FLASH) {
+		fprintf(stderr, "Too many flash devices at once\n");
+		return 1;
+	}
+	return 0;
+}
+
+int futil_unmap_flash(uint8_t *buf, int keep)
+{
+	struct flash_s *f = find_flash(buf);
+	int i;
+
+	if (!f)
+		return 1;
+	pthread_mutex_lock(&flash_lock);
+	for (i = 0; i < MAX_FLASH; i++)
+		if (flashes[i] == f)
+			flashes[i] = NULL;
+	pthread_mutex_unlock(&flash_lock);
+
+	if (!keep) {
+		flash_free(f);
+		return 0;
+	}
+	if (kept)
+		flash_free(kept);
+	kept = f;
+	return 0;
+}
+
+#ifdef __linux__
+
+int futil_is_flash(int fd)
+{
+	struct mtd_info_user info;
+	struct stat sb;
+
+	return !fstat(fd, &sb) && S_ISCHR(sb.st_mode) &&
+		!ioctl(fd, MEMGETINFO, &info);
+}
+
+/* Read the erase blocks that [offset, offset + len) is in */
+static int read_blocks(int fd, struct flash_s *f, uint64_t offset,
+		       uint64_t len)
+{
+	uint64_t b, first, end;
+
+	if (offset >= f->len)
+		return 0;
+	if (len > f->len - offset)
+		len = f->len - offset;
+	first = offset / f->erasesize;
+	end = (offset + len + f->erasesize - 1) / f->erasesize;
+	for (b = first; b < end; b++) {
+		if (f->read[b])
+			continue;
+		if (PreadFull(fd, f->buf + b * f->erasesize, f->erasesize,
+			      b * f->erasesize) != f->erasesize) {
+			fprintf(stderr, "Can't read flash at 0x%" PRIx64
+				": %s\n", b * f->erasesize, strerror(errno));
+			return 1;
+		}
+		f->read[b] = 1;
+	}
+	return 0;
+}
+
+static int flash_fmap_at(int fd, struct flash_s *f, uint64_t offset)
+{
+	FmapHeader h;
+
+	if (offset + sizeof(h) > f->len ||
+	    PreadFull(fd, &h, sizeof(h), offset) != sizeof(h))
+		return 0;
+	return !memcmp(h.fmap_signature, FMAP_SIGNATURE,
+		       FMAP_SIGNATURE_SIZE) &&
+		h.fmap_ver_major == FMAP_VER_MAJOR;
+}
+
+/*
+ * Where fmap_find() would find the FMAP, if it's at 0 or on one of the large
+ * boundaries it tries first, or -1 if it isn't.
+ */
+static int64_t flash_find_fmap(int fd, struct flash_s *f)
+{
+	uint64_t offset, align;
+
+	if (flash_fmap_at(fd, f, 0))
+		return 0;
+	for (align = FMAP_SEARCH_STRIDE; align < f->len; align *= 2)
+		;
+	for (; align >= FLASH_PROBE_ALIGN; align /= 2)
+		for (offset = align; offset < f->len; offset += align * 2)
+			if (flash_fmap_at(fd, f, offset))
+				return offset;
+	return -1;
+}
+
+/*
+ * Read the blocks holding the FMAP, and then the areas it says signing
+ * needs. Nothing before the FMAP is read, so fmap_find() finds the same one
+ * in the buffer. If it can't be found that quickly, all of it is read.
+ */
+static int read_flash(int fd, struct flash_s *f)
+{
+	const FmapHeader *fmh;
+	const FmapAreaHeader *ah;
+	int64_t offset;
+	size_t i;
+	int j;
+
+	offset = flash_find_fmap(fd, f);
+	if (offset < 0) {
+		Debug("no FMAP on a large boundary, so reading it all\n");
+		return read_blocks(fd, f, 0, f->len);
+	}
+
+	if (read_blocks(fd, f, offset, sizeof(*fmh)))
+		return 1;
+	fmh = (const FmapHeader *)(f->buf + offset);
+	if (read_blocks(fd, f, offset, sizeof(*fmh) +
+			fmh->fmap_nareas * sizeof(*ah)))
+		return 1;
+
+	ah = (const FmapAreaHeader *)(fmh + 1);
+	for (j = 0; j < fmh->fmap_nareas; j++)
+		for (i = 0; i < ARRAY_SIZE(flash_areas); i++)
+			if (!strncmp(ah[j].area_name, flash_areas[i],
+				     FMAP_NAMELEN) &&
+			    read_blocks(fd, f, ah[j].area_offset,
+					ah[j].area_size))
+				return 1;
+	return 0;
+}
+
+enum futil_file_err futil_map_flash(int fd, uint8_t **buf, uint64_t *len)
+{
+	uint64_t start = futil_stats_begin();
+	struct mtd_info_user info;
+	struct flash_s *f;
+	struct stat sb;
+	void *ptr;
+
+	if (fstat(fd, &sb) || ioctl(fd, MEMGETINFO, &info) ||
+	    !info.erasesize ||
+	    info.size % info.erasesize) {
+		fprintf(stderr, "Can't get the flash's size: %s\n",
+			strerror(errno));
+		return FILE_ERR_STAT;
+	}
+
+	if (kept && kept->rdev == sb.st_rdev) {
+		f = kept;
+		kept = NULL;
+		goto found;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return FILE_ERR_MMAP;
+	f->rdev = sb.st_rdev;
+	f->len = info.size;
+	f->erasesize = info.erasesize;
+	f->read = calloc(info.size / info.erasesize, 1);
+	ptr = mmap(0, f->len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!f->read || ptr == MAP_FAILED) {
+		fprintf(stderr, "Can't map the flash: %s\n", strerror(errno));
+		if (ptr != MAP_FAILED)
+			munmap(ptr, f->len);
+		flash_free(f);
+		return FILE_ERR_MMAP;
+	}
+	f->buf = ptr;
+
+	/* What isn't read looks erased */
+	memset(f->buf, 0xff, f->len);
+	if (read_flash(fd, f)) {
+		flash_free(f);
+		return FILE_ERR_MMAP;
+	}
+
+found:
+	if (add_flash(f)) {
+		flash_free(f);
+		return FILE_ERR_MMAP;
+	}
+
+	*buf = f->buf;
+	*len = f->len;
+	futil_stats_end(STAT_MAP, "flash", start, f->len);
+	return FILE_ERR_NONE;
+}
+
+/* Erase block [b], and program it from [f] unless that's all 0xff */
+static int write_block(int fd, struct flash_s *f, uint64_t b)
+{
+	const uint8_t *data = f->buf + b * f->erasesize;
+	struct erase_info_user erase;
+	uint64_t done;
+	ssize_t n;
+
+	erase.start = b * f->erasesize;
+	erase.length = f->erasesize;
+	if (ioctl(fd, MEMERASE, &erase)) {
+		fprintf(stderr, "Can't erase flash at 0x%" PRIx64 ": %s\n",
+			b * f->erasesize, strerror(errno));
+		return 1;
+	}
+	if (image_fill(data, f->erasesize) == IMAGE_FILL_ERASED)
+		return 0;
+
+	for (done = 0; done < f->erasesize; done += n) {
+		n = pwrite(fd, data + done, f->erasesize - done,
+			   b * f->erasesize + done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			fprintf(stderr, "Can't program flash at 0x%" PRIx64
+				": %s\n", b * f->erasesize, strerror(errno));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int futil_write_flash(int fd, const uint8_t *buf,
+		      const struct futil_traverse_state_s *state)
+{
+	uint64_t start = futil_stats_begin();
+	const struct cb_range_s *r;
+	struct flash_s *f;
+	uint8_t *todo, *old;
+	uint64_t b, nblocks, total = 0;
+	int i, rv = 0;
+
+	f = find_flash(buf);
+	if (!f) {
+		fprintf(stderr, "That flash image wasn't read from flash\n");
+		return 1;
+	}
+
+	/* The blocks the changes are in, which have to have been read */
+	nblocks = f->len / f->erasesize;
+	todo = calloc(nblocks, 1);
+	old = malloc(f->erasesize);
+	if (!todo || !old) {
+		fprintf(stderr, "Out of memory\n");
+		free(todo);
+		free(old);
+		return 1;
+	}
+	for (i = 0; i < state->num_dirty; i++) {
+		r = &state->dirty[i];
+		if (!r->len || r->offset >= f->len)
+			continue;
+		for (b = r->offset / f->erasesize;
+		     b * f->erasesize < r->offset + r->len && b < nblocks; b++)
+			todo[b] = 1;
+	}
+	for (b = 0; b < nblocks && !rv; b++)
+		if (todo[b] && !f->read[b]) {
+			fprintf(stderr, "Flash at 0x%" PRIx64 " changed, but"
+				" wasn't read\n", b * f->erasesize);
+			rv = 1;
+		}
+
+	/* Only what's really different is erased and programmed */
+	for (b = 0; b < nblocks && !rv; b++) {
+		if (!todo[b])
+			continue;
+		if (PreadFull(fd, old, f->erasesize, b * f->erasesize) ==
+		    f->erasesize &&
+		    !memcmp(old, f->buf + b * f->erasesize, f->erasesize))
+			continue;
+		Debug("write back flash block at 0x%" PRIx64 "\n",
+		      b * f->erasesize);
+		rv = write_block(fd, f, b);
+		total += f->erasesize;
+	}
+
+	free(todo);
+	free(old);
+	futil_stats_end(STAT_WRITE_BACK, "flash blocks", start, total);
+	return rv;
+}
+
+#else  /* !__linux__ */
+
+int futil_is_flash(int fd)
+{
+	return 0;
+}
+
+enum futil_file_err futil_map_flash(int fd, uint8_t **buf, uint64_t *len)
+{
+	return FILE_ERR_CHR;
+}
+
+int futil_write_flash(int fd, const uint8_t *buf,
+		      const struct futil_traverse_state_s *state)
+{
+	return 1;
+}
+
+#endif  /* __linux__ */
@@ -4,7 +4,6 @@
  * found in the LICENSE file.
  */
 
-#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
@@ -16,6 +15,8 @@
 #include <unistd.h>
 
 #include "futility.h"
+#include "host_crypto.h"
+#include "stats.h"
 
 
 /******************************************************************************/
@@ -29,96 +30,62 @@
 
 /* #define FORCE_LOGGING_ON */
 
-static int log_fd = -1;
+/*
+ * Set this in the environment to also log who called us. Finding out means
+ * reading a few files in /proc, so it's not done unless asked for.
+ */
+#define LOG_CALLER_ENV "FUTILITY_LOG_CALLER"
 
-/* Write the string and a newline. Silently give up on errors */
-static void log_str(char *prefix, char *str)
+/*
+ * Each invocation's record is put together in memory and appended with a
+ * single write(), so that many futilities running at once neither wait for
+ * each other nor mix up their lines. Records grow as needed.
+ */
+struct log_rec_s {
+	char *buf;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+static void log_add(struct log_rec_s *rec, const char *str, size_t len)
 {
-	int len, done, n;
-
-	if (log_fd < 0)
+	if (rec->failed)
 		return;
 
-	if (!str)
-		str = "(NULL)";
-
-	if (prefix && *prefix) {
-		len = strlen(prefix);
-		for (done = 0; done < len; done += n) {
-			n = write(log_fd, prefix + done, len - done);
-			if (n < 0)
-				return;
-		}
-	}
+	if (rec->len + len > rec->size) {
+		size_t n = rec->size ? rec->size : 1024;
+		char *p;
 
-	len = strlen(str);
-	if (len == 0) {
-		str = "(EMPTY)";
-		len = strlen(str);
-	}
-
-	for (done = 0; done < len; done += n) {
-		n = write(log_fd, str + done, len - done);
-		if (n < 0)
+		while (n < rec->len + len)
+			n *= 2;
+		p = realloc(rec->buf, n);
+		if (!p) {
+			rec->failed = 1;
 			return;
+		}
+		rec->buf = p;
+		rec->size = n;
 	}
-
-	if (write(log_fd, "\n", 1) < 0)
-		return;
-}
-
-static void log_close(void)
-{
-	struct flock lock;
-
-	if (log_fd >= 0) {
-		memset(&lock, 0, sizeof(lock));
-		lock.l_type = F_UNLCK;
-		lock.l_whence = SEEK_SET;
-		if (fcntl(log_fd, F_SETLKW, &lock))
-			perror("Unable to unlock log file");
-
-		close(log_fd);
-		log_fd = -1;
-	}
+	memcpy(rec->buf + rec->len, str, len);
+	rec->len += len;
 }
 
-static void log_open(void)
+/* Add the string and a newline */
+static void log_str(struct log_rec_s *rec, char *prefix, char *str)
 {
-	struct flock lock;
-	int ret;
-
-#ifdef FORCE_LOGGING_ON
-	log_fd = open(LOGFILE, O_WRONLY | O_APPEND | O_CREAT, 0666);
-#else
-	log_fd = open(LOGFILE, O_WRONLY | O_APPEND);
-#endif
-	if (log_fd < 0) {
-
-		if (errno != EACCES)
-			return;
-
-		/* Permission problems should improve shortly ... */
-		sleep(1);
-		log_fd = open(LOGFILE, O_WRONLY | O_APPEND | O_CREAT, 0666);
-		if (log_fd < 0)	/* Nope, they didn't */
-			return;
-	}
-
-	/* Let anyone have a turn */
-	fchmod(log_fd, 0666);
-
-	/* But only one at a time */
-	memset(&lock, 0, sizeof(lock));
-	lock.l_type = F_WRLCK;
-	lock.l_whence = SEEK_END;
+	if (!str)
+		str = "(NULL)";
+	else if (!*str)
+		str = "(EMPTY)";
 
-	ret = fcntl(log_fd, F_SETLKW, &lock);	/* this blocks */
-	if (ret < 0)
-		log_close();
+	if (prefix)
+		log_add(rec, prefix, strlen(prefix));
+	log_add(rec, str, strlen(str));
+	log_add(rec, "\n", 1);
 }
 
-static void log_args(int argc, char *argv[])
+static void log_caller(struct log_rec_s *rec)
 {
 	int i;
 	ssize_t r;
@@ -127,18 +94,13 @@ static void log_args(int argc, char *argv[])
 	FILE *fp;
 	char caller_buf[PATH_MAX];
 
-	log_open();
-
-	/* delimiter */
-	log_str(NULL, "##### LOG #####");
-
 	/* Can we tell who called us? */
 	parent = getppid();
 	snprintf(buf, sizeof(buf), "/proc/%d/exe", parent);
 	r = readlink(buf, caller_buf, sizeof(caller_buf) - 1);
 	if (r >= 0) {
 		caller_buf[r] = '\0';
-		log_str("CALLER:", caller_buf);
+		log_str(rec, "CALLER:", caller_buf);
 	}
 
 	/* From where? */
@@ -146,7 +108,7 @@ static void log_args(int argc, char *argv[])
 	r = readlink(buf, caller_buf, sizeof(caller_buf) - 1);
 	if (r >= 0) {
 		caller_buf[r] = '\0';
-		log_str("DIR:", caller_buf);
+		log_str(rec, "DIR:", caller_buf);
 	}
 
 	/* And maybe the args? */
@@ -158,7 +120,7 @@ static void log_args(int argc, char *argv[])
 		if (r > 0) {
 			char *s = caller_buf;
 			for (i = 0; i < r && *s; ) {
-				log_str("CMDLINE:", s);
+				log_str(rec, "CMDLINE:", s);
 				while (i < r && *s)
 					i++, s++;
 				i++, s++;
@@ -166,12 +128,42 @@ static void log_args(int argc, char *argv[])
 		}
 		fclose(fp);
 	}
+}
+
+static void log_args(int argc, char *argv[])
+{
+	struct log_rec_s rec = { 0 };
+	const char *env;
+	int fd, i;
+
+#ifdef FORCE_LOGGING_ON
+	fd = open(LOGFILE, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	if (fd >= 0)
+		/* Let anyone have a turn */
+		fchmod(fd, 0666);
+#else
+	fd = open(LOGFILE, O_WRONLY | O_APPEND);
+#endif
+	/* Silently give up on errors */
+	if (fd < 0)
+		return;
+
+	/* delimiter */
+	log_str(&rec, NULL, "##### LOG #####");
+
+	env = getenv(LOG_CALLER_ENV);
+	if (env && *env && strcmp(env, "0"))
+		log_caller(&rec);
 
 	/* Now log the stuff about ourselves */
 	for (i = 0; i < argc; i++)
-		log_str(NULL, argv[i]);
+		log_str(&rec, NULL, argv[i]);
+
+	if (!rec.failed && write(fd, rec.buf, rec.len) < 0)
+		rec.failed = 1;
 
-	log_close();
+	free(rec.buf);
+	close(fd);
 }
 
 /******************************************************************************/
@@ -196,15 +188,61 @@ static const char *const options =
 "\n"
 "  --vb1        Use only vboot v1.0 binary formats\n"
 "  --vb21       Use only vboot v2.1 binary formats\n"
+"  --stats      Print where the time went to stderr when done\n"
+"  --trace FILE Write the same as Chrome trace JSON to FILE\n"
+"  --budget FILE\n"
+"               Fail if the command makes more allocations, syscalls,\n"
+"                 RSA operations and so on than FILE allows; see\n"
+"                 include/futility/stats.h\n"
+"  --crypto NAME\n"
+"               Hash and check signatures with NAME, which is cryptolib\n"
+#ifdef FUTIL_VERIFY_ONLY
+"                 (the firmware's code, the default) or afalg\n"
+#else
+"                 (the firmware's code, the default), libcrypto, or afalg\n"
+#endif
+"                 (big hashes by the kernel, or a crypto card it drives)\n"
+"  -j|--jobs NUM\n"
+"               Keep at most NUM threads busy, however many commands\n"
+"                 ask for (default is one per CPU)\n"
+"  --mem_budget SIZE\n"
+"               Hold back batch jobs while those running would need more\n"
+"                 than SIZE bytes (K, M or G) between them (default is\n"
+"                 half the memory there is)\n"
+"  --xattr_cache\n"
+"               Remember each file's type and where its FMAP is in its\n"
+"                 user.futility.meta extended attribute, and use that\n"
+"                 until the file changes\n"
+"  --window SIZE\n"
+"               Read images bigger than SIZE bytes (K, M or G) through a\n"
+"                 window of that size instead of mapping all of them\n"
+"                 (default is 256M on 32-bit hosts, and never otherwise)\n"
+"\n"
+"Setting FUTILITY_STATS=1, FUTILITY_TRACE=FILE, FUTILITY_BUDGET=FILE,\n"
+"FUTILITY_CRYPTO=NAME, FUTILITY_JOBS=NUM, FUTILITY_MEM_BUDGET=SIZE,\n"
+"FUTILITY_XATTR_CACHE=1 or FUTILITY_WINDOW=SIZE in the environment does\n"
+"the same, which also works when invoked by one of the old tool names.\n"
 "\n";
 
-static const struct futil_cmd_t *find_command(const char *name)
+static int futil_cmd_hash(const char *name)
 {
-	const struct futil_cmd_t *const *cmd;
+	uint32_t h = futil_cmd_hash_seed;
 
-	for (cmd = futil_cmds; *cmd; cmd++)
-		if (0 == strcmp((*cmd)->name, name))
-			return *cmd;
+	for (; *name; name++) {
+		h ^= (uint8_t)*name;
+		h *= 16777619;
+	}
+	return h >> 27;
+}
+BUILD_ASSERT(FUTIL_CMD_SLOTS == 1 << (32 - 27));
+
+/* Every command has a slot to itself, so one strcmp() is enough */
+const struct futil_cmd_t *find_command(const char *name)
+{
+	int i = futil_cmd_slot[futil_cmd_hash(name)];
+
+	if (i >= 0 && 0 == strcmp(futil_cmds[i]->name, name))
+		return futil_cmds[i];
 
 	return NULL;
 }
@@ -273,6 +311,9 @@ DECLARE_FUTIL_COMMAND(version, do_version, VBOOT_VERSION_ALL,
 
 int run_command(const struct futil_cmd_t *cmd, int argc, char *argv[])
 {
+	uint64_t start;
+	int retval;
+
 	/* Handle the "CMD --help" case ourselves */
 	if (2 == argc && 0 == strcmp(argv[1], "--help")) {
 		char *fake_argv[] = {"help",
@@ -281,7 +322,13 @@ int run_command(const struct futil_cmd_t *cmd, int argc, char *argv[])
 		return do_help(2, fake_argv);
 	}
 
-	return cmd->handler(argc, argv);
+	futil_budget_begin();
+	start = futil_stats_begin();
+	retval = cmd->handler(argc, argv);
+	futil_stats_end(STAT_COMMAND, cmd->name, start, 0);
+	if (futil_budget_check(cmd->name) && !retval)
+		retval = 1;
+	return retval;
 }
 
 static char *simple_basename(char *str)
@@ -301,27 +348,113 @@ int main(int argc, char *argv[], char *envp[])
 	const struct futil_cmd_t *cmd;
 	int i, errorcnt = 0;
 	int vb_ver = VBOOT_VERSION_ALL;
+	int want_stats;
+	char *trace_file, *crypto, *s;
 	struct option long_opts[] = {
 		{"vb1" , 0,  &vb_ver,  VBOOT_VERSION_1_0},
 		{"vb21", 0,  &vb_ver,  VBOOT_VERSION_2_1},
+		{"stats", 0, NULL,     'S'},
+		{"trace", 1, NULL,     'T'},
+		{"budget", 1, NULL,    'B'},
+		{"crypto", 1, NULL,    'C'},
+		{"jobs", 1, NULL,      'j'},
+		{"mem_budget", 1, NULL, 'M'},
+		{"xattr_cache", 0, NULL, 'X'},
+		{"window", 1, NULL,    'W'},
 		{ 0, 0, 0, 0},
 	};
 
 	log_args(argc, argv);
+	futil_debug_init();
+
+	s = getenv("FUTILITY_STATS");
+	want_stats = s && *s && strcmp(s, "0");
+	trace_file = getenv("FUTILITY_TRACE");
+	if (trace_file && !*trace_file)
+		trace_file = NULL;
+	s = getenv("FUTILITY_BUDGET");
+	if (s && *s && futil_budget_load(s))
+		return 1;
+	crypto = getenv("FUTILITY_CRYPTO");
+	if (crypto && *crypto && CryptoProviderSelect(crypto)) {
+		fprintf(stderr, "Unknown FUTILITY_CRYPTO \"%s\"\n", crypto);
+		return 1;
+	}
+	s = getenv("FUTILITY_JOBS");
+	if (s && *s && futil_set_jobs(s)) {
+		fprintf(stderr, "Invalid FUTILITY_JOBS \"%s\"\n", s);
+		return 1;
+	}
+	s = getenv("FUTILITY_MEM_BUDGET");
+	if (s && *s && futil_set_mem_budget(s)) {
+		fprintf(stderr, "Invalid FUTILITY_MEM_BUDGET \"%s\"\n", s);
+		return 1;
+	}
+	s = getenv("FUTILITY_XATTR_CACHE");
+	futil_set_xattr_cache(s && *s && strcmp(s, "0"));
+	s = getenv("FUTILITY_WINDOW");
+	if (s && *s && futil_set_window(s)) {
+		fprintf(stderr, "Invalid FUTILITY_WINDOW \"%s\"\n", s);
+		return 1;
+	}
 
 	/* How were we invoked? */
 	progname = simple_basename(argv[0]);
 
 	/* See if the program name is a command we recognize */
-	cmd = find_command(progname);
-	if (cmd)
+	cmd = strcmp(progname, MYNAME) ? find_command(progname) : NULL;
+	if (cmd) {
 		/* Yep, just do that */
+		if ((want_stats || trace_file) && futil_stats_start(trace_file))
+			return 1;
 		return run_command(cmd, argc, argv);
+	}
 
 	/* Parse the global options, stopping at the first non-option. */
 	opterr = 0;				/* quiet, you. */
-	while ((i = getopt_long(argc, argv, "+:", long_opts, NULL)) != -1) {
+	while ((i = getopt_long(argc, argv, "+:j:", long_opts, NULL)) != -1) {
 		switch (i) {
+		case 'S':
+			want_stats = 1;
+			break;
+		case 'T':
+			trace_file = optarg;
+			break;
+		case 'B':
+			if (futil_budget_load(optarg))
+				errorcnt++;
+			break;
+		case 'C':
+			if (CryptoProviderSelect(optarg)) {
+				fprintf(stderr, "Unknown --crypto \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case 'j':
+			if (futil_set_jobs(optarg)) {
+				fprintf(stderr, "Invalid --jobs \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case 'M':
+			if (futil_set_mem_budget(optarg)) {
+				fprintf(stderr, "Invalid --mem_budget \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
+		case 'X':
+			futil_set_xattr_cache(1);
+			break;
+		case 'W':
+			if (futil_set_window(optarg)) {
+				fprintf(stderr, "Invalid --window \"%s\"\n",
+					optarg);
+				errorcnt++;
+			}
+			break;
 		case '?':
 			if (optopt)
 				fprintf(stderr, "Unrecognized option: -%c\n",
@@ -344,6 +477,10 @@ int main(int argc, char *argv[], char *envp[])
 	}
 	vboot_version = vb_ver;
 
+	if (!errorcnt && (want_stats || trace_file) &&
+	    futil_stats_start(trace_file))
+		return 1;
+
 	/* Reset the getopt state so commands can parse their own options. */
 	argc -= optind;
 	argv += optind;
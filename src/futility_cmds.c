@@ -1,35 +1,167 @@
+#include "futility.h"
+
 const char futility_version[] = "v0.0.1370-4b06fde";
+
+#ifdef FUTIL_VERIFY_ONLY
+/* futility-verify: just what it takes to look at images, and no signing */
 #define _CMD(NAME) extern const struct futil_cmd_t __cmd_##NAME;
 _CMD(dump_fmap)
+_CMD(show)
+_CMD(verify)
+_CMD(help)
+_CMD(version)
+#undef _CMD
+#define _CMD(NAME) &__cmd_##NAME,
+const struct futil_cmd_t *const futil_cmds[] = {
+_CMD(dump_fmap)
+_CMD(show)
+_CMD(verify)
+_CMD(help)
+_CMD(version)
+0};  /* null-terminated */
+#undef _CMD
+
+/* As below */
+const uint32_t futil_cmd_hash_seed = 0;
+const int8_t futil_cmd_slot[FUTIL_CMD_SLOTS] = {
+	-1,
+	-1,
+	2,		/* verify */
+	-1,
+	-1,
+	4,		/* version */
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	1,		/* show */
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+	0,		/* dump_fmap */
+	3,		/* help */
+	-1,
+	-1,
+	-1,
+	-1,
+	-1,
+};
+BUILD_ASSERT(ARRAY_SIZE(futil_cmds) == 5 + 1);
+#else
+#define _CMD(NAME) extern const struct futil_cmd_t __cmd_##NAME;
+_CMD(assemble)
+_CMD(bench)
+_CMD(bootsim)
+_CMD(bmpblk)
+_CMD(create)
+_CMD(diff)
+_CMD(dump_fmap)
 _CMD(dump_kernel_config)
 _CMD(gbb_utility)
+_CMD(gpt)
+_CMD(hash)
+_CMD(keystore)
 _CMD(load_fmap)
 _CMD(pcr)
+_CMD(serve)
 _CMD(show)
 _CMD(verify)
 _CMD(sign)
+_CMD(synth)
 _CMD(vbutil_firmware)
 _CMD(vbutil_kernel)
 _CMD(vbutil_key)
 _CMD(vbutil_keyblock)
+_CMD(verify_chain)
+_CMD(verity)
 _CMD(help)
 _CMD(version)
 #undef _CMD
 #define _CMD(NAME) &__cmd_##NAME,
 const struct futil_cmd_t *const futil_cmds[] = {
+_CMD(assemble)
+_CMD(bench)
+_CMD(bootsim)
+_CMD(bmpblk)
+_CMD(create)
+_CMD(diff)
 _CMD(dump_fmap)
 _CMD(dump_kernel_config)
 _CMD(gbb_utility)
+_CMD(gpt)
+_CMD(hash)
+_CMD(keystore)
 _CMD(load_fmap)
 _CMD(pcr)
+_CMD(serve)
 _CMD(show)
 _CMD(verify)
 _CMD(sign)
+_CMD(synth)
 _CMD(vbutil_firmware)
 _CMD(vbutil_kernel)
 _CMD(vbutil_key)
 _CMD(vbutil_keyblock)
+_CMD(verify_chain)
+_CMD(verity)
 _CMD(help)
 _CMD(version)
 0};  /* null-terminated */
 #undef _CMD
+
+/*
+ * find_command() looks in slot futil_cmd_hash(name) of this for the index of
+ * the command in futil_cmds[], or -1 if there isn't one. The hash is 32-bit
+ * FNV-1a started at the seed instead of the usual offset basis, keeping the
+ * top 5 bits. The seed is the smallest one that gives every command a slot to
+ * itself, so adding or renaming a command means finding a new seed and
+ * redoing this table.
+ */
+const uint32_t futil_cmd_hash_seed = 100570154;
+const int8_t futil_cmd_slot[FUTIL_CMD_SLOTS] = {
+	-1,
+	6,		/* dump_fmap */
+	5,		/* diff */
+	15,		/* show */
+	-1,
+	22,		/* vbutil_keyblock */
+	23,		/* verify_chain */
+	-1,
+	4,		/* create */
+	19,		/* vbutil_firmware */
+	3,		/* bmpblk */
+	-1,
+	-1,
+	0,		/* assemble */
+	20,		/* vbutil_kernel */
+	10,		/* hash */
+	13,		/* pcr */
+	11,		/* keystore */
+	2,		/* bootsim */
+	1,		/* bench */
+	17,		/* sign */
+	14,		/* serve */
+	12,		/* load_fmap */
+	21,		/* vbutil_key */
+	18,		/* synth */
+	26,		/* version */
+	7,		/* dump_kernel_config */
+	16,		/* verify */
+	24,		/* verity */
+	25,		/* help */
+	9,		/* gpt */
+	8,		/* gbb_utility */
+};
+BUILD_ASSERT(ARRAY_SIZE(futil_cmds) == 27 + 1);
+#endif
@@ -0,0 +1,343 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * The threads that the commands which do things in parallel share.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "futility.h"
+#include "metrics.h"
+
+/* How many threads may be busy at once, or 0 for one per CPU */
+static int jobs_limit;
+
+/* How many are, counting the main thread */
+static int jobs_busy = 1;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * How much memory the jobs in flight may take between them, or 0 for half
+ * of what there is, and how much they've said they'll take.
+ */
+static uint64_t mem_budget;
+static uint64_t mem_used;
+static pthread_cond_t mem_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * The CPUs of each NUMA node that we're allowed to use, if there's more
+ * than one. Threads are kept to a node, so that what a job maps and then
+ * hashes is read into that node's memory, and what it caches (keys, the
+ * RSA cache) is allocated there too.
+ */
+#define MAX_NODES 64
+static cpu_set_t node_cpus[MAX_NODES];
+static int num_nodes;
+static pthread_once_t nodes_once = PTHREAD_ONCE_INIT;
+
+/* Whether this thread has already been put on a node */
+static __thread int jobs_pinned;
+
+/* Threads are numbered from 1 as they first ask */
+static int next_thread_id;
+static __thread int thread_id;
+
+/* The index of the job this thread is running, or -1 */
+static __thread int64_t job_id = -1;
+
+struct jobs_pool_s {
+	void (*func)(void *arg, uint32_t index);
+	void (*thread_done)(void *arg);
+	void *arg;
+	uint32_t count;
+	uint32_t next;
+	int pinned;
+	pthread_mutex_t lock;
+};
+
+int futil_set_jobs(const char *str)
+{
+	char *e;
+	long n;
+
+	n = strtol(str, &e, 0);
+	if (!*str || *e || n < 1 || n > 4096)
+		return 1;
+	jobs_limit = n;
+	return 0;
+}
+
+int futil_jobs(void)
+{
+	long n;
+
+	if (jobs_limit)
+		return jobs_limit;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : n;
+}
+
+int futil_thread_id(void)
+{
+	if (!thread_id)
+		thread_id = __sync_add_and_fetch(&next_thread_id, 1);
+	return thread_id;
+}
+
+int64_t futil_job_id(void)
+{
+	return job_id;
+}
+
+int futil_parse_size(const char *str, uint64_t *size)
+{
+	uint64_t val;
+	char *e;
+
+	errno = 0;
+	val = strtoull(str, &e, 0);
+	if (errno || e == str)
+		return 1;
+	switch (*e) {
+	case 'G':
+	case 'g':
+		val <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		val <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		val <<= 10;
+		e++;
+	}
+	if (*e || !val)
+		return 1;
+	*size = val;
+	return 0;
+}
+
+int futil_set_mem_budget(const char *str)
+{
+	return futil_parse_size(str, &mem_budget);
+}
+
+uint64_t futil_mem_budget(void)
+{
+	long pages, page_size;
+
+	if (mem_budget)
+		return mem_budget;
+	pages = sysconf(_SC_PHYS_PAGES);
+	page_size = sysconf(_SC_PAGESIZE);
+	if (pages < 1 || page_size < 1)
+		return UINT64_MAX;
+	return (uint64_t)pages * page_size / 2;
+}
+
+uint64_t futil_mem_reserve(uint64_t want)
+{
+	uint64_t budget = futil_mem_budget();
+
+	/* Something too big to ever fit just waits until it's alone */
+	if (want > budget)
+		want = budget;
+
+	pthread_mutex_lock(&jobs_lock);
+	while (mem_used && mem_used + want > budget)
+		pthread_cond_wait(&mem_cond, &jobs_lock);
+	mem_used += want;
+	pthread_mutex_unlock(&jobs_lock);
+	return want;
+}
+
+void futil_mem_release(uint64_t got)
+{
+	if (!got)
+		return;
+	pthread_mutex_lock(&jobs_lock);
+	mem_used -= got;
+	pthread_cond_broadcast(&mem_cond);
+	pthread_mutex_unlock(&jobs_lock);
+}
+
+/* Adds a cpulist like "0-7,16-23" to [set] */
+static void parse_cpulist(const char *list, cpu_set_t *set)
+{
+	char *e;
+	long a, b;
+
+	while (*list) {
+		a = strtol(list, &e, 10);
+		if (e == list)
+			return;
+		b = a;
+		if (*e == '-')
+			b = strtol(e + 1, &e, 10);
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, set);
+		if (*e != ',')
+			return;
+		list = e + 1;
+	}
+}
+
+static void read_nodes(void)
+{
+	char path[64], line[1024];
+	cpu_set_t allowed, *set;
+	FILE *fp;
+	int n;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return;
+	for (n = 0; n < MAX_NODES; n++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", n);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		set = &node_cpus[num_nodes];
+		CPU_ZERO(set);
+		if (fgets(line, sizeof(line), fp))
+			parse_cpulist(line, set);
+		fclose(fp);
+		CPU_AND(set, set, &allowed);
+		if (CPU_COUNT(set))
+			num_nodes++;
+	}
+	if (num_nodes < 2)
+		num_nodes = 0;
+}
+
+/* Takes up to [want] of the threads nobody's using, with [limit] in all */
+static int jobs_reserve(int limit, int want)
+{
+	int n;
+
+	pthread_mutex_lock(&jobs_lock);
+	n = limit - jobs_busy;
+	if (n > want)
+		n = want;
+	if (n > 0)
+		jobs_busy += n;
+	else
+		n = 0;
+	pthread_mutex_unlock(&jobs_lock);
+	return n;
+}
+
+int futil_jobs_reserve(int want)
+{
+	return jobs_reserve(futil_jobs(), want);
+}
+
+void futil_jobs_release(int n)
+{
+	pthread_mutex_lock(&jobs_lock);
+	jobs_busy -= n;
+	pthread_mutex_unlock(&jobs_lock);
+}
+
+/* Every thread takes whatever's next until there's nothing left */
+static void jobs_run(struct jobs_pool_s *pool)
+{
+	int64_t outer = job_id;
+	uint32_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next;
+		if (i < pool->count)
+			pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->count)
+			break;
+		job_id = i;
+		pool->func(pool->arg, i);
+	}
+	job_id = outer;
+}
+
+static void *jobs_thread(void *arg)
+{
+	struct jobs_pool_s *pool = arg;
+
+	jobs_pinned = pool->pinned;
+	futil_metrics_thread();
+	jobs_run(pool);
+	if (pool->thread_done)
+		pool->thread_done(pool->arg);
+
+	/* Let whoever asks next have this one */
+	futil_jobs_release(1);
+	return NULL;
+}
+
+void futil_run_jobs(void (*func)(void *arg, uint32_t index),
+		    void (*thread_done)(void *arg), void *arg,
+		    uint32_t count, int jobs)
+{
+	struct jobs_pool_s pool = {
+		.func = func,
+		.thread_done = thread_done,
+		.arg = arg,
+		.count = count,
+	};
+	pthread_t *tid = NULL;
+	pthread_attr_t attr;
+	int i, limit, want, started = 0;
+
+	/* Asking for more than the limit (to wait on a server, say) is OK */
+	limit = futil_jobs();
+	if (jobs < 1)
+		jobs = limit;
+	else if (jobs > limit)
+		limit = jobs;
+	if ((uint32_t)jobs > count)
+		jobs = count;
+
+	/*
+	 * Only take the threads nobody else is using, so that jobs which
+	 * start jobs of their own don't have more threads than CPUs between
+	 * them. Whatever doesn't get a thread is done here.
+	 */
+	want = jobs_reserve(limit, jobs - 1);
+
+	/*
+	 * Spread the threads evenly over the nodes. Those that a thread on a
+	 * node starts stay on its node, as they'd share its memory.
+	 */
+	pthread_once(&nodes_once, read_nodes);
+	pool.pinned = num_nodes && !jobs_pinned;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_attr_init(&attr);
+	if (want)
+		tid = calloc(want, sizeof(*tid));
+	for (i = 0; tid && i < want; i++) {
+		if (pool.pinned)
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+						    &node_cpus[i % num_nodes]);
+		if (!pthread_create(&tid[started], &attr, jobs_thread, &pool))
+			started++;
+	}
+	pthread_attr_destroy(&attr);
+	if (want > started)
+		futil_jobs_release(want - started);
+
+	jobs_run(&pool);
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+	free(tid);
+}
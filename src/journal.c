@@ -0,0 +1,239 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * A record of which items of a batch have been finished, so that a batch
+ * that's started again only does what it hadn't done.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "futility.h"
+#include "host_common.h"
+
+/*
+ * Each line is "KEY INPUT OUTPUT NAME": the item's key, the SHA-256 of its
+ * input before it was signed and of its output after, in hex, and the name
+ * of the output, which is only there for people reading it. Lines are only
+ * ever appended, and the last one for a key counts.
+ */
+#define HEX_SIZE (2 * SHA256_DIGEST_SIZE)
+
+struct journal_rec_s {
+	uint8_t key[SHA256_DIGEST_SIZE];
+	uint8_t in[SHA256_DIGEST_SIZE];
+	uint8_t out[SHA256_DIGEST_SIZE];
+	int seq;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	FILE *fp;
+	const char *filename;
+	struct journal_rec_s *rec;	/* what was there, sorted by key */
+	int count;
+	int errors;
+} journal = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int from_hex(const char *hex, uint8_t *buf)
+{
+	unsigned int v;
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+			return 1;
+		buf[i] = v;
+	}
+	return hex[HEX_SIZE] != ' ';
+}
+
+static void to_hex(const uint8_t *buf, char *hex)
+{
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		sprintf(hex + 2 * i, "%02x", buf[i]);
+}
+
+/* By key, and for the same key, in the order they were written */
+static int rec_cmp(const void *a, const void *b)
+{
+	const struct journal_rec_s *ra = a, *rb = b;
+	int c = memcmp(ra->key, rb->key, sizeof(ra->key));
+
+	return c ? c : ra->seq - rb->seq;
+}
+
+int futil_file_sha256(const char *filename, uint8_t *digest)
+{
+	VB_SHA256_CTX ctx;
+	uint8_t buf[65536];
+	ssize_t n;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	SHA256_init(&ctx);
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			close(fd);
+			return 1;
+		}
+		SHA256_update(&ctx, buf, n);
+	}
+	close(fd);
+	memcpy(digest, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+	return 0;
+}
+
+int futil_journal_open(const char *filename)
+{
+	struct journal_rec_s *rec;
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t len = 0;
+	int seq = 0;
+
+	journal.fp = fopen(filename, "a+");
+	if (!journal.fp) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			filename, strerror(errno));
+		return 1;
+	}
+	journal.filename = filename;
+	journal.errors = 0;
+
+	/* A line cut short by a crash just doesn't count */
+	rewind(journal.fp);
+	while ((len = getline(&line, &linesize, journal.fp)) != -1) {
+		seq++;
+		if (len < 3 * (HEX_SIZE + 1))
+			continue;
+		rec = realloc(journal.rec, (journal.count + 1) * sizeof(*rec));
+		if (!rec) {
+			fprintf(stderr, "Out of memory\n");
+			break;
+		}
+		journal.rec = rec;
+		rec += journal.count;
+		if (from_hex(line, rec->key) ||
+		    from_hex(line + HEX_SIZE + 1, rec->in) ||
+		    from_hex(line + 2 * (HEX_SIZE + 1), rec->out))
+			continue;
+		rec->seq = seq;
+		journal.count++;
+	}
+	free(line);
+	if (journal.count)
+		qsort(journal.rec, journal.count, sizeof(*journal.rec),
+		      rec_cmp);
+
+	/* Don't add to the end of a cut-short line */
+	if (fseek(journal.fp, 0, SEEK_END) == 0 && ftell(journal.fp) > 0) {
+		fseek(journal.fp, -1, SEEK_END);
+		if (fgetc(journal.fp) != '\n') {
+			fseek(journal.fp, 0, SEEK_END);
+			fputc('\n', journal.fp);
+		}
+	}
+	fseek(journal.fp, 0, SEEK_END);
+	return 0;
+}
+
+int futil_journal_done(const uint8_t *key, const uint8_t *in_digest,
+		       const char *outfile, int in_place)
+{
+	struct journal_rec_s *rec = NULL;
+	uint8_t out[SHA256_DIGEST_SIZE];
+	int lo = 0, hi = journal.count, mid, c;
+
+	/* The last record for [key] */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		c = memcmp(journal.rec[mid].key, key, SHA256_DIGEST_SIZE);
+		if (c <= 0) {
+			if (!c)
+				rec = &journal.rec[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (!rec)
+		return 0;
+
+	/* Whatever's there has to be what was written then */
+	if (!in_place && memcmp(in_digest, rec->in, SHA256_DIGEST_SIZE))
+		return 0;
+	if (futil_file_sha256(outfile, out) ||
+	    memcmp(out, rec->out, SHA256_DIGEST_SIZE))
+		return 0;
+	return 1;
+}
+
+int futil_journal_add(const uint8_t *key, const uint8_t *in_digest,
+		      const char *outfile)
+{
+	uint8_t out[SHA256_DIGEST_SIZE];
+	char hex[3][HEX_SIZE + 1];
+	int rv = 0;
+
+	if (futil_file_sha256(outfile, out)) {
+		fprintf(stderr, "Can't read back %s for %s: %s\n",
+			outfile, journal.filename, strerror(errno));
+		pthread_mutex_lock(&journal.lock);
+		journal.errors++;
+		pthread_mutex_unlock(&journal.lock);
+		return 1;
+	}
+	to_hex(key, hex[0]);
+	to_hex(in_digest, hex[1]);
+	to_hex(out, hex[2]);
+
+	/*
+	 * It's only flushed, not synced. A record that's lost just means the
+	 * item is done again, and one that outlives the output it describes
+	 * won't match what's in the file.
+	 */
+	pthread_mutex_lock(&journal.lock);
+	if (fprintf(journal.fp, "%s %s %s %s\n",
+		    hex[0], hex[1], hex[2], outfile) < 0 ||
+	    fflush(journal.fp)) {
+		fprintf(stderr, "Can't write %s: %s\n",
+			journal.filename, strerror(errno));
+		journal.errors++;
+		rv = 1;
+	}
+	pthread_mutex_unlock(&journal.lock);
+	return rv;
+}
+
+int futil_journal_close(void)
+{
+	int errors = journal.errors;
+
+	if (journal.fp && fclose(journal.fp)) {
+		fprintf(stderr, "Can't write %s: %s\n",
+			journal.filename, strerror(errno));
+		errors++;
+	}
+	journal.fp = NULL;
+	free(journal.rec);
+	journal.rec = NULL;
+	journal.count = 0;
+	return errors;
+}
@@ -0,0 +1,630 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cryptolib.h"
+#include "futility.h"
+#include "host_common.h"
+#include "keystore.h"
+#include "util_misc.h"
+
+/*
+ * A key store is a header, an index sorted by id, and the objects it
+ * describes, each starting on an 8-byte boundary. The id of an object is
+ * the sha1sum of the key it carries (the key itself for a .vbpubk, the data
+ * key for a .keyblock), which is what "futility show" prints for it.
+ * Everything is checked when the store is made, so reading an object back
+ * is just a binary search and a copy.
+ */
+#define KEYSTORE_MAGIC 0x31736b76		/* "vks1" */
+#define KEYSTORE_VERSION 1
+#define KEYSTORE_ALIGN 8
+
+struct keystore_header_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t size;				/* Of the whole store */
+};
+
+struct keystore_entry_s {
+	uint8_t id[SHA1_DIGEST_SIZE];
+	uint32_t type;				/* enum futil_file_type */
+	uint64_t offset;			/* From the start of the store */
+	uint64_t size;
+};
+
+static uint64_t keystore_align(uint64_t n)
+{
+	return (n + KEYSTORE_ALIGN - 1) & ~(uint64_t)(KEYSTORE_ALIGN - 1);
+}
+
+static const struct keystore_header_s *keystore_check(const uint8_t *buf,
+						      uint64_t len)
+{
+	const struct keystore_header_s *h = (const void *)buf;
+	const struct keystore_entry_s *e = (const void *)(h + 1);
+	uint32_t i;
+
+	if (len < sizeof(*h) || h->magic != KEYSTORE_MAGIC ||
+	    h->version != KEYSTORE_VERSION || h->size != len ||
+	    h->count > (len - sizeof(*h)) / sizeof(*e))
+		return NULL;
+	for (i = 0; i < h->count; i++)
+		if (e[i].offset > len || e[i].size > len - e[i].offset)
+			return NULL;
+	return h;
+}
+
+/* Splits STORE:ID. Returns the id's hex digit count, or 0 if it isn't one. */
+static int keystore_split(const char *spec, char **store, uint8_t *id)
+{
+	const char *colon = strrchr(spec, ':');
+	const char *s;
+	int n;
+
+	if (!colon || colon == spec)
+		return 0;
+	n = strlen(colon + 1);
+	if (!n || n > 2 * SHA1_DIGEST_SIZE)
+		return 0;
+
+	memset(id, 0, SHA1_DIGEST_SIZE);
+	for (s = colon + 1; *s; s++) {
+		int v, d = s - colon - 1;
+
+		if (!isxdigit(*s))
+			return 0;
+		v = isdigit(*s) ? *s - '0' : 10 + tolower(*s) - 'a';
+		id[d / 2] |= d & 1 ? v : v << 4;
+	}
+
+	*store = strndup(spec, colon - spec);
+	return *store ? n : 0;
+}
+
+static int keystore_prefix_cmp(const uint8_t *id, const uint8_t *want,
+			       int digits)
+{
+	int r = memcmp(id, want, digits / 2);
+
+	if (r || !(digits & 1))
+		return r;
+	return (id[digits / 2] & 0xf0) - want[digits / 2];
+}
+
+int futil_is_keystore_spec(const char *spec)
+{
+	struct keystore_header_s h;
+	uint8_t id[SHA1_DIGEST_SIZE];
+	char *store;
+	struct stat sb;
+	int fd, ok;
+
+	/* A file by that name wins, even if it has a colon in it */
+	if (!stat(spec, &sb) || !keystore_split(spec, &store, id))
+		return 0;
+
+	fd = open(store, O_RDONLY);
+	free(store);
+	if (fd < 0)
+		return 0;
+	ok = read(fd, &h, sizeof(h)) == sizeof(h) &&
+		h.magic == KEYSTORE_MAGIC;
+	close(fd);
+	return ok;
+}
+
+int futil_keystore_stat(const char *spec, struct stat *sb)
+{
+	uint8_t id[SHA1_DIGEST_SIZE];
+	char *store;
+	int r;
+
+	if (!keystore_split(spec, &store, id))
+		return 1;
+	r = stat(store, sb);
+	free(store);
+	return !!r;
+}
+
+void *futil_keystore_read(const char *spec, enum futil_file_type *type)
+{
+	const struct keystore_header_s *h;
+	const struct keystore_entry_s *e, *found = NULL;
+	uint8_t id[SHA1_DIGEST_SIZE];
+	uint8_t *buf = NULL;
+	uint64_t len = 0;
+	void *obj = NULL;
+	char *store;
+	uint32_t lo, hi;
+	int digits, fd;
+
+	digits = keystore_split(spec, &store, id);
+	if (!digits) {
+		fprintf(stderr, "%s isn't STORE:ID\n", spec);
+		return NULL;
+	}
+
+	fd = open(store, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", store, strerror(errno));
+		free(store);
+		return NULL;
+	}
+	if (futil_map_file(fd, MAP_RO, &buf, &len) != FILE_ERR_NONE)
+		goto done;
+	h = keystore_check(buf, len);
+	if (!h) {
+		fprintf(stderr, "%s is not a valid key store\n", store);
+		goto done;
+	}
+	e = (const void *)(h + 1);
+
+	/* Find the first entry at or after the id prefix */
+	lo = 0;
+	hi = h->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (keystore_prefix_cmp(e[mid].id, id, digits) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < h->count && !keystore_prefix_cmp(e[lo].id, id, digits);
+	     lo++) {
+		if (*type != FILE_TYPE_UNKNOWN && e[lo].type != *type)
+			continue;
+		if (found) {
+			fprintf(stderr, "%s matches more than one key\n",
+				spec);
+			goto done;
+		}
+		found = &e[lo];
+	}
+	if (!found) {
+		fprintf(stderr, "%s: no such key\n", spec);
+		goto done;
+	}
+
+	/* Callers own what they get, just as if it came from a file */
+	obj = malloc(found->size);
+	if (obj) {
+		memcpy(obj, buf + found->offset, found->size);
+		*type = found->type;
+	}
+
+done:
+	if (buf)
+		futil_unmap_file(fd, MAP_RO, buf, len);
+	close(fd);
+	free(store);
+	return obj;
+}
+
+struct keystore_item_s {
+	struct keystore_entry_s e;
+	uint8_t *obj;
+};
+
+static int keystore_item_cmp(const void *a, const void *b)
+{
+	const struct keystore_item_s *x = a, *y = b;
+	int r = memcmp(x->e.id, y->e.id, sizeof(x->e.id));
+
+	if (r)
+		return r;
+	return (int)x->e.type - (int)y->e.type;
+}
+
+/* Returns the key carried by a .vbpubk or .keyblock, or NULL */
+static VbPublicKey *keystore_key_of(uint8_t *obj, uint64_t len,
+				    enum futil_file_type *type)
+{
+	VbKeyBlockHeader *kb;
+	VbPublicKey *key;
+
+	*type = futil_file_type_buf(obj, len);
+	switch (*type) {
+	case FILE_TYPE_PUBKEY:
+		key = (VbPublicKey *)obj;
+		if (!PublicKeyLooksOkay(key, len))
+			return NULL;
+		return key;
+	case FILE_TYPE_KEYBLOCK:
+		kb = (VbKeyBlockHeader *)obj;
+		if (KeyBlockVerify(kb, len, NULL, 1))
+			return NULL;
+		return &kb->data_key;
+	default:
+		return NULL;
+	}
+}
+
+int futil_keystore_create(const char *outfile, int count, char *files[])
+{
+	struct keystore_item_s *items;
+	struct keystore_header_s *h;
+	struct keystore_entry_s *e;
+	uint8_t *buf = NULL;
+	uint64_t size;
+	int i, n = 0, errorcnt = 0;
+
+	items = calloc(count ? count : 1, sizeof(*items));
+	if (!items) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		enum futil_file_type type;
+		VbPublicKey *key;
+		uint64_t len;
+		uint8_t *obj;
+
+		obj = ReadFile(files[i], &len);
+		if (!obj) {
+			fprintf(stderr, "Can't read %s\n", files[i]);
+			errorcnt++;
+			continue;
+		}
+		key = keystore_key_of(obj, len, &type);
+		if (!key) {
+			fprintf(stderr,
+				"%s is not a valid .vbpubk or .keyblock\n",
+				files[i]);
+			free(obj);
+			errorcnt++;
+			continue;
+		}
+		internal_SHA1(GetPublicKeyData(key), key->key_size,
+			      items[n].e.id);
+		items[n].e.type = type;
+		/* Trailing padding and the like don't need to be kept */
+		items[n].e.size = type == FILE_TYPE_PUBKEY ?
+			key->key_offset + key->key_size :
+			((VbKeyBlockHeader *)obj)->key_block_size;
+		items[n].obj = obj;
+		n++;
+	}
+	if (errorcnt)
+		goto done;
+
+	qsort(items, n, sizeof(*items), keystore_item_cmp);
+
+	size = keystore_align(sizeof(*h) + n * sizeof(*e));
+	for (i = 0; i < n; i++) {
+		items[i].e.offset = size;
+		size = keystore_align(size + items[i].e.size);
+	}
+
+	buf = calloc(1, size);
+	if (!buf) {
+		fprintf(stderr, "Out of memory\n");
+		errorcnt++;
+		goto done;
+	}
+	h = (struct keystore_header_s *)buf;
+	h->magic = KEYSTORE_MAGIC;
+	h->version = KEYSTORE_VERSION;
+	h->count = n;
+	h->size = size;
+	e = (struct keystore_entry_s *)(h + 1);
+	for (i = 0; i < n; i++) {
+		e[i] = items[i].e;
+		memcpy(buf + e[i].offset, items[i].obj, e[i].size);
+	}
+
+	if (futil_write_file(outfile, buf, size) != FILE_ERR_NONE)
+		errorcnt++;
+
+done:
+	for (i = 0; i < n; i++)
+		free(items[i].obj);
+	free(items);
+	free(buf);
+	return errorcnt;
+}
+
+int futil_keystore_list(const char *storefile)
+{
+	const struct keystore_header_s *h;
+	const struct keystore_entry_s *e;
+	uint8_t *buf = NULL;
+	uint64_t len = 0;
+	uint32_t i;
+	int fd, j, errorcnt = 0;
+
+	fd = open(storefile, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			storefile, strerror(errno));
+		return 1;
+	}
+	if (futil_map_file(fd, MAP_RO, &buf, &len) != FILE_ERR_NONE) {
+		close(fd);
+		return 1;
+	}
+
+	h = keystore_check(buf, len);
+	if (!h) {
+		fprintf(stderr, "%s is not a valid key store\n", storefile);
+		errorcnt++;
+		goto done;
+	}
+	e = (const void *)(h + 1);
+	printf("Key store:             %s\n", storefile);
+	printf("  Keys:                %u\n", h->count);
+	for (i = 0; i < h->count; i++) {
+		const VbPublicKey *key;
+
+		if (e[i].type == FILE_TYPE_KEYBLOCK)
+			key = &((const VbKeyBlockHeader *)
+				(buf + e[i].offset))->data_key;
+		else
+			key = (const VbPublicKey *)(buf + e[i].offset);
+		printf("  ");
+		for (j = 0; j < SHA1_DIGEST_SIZE; j++)
+			printf("%02x", e[i].id[j]);
+		printf("  %-8s  algorithm %" PRIu64 ", version %" PRIu64 "\n",
+		       e[i].type == FILE_TYPE_KEYBLOCK ? "keyblock" : "pubkey",
+		       key->algorithm, key->key_version);
+	}
+
+done:
+	futil_unmap_file(fd, MAP_RO, buf, len);
+	close(fd);
+	return errorcnt;
+}
+
+/*
+ * The known keys are an open-addressed hash table on the sha1sum, which is
+ * already as good a hash as any, so a lookup is one probe or so however many
+ * keys there are.
+ */
+struct known_key_s {
+	uint8_t id[SHA1_DIGEST_SIZE];
+	char *name;				/* NULL if the slot is free */
+};
+
+struct futil_known_keys {
+	struct known_key_s *slot;
+	uint32_t mask;
+};
+
+static uint32_t known_hash(const uint8_t *id)
+{
+	return id[0] | id[1] << 8 | id[2] << 16 | (uint32_t)id[3] << 24;
+}
+
+static struct known_key_s *known_find(const struct futil_known_keys *known,
+				      const uint8_t *id)
+{
+	uint32_t i = known_hash(id) & known->mask;
+
+	while (known->slot[i].name &&
+	       memcmp(known->slot[i].id, id, SHA1_DIGEST_SIZE))
+		i = (i + 1) & known->mask;
+	return &known->slot[i];
+}
+
+/* Adds a copy of [name] for [id]. The first name given for a key sticks. */
+static int known_add(struct futil_known_keys *known, const uint8_t *id,
+		     const char *name)
+{
+	struct known_key_s *k = known_find(known, id);
+
+	if (k->name)
+		return 0;
+	k->name = strdup(name);
+	if (!k->name)
+		return 1;
+	memcpy(k->id, id, SHA1_DIGEST_SIZE);
+	return 0;
+}
+
+/* Room for [count] keys, with the table never more than half full */
+static struct futil_known_keys *known_alloc(uint32_t count)
+{
+	struct futil_known_keys *known = calloc(1, sizeof(*known));
+	uint32_t size = 16;
+
+	while (size < 2 * count)
+		size *= 2;
+	if (known)
+		known->slot = calloc(size, sizeof(*known->slot));
+	if (!known || !known->slot) {
+		fprintf(stderr, "Out of memory\n");
+		free(known);
+		return NULL;
+	}
+	known->mask = size - 1;
+	return known;
+}
+
+void futil_known_keys_free(struct futil_known_keys *known)
+{
+	uint32_t i;
+
+	if (!known)
+		return;
+	for (i = 0; i <= known->mask; i++)
+		free(known->slot[i].name);
+	free(known->slot);
+	free(known);
+}
+
+/* The [n]th hex digit of [id] */
+static int id_digit(const uint8_t *id, int n)
+{
+	return (id[n / 2] >> (n & 1 ? 0 : 4)) & 0xf;
+}
+
+/* How many digits it takes to tell [a] from [b], if more than [digits] */
+static int id_digits_apart(const uint8_t *a, const uint8_t *b, int digits)
+{
+	int n;
+
+	for (n = 0; n < 2 * SHA1_DIGEST_SIZE &&
+		     id_digit(a, n) == id_digit(b, n); n++)
+		;
+	return n >= digits ? n + 1 : digits;
+}
+
+/*
+ * Each key in a store is named by as much of its id as tells it apart from
+ * its neighbours in the sorted index, but no less than 8 digits.
+ */
+static struct futil_known_keys *known_keys_from_store(const char *path,
+						      const uint8_t *buf,
+						      uint64_t len)
+{
+	const struct keystore_header_s *h = keystore_check(buf, len);
+	const struct keystore_entry_s *e;
+	struct futil_known_keys *known;
+	char name[PATH_MAX + 2 * SHA1_DIGEST_SIZE + 2];
+	uint32_t i, j;
+	int digits, n;
+
+	if (!h) {
+		fprintf(stderr, "%s is not a valid key store\n", path);
+		return NULL;
+	}
+	e = (const void *)(h + 1);
+	known = known_alloc(h->count);
+	if (!known)
+		return NULL;
+
+	for (i = 0; i < h->count; i++) {
+		/* A pubkey and a keyblock can share an id; skip past those */
+		digits = 8;
+		for (j = i; j > 0 && !memcmp(e[j - 1].id, e[i].id,
+					     SHA1_DIGEST_SIZE); j--)
+			;
+		if (j > 0)
+			digits = id_digits_apart(e[i].id, e[j - 1].id, digits);
+		for (j = i + 1; j < h->count && !memcmp(e[j].id, e[i].id,
+							SHA1_DIGEST_SIZE); j++)
+			;
+		if (j < h->count)
+			digits = id_digits_apart(e[i].id, e[j].id, digits);
+
+		n = snprintf(name, sizeof(name), "%s:", path);
+		for (j = 0; j < digits && n < sizeof(name) - 1; j++)
+			name[n++] = "0123456789abcdef"[id_digit(e[i].id, j)];
+		name[n] = '\0';
+		if (known_add(known, e[i].id, name)) {
+			futil_known_keys_free(known);
+			return NULL;
+		}
+	}
+	return known;
+}
+
+/* Files are taken in name order, so which name a duplicate gets is stable */
+static struct futil_known_keys *known_keys_from_dir(const char *path)
+{
+	struct futil_known_keys *known;
+	char name[PATH_MAX];
+	uint8_t id[SHA1_DIGEST_SIZE];
+	struct dirent **de;
+	int count, i, errorcnt = 0;
+
+	count = scandir(path, &de, NULL, alphasort);
+	if (count < 0) {
+		fprintf(stderr, "Can't read %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	known = known_alloc(count);
+
+	for (i = 0; i < count; i++) {
+		enum futil_file_type type;
+		struct stat sb;
+		VbPublicKey *key;
+		uint8_t *obj;
+		uint64_t len;
+
+		snprintf(name, sizeof(name), "%s/%s", path, de[i]->d_name);
+		free(de[i]);
+		if (!known || errorcnt || stat(name, &sb) ||
+		    !S_ISREG(sb.st_mode))
+			continue;
+		/* Whatever isn't a key is just skipped */
+		obj = ReadFile(name, &len);
+		if (!obj)
+			continue;
+		key = keystore_key_of(obj, len, &type);
+		if (key)
+			PubKeySha1(key, id);
+		free(obj);
+		if (key)
+			errorcnt += known_add(known, id, name);
+	}
+	free(de);
+
+	if (errorcnt) {
+		futil_known_keys_free(known);
+		return NULL;
+	}
+	return known;
+}
+
+struct futil_known_keys *futil_known_keys_load(const char *path)
+{
+	struct futil_known_keys *known;
+	struct stat sb;
+	uint8_t *buf;
+	uint64_t len;
+	int fd;
+
+	if (stat(path, &sb)) {
+		fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (S_ISDIR(sb.st_mode))
+		return known_keys_from_dir(path);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (futil_map_file(fd, MAP_RO, &buf, &len) != FILE_ERR_NONE) {
+		close(fd);
+		return NULL;
+	}
+	known = known_keys_from_store(path, buf, len);
+	futil_unmap_file(fd, MAP_RO, buf, len);
+	close(fd);
+	return known;
+}
+
+const char *futil_known_key_name(const struct futil_known_keys *known,
+				 VbPublicKey *key)
+{
+	uint8_t id[SHA1_DIGEST_SIZE];
+
+	if (!known || !key)
+		return NULL;
+	PubKeySha1(key, id);
+	return known_find(known, id)->name;
+}
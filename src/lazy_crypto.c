@@ -0,0 +1,154 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Most invocations never touch a private key, so rather than linking against
+ * libcrypto (and paying for the loader to map and relocate it every time) we
+ * provide the handful of functions futility calls, and each one looks up the
+ * real thing the first time it's used. Anything new that futility starts
+ * calling will show up as an undefined symbol at link time, and needs a line
+ * added here.
+ */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "futility.h"
+
+/* Whichever of these we find first */
+static const char * const libcrypto_names[] = {
+#ifdef LIBCRYPTO_SONAME
+	LIBCRYPTO_SONAME,
+#endif
+	"libcrypto.so.3",
+	"libcrypto.so.1.1",
+	"libcrypto.so.1.0.0",
+	"libcrypto.so",
+};
+
+static pthread_once_t libcrypto_once = PTHREAD_ONCE_INIT;
+static void *libcrypto;
+
+static void libcrypto_open(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(libcrypto_names) && !libcrypto; i++)
+		libcrypto = dlopen(libcrypto_names[i], RTLD_NOW);
+}
+
+/* Like the dynamic loader, there's no recovering from a missing symbol */
+static void *lazy_crypto_sym(const char *name)
+{
+	void *sym;
+
+	pthread_once(&libcrypto_once, libcrypto_open);
+	if (!libcrypto) {
+		fprintf(stderr, MYNAME ": can't load libcrypto: %s\n",
+			dlerror());
+		exit(1);
+	}
+	sym = dlsym(libcrypto, name);
+	if (!sym) {
+		fprintf(stderr, MYNAME ": can't find %s in libcrypto\n", name);
+		exit(1);
+	}
+	return sym;
+}
+
+#define LAZY_FN(NAME)							\
+	static __typeof__(NAME) *fn;					\
+	__typeof__(NAME) *f = __atomic_load_n(&fn, __ATOMIC_ACQUIRE);	\
+									\
+	if (!f) {							\
+		f = lazy_crypto_sym(#NAME);				\
+		__atomic_store_n(&fn, f, __ATOMIC_RELEASE);		\
+	}
+
+#define LAZY(RET, NAME, PARAMS, ARGS)					\
+	RET NAME PARAMS							\
+	{								\
+		LAZY_FN(NAME)						\
+		return f ARGS;						\
+	}
+
+#define LAZY_VOID(NAME, PARAMS, ARGS)					\
+	void NAME PARAMS						\
+	{								\
+		LAZY_FN(NAME)						\
+		f ARGS;							\
+	}
+
+LAZY(int, BN_add_word, (BIGNUM *a, BN_ULONG w), (a, w))
+LAZY(BN_CTX *, BN_CTX_new, (void), ())
+LAZY_VOID(BN_CTX_free, (BN_CTX *c), (c))
+LAZY(int, BN_bn2bin, (const BIGNUM *a, unsigned char *to), (a, to))
+LAZY(BIGNUM *, BN_bin2bn, (const unsigned char *s, int len, BIGNUM *ret),
+     (s, len, ret))
+LAZY(int, BN_cmp, (const BIGNUM *a, const BIGNUM *b), (a, b))
+LAZY(BIGNUM *, BN_copy, (BIGNUM *a, const BIGNUM *b), (a, b))
+LAZY(int, BN_div, (BIGNUM *dv, BIGNUM *rem, const BIGNUM *m,
+		   const BIGNUM *d, BN_CTX *ctx),
+     (dv, rem, m, d, ctx))
+LAZY(int, BN_exp, (BIGNUM *r, const BIGNUM *a, const BIGNUM *p, BN_CTX *ctx),
+     (r, a, p, ctx))
+LAZY_VOID(BN_free, (BIGNUM *a), (a))
+LAZY(BN_ULONG, BN_get_word, (const BIGNUM *a), (a))
+LAZY(int, BN_is_prime_ex, (const BIGNUM *p, int nchecks, BN_CTX *ctx,
+			   BN_GENCB *cb),
+     (p, nchecks, ctx, cb))
+LAZY(BIGNUM *, BN_mod_inverse, (BIGNUM *ret, const BIGNUM *a,
+				const BIGNUM *n, BN_CTX *ctx),
+     (ret, a, n, ctx))
+LAZY(BN_ULONG, BN_mod_word, (const BIGNUM *a, BN_ULONG w), (a, w))
+LAZY(int, BN_mul, (BIGNUM *r, const BIGNUM *a, const BIGNUM *b, BN_CTX *ctx),
+     (r, a, b, ctx))
+LAZY(BIGNUM *, BN_new, (void), ())
+LAZY(int, BN_num_bits, (const BIGNUM *a), (a))
+LAZY(int, BN_rshift, (BIGNUM *r, const BIGNUM *a, int n), (r, a, n))
+LAZY(int, BN_set_word, (BIGNUM *a, BN_ULONG w), (a, w))
+LAZY(int, BN_sub, (BIGNUM *r, const BIGNUM *a, const BIGNUM *b), (r, a, b))
+LAZY(int, BN_sub_word, (BIGNUM *a, BN_ULONG w), (a, w))
+LAZY_VOID(CRYPTO_free, (void *ptr), (ptr))
+
+LAZY(int, EVP_Digest, (const void *data, size_t count, unsigned char *md,
+		       unsigned int *size, const EVP_MD *type, ENGINE *impl),
+     (data, count, md, size, type, impl))
+LAZY(const EVP_MD *, EVP_sha1, (void), ())
+LAZY(const EVP_MD *, EVP_sha256, (void), ())
+LAZY(const EVP_MD *, EVP_sha512, (void), ())
+
+LAZY(RSA *, RSA_new, (void), ())
+LAZY_VOID(RSA_free, (RSA *r), (r))
+LAZY(int, RSA_size, (const RSA *rsa), (rsa))
+LAZY(int, RSA_generate_key_ex, (RSA *rsa, int bits, BIGNUM *e, BN_GENCB *cb),
+     (rsa, bits, e, cb))
+LAZY(int, RSA_private_encrypt, (int flen, const unsigned char *from,
+				unsigned char *to, RSA *rsa, int padding),
+     (flen, from, to, rsa, padding))
+LAZY(int, RSA_public_decrypt, (int flen, const unsigned char *from,
+			       unsigned char *to, RSA *rsa, int padding),
+     (flen, from, to, rsa, padding))
+LAZY(RSA *, d2i_RSAPublicKey, (RSA **a, const unsigned char **in, long len),
+     (a, in, len))
+LAZY(RSA *, d2i_RSAPrivateKey, (RSA **a, const unsigned char **in, long len),
+     (a, in, len))
+LAZY(int, i2d_RSAPrivateKey, (const RSA *a, unsigned char **out), (a, out))
+LAZY(int, i2d_RSAPublicKey, (const RSA *a, unsigned char **out), (a, out))
+
+LAZY(RSA *, PEM_read_RSAPrivateKey, (FILE *fp, RSA **x, pem_password_cb *cb,
+				     void *u),
+     (fp, x, cb, u))
+LAZY(int, PEM_write_RSAPrivateKey, (FILE *fp, RSA *x, const EVP_CIPHER *enc,
+				    unsigned char *kstr, int klen,
+				    pem_password_cb *cb, void *u),
+     (fp, x, enc, kstr, klen, cb, u))
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Signing and verifying in-memory images, for use as a library.
+ */
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "file_type.h"
+#include "futility.h"
+#include "host_common.h"
+#include "kernel_blob.h"
+#include "libfutility.h"
+#include "traversal.h"
+#include "vb1_helper.h"
+
+/* The same defaults as "futility sign" */
+#define DEFAULT_PADDING 65536
+#define DEFAULT_VERSION 1
+
+/* futility.c sets this from the command line; there's none here */
+enum vboot_version vboot_version;
+
+int futil_sign_kernel(const uint8_t *buf, uint64_t len,
+		      const struct futil_sign_keys *keys,
+		      const struct futil_sign_opts *opts,
+		      struct iovec out[2])
+{
+	struct kernel_blob_ctx_s kb;
+	enum futil_file_type type;
+	VbKeyBlockHeader *keyblock = keys->keyblock;
+	VbKernelPreambleHeader *preamble = NULL;
+	uint8_t *kpart_data, *kblob_data, *vblock_data;
+	uint64_t kblob_size, vblock_size;
+	uint64_t padding = opts->padding ? opts->padding : DEFAULT_PADDING;
+	uint64_t kloadaddr = opts->kloadaddr ? opts->kloadaddr :
+		CROS_32BIT_ENTRY_ADDR;
+	uint32_t version = opts->version_specified ? opts->version :
+		DEFAULT_VERSION;
+	uint32_t flags = opts->flags_specified ? opts->flags : 0;
+
+	if (!keys->signprivate) {
+		fprintf(stderr, "Missing private key\n");
+		return 1;
+	}
+
+	/* None of these write to the buffer, whatever their prototypes say */
+	memset(&kb, 0, sizeof(kb));
+	type = futil_file_type_buf((uint8_t *)buf, len);
+	switch (type) {
+	case FILE_TYPE_KERN_PREAMBLE:
+		/* The config is replaced in place, so work on a copy */
+		kpart_data = malloc(len);
+		if (!kpart_data) {
+			fprintf(stderr, "Couldn't allocate 0x%" PRIx64
+				" bytes\n", len);
+			return 1;
+		}
+		memcpy(kpart_data, buf, len);
+
+		kblob_data = UnpackKPart(&kb, kpart_data, len, padding,
+					 &keyblock, &preamble, &kblob_size);
+		if (!kblob_data) {
+			fprintf(stderr, "Unable to unpack kernel partition\n");
+			free(kpart_data);
+			return 1;
+		}
+
+		/* Keep what "futility sign" would when resigning */
+		kloadaddr = preamble->body_load_address;
+		if (!opts->version_specified)
+			version = preamble->kernel_version;
+		if (VbKernelHasFlags(preamble) == VBOOT_SUCCESS &&
+		    !opts->flags_specified)
+			flags = preamble->flags;
+		if (keys->keyblock)
+			keyblock = keys->keyblock;
+
+		vblock_data = ResignKernelBlob(&kb, kblob_data, kblob_size,
+					       opts->config_data,
+					       opts->config_size,
+					       NULL, padding,
+					       version, kloadaddr,
+					       keyblock, keys->signprivate,
+					       flags, &vblock_size);
+		if (!vblock_data) {
+			fprintf(stderr, "Unable to sign kernel blob\n");
+			free(kpart_data);
+			return 1;
+		}
+
+		/* The blob is all we need of the copy */
+		memmove(kpart_data, kblob_data, kblob_size);
+		kblob_data = kpart_data;
+		break;
+
+	case FILE_TYPE_UNKNOWN:
+		if (!keys->keyblock || !opts->config_data ||
+		    !opts->bootloader_data || opts->arch == ARCH_UNSPECIFIED) {
+			fprintf(stderr, "A new kernel partition needs a"
+				" keyblock, config, bootloader and arch\n");
+			return 1;
+		}
+
+		kblob_data = CreateKernelBlob(&kb, (uint8_t *)buf, len,
+					      opts->arch, kloadaddr,
+					      opts->config_data,
+					      opts->config_size,
+					      opts->bootloader_data,
+					      opts->bootloader_size,
+					      &kblob_size);
+		if (!kblob_data) {
+			fprintf(stderr, "Unable to create kernel blob\n");
+			return 1;
+		}
+
+		vblock_data = SignKernelBlob(&kb, kblob_data, kblob_size,
+					     padding, version, kloadaddr,
+					     keyblock, keys->signprivate,
+					     flags, &vblock_size);
+		if (!vblock_data) {
+			fprintf(stderr, "Unable to sign kernel blob\n");
+			free(kblob_data);
+			return 1;
+		}
+		break;
+
+	default:
+		fprintf(stderr, "Can't sign a %s as a kernel\n",
+			futil_file_type_str(type));
+		return 1;
+	}
+
+	if (opts->vblockonly) {
+		free(kblob_data);
+		kblob_data = NULL;
+		kblob_size = 0;
+	}
+
+	out[0].iov_base = vblock_data;
+	out[0].iov_len = vblock_size;
+	out[1].iov_base = kblob_data;
+	out[1].iov_len = kblob_size;
+	return 0;
+}
+
+int futil_verify(const uint8_t *buf, uint64_t len, VbPublicKey *key,
+		 FILE *report)
+{
+	struct futil_traverse_state_s state;
+	FILE *out = report;
+	int errorcnt;
+
+	if (!out) {
+		out = fopen("/dev/null", "w");
+		if (!out) {
+			fprintf(stderr, "Can't open /dev/null\n");
+			return 1;
+		}
+	}
+
+	futil_show_init(out, out, key, 1);
+
+	memset(&state, 0, sizeof(state));
+	state.in_filename = "<buffer>";
+	state.op = FUTIL_OP_SHOW;
+
+	/* Showing only reads the buffer */
+	errorcnt = futil_traverse((uint8_t *)buf, len, &state,
+				  FILE_TYPE_UNKNOWN);
+
+	/* The caller may reuse the buffer for something else */
+	futil_fmap_index_forget((uint8_t *)buf);
+
+	if (out != report)
+		fclose(out);
+	return errorcnt;
+}
@@ -0,0 +1,521 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Metrics for "futility serve", in the Prometheus text format, either
+ * written to a file (for node_exporter's textfile collector) or sent to
+ * whoever connects to a Unix socket.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "futility.h"
+#include "host_common.h"
+#include "metrics.h"
+
+int futil_metrics_enabled;
+
+/* Upper bounds of the latency buckets, in ms */
+static const double latency_ms[] = {
+	1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000,
+};
+#define NUM_BUCKETS (ARRAY_SIZE(latency_ms) + 1)
+
+static const char * const op_name[NUM_METRIC_OPS] = {
+	"sign",
+	"verify",
+	"other",
+};
+
+/*
+ * What one thread has counted. Only that thread writes to it, so it needs
+ * no lock, and when the thread exits its block goes to the next thread to
+ * start rather than being freed, so nothing counted is ever lost.
+ */
+struct metrics_block_s {
+	struct metrics_block_s *next;		/* every block */
+	struct metrics_block_s *next_free;
+	uint64_t count[NUM_METRICS];
+	uint64_t requests[NUM_METRIC_OPS][2];	/* by success, failure */
+	uint64_t latency[NUM_METRIC_OPS][NUM_BUCKETS];
+	uint64_t latency_ns[NUM_METRIC_OPS];
+	CryptoStats crypto;
+};
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_block_s *all_blocks, *free_blocks;
+static pthread_key_t block_key;
+static __thread struct metrics_block_s *my_block;
+
+static const char *metrics_file;
+static const char *metrics_socket;
+static int listen_sock = -1;
+static pthread_t listen_thread;
+
+static void bump(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t peek(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void block_release(void *arg)
+{
+	struct metrics_block_s *b = arg;
+
+	crypto_thread_stats = NULL;
+	my_block = NULL;
+	pthread_mutex_lock(&blocks_lock);
+	b->next_free = free_blocks;
+	free_blocks = b;
+	pthread_mutex_unlock(&blocks_lock);
+}
+
+static struct metrics_block_s *block_get(void)
+{
+	struct metrics_block_s *b;
+
+	if (my_block)
+		return my_block;
+
+	pthread_mutex_lock(&blocks_lock);
+	b = free_blocks;
+	if (b) {
+		free_blocks = b->next_free;
+	} else {
+		b = calloc(1, sizeof(*b));
+		if (b) {
+			b->next = all_blocks;
+			all_blocks = b;
+		}
+	}
+	pthread_mutex_unlock(&blocks_lock);
+	if (!b)
+		return NULL;
+
+	pthread_setspecific(block_key, b);
+	crypto_thread_stats = &b->crypto;
+	my_block = b;
+	return b;
+}
+
+void futil_metrics_thread_begin(void)
+{
+	block_get();
+}
+
+void futil_metrics_add(enum futil_metric metric, uint64_t n)
+{
+	struct metrics_block_s *b = block_get();
+
+	if (b && (int)metric >= 0 && metric < NUM_METRICS)
+		bump(&b->count[metric], n);
+}
+
+void futil_metrics_request(enum futil_metric_op op, int status, uint64_t ns)
+{
+	struct metrics_block_s *b;
+	int i;
+
+	if (!futil_metrics_enabled || (int)op < 0 || op >= NUM_METRIC_OPS)
+		return;
+	b = block_get();
+	if (!b)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(latency_ms); i++)
+		if (ns <= latency_ms[i] * 1e6)
+			break;
+	bump(&b->requests[op][!!status], 1);
+	bump(&b->latency[op][i], 1);
+	bump(&b->latency_ns[op], ns);
+}
+
+/* All the blocks added up */
+static void metrics_sum(struct metrics_block_s *sum)
+{
+	const struct metrics_block_s *b;
+	int i, j;
+
+	memset(sum, 0, sizeof(*sum));
+	pthread_mutex_lock(&blocks_lock);
+	for (b = all_blocks; b; b = b->next) {
+		for (i = 0; i < NUM_METRICS; i++)
+			sum->count[i] += peek(&b->count[i]);
+		for (i = 0; i < NUM_METRIC_OPS; i++) {
+			sum->requests[i][0] += peek(&b->requests[i][0]);
+			sum->requests[i][1] += peek(&b->requests[i][1]);
+			for (j = 0; j < NUM_BUCKETS; j++)
+				sum->latency[i][j] += peek(&b->latency[i][j]);
+			sum->latency_ns[i] += peek(&b->latency_ns[i]);
+		}
+		sum->crypto.digest_bytes += peek(&b->crypto.digest_bytes);
+		sum->crypto.rsa_verify += peek(&b->crypto.rsa_verify);
+		sum->crypto.rsa_sign += peek(&b->crypto.rsa_sign);
+		sum->crypto.rsa_key_hits += peek(&b->crypto.rsa_key_hits);
+		sum->crypto.rsa_key_misses += peek(&b->crypto.rsa_key_misses);
+	}
+	pthread_mutex_unlock(&blocks_lock);
+}
+
+/* Key names are pathnames, which may hold anything */
+static void print_label(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '\n')
+			fputs("\\n", fp);
+		else if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void print_head(FILE *fp, const char *name, const char *type,
+		       const char *help)
+{
+	fprintf(fp, "# HELP futility_%s %s\n# TYPE futility_%s %s\n",
+		name, help, name, type);
+}
+
+static void print_cache(FILE *fp, const char *cache, uint64_t hits,
+			uint64_t misses)
+{
+	fprintf(fp, "futility_cache_lookups_total{cache=\"%s\",result=\"hit\"}"
+		" %" PRIu64 "\n", cache, hits);
+	fprintf(fp, "futility_cache_lookups_total{cache=\"%s\",result=\"miss\"}"
+		" %" PRIu64 "\n", cache, misses);
+}
+
+/* One series for each key name the signing scheduler knows */
+struct sched_print_s {
+	FILE *fp;
+	const char *name;
+	int field;
+};
+
+enum {
+	SCHED_REQUESTS,
+	SCHED_STARTED,
+	SCHED_SHARED,
+	SCHED_REMEMBERED,
+	SCHED_INFLIGHT,
+	SCHED_WAITING,
+};
+
+static void print_sched_one(void *arg, const char *key,
+			    const VbSignScheduleStats *stats)
+{
+	struct sched_print_s *p = arg;
+	uint64_t val = 0;
+
+	switch (p->field) {
+	case SCHED_REQUESTS:
+		val = stats->requests;
+		break;
+	case SCHED_STARTED:
+		val = stats->started;
+		break;
+	case SCHED_SHARED:
+		val = stats->shared;
+		break;
+	case SCHED_REMEMBERED:
+		val = stats->remembered;
+		break;
+	case SCHED_INFLIGHT:
+		val = stats->inflight;
+		break;
+	case SCHED_WAITING:
+		val = stats->waiting;
+		break;
+	}
+	fprintf(p->fp, "futility_%s{key=", p->name);
+	print_label(p->fp, key);
+	fprintf(p->fp, "} %" PRIu64 "\n", val);
+}
+
+static void print_sched(FILE *fp, int field, const char *name,
+			const char *type, const char *help)
+{
+	struct sched_print_s p = { fp, name, field };
+
+	print_head(fp, name, type, help);
+	PrivateKeyScheduledStats(print_sched_one, &p);
+}
+
+static void metrics_print(FILE *fp)
+{
+	struct metrics_block_s *sum;
+	uint64_t cum;
+	int i, j;
+
+	sum = malloc(sizeof(*sum));
+	if (!sum)
+		return;
+	metrics_sum(sum);
+
+	print_head(fp, "serve_requests_total", "counter",
+		   "Requests run, by command and outcome.");
+	for (i = 0; i < NUM_METRIC_OPS; i++) {
+		fprintf(fp, "futility_serve_requests_total"
+			"{op=\"%s\",status=\"ok\"} %" PRIu64 "\n",
+			op_name[i], sum->requests[i][0]);
+		fprintf(fp, "futility_serve_requests_total"
+			"{op=\"%s\",status=\"error\"} %" PRIu64 "\n",
+			op_name[i], sum->requests[i][1]);
+	}
+
+	print_head(fp, "serve_request_duration_seconds", "histogram",
+		   "How long requests took to run.");
+	for (i = 0; i < NUM_METRIC_OPS; i++) {
+		for (cum = 0, j = 0; j < NUM_BUCKETS; j++) {
+			cum += sum->latency[i][j];
+			fprintf(fp, "futility_serve_request_duration_"
+				"seconds_bucket{op=\"%s\",le=", op_name[i]);
+			if (j < ARRAY_SIZE(latency_ms))
+				fprintf(fp, "\"%g\"", latency_ms[j] / 1000);
+			else
+				fprintf(fp, "\"+Inf\"");
+			fprintf(fp, "} %" PRIu64 "\n", cum);
+		}
+		fprintf(fp, "futility_serve_request_duration_seconds_sum"
+			"{op=\"%s\"} %.9f\n", op_name[i],
+			sum->latency_ns[i] / 1e9);
+		fprintf(fp, "futility_serve_request_duration_seconds_count"
+			"{op=\"%s\"} %" PRIu64 "\n", op_name[i], cum);
+	}
+
+	print_head(fp, "digest_bytes_total", "counter", "Bytes hashed.");
+	fprintf(fp, "futility_digest_bytes_total %" PRIu64 "\n",
+		sum->crypto.digest_bytes);
+	print_head(fp, "rsa_verify_total", "counter", "Signatures checked.");
+	fprintf(fp, "futility_rsa_verify_total %" PRIu64 "\n",
+		sum->crypto.rsa_verify);
+	print_head(fp, "rsa_sign_total", "counter",
+		   "Digests handed to a signer.");
+	fprintf(fp, "futility_rsa_sign_total %" PRIu64 "\n",
+		sum->crypto.rsa_sign);
+
+	print_head(fp, "cache_lookups_total", "counter",
+		   "Cache lookups, by cache and result.");
+	print_cache(fp, "digest", sum->count[METRIC_DIGEST_CACHE_HIT],
+		    sum->count[METRIC_DIGEST_CACHE_MISS]);
+	print_cache(fp, "verify", sum->count[METRIC_VERIFY_CACHE_HIT],
+		    sum->count[METRIC_VERIFY_CACHE_MISS]);
+	print_cache(fp, "keyblock_verify",
+		    sum->count[METRIC_KEYBLOCK_MEMO_HIT],
+		    sum->count[METRIC_KEYBLOCK_MEMO_MISS]);
+	print_cache(fp, "rsa_key", sum->crypto.rsa_key_hits,
+		    sum->crypto.rsa_key_misses);
+
+	print_sched(fp, SCHED_REQUESTS, "sign_key_requests_total", "counter",
+		    "Signatures asked for, by key.");
+	print_sched(fp, SCHED_STARTED, "sign_key_started_total", "counter",
+		    "Signatures the signing backend was asked for, by key.");
+	print_sched(fp, SCHED_SHARED, "sign_key_shared_total", "counter",
+		    "Signatures shared with another request, by key.");
+	print_sched(fp, SCHED_REMEMBERED, "sign_key_remembered_total",
+		    "counter", "Signatures made earlier and reused, by key.");
+	print_sched(fp, SCHED_INFLIGHT, "sign_key_inflight", "gauge",
+		    "Signatures the signing backend is working on, by key.");
+	print_sched(fp, SCHED_WAITING, "sign_key_queue_depth", "gauge",
+		    "Signatures waiting to be sent to the backend, by key.");
+
+	free(sum);
+}
+
+void futil_metrics_update(void)
+{
+	char *buf = NULL, *tmpname;
+	size_t len = 0;
+	FILE *fp;
+	int fd, ok;
+
+	if (!futil_metrics_enabled || !metrics_file)
+		return;
+
+	fp = open_memstream(&buf, &len);
+	if (!fp)
+		return;
+	metrics_print(fp);
+	if (fclose(fp)) {
+		free(buf);
+		return;
+	}
+
+	/* Whoever reads it mustn't ever see half of it */
+	tmpname = malloc(strlen(metrics_file) + 5);
+	if (!tmpname) {
+		free(buf);
+		return;
+	}
+	sprintf(tmpname, "%s.tmp", metrics_file);
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	ok = fd >= 0 && write(fd, buf, len) == len;
+	if (fd >= 0 && close(fd))
+		ok = 0;
+	if (!ok || rename(tmpname, metrics_file)) {
+		fprintf(stderr, "Can't write %s: %s\n",
+			metrics_file, strerror(errno));
+		unlink(tmpname);
+	}
+	free(tmpname);
+	free(buf);
+}
+
+/*
+ * Anyone connecting is sent the metrics, as an HTTP response if they ask
+ * with a GET (as curl --unix-socket does) and as they are otherwise.
+ */
+static void metrics_answer(int client)
+{
+	struct timeval tv = { 1, 0 };
+	char req[4] = "";
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int http;
+
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	http = recv(client, req, sizeof(req), MSG_PEEK) == sizeof(req) &&
+		!memcmp(req, "GET ", sizeof(req));
+
+	fp = open_memstream(&buf, &len);
+	if (!fp)
+		return;
+	metrics_print(fp);
+	if (fclose(fp)) {
+		free(buf);
+		return;
+	}
+	if (http)
+		dprintf(client, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", len);
+	if (write(client, buf, len) != len)
+		Debug("metrics client went away\n");
+	free(buf);
+}
+
+static void *metrics_listen(void *arg)
+{
+	int client;
+
+	futil_metrics_thread_begin();
+	for (;;) {
+		client = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		metrics_answer(client);
+		close(client);
+	}
+	return NULL;
+}
+
+static int metrics_listen_start(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t old_umask;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket name %s is too long\n", path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listen_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_sock < 0) {
+		fprintf(stderr, "Can't create socket: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* The key names are nobody else's business either */
+	old_umask = umask(0077);
+	if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(listen_sock, 16)) {
+		fprintf(stderr, "Can't listen on %s: %s\n",
+			path, strerror(errno));
+		umask(old_umask);
+		goto fail;
+	}
+	umask(old_umask);
+
+	if (pthread_create(&listen_thread, NULL, metrics_listen, NULL)) {
+		fprintf(stderr, "Can't start the metrics thread\n");
+		unlink(path);
+		goto fail;
+	}
+	metrics_socket = path;
+	return 0;
+
+fail:
+	close(listen_sock);
+	listen_sock = -1;
+	return 1;
+}
+
+int futil_metrics_start(const char *file, const char *socket_path)
+{
+	if (futil_metrics_enabled)
+		return 0;
+
+	if (pthread_key_create(&block_key, block_release)) {
+		fprintf(stderr, "Can't start counting\n");
+		return 1;
+	}
+	futil_metrics_enabled = 1;
+	if (!block_get()) {
+		fprintf(stderr, "Out of memory\n");
+		futil_metrics_enabled = 0;
+		return 1;
+	}
+
+	metrics_file = file;
+	if (socket_path && metrics_listen_start(socket_path)) {
+		futil_metrics_enabled = 0;
+		return 1;
+	}
+	futil_metrics_update();
+	return 0;
+}
+
+void futil_metrics_stop(void)
+{
+	if (!futil_metrics_enabled)
+		return;
+
+	futil_metrics_update();
+	if (listen_sock >= 0) {
+		/* That wakes up accept() */
+		shutdown(listen_sock, SHUT_RDWR);
+		pthread_join(listen_thread, NULL);
+		close(listen_sock);
+		listen_sock = -1;
+		unlink(metrics_socket);
+		metrics_socket = NULL;
+	}
+	futil_metrics_enabled = 0;
+}
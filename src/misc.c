@@ -14,7 +14,14 @@
 #include <sys/disk.h>       /* for DIOCGMEDIASIZE */
 #endif
 
-#include <stdarg.h>
+#if defined(__GLIBC__) && \
+	(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,26 +30,19 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "cgptlib_internal.h"
+#include "crc32.h"
 #include "file_type.h"
 #include "futility.h"
 #include "gbb_header.h"
-
-int debugging_enabled;
-void Debug(const char *format, ...)
-{
-	if (!debugging_enabled)
-		return;
-
-	va_list ap;
-	va_start(ap, format);
-	fprintf(stderr, "DEBUG: ");
-	vfprintf(stderr, format, ap);
-	va_end(ap);
-}
+#include "gpt_misc.h"
+#include "metrics.h"
+#include "stats.h"
+#include "vb21_common.h"
+#include "traversal.h"
 
 static int is_null_terminated(const char *s, int len)
 {
@@ -59,7 +59,7 @@ static inline uint32_t max(uint32_t a, uint32_t b)
 	return a > b ? a : b;
 }
 
-enum futil_file_type recognize_gbb(uint8_t *buf, uint32_t len)
+enum futil_file_type recognize_gbb(uint8_t *buf, uint64_t len)
 {
 	GoogleBinaryBlockHeader *gbb = (GoogleBinaryBlockHeader *)buf;
 
@@ -74,6 +74,53 @@ enum futil_file_type recognize_gbb(uint8_t *buf, uint32_t len)
 	return FILE_TYPE_GBB;
 }
 
+enum futil_file_type recognize_vbsd(uint8_t *buf, uint64_t len)
+{
+	VbSharedDataHeader *sh = (VbSharedDataHeader *)buf;
+
+	if (len < VB_SHARED_DATA_HEADER_SIZE_V1)
+		return FILE_TYPE_UNKNOWN;
+	if (sh->magic != VB_SHARED_DATA_MAGIC)
+		return FILE_TYPE_UNKNOWN;
+	if (sh->struct_size < VB_SHARED_DATA_HEADER_SIZE_V1 ||
+	    sh->struct_size > len)
+		return FILE_TYPE_UNKNOWN;
+
+	return FILE_TYPE_VBSD;
+}
+
+enum futil_file_type recognize_vb21(uint8_t *buf, uint64_t len)
+{
+	const struct vb21_keyblock *block = (const struct vb21_keyblock *)buf;
+	uint32_t more;
+
+	if (len < sizeof(struct vb21_struct_common) || len > UINT32_MAX)
+		return FILE_TYPE_UNKNOWN;
+
+	switch (block->c.magic) {
+	case VB21_MAGIC_PACKED_KEY:
+		if (Vb21PackedKeyInside(buf, len, 0, NULL))
+			return FILE_TYPE_VB21_PUBKEY;
+		break;
+	case VB21_MAGIC_SIGNATURE:
+		if (Vb21SignatureInside(buf, len, 0, NULL))
+			return FILE_TYPE_VB21_SIGNATURE;
+		break;
+	case VB21_MAGIC_KEYBLOCK:
+		if (VBOOT_SUCCESS != Vb21VerifyKeyblock(block, len, NULL))
+			break;
+		/* Just the shape, as for a vblock. Show checks the rest. */
+		more = block->c.total_size;
+		if (VBOOT_SUCCESS ==
+		    Vb21VerifyFwPreamble((struct vb21_fw_preamble *)
+					 (buf + more), len - more, NULL))
+			return FILE_TYPE_VB21_FW_PREAMBLE;
+		return FILE_TYPE_VB21_KEYBLOCK;
+	}
+
+	return FILE_TYPE_UNKNOWN;
+}
+
 int futil_valid_gbb_header(GoogleBinaryBlockHeader *gbb, uint32_t len,
 			   uint32_t *maxlen_ptr)
 {
@@ -131,37 +178,34 @@ int futil_valid_gbb_header(GoogleBinaryBlockHeader *gbb, uint32_t len,
 
 /* For GBB v1.2 and later, print the stored digest of the HWID (and whether
  * it's correct). Return true if it is correct. */
-int print_hwid_digest(GoogleBinaryBlockHeader *gbb,
+int print_hwid_digest(FILE *fp, GoogleBinaryBlockHeader *gbb,
 		      const char *banner, const char *footer)
 {
-	printf("%s", banner);
+	fprintf(fp, "%s", banner);
 
 	/* There isn't one for v1.1 and earlier, so assume it's good. */
 	if (gbb->minor_version < 2) {
-		printf("<none>%s", footer);
+		fprintf(fp, "<none>%s", footer);
 		return 1;
 	}
 
 	uint8_t *buf = (uint8_t *)gbb;
 	char *hwid_str = (char *)(buf + gbb->hwid_offset);
-	int is_valid = 0;
-	uint8_t *digest = DigestBuf(buf + gbb->hwid_offset,
-				    strlen(hwid_str),
-				    SHA256_DIGEST_ALGORITHM);
-	if (digest) {
-		int i;
-		is_valid = 1;
-		/* print it, comparing as we go */
-		for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
-			printf("%02x", gbb->hwid_digest[i]);
-			if (gbb->hwid_digest[i] != digest[i])
-				is_valid = 0;
-		}
-		free(digest);
+	int is_valid = 1;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	int i;
+
+	DigestBufInto(buf + gbb->hwid_offset, strlen(hwid_str),
+		      SHA256_DIGEST_ALGORITHM, digest);
+	/* print it, comparing as we go */
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		fprintf(fp, "%02x", gbb->hwid_digest[i]);
+		if (gbb->hwid_digest[i] != digest[i])
+			is_valid = 0;
 	}
 
-	printf("   %s", is_valid ? "valid" : "<invalid>");
-	printf("%s", footer);
+	fprintf(fp, "   %s", is_valid ? "valid" : "<invalid>");
+	fprintf(fp, "%s", footer);
 	return is_valid;
 }
 
@@ -174,11 +218,311 @@ void update_hwid_digest(GoogleBinaryBlockHeader *gbb)
 
 	uint8_t *buf = (uint8_t *)gbb;
 	char *hwid_str = (char *)(buf + gbb->hwid_offset);
-	uint8_t *digest = DigestBuf(buf + gbb->hwid_offset,
-				    strlen(hwid_str),
-				    SHA256_DIGEST_ALGORITHM);
+	uint8_t digest[SHA512_DIGEST_SIZE];
+
+	DigestBufInto(buf + gbb->hwid_offset, strlen(hwid_str),
+		      SHA256_DIGEST_ALGORITHM, digest);
 	memcpy(gbb->hwid_digest, digest, SHA256_DIGEST_SIZE);
-	free(digest);
+}
+
+/*
+ * Files written while a commit group is open, waiting to be synced and
+ * renamed into place. An in-place change has no names, just its fd.
+ */
+struct commit_s {
+	struct commit_s *next;
+	int fd;
+	char *tmpname;
+	char *outfile;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int size;			/* commit every this many, or 0 */
+	int count;
+	struct commit_s *first;
+	int errors;
+} group = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Calls syncfs() once for each filesystem [list] has files on */
+static int commit_sync(struct commit_s *list)
+{
+	struct commit_s *c, *d;
+	struct stat sc, sd;
+	int errors = 0;
+
+	for (c = list; c; c = c->next) {
+		if (fstat(c->fd, &sc))
+			continue;
+		for (d = list; d != c; d = d->next)
+			if (!fstat(d->fd, &sd) && sd.st_dev == sc.st_dev)
+				break;
+		if (d == c && syncfs(c->fd)) {
+			fprintf(stderr, "Can't sync %s: %s\n",
+				c->outfile ? c->outfile : "changes",
+				strerror(errno));
+			errors++;
+		}
+	}
+	return errors;
+}
+
+/* Makes a group of files durable, and only then puts them in place */
+static int commit_flush(struct commit_s *list)
+{
+	struct commit_s *c, *next;
+	int errors;
+
+	if (!list)
+		return 0;
+
+	errors = commit_sync(list);
+	for (c = list; c; c = c->next) {
+		if (!c->tmpname)
+			continue;
+		if (errors || rename(c->tmpname, c->outfile)) {
+			if (!errors)
+				fprintf(stderr, "Can't replace %s: %s\n",
+					c->outfile, strerror(errno));
+			unlink(c->tmpname);
+			errors++;
+		}
+	}
+	/* And once more for the renames themselves */
+	if (!errors)
+		errors = commit_sync(list);
+
+	for (c = list; c; c = next) {
+		next = c->next;
+		close(c->fd);
+		free(c->tmpname);
+		free(c->outfile);
+		free(c);
+	}
+	return errors;
+}
+
+/*
+ * Hands a file over to the open commit group, which then owns [fd] and
+ * [tmpname]. Returns 0 if there isn't one, or it can't take it.
+ */
+static int commit_defer(int fd, char *tmpname, const char *outfile)
+{
+	struct commit_s *c, *list = NULL;
+
+	if (!group.size)
+		return 0;
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return 0;
+	c->fd = fd;
+	if (tmpname) {
+		c->outfile = strdup(outfile);
+		if (!c->outfile) {
+			free(c);
+			return 0;
+		}
+		c->tmpname = tmpname;
+	}
+
+	pthread_mutex_lock(&group.lock);
+	c->next = group.first;
+	group.first = c;
+	if (++group.count >= group.size) {
+		list = group.first;
+		group.first = NULL;
+		group.count = 0;
+	}
+	pthread_mutex_unlock(&group.lock);
+
+	if (commit_flush(list)) {
+		pthread_mutex_lock(&group.lock);
+		group.errors++;
+		pthread_mutex_unlock(&group.lock);
+	}
+	return 1;
+}
+
+void futil_commit_begin(int size)
+{
+	group.size = size;
+	group.errors = 0;
+}
+
+int futil_commit_end(void)
+{
+	int errors;
+
+	errors = commit_flush(group.first);
+	group.first = NULL;
+	group.count = 0;
+	group.size = 0;
+	return errors + group.errors;
+}
+
+int futil_write_dirty(int fd, const uint8_t *buf,
+		      const struct futil_traverse_state_s *state, int sync)
+{
+	const struct cb_range_s *r;
+	uint64_t start = futil_stats_begin();
+	uint64_t done, total = 0;
+	ssize_t n;
+	int i, dfd;
+
+	if (futil_is_flash(fd))
+		return futil_write_flash(fd, buf, state);
+
+	for (i = 0; i < state->num_dirty; i++) {
+		r = &state->dirty[i];
+		Debug("write back 0x%" PRIx64 " bytes at 0x%" PRIx64 "\n",
+		      r->len, r->offset);
+		for (done = 0; done < r->len; done += n) {
+			n = pwrite(fd, buf + r->offset + done, r->len - done,
+				   r->offset + done);
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+			} else if (n <= 0) {
+				fprintf(stderr, "Can't write back changes: %s\n",
+					strerror(errno));
+				return 1;
+			}
+		}
+		total += r->len;
+	}
+
+	/* With a commit group, it's synced along with the rest */
+	if (sync && state->num_dirty && group.size) {
+		dfd = dup(fd);
+		if (dfd >= 0 && commit_defer(dfd, NULL, NULL))
+			sync = 0;
+		else if (dfd >= 0)
+			close(dfd);
+	}
+	if (sync && state->num_dirty && fdatasync(fd)) {
+		fprintf(stderr, "Can't sync changes: %s\n", strerror(errno));
+		return 1;
+	}
+
+	futil_stats_end(STAT_WRITE_BACK, "dirty ranges", start, total);
+	return 0;
+}
+
+int futil_next_data(int fd, uint64_t offset, uint64_t size,
+		    uint64_t *data, uint64_t *hole)
+{
+#ifdef SEEK_DATA
+	off_t d, h;
+
+	d = lseek(fd, offset, SEEK_DATA);
+	if (d < 0 && errno == ENXIO)
+		return 1;
+	if (d >= 0) {
+		h = lseek(fd, d, SEEK_HOLE);
+		if (h > d) {
+			*data = d;
+			*hole = (uint64_t)h < size ? (uint64_t)h : size;
+			return *data >= *hole;
+		}
+	}
+#endif
+	/* We can't tell, so it's all data */
+	*data = offset;
+	*hole = size;
+	return offset >= size;
+}
+
+int futil_write_at(int fd, const void *buf, uint64_t len, uint64_t offset)
+{
+	const uint8_t *p = buf;
+	uint64_t done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += n) {
+		n = pwrite(fd, p + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy ifd to the empty ofd. A regular file is copied a data extent at a
+ * time, so the holes in a sparse one stay holes. Returns 0 on success.
+ */
+static int copy_fd(int ifd, int ofd, const struct stat *sb)
+{
+	uint8_t buf[64 * 1024];
+	uint64_t size = sb->st_size;
+	uint64_t data, hole, n;
+	ssize_t r, w;
+
+#ifdef FICLONE
+	/* Copy-on-write filesystems can share the blocks */
+	if (0 == ioctl(ofd, FICLONE, ifd))
+		return 0;
+#endif
+
+	if (!S_ISREG(sb->st_mode)) {
+		/* No telling how much there is, so read until it ends */
+		while ((r = read(ifd, buf, sizeof(buf))) != 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				return -1;
+			for (data = 0; data < r; data += w) {
+				w = write(ofd, buf + data, r - data);
+				if (w < 0 && errno == EINTR)
+					w = 0;
+				else if (w < 0)
+					return -1;
+			}
+		}
+		return 0;
+	}
+
+	for (hole = 0; !futil_next_data(ifd, hole, size, &data, &hole); ) {
+		/* Let the kernel copy it without bouncing it through us */
+		n = futil_copy_range(ifd, data, ofd, data, hole - data);
+
+		/* Fine, we'll do the rest ourselves. */
+		for (data += n; data < hole; data += r) {
+			r = pread(ifd, buf, hole - data < sizeof(buf) ?
+				  hole - data : sizeof(buf), data);
+			if (r < 0 && errno == EINTR)
+				r = 0;
+			else if (r <= 0)
+				return -1;
+			if (futil_write_at(ofd, buf, r, data))
+				return -1;
+		}
+	}
+
+	/* Any hole at the end is just the length */
+	return ftruncate(ofd, size);
+}
+
+uint64_t futil_copy_range(int ifd, uint64_t ioff, int ofd, uint64_t ooff,
+			  uint64_t len)
+{
+	uint64_t done = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t in = ioff, out = ooff;
+	ssize_t n;
+
+	while (done < len) {
+		n = copy_file_range(ifd, &in, ofd, &out,
+				    len - done > (1 << 30) ?
+				    (1 << 30) : len - done, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+#endif
+	return done;
 }
 
 /*
@@ -187,89 +531,440 @@ void update_hwid_digest(GoogleBinaryBlockHeader *gbb)
  */
 void futil_copy_file_or_die(const char *infile, const char *outfile)
 {
-	pid_t pid;
-	int status;
+	struct stat isb, osb;
+	int ifd, ofd;
 
 	Debug("%s(%s, %s)\n", __func__, infile, outfile);
 
-	pid = fork();
-
-	if (pid < 0) {
-		fprintf(stderr, "Couldn't fork /bin/cp process: %s\n",
-			strerror(errno));
+	ifd = open(infile, O_RDONLY);
+	if (ifd < 0 || fstat(ifd, &isb)) {
+		fprintf(stderr, "Can't open %s for reading: %s\n",
+			infile, strerror(errno));
 		exit(1);
 	}
 
-	/* child */
-	if (!pid) {
-		execl("/bin/cp", "/bin/cp", infile, outfile, NULL);
-		fprintf(stderr, "Child couldn't exec /bin/cp: %s\n",
-			strerror(errno));
+	/* Like cp, don't truncate the input by copying it onto itself */
+	if (0 == stat(outfile, &osb) &&
+	    isb.st_dev == osb.st_dev && isb.st_ino == osb.st_ino) {
+		fprintf(stderr, "%s and %s are the same file\n",
+			infile, outfile);
 		exit(1);
 	}
 
-	/* parent - wait for child to finish */
-	if (wait(&status) == -1) {
-		fprintf(stderr,
-			"Couldn't wait for /bin/cp process to exit: %s\n",
-			strerror(errno));
+	ofd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC,
+		   isb.st_mode & 0777);
+	if (ofd < 0) {
+		fprintf(stderr, "Can't open %s for writing: %s\n",
+			outfile, strerror(errno));
 		exit(1);
 	}
 
-	if (WIFEXITED(status)) {
-		status = WEXITSTATUS(status);
-		/* zero is normal exit */
-		if (!status)
-			return;
-		fprintf(stderr, "/bin/cp exited with status %d\n", status);
+	if (copy_fd(ifd, ofd, &isb)) {
+		fprintf(stderr, "Can't copy %s to %s: %s\n",
+			infile, outfile, strerror(errno));
 		exit(1);
 	}
 
-	if (WIFSIGNALED(status)) {
-		status = WTERMSIG(status);
-		fprintf(stderr, "/bin/cp was killed with signal %d\n", status);
+	if (close(ofd)) {
+		fprintf(stderr, "Error when closing %s: %s\n",
+			outfile, strerror(errno));
 		exit(1);
 	}
+	close(ifd);
+}
 
-	fprintf(stderr, "I have no idea what just happened\n");
-	exit(1);
+/* Write out all of [iov], calling writev() as often as it takes */
+static int write_iov(int fd, struct iovec *iov, int count)
+{
+	ssize_t n;
+
+	while (count) {
+		n = writev(fd, iov, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		while (count && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
 }
 
+/*
+ * New files at least this big are written sparsely. That's as small as a
+ * padded vblock, whose padding is then never written at all.
+ */
+#define SPARSE_MIN_SIZE (64 << 10)
+#define SPARSE_BLOCK 4096
 
-enum futil_file_err futil_map_file(int fd, int writeable,
-				   uint8_t **buf, uint32_t *len)
+static int is_zero(const uint8_t *buf, uint64_t len)
 {
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+/*
+ * Like write_iov(), but for a new, empty file: blocks of zeros aren't written
+ * at all, so they're left as holes.
+ */
+static int write_iov_sparse(int fd, const struct iovec *iov, int count)
+{
+	const uint8_t *p, *run;
+	uint64_t offset = 0, left, n;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		p = run = iov[i].iov_base;
+		left = iov[i].iov_len;
+		while (left) {
+			/* Look at one file system block at a time */
+			n = SPARSE_BLOCK - offset % SPARSE_BLOCK;
+			if (n > left)
+				n = left;
+			if (is_zero(p, n)) {
+				if (p > run &&
+				    futil_write_at(fd, run, p - run,
+						   offset - (p - run)))
+					return -1;
+				run = p + n;
+			}
+			p += n;
+			offset += n;
+			left -= n;
+		}
+		if (p > run &&
+		    futil_write_at(fd, run, p - run, offset - (p - run)))
+			return -1;
+	}
+
+	/* Any hole at the end is just the length */
+	return ftruncate(fd, offset);
+}
+
+enum futil_file_err futil_write_iov(const char *outfile,
+				    struct iovec *iov, int count)
+{
+	static unsigned int seq;
+	enum futil_file_err err = FILE_ERR_NONE;
+	uint64_t start = futil_stats_begin();
+	uint64_t len = 0;
+	char *tmpname = NULL;
 	struct stat sb;
-	void *mmap_ptr;
-	uint32_t reasonable_len;
+	int i, fd = -1, have_old, sparse = 0;
 
-	if (0 != fstat(fd, &sb)) {
-		fprintf(stderr, "Can't stat input file: %s\n",
-			strerror(errno));
-		return FILE_ERR_STAT;
+	for (i = 0; i < count; i++)
+		len += iov[i].iov_len;
+
+	/* With an archive open, it goes in there instead */
+	if (futil_archive_active()) {
+		err = futil_archive_write(outfile, iov, count);
+		futil_stats_end(STAT_WRITE_BACK, "archive", start, len);
+		return err;
+	}
+
+	/*
+	 * A regular file is written under another name and renamed over the
+	 * old one, so nobody ever sees it half written, and it's left alone if
+	 * something goes wrong. Anything else (a device, a symlink), or a
+	 * file we can't do that for, is overwritten in place. "-" is stdout.
+	 */
+	have_old = !lstat(outfile, &sb);
+	if (!strcmp(outfile, "-")) {
+		fd = dup(STDOUT_FILENO);
+	} else if (have_old ? S_ISREG(sb.st_mode) : errno == ENOENT) {
+		tmpname = malloc(strlen(outfile) + 32);
+		if (tmpname) {
+			sprintf(tmpname, "%s.%d-%u", outfile, (int)getpid(),
+				__sync_fetch_and_add(&seq, 1));
+			fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0666);
+			/* A file being replaced keeps its permissions */
+			if (fd >= 0 && have_old)
+				fchmod(fd, sb.st_mode & 07777);
+			/* Disk images are mostly zeros; keep them sparse */
+			sparse = len >= SPARSE_MIN_SIZE;
+#ifdef FALLOC_FL_KEEP_SIZE
+			/* Otherwise get it all in one go, if we can */
+			if (fd >= 0 && !sparse && len)
+				fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len);
+#endif
+		}
+		if (fd < 0) {
+			free(tmpname);
+			tmpname = NULL;
+		}
+	}
+	if (fd < 0 && strcmp(outfile, "-"))
+		fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s for writing: %s\n",
+			outfile, strerror(errno));
+		return FILE_ERR_OPEN;
+	}
+
+	if (sparse ? write_iov_sparse(fd, iov, count) :
+	    write_iov(fd, iov, count)) {
+		fprintf(stderr, "Can't write %s: %s\n",
+			outfile, strerror(errno));
+		err = FILE_ERR_SIZE;
+	}
+
+	/* With a commit group, it's put in place once it's safely written */
+	if (tmpname && err == FILE_ERR_NONE &&
+	    commit_defer(fd, tmpname, outfile)) {
+		futil_stats_end(STAT_WRITE_BACK, "new file", start, len);
+		return err;
+	}
+
+	if (close(fd)) {
+		fprintf(stderr, "Error when closing %s: %s\n",
+			outfile, strerror(errno));
+		if (err == FILE_ERR_NONE)
+			err = FILE_ERR_CLOSE;
+	}
+
+	if (tmpname) {
+		if (err == FILE_ERR_NONE && rename(tmpname, outfile)) {
+			fprintf(stderr, "Can't replace %s: %s\n",
+				outfile, strerror(errno));
+			err = FILE_ERR_OPEN;
+		}
+		if (err != FILE_ERR_NONE)
+			unlink(tmpname);
+		free(tmpname);
 	}
 
-	if (S_ISBLK(sb.st_mode)) {
+	futil_stats_end(STAT_WRITE_BACK, "new file", start, len);
+	return err;
+}
+
+enum futil_file_err futil_write_file(const char *outfile,
+				     const uint8_t *buf, uint64_t len)
+{
+	struct iovec iov = { (void *)buf, len };
+
+	return futil_write_iov(outfile, &iov, 1);
+}
+
+
+int futil_same_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+
+	return !stat(a, &sa) && !stat(b, &sb) &&
+		sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+int futil_split_line(char *line, char **argv, int max)
+{
+	int argc = 0;
+	char *word;
+
+	for (word = strtok(line, " \t\r\n");
+	     word && *word != '#';
+	     word = strtok(NULL, " \t\r\n")) {
+		if (argc == max)
+			return -1;
+		argv[argc++] = word;
+	}
+
+	return argc;
+}
+
+static const struct {
+	const char *name;
+	Guid guid;
+} gpt_types[] = {
+	{"kernel",   GPT_ENT_TYPE_CHROMEOS_KERNEL},
+	{"rootfs",   GPT_ENT_TYPE_CHROMEOS_ROOTFS},
+	{"data",     GPT_ENT_TYPE_LINUX_DATA},
+	{"fs",       GPT_ENT_TYPE_LINUX_FS},
+	{"reserved", GPT_ENT_TYPE_CHROMEOS_RESERVED},
+	{"efi",      GPT_ENT_TYPE_EFI},
+	{"firmware", GPT_ENT_TYPE_CHROMEOS_FIRMWARE},
+};
+
+int futil_gpt_type(const char *name, Guid *guid)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gpt_types); i++)
+		if (!strcmp(name, gpt_types[i].name)) {
+			*guid = gpt_types[i].guid;
+			return 0;
+		}
+	return 1;
+}
+
+const char *futil_gpt_type_name(const Guid *guid)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gpt_types); i++)
+		if (!memcmp(guid, &gpt_types[i].guid, sizeof(*guid)))
+			return gpt_types[i].name;
+	return NULL;
+}
+
+uint64_t futil_align_lba(uint64_t lba, uint64_t align)
+{
+	return (lba + align - 1) / align * align;
+}
+
+void futil_make_uuid(Guid *guid)
+{
+	guid->u.Uuid.time_high_and_version =
+		(guid->u.Uuid.time_high_and_version & 0x0fff) | 0x4000;
+	guid->u.Uuid.clock_seq_high_and_reserved =
+		(guid->u.Uuid.clock_seq_high_and_reserved & 0x3f) | 0x80;
+}
+
+int futil_make_gpt(uint8_t *gpt, uint8_t *tail, uint64_t sectors,
+		   const Guid *disk_uuid)
+{
+	GptHeader *h = (GptHeader *)(gpt + GPT_PMBR_SECTORS *
+				     DISK_SECTOR_SIZE);
+	uint8_t *entries = gpt + (GPT_PMBR_SECTORS + GPT_HEADER_SECTORS) *
+		DISK_SECTOR_SIZE;
+	uint64_t last;
+	GptData g;
+	int i, rv;
+
+	/* The rest of the PMBR is zero, which is fine */
+	memset(gpt, 0, entries - gpt);
+	gpt[446 + 4] = 0xee;
+	gpt[446 + 8] = 1;
+	last = sectors - 1 > UINT32_MAX ? UINT32_MAX : sectors - 1;
+	for (i = 0; i < 4; i++)
+		gpt[446 + 12 + i] = last >> (8 * i);
+	gpt[510] = 0x55;
+	gpt[511] = 0xaa;
+
+	memcpy(h->signature, GPT_HEADER_SIGNATURE, GPT_HEADER_SIGNATURE_SIZE);
+	h->revision = GPT_HEADER_REVISION;
+	h->size = MIN_SIZE_OF_HEADER;
+	h->my_lba = GPT_PMBR_SECTORS;
+	h->alternate_lba = sectors - GPT_HEADER_SECTORS;
+	h->first_usable_lba = GPT_SECTORS;
+	h->last_usable_lba = sectors - GPT_TAIL_SECTORS - 1;
+	h->disk_uuid = *disk_uuid;
+	h->entries_lba = GPT_PMBR_SECTORS + GPT_HEADER_SECTORS;
+	h->number_of_entries = MAX_NUMBER_OF_ENTRIES;
+	h->size_of_entry = sizeof(GptEntry);
+	h->entries_crc32 = Crc32(entries,
+				 MAX_NUMBER_OF_ENTRIES * sizeof(GptEntry));
+	h->header_crc32 = HeaderCrc(h);
+
+	/*
+	 * Let cgptlib check the primary copy and make the secondary one from
+	 * it, as it would when repairing a disk.
+	 */
+	memset(&g, 0, sizeof(g));
+	g.primary_header = (uint8_t *)h;
+	g.primary_entries = entries;
+	g.secondary_entries = tail;
+	g.secondary_header = tail + GPT_ENTRIES_SECTORS * DISK_SECTOR_SIZE;
+	g.sector_bytes = DISK_SECTOR_SIZE;
+	g.streaming_drive_sectors = sectors;
+	g.gpt_drive_sectors = sectors;
+	rv = GptSanityCheck(&g);
+	if (rv == GPT_SUCCESS) {
+		GptRepair(&g);
+		rv = GptSanityCheck(&g);
+	}
+	if (rv == GPT_SUCCESS && g.valid_headers != MASK_BOTH)
+		rv = GPT_ERROR_INVALID_HEADERS;
+	if (rv == GPT_SUCCESS && g.valid_entries != MASK_BOTH)
+		rv = GPT_ERROR_INVALID_ENTRIES;
+	return rv;
+}
+
+/*
+ * Small images are read in when they're mapped, rather than a page fault at
+ * a time. Large ones (whole disks) get huge pages where the kernel can.
+ */
+#define MAP_READ_AHEAD_MAX (16 << 20)
+#define MAP_HUGEPAGE_MIN (256 << 20)
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+void futil_advise(const uint8_t *buf, uint64_t len, int advice)
+{
+	static long page_size;
+	uintptr_t start, end;
+
+	if (!len)
+		return;
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+	start = (uintptr_t)buf & ~(page_size - 1);
+	end = (uintptr_t)buf + len;
+	madvise((void *)start, end - start, advice);
+}
+
+int futil_fstat(int fd, struct stat *sb)
+{
+	if (0 != fstat(fd, sb))
+		return 1;
+
+	if (S_ISBLK(sb->st_mode)) {
 #ifdef BLKGETSIZE64
 		/* Linux, Cygwin */
-		ioctl(fd, BLKGETSIZE64, &sb.st_size);
+		ioctl(fd, BLKGETSIZE64, &sb->st_size);
 #endif
 #ifdef DIOCGMEDIASIZE
 		/* FreeBSD */
-		ioctl(fd, DIOCGMEDIASIZE, &sb.st_size);
+		ioctl(fd, DIOCGMEDIASIZE, &sb->st_size);
 #endif
 	}
+	return 0;
+}
+
+enum futil_file_err futil_map_file(int fd, int writeable,
+				   uint8_t **buf, uint64_t *len)
+{
+	uint64_t start = futil_stats_begin();
+	struct stat sb;
+	void *mmap_ptr;
+	uint64_t reasonable_len;
+	int populate;
 
-	/* If the image is larger than 2^32 bytes, it's wrong. */
-	if (sb.st_size < 0 || sb.st_size > UINT32_MAX) {
+	if (0 != futil_fstat(fd, &sb)) {
+		fprintf(stderr, "Can't stat input file: %s\n",
+			strerror(errno));
+		return FILE_ERR_STAT;
+	}
+
+	if (S_ISCHR(sb.st_mode) && futil_is_flash(fd)) {
+		if (writeable) {
+			fprintf(stderr, "Flash can't be mapped for writing\n");
+			return FILE_ERR_CHR;
+		}
+		return futil_map_flash(fd, buf, len);
+	}
+
+	/* It has to fit in our address space, too. */
+	if (sb.st_size < 0 || (uint64_t)sb.st_size > SIZE_MAX) {
 		fprintf(stderr, "Image size is unreasonable\n");
 		return FILE_ERR_SIZE;
 	}
-	reasonable_len = (uint32_t)sb.st_size;
+	reasonable_len = (uint64_t)sb.st_size;
+	populate = reasonable_len <= MAP_READ_AHEAD_MAX ? MAP_POPULATE : 0;
 
+	/*
+	 * Populating a private writable mapping would copy every page, so
+	 * those only get the readahead started.
+	 */
 	if (writeable)
 		mmap_ptr = mmap(0, sb.st_size,
-				PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+				PROT_READ|PROT_WRITE, MAP_SHARED | populate,
+				fd, 0);
 	else
 		mmap_ptr = mmap(0, sb.st_size,
 				PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
@@ -281,21 +976,39 @@ enum futil_file_err futil_map_file(int fd, int writeable,
 		return FILE_ERR_MMAP;
 	}
 
+	if (!writeable && reasonable_len <= MAP_READ_AHEAD_MAX)
+		futil_advise(mmap_ptr, reasonable_len, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	if (reasonable_len >= MAP_HUGEPAGE_MIN)
+		futil_advise(mmap_ptr, reasonable_len, MADV_HUGEPAGE);
+#endif
+
 	*buf = (uint8_t *)mmap_ptr;
 	*len = reasonable_len;
+	futil_stats_end(STAT_MAP, NULL, start, reasonable_len);
 	return FILE_ERR_NONE;
 }
 
 enum futil_file_err futil_unmap_file(int fd, int writeable,
-				     uint8_t *buf, uint32_t len)
+				     uint8_t *buf, uint64_t len)
 {
 	void *mmap_ptr = buf;
 	enum futil_file_err err = FILE_ERR_NONE;
 
-	if (writeable &&
-	    (0 != msync(mmap_ptr, len, MS_SYNC|MS_INVALIDATE))) {
-		fprintf(stderr, "msync failed: %s\n", strerror(errno));
-		err = FILE_ERR_MSYNC;
+	futil_fmap_index_forget(buf);
+
+	if (!futil_unmap_flash(buf, 0))
+		return FILE_ERR_NONE;
+
+	if (writeable) {
+		uint64_t start = futil_stats_begin();
+
+		if (0 != msync(mmap_ptr, len, MS_SYNC|MS_INVALIDATE)) {
+			fprintf(stderr, "msync failed: %s\n",
+				strerror(errno));
+			err = FILE_ERR_MSYNC;
+		}
+		futil_stats_end(STAT_WRITE_BACK, "msync", start, len);
 	}
 
 	if (0 != munmap(mmap_ptr, len)) {
@@ -308,9 +1021,77 @@ enum futil_file_err futil_unmap_file(int fd, int writeable,
 	return err;
 }
 
+static __thread RSAKeyCache rsa_cache;
+
+RSAKeyCache *futil_rsa_cache(void)
+{
+	return &rsa_cache;
+}
+
+void futil_rsa_cache_free(void)
+{
+	RSAKeyCacheFree(&rsa_cache);
+}
+
+/*
+ * Keyblock verdicts, by a digest of the keyblock and of the key that checked
+ * it. Release images are mostly signed with a few keyblocks, so this saves
+ * redoing the same RSA check for every file.
+ */
+#define KEYBLOCK_MEMO_SIZE 16
+
+struct keyblock_memo_s {
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	int valid;
+	int result;
+};
+
+static __thread struct keyblock_memo_s keyblock_memo[KEYBLOCK_MEMO_SIZE];
+static __thread int keyblock_memo_next;
+
+int futil_keyblock_verify(const VbKeyBlockHeader *block, uint64_t size,
+			  const VbPublicKey *key)
+{
+	struct keyblock_memo_s *m;
+	DigestContext ctx;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	int i;
+
+	/*
+	 * Only remember keyblocks that fit, checked by keys that make sense;
+	 * anything else fails quickly enough anyway.
+	 */
+	if (size < sizeof(*block) || block->key_block_size > size ||
+	    !RSAKeyCacheGet(futil_rsa_cache(), key))
+		return KeyBlockVerifyCached(block, size, key, 0,
+					    futil_rsa_cache());
+
+	DigestInit(&ctx, SHA256_DIGEST_ALGORITHM);
+	DigestUpdate(&ctx, (const uint8_t *)block, block->key_block_size);
+	DigestUpdate(&ctx, (const uint8_t *)&key->algorithm,
+		     sizeof(key->algorithm));
+	DigestUpdate(&ctx, GetPublicKeyDataC(key), key->key_size);
+	DigestFinalInto(&ctx, digest);
+
+	for (i = 0; i < KEYBLOCK_MEMO_SIZE; i++) {
+		m = &keyblock_memo[i];
+		if (m->valid && !memcmp(m->digest, digest, sizeof(digest))) {
+			futil_metrics_count(METRIC_KEYBLOCK_MEMO_HIT);
+			return m->result;
+		}
+	}
+	futil_metrics_count(METRIC_KEYBLOCK_MEMO_MISS);
+
+	m = &keyblock_memo[keyblock_memo_next];
+	keyblock_memo_next = (keyblock_memo_next + 1) % KEYBLOCK_MEMO_SIZE;
+	memcpy(m->digest, digest, sizeof(digest));
+	m->result = KeyBlockVerifyCached(block, size, key, 0,
+					 futil_rsa_cache());
+	m->valid = 1;
+	return m->result;
+}
 
-#define DISK_SECTOR_SIZE 512
-enum futil_file_type recognize_gpt(uint8_t *buf, uint32_t len)
+enum futil_file_type recognize_gpt(uint8_t *buf, uint64_t len)
 {
 	GptHeader *h;
 
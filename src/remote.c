@@ -0,0 +1,355 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Reading objects that live somewhere else (artifact storage, say) only as
+ * far as they're looked at.
+ *
+ * The object is given an address range that's reserved but inaccessible.
+ * The first touch of each block faults, and the fault handler fetches the
+ * block (and, if the reads are sequential, the next few with it) by running
+ * the fetch program, then puts it in place. Everything that gets a buffer,
+ * the traversal included, works as it would on a mapped file.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "file_type.h"
+#include "futility.h"
+#include "traversal.h"
+
+/* The smallest fetch, and the most a run of sequential reads grows to */
+#define REMOTE_BLOCK (64 << 10)
+#define REMOTE_WINDOW_MAX (4 << 20)
+#define MAX_REMOTE 16
+
+struct remote_s {
+	const char *prog;
+	const char *object;
+	uint8_t *buf;
+	uint64_t len;
+	uint64_t reserved;		/* len, in whole blocks */
+	uint8_t *loaded;		/* one per block */
+	uint64_t next_block;		/* where the last fetch ended */
+	uint64_t window;		/* in blocks */
+	uint64_t fetches, fetched;
+	int failed;
+};
+
+static struct remote_s *remotes[MAX_REMOTE];
+static volatile int remote_lock;
+static struct sigaction old_segv;
+static int handler_installed;
+
+static void lock_remotes(void)
+{
+	while (__sync_lock_test_and_set(&remote_lock, 1))
+		;
+}
+
+static void unlock_remotes(void)
+{
+	__sync_lock_release(&remote_lock);
+}
+
+/* Only async-signal-safe calls from here until futil_map_remote() */
+static void say(const char *str)
+{
+	if (write(STDERR_FILENO, str, strlen(str)) < 0)
+		return;
+}
+
+static char *u64_str(char *end, uint64_t val)
+{
+	*--end = '\0';
+	do {
+		*--end = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	return end;
+}
+
+/*
+ * Runs [prog] with [argv] and reads up to [len] bytes of its output into
+ * [buf]. Returns how many it read, or -1 if it failed.
+ */
+static int64_t run_fetch(const char *prog, char *const argv[],
+			 uint8_t *buf, uint64_t len)
+{
+	uint64_t got = 0;
+	ssize_t n;
+	int status;
+	pid_t pid;
+	int p[2];
+
+	if (pipe(p))
+		return -1;
+	pid = fork();
+	if (pid < 0) {
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+	if (!pid) {
+		if (dup2(p[1], STDOUT_FILENO) != STDOUT_FILENO)
+			_exit(127);
+		close(p[0]);
+		close(p[1]);
+		execvp(prog, argv);
+		_exit(127);
+	}
+
+	close(p[1]);
+	while (got < len) {
+		n = read(p[0], buf + got, len - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	close(p[0]);
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+	return got;
+}
+
+/* Fetches [count] blocks of [r] from [first] and puts them in place */
+static void fetch_blocks(struct remote_s *r, uint64_t first, uint64_t count)
+{
+	uint64_t offset = first * REMOTE_BLOCK;
+	uint64_t len = count * REMOTE_BLOCK;
+	char offset_str[24], len_str[24];
+	char *argv[5];
+	int64_t got;
+	void *tmp;
+
+	if (offset + len > r->len)
+		len = r->len - offset;
+
+	/*
+	 * It's read somewhere else and moved in whole, so other threads
+	 * never see a block half fetched.
+	 */
+	tmp = mmap(0, count * REMOTE_BLOCK, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (tmp == MAP_FAILED) {
+		say("Can't map memory to fetch into\n");
+		_exit(1);
+	}
+
+	argv[0] = (char *)r->prog;
+	argv[1] = (char *)r->object;
+	argv[2] = u64_str(offset_str + sizeof(offset_str), offset);
+	argv[3] = u64_str(len_str + sizeof(len_str), len);
+	argv[4] = NULL;
+	got = run_fetch(r->prog, argv, tmp, len);
+	if (got != len) {
+		/* It reads as zeroes, and the unmap reports it */
+		say("Can't fetch part of ");
+		say(r->object);
+		say("\n");
+		r->failed = 1;
+	}
+
+	if (mremap(tmp, count * REMOTE_BLOCK, count * REMOTE_BLOCK,
+		   MREMAP_MAYMOVE | MREMAP_FIXED, r->buf + offset)
+	    == MAP_FAILED) {
+		say("Can't move fetched data into place\n");
+		_exit(1);
+	}
+
+	memset(r->loaded + first, 1, count);
+	r->fetches++;
+	r->fetched += len;
+}
+
+static void remote_fault(int sig, siginfo_t *info, void *ctx)
+{
+	uint8_t *addr = info->si_addr;
+	struct remote_s *r = NULL;
+	uint64_t block, nblocks, count;
+	int i;
+
+	lock_remotes();
+	for (i = 0; i < MAX_REMOTE; i++)
+		if (remotes[i] && addr >= remotes[i]->buf &&
+		    addr < remotes[i]->buf + remotes[i]->len) {
+			r = remotes[i];
+			break;
+		}
+
+	if (!r) {
+		/* Not ours, so let it crash the way it would have */
+		unlock_remotes();
+		sigaction(SIGSEGV, &old_segv, NULL);
+		return;
+	}
+
+	block = (addr - r->buf) / REMOTE_BLOCK;
+	if (r->loaded[block]) {
+		/* Another thread got it first */
+		unlock_remotes();
+		return;
+	}
+
+	/* Reading on from where we left off? Then fetch more at once. */
+	if (block == r->next_block) {
+		r->window *= 2;
+		if (r->window > REMOTE_WINDOW_MAX / REMOTE_BLOCK)
+			r->window = REMOTE_WINDOW_MAX / REMOTE_BLOCK;
+	} else {
+		r->window = 1;
+	}
+
+	nblocks = r->reserved / REMOTE_BLOCK;
+	for (count = 1; count < r->window && block + count < nblocks &&
+		     !r->loaded[block + count]; count++)
+		;
+	fetch_blocks(r, block, count);
+	r->next_block = block + count;
+	unlock_remotes();
+}
+
+/* Back to the usual rules */
+
+/* Runs [prog] [object], which prints the object's size */
+static int remote_size(const char *prog, const char *object, uint64_t *len)
+{
+	char *argv[] = {(char *)prog, (char *)object, NULL};
+	char str[32];
+	int64_t got;
+	char *e;
+
+	got = run_fetch(prog, argv, (uint8_t *)str, sizeof(str) - 1);
+	if (got <= 0) {
+		fprintf(stderr, "%s couldn't find the size of %s\n",
+			prog, object);
+		return 1;
+	}
+	str[got] = '\0';
+	*len = strtoull(str, &e, 0);
+	if (e == str || (*e && *e != '\n')) {
+		fprintf(stderr, "%s said %s's size is \"%s\"\n",
+			prog, object, str);
+		return 1;
+	}
+	return 0;
+}
+
+enum futil_file_err futil_map_remote(const char *prog, const char *object,
+				     uint8_t **buf, uint64_t *len)
+{
+	struct sigaction sa;
+	struct remote_s *r;
+	int i;
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		fprintf(stderr, "Out of memory\n");
+		return FILE_ERR_MMAP;
+	}
+	r->prog = prog;
+	r->object = object;
+	r->next_block = ~0ULL;
+
+	if (remote_size(prog, object, &r->len)) {
+		free(r);
+		return FILE_ERR_STAT;
+	}
+	if (!r->len || r->len > SIZE_MAX) {
+		fprintf(stderr, "%s's size is unreasonable\n", object);
+		free(r);
+		return FILE_ERR_SIZE;
+	}
+
+	r->reserved = (r->len + REMOTE_BLOCK - 1) / REMOTE_BLOCK;
+	r->loaded = calloc(r->reserved, 1);
+	r->reserved *= REMOTE_BLOCK;
+	r->buf = mmap(0, r->reserved, PROT_NONE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (!r->loaded || r->buf == MAP_FAILED) {
+		fprintf(stderr, "Can't reserve 0x%" PRIx64 " bytes for %s\n",
+			r->len, object);
+		if (r->buf != MAP_FAILED)
+			munmap(r->buf, r->reserved);
+		free(r->loaded);
+		free(r);
+		return FILE_ERR_MMAP;
+	}
+
+	lock_remotes();
+	if (!handler_installed) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = remote_fault;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGSEGV, &sa, &old_segv);
+		handler_installed = 1;
+	}
+	for (i = 0; i < MAX_REMOTE; i++)
+		if (!remotes[i]) {
+			remotes[i] = r;
+			break;
+		}
+	unlock_remotes();
+
+	if (i == MAX_REMOTE) {
+		fprintf(stderr, "Too many remote objects at once\n");
+		munmap(r->buf, r->reserved);
+		free(r->loaded);
+		free(r);
+		return FILE_ERR_MMAP;
+	}
+
+	*buf = r->buf;
+	*len = r->len;
+	return FILE_ERR_NONE;
+}
+
+enum futil_file_err futil_unmap_remote(uint8_t *buf, uint64_t len)
+{
+	enum futil_file_err err = FILE_ERR_NONE;
+	struct remote_s *r = NULL;
+	int i;
+
+	futil_fmap_index_forget(buf);
+
+	lock_remotes();
+	for (i = 0; i < MAX_REMOTE; i++)
+		if (remotes[i] && remotes[i]->buf == buf) {
+			r = remotes[i];
+			remotes[i] = NULL;
+			break;
+		}
+	unlock_remotes();
+	if (!r)
+		return FILE_ERR_MUNMAP;
+
+	Debug("%s: fetched 0x%" PRIx64 " of 0x%" PRIx64 " bytes in %" PRIu64
+	      " requests\n", r->object, r->fetched, r->len, r->fetches);
+	if (r->failed)
+		err = FILE_ERR_OPEN;
+	if (munmap(r->buf, r->reserved)) {
+		fprintf(stderr, "Can't munmap pointer: %s\n", strerror(errno));
+		err = FILE_ERR_MUNMAP;
+	}
+	free(r->loaded);
+	free(r);
+	return err;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * The client side of "futility serve"; see serve.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "futility.h"
+#include "serve.h"
+
+int serve_read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int serve_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		/* A server that's gone is an error, not a SIGPIPE */
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int serve_is_fd_arg(const char *arg)
+{
+	return !strncmp(arg, FD_PREFIX, strlen(FD_PREFIX)) &&
+		arg[strlen(FD_PREFIX)];
+}
+
+int futil_serve_request(const char *path, int argc, char *argv[],
+			int *status)
+{
+	struct sockaddr_un addr;
+	struct serve_request_s req;
+	struct serve_reply_s reply;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int fds[SERVE_MAX_FDS];
+	int nfds = SERVE_FD_ARGS;
+	char *payload, *s;
+	size_t size = 0;
+	int sock, i;
+
+	*status = 1;
+	if (argc > SERVE_MAX_ARGS) {
+		fprintf(stderr, "Too many arguments\n");
+		return SERVE_BAD_REQUEST;
+	}
+
+	for (i = 0; i < argc; i++) {
+		size += strlen(argv[i]) + 1;
+		if (serve_is_fd_arg(argv[i])) {
+			if (nfds == SERVE_MAX_FDS) {
+				fprintf(stderr, "Too many " FD_PREFIX "N args\n");
+				return SERVE_BAD_REQUEST;
+			}
+			fds[nfds++] = atoi(argv[i] + strlen(FD_PREFIX));
+		}
+	}
+	if (size > SERVE_MAX_SIZE) {
+		fprintf(stderr, "Arguments are too long\n");
+		return SERVE_BAD_REQUEST;
+	}
+
+	payload = malloc(size);
+	if (!payload) {
+		fprintf(stderr, "Out of memory\n");
+		return SERVE_BAD_REQUEST;
+	}
+	for (s = payload, i = 0; i < argc; i++)
+		s = stpcpy(s, argv[i]) + 1;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket name %s is too long\n", path);
+		free(payload);
+		return SERVE_NOT_SENT;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "Can't connect to %s: %s\n",
+			path, strerror(errno));
+		free(payload);
+		return SERVE_NOT_SENT;
+	}
+
+	fds[SERVE_FD_CWD] = open(".", O_RDONLY | O_DIRECTORY);
+	fds[SERVE_FD_STDOUT] = STDOUT_FILENO;
+	fds[SERVE_FD_STDERR] = STDERR_FILENO;
+	if (fds[SERVE_FD_CWD] < 0) {
+		fprintf(stderr, "Can't open the current directory: %s\n",
+			strerror(errno));
+		free(payload);
+		close(sock);
+		return SERVE_BAD_REQUEST;
+	}
+
+	req.magic = SERVE_MAGIC;
+	req.argc = argc;
+	req.size = size;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	fflush(stdout);
+	fflush(stderr);
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(req) ||
+	    serve_write_all(sock, payload, size)) {
+		/* It won't run a request it didn't get all of */
+		fprintf(stderr, "Can't send to %s\n", path);
+		i = SERVE_NOT_SENT;
+	} else if (serve_read_all(sock, &reply, sizeof(reply)) ||
+		   reply.magic != SERVE_MAGIC) {
+		fprintf(stderr, "No reply from %s\n", path);
+		i = SERVE_NO_REPLY;
+	} else {
+		*status = reply.status;
+		i = 0;
+	}
+
+	close(fds[SERVE_FD_CWD]);
+	close(sock);
+	free(payload);
+	return i;
+}
@@ -0,0 +1,415 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cryptolib.h"
+#include "futility.h"
+#include "stats.h"
+#include "vboot_api_stub_malloc.h"
+
+int futil_stats_enabled;
+static int reporting;
+
+static const char * const stat_name[STAT_CALLBACK] = {
+	"command",
+	"map",
+	"recognize",
+	"traverse",
+	"write back",
+};
+
+static struct {
+	uint64_t count;
+	uint64_t ns;
+	uint64_t bytes;
+} totals[NUM_STATS];
+
+static CryptoStats crypto_totals;
+
+/* Events are only kept when there's a trace to write them to */
+struct stats_event_s {
+	uint64_t start;
+	uint64_t dur;
+	uint64_t bytes;
+	const char *detail;
+	int stat;
+	int tid;
+};
+
+static FILE *trace_fp;
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_event_s *events;
+static size_t num_events, max_events;
+static uint64_t start_ns;
+
+static const char *futil_stat_name(int stat)
+{
+	if (stat < STAT_CALLBACK)
+		return stat_name[stat];
+	return futil_cb_component_str[stat - STAT_CALLBACK];
+}
+
+uint64_t futil_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void futil_stats_add(enum futil_stat stat, const char *detail,
+		     uint64_t start, uint64_t bytes)
+{
+	uint64_t dur = futil_stats_now() - start;
+	struct stats_event_s *e;
+
+	if ((int)stat < 0 || stat >= NUM_STATS)
+		return;
+
+	__sync_fetch_and_add(&totals[stat].count, 1);
+	__sync_fetch_and_add(&totals[stat].ns, dur);
+	__sync_fetch_and_add(&totals[stat].bytes, bytes);
+
+	if (!trace_fp)
+		return;
+
+	pthread_mutex_lock(&event_lock);
+	if (num_events == max_events) {
+		size_t n = max_events ? 2 * max_events : 256;
+
+		e = realloc(events, n * sizeof(*e));
+		if (!e) {
+			pthread_mutex_unlock(&event_lock);
+			return;
+		}
+		events = e;
+		max_events = n;
+	}
+	e = &events[num_events++];
+	e->start = start - start_ns;
+	e->dur = dur;
+	e->bytes = bytes;
+	e->detail = detail;
+	e->stat = stat;
+	e->tid = futil_thread_id();
+	pthread_mutex_unlock(&event_lock);
+}
+
+static void print_summary(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "%-20s %8s %12s %14s\n",
+		"futility stats", "count", "total ms", "bytes");
+	for (i = 0; i < NUM_STATS; i++) {
+		if (!totals[i].count)
+			continue;
+		fprintf(fp, "%-20s %8" PRIu64 " %12.3f %14" PRIu64 "\n",
+			futil_stat_name(i), totals[i].count,
+			totals[i].ns / 1e6, totals[i].bytes);
+	}
+	fprintf(fp, "%-20s %8s %12s %14" PRIu64 "\n",
+		"digest", "", "", crypto_totals.digest_bytes);
+	fprintf(fp, "%-20s %8" PRIu64 "\n", "rsa verify",
+		crypto_totals.rsa_verify);
+	fprintf(fp, "%-20s %8" PRIu64 "\n", "rsa sign",
+		crypto_totals.rsa_sign);
+}
+
+/* The names we record are ours, but be careful anyway */
+static void print_json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void print_trace(FILE *fp)
+{
+	uint64_t end = futil_stats_now() - start_ns;
+	pid_t pid = getpid();
+	size_t i;
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+	for (i = 0; i < num_events; i++) {
+		const struct stats_event_s *e = &events[i];
+
+		fprintf(fp, "{\"name\":");
+		print_json_string(fp, futil_stat_name(e->stat));
+		fprintf(fp, ",\"cat\":\"futility\",\"ph\":\"X\","
+			"\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"bytes\":%" PRIu64,
+			e->start / 1e3, e->dur / 1e3, pid, e->tid, e->bytes);
+		if (e->detail) {
+			fprintf(fp, ",\"detail\":");
+			print_json_string(fp, e->detail);
+		}
+		fprintf(fp, "}},\n");
+	}
+	fprintf(fp, "{\"name\":\"cryptolib\",\"cat\":\"futility\","
+		"\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"tid\":1,"
+		"\"args\":{\"digest_bytes\":%" PRIu64
+		",\"rsa_verify\":%" PRIu64 ",\"rsa_sign\":%" PRIu64 "}}\n",
+		end / 1e3, pid, crypto_totals.digest_bytes,
+		crypto_totals.rsa_verify, crypto_totals.rsa_sign);
+	fprintf(fp, "]}\n");
+}
+
+static void futil_stats_report(void)
+{
+	/* Anything still running past this point isn't ours to count */
+	crypto_stats = NULL;
+	futil_stats_enabled = 0;
+
+	if (!trace_fp) {
+		print_summary(stderr);
+		return;
+	}
+
+	pthread_mutex_lock(&event_lock);
+	print_trace(trace_fp);
+	pthread_mutex_unlock(&event_lock);
+	if (fclose(trace_fp))
+		fprintf(stderr, "Can't write trace: %s\n", strerror(errno));
+	trace_fp = NULL;
+}
+
+/* Collecting without reporting, for futil_budget_load() */
+static void stats_collect(void)
+{
+	if (futil_stats_enabled)
+		return;
+	start_ns = futil_stats_now();
+	crypto_stats = &crypto_totals;
+	futil_stats_enabled = 1;
+}
+
+int futil_stats_start(const char *trace_file)
+{
+	if (reporting)
+		return 0;
+
+	if (trace_file) {
+		trace_fp = fopen(trace_file, "w");
+		if (!trace_fp) {
+			fprintf(stderr, "Can't open %s for writing: %s\n",
+				trace_file, strerror(errno));
+			return 1;
+		}
+	}
+
+	if (atexit(futil_stats_report)) {
+		fprintf(stderr, "Can't report stats at exit\n");
+		if (trace_fp)
+			fclose(trace_fp);
+		trace_fp = NULL;
+		return 1;
+	}
+
+	reporting = 1;
+	stats_collect();
+	return 0;
+}
+
+/****************************************************************************/
+/* Budgets */
+
+enum budget_counter {
+	BUDGET_ALLOCS,
+	BUDGET_MAPS,
+	BUDGET_READS,
+	BUDGET_WRITES,
+	BUDGET_READ_BYTES,
+	BUDGET_WRITE_BYTES,
+	BUDGET_DIGEST_BYTES,
+	BUDGET_RSA_VERIFY,
+	BUDGET_RSA_SIGN,
+
+	NUM_BUDGET_COUNTERS
+};
+
+static const char * const budget_name[NUM_BUDGET_COUNTERS] = {
+	"allocs",
+	"maps",
+	"reads",
+	"writes",
+	"read_bytes",
+	"write_bytes",
+	"digest_bytes",
+	"rsa_verify",
+	"rsa_sign",
+};
+
+struct budget_s {
+	char *cmd;			/* or "*" for all of them */
+	enum budget_counter counter;
+	uint64_t max;
+};
+
+static struct budget_s *budgets;
+static int num_budgets;
+static uint64_t budget_base[NUM_BUDGET_COUNTERS];
+
+/*
+ * The read and write syscalls and bytes from /proc/self/io, where there is
+ * one. Reading it is a syscall too, which the next reading counts, so that
+ * is taken off. Returns nonzero if it can't be read.
+ */
+static int io_counts(uint64_t *c)
+{
+	static const char * const key[] = {
+		"syscr:", "syscw:", "rchar:", "wchar:",
+	};
+	char buf[512], *p;
+	ssize_t n;
+	int fd, i;
+
+	fd = open("/proc/self/io", O_RDONLY);
+	if (fd < 0)
+		return 1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 1;
+	buf[n] = '\0';
+
+	for (i = 0; i < ARRAY_SIZE(key); i++) {
+		p = strstr(buf, key[i]);
+		if (!p)
+			return 1;
+		c[BUDGET_READS + i] = strtoull(p + strlen(key[i]), NULL, 10);
+	}
+	c[BUDGET_READS] -= 1;
+	c[BUDGET_READ_BYTES] -= n;
+	return 0;
+}
+
+static void budget_counts(uint64_t *c)
+{
+	memset(c, 0, NUM_BUDGET_COUNTERS * sizeof(*c));
+	c[BUDGET_ALLOCS] = vboot_api_stub_alloc_count();
+	c[BUDGET_MAPS] = __sync_fetch_and_add(&totals[STAT_MAP].count, 0);
+	io_counts(c);
+	c[BUDGET_DIGEST_BYTES] = crypto_totals.digest_bytes;
+	c[BUDGET_RSA_VERIFY] = crypto_totals.rsa_verify;
+	c[BUDGET_RSA_SIGN] = crypto_totals.rsa_sign;
+}
+
+int futil_budget_load(const char *filename)
+{
+	struct budget_s *b;
+	char *line = NULL, cmd[64], name[32];
+	size_t linesize = 0;
+	unsigned long long max;
+	uint64_t c[NUM_BUDGET_COUNTERS];
+	int lineno = 0, errorcnt = 0, i;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			filename, strerror(errno));
+		return 1;
+	}
+
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		if (sscanf(line, " %1s", cmd) != 1 || cmd[0] == '#')
+			continue;
+		if (sscanf(line, "%63s %31s %llu", cmd, name, &max) != 3) {
+			fprintf(stderr, "%s:%d: not \"COMMAND COUNTER MAX\"\n",
+				filename, lineno);
+			errorcnt++;
+			continue;
+		}
+		for (i = 0; i < NUM_BUDGET_COUNTERS; i++)
+			if (!strcmp(name, budget_name[i]))
+				break;
+		if (i == NUM_BUDGET_COUNTERS) {
+			fprintf(stderr, "%s:%d: unknown counter \"%s\"\n",
+				filename, lineno, name);
+			errorcnt++;
+			continue;
+		}
+		b = realloc(budgets, (num_budgets + 1) * sizeof(*b));
+		if (!b || !(b[num_budgets].cmd = strdup(cmd))) {
+			fprintf(stderr, "Out of memory\n");
+			budgets = b ? b : budgets;
+			errorcnt++;
+			break;
+		}
+		budgets = b;
+		b[num_budgets].counter = i;
+		b[num_budgets].max = max;
+		num_budgets++;
+	}
+	free(line);
+	fclose(fp);
+
+	for (i = 0; i < num_budgets; i++)
+		if (budgets[i].counter >= BUDGET_READS &&
+		    budgets[i].counter <= BUDGET_WRITE_BYTES &&
+		    io_counts(c)) {
+			fprintf(stderr, "Can't count syscalls here,"
+				" so those budgets won't be checked\n");
+			break;
+		}
+
+	stats_collect();
+	futil_budget_begin();
+	return errorcnt;
+}
+
+void futil_budget_begin(void)
+{
+	if (num_budgets)
+		budget_counts(budget_base);
+}
+
+int futil_budget_check(const char *cmd)
+{
+	uint64_t c[NUM_BUDGET_COUNTERS];
+	const struct budget_s *b;
+	int i, over = 0;
+
+	if (!num_budgets)
+		return 0;
+
+	/* What the command printed counts too */
+	fflush(stdout);
+	budget_counts(c);
+	for (i = 0; i < NUM_BUDGET_COUNTERS; i++)
+		c[i] -= budget_base[i];
+	for (i = 0; i < num_budgets; i++) {
+		b = &budgets[i];
+		if (strcmp(b->cmd, "*") && strcmp(b->cmd, cmd))
+			continue;
+		if (c[b->counter] <= b->max)
+			continue;
+		fprintf(stderr, "%s used %" PRIu64 " %s, over its budget of %"
+			PRIu64 "\n", cmd, c[b->counter],
+			budget_name[b->counter], b->max);
+		over = 1;
+	}
+	return over;
+}
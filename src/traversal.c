@@ -4,13 +4,25 @@
  * found in the LICENSE file.
  */
 
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "cgptlib_internal.h"
 #include "file_type.h"
 #include "fmap.h"
 #include "futility.h"
+#include "host_common.h"
+#include "metrics.h"
+#include "stats.h"
 #include "traversal.h"
+#include "vboot_probe.h"
 
 /* What functions do we invoke for a particular operation and component? */
 
@@ -23,6 +35,7 @@ static int (* const cb_show_funcs[])(struct futil_traverse_state_s *state) = {
 	futil_cb_show_fw_preamble,	/* CB_FMAP_VBLOCK_B */
 	futil_cb_show_fw_main,		/* CB_FMAP_FW_MAIN_A */
 	futil_cb_show_fw_main,		/* CB_FMAP_FW_MAIN_B */
+	futil_cb_show_kernel_preamble,	/* CB_GPT_KERNEL */
 	futil_cb_show_pubkey,		/* CB_PUBKEY */
 	futil_cb_show_keyblock,		/* CB_KEYBLOCK */
 	futil_cb_show_gbb,		/* CB_GBB */
@@ -31,10 +44,21 @@ static int (* const cb_show_funcs[])(struct futil_traverse_state_s *state) = {
 	NULL,				/* CB_RAW_FIRMWARE */
 	NULL,				/* CB_RAW_KERNEL */
 	futil_cb_show_privkey,		/* CB_PRIVKEY */
+	futil_cb_show_vbsd,		/* CB_VBSD */
+	futil_cb_show_vb21_pubkey,	/* CB_VB21_PUBKEY */
+	futil_cb_show_vb21_keyblock,	/* CB_VB21_KEYBLOCK */
+	futil_cb_show_vb21_fw_preamble,	/* CB_VB21_FW_PREAMBLE */
+	futil_cb_show_vb21_signature,	/* CB_VB21_SIGNATURE */
+	futil_cb_show_cbfs_file,	/* CB_CBFS_FILE */
 };
 BUILD_ASSERT(ARRAY_SIZE(cb_show_funcs) == NUM_CB_COMPONENTS);
 
 /* FUTIL_OP_SIGN */
+#ifdef FUTIL_VERIFY_ONLY
+/* futility-verify can't sign, and doesn't link the code that does */
+static int (* const cb_sign_funcs[NUM_CB_COMPONENTS])(
+	struct futil_traverse_state_s *state) = {NULL};
+#else
 static int (* const cb_sign_funcs[])(struct futil_traverse_state_s *state) = {
 	futil_cb_sign_begin,		/* CB_BEGIN_TRAVERSAL */
 	futil_cb_sign_end,		/* CB_END_TRAVERSAL */
@@ -43,6 +67,7 @@ static int (* const cb_sign_funcs[])(struct futil_traverse_state_s *state) = {
 	futil_cb_sign_fw_vblock,	/* CB_FMAP_VBLOCK_B */
 	futil_cb_sign_fw_main,		/* CB_FMAP_FW_MAIN_A */
 	futil_cb_sign_fw_main,		/* CB_FMAP_FW_MAIN_B */
+	futil_cb_sign_gpt_kernel,	/* CB_GPT_KERNEL */
 	futil_cb_sign_pubkey,		/* CB_PUBKEY */
 	NULL,				/* CB_KEYBLOCK */
 	NULL,				/* CB_GBB */
@@ -51,15 +76,178 @@ static int (* const cb_sign_funcs[])(struct futil_traverse_state_s *state) = {
 	futil_cb_sign_raw_firmware,	/* CB_RAW_FIRMWARE */
 	futil_cb_create_kernel_part,	/* CB_RAW_KERNEL */
 	NULL,				/* CB_PRIVKEY */
+	NULL,				/* CB_VBSD */
+	futil_cb_sign_pubkey,		/* CB_VB21_PUBKEY */
+	NULL,				/* CB_VB21_KEYBLOCK */
+	NULL,				/* CB_VB21_FW_PREAMBLE */
+	NULL,				/* CB_VB21_SIGNATURE */
+	NULL,				/* CB_CBFS_FILE */
 };
+#endif
 BUILD_ASSERT(ARRAY_SIZE(cb_sign_funcs) == NUM_CB_COMPONENTS);
 
+/* FUTIL_OP_TRIAGE */
+static int (* const cb_triage_funcs[])(struct futil_traverse_state_s *state) = {
+	NULL,				/* CB_BEGIN_TRAVERSAL */
+	NULL,				/* CB_END_TRAVERSAL */
+	NULL,				/* CB_FMAP_GBB */
+	futil_cb_triage_fw_preamble,	/* CB_FMAP_VBLOCK_A */
+	futil_cb_triage_fw_preamble,	/* CB_FMAP_VBLOCK_B */
+	NULL,				/* CB_FMAP_FW_MAIN_A */
+	NULL,				/* CB_FMAP_FW_MAIN_B */
+	futil_cb_triage_kernel_preamble,	/* CB_GPT_KERNEL */
+	NULL,				/* CB_PUBKEY */
+	futil_cb_triage_keyblock,	/* CB_KEYBLOCK */
+	NULL,				/* CB_GBB */
+	futil_cb_triage_fw_preamble,	/* CB_FW_PREAMBLE */
+	futil_cb_triage_kernel_preamble,	/* CB_KERN_PREAMBLE */
+	NULL,				/* CB_RAW_FIRMWARE */
+	NULL,				/* CB_RAW_KERNEL */
+	NULL,				/* CB_PRIVKEY */
+	NULL,				/* CB_VBSD */
+	NULL,				/* CB_VB21_PUBKEY */
+	NULL,				/* CB_VB21_KEYBLOCK */
+	NULL,				/* CB_VB21_FW_PREAMBLE */
+	NULL,				/* CB_VB21_SIGNATURE */
+	NULL,				/* CB_CBFS_FILE */
+};
+BUILD_ASSERT(ARRAY_SIZE(cb_triage_funcs) == NUM_CB_COMPONENTS);
+
+/* FUTIL_OP_VERIFY_CHAIN */
+#ifdef FUTIL_VERIFY_ONLY
+static int (* const cb_chain_funcs[NUM_CB_COMPONENTS])(
+	struct futil_traverse_state_s *state) = {NULL};
+#else
+static int (* const cb_chain_funcs[])(struct futil_traverse_state_s *state) = {
+	NULL,				/* CB_BEGIN_TRAVERSAL */
+	NULL,				/* CB_END_TRAVERSAL */
+	futil_cb_chain_gbb,		/* CB_FMAP_GBB */
+	futil_cb_chain_fw_vblock,	/* CB_FMAP_VBLOCK_A */
+	futil_cb_chain_fw_vblock,	/* CB_FMAP_VBLOCK_B */
+	NULL,				/* CB_FMAP_FW_MAIN_A */
+	NULL,				/* CB_FMAP_FW_MAIN_B */
+	futil_cb_chain_kernel,		/* CB_GPT_KERNEL */
+	NULL,				/* CB_PUBKEY */
+	NULL,				/* CB_KEYBLOCK */
+	NULL,				/* CB_GBB */
+	NULL,				/* CB_FW_PREAMBLE */
+	NULL,				/* CB_KERN_PREAMBLE */
+	NULL,				/* CB_RAW_FIRMWARE */
+	NULL,				/* CB_RAW_KERNEL */
+	NULL,				/* CB_PRIVKEY */
+	NULL,				/* CB_VBSD */
+	NULL,				/* CB_VB21_PUBKEY */
+	NULL,				/* CB_VB21_KEYBLOCK */
+	NULL,				/* CB_VB21_FW_PREAMBLE */
+	NULL,				/* CB_VB21_SIGNATURE */
+	NULL,				/* CB_CBFS_FILE */
+};
+#endif
+BUILD_ASSERT(ARRAY_SIZE(cb_chain_funcs) == NUM_CB_COMPONENTS);
+
 static int (* const * const cb_func[])(struct futil_traverse_state_s *state) = {
 	cb_show_funcs,
 	cb_sign_funcs,
+	cb_triage_funcs,
+	cb_chain_funcs,
 };
 BUILD_ASSERT(ARRAY_SIZE(cb_func) == NUM_FUTIL_OPS);
 
+/*
+ * For ops whose callbacks can run alongside each other: the components whose
+ * callbacks must have finished before each one's can start. The areas of a
+ * BIOS image that don't depend on each other are examined at the same time,
+ * and what the callbacks print is put back in traversal order.
+ */
+#define AFTER(c) (1U << (c))
+BUILD_ASSERT(NUM_CB_COMPONENTS <= 32);
+
+/* FUTIL_OP_SHOW: a vblock needs the GBB's root key and its firmware body */
+static const uint32_t cb_show_after[] = {
+	0,				/* CB_BEGIN_TRAVERSAL */
+	0,				/* CB_END_TRAVERSAL */
+	0,				/* CB_FMAP_GBB */
+	AFTER(CB_FMAP_GBB) | AFTER(CB_FMAP_FW_MAIN_A),	/* CB_FMAP_VBLOCK_A */
+	AFTER(CB_FMAP_GBB) | AFTER(CB_FMAP_FW_MAIN_B),	/* CB_FMAP_VBLOCK_B */
+	0,				/* CB_FMAP_FW_MAIN_A */
+	0,				/* CB_FMAP_FW_MAIN_B */
+	0,				/* CB_GPT_KERNEL */
+	0,				/* CB_PUBKEY */
+	0,				/* CB_KEYBLOCK */
+	0,				/* CB_GBB */
+	0,				/* CB_FW_PREAMBLE */
+	0,				/* CB_KERN_PREAMBLE */
+	0,				/* CB_RAW_FIRMWARE */
+	0,				/* CB_RAW_KERNEL */
+	0,				/* CB_PRIVKEY */
+	0,				/* CB_VBSD */
+	0,				/* CB_VB21_PUBKEY */
+	0,				/* CB_VB21_KEYBLOCK */
+	0,				/* CB_VB21_FW_PREAMBLE */
+	0,				/* CB_VB21_SIGNATURE */
+	0,				/* CB_CBFS_FILE */
+};
+BUILD_ASSERT(ARRAY_SIZE(cb_show_after) == NUM_CB_COMPONENTS);
+
+/* FUTIL_OP_VERIFY_CHAIN: a vblock needs the GBB's root key */
+static const uint32_t cb_chain_after[] = {
+	0,				/* CB_BEGIN_TRAVERSAL */
+	0,				/* CB_END_TRAVERSAL */
+	0,				/* CB_FMAP_GBB */
+	AFTER(CB_FMAP_GBB),		/* CB_FMAP_VBLOCK_A */
+	AFTER(CB_FMAP_GBB),		/* CB_FMAP_VBLOCK_B */
+	0,				/* CB_FMAP_FW_MAIN_A */
+	0,				/* CB_FMAP_FW_MAIN_B */
+	0,				/* CB_GPT_KERNEL */
+	0,				/* CB_PUBKEY */
+	0,				/* CB_KEYBLOCK */
+	0,				/* CB_GBB */
+	0,				/* CB_FW_PREAMBLE */
+	0,				/* CB_KERN_PREAMBLE */
+	0,				/* CB_RAW_FIRMWARE */
+	0,				/* CB_RAW_KERNEL */
+	0,				/* CB_PRIVKEY */
+	0,				/* CB_VBSD */
+	0,				/* CB_VB21_PUBKEY */
+	0,				/* CB_VB21_KEYBLOCK */
+	0,				/* CB_VB21_FW_PREAMBLE */
+	0,				/* CB_VB21_SIGNATURE */
+	0,				/* CB_CBFS_FILE */
+};
+BUILD_ASSERT(ARRAY_SIZE(cb_chain_after) == NUM_CB_COMPONENTS);
+
+struct cb_parallel_s {
+	const uint32_t *after;
+	void (*thread_begin)(FILE *out, FILE *err);
+	void (*thread_end)(void);
+	void (*flush)(const char *out, size_t out_len,
+		      const char *err, size_t err_len);
+};
+
+static const struct cb_parallel_s cb_show_parallel = {
+	cb_show_after,
+	futil_show_thread_begin,
+	futil_show_thread_end,
+	futil_show_flush,
+};
+
+/* These print nothing until the end, so the show hooks will do */
+static const struct cb_parallel_s cb_chain_parallel = {
+	cb_chain_after,
+	futil_show_thread_begin,
+	futil_show_thread_end,
+	futil_show_flush,
+};
+
+/* The sign and triage callbacks share state, so they take turns */
+static const struct cb_parallel_s * const cb_parallel[] = {
+	&cb_show_parallel,
+	NULL,
+	NULL,
+	&cb_chain_parallel,
+};
+BUILD_ASSERT(ARRAY_SIZE(cb_parallel) == NUM_FUTIL_OPS);
+
 /*
  * File types that don't need iterating can use a lookup table to determine the
  * callback component and name. The index is the file type.
@@ -80,6 +268,12 @@ static const struct {
 	{CB_RAW_KERNEL,    "raw kernel"},	/* FILE_TYPE_RAW_KERNEL */
 	{0,                "chromiumos disk"},	/* FILE_TYPE_CHROMIUMOS_DISK */
 	{CB_PRIVKEY,       "VbPrivateKey"},	/* FILE_TYPE_PRIVKEY */
+	{CB_VBSD,          "VbSharedData"},	/* FILE_TYPE_VBSD */
+	{CB_VB21_PUBKEY,   "vb21 packed key"},	/* FILE_TYPE_VB21_PUBKEY */
+	{CB_VB21_KEYBLOCK, "vb21 keyblock"},	/* FILE_TYPE_VB21_KEYBLOCK */
+	{CB_VB21_FW_PREAMBLE, "vb21 FW Preamble"},
+						/* FILE_TYPE_VB21_FW_PREAMBLE */
+	{CB_VB21_SIGNATURE, "vb21 signature"},	/* FILE_TYPE_VB21_SIGNATURE */
 };
 BUILD_ASSERT(ARRAY_SIZE(direct_callback) == NUM_FILE_TYPES);
 
@@ -101,6 +295,7 @@ static const struct bios_area_s bios_area[] = {
 	{"VBLOCK_B",  CB_FMAP_VBLOCK_B},
 	{0, 0}
 };
+#define NUM_BIOS_AREAS (ARRAY_SIZE(bios_area) - 1)
 
 /* Really old BIOS images had different names, but worked the same. */
 static const struct bios_area_s old_bios_area[] = {
@@ -111,32 +306,88 @@ static const struct bios_area_s old_bios_area[] = {
 	{"Firmware B Key",  CB_FMAP_VBLOCK_B},
 	{0, 0}
 };
+BUILD_ASSERT(ARRAY_SIZE(old_bios_area) == ARRAY_SIZE(bios_area));
+
+/*
+ * The image is examined several times (recognizing it, then traversing it),
+ * so remember the FMAP index for the most recent buffer, and where to look
+ * first for the next one's FMAP.
+ */
+static __thread struct {
+	uint8_t *buf;
+	uint64_t len;
+	FmapIndex *idx;
+	uint8_t *hint_buf;
+	uint64_t hint;
+} fmap_cache;
+
+FmapIndex *futil_fmap_index(uint8_t *buf, uint64_t len)
+{
+	if (fmap_cache.buf == buf && fmap_cache.len == len)
+		return fmap_cache.idx;
+
+	fmap_index_free(fmap_cache.idx);
+	fmap_cache.buf = buf;
+	fmap_cache.len = len;
+	if (fmap_cache.hint_buf == buf)
+		fmap_cache.idx = fmap_index_create_at(buf, len,
+						      fmap_cache.hint);
+	else
+		fmap_cache.idx = fmap_index_create(buf, len);
+	fmap_cache.hint_buf = NULL;
+	return fmap_cache.idx;
+}
+
+void futil_fmap_hint(uint8_t *buf, uint64_t offset)
+{
+	fmap_cache.hint_buf = buf;
+	fmap_cache.hint = offset;
+}
+
+uint64_t futil_fmap_offset(uint8_t *buf)
+{
+	if (fmap_cache.buf != buf || !fmap_cache.idx)
+		return FUTIL_NO_FMAP;
+	return (uint8_t *)fmap_cache.idx->fmap - buf;
+}
 
-static int has_all_areas(uint8_t *buf, uint32_t len, FmapHeader *fmap,
-			 const struct bios_area_s *area)
+void futil_fmap_index_forget(uint8_t *buf)
+{
+	if (fmap_cache.hint_buf == buf)
+		fmap_cache.hint_buf = NULL;
+	if (fmap_cache.buf != buf)
+		return;
+
+	fmap_index_free(fmap_cache.idx);
+	fmap_cache.buf = NULL;
+	fmap_cache.len = 0;
+	fmap_cache.idx = NULL;
+}
+
+static int has_all_areas(FmapIndex *idx, const struct bios_area_s *area)
 {
 	/* We must have all the expected areas */
 	for (; area->name; area++)
-		if (!fmap_find_by_name(buf, len, fmap, area->name, 0))
+		if (!fmap_index_find(idx, area->name))
 			return 0;
 
 	/* Found 'em all */
 	return 1;
 }
 
-enum futil_file_type recognize_bios_image(uint8_t *buf, uint32_t len)
+enum futil_file_type recognize_bios_image(uint8_t *buf, uint64_t len)
 {
-	FmapHeader *fmap = fmap_find(buf, len);
-	if (fmap) {
-		if (has_all_areas(buf, len, fmap, bios_area))
+	FmapIndex *idx = futil_fmap_index(buf, len);
+	if (idx) {
+		if (has_all_areas(idx, bios_area))
 			return FILE_TYPE_BIOS_IMAGE;
-		if (has_all_areas(buf, len, fmap, old_bios_area))
+		if (has_all_areas(idx, old_bios_area))
 			return FILE_TYPE_OLD_BIOS_IMAGE;
 	}
 	return FILE_TYPE_UNKNOWN;
 }
 
-static const char * const futil_cb_component_str[] = {
+const char * const futil_cb_component_str[] = {
 	"CB_BEGIN_TRAVERSAL",
 	"CB_END_TRAVERSAL",
 	"CB_FMAP_GBB",
@@ -144,6 +395,7 @@ static const char * const futil_cb_component_str[] = {
 	"CB_FMAP_VBLOCK_B",
 	"CB_FMAP_FW_MAIN_A",
 	"CB_FMAP_FW_MAIN_B",
+	"CB_GPT_KERNEL",
 	"CB_PUBKEY",
 	"CB_KEYBLOCK",
 	"CB_GBB",
@@ -152,15 +404,24 @@ static const char * const futil_cb_component_str[] = {
 	"CB_RAW_FIRMWARE",
 	"CB_RAW_KERNEL",
 	"CB_PRIVKEY",
+	"CB_VBSD",
+	"CB_VB21_PUBKEY",
+	"CB_VB21_KEYBLOCK",
+	"CB_VB21_FW_PREAMBLE",
+	"CB_VB21_SIGNATURE",
+	"CB_CBFS_FILE",
 };
 BUILD_ASSERT(ARRAY_SIZE(futil_cb_component_str) == NUM_CB_COMPONENTS);
 
 static int invoke_callback(struct futil_traverse_state_s *state,
 			   enum futil_cb_component c, const char *name,
-			   uint32_t offset, uint8_t *buf, uint32_t len)
+			   uint64_t offset, uint8_t *buf, uint64_t len)
 {
+	uint64_t start;
+	int retval;
+
 	Debug("%s: name \"%s\" op %d component %s"
-	      " offset=0x%08x len=0x%08x, buf=%p\n",
+	      " offset=0x%08" PRIx64 " len=0x%08" PRIx64 ", buf=%p\n",
 	      __func__, name, state->op, futil_cb_component_str[c],
 	      offset, len, buf);
 
@@ -176,17 +437,22 @@ static int invoke_callback(struct futil_traverse_state_s *state,
 	state->cb_area[c].len = len;
 	state->my_area = &state->cb_area[c];
 
-	if (cb_func[state->op][c])
-		return cb_func[state->op][c](state);
+	if (!cb_func[state->op][c])
+		return 0;
 
-	return 0;
+	VB_PROBE3(callback_entry, state->op, c, len);
+	start = futil_stats_begin();
+	retval = cb_func[state->op][c](state);
+	futil_stats_end(STAT_CALLBACK + c, name, start, len);
+	VB_PROBE3(callback_return, state->op, c, retval);
+	return retval;
 }
 
-static void fmap_limit_area(FmapAreaHeader *ah, uint32_t len)
+static void fmap_limit_area(FmapAreaHeader *ah, uint64_t len)
 {
-	uint32_t sum = ah->area_offset + ah->area_size;
-	if (sum < ah->area_size || sum > len) {
-		Debug("%s(%s) 0x%x + 0x%x > 0x%x\n",
+	uint64_t sum = (uint64_t)ah->area_offset + ah->area_size;
+	if (sum > len) {
+		Debug("%s(%s) 0x%x + 0x%x > 0x%" PRIx64 "\n",
 		      __func__, ah->area_name,
 		      ah->area_offset, ah->area_size, len);
 		ah->area_offset = 0;
@@ -194,14 +460,482 @@ static void fmap_limit_area(FmapAreaHeader *ah, uint32_t len)
 	}
 }
 
-int futil_traverse(uint8_t *buf, uint32_t len,
+void futil_prefetch_area(struct futil_traverse_state_s *state,
+			 enum futil_cb_component c)
+{
+	struct cb_area_s *cb = &state->cb_area[c];
+
+	if (cb->buf)
+		futil_advise(cb->buf, cb->len, MADV_WILLNEED);
+}
+
+const CbfsIndex *futil_cbfs_index(struct futil_traverse_state_s *state,
+				  enum futil_cb_component c)
+{
+	struct cb_area_s *cb = &state->cb_area[c];
+
+	if (!cb->cbfs && cb->buf)
+		cb->cbfs = cbfs_index_create(cb->buf, cb->len);
+	return cb->cbfs;
+}
+
+int futil_traverse_cbfs(struct futil_traverse_state_s *state,
+			enum futil_cb_component c, const char *area_name)
+{
+	enum futil_cb_component component = state->component;
+	struct cb_area_s *my_area = state->my_area;
+	const char *name = state->name;
+	const CbfsIndex *idx;
+	const CbfsEntry *e;
+	uint64_t offset;
+	uint8_t *buf;
+	int retval = 0;
+	int i;
+
+	idx = futil_cbfs_index(state, c);
+	offset = state->cb_area[c].offset;
+	buf = state->cb_area[c].buf;
+	state->cbfs_area = area_name;
+	for (i = 0; (e = cbfs_index_entry(idx, i)); i++) {
+		state->cbfs_file = e;
+		retval |= invoke_callback(state, CB_CBFS_FILE, e->name,
+					  offset + e->data_offset,
+					  buf + e->data_offset, e->len);
+	}
+	state->cbfs_file = NULL;
+	state->cbfs_area = NULL;
+
+	state->component = component;
+	state->my_area = my_area;
+	state->name = name;
+	return retval;
+}
+
+void futil_mark_dirty(struct futil_traverse_state_s *state,
+		      uint64_t offset, uint64_t len)
+{
+	struct cb_range_s *r;
+	uint64_t end = offset + len;
+	int i;
+
+	if (!len)
+		return;
+
+	/* Grow an existing range if this one touches it */
+	for (i = 0; i < state->num_dirty; i++) {
+		r = &state->dirty[i];
+		if (offset <= r->offset + r->len && r->offset <= end)
+			goto merge;
+	}
+
+	if (state->num_dirty < MAX_DIRTY_RANGES) {
+		r = &state->dirty[state->num_dirty++];
+		r->offset = offset;
+		r->len = len;
+		return;
+	}
+
+	/* Out of slots, so the last one will have to cover both */
+	r = &state->dirty[MAX_DIRTY_RANGES - 1];
+merge:
+	if (offset < r->offset) {
+		r->len += r->offset - offset;
+		r->offset = offset;
+	}
+	if (end > r->offset + r->len)
+		r->len = end - r->offset;
+}
+
+/* [size] bytes of the disk image at [offset], from [buf] or through [win] */
+static uint8_t *disk_at(uint8_t *buf, struct futil_window_s *win,
+			uint64_t offset, uint64_t size)
+{
+	return win ? futil_window_get(win, offset, size) : buf + offset;
+}
+
+/*
+ * Copies [size] bytes of the disk image from sector [lba], zero-filling
+ * whatever's past the end. Returns NULL if it can't allocate them.
+ */
+static uint8_t *copy_sectors(uint8_t *buf, struct futil_window_s *win,
+			     int fd, uint64_t len, uint64_t lba, uint64_t size)
+{
+	uint8_t *copy = calloc(1, size);
+	uint64_t offset = lba * DISK_SECTOR_SIZE;
+	uint8_t *p;
+
+	if (copy && lba < len / DISK_SECTOR_SIZE) {
+		if (len - offset < size)
+			size = len - offset;
+		if (fd >= 0) {
+			/* What can't be read is left for GptInit() to reject */
+			PreadFull(fd, copy, size, offset);
+			return copy;
+		}
+		p = disk_at(buf, win, offset, size);
+		if (p)
+			memcpy(copy, p, size);
+	}
+	return copy;
+}
+
+/* Far more than any kernel's keyblock and preamble need */
+#define MAX_VBLOCK_SIZE (1 << 20)
+
+/*
+ * Reads in just the vblock at the start of the [size] byte partition at
+ * [offset] of [fd]: the keyblock, and the kernel preamble after it, which
+ * each say how big they are. Returns NULL if that isn't what's there.
+ */
+static uint8_t *read_vblock(int fd, uint64_t offset, uint64_t size,
+			    uint64_t *vblock_len)
+{
+	VbKeyBlockHeader kb;
+	uint64_t preamble_size, len;
+	uint8_t *vblock;
+
+	if (size < sizeof(kb) ||
+	    PreadFull(fd, &kb, sizeof(kb), offset) != sizeof(kb) ||
+	    memcmp(kb.magic, KEY_BLOCK_MAGIC, KEY_BLOCK_MAGIC_SIZE) ||
+	    kb.key_block_size > size - sizeof(preamble_size) ||
+	    PreadFull(fd, &preamble_size, sizeof(preamble_size),
+		      offset + kb.key_block_size) != sizeof(preamble_size) ||
+	    preamble_size > size - kb.key_block_size)
+		return NULL;
+
+	len = kb.key_block_size + preamble_size;
+	if (len > MAX_VBLOCK_SIZE)
+		return NULL;
+	vblock = malloc(len);
+	if (!vblock)
+		return NULL;
+	if (PreadFull(fd, vblock, len, offset) != len ||
+	    FILE_TYPE_KERN_PREAMBLE != recognize_vblock1(vblock, len)) {
+		free(vblock);
+		return NULL;
+	}
+	*vblock_len = len;
+	return vblock;
+}
+
+/* One area's callback, which may run on a thread of its own */
+struct area_job_s {
+	enum futil_cb_component component;
+	const char *name;
+	uint64_t offset;
+	uint8_t *buf;
+	uint64_t len;
+	/* For a kernel partition, which one it is and how big it is */
+	uint32_t partition;
+	uint64_t part_len;
+	const struct cb_parallel_s *par;
+	/* A threaded callback gets its own copy of the state, and output */
+	struct futil_traverse_state_s state;
+	char *out, *err;
+	size_t out_len, err_len;
+	int retval;
+	int threaded;
+	pthread_t tid;
+};
+
+static void *area_job_thread(void *arg)
+{
+	struct area_job_s *job = arg;
+	FILE *out, *err;
+
+	futil_metrics_thread();
+	out = open_memstream(&job->out, &job->out_len);
+	err = open_memstream(&job->err, &job->err_len);
+	if (!out || !err) {
+		fprintf(stderr, "Couldn't buffer the output for %s\n",
+			job->name);
+		job->retval = 1;
+	} else {
+		job->par->thread_begin(out, err);
+		job->retval = invoke_callback(&job->state, job->component,
+					      job->name, job->offset,
+					      job->buf, job->len);
+		job->par->thread_end();
+	}
+	if (out)
+		fclose(out);
+	if (err)
+		fclose(err);
+	futil_jobs_release(1);
+	return NULL;
+}
+
+/*
+ * Starts [j] on a thread of its own, with a copy of [state], if there's a
+ * thread to spare. Otherwise the caller invokes it in turn.
+ */
+static void area_job_start(struct area_job_s *j,
+			   const struct futil_traverse_state_s *state)
+{
+	j->state = *state;
+	j->out = j->err = NULL;
+	j->out_len = j->err_len = 0;
+	j->threaded = 0;
+	if (futil_jobs_reserve(1)) {
+		j->threaded = !pthread_create(&j->tid, NULL, area_job_thread,
+					      j);
+		if (!j->threaded)
+			futil_jobs_release(1);
+	}
+}
+
+/* Waits for a threaded [j] to finish, and passes its output on */
+static void area_job_join(struct area_job_s *j)
+{
+	pthread_join(j->tid, NULL);
+	j->par->flush(j->out, j->out_len, j->err, j->err_len);
+	free(j->out);
+	free(j->err);
+}
+
+/*
+ * Invokes the callback for each Chrome OS kernel partition in a disk image
+ * that has a kernel in it, in partition table order. cgptlib gets a copy of
+ * the GPT, because it may repair it and the buffer could be read-only.
+ * Read through [win], a partition bigger than the window is only looked at
+ * as far as the window goes, which the kernel in it seldom goes past. Read
+ * from [fd], only each partition's vblock is read, and the callback gets
+ * just that.
+ *
+ * If the op allows it, and the partitions stay put (they don't in a window),
+ * they all go at once like the areas of a BIOS image.
+ */
+static int traverse_gpt(uint8_t *buf, uint64_t len,
+			struct futil_window_s *win, int fd,
+			struct futil_traverse_state_s *state)
+{
+	const uint64_t entries_size = MAX_NUMBER_OF_ENTRIES * MAX_SIZE_OF_ENTRY;
+	const struct cb_parallel_s *par = win ? NULL : cb_parallel[state->op];
+	uint64_t sectors = len / DISK_SECTOR_SIZE;
+	struct area_job_s *job = NULL, *j;
+	GptData gpt;
+	GptHeader *h;
+	GptEntry *e;
+	uint64_t offset, size, part_len;
+	uint8_t *part;
+	uint32_t i, n = 0;
+	int retval = 0;
+
+	memset(&gpt, 0, sizeof(gpt));
+	gpt.sector_bytes = DISK_SECTOR_SIZE;
+	gpt.streaming_drive_sectors = sectors;
+	gpt.gpt_drive_sectors = sectors;
+	gpt.primary_header = copy_sectors(buf, win, fd, len, GPT_PMBR_SECTORS,
+					  DISK_SECTOR_SIZE);
+	gpt.secondary_header = copy_sectors(buf, win, fd, len, sectors - 1,
+					    DISK_SECTOR_SIZE);
+	if (!gpt.primary_header || !gpt.secondary_header) {
+		fprintf(stderr, "Couldn't allocate space for the GPT\n");
+		retval = 1;
+		goto done;
+	}
+	h = (GptHeader *)gpt.primary_header;
+	gpt.primary_entries = copy_sectors(buf, win, fd, len, h->entries_lba,
+					   entries_size);
+	h = (GptHeader *)gpt.secondary_header;
+	gpt.secondary_entries = copy_sectors(buf, win, fd, len,
+					     h->entries_lba, entries_size);
+	if (!gpt.primary_entries || !gpt.secondary_entries) {
+		fprintf(stderr, "Couldn't allocate space for the GPT\n");
+		retval = 1;
+		goto done;
+	}
+
+	if (GPT_SUCCESS != GptInit(&gpt)) {
+		fprintf(stderr, "%s has no usable GPT\n", state->in_filename);
+		retval = 1;
+		goto done;
+	}
+
+	/* After GptInit(), the primary copy is good */
+	h = (GptHeader *)gpt.primary_header;
+	e = (GptEntry *)gpt.primary_entries;
+	if (par) {
+		job = calloc(h->number_of_entries, sizeof(*job));
+		if (!job)
+			par = NULL;
+	}
+	for (i = 0; i < h->number_of_entries; i++, e++) {
+		if (!IsKernelEntry(e))
+			continue;
+
+		offset = e->starting_lba * DISK_SECTOR_SIZE;
+		size = (e->ending_lba - e->starting_lba + 1) *
+			DISK_SECTOR_SIZE;
+		if (e->starting_lba > e->ending_lba ||
+		    e->ending_lba >= sectors) {
+			fprintf(stderr, "Partition %d is past the end of %s\n",
+				i + 1, state->in_filename);
+			retval = 1;
+			continue;
+		}
+		part_len = size;
+
+		if (fd >= 0) {
+			/* Spare kernel partitions are often left empty */
+			part = read_vblock(fd, offset, size, &size);
+			if (!part) {
+				Debug("partition %d has no kernel\n", i + 1);
+				continue;
+			}
+		} else {
+			if (win)
+				size = futil_window_clamp(size);
+			part = disk_at(buf, win, offset, size);
+			if (!part) {
+				retval = 1;
+				continue;
+			}
+			if (FILE_TYPE_KERN_PREAMBLE !=
+			    recognize_vblock1(part, size)) {
+				Debug("partition %d has no kernel\n", i + 1);
+				continue;
+			}
+		}
+
+		state->partition = i + 1;
+		state->part_len = part_len;
+		if (!par) {
+			retval |= invoke_callback(state, CB_GPT_KERNEL,
+						  "kernel partition",
+						  offset, part, size);
+			state->errors = retval;
+			if (fd >= 0)
+				free(part);
+			continue;
+		}
+
+		/* The first goes on this thread, once the rest are going */
+		j = &job[n];
+		j->component = CB_GPT_KERNEL;
+		j->name = "kernel partition";
+		j->offset = offset;
+		j->buf = part;
+		j->len = size;
+		j->partition = state->partition;
+		j->part_len = part_len;
+		j->par = par;
+		if (n++)
+			area_job_start(j, state);
+	}
+
+	/* Then gather them up in order */
+	for (i = 0; i < n; i++) {
+		j = &job[i];
+		if (j->threaded) {
+			area_job_join(j);
+			retval |= j->retval;
+		} else {
+			state->partition = j->partition;
+			state->part_len = j->part_len;
+			retval |= invoke_callback(state, j->component, j->name,
+						  j->offset, j->buf, j->len);
+		}
+		state->errors = retval;
+		if (fd >= 0)
+			free(j->buf);
+	}
+
+done:
+	free(job);
+	free(gpt.primary_header);
+	free(gpt.secondary_header);
+	free(gpt.primary_entries);
+	free(gpt.secondary_entries);
+	return retval;
+}
+
+/*
+ * Invoke the callbacks for each of a BIOS image's [areas]. If the op allows
+ * it, each run of areas that don't have to wait for each other goes at once:
+ * the first on this thread and the rest on threads of their own, whose
+ * output is passed on afterwards, so it still comes out in traversal order.
+ * Otherwise, or if there's no thread to spare, they're just taken in turn.
+ */
+static int traverse_bios_areas(uint8_t *buf, FmapIndex *idx,
+			       const struct bios_area_s *areas,
+			       struct futil_traverse_state_s *state)
+{
+	const struct cb_parallel_s *par = cb_parallel[state->op];
+	struct area_job_s job[NUM_BIOS_AREAS], *j;
+	struct cb_area_s rootkey, recovery_key;
+	FmapAreaHeader *ah;
+	uint32_t done = 0;
+	int n, first, last, i;
+	int retval = 0;
+
+	for (n = 0; areas[n].name; n++) {
+		ah = fmap_index_find(idx, areas[n].name);
+		job[n].component = areas[n].component;
+		job[n].name = areas[n].name;
+		job[n].offset = ah->area_offset;
+		job[n].buf = buf + ah->area_offset;
+		job[n].len = ah->area_size;
+		job[n].par = par;
+	}
+
+	for (first = 0; first < n; first = last) {
+		/* The next area always goes, and those after it that needn't
+		 * wait for it or for each other go along with it */
+		rootkey = state->rootkey;
+		recovery_key = state->recovery_key;
+		job[first].threaded = 0;
+		for (last = first + 1; par && last < n; last++) {
+			j = &job[last];
+			if (par->after[j->component] & ~done)
+				break;
+			area_job_start(j, state);
+		}
+		if (!par)
+			last = first + 1;
+
+		/* Then gather them up in order */
+		for (i = first; i < last; i++) {
+			j = &job[i];
+			if (!j->threaded) {
+				retval |= invoke_callback(state, j->component,
+							  j->name, j->offset,
+							  j->buf, j->len);
+				state->errors = retval;
+				continue;
+			}
+
+			area_job_join(j);
+			state->cb_area[j->component] =
+				j->state.cb_area[j->component];
+			if (memcmp(&j->state.rootkey, &rootkey,
+				   sizeof(rootkey)))
+				state->rootkey = j->state.rootkey;
+			if (memcmp(&j->state.recovery_key, &recovery_key,
+				   sizeof(recovery_key)))
+				state->recovery_key = j->state.recovery_key;
+			retval |= j->retval;
+			state->errors = retval;
+		}
+
+		for (i = first; i < last; i++)
+			done |= AFTER(job[i].component);
+	}
+
+	return retval;
+}
+
+int futil_traverse(uint8_t *buf, uint64_t len,
 		   struct futil_traverse_state_s *state,
 		   enum futil_file_type type)
 {
-	FmapHeader *fmap;
+	FmapIndex *idx;
 	FmapAreaHeader *ah = 0;
-	const struct bios_area_s *area;
+	const struct bios_area_s *areas, *area;
+	struct cb_area_s *cb;
+	uint64_t start = futil_stats_begin();
 	int retval = 0;
+	int i;
 
 	if ((int) state->op < 0 || state->op >= NUM_FUTIL_OPS) {
 		fprintf(stderr, "Invalid op %d\n", state->op);
@@ -219,44 +953,33 @@ int futil_traverse(uint8_t *buf, uint32_t len,
 
 	switch (type) {
 	case FILE_TYPE_BIOS_IMAGE:
+	case FILE_TYPE_OLD_BIOS_IMAGE:
 		/* We've already checked, so we know this will work. */
-		fmap = fmap_find(buf, len);
-		for (area = bios_area; area->name; area++) {
+		idx = futil_fmap_index(buf, len);
+		areas = (type == FILE_TYPE_BIOS_IMAGE) ?
+			bios_area : old_bios_area;
+		/* Say where everything is first, so callbacks can look ahead */
+		for (area = areas; area->name; area++) {
 			/* We know this will work, too */
-			fmap_find_by_name(buf, len, fmap, area->name, &ah);
+			ah = fmap_index_find(idx, area->name);
 			/* But the file might be truncated */
 			fmap_limit_area(ah, len);
-			retval |= invoke_callback(state,
-						  area->component,
-						  area->name,
-						  ah->area_offset,
-						  buf + ah->area_offset,
-						  ah->area_size);
-			state->errors = retval;
+			cb = &state->cb_area[area->component];
+			cb->offset = ah->area_offset;
+			cb->buf = buf + ah->area_offset;
+			cb->len = ah->area_size;
 		}
+		retval |= traverse_bios_areas(buf, idx, areas, state);
+		state->errors = retval;
 		break;
 
-	case FILE_TYPE_OLD_BIOS_IMAGE:
-		/* We've already checked, so we know this will work. */
-		fmap = fmap_find(buf, len);
-		for (area = old_bios_area; area->name; area++) {
-			/* We know this will work, too */
-			fmap_find_by_name(buf, len, fmap, area->name, &ah);
-			/* But the file might be truncated */
-			fmap_limit_area(ah, len);
-			retval |= invoke_callback(state,
-						  area->component,
-						  area->name,
-						  ah->area_offset,
-						  buf + ah->area_offset,
-						  ah->area_size);
-			state->errors = retval;
-		}
+	case FILE_TYPE_CHROMIUMOS_DISK:
+		retval |= traverse_gpt(buf, len, NULL, -1, state);
+		state->errors = retval;
 		break;
 
 	case FILE_TYPE_UNKNOWN:
-	case FILE_TYPE_CHROMIUMOS_DISK:
-		/* Nothing to do for these file types (yet) */
+		/* Nothing to do for this file type */
 		break;
 
 	default:
@@ -271,5 +994,98 @@ int futil_traverse(uint8_t *buf, uint32_t len,
 
 	retval |= invoke_callback(state, CB_END_TRAVERSAL, "<end>",
 				  0, buf, len);
+
+	for (i = 0; i < NUM_CB_COMPONENTS; i++) {
+		cbfs_index_free(state->cb_area[i].cbfs);
+		state->cb_area[i].cbfs = NULL;
+	}
+	futil_stats_end(STAT_TRAVERSE, NULL, start, len);
+	return retval;
+}
+
+int futil_traverse_window(struct futil_window_s *win,
+			  struct futil_traverse_state_s *state)
+{
+	uint64_t start = futil_stats_begin();
+	uint8_t *head;
+	uint64_t head_len;
+	int retval = 0;
+
+	if ((int) state->op < 0 || state->op >= NUM_FUTIL_OPS) {
+		fprintf(stderr, "Invalid op %d\n", state->op);
+		return 1;
+	}
+
+	/* What it is can be told from the start of it */
+	head_len = futil_window_clamp(win->len);
+	head = futil_window_get(win, 0, head_len);
+	if (!head)
+		return 1;
+	state->in_type = futil_file_type_buf(head, head_len);
+
+	retval |= invoke_callback(state, CB_BEGIN_TRAVERSAL, "<begin>",
+				  0, NULL, win->len);
+	state->errors = retval;
+
+	switch (state->in_type) {
+	case FILE_TYPE_CHROMIUMOS_DISK:
+		retval |= traverse_gpt(NULL, win->len, win, -1, state);
+		state->errors = retval;
+		break;
+
+	case FILE_TYPE_UNKNOWN:
+		break;
+
+	default:
+		fprintf(stderr, "%s is a %s, which can't be read through a"
+			" window\n", state->in_filename,
+			futil_file_type_str(state->in_type));
+		retval = 1;
+		state->errors = retval;
+		break;
+	}
+
+	retval |= invoke_callback(state, CB_END_TRAVERSAL, "<end>",
+				  0, NULL, win->len);
+	futil_stats_end(STAT_TRAVERSE, NULL, start, win->len);
+	return retval;
+}
+
+int futil_traverse_disk(int fd, uint64_t len,
+			struct futil_traverse_state_s *state)
+{
+	uint64_t start = futil_stats_begin();
+	uint8_t head[2 * DISK_SECTOR_SIZE];
+	int retval = 0;
+
+	if ((int) state->op < 0 || state->op >= NUM_FUTIL_OPS) {
+		fprintf(stderr, "Invalid op %d\n", state->op);
+		return 1;
+	}
+
+	state->in_type = FILE_TYPE_UNKNOWN;
+	if (len >= sizeof(head) &&
+	    PreadFull(fd, head, sizeof(head), 0) == sizeof(head))
+		state->in_type = recognize_gpt(head, sizeof(head));
+
+	retval |= invoke_callback(state, CB_BEGIN_TRAVERSAL, "<begin>",
+				  0, NULL, len);
+	state->errors = retval;
+
+	if (state->in_type == FILE_TYPE_CHROMIUMOS_DISK) {
+		state->fd = fd;
+		state->vblock_only = 1;
+		retval |= traverse_gpt(NULL, len, NULL, fd, state);
+		state->vblock_only = 0;
+		state->errors = retval;
+	} else {
+		fprintf(stderr, "%s isn't a disk image\n", state->in_filename);
+		retval = 1;
+		state->errors = retval;
+	}
+
+	retval |= invoke_callback(state, CB_END_TRAVERSAL, "<end>",
+				  0, NULL, len);
+	futil_stats_end(STAT_TRAVERSE, NULL, start, len);
 	return retval;
 }
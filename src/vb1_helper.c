@@ -5,9 +5,12 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>		/* For PRIu64 */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <openssl/rsa.h>
 
@@ -19,7 +22,7 @@
 #include "vb1_helper.h"
 
 /****************************************************************************/
-/* Here are globals containing all the bits & pieces I'm working on.
+/* A struct kernel_blob_ctx_s holds all the bits & pieces being worked on.
  *
  * kernel vblock    = keyblock + kernel preamble + padding to 64K (or whatever)
  * kernel blob      = 32-bit kernel + config file + params + bootloader stub +
@@ -29,27 +32,6 @@
  * The VbKernelPreambleHeader.preamble_size includes the padding.
  */
 
-/* The keyblock, preamble, and kernel blob are kept in separate places. */
-static VbKeyBlockHeader *g_keyblock;
-static VbKernelPreambleHeader *g_preamble;
-static uint8_t *g_kernel_blob_data;
-static uint64_t g_kernel_blob_size;
-
-/* These refer to individual parts within the kernel blob. */
-static uint8_t *g_kernel_data;
-static uint64_t g_kernel_size;
-static uint8_t *g_config_data;
-static uint64_t g_config_size;
-static uint8_t *g_param_data;
-static uint64_t g_param_size;
-static uint8_t *g_bootloader_data;
-static uint64_t g_bootloader_size;
-static uint8_t *g_vmlinuz_header_data;
-static uint64_t g_vmlinuz_header_size;
-
-static uint64_t g_ondisk_bootloader_addr;
-static uint64_t g_ondisk_vmlinuz_header_addr;
-
 
 /*
  * Read the kernel command line from a file. Get rid of \n characters along
@@ -147,9 +129,10 @@ static int KernelSize(uint8_t *kernel_buf, uint64_t kernel_size,
 	return kernel_size - kernel32_start;
 }
 
-/* This extracts g_kernel_* and g_param_* from a standard vmlinuz file.
+/* This extracts kb->kernel_* and kb->param_* from a standard vmlinuz file.
  * It returns nonzero on error. */
-static int PickApartVmlinuz(uint8_t *kernel_buf, uint64_t kernel_size,
+static int PickApartVmlinuz(struct kernel_blob_ctx_s *kb,
+			    uint8_t *kernel_buf, uint64_t kernel_size,
 			    enum arch_t arch,
 			    uint64_t kernel_body_load_address)
 {
@@ -173,8 +156,8 @@ static int PickApartVmlinuz(uint8_t *kernel_buf, uint64_t kernel_size,
 		Debug(" kernel16_size=0x%" PRIx64 "\n", kernel32_start);
 
 		/* Copy the original zeropage data from kernel_buf into
-		 * g_param_data, then tweak a few fields for our purposes */
-		params = (struct linux_kernel_params *)(g_param_data);
+		 * kb->param_data, then tweak a few fields for our purposes */
+		params = (struct linux_kernel_params *)(kb->param_data);
 		Memcpy(&(params->setup_sects), &(lh->setup_sects),
 		       offsetof(struct linux_kernel_params, e820_entries)
 		       - offsetof(struct linux_kernel_params, setup_sects));
@@ -186,7 +169,7 @@ static int PickApartVmlinuz(uint8_t *kernel_buf, uint64_t kernel_size,
 		 * will come right after the 32-bit part of the kernel. */
 		params->cmd_line_ptr = kernel_body_load_address +
 			roundup(kernel32_size, CROS_ALIGN) +
-			find_cmdline_start(g_config_data, g_config_size);
+			find_cmdline_start(kb->config_data, kb->config_size);
 		Debug(" cmdline_addr=0x%x\n", params->cmd_line_ptr);
 		Debug(" version=0x%x\n", params->version);
 		Debug(" kernel_alignment=0x%x\n", params->kernel_alignment);
@@ -204,20 +187,18 @@ static int PickApartVmlinuz(uint8_t *kernel_buf, uint64_t kernel_size,
 	Debug(" kernel32_start=0x%" PRIx64 "\n", kernel32_start);
 	Debug(" kernel32_size=0x%" PRIx64 "\n", kernel32_size);
 
-	/* Keep just the 32-bit kernel. */
-	if (kernel32_size) {
-		g_kernel_size = kernel32_size;
-		Memcpy(g_kernel_data, kernel_buf + kernel32_start,
-		       g_kernel_size);
-	}
+	/* Keep just the 32-bit kernel; KernelBlobSegments() says where. */
+	if (kernel32_size)
+		kb->kernel_size = kernel32_size;
 
 	/* done */
 	return 0;
 }
 
-/* Split a kernel blob into separate g_kernel, g_param, g_config,
- * g_bootloader, and g_vmlinuz_header parts. */
-static void UnpackKernelBlob(uint8_t *kernel_blob_data)
+/* Split a kernel blob into separate kernel, param, config, bootloader, and
+ * vmlinuz_header parts. */
+static void UnpackKernelBlob(struct kernel_blob_ctx_s *kb,
+			     uint8_t *kernel_blob_data)
 {
 	uint64_t now;
 	uint64_t vmlinuz_header_size = 0;
@@ -227,7 +208,7 @@ static void UnpackKernelBlob(uint8_t *kernel_blob_data)
 	   only describes the bootloader and vmlinuz stubs. */
 
 	/* Vmlinuz Header is at the end */
-	if (VbGetKernelVmlinuzHeader(g_preamble,
+	if (VbGetKernelVmlinuzHeader(kb->preamble,
 				     &vmlinuz_header_address,
 				     &vmlinuz_header_size)
 	    != VBOOT_SUCCESS) {
@@ -235,66 +216,68 @@ static void UnpackKernelBlob(uint8_t *kernel_blob_data)
 		return;
 	}
 	if (vmlinuz_header_size) {
-		now = vmlinuz_header_address - g_preamble->body_load_address;
-		g_vmlinuz_header_size = vmlinuz_header_size;
-		g_vmlinuz_header_data = kernel_blob_data + now;
+		now = vmlinuz_header_address - kb->preamble->body_load_address;
+		kb->vmlinuz_header_size = vmlinuz_header_size;
+		kb->vmlinuz_header_data = kernel_blob_data + now;
 
 		Debug("vmlinuz_header_size     = 0x%" PRIx64 "\n",
-		      g_vmlinuz_header_size);
+		      kb->vmlinuz_header_size);
 		Debug("vmlinuz_header_ofs      = 0x%" PRIx64 "\n", now);
 	}
 
 	/* Where does the bootloader stub begin? */
-	now = g_preamble->bootloader_address - g_preamble->body_load_address;
+	now = kb->preamble->bootloader_address - kb->preamble->body_load_address;
 
 	/* Bootloader is at the end */
-	g_bootloader_size = g_preamble->bootloader_size;
-	g_bootloader_data = kernel_blob_data + now;
+	kb->bootloader_size = kb->preamble->bootloader_size;
+	kb->bootloader_data = kernel_blob_data + now;
 	/* TODO: What to do if this is beyond the end of the blob? */
 
-	Debug("bootloader_size     = 0x%" PRIx64 "\n", g_bootloader_size);
+	Debug("bootloader_size     = 0x%" PRIx64 "\n", kb->bootloader_size);
 	Debug("bootloader_ofs      = 0x%" PRIx64 "\n", now);
 
 	/* Before that is the params */
 	now -= CROS_PARAMS_SIZE;
-	g_param_size = CROS_PARAMS_SIZE;
-	g_param_data = kernel_blob_data + now;
+	kb->param_size = CROS_PARAMS_SIZE;
+	kb->param_data = kernel_blob_data + now;
 	Debug("param_ofs           = 0x%" PRIx64 "\n", now);
 
 	/* Before that is the config */
 	now -= CROS_CONFIG_SIZE;
-	g_config_size = CROS_CONFIG_SIZE;
-	g_config_data = kernel_blob_data + now;
+	kb->config_size = CROS_CONFIG_SIZE;
+	kb->config_data = kernel_blob_data + now;
 	Debug("config_ofs          = 0x%" PRIx64 "\n", now);
 
 	/* The kernel starts at offset 0 and extends up to the config */
-	g_kernel_data = kernel_blob_data;
-	g_kernel_size = now;
-	Debug("kernel_size         = 0x%" PRIx64 "\n", g_kernel_size);
+	kb->kernel_data = kernel_blob_data;
+	kb->kernel_size = now;
+	Debug("kernel_size         = 0x%" PRIx64 "\n", kb->kernel_size);
 }
 
 
 /* Replaces the config section of the specified kernel blob.
  * Return nonzero on error. */
-int UpdateKernelBlobConfig(uint8_t *kblob_data, uint64_t kblob_size,
+int UpdateKernelBlobConfig(struct kernel_blob_ctx_s *kb,
+			   uint8_t *kblob_data, uint64_t kblob_size,
 			   uint8_t *config_data, uint64_t config_size)
 {
 	/* We should have already examined this blob. If not, we could do it
 	 * again, but it's more likely due to an error. */
-	if (kblob_data != g_kernel_blob_data ||
-	    kblob_size != g_kernel_blob_size) {
+	if (kblob_data != kb->kernel_blob_data ||
+	    kblob_size != kb->kernel_blob_size) {
 		fprintf(stderr, "Trying to update some other blob\n");
 		return -1;
 	}
 
-	Memset(g_config_data, 0, g_config_size);
-	Memcpy(g_config_data, config_data, config_size);
+	Memset(kb->config_data, 0, kb->config_size);
+	Memcpy(kb->config_data, config_data, config_size);
 
 	return 0;
 }
 
 /* Split a kernel partition into separate vblock and blob parts. */
-uint8_t *UnpackKPart(uint8_t *kpart_data, uint64_t kpart_size,
+uint8_t *UnpackKPart(struct kernel_blob_ctx_s *kb,
+		     uint8_t *kpart_data, uint64_t kpart_size,
 		     uint64_t padding,
 		     VbKeyBlockHeader **keyblock_ptr,
 		     VbKernelPreambleHeader **preamble_ptr,
@@ -325,7 +308,7 @@ uint8_t *UnpackKPart(uint8_t *kpart_data, uint64_t kpart_size,
 	}
 
 	/* LGTM */
-	g_keyblock = keyblock;
+	kb->keyblock = keyblock;
 
 	/* And the preamble */
 	preamble = (VbKernelPreambleHeader *)(kpart_data + now);
@@ -353,8 +336,8 @@ uint8_t *UnpackKPart(uint8_t *kpart_data, uint64_t kpart_size,
 		flags = preamble->flags;
 	Debug(" flags = 0x%" PRIx32 "\n", flags);
 
-	g_preamble = preamble;
-	g_ondisk_bootloader_addr = g_preamble->bootloader_address;
+	kb->preamble = preamble;
+	kb->ondisk_bootloader_addr = kb->preamble->bootloader_address;
 
 	if (VbGetKernelVmlinuzHeader(preamble,
 				     &vmlinuz_header_address,
@@ -368,77 +351,386 @@ uint8_t *UnpackKPart(uint8_t *kpart_data, uint64_t kpart_size,
 		      vmlinuz_header_address);
 		Debug(" vmlinuz_header_size = 0x%" PRIx64 "\n",
 		      vmlinuz_header_size);
-		g_ondisk_vmlinuz_header_addr = vmlinuz_header_address;
+		kb->ondisk_vmlinuz_header_addr = vmlinuz_header_address;
 	}
 
 	Debug("kernel blob is at offset 0x%" PRIx64 "\n", now);
-	g_kernel_blob_data = kpart_data + now;
-	g_kernel_blob_size = preamble->body_signature.data_size;
+	kb->kernel_blob_data = kpart_data + now;
+	kb->kernel_blob_size = preamble->body_signature.data_size;
 
 	/* Sanity check */
-	if (g_kernel_blob_size < preamble->body_signature.data_size)
+	if (kb->kernel_blob_size < preamble->body_signature.data_size)
 		fprintf(stderr,
 			"Warning: kernel file only has 0x%" PRIx64 " bytes\n",
-			g_kernel_blob_size);
+			kb->kernel_blob_size);
 
 	/* Update the blob pointers */
-	UnpackKernelBlob(g_kernel_blob_data);
+	UnpackKernelBlob(kb, kb->kernel_blob_data);
 
 	if (keyblock_ptr)
 		*keyblock_ptr = keyblock;
 	if (preamble_ptr)
 		*preamble_ptr = preamble;
 	if (blob_size_ptr)
-		*blob_size_ptr = g_kernel_blob_size;
+		*blob_size_ptr = kb->kernel_blob_size;
 
-	return g_kernel_blob_data;
+	return kb->kernel_blob_data;
 }
 
-uint8_t *SignKernelBlob(uint8_t *kernel_blob, uint64_t kernel_size,
+/* Wrap a kernel blob's body signature up into a vblock */
+static uint8_t *CreateKernelVblock(struct kernel_blob_ctx_s *kb,
+				   VbSignature *body_sig, uint64_t padding,
+				   int version,
+				   uint64_t kernel_body_load_address,
+				   VbKeyBlockHeader *keyblock,
+				   VbPrivateKey *signpriv_key,
+				   uint32_t flags, uint64_t *vblock_size_ptr)
+{
+	uint64_t min_size = padding > keyblock->key_block_size
+		? padding - keyblock->key_block_size : 0;
+	uint8_t *outbuf;
+	uint64_t outsize;
+
+	/* The preamble is built straight into the vblock, after the keyblock */
+	outsize = keyblock->key_block_size +
+		KernelPreambleSize(body_sig, min_size, signpriv_key);
+	outbuf = malloc(outsize);
+	if (!outbuf) {
+		fprintf(stderr, "Couldn't allocate 0x%" PRIx64 " bytes\n",
+			outsize);
+		return 0;
+	}
+	Memcpy(outbuf, keyblock, keyblock->key_block_size);
+
+	if (CreateKernelPreambleInto(version,
+				     kernel_body_load_address,
+				     kb->ondisk_bootloader_addr,
+				     kb->bootloader_size,
+				     body_sig,
+				     kb->ondisk_vmlinuz_header_addr,
+				     kb->vmlinuz_header_size,
+				     flags,
+				     min_size,
+				     signpriv_key,
+				     (VbKernelPreambleHeader *)
+				     (outbuf + keyblock->key_block_size),
+				     outsize - keyblock->key_block_size)) {
+		fprintf(stderr, "Error creating preamble.\n");
+		free(outbuf);
+		return 0;
+	}
+
+	if (vblock_size_ptr)
+		*vblock_size_ptr = outsize;
+	return outbuf;
+}
+
+uint8_t *SignKernelBlob(struct kernel_blob_ctx_s *kb,
+			uint8_t *kernel_blob, uint64_t kernel_size,
 			uint64_t padding,
 			int version, uint64_t kernel_body_load_address,
 			VbKeyBlockHeader *keyblock, VbPrivateKey *signpriv_key,
 			uint32_t flags, uint64_t *vblock_size_ptr)
 {
 	VbSignature *body_sig;
-	VbKernelPreambleHeader *preamble;
-	uint64_t min_size = padding > keyblock->key_block_size
-		? padding - keyblock->key_block_size : 0;
-	void *outbuf;
-	uint64_t outsize;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	DigestContext ctx;
+	uint8_t *outbuf;
 
 	/* Sign the kernel data */
-	body_sig = CalculateSignature(kernel_blob, kernel_size, signpriv_key);
+	DigestInit(&ctx, signpriv_key->algorithm);
+	DigestUpdate(&ctx, kernel_blob, kernel_size);
+	DigestFinalInto(&ctx, digest);
+	body_sig = CalculateSignatureForDigest(digest, kernel_size,
+					       signpriv_key);
 	if (!body_sig) {
 		fprintf(stderr, "Error calculating body signature\n");
 		return NULL;
 	}
+	futil_signed_digest_add(body_sig, digest, signpriv_key->algorithm);
 
-	/* Create preamble */
-	preamble = CreateKernelPreamble(version,
-					kernel_body_load_address,
-					g_ondisk_bootloader_addr,
-					g_bootloader_size,
-					body_sig,
-					g_ondisk_vmlinuz_header_addr,
-					g_vmlinuz_header_size,
-					flags,
-					min_size,
-					signpriv_key);
-	if (!preamble) {
-		fprintf(stderr, "Error creating preamble.\n");
-		return 0;
+	outbuf = CreateKernelVblock(kb, body_sig, padding, version,
+				    kernel_body_load_address, keyblock,
+				    signpriv_key, flags, vblock_size_ptr);
+	free(body_sig);
+	return outbuf;
+}
+
+/*
+ * The hash cache remembers the hash state of the part of each kernel blob
+ * that comes before the config, so updating just the config doesn't mean
+ * rehashing the whole kernel. Entries are named after the body signature
+ * they lead to, and are only trusted if they reproduce it.
+ */
+#define KHASH_MAGIC 0x3163686b			/* "khc1" */
+
+struct khash_entry_s {
+	uint32_t magic;
+	uint32_t ctx_size;
+	uint64_t algorithm;
+	uint64_t prefix_size;
+	DigestContext ctx;
+};
+
+/* Returns the cache entry path for a body signature. Caller must free it. */
+static char *khash_path(const char *dir, const VbSignature *sig)
+{
+	uint8_t id[SHA256_DIGEST_SIZE];
+
+	internal_SHA256(GetSignatureDataC(sig), sig->sig_size, id);
+	return futil_cache_path(dir, id, sizeof(id));
+}
+
+/* Find the prefix hash state for the blob we've unpacked. Returns zero if
+ * there is one and it's good for signing with [algorithm]. */
+static int khash_load(const struct kernel_blob_ctx_s *kb, const char *dir,
+		      uint64_t prefix_size, uint64_t algorithm,
+		      DigestContext *ctx)
+{
+	const VbSignature *sig = &kb->preamble->body_signature;
+	const VbPublicKey *key = &kb->keyblock->data_key;
+	const RSAPublicKey *rsa;
+	struct khash_entry_s e;
+	DigestContext tmp;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	char *path;
+	FILE *fp;
+	int ok;
+
+	if (key->algorithm >= kNumAlgorithms ||
+	    hash_type_map[key->algorithm] != hash_type_map[algorithm])
+		return 1;
+
+	path = khash_path(dir, sig);
+	if (!path)
+		return 1;
+	fp = fopen(path, "rb");
+	free(path);
+	if (!fp)
+		return 1;
+	ok = 1 == fread(&e, sizeof(e), 1, fp);
+	fclose(fp);
+	if (!ok || e.magic != KHASH_MAGIC || e.ctx_size != sizeof(e.ctx) ||
+	    e.prefix_size != prefix_size || e.algorithm >= kNumAlgorithms ||
+	    hash_type_map[e.algorithm] != hash_type_map[algorithm] ||
+	    e.ctx.algorithm != hash_type_map[algorithm])
+		return 1;
+
+	/* Make sure it really does lead to the current body signature */
+	tmp = e.ctx;
+	DigestUpdate(&tmp, kb->kernel_blob_data + prefix_size,
+		     kb->kernel_blob_size - prefix_size);
+	DigestFinalInto(&tmp, digest);
+	rsa = RSAKeyCacheGet(futil_rsa_cache(), key);
+	if (!rsa || 0 != VerifyDigest(digest, sig, rsa)) {
+		Debug("stale hash cache entry\n");
+		return 1;
 	}
 
-	outsize = keyblock->key_block_size + preamble->preamble_size;
-	outbuf = malloc(outsize);
-	Memset(outbuf, 0, outsize);
-	Memcpy(outbuf, keyblock, keyblock->key_block_size);
-	Memcpy(outbuf + keyblock->key_block_size,
-	       preamble, preamble->preamble_size);
+	*ctx = e.ctx;
+	return 0;
+}
 
-	if (vblock_size_ptr)
-		*vblock_size_ptr = outsize;
+/* Remember the prefix hash state for a new body signature */
+static void khash_save(const char *dir, const VbSignature *sig,
+		       uint64_t algorithm, uint64_t prefix_size,
+		       const DigestContext *ctx)
+{
+	struct khash_entry_s e;
+	char *path;
+
+	memset(&e, 0, sizeof(e));
+	e.magic = KHASH_MAGIC;
+	e.ctx_size = sizeof(e.ctx);
+	e.algorithm = algorithm;
+	e.prefix_size = prefix_size;
+	e.ctx = *ctx;
+
+	path = khash_path(dir, sig);
+	if (!path)
+		return;
+	futil_cache_write(path, &e, sizeof(e));
+	free(path);
+}
+
+uint8_t *ResignKernelBlob(struct kernel_blob_ctx_s *kb,
+			  uint8_t *kblob_data, uint64_t kblob_size,
+			  uint8_t *config_data, uint64_t config_size,
+			  const char *cache_dir, uint64_t padding,
+			  int version, uint64_t kernel_body_load_address,
+			  VbKeyBlockHeader *keyblock, VbPrivateKey *signpriv_key,
+			  uint32_t flags, uint64_t *vblock_size_ptr)
+{
+	DigestContext prefix_ctx, ctx;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	VbSignature *body_sig;
+	uint8_t *outbuf;
+	uint64_t prefix_size;
+	int hit = 0;
+
+	/* We should have already examined this blob. */
+	if (kblob_data != kb->kernel_blob_data ||
+	    kblob_size != kb->kernel_blob_size) {
+		fprintf(stderr, "Trying to resign some other blob\n");
+		return NULL;
+	}
+
+	/* Everything before the config stays the same */
+	prefix_size = kb->config_data - kb->kernel_blob_data;
+	if (prefix_size > kblob_size)
+		prefix_size = 0;
+
+	/* The old blob is needed to check the cache, so do that first */
+	if (cache_dir && prefix_size)
+		hit = !khash_load(kb, cache_dir, prefix_size,
+				  signpriv_key->algorithm, &prefix_ctx);
+	Debug("hash cache %s\n", !cache_dir ? "unused" : hit ? "hit" : "miss");
+
+	if (config_data &&
+	    0 != UpdateKernelBlobConfig(kb, kblob_data, kblob_size,
+					config_data, config_size)) {
+		fprintf(stderr, "Unable to update config\n");
+		return NULL;
+	}
+
+	if (!hit) {
+		DigestInit(&prefix_ctx, signpriv_key->algorithm);
+		DigestUpdate(&prefix_ctx, kblob_data, prefix_size);
+	}
+	ctx = prefix_ctx;
+	DigestUpdate(&ctx, kblob_data + prefix_size, kblob_size - prefix_size);
+	DigestFinalInto(&ctx, digest);
+
+	/* Sign the kernel data */
+	body_sig = CalculateSignatureForDigest(digest, kblob_size,
+					       signpriv_key);
+	if (!body_sig) {
+		fprintf(stderr, "Error calculating body signature\n");
+		return NULL;
+	}
+	futil_signed_digest_add(body_sig, digest, signpriv_key->algorithm);
+	if (cache_dir && prefix_size)
+		khash_save(cache_dir, body_sig, signpriv_key->algorithm,
+			   prefix_size, &prefix_ctx);
+
+	outbuf = CreateKernelVblock(kb, body_sig, padding, version,
+				    kernel_body_load_address, keyblock,
+				    signpriv_key, flags, vblock_size_ptr);
+	free(body_sig);
+	return outbuf;
+}
+
+uint8_t *ResignKernelPartFd(struct kernel_blob_ctx_s *kb, int fd,
+			    uint64_t body_offset, uint64_t body_size,
+			    uint64_t padding, int version,
+			    uint64_t kernel_body_load_address,
+			    VbKeyBlockHeader *keyblock,
+			    VbPrivateKey *signpriv_key,
+			    uint32_t flags, uint64_t *vblock_size_ptr)
+{
+	DigestContext ctx;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	VbSignature *body_sig;
+	uint8_t *outbuf;
+
+	DigestInit(&ctx, signpriv_key->algorithm);
+	if (DigestFileRegion(&ctx, fd, body_offset, body_size, NULL, NULL)) {
+		fprintf(stderr, "Unable to read kernel body\n");
+		return NULL;
+	}
+	DigestFinalInto(&ctx, digest);
+
+	body_sig = CalculateSignatureForDigest(digest, body_size,
+					       signpriv_key);
+	if (!body_sig) {
+		fprintf(stderr, "Error calculating body signature\n");
+		return NULL;
+	}
+	futil_signed_digest_add(body_sig, digest, signpriv_key->algorithm);
+
+	outbuf = CreateKernelVblock(kb, body_sig, padding, version,
+				    kernel_body_load_address, keyblock,
+				    signpriv_key, flags, vblock_size_ptr);
+	free(body_sig);
+	return outbuf;
+}
+
+/*
+ * Recovers the body digest of the blob we've unpacked from its body
+ * signature, once the keyblock checks out against [trusted_key] and the
+ * preamble against the keyblock. Returns zero if it did and the digest is
+ * good for signing with [algorithm].
+ */
+static int recover_body_digest(const struct kernel_blob_ctx_s *kb,
+			       uint64_t body_avail,
+			       const VbPublicKey *trusted_key,
+			       uint64_t algorithm, uint8_t *digest)
+{
+	const VbKeyBlockHeader *keyblock = kb->keyblock;
+	const VbPublicKey *key = &keyblock->data_key;
+	const VbSignature *sig = &kb->preamble->body_signature;
+	const RSAPublicKey *rsa;
+	uint64_t vblock_size = kb->kernel_blob_data - (uint8_t *)keyblock;
+
+	if (KeyBlockVerifyCached(keyblock, vblock_size, trusted_key, 0,
+				 futil_rsa_cache())) {
+		Debug("keyblock isn't signed by the old key\n");
+		return 1;
+	}
+	if (key->algorithm >= kNumAlgorithms ||
+	    hash_type_map[key->algorithm] != hash_type_map[algorithm]) {
+		Debug("old and new keys hash differently\n");
+		return 1;
+	}
+	rsa = RSAKeyCacheGet(futil_rsa_cache(), key);
+	if (!rsa || VerifyKernelPreamble(kb->preamble,
+					 vblock_size - keyblock->key_block_size,
+					 rsa)) {
+		Debug("preamble doesn't verify\n");
+		return 1;
+	}
+	if (sig->data_size != kb->kernel_blob_size ||
+	    sig->data_size > body_avail) {
+		Debug("body isn't the size the preamble says\n");
+		return 1;
+	}
+	if (!RSARecoverDigest(rsa, GetSignatureDataC(sig), sig->sig_size,
+			      key->algorithm, digest)) {
+		Debug("can't recover the body digest\n");
+		return 1;
+	}
+	return 0;
+}
+
+uint8_t *ResignKernelRecovered(struct kernel_blob_ctx_s *kb,
+			       uint64_t body_avail,
+			       const VbPublicKey *trusted_key,
+			       uint64_t padding, int version,
+			       uint64_t kernel_body_load_address,
+			       VbKeyBlockHeader *keyblock,
+			       VbPrivateKey *signpriv_key,
+			       uint32_t flags, uint64_t *vblock_size_ptr)
+{
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	VbSignature *body_sig;
+	uint8_t *outbuf;
+
+	if (recover_body_digest(kb, body_avail, trusted_key,
+				signpriv_key->algorithm, digest))
+		return NULL;
+
+	body_sig = CalculateSignatureForDigest(digest, kb->kernel_blob_size,
+					       signpriv_key);
+	if (!body_sig) {
+		fprintf(stderr, "Error calculating body signature\n");
+		return NULL;
+	}
+	futil_signed_digest_add(body_sig, digest, signpriv_key->algorithm);
+
+	outbuf = CreateKernelVblock(kb, body_sig, padding, version,
+				    kernel_body_load_address, keyblock,
+				    signpriv_key, flags, vblock_size_ptr);
+	free(body_sig);
 	return outbuf;
 }
 
@@ -447,51 +739,29 @@ int WriteSomeParts(const char *outfile,
 		   void *part1_data, uint64_t part1_size,
 		   void *part2_data, uint64_t part2_size)
 {
-	FILE *f;
+	struct iovec iov[2] = {
+		{ part1_data, part1_data ? part1_size : 0 },
+		{ part2_data, part2_data ? part2_size : 0 },
+	};
 
 	/* Write the output file */
 	Debug("writing %s with 0x%" PRIx64 ", 0x%" PRIx64 "\n",
 	      outfile, part1_size, part2_size);
 
-	f = fopen(outfile, "wb");
-	if (!f) {
-		fprintf(stderr, "Can't open output file %s: %s\n",
-			outfile, strerror(errno));
+	if (FILE_ERR_NONE != futil_write_iov(outfile, iov, ARRAY_SIZE(iov)))
 		return -1;
-	}
-
-	if (part1_data && part1_size) {
-		if (1 != fwrite(part1_data, part1_size, 1, f)) {
-			fprintf(stderr, "Can't write output file %s: %s\n",
-				outfile, strerror(errno));
-			fclose(f);
-			unlink(outfile);
-			return -1;
-		}
-	}
-
-	if (part2_data && part2_size) {
-		if (1 != fwrite(part2_data, part2_size, 1, f)) {
-			fprintf(stderr, "Can't write output file %s: %s\n",
-				outfile, strerror(errno));
-			fclose(f);
-			unlink(outfile);
-			return -1;
-		}
-	}
-
-	fclose(f);
 
 	/* Success */
 	return 0;
 }
 
 /* Returns 0 on success */
-int VerifyKernelBlob(uint8_t *kernel_blob,
-		     uint64_t kernel_size,
-		     VbPublicKey *signpub_key,
-		     const char *keyblock_outfile,
-		     uint64_t min_version)
+/* Check and describe the keyblock and preamble found by UnpackKPart(). On
+ * success, returns zero and the data key to check the body with. */
+static int VerifyKernelHeaders(struct kernel_blob_ctx_s *kb,
+			       VbPublicKey *signpub_key,
+			       const char *keyblock_outfile,
+			       uint64_t min_version, RSAPublicKey **rsa_ptr)
 {
 	VbPublicKey *data_key;
 	RSAPublicKey *rsa;
@@ -499,27 +769,27 @@ int VerifyKernelBlob(uint8_t *kernel_blob,
 	uint64_t vmlinuz_header_size = 0;
 	uint64_t vmlinuz_header_address = 0;
 
-	if (0 != KeyBlockVerify(g_keyblock, g_keyblock->key_block_size,
+	if (0 != KeyBlockVerify(kb->keyblock, kb->keyblock->key_block_size,
 				signpub_key, (0 == signpub_key))) {
 		fprintf(stderr, "Error verifying key block.\n");
 		goto done;
 	}
 
 	printf("Key block:\n");
-	data_key = &g_keyblock->data_key;
+	data_key = &kb->keyblock->data_key;
 	printf("  Signature:           %s\n",
 	       signpub_key ? "valid" : "ignored");
 	printf("  Size:                0x%" PRIx64 "\n",
-	       g_keyblock->key_block_size);
+	       kb->keyblock->key_block_size);
 	printf("  Flags:               %" PRIu64 " ",
-	       g_keyblock->key_block_flags);
-	if (g_keyblock->key_block_flags & KEY_BLOCK_FLAG_DEVELOPER_0)
+	       kb->keyblock->key_block_flags);
+	if (kb->keyblock->key_block_flags & KEY_BLOCK_FLAG_DEVELOPER_0)
 		printf(" !DEV");
-	if (g_keyblock->key_block_flags & KEY_BLOCK_FLAG_DEVELOPER_1)
+	if (kb->keyblock->key_block_flags & KEY_BLOCK_FLAG_DEVELOPER_1)
 		printf(" DEV");
-	if (g_keyblock->key_block_flags & KEY_BLOCK_FLAG_RECOVERY_0)
+	if (kb->keyblock->key_block_flags & KEY_BLOCK_FLAG_RECOVERY_0)
 		printf(" !REC");
-	if (g_keyblock->key_block_flags & KEY_BLOCK_FLAG_RECOVERY_1)
+	if (kb->keyblock->key_block_flags & KEY_BLOCK_FLAG_RECOVERY_1)
 		printf(" REC");
 	printf("\n");
 	printf("  Data key algorithm:  %" PRIu64 " %s\n", data_key->algorithm,
@@ -538,7 +808,7 @@ int VerifyKernelBlob(uint8_t *kernel_blob,
 				keyblock_outfile, strerror(errno));
 			goto done;
 		}
-		if (1 != fwrite(g_keyblock, g_keyblock->key_block_size, 1, f)) {
+		if (1 != fwrite(kb->keyblock, kb->keyblock->key_block_size, 1, f)) {
 			fprintf(stderr, "Can't write key block file %s: %s\n",
 				keyblock_outfile, strerror(errno));
 			fclose(f);
@@ -561,30 +831,30 @@ int VerifyKernelBlob(uint8_t *kernel_blob,
 	}
 
 	/* Verify preamble */
-	if (0 != VerifyKernelPreamble(g_preamble,
-				      g_preamble->preamble_size, rsa)) {
+	if (0 != VerifyKernelPreamble(kb->preamble,
+				      kb->preamble->preamble_size, rsa)) {
 		fprintf(stderr, "Error verifying preamble.\n");
 		goto done;
 	}
 
 	printf("Preamble:\n");
 	printf("  Size:                0x%" PRIx64 "\n",
-	       g_preamble->preamble_size);
+	       kb->preamble->preamble_size);
 	printf("  Header version:      %" PRIu32 ".%" PRIu32 "\n",
-	       g_preamble->header_version_major,
-	       g_preamble->header_version_minor);
+	       kb->preamble->header_version_major,
+	       kb->preamble->header_version_minor);
 	printf("  Kernel version:      %" PRIu64 "\n",
-	       g_preamble->kernel_version);
+	       kb->preamble->kernel_version);
 	printf("  Body load address:   0x%" PRIx64 "\n",
-	       g_preamble->body_load_address);
+	       kb->preamble->body_load_address);
 	printf("  Body size:           0x%" PRIx64 "\n",
-	       g_preamble->body_signature.data_size);
+	       kb->preamble->body_signature.data_size);
 	printf("  Bootloader address:  0x%" PRIx64 "\n",
-	       g_preamble->bootloader_address);
+	       kb->preamble->bootloader_address);
 	printf("  Bootloader size:     0x%" PRIx64 "\n",
-	       g_preamble->bootloader_size);
+	       kb->preamble->bootloader_size);
 
-	if (VbGetKernelVmlinuzHeader(g_preamble,
+	if (VbGetKernelVmlinuzHeader(kb->preamble,
 				     &vmlinuz_header_address,
 				     &vmlinuz_header_size)
 	    != VBOOT_SUCCESS) {
@@ -598,39 +868,152 @@ int VerifyKernelBlob(uint8_t *kernel_blob,
 		       vmlinuz_header_size);
 	}
 
-	if (VbKernelHasFlags(g_preamble) == VBOOT_SUCCESS)
+	if (VbKernelHasFlags(kb->preamble) == VBOOT_SUCCESS)
 		printf("  Flags          :       0x%" PRIx32 "\n",
-		       g_preamble->flags);
+		       kb->preamble->flags);
 
-	if (g_preamble->kernel_version < (min_version & 0xFFFF)) {
+	if (kb->preamble->kernel_version < (min_version & 0xFFFF)) {
 		fprintf(stderr,
 			"Kernel version %" PRIu64 " is lower than minimum %"
-			PRIu64 ".\n", g_preamble->kernel_version,
+			PRIu64 ".\n", kb->preamble->kernel_version,
 			(min_version & 0xFFFF));
 		goto done;
 	}
 
+	*rsa_ptr = rsa;
+	rv = 0;
+done:
+	return rv;
+}
+
+int VerifyKernelBlob(struct kernel_blob_ctx_s *kb,
+		     uint8_t *kernel_blob,
+		     uint64_t kernel_size,
+		     VbPublicKey *signpub_key,
+		     const char *keyblock_outfile,
+		     uint64_t min_version)
+{
+	RSAPublicKey *rsa;
+
+	if (VerifyKernelHeaders(kb, signpub_key, keyblock_outfile, min_version,
+				&rsa))
+		return -1;
+
 	/* Verify body */
 	if (0 != VerifyData(kernel_blob, kernel_size,
-			    &g_preamble->body_signature, rsa)) {
+			    &kb->preamble->body_signature, rsa)) {
+		fprintf(stderr, "Error verifying kernel body.\n");
+		return -1;
+	}
+	printf("Body verification succeeded.\n");
+
+	printf("Config:\n%s\n", kernel_blob + KernelCmdLineOffset(kb->preamble));
+
+	return 0;
+}
+
+/* Where the kernel command line is, and somewhere to put it */
+struct config_grab_s {
+	uint64_t ofs;
+	uint8_t data[CROS_CONFIG_SIZE + 1];
+};
+
+static void grab_config(void *arg, uint64_t pos, const uint8_t *buf,
+			uint64_t len)
+{
+	struct config_grab_s *c = arg;
+	uint64_t from, to;
+
+	if (c->ofs >= pos + len || pos >= c->ofs + CROS_CONFIG_SIZE)
+		return;
+	from = c->ofs > pos ? c->ofs : pos;
+	to = c->ofs + CROS_CONFIG_SIZE;
+	if (to > pos + len)
+		to = pos + len;
+	memcpy(c->data + from - c->ofs, buf + from - pos, to - from);
+}
+
+int VerifyKernelPartFile(const char *filename, uint64_t padding,
+			 VbPublicKey *signpub_key,
+			 const char *keyblock_outfile,
+			 uint64_t min_version)
+{
+	struct kernel_blob_ctx_s ctx_kb, *kb = &ctx_kb;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	struct config_grab_s config;
+	uint64_t body_ofs, body_size;
+	uint8_t *vblock = NULL;
+	DigestContext ctx;
+	RSAPublicKey *rsa;
+	ssize_t got;
+	int fd, rv = -1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open file %s: %s\n", filename,
+			strerror(errno));
+		return -1;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	/* The keyblock and preamble both have to fit in the padding */
+	vblock = malloc(padding);
+	if (!vblock) {
+		fprintf(stderr, "Unable to allocate buffers\n");
+		goto done;
+	}
+	got = pread(fd, vblock, padding, 0);
+	if (got < 0 || (uint64_t)got != padding) {
+		fprintf(stderr, "%s is too small to be a valid kernel blob\n",
+			filename);
+		goto done;
+	}
+	memset(kb, 0, sizeof(*kb));
+	if (!UnpackKPart(kb, vblock, padding, padding, 0, 0, &body_size)) {
+		fprintf(stderr, "Unable to unpack kernel partition\n");
+		goto done;
+	}
+	body_ofs = kb->kernel_blob_data - vblock;
+	memset(&config, 0, sizeof(config));
+	config.ofs = KernelCmdLineOffset(kb->preamble);
+
+	if (VerifyKernelHeaders(kb, signpub_key, keyblock_outfile, min_version,
+				&rsa))
+		goto done;
+
+	/* Hash the body as it goes by, keeping only the config */
+	DigestInit(&ctx, rsa->algorithm);
+	if (DigestFileRegion(&ctx, fd, body_ofs, body_size,
+			     grab_config, &config)) {
+		fprintf(stderr, "Unable to read kernel body\n");
+		goto done;
+	}
+	DigestFinalInto(&ctx, digest);
+
+	if (0 != VerifyDigest(digest, &kb->preamble->body_signature, rsa)) {
 		fprintf(stderr, "Error verifying kernel body.\n");
 		goto done;
 	}
 	printf("Body verification succeeded.\n");
 
-	printf("Config:\n%s\n", kernel_blob + KernelCmdLineOffset(g_preamble));
+	printf("Config:\n%s\n", config.data);
 
 	rv = 0;
 done:
+	free(vblock);
+	close(fd);
 	return rv;
 }
 
 
-uint8_t *CreateKernelBlob(uint8_t *vmlinuz_buf, uint64_t vmlinuz_size,
+/* Work out the size and on-disk address of each part of a new kernel blob.
+ * Returns nonzero on error. */
+static int PlanKernelBlob(struct kernel_blob_ctx_s *kb,
+			  uint8_t *vmlinuz_buf, uint64_t vmlinuz_size,
 			  enum arch_t arch, uint64_t kernel_body_load_address,
-			  uint8_t *config_data, uint64_t config_size,
-			  uint8_t *bootloader_data, uint64_t bootloader_size,
-			  uint64_t *blob_size_ptr)
+			  uint64_t bootloader_size)
 {
 	uint64_t now = 0;
 	int tmp;
@@ -638,119 +1021,324 @@ uint8_t *CreateKernelBlob(uint8_t *vmlinuz_buf, uint64_t vmlinuz_size,
 	/* We have all the parts. How much room do we need? */
 	tmp = KernelSize(vmlinuz_buf, vmlinuz_size, arch);
 	if (tmp < 0)
-		return NULL;
-	g_kernel_size = tmp;
-	g_config_size = CROS_CONFIG_SIZE;
-	g_param_size = CROS_PARAMS_SIZE;
-	g_bootloader_size = roundup(bootloader_size, CROS_ALIGN);
-	g_vmlinuz_header_size = vmlinuz_size-g_kernel_size;
-	g_kernel_blob_size =
-		roundup(g_kernel_size, CROS_ALIGN) +
-		g_config_size                      +
-		g_param_size                       +
-		g_bootloader_size                  +
-		g_vmlinuz_header_size;
-	Debug("g_kernel_blob_size  0x%" PRIx64 "\n", g_kernel_blob_size);
-
-	/* Allocate space for the blob. */
-	g_kernel_blob_data = malloc(g_kernel_blob_size);
-	Memset(g_kernel_blob_data, 0, g_kernel_blob_size);
+		return -1;
+	kb->kernel_size = tmp;
+	kb->config_size = CROS_CONFIG_SIZE;
+	kb->param_size = CROS_PARAMS_SIZE;
+	kb->bootloader_size = roundup(bootloader_size, CROS_ALIGN);
+	kb->vmlinuz_header_size = vmlinuz_size-kb->kernel_size;
+	kb->kernel_blob_size =
+		roundup(kb->kernel_size, CROS_ALIGN) +
+		kb->config_size                      +
+		kb->param_size                       +
+		kb->bootloader_size                  +
+		kb->vmlinuz_header_size;
+	Debug("g_kernel_blob_size  0x%" PRIx64 "\n", kb->kernel_blob_size);
 
-	/* Assign the sub-pointers */
-	g_kernel_data = g_kernel_blob_data + now;
 	Debug("g_kernel_size       0x%" PRIx64 " ofs 0x%" PRIx64 "\n",
-	      g_kernel_size, now);
-	now += roundup(g_kernel_size, CROS_ALIGN);
+	      kb->kernel_size, now);
+	now += roundup(kb->kernel_size, CROS_ALIGN);
 
-	g_config_data = g_kernel_blob_data + now;
 	Debug("g_config_size       0x%" PRIx64 " ofs 0x%" PRIx64 "\n",
-	      g_config_size, now);
-	now += g_config_size;
+	      kb->config_size, now);
+	now += kb->config_size;
 
-	g_param_data = g_kernel_blob_data + now;
 	Debug("g_param_size        0x%" PRIx64 " ofs 0x%" PRIx64 "\n",
-	      g_param_size, now);
-	now += g_param_size;
+	      kb->param_size, now);
+	now += kb->param_size;
 
-	g_bootloader_data = g_kernel_blob_data + now;
 	Debug("g_bootloader_size   0x%" PRIx64 " ofs 0x%" PRIx64 "\n",
-	      g_bootloader_size, now);
-	g_ondisk_bootloader_addr = kernel_body_load_address + now;
+	      kb->bootloader_size, now);
+	kb->ondisk_bootloader_addr = kernel_body_load_address + now;
 	Debug("g_ondisk_bootloader_addr   0x%" PRIx64 "\n",
-	      g_ondisk_bootloader_addr);
-	now += g_bootloader_size;
+	      kb->ondisk_bootloader_addr);
+	now += kb->bootloader_size;
 
-	if (g_vmlinuz_header_size) {
-		g_vmlinuz_header_data = g_kernel_blob_data + now;
+	kb->ondisk_vmlinuz_header_addr = 0;
+	if (kb->vmlinuz_header_size) {
 		Debug("g_vmlinuz_header_size 0x%" PRIx64 " ofs 0x%" PRIx64 "\n",
-		      g_vmlinuz_header_size, now);
-		g_ondisk_vmlinuz_header_addr = kernel_body_load_address + now;
+		      kb->vmlinuz_header_size, now);
+		kb->ondisk_vmlinuz_header_addr = kernel_body_load_address + now;
 		Debug("g_ondisk_vmlinuz_header_addr   0x%" PRIx64 "\n",
-		      g_ondisk_vmlinuz_header_addr);
+		      kb->ondisk_vmlinuz_header_addr);
 	}
 
 	Debug("end of kern_blob at kern_blob+0x%" PRIx64 "\n", now);
+	return 0;
+}
+
+/*
+ * A new kernel blob, as a list of the pieces it's made of, in order. Only
+ * the config and params ([head], which PickApartVmlinuz() fills in) have to
+ * be built; the kernel, bootloader and vmlinuz header are used from where
+ * they already are, and the padding comes from a static block of zeros.
+ */
+#define KBLOB_SEGMENTS 6
+
+static void KernelBlobSegments(const struct kernel_blob_ctx_s *kb,
+			       uint8_t *vmlinuz_buf, uint8_t *head,
+			       uint8_t *bootloader_data,
+			       uint64_t bootloader_size,
+			       struct iovec seg[KBLOB_SEGMENTS])
+{
+	static const uint8_t zeros[CROS_ALIGN];
+
+	seg[0].iov_base = vmlinuz_buf + kb->vmlinuz_header_size;
+	seg[0].iov_len = kb->kernel_size;
+	seg[1].iov_base = (void *)zeros;
+	seg[1].iov_len = roundup(kb->kernel_size, CROS_ALIGN) - kb->kernel_size;
+	seg[2].iov_base = head;
+	seg[2].iov_len = kb->config_size + kb->param_size;
+	seg[3].iov_base = bootloader_data;
+	seg[3].iov_len = bootloader_size;
+	seg[4].iov_base = (void *)zeros;
+	seg[4].iov_len = kb->bootloader_size - bootloader_size;
+	seg[5].iov_base = vmlinuz_buf;
+	seg[5].iov_len = kb->vmlinuz_header_size;
+}
+
+uint8_t *CreateKernelBlob(struct kernel_blob_ctx_s *kb,
+			  uint8_t *vmlinuz_buf, uint64_t vmlinuz_size,
+			  enum arch_t arch, uint64_t kernel_body_load_address,
+			  uint8_t *config_data, uint64_t config_size,
+			  uint8_t *bootloader_data, uint64_t bootloader_size,
+			  uint64_t *blob_size_ptr)
+{
+	struct iovec seg[KBLOB_SEGMENTS];
+	uint8_t *p;
+	int i;
+
+	if (0 != PlanKernelBlob(kb, vmlinuz_buf, vmlinuz_size, arch,
+				kernel_body_load_address, bootloader_size))
+		return NULL;
 
-	/* Copy the kernel and params bits into the correct places */
-	if (0 != PickApartVmlinuz(vmlinuz_buf, vmlinuz_size,
+	/* Allocate space for the blob. Every byte of it gets written below,
+	 * so only the config and params need zeroing first. */
+	kb->kernel_blob_data = malloc(kb->kernel_blob_size);
+	if (!kb->kernel_blob_data)
+		return NULL;
+
+	/* Assign the sub-pointers */
+	kb->kernel_data = kb->kernel_blob_data;
+	kb->config_data = kb->kernel_data + roundup(kb->kernel_size, CROS_ALIGN);
+	kb->param_data = kb->config_data + kb->config_size;
+	kb->bootloader_data = kb->param_data + kb->param_size;
+	kb->vmlinuz_header_data = kb->vmlinuz_header_size ?
+		kb->bootloader_data + kb->bootloader_size : NULL;
+	Memset(kb->config_data, 0, kb->config_size + kb->param_size);
+
+	/* Build the params in place */
+	if (0 != PickApartVmlinuz(kb, vmlinuz_buf, vmlinuz_size,
 				  arch, kernel_body_load_address)) {
 		fprintf(stderr, "Error picking apart kernel file.\n");
-		free(g_kernel_blob_data);
-		g_kernel_blob_data = NULL;
-		g_kernel_blob_size = 0;
+		free(kb->kernel_blob_data);
+		kb->kernel_blob_data = NULL;
+		kb->kernel_blob_size = 0;
 		return NULL;
 	}
-
-	/* Copy the other bits too */
-	Memcpy(g_config_data, config_data, config_size);
-	Memcpy(g_bootloader_data, bootloader_data, bootloader_size);
-	if (g_vmlinuz_header_size) {
-		Memcpy(g_vmlinuz_header_data,
-		       vmlinuz_buf,
-		       g_vmlinuz_header_size);
+	Memcpy(kb->config_data, config_data, config_size);
+
+	/* Gather the rest around them, copying each byte of vmlinuz once */
+	KernelBlobSegments(kb, vmlinuz_buf, kb->config_data,
+			   bootloader_data, bootloader_size, seg);
+	for (p = kb->kernel_blob_data, i = 0; i < KBLOB_SEGMENTS; i++) {
+		if (p != seg[i].iov_base)
+			Memcpy(p, seg[i].iov_base, seg[i].iov_len);
+		p += seg[i].iov_len;
 	}
 
 	if (blob_size_ptr)
-		*blob_size_ptr = g_kernel_blob_size;
-	return g_kernel_blob_data;
+		*blob_size_ptr = kb->kernel_blob_size;
+	return kb->kernel_blob_data;
 }
 
-enum futil_file_type recognize_vblock1(uint8_t *buf, uint32_t len)
+int WriteKernelPart(const char *outfile,
+		    uint8_t *vmlinuz_buf, uint64_t vmlinuz_size,
+		    enum arch_t arch, uint64_t kernel_body_load_address,
+		    uint8_t *config_data, uint64_t config_size,
+		    uint8_t *bootloader_data, uint64_t bootloader_size,
+		    uint64_t padding, int version,
+		    VbKeyBlockHeader *keyblock, VbPrivateKey *signpriv_key,
+		    uint32_t flags, int vblockonly,
+		    const char *digest_cache, const char *vmlinuz_file)
+{
+	struct kernel_blob_ctx_s ctx_kb, *kb = &ctx_kb;
+	struct iovec iov[1 + KBLOB_SEGMENTS];
+	DigestContext ctx;
+	uint8_t digest[SHA512_DIGEST_SIZE];
+	VbSignature *body_sig;
+	uint8_t *head, *vblock_data = NULL;
+	uint64_t vblock_size;
+	int i, rv = -1;
+
+	memset(kb, 0, sizeof(*kb));
+	if (0 != PlanKernelBlob(kb, vmlinuz_buf, vmlinuz_size, arch,
+				kernel_body_load_address, bootloader_size))
+		return -1;
+
+	/* Only the config and params have to be built; the rest can be
+	 * written straight from where it already is. */
+	head = calloc(1, kb->config_size + kb->param_size);
+	if (!head)
+		return -1;
+	kb->config_data = head;
+	kb->param_data = head + kb->config_size;
+	if (0 != PickApartVmlinuz(kb, vmlinuz_buf, vmlinuz_size,
+				  arch, kernel_body_load_address)) {
+		fprintf(stderr, "Error picking apart kernel file.\n");
+		goto done;
+	}
+	Memcpy(kb->config_data, config_data, config_size);
+
+	/* Lay out the blob exactly as CreateKernelBlob() would */
+	KernelBlobSegments(kb, vmlinuz_buf, head,
+			   bootloader_data, bootloader_size, iov + 1);
+
+	/* Hash it piece by piece, and sign that */
+	futil_digest_region(digest_cache, vmlinuz_file, kb->vmlinuz_header_size,
+			    iov[1].iov_base, iov[1].iov_len,
+			    signpriv_key->algorithm, &ctx);
+	for (i = 2; i < ARRAY_SIZE(iov); i++)
+		DigestUpdate(&ctx, iov[i].iov_base, iov[i].iov_len);
+	DigestFinalInto(&ctx, digest);
+	body_sig = CalculateSignatureForDigest(digest, kb->kernel_blob_size,
+					       signpriv_key);
+	if (!body_sig) {
+		fprintf(stderr, "Error calculating body signature\n");
+		goto done;
+	}
+	futil_signed_digest_add(body_sig, digest, signpriv_key->algorithm);
+	vblock_data = CreateKernelVblock(kb, body_sig, padding, version,
+					 kernel_body_load_address, keyblock,
+					 signpriv_key, flags, &vblock_size);
+	free(body_sig);
+	if (!vblock_data)
+		goto done;
+	iov[0].iov_base = vblock_data;
+	iov[0].iov_len = vblock_size;
+
+	Debug("writing %s with 0x%" PRIx64 ", 0x%" PRIx64 "\n",
+	      outfile, vblock_size, vblockonly ? 0 : kb->kernel_blob_size);
+	if (FILE_ERR_NONE != futil_write_iov(outfile, iov,
+					     vblockonly ? 1 : ARRAY_SIZE(iov)))
+		goto done;
+	rv = 0;
+
+done:
+	free(vblock_data);
+	free(head);
+	return rv;
+}
+
+int FirmwarePreambleLooksOkay(const VbFirmwarePreambleHeader *preamble,
+			      uint64_t size)
+{
+	const VbSignature *sig = &preamble->preamble_signature;
+
+	/* What VerifyFirmwarePreamble() checks, less the signature */
+	if (size < EXPECTED_VBFIRMWAREPREAMBLEHEADER2_0_SIZE ||
+	    preamble->header_version_major !=
+	    FIRMWARE_PREAMBLE_HEADER_VERSION_MAJOR ||
+	    size < preamble->preamble_size ||
+	    VerifySignatureInside(preamble, preamble->preamble_size, sig) ||
+	    preamble->preamble_size < sig->data_size ||
+	    sig->data_size < sizeof(VbFirmwarePreambleHeader) ||
+	    VerifySignatureInside(preamble, sig->data_size,
+				  &preamble->body_signature) ||
+	    VerifyPublicKeyInside(preamble, sig->data_size,
+				  &preamble->kernel_subkey))
+		return 0;
+
+	if (preamble->header_version_minor >= 1 &&
+	    size < EXPECTED_VBFIRMWAREPREAMBLEHEADER2_1_SIZE)
+		return 0;
+
+	return 1;
+}
+
+int KernelPreambleLooksOkay(const VbKernelPreambleHeader *preamble,
+			    uint64_t size)
+{
+	const VbSignature *sig = &preamble->preamble_signature;
+
+	/* What VerifyKernelPreamble() checks, less the signature */
+	if (size < sizeof(VbKernelPreambleHeader) ||
+	    preamble->header_version_major !=
+	    KERNEL_PREAMBLE_HEADER_VERSION_MAJOR ||
+	    size < preamble->preamble_size ||
+	    VerifySignatureInside(preamble, preamble->preamble_size, sig) ||
+	    size < sig->data_size ||
+	    sig->data_size < sizeof(VbKernelPreambleHeader) ||
+	    VerifySignatureInside(preamble, sig->data_size,
+				  &preamble->body_signature))
+		return 0;
+
+	if ((preamble->header_version_minor == 1 &&
+	     size < EXPECTED_VBKERNELPREAMBLEHEADER2_1_SIZE) ||
+	    (preamble->header_version_minor == 2 &&
+	     size < EXPECTED_VBKERNELPREAMBLEHEADER2_2_SIZE))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Type detection goes by the shape of things only, so recognizing a file never
+ * costs an RSA verify. A keyblock followed by what looks like a preamble is
+ * taken to be one; the callbacks that report on it check the signatures.
+ */
+enum futil_file_type recognize_vblock1(uint8_t *buf, uint64_t len)
 {
 	VbKeyBlockHeader *key_block = (VbKeyBlockHeader *)buf;
-	VbPublicKey *pubkey = (VbPublicKey *)buf;
-	VbFirmwarePreambleHeader *fw_preamble;
-	VbKernelPreambleHeader *kern_preamble;
-	RSAPublicKey *rsa;
+	uint64_t more;
 
 	if (VBOOT_SUCCESS == KeyBlockVerify(key_block, len, NULL, 1)) {
-		rsa = PublicKeyToRSA(&key_block->data_key);
-		uint32_t more = key_block->key_block_size;
-
-		/* and firmware preamble too? */
-		fw_preamble = (VbFirmwarePreambleHeader *)(buf + more);
-		if (VBOOT_SUCCESS ==
-		    VerifyFirmwarePreamble(fw_preamble, len - more, rsa))
+		more = key_block->key_block_size;
+		if (FirmwarePreambleLooksOkay((VbFirmwarePreambleHeader *)
+					      (buf + more), len - more))
 			return FILE_TYPE_FW_PREAMBLE;
-
-		/* or maybe kernel preamble? */
-		kern_preamble = (VbKernelPreambleHeader *)(buf + more);
-		if (VBOOT_SUCCESS ==
-		    VerifyKernelPreamble(kern_preamble, len - more, rsa))
+		if (KernelPreambleLooksOkay((VbKernelPreambleHeader *)
+					    (buf + more), len - more))
 			return FILE_TYPE_KERN_PREAMBLE;
-
-		/* no, just keyblock */
 		return FILE_TYPE_KEYBLOCK;
 	}
 
 	/* Maybe just a VbPublicKey? */
-	if (PublicKeyLooksOkay(pubkey, len))
+	if (PublicKeyLooksOkay((VbPublicKey *)buf, len))
 		return FILE_TYPE_PUBKEY;
 
 	return FILE_TYPE_UNKNOWN;
 }
 
-enum futil_file_type recognize_privkey(uint8_t *buf, uint32_t len)
+/*
+ * Does [der] start with a DER SEQUENCE that's exactly [len] bytes long? This
+ * is all a .vbprivk holds after the algorithm, so it's checked before
+ * handing anything to libcrypto.
+ */
+static int is_der_sequence(const uint8_t *der, uint64_t len)
+{
+	uint64_t size = 0, hdr = 2;
+	int i, n;
+
+	if (len < 2 || der[0] != 0x30)
+		return 0;
+	if (der[1] < 0x80) {
+		size = der[1];
+	} else {
+		/* Long form, which DER only uses when it has to */
+		n = der[1] & 0x7f;
+		if (n < 1 || n > 4 || len < 2 + n || !der[2])
+			return 0;
+		for (i = 0; i < n; i++)
+			size = (size << 8) | der[2 + i];
+		if (size < 0x80)
+			return 0;
+		hdr += n;
+	}
+	return hdr + size == len;
+}
+
+enum futil_file_type recognize_privkey(uint8_t *buf, uint64_t len)
 {
 	VbPrivateKey key;
 	const unsigned char *start;
@@ -760,6 +1348,9 @@ enum futil_file_type recognize_privkey(uint8_t *buf, uint32_t len)
 
 	key.algorithm = *(typeof(key.algorithm) *)buf;
 	start = buf + sizeof(key.algorithm);
+	if (key.algorithm >= kNumAlgorithms ||
+	    !is_der_sequence(start, len - sizeof(key.algorithm)))
+		return FILE_TYPE_UNKNOWN;
 	key.rsa_private_key = d2i_RSAPrivateKey(NULL, &start,
 						len - sizeof(key.algorithm));
 
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2015 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Reading an image a window at a time, for when mapping all of it won't do:
+ * a multi-GB disk image doesn't fit in a 32-bit address space, and in a
+ * container with little memory every page of it that's been read counts.
+ * Only what the window covers is mapped, and whatever it slides past is
+ * dropped, so the address space and memory used stay bounded however big
+ * the image is.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "futility.h"
+
+/* Whole images only get mapped if there's room for them */
+#if UINTPTR_MAX <= 0xffffffff
+#define WINDOW_DEFAULT (256 << 20)
+#else
+#define WINDOW_DEFAULT 0
+#endif
+
+/* Anything smaller would mean sliding for every read */
+#define WINDOW_MIN (1 << 20)
+
+static uint64_t window_size = WINDOW_DEFAULT;
+
+int futil_set_window(const char *str)
+{
+	uint64_t val;
+
+	if (futil_parse_size(str, &val) || val < WINDOW_MIN || val > SIZE_MAX)
+		return 1;
+	window_size = val;
+	return 0;
+}
+
+uint64_t futil_window_size(void)
+{
+	return window_size;
+}
+
+uint64_t futil_window_clamp(uint64_t len)
+{
+	return window_size && len > window_size ? window_size : len;
+}
+
+int futil_window_wanted(int fd)
+{
+	struct stat sb;
+
+	if (!window_size || futil_fstat(fd, &sb))
+		return 0;
+	return (S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode)) &&
+		(uint64_t)sb.st_size > window_size;
+}
+
+enum futil_file_err futil_window_open(struct futil_window_s *win, int fd)
+{
+	struct stat sb;
+
+	memset(win, 0, sizeof(*win));
+	if (futil_fstat(fd, &sb)) {
+		fprintf(stderr, "Can't stat input file: %s\n",
+			strerror(errno));
+		return FILE_ERR_STAT;
+	}
+	win->fd = fd;
+	win->len = sb.st_size;
+	return FILE_ERR_NONE;
+}
+
+/* Unmaps what's mapped, and lets the page cache forget it too */
+static void window_drop(struct futil_window_s *win)
+{
+	if (!win->map)
+		return;
+	munmap(win->map, win->map_len);
+	posix_fadvise(win->fd, win->map_offset, win->map_len,
+		      POSIX_FADV_DONTNEED);
+	win->map = NULL;
+}
+
+uint8_t *futil_window_get(struct futil_window_s *win, uint64_t offset,
+			  uint64_t len)
+{
+	static long page_size;
+	uint64_t start, map_len;
+	void *ptr;
+
+	if (offset > win->len || len > win->len - offset ||
+	    len > window_size) {
+		fprintf(stderr, "Can't read 0x%" PRIx64 " bytes at 0x%" PRIx64
+			" through the window\n", len, offset);
+		return NULL;
+	}
+
+	if (win->map && offset >= win->map_offset &&
+	    offset + len <= win->map_offset + win->map_len)
+		return win->map + (offset - win->map_offset);
+
+	window_drop(win);
+
+	/* A whole window from the page the range starts in, if there is one */
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+	start = offset & ~(uint64_t)(page_size - 1);
+	map_len = win->len - start < window_size ? win->len - start :
+		window_size;
+	if (map_len < offset + len - start)
+		map_len = offset + len - start;
+	if (!map_len)
+		map_len = 1;
+
+	ptr = mmap(0, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		   win->fd, start);
+	if (ptr == MAP_FAILED) {
+		fprintf(stderr, "Can't mmap input file: %s\n",
+			strerror(errno));
+		return NULL;
+	}
+	futil_advise(ptr, map_len, MADV_SEQUENTIAL);
+
+	win->map = ptr;
+	win->map_offset = start;
+	win->map_len = map_len;
+	return win->map + (offset - start);
+}
+
+void futil_window_close(struct futil_window_s *win)
+{
+	window_drop(win);
+}
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Copyright 2015 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# "futility create" makes keypairs that sign and verify, one at a time or
+# in a batch, and a keypair that can't be made fails only itself.
+#
+# Usage: create_test.sh FUTILITY
+
+F=$(realpath "$1")
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+"$F" synth --types keys,kernel --bits 1024 --sign-bits 1024 \
+	--kernel-size 64K . >/dev/null 2>&1 || fail "synth"
+K=keys/rsa1024
+
+# One from a .pem, which should be the same key synth wrote
+"$F" create $K/kernel_data_key.pem data 2>/dev/null || fail "create"
+cmp data.vbprivk $K/kernel_data_key.vbprivk ||
+	fail "the private key isn't the one in the .pem"
+cmp data.vbpubk $K/kernel_data_key.vbpubk ||
+	fail "the public key isn't the one in the .pem"
+
+# New ones, used to sign a kernel
+"$F" create --generate 2 --bits 1024 --hash_alg sha512 new >gen.out ||
+	fail "create --generate"
+grep -q "^Created 2 of 2 keypairs" gen.out || fail "the summary is wrong"
+"$F" vbutil_keyblock --pack new.keyblock --datapubkey new_1.vbpubk \
+	--signprivate new_2.vbprivk >/dev/null || fail "packing a keyblock"
+"$F" sign -s new_1.vbprivk -b new.keyblock kernel-0000.bin new.bin ||
+	fail "signing with the new keys"
+"$F" verify --publickey new_2.vbpubk new.bin >/dev/null ||
+	fail "the kernel signed with the new keys doesn't verify"
+
+# A batch with keypairs that can't be made
+cat > create.batch <<END
+$K/root_key.pem root
+nonexist.pem
+$K/kernel_subkey.pem nonexist/subkey
+$K/firmware_data_key.pem fw
+END
+"$F" create --batch create.batch >batch.out 2>/dev/null &&
+	fail "a batch with bad lines succeeded"
+for n in 2 3; do
+	grep -q "^$n: .* FAILED" batch.out || fail "line $n wasn't reported"
+done
+for n in 1:root 4:fw; do
+	grep -q "^${n%%:*}: ${n#*:} OK" batch.out ||
+		fail "line ${n%%:*} wasn't made"
+	[ -s ${n#*:}.vbprivk ] && [ -s ${n#*:}.vbpubk ] ||
+		fail "${n#*:} wasn't written"
+done
+
+# However many of futility's shared threads a batch gets, each keypair is
+# made once, and no two are the same
+for j in 1 4; do
+	"$F" -j $j create --generate 6 --bits 1024 --jobs 3 j$j >j$j.out ||
+		fail "create --generate with -j $j"
+	for n in 1 2 3 4 5 6; do
+		[ "$(grep -c "^$n: j${j}_$n OK" j$j.out)" = 1 ] ||
+			fail "-j $j didn't make j${j}_$n once"
+	done
+	for n in 2 3 4 5 6; do
+		cmp -s j${j}_1.vbprivk j${j}_$n.vbprivk &&
+			fail "-j $j made the same key twice"
+	done
+done
+
+echo "PASS: $(basename "$0")"
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Copyright 2015 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# A request that fails has to fail on its own, leaving "futility serve"
+# running for the next one, and sign --batch --node mustn't pass it around.
+#
+# Usage: serve_test.sh FUTILITY
+
+F=$(realpath "$1")
+T=$(mktemp -d)
+pids=
+trap 'kill $pids 2>/dev/null; rm -rf "$T"' EXIT
+cd "$T" || exit 1
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# Starts a server on the socket $1
+start_server() {
+	"$F" serve "$1" 2>"$1.log" &
+	pids="$pids $!"
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		[ -S "$1" ] && return
+		sleep 0.2
+	done
+	fail "server on $1 didn't start"
+}
+
+"$F" synth --types keys,kernel --bits 1024 --sign-bits 1024 \
+	--kernel-size 64K . >/dev/null 2>&1 || fail "synth"
+K=keys/rsa1024
+
+start_server s1
+"$F" serve --connect s1 sign -s /nonexist kernel-0000.bin bad.bin \
+	2>/dev/null && fail "a missing key was accepted"
+"$F" serve --connect s1 sign -s $K/kernel_data_key.vbprivk \
+	kernel-0000.bin good.bin || fail "the server didn't survive a bad key"
+"$F" verify --publickey $K/kernel_subkey.vbpubk good.bin >/dev/null ||
+	fail "the good request's output doesn't verify"
+
+# A line that fails is reported, and isn't passed from node to node
+start_server s2
+cat > nodes.batch <<END
+-s $K/kernel_data_key.vbprivk kernel-0000.bin n1.bin
+-s /nonexist kernel-0000.bin n2.bin
+-s $K/kernel_data_key.vbprivk kernel-0000.bin n3.bin
+END
+"$F" sign --batch nodes.batch --node s1 --node s2 >nodes.out 2>/dev/null &&
+	fail "a batch with a bad line succeeded"
+grep -q "^2: .* FAILED" nodes.out || fail "the bad line wasn't reported"
+[ "$(grep -c ": .* OK" nodes.out)" = 2 ] || fail "the good lines weren't signed"
+grep -q "dropped" nodes.out && fail "a node was dropped for a bad line"
+for s in s1 s2; do
+	"$F" serve --connect $s sign -s $K/kernel_data_key.vbprivk \
+		kernel-0000.bin $s.bin || fail "$s didn't survive the batch"
+done
+
+echo "PASS: $(basename "$0")"
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Copyright 2015 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Each line of a "futility sign --batch" manifest succeeds or fails on its
+# own, whatever is wrong with the others.
+#
+# Usage: sign_batch_test.sh FUTILITY
+
+F=$(realpath "$1")
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+"$F" synth --types keys,kernel --bits 1024 --sign-bits 1024 \
+	--kernel-size 64K . >/dev/null 2>&1 || fail "synth"
+K=keys/rsa1024
+S="-s $K/kernel_data_key.vbprivk"
+
+# Keys that can't be read, one missing and one not a key at all
+cat > keys.batch <<END
+$S kernel-0000.bin k1.bin
+-s /nonexist kernel-0000.bin k2.bin
+$S kernel-0000.bin k3.bin
+-s kernel-0000.bin kernel-0000.bin k4.bin
+$S -b /nonexist kernel-0000.bin k5.bin
+$S nonexist.bin k6.bin
+$S kernel-0000.bin k7.bin
+END
+"$F" sign --batch keys.batch >keys.out 2>/dev/null &&
+	fail "a batch with bad lines succeeded"
+for n in 2 4 5 6; do
+	grep -q "^$n: .* FAILED" keys.out || fail "line $n wasn't reported"
+done
+for n in 1 3 7; do
+	grep -q "^$n: k$n.bin OK" keys.out || fail "line $n wasn't signed"
+	"$F" verify --publickey $K/kernel_subkey.vbpubk k$n.bin >/dev/null ||
+		fail "k$n.bin doesn't verify"
+done
+grep -q "^Signed 3 of 7 items" keys.out || fail "the summary is wrong"
+
+echo "PASS: $(basename "$0")"